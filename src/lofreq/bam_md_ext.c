@@ -260,10 +260,11 @@ void idaq(bam1_t *b, const char *ref, double **pd, int xe, int xb, int bw)
  *
  * baq_flag: 0 off, 1 on, 2 redo
  * aq_flag: 0 off, 1 on, 2 redo
+ * ws: optional kpa_ext_glocal() workspace to reuse between reads
  */
 int bam_prob_realn_core_ext(bam1_t *b, const char *ref, 
                             int baq_flag, int baq_extended,
-                            int idaq_flag)
+                            int idaq_flag, kpa_ext_ws_t *ws)
 {
 /*#define ORIG_BAQ 1*/
      int k, i, bw, x, y, yb, ye, xb, xe;
@@ -283,6 +284,7 @@ int bam_prob_realn_core_ext(bam1_t *b, const char *ref,
      uint8_t *prec_ai, *prec_ad, *prec_baq;
      int has_ins = 0, has_del = 0;
      double **pd = 0;
+     kpa_ext_ws_t tmp_ws;
 
      /* nothing to do ? */
      if (! baq_flag && ! idaq_flag) {
@@ -369,8 +371,9 @@ int bam_prob_realn_core_ext(bam1_t *b, const char *ref,
          }
     }
 
-    if (has_ins || has_del) {
-         pd = calloc(c->l_qseq+1, sizeof(double*));
+    if (! ws) {
+         kpa_ext_ws_init(& tmp_ws);
+         ws = & tmp_ws;
     }
 
     /* either need to compute BAQ or IDAQ 
@@ -408,7 +411,9 @@ int bam_prob_realn_core_ext(bam1_t *b, const char *ref,
 #ifdef DEBUG
         fprintf(stderr, "processing read %s\n", bam1_qname(b));
 #endif
-        kpa_ext_glocal(r, xe-xb, s, c->l_qseq, qual, &conf, state, q, pd, &bw);
+        /* pd is only needed for IDAQ, i.e. if there are indels */
+        kpa_ext_glocal(ws, r, xe-xb, s, c->l_qseq, qual, &conf, state, q,
+                       (has_ins || has_del) ? &pd : NULL, &bw);
 
         if (baq_flag && ! prec_baq) {
              if (! baq_extended) { // in this block, bq[] is capped by base quality qual[]
@@ -483,9 +488,9 @@ int bam_prob_realn_core_ext(bam1_t *b, const char *ref,
              idaq(b, ref, pd, xe, xb, bw);
         }
         
-        if (pd) {
-             for (i = 0; i<=c->l_qseq; ++i) free(pd[i]);
-             free(pd); 
+        /* pd belongs to ws */
+        if (ws == & tmp_ws) {
+             kpa_ext_ws_free(& tmp_ws);
         }
         free(bq); free(s); free(r); free(q); free(state);
 	}
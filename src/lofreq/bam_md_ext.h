@@ -27,8 +27,11 @@
 #define BAM_MD_EXT_H
 
 
+#include "kprobaln_ext.h"
+
 int bam_prob_realn_core_ext(bam1_t *b, const char *ref, 
-                            int baq_flag, int ext_baq, int idaq_flag);
+                            int baq_flag, int ext_baq, int idaq_flag,
+                            kpa_ext_ws_t *ws);
 
 
 #endif
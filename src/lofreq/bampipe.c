@@ -0,0 +1,322 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Read-transform-write pipeline for BAM rewriting subcommands
+ * (viterbi, indelqual, alnqual). One thread reads batches of
+ * records, num_threads workers transform them and the calling thread
+ * writes them in input order. Batches live in a ring of slots, each
+ * cycling through FREE -> READ -> BUSY -> DONE -> FREE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "bampipe.h"
+
+
+typedef enum {
+     SLOT_FREE = 0,
+     SLOT_READ,
+     SLOT_BUSY,
+     SLOT_DONE
+} slot_state_t;
+
+
+typedef struct {
+     bam1_t *recs[BAMPIPE_BATCH_SIZE];
+     int n;
+     long int seq; /* batch number */
+     slot_state_t state;
+} bampipe_slot_t;
+
+
+typedef struct {
+     pthread_mutex_t lock; /* protects everything below except slot records in use */
+     pthread_cond_t cond; /* signalled on every state change */
+     bampipe_slot_t *slots;
+     int num_slots;
+     long int next_work; /* next batch to be transformed */
+     long int num_batches; /* only valid once eof is set */
+     int eof;
+     int rc;
+     samfile_t *in;
+     bampipe_func_t func;
+     void **wdata;
+} bampipe_t;
+
+
+typedef struct {
+     bampipe_t *pipe;
+     void *wdata;
+} bampipe_worker_arg_t;
+
+
+int
+bampipe_write_bam(const bam1_t *b, void *out)
+{
+     return bam_write1((bamFile)out, b);
+}
+/* bampipe_write_bam() */
+
+
+int
+bampipe_write_sam(const bam1_t *b, void *out)
+{
+     return samwrite((samfile_t *)out, b);
+}
+/* bampipe_write_sam() */
+
+
+static void *
+bampipe_reader(void *arg)
+{
+     bampipe_t *p = (bampipe_t *)arg;
+     long int seq;
+
+     for (seq = 0; ; seq++) {
+          bampipe_slot_t *s = & p->slots[seq % p->num_slots];
+          int n = 0;
+
+          pthread_mutex_lock(& p->lock);
+          while (s->state != SLOT_FREE && ! p->rc) {
+               pthread_cond_wait(& p->cond, & p->lock);
+          }
+          if (p->rc) {
+               p->eof = 1;
+               p->num_batches = seq;
+               pthread_cond_broadcast(& p->cond);
+               pthread_mutex_unlock(& p->lock);
+               break;
+          }
+          pthread_mutex_unlock(& p->lock);
+
+          /* slot is ours until marked as read */
+          while (n < BAMPIPE_BATCH_SIZE) {
+               if (! s->recs[n]) {
+                    s->recs[n] = bam_init1();
+               }
+               if (samread(p->in, s->recs[n]) < 0) {
+                    break;
+               }
+               n++;
+          }
+
+          pthread_mutex_lock(& p->lock);
+          if (n) {
+               s->n = n;
+               s->seq = seq;
+               s->state = SLOT_READ;
+          }
+          if (n < BAMPIPE_BATCH_SIZE) {
+               p->eof = 1;
+               p->num_batches = n ? seq+1 : seq;
+          }
+          pthread_cond_broadcast(& p->cond);
+          pthread_mutex_unlock(& p->lock);
+          if (n < BAMPIPE_BATCH_SIZE) {
+               break;
+          }
+     }
+     return NULL;
+}
+/* bampipe_reader() */
+
+
+static void *
+bampipe_worker(void *arg)
+{
+     bampipe_worker_arg_t *wa = (bampipe_worker_arg_t *)arg;
+     bampipe_t *p = wa->pipe;
+
+     while (1) {
+          bampipe_slot_t *s;
+          int i, rc = 0;
+
+          pthread_mutex_lock(& p->lock);
+          while (1) {
+               s = & p->slots[p->next_work % p->num_slots];
+               if (p->rc || (p->eof && p->next_work >= p->num_batches)) {
+                    s = NULL;
+                    break;
+               }
+               if (s->state == SLOT_READ && s->seq == p->next_work) {
+                    break;
+               }
+               pthread_cond_wait(& p->cond, & p->lock);
+          }
+          if (! s) {
+               pthread_mutex_unlock(& p->lock);
+               break;
+          }
+          s->state = SLOT_BUSY;
+          p->next_work++;
+          pthread_mutex_unlock(& p->lock);
+
+          for (i = 0; i < s->n && ! rc; i++) {
+               rc = p->func(s->recs[i], wa->wdata);
+          }
+
+          pthread_mutex_lock(& p->lock);
+          s->state = SLOT_DONE;
+          if (rc) {
+               p->rc = rc;
+          }
+          pthread_cond_broadcast(& p->cond);
+          pthread_mutex_unlock(& p->lock);
+     }
+     return NULL;
+}
+/* bampipe_worker() */
+
+
+/* reads all records from in, applies func to each and writes them
+ * with write_func to out in the original order. with num_threads > 1
+ * func is run in num_threads threads, each using its own entry in
+ * wdata (which must have num_threads entries), and reading happens in
+ * a separate thread. otherwise only wdata[0] is used. func and
+ * write_func are never called concurrently for the same record.
+ * returns the number of records processed or -1 on error.
+ */
+long int
+bampipe_run(samfile_t *in, bampipe_write_t write_func, void *out,
+            bampipe_func_t func, void **wdata, int num_threads)
+{
+     bampipe_t p;
+     pthread_t reader;
+     pthread_t *workers;
+     bampipe_worker_arg_t *wargs;
+     long int seq;
+     long int num_recs = 0;
+     int i, j;
+
+     if (num_threads <= 1) {
+          bam1_t *b = bam_init1();
+          int rc = 0;
+          while (samread(in, b) >= 0) {
+               if ((rc = func(b, wdata[0]))) {
+                    break;
+               }
+               if (write_func(b, out) < 0) {
+                    LOG_ERROR("%s\n", "Couldn't write BAM record");
+                    rc = -1;
+                    break;
+               }
+               num_recs++;
+          }
+          bam_destroy1(b);
+          return rc ? -1 : num_recs;
+     }
+
+     memset(& p, 0, sizeof(bampipe_t));
+     pthread_mutex_init(& p.lock, NULL);
+     pthread_cond_init(& p.cond, NULL);
+     p.num_slots = 2*num_threads + 2;
+     p.in = in;
+     p.func = func;
+     p.wdata = wdata;
+     if (NULL == (p.slots = calloc(p.num_slots, sizeof(bampipe_slot_t)))
+         ||
+         NULL == (workers = malloc(num_threads * sizeof(pthread_t)))
+         ||
+         NULL == (wargs = malloc(num_threads * sizeof(bampipe_worker_arg_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     if (pthread_create(& reader, NULL, bampipe_reader, & p)) {
+          LOG_FATAL("%s\n", "Couldn't create reader thread");
+          exit(1);
+     }
+     for (i = 0; i < num_threads; i++) {
+          wargs[i].pipe = & p;
+          wargs[i].wdata = wdata[i];
+          if (pthread_create(& workers[i], NULL, bampipe_worker, & wargs[i])) {
+               LOG_FATAL("Couldn't create thread #%d\n", i+1);
+               exit(1);
+          }
+     }
+
+     /* write in order */
+     for (seq = 0; ; seq++) {
+          bampipe_slot_t *s = & p.slots[seq % p.num_slots];
+          int rc = 0;
+
+          pthread_mutex_lock(& p.lock);
+          while (! p.rc && ! (s->state == SLOT_DONE && s->seq == seq)
+                 && ! (p.eof && seq >= p.num_batches)) {
+               pthread_cond_wait(& p.cond, & p.lock);
+          }
+          if (p.rc || s->state != SLOT_DONE || s->seq != seq) {
+               pthread_mutex_unlock(& p.lock);
+               break;
+          }
+          pthread_mutex_unlock(& p.lock);
+
+          for (j = 0; j < s->n; j++) {
+               if (write_func(s->recs[j], out) < 0) {
+                    LOG_ERROR("%s\n", "Couldn't write BAM record");
+                    rc = -1;
+                    break;
+               }
+          }
+          num_recs += s->n;
+
+          pthread_mutex_lock(& p.lock);
+          s->state = SLOT_FREE;
+          if (rc) {
+               p.rc = rc;
+          }
+          pthread_cond_broadcast(& p.cond);
+          pthread_mutex_unlock(& p.lock);
+     }
+
+     pthread_join(reader, NULL);
+     for (i = 0; i < num_threads; i++) {
+          pthread_join(workers[i], NULL);
+     }
+
+     for (i = 0; i < p.num_slots; i++) {
+          for (j = 0; j < BAMPIPE_BATCH_SIZE; j++) {
+               if (p.slots[i].recs[j]) {
+                    bam_destroy1(p.slots[i].recs[j]);
+               }
+          }
+     }
+     free(p.slots);
+     free(workers);
+     free(wargs);
+     pthread_cond_destroy(& p.cond);
+     pthread_mutex_destroy(& p.lock);
+
+     return p.rc ? -1 : num_recs;
+}
+/* bampipe_run() */
@@ -0,0 +1,55 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef BAMPIPE_H
+#define BAMPIPE_H
+
+#include "sam.h"
+
+/* records per batch handed to a worker */
+#define BAMPIPE_BATCH_SIZE 512
+
+/* transforms one record in place. wdata is the worker's entry of the
+ * wdata array given to bampipe_run(). returns non-zero on error,
+ * which stops the pipeline */
+typedef int (*bampipe_func_t)(bam1_t *b, void *wdata);
+
+/* writes one record to out. returns <0 on error */
+typedef int (*bampipe_write_t)(const bam1_t *b, void *out);
+
+int
+bampipe_write_bam(const bam1_t *b, void *out);
+
+int
+bampipe_write_sam(const bam1_t *b, void *out);
+
+long int
+bampipe_run(samfile_t *in, bampipe_write_t write_func, void *out,
+            bampipe_func_t func, void **wdata, int num_threads);
+
+#endif
@@ -0,0 +1,417 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+/* Per-target read statistics. See bamstats.h. Formerly the body of
+ * lofreq bamstats (lofreq_bamstats.c), which now only drives it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "log.h"
+#include "utils.h"
+#include "defaults.h"
+#include "bamstats.h"
+
+/* from bedidx.c */
+int bed_tidx_overlap(const void *_t, int tid, int beg, int end);
+
+
+/* initialize preallocated conf with defaults */
+void
+bamstats_conf_init(bamstats_conf_t *conf)
+{
+     memset(conf, 0, sizeof(bamstats_conf_t));
+     conf->min_mq = DEFAULT_MIN_MQ;
+     conf->min_bq = DEFAULT_MIN_BQ;
+     /* will skip read if any of the following is set */
+     conf->samflags_off = 0;
+     conf->samflags_off |= 0x4; /* segment unmapped */
+     conf->samflags_off |= 0x100; /* secondary alignment */
+     conf->samflags_off |= 0x200; /* not passing quality controls */
+     conf->samflags_off |= 0x400; /* PCR or optical duplicate */
+     conf->samflags_off |= 0x800; /* supplementary alignment */
+#ifdef USE_ALNERRPROF
+     conf->type = BAMSTATS_ALNERRPROF;
+#else
+     conf->type = BAMSTATS_OPCAT;
+#endif
+}
+/* bamstats_conf_init() */
+
+
+/* adopted from sam_view.c:__g_skip_aln */
+static inline int
+skip_aln(const bam1_t *b, const bamstats_conf_t *conf)
+{
+     if (conf->bed_tidx && b->core.tid >= 0 && !bed_tidx_overlap(conf->bed_tidx, b->core.tid, b->core.pos, bam_calend(&b->core, bam1_cigar(b)))) {
+          return 1;
+     }
+     if (b->core.qual < conf->min_mq) {
+          return 2;
+     }
+     if (((b->core.flag & conf->samflags_on) != conf->samflags_on) || (b->core.flag & conf->samflags_off)) {
+          return 3;
+     }
+     return 0;
+}
+/* skip_aln() */
+
+
+bamstats_t *
+bamstats_new(const bamstats_conf_t *conf, refcache_t *refcache)
+{
+     bamstats_t *s;
+
+     if (NULL == (s = calloc(1, sizeof(bamstats_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     memcpy(& s->conf, conf, sizeof(bamstats_conf_t));
+     s->refcache = refcache;
+     s->ref_tid = -1;
+     pthread_mutex_init(& s->lock, NULL);
+     return s;
+}
+/* bamstats_new() */
+
+
+static void
+bamstats_set_targets(bamstats_t *s, const int num_targets, char * const *target_names)
+{
+     int i;
+
+     s->num_targets = num_targets;
+     s->target_names = calloc(num_targets, sizeof(char *));
+     s->targets = calloc(num_targets, sizeof(bamstats_target_t *));
+     if (! s->target_names || ! s->targets) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<num_targets; i++) {
+          s->target_names[i] = strdup(target_names[i]);
+     }
+}
+/* bamstats_set_targets() */
+
+
+static bamstats_target_t *
+bamstats_target(bamstats_t *s, const int tid)
+{
+     bamstats_target_t *t = s->targets[tid];
+
+     if (t) {
+          return t;
+     }
+     if (NULL == (t = calloc(1, sizeof(bamstats_target_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+#ifdef USE_ALNERRPROF
+     t->alnerrprof = calloc(MAX_READ_LEN, sizeof(double));
+     t->alnerrprof_usedpos = calloc(MAX_READ_LEN, sizeof(unsigned long int));
+     if (! t->alnerrprof || ! t->alnerrprof_usedpos) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+#endif
+     s->targets[tid] = t;
+     return t;
+}
+/* bamstats_target() */
+
+
+/* makes sure cat_counts of t can be indexed with count */
+static void
+cat_counts_reserve(bamstats_target_t *t, const int count)
+{
+     int i;
+     int new_size;
+
+     if (count < t->cat_counts_size) {
+          return;
+     }
+     new_size = t->cat_counts_size ? t->cat_counts_size : 256;
+     while (new_size <= count) {
+          new_size *= 2;
+     }
+     for (i=0; i<NUM_OP_CATS; i++) {
+          if (NULL == (t->cat_counts[i] = realloc(t->cat_counts[i], new_size * sizeof(unsigned long int)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          memset(t->cat_counts[i] + t->cat_counts_size, 0,
+                 (new_size - t->cat_counts_size) * sizeof(unsigned long int));
+     }
+     t->cat_counts_size = new_size;
+}
+/* cat_counts_reserve() */
+
+
+static void
+bamstats_target_free(bamstats_target_t *t)
+{
+     int i;
+
+     if (! t) {
+          return;
+     }
+     for (i=0; i<NUM_OP_CATS; i++) {
+          free(t->cat_counts[i]);
+     }
+#ifdef USE_ALNERRPROF
+     free(t->alnerrprof);
+     free(t->alnerrprof_usedpos);
+#endif
+     free(t);
+}
+/* bamstats_target_free() */
+
+
+/**
+ * @brief Counts read b (from file with header h). Reads without
+ * target are ignored, as are reads too long for the alignment error
+ * profile (with a warning). Returns non-zero on fatal errors
+ * (reference missing).
+ */
+int
+bamstats_add(bamstats_t *s, const bam_header_t *h, const bam1_t *b)
+{
+     bamstats_target_t *t;
+     const int tid = b->core.tid;
+     int counts[NUM_OP_CATS];
+     int i;
+
+     if (tid < 0) {
+          return 0;
+     }
+     if (! s->target_names) {
+          bamstats_set_targets(s, h->n_targets, h->target_name);
+     }
+     t = bamstats_target(s, tid);
+
+     if (skip_aln(b, & s->conf)) {
+          t->num_ign_reads += 1;
+          return 0;
+     }
+     if (s->conf.type != BAMSTATS_OPCAT && b->core.l_qseq >= MAX_READ_LEN) {
+          /* profile has one entry per read position */
+          if (! s->long_read_warned) {
+               LOG_WARN("Ignoring reads of length %d or longer, e.g. %s\n",
+                        MAX_READ_LEN, bam1_qname(b));
+               s->long_read_warned = 1;
+          }
+          t->num_ign_reads += 1;
+          return 0;
+     }
+     t->num_good_reads += 1;
+
+     if (b->core.l_qseq > t->max_obs_read_len) {
+          t->max_obs_read_len = b->core.l_qseq;
+     }
+
+     if (s->ref_tid != tid) {
+          int ref_len = -1;
+          if (s->ref) {
+               refcache_release(s->refcache, s->target_names[s->ref_tid]);
+               s->ref = NULL;
+          }
+          if (! s->refcache ||
+              NULL == (s->ref = refcache_get(s->refcache, s->target_names[tid], &ref_len))) {
+               LOG_FATAL("Couldn't fetch sequence '%s'.\n", s->target_names[tid]);
+               return 1;
+          }
+          s->ref_tid = tid;
+     }
+
+     if (s->conf.type == BAMSTATS_OPCAT) {
+          /* target is only needed for the source quality ignore list */
+          if (-1 == count_cigar_ops(counts, NULL, b, s->ref, s->conf.min_bq, NULL)) {
+               LOG_WARN("count_cigar_ops failed on read %s. ignoring\n", bam1_qname(b));
+               return 0;
+          }
+          for (i=0; i<NUM_OP_CATS; i++) {
+               cat_counts_reserve(t, counts[i]);
+               t->cat_counts[i][counts[i]] += 1;
+          }
+          if (0 == counts[OP_MATCH]) {
+               LOG_DEBUG("Got read with zero matches after filtering with min_bq %d: name:%s\n",
+                         s->conf.min_bq, bam1_qname(b));
+               t->num_zero_matches += 1;
+          }
+     } else {
+#ifdef USE_ALNERRPROF
+          calc_read_alnerrprof(t->alnerrprof, t->alnerrprof_usedpos, b, s->ref);
+#endif
+     }
+     return 0;
+}
+/* bamstats_add() */
+
+
+/**
+ * @brief Adds all counts of src to dst, leaving src empty. Thread
+ * safe with respect to dst, i.e. threads can merge their own tables
+ * into a shared one. Both need to come from files with the same
+ * targets.
+ */
+void
+bamstats_merge(bamstats_t *dst, bamstats_t *src)
+{
+     int tid, i, j;
+
+     if (! src->target_names) {
+          return;
+     }
+     pthread_mutex_lock(& dst->lock);
+     if (! dst->target_names) {
+          bamstats_set_targets(dst, src->num_targets, src->target_names);
+     }
+     assert(dst->num_targets == src->num_targets);
+     for (tid=0; tid<src->num_targets; tid++) {
+          bamstats_target_t *st = src->targets[tid];
+          bamstats_target_t *dt = dst->targets[tid];
+          if (! st) {
+               continue;
+          }
+          if (! dt) {
+               dst->targets[tid] = st;
+               src->targets[tid] = NULL;
+               continue;
+          }
+          dt->num_good_reads += st->num_good_reads;
+          dt->num_ign_reads += st->num_ign_reads;
+          dt->num_zero_matches += st->num_zero_matches;
+          if (st->max_obs_read_len > dt->max_obs_read_len) {
+               dt->max_obs_read_len = st->max_obs_read_len;
+          }
+          if (st->cat_counts_size) {
+               cat_counts_reserve(dt, st->cat_counts_size-1);
+          }
+          for (i=0; i<NUM_OP_CATS; i++) {
+               for (j=0; j<st->cat_counts_size; j++) {
+                    dt->cat_counts[i][j] += st->cat_counts[i][j];
+               }
+          }
+#ifdef USE_ALNERRPROF
+          for (j=0; j<MAX_READ_LEN; j++) {
+               dt->alnerrprof[j] += st->alnerrprof[j];
+               dt->alnerrprof_usedpos[j] += st->alnerrprof_usedpos[j];
+          }
+#endif
+          bamstats_target_free(st);
+          src->targets[tid] = NULL;
+     }
+     pthread_mutex_unlock(& dst->lock);
+}
+/* bamstats_merge() */
+
+
+static void
+write_cat_stats(const char *target_name, const bamstats_target_t *t, FILE *out)
+{
+     int i, j;
+     fprintf(out, "# Listing of proportions of reads with certain number of BAM operations (op)\n");
+     fprintf(out, "# proportions are in scientific notation or missing altogether if no reads for that count were found\n");
+     fprintf(out, "# chrom\top-category\top-count\tread-proportion\n");
+
+     for (i=0; i<NUM_OP_CATS; i++) {
+          unsigned long int cat_sum = 0;
+          for (j=0; j<t->cat_counts_size; j++) {
+               if (t->cat_counts[i][j]) {
+                    fprintf(out, "%s\t%s\t%d\t%g\n",
+                            target_name, op_cat_str[i], j, t->cat_counts[i][j]/(double)t->num_good_reads);
+                    cat_sum += t->cat_counts[i][j];
+               }
+          }
+          /* reads on which count_cigar_ops() failed are missing */
+          if (cat_sum != t->num_good_reads) {
+               LOG_FIXME("fail cat_sum=%lu != num_reads=%lu\n", cat_sum, t->num_good_reads);
+          }
+     }
+}
+/* write_cat_stats() */
+
+
+/* writes stats for all targets with reads used for counting, in
+ * header order */
+void
+bamstats_write(const bamstats_t *s, FILE *out)
+{
+     int tid;
+
+     for (tid=0; tid<s->num_targets; tid++) {
+          const bamstats_target_t *t = s->targets[tid];
+          if (! t || ! t->num_good_reads) {
+               continue;
+          }
+          fprintf(out, "# Reads ignored for counting (due to bed/mq filtering): %lu\n", t->num_ign_reads);
+          fprintf(out, "# Reads used for counting: %lu\n", t->num_good_reads);
+          if (s->conf.type == BAMSTATS_OPCAT) {
+               fprintf(out, "# Reads with zero matches (after bq filtering): %lu\n", t->num_zero_matches);
+               write_cat_stats(s->target_names[tid], t, out);
+          } else {
+#ifdef USE_ALNERRPROF
+               write_alnerrprof_stats(s->target_names[tid], t->alnerrprof_usedpos,
+                                      t->alnerrprof, t->max_obs_read_len, out);
+#endif
+          }
+     }
+}
+/* bamstats_write() */
+
+
+void
+bamstats_free(bamstats_t *s)
+{
+     int tid;
+
+     if (! s) {
+          return;
+     }
+     if (s->ref) {
+          refcache_release(s->refcache, s->target_names[s->ref_tid]);
+     }
+     for (tid=0; tid<s->num_targets; tid++) {
+          bamstats_target_free(s->targets[tid]);
+          free(s->target_names[tid]);
+     }
+     free(s->targets);
+     free(s->target_names);
+     pthread_mutex_destroy(& s->lock);
+     free(s);
+}
+/* bamstats_free() */
@@ -0,0 +1,104 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef BAMSTATS_H
+#define BAMSTATS_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "sam.h"
+#include "samutils.h"
+#include "refcache.h"
+
+/* Per-target read statistics (cigar op categories or alignment error
+ * profile), as reported by lofreq bamstats. Counts are kept in
+ * bamstats_t tables, one per thread, which get merged at the end.
+ * Used by lofreq bamstats and as side pass by lofreq call
+ * --bamstats.
+ */
+
+#define BAMSTATS_ALNERRPROF 0
+#define BAMSTATS_OPCAT 1
+
+typedef struct {
+     int min_mq;
+     int min_bq;
+     int samflags_on; /* reads need all of these */
+     int samflags_off; /* reads must have none of these */
+     const void *bed_tidx; /* optional bed resolved against header (see bedidx.c). not owned */
+     int type; /* BAMSTATS_OPCAT or BAMSTATS_ALNERRPROF */
+} bamstats_conf_t;
+
+
+typedef struct {
+     unsigned long int num_good_reads;
+     unsigned long int num_ign_reads;
+     unsigned long int num_zero_matches;
+     unsigned long int *cat_counts[NUM_OP_CATS]; /* index: number of ops of this category in read */
+     int cat_counts_size;
+     int max_obs_read_len;
+#ifdef USE_ALNERRPROF
+     double *alnerrprof; /* MAX_READ_LEN */
+     unsigned long int *alnerrprof_usedpos; /* MAX_READ_LEN */
+#endif
+} bamstats_target_t;
+
+
+typedef struct {
+     bamstats_conf_t conf;
+     int num_targets;
+     char **target_names; /* copied from header on first use */
+     bamstats_target_t **targets; /* index: tid. allocated on first read */
+     refcache_t *refcache; /* not owned. only needed for bamstats_add() */
+     int ref_tid; /* tid of ref */
+     const char *ref; /* acquired from refcache */
+     int long_read_warned; /* see bamstats_add() */
+     pthread_mutex_t lock; /* protects merges into this */
+} bamstats_t;
+
+
+void
+bamstats_conf_init(bamstats_conf_t *conf);
+
+bamstats_t *
+bamstats_new(const bamstats_conf_t *conf, refcache_t *refcache);
+
+int
+bamstats_add(bamstats_t *s, const bam_header_t *h, const bam1_t *b);
+
+void
+bamstats_merge(bamstats_t *dst, bamstats_t *src);
+
+void
+bamstats_write(const bamstats_t *s, FILE *out);
+
+void
+bamstats_free(bamstats_t *s);
+
+#endif
@@ -44,8 +44,16 @@ typedef struct {
     int n, m;
     uint64_t *a;
     int *idx;
+    int n_mrg;
+    uint32_t *mrg_beg, *mrg_end; // merged overlapping regions, sorted. see bed_merge()
 } bed_reglist_t;
 
+// regions resolved against target ids of a BAM header. see bed_tidx_init()
+typedef struct {
+    int n;
+    const bed_reglist_t **lists; // NULL for targets without regions
+} bed_tidx_t;
+
 #include "htslib/khash.h"
 KHASH_MAP_INIT_STR(reg, bed_reglist_t)
 
@@ -81,6 +89,30 @@ int *bed_index_core(int n, uint64_t *a, int *n_idx)
     return idx;
 }
 
+/* merges overlapping regions of sorted p->a into mrg_beg/mrg_end.
+ * touching regions are kept separate, so that answers are exactly the
+ * same as for bed_overlap_core(). begs and ends of the result are
+ * both sorted, which allows binary search */
+static int bed_merge(bed_reglist_t *p)
+{
+    int i, n = 0;
+    free(p->mrg_beg); free(p->mrg_end);
+    p->mrg_beg = malloc((p->n>0? p->n : 1) * sizeof(uint32_t));
+    p->mrg_end = malloc((p->n>0? p->n : 1) * sizeof(uint32_t));
+    if (NULL == p->mrg_beg || NULL == p->mrg_end) return -1;
+    for (i = 0; i < p->n; ++i) {
+        uint32_t beg = p->a[i]>>32, end = (uint32_t)p->a[i];
+        if (n > 0 && beg < p->mrg_end[n-1]) {
+            if (end > p->mrg_end[n-1]) p->mrg_end[n-1] = end;
+        } else {
+            p->mrg_beg[n] = beg; p->mrg_end[n] = end;
+            ++n;
+        }
+    }
+    p->n_mrg = n;
+    return 0;
+}
+
 void bed_index(void *_h)
 {
     reghash_t *h = (reghash_t*)_h;
@@ -91,6 +123,11 @@ void bed_index(void *_h)
             if (p->idx) free(p->idx);
             ks_introsort(uint64_t, p->n, p->a);
             p->idx = bed_index_core(p->n, p->a, &p->m);
+            if (bed_merge(p)) {
+                fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                        __FILE__, __FUNCTION__, __LINE__);
+                exit(1);
+            }
         }
     }
 }
@@ -125,6 +162,115 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end)
     return bed_overlap_core(&kh_val(h, k), beg, end);
 }
 
+/* resolves regions against the n_targets target names of a BAM
+ * header, so that they can be queried by tid without hashing names.
+ * the result points into h, i.e. h needs to be indexed and has to
+ * outlive it. read-only after that, i.e. can be shared between
+ * threads. free with bed_tidx_destroy() */
+void *bed_tidx_init(const void *_h, int n_targets, char * const *target_names)
+{
+    const reghash_t *h = (const reghash_t*)_h;
+    bed_tidx_t *t;
+    int i;
+    if (!h) return NULL;
+    t = calloc(1, sizeof(bed_tidx_t));
+    if (NULL == t) return NULL;
+    t->n = n_targets;
+    t->lists = calloc(n_targets > 0? n_targets : 1, sizeof(bed_reglist_t*));
+    if (NULL == t->lists) { free(t); return NULL; }
+    for (i = 0; i < n_targets; ++i) {
+        khint_t k = kh_get(reg, h, target_names[i]);
+        if (k != kh_end(h) && kh_val(h, k).n_mrg > 0)
+            t->lists[i] = &kh_val(h, k);
+    }
+    return t;
+}
+
+void bed_tidx_destroy(void *_t)
+{
+    bed_tidx_t *t = (bed_tidx_t*)_t;
+    if (!t) return;
+    free(t->lists);
+    free(t);
+}
+
+// index of first merged region with end > pos or p->n_mrg if none
+static inline int bed_tidx_search(const bed_reglist_t *p, int pos)
+{
+    int lo = 0, hi = p->n_mrg;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((int)p->mrg_end[mid] > pos) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/* same as bed_overlap() but for tid as resolved by bed_tidx_init() */
+int bed_tidx_overlap(const void *_t, int tid, int beg, int end)
+{
+    const bed_tidx_t *t = (const bed_tidx_t*)_t;
+    const bed_reglist_t *p;
+    int i;
+    if (!t || tid < 0 || tid >= t->n || NULL == (p = t->lists[tid])) return 0;
+    i = bed_tidx_search(p, beg);
+    return i < p->n_mrg && (int)p->mrg_beg[i] < end;
+}
+
+/* finds the first (merged) region on tid which ends after pos, i.e.
+ * which contains pos or comes after it, and stores its coordinates
+ * in beg and end. returns 1 if found, 0 otherwise */
+int bed_tidx_next(const void *_t, int tid, int pos, int *beg, int *end)
+{
+    const bed_tidx_t *t = (const bed_tidx_t*)_t;
+    const bed_reglist_t *p;
+    int i;
+    if (!t || tid < 0 || tid >= t->n || NULL == (p = t->lists[tid])) return 0;
+    i = bed_tidx_search(p, pos);
+    if (i == p->n_mrg) return 0;
+    *beg = p->mrg_beg[i];
+    *end = p->mrg_end[i];
+    return 1;
+}
+
+void *bed_init(void)
+{
+    return kh_init(reg);
+}
+
+/* add region [beg, end) for ref. call bed_index() once done adding.
+ * returns non-zero on error */
+int bed_add(void *_h, const char *ref, unsigned int beg, unsigned int end)
+{
+    reghash_t *h = (reghash_t*)_h;
+    khint_t k;
+    bed_reglist_t *p;
+
+    // Put reg in the hash table if not already there
+    k = kh_get(reg, h, ref);
+    if (k == kh_end(h)) { // absent from the hash table
+        int ret;
+        char *s = strdup(ref);
+        if (NULL == s) return -1;
+        k = kh_put(reg, h, s, &ret);
+        if (-1 == ret) {
+            free(s);
+            return -1;
+        }
+        memset(&kh_val(h, k), 0, sizeof(bed_reglist_t));
+    }
+    p = &kh_val(h, k);
+
+    // Add begin,end to the list
+    if (p->n == p->m) {
+        p->m = p->m? p->m<<1 : 4;
+        p->a = realloc(p->a, p->m * 8);
+        if (NULL == p->a) return -1;
+    }
+    p->a[p->n++] = (uint64_t)beg<<32 | end;
+    return 0;
+}
+
 /* "BED" file reader, which actually reads two different formats.
 
    BED files contain between three and nine fields per line, of which
@@ -175,8 +321,6 @@ void *bed_read(const char *fn)
         char *ref = str.s, *ref_end;
         unsigned int beg = 0, end = 0;
         int num = 0;
-        khint_t k;
-        bed_reglist_t *p;
 
         line++;
         while (*ref && isspace(*ref)) ref++;
@@ -202,28 +346,7 @@ void *bed_read(const char *fn)
             goto fail_no_msg;
         }
 
-        // Put reg in the hash table if not already there
-        k = kh_get(reg, h, ref);
-        if (k == kh_end(h)) { // absent from the hash table
-            int ret;
-            char *s = strdup(ref);
-            if (NULL == s) goto fail;
-            k = kh_put(reg, h, s, &ret);
-            if (-1 == ret) {
-                free(s);
-                goto fail;
-            }
-            memset(&kh_val(h, k), 0, sizeof(bed_reglist_t));
-        }
-        p = &kh_val(h, k);
-
-        // Add begin,end to the list
-        if (p->n == p->m) {
-            p->m = p->m? p->m<<1 : 4;
-            p->a = realloc(p->a, p->m * 8);
-            if (NULL == p->a) goto fail;
-        }
-        p->a[p->n++] = (uint64_t)beg<<32 | end;
+        if (bed_add(h, ref, beg, end)) goto fail;
     }
     // FIXME: Need to check for errors in ks_getuntil.  At the moment it
     // doesn't look like it can return one.  Possibly use gzgets instead?
@@ -251,6 +374,8 @@ void bed_destroy(void *_h)
         if (kh_exist(h, k)) {
             free(kh_val(h, k).a);
             free(kh_val(h, k).idx);
+            free(kh_val(h, k).mrg_beg);
+            free(kh_val(h, k).mrg_end);
             free((char*)kh_key(h, k));
         }
     }
@@ -0,0 +1,316 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+/* Work estimates from the BAM index for bin planning. See binplan.h.
+ *
+ * The BAI file is parsed directly, since htslib doesn't expose bins
+ * and chunks. For each bin, the bytes covered by its chunks are
+ * spread evenly across the windows the bin spans; most reads are
+ * in leaf bins, i.e. attributed to their own window. See the SAM
+ * specification for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "log.h"
+#include "utils.h"
+#include "defaults.h"
+#include "binplan.h"
+
+/* voffset deltas within one BGZF block are uncompressed bytes. scale
+ * them to roughly compressed bytes, i.e. the unit of deltas across
+ * blocks */
+#define BINPLAN_COMPRESSION_RATIO 3.0
+/* bin holding per-target metadata instead of reads */
+#define BAI_META_BIN 37450
+#define BAI_NUM_LEVELS 5
+
+
+static void *
+binplan_alloc(size_t n, size_t size)
+{
+     void *p;
+     if (NULL == (p = calloc(n ? n : 1, size))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     return p;
+}
+/* binplan_alloc() */
+
+
+static double
+voff_bytes(const uint64_t beg, const uint64_t end)
+{
+     if ((end>>16) > (beg>>16)) {
+          return (double)((end>>16) - (beg>>16));
+     } else if (end > beg) {
+          return ((end&0xffff) - (beg&0xffff)) / BINPLAN_COMPRESSION_RATIO;
+     }
+     return 0.0;
+}
+/* voff_bytes() */
+
+
+/* first window and number of windows covered by bin */
+static int
+bin_windows(const uint32_t bin, int *first, int *num)
+{
+     int level;
+     uint32_t level_offset = 0;
+
+     for (level=0; level<=BAI_NUM_LEVELS; level++) {
+          uint32_t level_bins = 1u << (3*level);
+          if (bin < level_offset + level_bins) {
+               *num = 1 << (3*(BAI_NUM_LEVELS-level));
+               *first = (bin - level_offset) * (*num);
+               return 0;
+          }
+          level_offset += level_bins;
+     }
+     return -1;
+}
+/* bin_windows() */
+
+
+/* reads bai into p. returns non-zero on error or if the index isn't
+ * a BAI file for h */
+static int
+binplan_read_bai(binplan_t *p, FILE *fh, const bam_header_t *h)
+{
+     char magic[4];
+     int32_t n_ref;
+     int tid;
+
+     if (1 != fread(magic, 4, 1, fh) || 0 != memcmp(magic, "BAI\1", 4)) {
+          return -1;
+     }
+     if (1 != fread(& n_ref, sizeof(int32_t), 1, fh) || n_ref != h->n_targets) {
+          return -1;
+     }
+     for (tid=0; tid<n_ref; tid++) {
+          int32_t n_bin, n_intv;
+          int i;
+
+          if (1 != fread(& n_bin, sizeof(int32_t), 1, fh)) {
+               return -1;
+          }
+          for (i=0; i<n_bin; i++) {
+               uint32_t bin;
+               int32_t n_chunk;
+               double bytes = 0.0;
+               int first, num, j;
+
+               if (1 != fread(& bin, sizeof(uint32_t), 1, fh)
+                   || 1 != fread(& n_chunk, sizeof(int32_t), 1, fh)) {
+                    return -1;
+               }
+               for (j=0; j<n_chunk; j++) {
+                    uint64_t chunk[2];
+                    if (2 != fread(chunk, sizeof(uint64_t), 2, fh)) {
+                         return -1;
+                    }
+                    bytes += voff_bytes(chunk[0], chunk[1]);
+               }
+               if (bin == BAI_META_BIN || bin_windows(bin, &first, &num)) {
+                    continue;
+               }
+               /* spread across those windows of bin that are on target */
+               if (first >= p->n_windows[tid]) {
+                    continue;
+               }
+               if (first + num > p->n_windows[tid]) {
+                    num = p->n_windows[tid] - first;
+               }
+               for (j=first; j<first+num; j++) {
+                    p->work[tid][j] += bytes / num;
+               }
+          }
+          /* linear index not needed */
+          if (1 != fread(& n_intv, sizeof(int32_t), 1, fh)
+              || fseek(fh, (long) n_intv * sizeof(uint64_t), SEEK_CUR)) {
+               return -1;
+          }
+     }
+     return 0;
+}
+/* binplan_read_bai() */
+
+
+/* work proportional to length: one unit per base */
+static void
+binplan_set_length_work(binplan_t *p, const bam_header_t *h)
+{
+     int tid, w;
+
+     for (tid=0; tid<p->n_targets; tid++) {
+          for (w=0; w<p->n_windows[tid]; w++) {
+               int end = MIN((w+1)*BINPLAN_WINDOW, (int) h->target_len[tid]);
+               p->work[tid][w] = end - w*BINPLAN_WINDOW;
+          }
+     }
+     p->from_index = 0;
+}
+/* binplan_set_length_work() */
+
+
+/**
+ * @brief Loads work estimates for bam_file (with header h) from its
+ * BAI index (bam_file.bai or with .bam replaced by .bai). Falls back
+ * to work proportional to length if there is no such index (e.g. for
+ * CRAM or CSI) or it has no reads.
+ */
+binplan_t *
+binplan_load(const char *bam_file, const bam_header_t *h)
+{
+     binplan_t *p = binplan_alloc(1, sizeof(binplan_t));
+     char *fn = binplan_alloc(strlen(bam_file) + 5, 1);
+     FILE *fh = NULL;
+     double total = 0.0;
+     int tid, w;
+
+     p->n_targets = h->n_targets;
+     p->n_windows = binplan_alloc(p->n_targets, sizeof(int));
+     p->work = binplan_alloc(p->n_targets, sizeof(double *));
+     p->len = binplan_alloc(p->n_targets, sizeof(int));
+     for (tid=0; tid<p->n_targets; tid++) {
+          p->len[tid] = h->target_len[tid];
+          p->n_windows[tid] = (h->target_len[tid] + BINPLAN_WINDOW - 1) / BINPLAN_WINDOW;
+          p->work[tid] = binplan_alloc(p->n_windows[tid], sizeof(double));
+     }
+
+     sprintf(fn, "%s.bai", bam_file);
+     if (NULL == (fh = fopen(fn, "rb"))) {
+          size_t len = strlen(bam_file);
+          if (len > 4 && 0 == strcmp(bam_file + len - 4, ".bam")) {
+               strcpy(fn, bam_file);
+               strcpy(fn + len - 4, ".bai");
+               fh = fopen(fn, "rb");
+          }
+     }
+     if (fh) {
+          p->from_index = (0 == binplan_read_bai(p, fh, h));
+          fclose(fh);
+     }
+     for (tid=0; p->from_index && tid<p->n_targets; tid++) {
+          for (w=0; w<p->n_windows[tid]; w++) {
+               total += p->work[tid][w];
+          }
+     }
+     if (total <= 0.0) {
+          LOG_VERBOSE("No usable BAI index for %s. Planning bins by length\n", bam_file);
+          binplan_set_length_work(p, h);
+     } else {
+          LOG_DEBUG("Loaded work estimates for %s from %s\n", bam_file, fn);
+     }
+     free(fn);
+     return p;
+}
+/* binplan_load() */
+
+
+void
+binplan_free(binplan_t *p)
+{
+     int tid;
+
+     if (! p) {
+          return;
+     }
+     for (tid=0; tid<p->n_targets; tid++) {
+          free(p->work[tid]);
+     }
+     free(p->work);
+     free(p->n_windows);
+     free(p->len);
+     free(p);
+}
+/* binplan_free() */
+
+
+/* work of [beg, end) in window w of tid, assuming uniform work within
+ * windows */
+static double
+window_work(const binplan_t *p, const int tid, const int w, const int beg, const int end)
+{
+     int wbeg = w*BINPLAN_WINDOW;
+     int wend = MIN(wbeg + BINPLAN_WINDOW, p->len[tid]);
+     int b = MAX(beg, wbeg);
+     int e = MIN(end, wend);
+
+     if (e <= b) {
+          return 0.0;
+     }
+     return p->work[tid][w] * (e-b) / (double) (wend-wbeg);
+}
+/* window_work() */
+
+
+/**
+ * @brief Estimated work of region [beg, end) (zero-based, half-open)
+ * of target tid
+ */
+double
+binplan_work(const binplan_t *p, const int tid, const int beg, const int end)
+{
+     double work = 0.0;
+     int w;
+
+     for (w = beg/BINPLAN_WINDOW; w < p->n_windows[tid] && w*BINPLAN_WINDOW < end; w++) {
+          work += window_work(p, tid, w, beg, end);
+     }
+     return work;
+}
+/* binplan_work() */
+
+
+/**
+ * @brief Returns smallest position cut in (beg, end] such that
+ * [beg, cut) has at least the given work. Cuts are at window
+ * boundaries (or end), so at least one window is always included.
+ */
+int
+binplan_next_cut(const binplan_t *p, const int tid, const int beg, const int end,
+                 const double work)
+{
+     double sum = 0.0;
+     int w;
+
+     for (w = beg/BINPLAN_WINDOW; w < p->n_windows[tid] && w*BINPLAN_WINDOW < end; w++) {
+          int wend = (w+1)*BINPLAN_WINDOW;
+          sum += window_work(p, tid, w, beg, end);
+          if (sum >= work) {
+               return MIN(wend, end);
+          }
+     }
+     return end;
+}
+/* binplan_next_cut() */
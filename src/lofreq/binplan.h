@@ -0,0 +1,69 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef BINPLAN_H
+#define BINPLAN_H
+
+#include "sam.h"
+
+/* Estimates of calling work per BINPLAN_WINDOW sized window of each
+ * target, used to split targets into bins of roughly equal work
+ * (instead of equal length), e.g. for amplicon data where a few
+ * windows hold most reads. Work is estimated from the BAM index as
+ * the number of (compressed) bytes of reads in each window. Without a
+ * (parseable BAI) index, work is proportional to length. Used by
+ * threaded lofreq call and, via lofreq binplan, by
+ * lofreq2_call_pparallel.py.
+ */
+
+/* size of BAI leaf bins, i.e. smallest resolution */
+#define BINPLAN_WINDOW 16384
+
+typedef struct {
+     int n_targets;
+     int *n_windows; /* per target */
+     int *len; /* target lengths. last window can be shorter */
+     double **work; /* per target and window */
+     int from_index; /* 0 if work is just length */
+} binplan_t;
+
+
+binplan_t *
+binplan_load(const char *bam_file, const bam_header_t *h);
+
+void
+binplan_free(binplan_t *p);
+
+double
+binplan_work(const binplan_t *p, const int tid, const int beg, const int end);
+
+int
+binplan_next_cut(const binplan_t *p, const int tid, const int beg, const int end,
+                 const double work);
+
+#endif
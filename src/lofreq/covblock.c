@@ -0,0 +1,264 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Run-length encoded coverage blocks. See covblock.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include "log.h"
+#include "utils.h"
+#include "plp.h"
+#include "vcf.h"
+#include "defaults.h"
+#include "covblock.h"
+
+
+static int
+covblock_parse_bands(covblock_t *b, const char *bands_str)
+{
+     const char *s = bands_str;
+     char *end;
+     int n = 1;
+
+     for (s=bands_str; *s; s++) {
+          if (',' == *s) {
+               n += 1;
+          }
+     }
+     /* one more for 0, which is added if missing */
+     if (NULL == (b->bands = malloc((n+1) * sizeof(int)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return 1;
+     }
+     b->bands[0] = 0;
+     b->num_bands = 1;
+     s = bands_str;
+     while (1) {
+          long int v = strtol(s, &end, 10);
+          if (end == s || v < 0 || v > INT_MAX || (*end != ',' && *end != '\0')) {
+               LOG_ERROR("Invalid depth bands '%s'\n", bands_str);
+               return 1;
+          }
+          if (v > 0) {
+               if (v <= b->bands[b->num_bands-1]) {
+                    LOG_ERROR("Depth bands have to be ascending: '%s'\n", bands_str);
+                    return 1;
+               }
+               b->bands[b->num_bands++] = (int) v;
+          }
+          if ('\0' == *end) {
+               break;
+          }
+          s = end+1;
+     }
+     return 0;
+}
+/* covblock_parse_bands() */
+
+
+static int
+covblock_band(const covblock_t *b, const int dp)
+{
+     int i;
+     /* few bands: linear search is fine */
+     for (i=b->num_bands-1; i>0; i--) {
+          if (dp >= b->bands[i]) {
+               break;
+          }
+     }
+     return i;
+}
+/* covblock_band() */
+
+
+/* writes current block (if any) and clears it */
+static void
+covblock_flush(covblock_t *b)
+{
+     long int n, half, cum = 0;
+     int med_dp, d;
+
+     if (b->tid < 0) {
+          return;
+     }
+     n = b->end - b->beg;
+     /* lower median */
+     half = (n+1)/2;
+     med_dp = b->hist_hi;
+     for (d=b->hist_lo; d<=b->hist_hi; d++) {
+          cum += b->dp_hist[d];
+          if (cum >= half) {
+               med_dp = d;
+               break;
+          }
+     }
+     if (COVBLOCK_HIST_SIZE-1 == med_dp && b->num_deep) {
+          /* num_deep values starting at cum-num_deep: exact value */
+          qsort(b->deep_dp, b->num_deep, sizeof(int), int_cmp);
+          med_dp = b->deep_dp[half - (cum - b->num_deep) - 1];
+     }
+     b->num_deep = 0;
+     memset(& b->dp_hist[b->hist_lo], 0, (b->hist_hi-b->hist_lo+1) * sizeof(unsigned int));
+
+     vcf_printf(& b->vcf, "%s\t%ld\t.\t%c\t<*>\t.\t.\tEND=%ld;MIN_DP=%d;MED_DP=%d;PF=%.3f\n",
+                b->chrom, b->beg+1, b->ref_base, b->end,
+                b->min_dp, med_dp,
+                b->sum_dp ? b->sum_pass/(double)b->sum_dp : 0.0);
+     b->num_blocks += 1;
+     b->tid = -1;
+}
+/* covblock_flush() */
+
+
+int
+covblock_open(covblock_t *b, const char *path, const char *bands_str,
+              const char *cmdline, const char *reffa)
+{
+     char tbuf[9];
+     struct tm tm;
+     time_t t;
+     int i;
+
+     memset(b, 0, sizeof(covblock_t));
+     b->tid = -1;
+     if (covblock_parse_bands(b, bands_str)) {
+          free(b->bands);
+          return 1;
+     }
+     if (NULL == (b->dp_hist = calloc(COVBLOCK_HIST_SIZE, sizeof(unsigned int)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          free(b->bands);
+          return 1;
+     }
+     if (vcf_file_open(& b->vcf, path, HAS_GZIP_EXT(path), 'w')) {
+          LOG_ERROR("Couldn't open %s\n", path);
+          free(b->bands);
+          free(b->dp_hist);
+          return 1;
+     }
+
+     t = time(0);
+     localtime_r(&t, &tm);
+     strftime(tbuf, 9, "%Y%m%d", &tm);
+     vcf_printf(& b->vcf, "##fileformat=VCFv4.1\n");
+     vcf_printf(& b->vcf, "##fileDate=%s\n", tbuf);
+     if (cmdline) {
+          vcf_printf(& b->vcf, "##source=%s\n", cmdline);
+     }
+     if (reffa) {
+          vcf_printf(& b->vcf, "##reference=%s\n", reffa);
+     }
+     vcf_printf(& b->vcf, "##coverage_bands=");
+     for (i=0; i<b->num_bands; i++) {
+          vcf_printf(& b->vcf, "%s%d", i ? "," : "", b->bands[i]);
+     }
+     vcf_printf(& b->vcf, "\n");
+     vcf_printf(& b->vcf, "##ALT=<ID=*,Description=\"Reference block: columns with depth in the same band\">\n");
+     vcf_printf(& b->vcf, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the block (inclusive)\">\n");
+     vcf_printf(& b->vcf, "##INFO=<ID=MIN_DP,Number=1,Type=Integer,Description=\"Minimum raw depth in the block\">\n");
+     vcf_printf(& b->vcf, "##INFO=<ID=MED_DP,Number=1,Type=Integer,Description=\"Median raw depth in the block\">\n");
+     vcf_printf(& b->vcf, "##INFO=<ID=PF,Number=1,Type=Float,Description=\"Fraction of raw depth with a base passing filters\">\n");
+     vcf_printf(& b->vcf, "%s\n", VCF_HEADER);
+     return 0;
+}
+/* covblock_open() */
+
+
+void
+covblock_add_col(covblock_t *b, const plp_col_t *p)
+{
+     int dp = p->coverage_plp;
+     int band = covblock_band(b, dp);
+     int h = dp < COVBLOCK_HIST_SIZE ? dp : COVBLOCK_HIST_SIZE-1;
+
+     if (b->tid >= 0 && (p->tid != b->tid || p->pos != b->end || band != b->band)) {
+          covblock_flush(b);
+     }
+
+     if (b->tid < 0) {
+          if (NULL == b->chrom || 0 != strcmp(b->chrom, p->target)) {
+               free(b->chrom);
+               b->chrom = strdup(p->target);
+          }
+          b->tid = p->tid;
+          b->beg = p->pos;
+          b->end = p->pos;
+          b->ref_base = p->ref_base;
+          b->band = band;
+          b->min_dp = dp;
+          b->sum_dp = b->sum_pass = 0;
+          b->hist_lo = b->hist_hi = h;
+     }
+
+     b->end += 1;
+     if (dp < b->min_dp) {
+          b->min_dp = dp;
+     }
+     b->sum_dp += dp;
+     /* num_bases can't exceed dp, unless downsampling lowered it */
+     b->sum_pass += MIN(p->num_bases, dp);
+     b->dp_hist[h] += 1;
+     if (COVBLOCK_HIST_SIZE-1 == h) {
+          if (b->num_deep == b->deep_size) {
+               b->deep_size = b->deep_size ? 2*b->deep_size : 1024;
+               if (NULL == (b->deep_dp = realloc(b->deep_dp, b->deep_size * sizeof(int)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          b->deep_dp[b->num_deep++] = dp;
+     }
+     if (h < b->hist_lo) {
+          b->hist_lo = h;
+     }
+     if (h > b->hist_hi) {
+          b->hist_hi = h;
+     }
+}
+/* covblock_add_col() */
+
+
+int
+covblock_close(covblock_t *b)
+{
+     covblock_flush(b);
+     LOG_VERBOSE("Wrote %ld coverage blocks\n", b->num_blocks);
+     free(b->chrom);
+     free(b->bands);
+     free(b->dp_hist);
+     free(b->deep_dp);
+     return vcf_file_close(& b->vcf);
+}
+/* covblock_close() */
@@ -0,0 +1,87 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef COVBLOCK_H
+#define COVBLOCK_H
+
+#include "plp.h"
+#include "vcf.h"
+
+/* Run-length encoded coverage, written by lofreq call --cov-blocks
+ * in the same pass as calling. Adjacent columns on the same target
+ * whose depth falls into the same band are merged into one gVCF-style
+ * reference block with END, minimum and median depth and the fraction
+ * of reads which contributed a base that passed filters. Positions
+ * without coverage are never piled up and therefore not covered by
+ * any block, i.e. a gap in the blocks means no coverage.
+ */
+
+/* lower depth bound of each band */
+#define COVBLOCK_DEFAULT_BANDS "0,1,5,10,20,50,100,200,500,1000"
+/* depths are counted in a histogram of this size for the median.
+ * the last bin holds all larger depths, which are then also kept
+ * individually, so that the median stays exact */
+#define COVBLOCK_HIST_SIZE 65536
+
+typedef struct {
+     vcf_file_t vcf;
+     int *bands; /* ascending, first is always 0 */
+     int num_bands;
+
+     /* current block. chrom is a copy, since target names of columns
+      * are only valid while mpileup() runs */
+     char *chrom;
+     int tid; /* -1 if no block open */
+     long int beg, end; /* zero-based, half-open */
+     char ref_base;
+     int band;
+     int min_dp;
+     long long int sum_dp, sum_pass;
+     unsigned int *dp_hist;
+     int hist_lo, hist_hi; /* range of dp_hist in use */
+     int *deep_dp; /* depths in the last bin of dp_hist */
+     long int num_deep, deep_size;
+
+     long int num_blocks; /* stats */
+} covblock_t;
+
+
+/* bands_str: comma separated, ascending lower bounds of depth bands
+ * (e.g. COVBLOCK_DEFAULT_BANDS). non-zero on error */
+int
+covblock_open(covblock_t *b, const char *path, const char *bands_str,
+              const char *cmdline, const char *reffa);
+
+void
+covblock_add_col(covblock_t *b, const plp_col_t *p);
+
+/* writes last block. non-zero on error */
+int
+covblock_close(covblock_t *b);
+
+#endif
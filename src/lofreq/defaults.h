@@ -58,6 +58,8 @@
 /* coverage thresholds */
 #define DEFAULT_MIN_COV 1
 #define DEFAULT_MAX_PLP_DEPTH 1000000
+/* seed for reproducible downsampling (--downsample) */
+#define DEFAULT_DS_SEED 13
 
 #define DEFAULT_BAQ_ON 1
 
@@ -1,8 +1,14 @@
 /* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
-/* Taken from samtools 0.1.18 (r982:295) */
+/* Taken from samtools 0.1.18 (r982:295). kt_fisher_exact_full() is
+ * the original. kt_fisher_exact() is a faster version of it, see
+ * below */
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fet.h"
 
 /* This program is implemented with ideas from this web page:
  *
@@ -59,7 +65,7 @@ static double hypergeo_acc(int n11, int n1_, int n_1, int n, hgacc_t *aux)
 	return aux->p;
 }
 
-double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two)
+double kt_fisher_exact_full(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two)
 {
 	int i, j, max, min;
 	double p, q, left, right;
@@ -97,6 +103,299 @@ double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double
 	return q;
 }
 
+
+
+/* kt_fisher_exact() gives the same results as kt_fisher_exact_full(),
+ * but
+ *
+ * - uses a log-factorial table instead of lgamma(). the table is
+ *   shared by all threads and grown (under lock) to the largest n
+ *   seen. replaced tables are kept, so that readers never need the
+ *   lock.
+ *
+ * - doesn't walk the whole support. the tails are summed from the
+ *   table's probability outwards, i.e. from the largest term, and
+ *   summation stops once the rest is negligible (like
+ *   pruned_calc_prob_dist() stops early). the hypergeometric is
+ *   log-concave, so the rest is bounded by p*r/(1-r), with r the
+ *   ratio of the current to the next term.
+ *
+ * - remembers recent results in a small LRU memo keyed on the table,
+ *   since the same DP4 counts come up again and again at amplicon
+ *   depth.
+ */
+
+#define FET_LFACT_MIN_SIZE 1024
+/* tables larger than this are never used (memory): falling back to
+ * kt_fisher_exact_full() */
+#define FET_LFACT_MAX_SIZE (1<<22)
+/* relative precision at which tail summation stops */
+#define FET_TAIL_EPS 1e-14
+/* terms are updated using ratios and recomputed every this often */
+#define FET_RECOMPUTE 64
+#define FET_MEMO_SETS 256 /* power of 2 */
+#define FET_MEMO_WAYS 4
+
+
+typedef struct lfact_table_s {
+     int size; /* log(k!) for k=0..size-1 */
+     double *v;
+     struct lfact_table_s *prev; /* replaced table. kept for readers */
+} lfact_table_t;
+
+static lfact_table_t * volatile lfact_cur = NULL;
+static pthread_mutex_t lfact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+typedef struct {
+     int n11, n12, n21, n22;
+     double p, left, right, two;
+     unsigned int stamp; /* 0: unused */
+} fet_memo_t;
+
+static fet_memo_t fet_memo[FET_MEMO_SETS][FET_MEMO_WAYS];
+static unsigned int fet_memo_clock = 0;
+static pthread_mutex_t fet_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* returns log-factorial table covering at least 0..n or NULL if n is
+ * too large or on allocation failure */
+static const double *
+lfact_get(const int n)
+{
+     lfact_table_t *t = lfact_cur;
+     lfact_table_t *new_t;
+     int i, size;
+
+     if (t && n < t->size) {
+          return t->v;
+     }
+     if (n >= FET_LFACT_MAX_SIZE) {
+          return NULL;
+     }
+
+     pthread_mutex_lock(& lfact_lock);
+     t = lfact_cur;
+     if (t && n < t->size) {
+          pthread_mutex_unlock(& lfact_lock);
+          return t->v;
+     }
+     size = t ? 2*t->size : FET_LFACT_MIN_SIZE;
+     while (size <= n) {
+          size *= 2;
+     }
+     if (size > FET_LFACT_MAX_SIZE) {
+          size = FET_LFACT_MAX_SIZE;
+     }
+     if (NULL == (new_t = malloc(sizeof(lfact_table_t)))
+         || NULL == (new_t->v = malloc(size * sizeof(double)))) {
+          free(new_t);
+          pthread_mutex_unlock(& lfact_lock);
+          return NULL;
+     }
+     i = 0;
+     if (t) {
+          memcpy(new_t->v, t->v, t->size * sizeof(double));
+          i = t->size;
+     }
+     for (; i<size; i++) {
+          new_t->v[i] = lgamma(i+1.0);
+     }
+     new_t->size = size;
+     new_t->prev = t;
+     /* table has to be complete before readers can see it */
+     __sync_synchronize();
+     lfact_cur = new_t;
+     pthread_mutex_unlock(& lfact_lock);
+
+     return new_t->v;
+}
+/* lfact_get() */
+
+
+/* hypergeometric probability of n11 given margins, using log-factorial table lf */
+static double
+fet_pmf(const double *lf, const int n11, const int n1_, const int n_1, const int n)
+{
+     return exp(lf[n1_] - lf[n11] - lf[n1_-n11]
+                + lf[n-n1_] - lf[n_1-n11] - lf[n-n1_-n_1+n11]
+                - lf[n] + lf[n_1] + lf[n-n_1]);
+}
+/* fet_pmf() */
+
+
+/* ratio pmf(k+step)/pmf(k) for step 1 or -1 */
+static double
+fet_ratio(const int k, const int step, const int n1_, const int n_1, const int n)
+{
+     if (step > 0) {
+          return ((double)(n1_-k) * (double)(n_1-k))
+               / ((double)(k+1) * (double)(n-n1_-n_1+k+1));
+     } else {
+          return ((double)k * (double)(n-n1_-n_1+k))
+               / ((double)(n1_-k+1) * (double)(n_1-k+1));
+     }
+}
+/* fet_ratio() */
+
+
+/* sum of pmf(k) for k=from, from+step, ... up to and including end,
+ * with p=pmf(from). moving away from the mode, i.e. terms shrink */
+static double
+fet_tail(const double *lf, int k, const int end, const int step, double p,
+         const int n1_, const int n_1, const int n)
+{
+     double sum = 0.0;
+     int steps = 0;
+
+     while (1) {
+          double r;
+          sum += p;
+          if (k == end || p == 0.0) {
+               break;
+          }
+          r = fet_ratio(k, step, n1_, n_1, n);
+          if (r < 1.0 && p * r / (1.0 - r) < FET_TAIL_EPS * sum) {
+               break;
+          }
+          k += step;
+          if (++steps % FET_RECOMPUTE) {
+               p *= r;
+          } else {
+               p = fet_pmf(lf, k, n1_, n_1, n);
+          }
+     }
+     return sum;
+}
+/* fet_tail() */
+
+
+static int
+fet_memo_get(const int n11, const int n12, const int n21, const int n22,
+             double *p, double *left, double *right, double *two)
+{
+     unsigned int h = ((unsigned int)n11 * 2654435761U) ^ ((unsigned int)n12 * 40503U)
+          ^ ((unsigned int)n21 * 2246822519U) ^ ((unsigned int)n22 * 3266489917U);
+     fet_memo_t *set = fet_memo[(h ^ (h >> 16)) & (FET_MEMO_SETS-1)];
+     int w;
+
+     pthread_mutex_lock(& fet_memo_lock);
+     for (w=0; w<FET_MEMO_WAYS; w++) {
+          fet_memo_t *e = & set[w];
+          if (e->stamp && e->n11 == n11 && e->n12 == n12 && e->n21 == n21 && e->n22 == n22) {
+               e->stamp = ++fet_memo_clock ? fet_memo_clock : ++fet_memo_clock;
+               *p = e->p; *left = e->left; *right = e->right; *two = e->two;
+               pthread_mutex_unlock(& fet_memo_lock);
+               return 1;
+          }
+     }
+     pthread_mutex_unlock(& fet_memo_lock);
+     return 0;
+}
+/* fet_memo_get() */
+
+
+static void
+fet_memo_put(const int n11, const int n12, const int n21, const int n22,
+             const double p, const double left, const double right, const double two)
+{
+     unsigned int h = ((unsigned int)n11 * 2654435761U) ^ ((unsigned int)n12 * 40503U)
+          ^ ((unsigned int)n21 * 2246822519U) ^ ((unsigned int)n22 * 3266489917U);
+     fet_memo_t *set = fet_memo[(h ^ (h >> 16)) & (FET_MEMO_SETS-1)];
+     fet_memo_t *e = & set[0];
+     int w;
+
+     pthread_mutex_lock(& fet_memo_lock);
+     /* least recently used. unused ones have stamp 0. wrap-around of
+      * the clock only makes a few choices suboptimal */
+     for (w=1; w<FET_MEMO_WAYS; w++) {
+          if (set[w].stamp < e->stamp) {
+               e = & set[w];
+          }
+     }
+     e->n11 = n11; e->n12 = n12; e->n21 = n21; e->n22 = n22;
+     e->p = p; e->left = left; e->right = right; e->two = two;
+     e->stamp = ++fet_memo_clock ? fet_memo_clock : ++fet_memo_clock;
+     pthread_mutex_unlock(& fet_memo_lock);
+}
+/* fet_memo_put() */
+
+
+double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two)
+{
+     int i, j, k, max, min, mode;
+     double p, pp, q, left, right, thresh_lo, thresh_hi;
+     int n1_, n_1, n;
+     const double *lf;
+
+     n1_ = n11 + n12; n_1 = n11 + n21; n = n11 + n12 + n21 + n22;
+     max = (n_1 < n1_) ? n_1 : n1_; /* max n11, for right tail */
+     min = n1_ + n_1 - n;
+     if (min < 0) min = 0; /* min n11, for left tail */
+     *two = *_left = *_right = 1.;
+     if (min == max) return 1.; /* no need to do test */
+
+     if (fet_memo_get(n11, n12, n21, n22, & q, _left, _right, two)) {
+          return q;
+     }
+     if (NULL == (lf = lfact_get(n))) {
+          return kt_fisher_exact_full(n11, n12, n21, n22, _left, _right, two);
+     }
+
+     q = fet_pmf(lf, n11, n1_, n_1, n); /* the probability of the current table */
+     thresh_lo = 0.99999999 * q;
+     thresh_hi = 1.00000001 * q;
+     mode = (int) (((double)(n1_+1) * (double)(n_1+1)) / (n+2));
+     if (mode < min) mode = min;
+     if (mode > max) mode = max;
+
+     /* left tail: as in kt_fisher_exact_full(), i is the first table
+      * from min with p >= thresh_lo, which is included if p is about
+      * q. found by walking down from n11 (or the mode) instead of up
+      * from min */
+     k = n11 < mode ? n11 : mode;
+     p = k == n11 ? q : fet_pmf(lf, k, n1_, n_1, n);
+     while (k > min && (pp = p * fet_ratio(k, -1, n1_, n_1, n)) >= thresh_lo) {
+          p = pp;
+          k -= 1;
+     }
+     i = k;
+     if (p < thresh_hi) {
+          left = fet_tail(lf, i, min, -1, p, n1_, n_1, n);
+     } else {
+          left = i > min ? fet_tail(lf, i-1, min, -1, p * fet_ratio(i, -1, n1_, n_1, n), n1_, n_1, n) : 0.;
+          --i;
+     }
+
+     /* right tail, same from the other side */
+     k = n11 > mode ? n11 : mode;
+     p = k == n11 ? q : fet_pmf(lf, k, n1_, n_1, n);
+     while (k < max && (pp = p * fet_ratio(k, 1, n1_, n_1, n)) >= thresh_lo) {
+          p = pp;
+          k += 1;
+     }
+     j = k;
+     if (p < thresh_hi) {
+          right = fet_tail(lf, j, max, 1, p, n1_, n_1, n);
+     } else {
+          right = j < max ? fet_tail(lf, j+1, max, 1, p * fet_ratio(j, 1, n1_, n_1, n), n1_, n_1, n) : 0.;
+          ++j;
+     }
+
+     /* two-tail */
+     *two = left + right;
+     if (*two > 1.) *two = 1.;
+     /* adjust left and right */
+     if (abs(i - n11) < abs(j - n11)) right = 1. - left + q;
+     else left = 1.0 - right + q;
+     *_left = left; *_right = right;
+
+     fet_memo_put(n11, n12, n21, n22, q, left, right, *two);
+     return q;
+}
+/* kt_fisher_exact() */
+
+
 #ifdef FET_MAIN
 #include <stdio.h>
 
@@ -107,9 +406,11 @@ int main(int argc, char *argv[])
 	double left, right, twotail, prob;
 
 	while (scanf("%s%d%d%d%d", id, &n11, &n12, &n21, &n22) == 5) {
+		double full_left, full_right, full_twotail;
 		prob = kt_fisher_exact(n11, n12, n21, n22, &left, &right, &twotail);
-		printf("%s\t%d\t%d\t%d\t%d\t%.6g\t%.6g\t%.6g\t%.6g\n", id, n11, n12, n21, n22,
-				prob, left, right, twotail);
+		(void) kt_fisher_exact_full(n11, n12, n21, n22, &full_left, &full_right, &full_twotail);
+		printf("%s\t%d\t%d\t%d\t%d\t%.6g\t%.6g\t%.6g\t%.6g\t%.6g\n", id, n11, n12, n21, n22,
+				prob, left, right, twotail, full_twotail);
 	}
 	return 0;
 }
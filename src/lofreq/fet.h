@@ -1,6 +1,13 @@
 #ifndef FET_H
 #define FET_H
 
+/* Fisher's exact test on 2x2 table n11 n12 / n21 n22. returns
+ * probability of the table and sets left, right and two-sided
+ * p-values. fast, thread-safe version (see fet.c) */
 double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
 
+/* original samtools version, walking the whole support. reference
+ * for kt_fisher_exact() */
+double kt_fisher_exact_full(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
+
 #endif
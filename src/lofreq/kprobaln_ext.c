@@ -75,48 +75,119 @@ kpa_ext_par_t kpa_ext_par_lofreq_pacbio = { 0.1, 0.4, 10};
    insertion). q[i] gives the phred scaled posterior probability of
    state[i] being wrong.
 
-   LoFreq extension not used if pd == NULL
+   LoFreq extension not used if pd == NULL. Otherwise *pd is set to
+   the posterior probability rows, which live in ws and are valid until
+   the next call. If ws is NULL a temporary workspace is used (and pd
+   has to be NULL).
  */
-int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, 
-     const uint8_t *iqual, const kpa_ext_par_t *c, int *state, uint8_t *q, double **pd,
+void kpa_ext_ws_init(kpa_ext_ws_t *ws)
+{
+	memset(ws, 0, sizeof(kpa_ext_ws_t));
+}
+
+void kpa_ext_ws_free(kpa_ext_ws_t *ws)
+{
+	free(ws->f); free(ws->b); free(ws->pd);
+	free(ws->f_rows); free(ws->b_rows); free(ws->pd_rows);
+	free(ws->s); free(ws->qual);
+	kpa_ext_ws_init(ws);
+}
+
+/* makes room for n_rows bands of row_len and zeroes the ones needed
+ * (the recursions read cells just outside of the band). returns
+ * non-zero on error */
+static int kpa_ext_ws_reserve(kpa_ext_ws_t *ws, int n_rows, int row_len, int need_b, int need_pd)
+{
+	size_t n_cells = (size_t)n_rows * row_len;
+	int i;
+	if (n_cells > ws->cap_cells) {
+		double *f, *b, *pd;
+		free(ws->f); free(ws->b); free(ws->pd);
+		f = malloc(n_cells * sizeof(double));
+		b = malloc(n_cells * sizeof(double));
+		pd = malloc(n_cells * sizeof(double));
+		ws->f = f; ws->b = b; ws->pd = pd;
+		if (! f || ! b || ! pd) {
+			ws->cap_cells = 0;
+			return -1;
+		}
+		ws->cap_cells = n_cells;
+	}
+	if (n_rows > ws->cap_rows) {
+		double **fr, **br, **pdr, *s;
+		float *qual;
+		fr = realloc(ws->f_rows, n_rows * sizeof(double*));
+		if (fr) ws->f_rows = fr;
+		br = realloc(ws->b_rows, n_rows * sizeof(double*));
+		if (br) ws->b_rows = br;
+		pdr = realloc(ws->pd_rows, n_rows * sizeof(double*));
+		if (pdr) ws->pd_rows = pdr;
+		s = realloc(ws->s, (n_rows+1) * sizeof(double));
+		if (s) ws->s = s;
+		qual = realloc(ws->qual, n_rows * sizeof(float));
+		if (qual) ws->qual = qual;
+		if (! fr || ! br || ! pdr || ! s || ! qual) return -1;
+		ws->cap_rows = n_rows;
+	}
+	for (i = 0; i < n_rows; ++i) {
+		ws->f_rows[i] = ws->f + (size_t)i * row_len;
+		ws->b_rows[i] = ws->b + (size_t)i * row_len;
+		ws->pd_rows[i] = ws->pd + (size_t)i * row_len;
+	}
+	memset(ws->f, 0, n_cells * sizeof(double));
+	if (need_b) memset(ws->b, 0, n_cells * sizeof(double));
+	if (need_pd) memset(ws->pd, 0, n_cells * sizeof(double));
+	memset(ws->s, 0, (n_rows+1) * sizeof(double));
+	return 0;
+}
+
+int kpa_ext_glocal(kpa_ext_ws_t *ws, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, 
+     const uint8_t *iqual, const kpa_ext_par_t *c, int *state, uint8_t *q, double ***ret_pd,
      int *ret_bw)
 {
-	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
+	double **f, **b = 0, **pd = 0, *s, m[9], sI, sM, bI, bM, pb;
+	double e_tab[5]; /* emission per reference nt4 for the current query base */
 	float *qual, *_qual;
 	const uint8_t *ref, *query;
 	int bw, bw2, i, k, /* is_diff = 0, */ is_backward = 1, Pr;
+	kpa_ext_ws_t tmp_ws;
 
     if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
 
 	/*** initialization ***/
     is_backward = state && q? 1 : 0;
-    if (pd) {
+    if (ret_pd) {
          is_backward = 1;
+    }
+    if (! ws) {
+         if (ret_pd) return 0;
+         kpa_ext_ws_init(&tmp_ws);
+         ws = &tmp_ws;
     }
 	ref = _ref - 1; query = _query - 1; // change to 1-based coordinate
 	bw = l_ref > l_query? l_ref : l_query;
 	if (bw > c->bw) bw = c->bw;
 	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
-    if (pd) {
+    if (ret_pd) {
          *ret_bw = bw;
     }
      bw2 = bw * 2 + 1;
-	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
-	f = calloc(l_query+1, sizeof(double*));
-    if (is_backward) b = calloc(l_query+1, sizeof(double*));
-	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
-		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
-        if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
-        if (pd) pd[i] = calloc(bw2 * 3 + 6, sizeof(double));
-#if 0
-        if (pd && i==0) fprintf(stderr, "pd[i=%d] allocated to bw2*3+6=%d\n", i, bw2 * 3 + 6);
-#endif
+	// get the forward and backward matrices f[][] and b[][] and the scaling array s[] from the workspace
+	if (kpa_ext_ws_reserve(ws, l_query+1, bw2 * 3 + 6, is_backward, ret_pd != NULL)) { // FIXME: this is over-allocated for very short seqs
+		fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+			__FILE__, __FUNCTION__, __LINE__);
+		exit(1);
 	}
-	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
+	f = ws->f_rows;
+	if (is_backward) b = ws->b_rows;
+	if (ret_pd) pd = *ret_pd = ws->pd_rows;
+	s = ws->s; // s[] is the scaling factor to avoid underflow
 	// initialize qual
-	_qual = calloc(l_query, sizeof(float));
+	_qual = ws->qual;
+	// filled backwards so that g_qual2prob[0] (used as init flag) is set
+	// last. otherwise concurrent callers might use a half-filled table
 	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
+		for (i = 255; i >= 0; --i)
 			g_qual2prob[i] = pow(10, -i/10.);
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
@@ -148,17 +219,26 @@ int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_
 	// f[2..l_query]
 	for (i = 2; i <= l_query; ++i) {
 		double *fi = f[i], *fi1 = f[i-1], sum, qli = qual[i];
-		int beg = 1, end = l_ref, x, _beg, _end;
+		int beg = 1, end = l_ref, x, _beg, _end, u0, o11, o10;
 		uint8_t qyi = query[i];
 		x = i - bw; beg = beg > x? beg : x; // band start
 		x = i + bw; end = end < x? end : x; // band end
+		for (x = 0; x < 5; ++x)
+			e_tab[x] = (x > 3 || qyi > 3)? 1. : x == qyi? 1. - qli : qli * EM;
+		// u, v11 and v10 advance by 3 with k, i.e. only need offsets
+		set_u(u0, bw, i, beg); set_u(o11, bw, i-1, beg-1); set_u(o10, bw, i-1, beg);
+		o11 -= u0; o10 -= u0;
+		// M and I only depend on the previous row: no loop carried
+		// dependency, so this is a branch-free loop that can be vectorized
+		for (k = beg; k <= end; ++k) {
+			int u = u0 + (k-beg)*3;
+			double e = e_tab[ref[k] > 4? 4 : ref[k]];
+			fi[u+0] = e * (m[0] * fi1[u+o11+0] + m[3] * fi1[u+o11+1] + m[6] * fi1[u+o11+2]);
+			fi[u+1] = EI * (m[1] * fi1[u+o10+0] + m[4] * fi1[u+o10+1]);
+		}
+		// D depends on previous column of this row; summed in the original order
 		for (k = beg, sum = 0.; k <= end; ++k) {
-			int u, v11, v01, v10;
-			double e;
-			e = (ref[k] > 3 || qyi > 3)? 1. : ref[k] == qyi? 1. - qli : qli * EM;
-			set_u(u, bw, i, k); set_u(v11, bw, i-1, k-1); set_u(v10, bw, i-1, k); set_u(v01, bw, i, k-1);
-			fi[u+0] = e * (m[0] * fi1[v11+0] + m[3] * fi1[v11+1] + m[6] * fi1[v11+2]);
-			fi[u+1] = EI * (m[1] * fi1[v10+0] + m[4] * fi1[v10+1]);
+			int u = u0 + (k-beg)*3, v01 = u-3;
 			fi[u+2] = m[2] * fi[v01+0] + m[8] * fi[v01+2];
 			sum += fi[u] + fi[u+1] + fi[u+2];
 //			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, fi[u], fi[u+1], fi[u+2]); // DEBUG
@@ -187,8 +267,7 @@ int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_
 		Pr1 += -4.343 * log(p * l_ref * l_query);
 		Pr = (int)(Pr1 + .499);
         if (!is_backward) { // skip backward and MAP
-             for (i = 0; i <= l_query; ++i) free(f[i]);
-             free(f); free(s); free(_qual);
+             if (ws == &tmp_ws) kpa_ext_ws_free(&tmp_ws);
              return Pr;
         }
 	}
@@ -208,11 +287,13 @@ int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_
 		uint8_t qyi1 = query[i+1];
 		x = i - bw; beg = beg > x? beg : x;
 		x = i + bw; end = end < x? end : x;
+		for (x = 0; x < 5; ++x)
+			e_tab[x] = (x > 3 || qyi1 > 3)? 1. : x == qyi1? 1. - qli1 : qli1 * EM;
 		for (k = end; k >= beg; --k) {
 			int u, v11, v01, v10;
 			double e;
 			set_u(u, bw, i, k); set_u(v11, bw, i+1, k+1); set_u(v10, bw, i+1, k); set_u(v01, bw, i, k+1);
-			e = (k >= l_ref? 0 : (ref[k+1] > 3 || qyi1 > 3)? 1. : ref[k+1] == qyi1? 1. - qli1 : qli1 * EM) * bi1[v11];
+			e = (k >= l_ref? 0 : e_tab[ref[k+1] > 4? 4 : ref[k+1]]) * bi1[v11];
 			bi[u+0] = e * m[0] + EI * m[1] * bi1[v10+1] + m[2] * bi[v01+2]; // bi1[v11] has been foled into e.
 			bi[u+1] = e * m[3] + EI * m[4] * bi1[v10+1];
 			bi[u+2] = (e * m[6] + m[8] * bi[v01+2]) * y;
@@ -265,11 +346,7 @@ int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_
 				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
 #endif
 	}
-	/*** free ***/
-	for (i = 0; i <= l_query; ++i) {
-		free(f[i]); free(b[i]); 
-	}
-	free(f); free(b); free(s); free(_qual);
+	if (ws == &tmp_ws) kpa_ext_ws_free(&tmp_ws);
 	return Pr;
 }
 
@@ -299,7 +376,7 @@ int main(int argc, char *argv[])
 	iqual = malloc(l_query);
 	memset(iqual, q, l_query);
 	kpa_ext_par_def.bw = b;
-	P = kpa_ext_glocal(ref, l_ref, query, l_query, iqual, &kpa_ext_par_alt, 0, 0);
+	P = kpa_ext_glocal(NULL, ref, l_ref, query, l_query, iqual, &kpa_ext_par_alt, 0, 0, NULL, NULL);
 	fprintf(stderr, "%d\n", P);
 	free(iqual);
 	return 0;
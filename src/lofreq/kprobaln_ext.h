@@ -33,12 +33,28 @@ typedef struct {
 	int bw;
 } kpa_ext_par_t;
 
+/* reusable workspace for kpa_ext_glocal(). matrices are kept as one
+ * flat buffer each with one band per query position and only ever
+ * grow (to the largest read seen). not thread safe: use one per
+ * thread */
+typedef struct {
+	double *f, *b, *pd;
+	double **f_rows, **b_rows, **pd_rows;
+	double *s;
+	float *qual;
+	size_t cap_cells; /* number of doubles allocated for each of f, b and pd */
+	int cap_rows;
+} kpa_ext_ws_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-	int kpa_ext_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, 
-    const uint8_t *iqual, const kpa_ext_par_t *c, int *state, uint8_t *q, double **pd, 
+	void kpa_ext_ws_init(kpa_ext_ws_t *ws);
+	void kpa_ext_ws_free(kpa_ext_ws_t *ws);
+
+	int kpa_ext_glocal(kpa_ext_ws_t *ws, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, 
+    const uint8_t *iqual, const kpa_ext_par_t *c, int *state, uint8_t *q, double ***pd, 
     int *ret_bw);
 
 #ifdef __cplusplus
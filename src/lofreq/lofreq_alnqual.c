@@ -28,12 +28,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include "htslib/faidx.h"
 #include "sam.h"
 
 #include "utils.h"
 #include "bam_md_ext.h"
 #include "defaults.h"
+#include "log.h"
+#include "refcache.h"
+#include "bampipe.h"
 
 extern const char bam_nt16_nt4_table[];
 
@@ -47,6 +52,46 @@ extern const char bam_nt16_nt4_table[];
 #define MYNAME "lofreq alnqual"		
 
 
+/* per thread data for alnqual_func() */
+typedef struct {
+     refcache_t *refcache; /* shared */
+     bam_header_t *header;
+     int tid;
+     const char *ref; /* acquired from refcache */
+     int baq_flag;
+     int ext_baq;
+     int idaq_flag;
+     kpa_ext_ws_t ws;
+} alnqual_data_t;
+
+
+/* bampipe_func_t computing BAQ and/or IDAQ for one read */
+static int alnqual_func(bam1_t *b, void *data)
+{
+     alnqual_data_t *d = (alnqual_data_t *)data;
+     int len;
+
+     if (b->core.tid < 0) {
+          return 0;
+     }
+     if (d->tid != b->core.tid) {
+          if (d->ref) {
+               refcache_release(d->refcache, d->header->target_name[d->tid]);
+          }
+          d->tid = b->core.tid;
+          /* refcache sequences are uppercase already */
+          d->ref = refcache_get(d->refcache, d->header->target_name[d->tid], &len);
+          if (d->ref == 0) {
+               fprintf(stderr, "FATAL: %s failed to find sequence '%s' in the reference.\n",
+                       MYNAME, d->header->target_name[d->tid]);
+               return 1;
+          }
+     }
+     bam_prob_realn_core_ext(b, d->ref, d->baq_flag, d->ext_baq, d->idaq_flag, & d->ws);
+     return 0;
+}
+
+
 static void usage()
 {
      fprintf(stderr, "%s: add base- and indel-alignment qualities (BAQ, IDAQ) to BAM file\n\n", MYNAME);
@@ -59,6 +104,7 @@ static void usage()
      fprintf(stderr, "         -B       Don't compute base alignment qualities\n");
      fprintf(stderr, "         -A       Don't compute indel alignment qualities\n");
      fprintf(stderr, "         -r       Recompute i.e. overwrite existing values\n");
+     fprintf(stderr, "         -t INT   Number of threads for processing and compression [1]\n");
      fprintf(stderr, "- Output BAM will be written to stdout.\n");				
      fprintf(stderr, "- Only reads containing indels will contain indel-alignment qualities (tags: %s and %s).\n", AI_TAG, AD_TAG);
      fprintf(stderr, "- Do not change the alignmnent after running this, i.e. use this as last postprocessing step!\n");
@@ -69,11 +115,15 @@ static void usage()
 
 int main_alnqual(int argc, char *argv[])
 {
-     int c, tid = -2, ret, len, is_bam_out, is_sam_in, is_uncompressed;
+     int c, i, is_bam_out, is_sam_in, is_uncompressed;
      samfile_t *fp, *fpout = 0;
      faidx_t *fai;
-     char *ref = 0, mode_w[8], mode_r[8];
-     bam1_t *b;
+     refcache_t *refcache;
+     char mode_w[8], mode_r[8];
+     alnqual_data_t *wdata;
+     void **wdata_ptrs;
+     int num_threads = 1;
+     int rc = 0;
      int baq_flag = 1;
      int ext_baq = 1;
      int idaq_flag = 1;
@@ -83,7 +133,7 @@ int main_alnqual(int argc, char *argv[])
      mode_w[0] = mode_r[0] = 0;
      strcpy(mode_r, "r"); strcpy(mode_w, "w");
 	
-     while ((c = getopt(argc, argv, "buSeBAr")) >= 0) {
+     while ((c = getopt(argc, argv, "buSeBArt:")) >= 0) {
           switch (c) {
           case 'b': is_bam_out = 1; break;
           case 'u': is_uncompressed = is_bam_out = 1; break;
@@ -92,6 +142,13 @@ int main_alnqual(int argc, char *argv[])
           case 'B': baq_flag = 0; break;
           case 'A': idaq_flag = 0; break;
           case 'r': redo = 1; break;
+          case 't':
+               num_threads = atoi(optarg);
+               if (num_threads < 1) {
+                    fprintf(stderr, "FATAL: %s: Number of threads has to be at least one\n", MYNAME);
+                    return 1;
+               }
+               break;
           case '?': 
                fprintf(stderr, "FATAL: unrecognized arguments found. Exiting...\n");
                return 1;
@@ -133,6 +190,11 @@ int main_alnqual(int argc, char *argv[])
           return 1;
      }
      fpout = samopen("-", mode_w, fp->header);
+     if (is_bam_out && ! is_uncompressed && num_threads > 1) {
+          if (bgzf_mt(fpout->x.bam, num_threads, 256)) {
+               LOG_WARN("%s\n", "Couldn't enable multi-threaded compression");
+          }
+     }
 
      fai = fai_load(argv[optind+1]);
      if (! fai) {
@@ -140,30 +202,43 @@ int main_alnqual(int argc, char *argv[])
           return 1;
      }
 
-     b = bam_init1();
-     while ((ret = samread(fp, b)) >= 0) {
-          if (b->core.tid >= 0) {
-               if (tid != b->core.tid) {
-                    free(ref);
-                    ref = fai_fetch(fai, fp->header->target_name[b->core.tid], &len);
-                    strtoupper(ref);/* safeguard */
-                    tid = b->core.tid;
-                    if (ref == 0) {
-                         fprintf(stderr, "FATAL: %s failed to find sequence '%s' in the reference.\n",
-                                   MYNAME, fp->header->target_name[tid]);
-                         return 1;
-                    }
-               }
-               
-               bam_prob_realn_core_ext(b, ref, baq_flag, ext_baq, idaq_flag);
+     /* fai isn't thread safe, but refcache is */
+     refcache = refcache_new(fai, REFCACHE_DEFAULT_MAX_BYTES);
+     refcache_open_store(refcache, argv[optind+1]);
+     wdata = calloc(num_threads, sizeof(alnqual_data_t));
+     wdata_ptrs = malloc(num_threads * sizeof(void *));
+     if (! wdata || ! wdata_ptrs) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i = 0; i < num_threads; i++) {
+          wdata[i].refcache = refcache;
+          wdata[i].header = fp->header;
+          wdata[i].tid = -2;
+          wdata[i].baq_flag = baq_flag;
+          wdata[i].ext_baq = ext_baq;
+          wdata[i].idaq_flag = idaq_flag;
+          kpa_ext_ws_init(& wdata[i].ws);
+          wdata_ptrs[i] = & wdata[i];
+     }
+
+     if (bampipe_run(fp, bampipe_write_sam, fpout, alnqual_func,
+                     wdata_ptrs, num_threads) < 0) {
+          rc = 1;
+     }
+
+     for (i = 0; i < num_threads; i++) {
+          if (wdata[i].ref) {
+               refcache_release(refcache, fp->header->target_name[wdata[i].tid]);
           }
-          samwrite(fpout, b);
+          kpa_ext_ws_free(& wdata[i].ws);
      }
-     bam_destroy1(b);
-     
-     free(ref);
+     free(wdata);
+     free(wdata_ptrs);
+     refcache_free(refcache);
      fai_destroy(fai);
      samclose(fp); 
      samclose(fpout);
-     return 0;
+     return rc;
 }
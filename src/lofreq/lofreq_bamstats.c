@@ -26,7 +26,6 @@
 *
 ************************************************************************/
 
-
 /* loosely based on 0.1.18 sam_view.c */
 
 #include <stdio.h>
@@ -34,6 +33,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
 
 /* samtools includes */
 #include "sam.h"
@@ -41,13 +41,16 @@
 /* from bedidx.c */
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
-int bed_overlap(const void *_h, const char *chr, int beg, int end);
+void *bed_tidx_init(const void *_h, int n_targets, char * const *target_names);
+void bed_tidx_destroy(void *_t);
 
 /* lofreq includes */
 #include "log.h"
 #include "utils.h"
 #include "samutils.h"
 #include "defaults.h"
+#include "refcache.h"
+#include "bamstats.h"
 
 #if 1
 #define MYNAME "lofreq bamstats"
@@ -55,74 +58,27 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end);
 #define MYNAME PACKAGE
 #endif
 
-#define TYPE_MAPERRPROF 0
-#define TYPE_OPCAT 1
-
-typedef struct {
-     int min_mq;
-     int min_bq;
-     char *fa;
-     faidx_t *fai;
-     void *bed;
-     int samflags_on;
-     int samflags_off;
-     FILE *out;
-     int type;
-} bamstats_conf_t;
-
-#ifdef USE_ALNERRPROF
-
-#define WRITE_STATS  if (ref) { \
-          fprintf(bamstats_conf->out, "# Reads ignored for counting (due to bed/mq filtering): %lu\n", num_ign_reads); \
-          fprintf(bamstats_conf->out, "# Reads used for counting: %lu\n", num_good_reads); \
-          if (bamstats_conf->type == TYPE_OPCAT) { \
-               fprintf(bamstats_conf->out, "# Reads with zero matches (after bq filtering): %lu\n", num_zero_matches); \
-               write_cat_stats(target_name, read_cat_counts, num_good_reads, bamstats_conf->out); \
-          } else { \
-               write_alnerrprof_stats(target_name, alnerrprof_usedpos, alnerrprof, max_obs_read_len, bamstats_conf->out); \
-          } \
-          free(ref); \
-     }
-#else
-
-#define WRITE_STATS  if (ref) { \
-          fprintf(bamstats_conf->out, "# Reads ignored for counting (due to bed/mq filtering): %lu\n", num_ign_reads); \
-          fprintf(bamstats_conf->out, "# Reads used for counting: %lu\n", num_good_reads); \
-          if (bamstats_conf->type == TYPE_OPCAT) { \
-               fprintf(bamstats_conf->out, "# Reads with zero matches (after bq filtering): %lu\n", num_zero_matches); \
-               write_cat_stats(target_name, read_cat_counts, num_good_reads, bamstats_conf->out); \
-          } \
-          free(ref); \
-     }
-#endif
-
+/* multi-threaded counting splits targets into chunks of this size.
+ * reads are counted in the chunk they start in */
+#define BAMSTATS_CHUNK_SIZE 1000000
 
-/* adopted from sam_view.c:__g_skip_aln */
-static inline int 
-skip_aln(const bam_header_t *h, const bam1_t *b,
-         const int min_mq, const int flag_on, const int flag_off, void *bed)
-{
-     if (bed && b->core.tid >= 0 && !bed_overlap(bed, h->target_name[b->core.tid], b->core.pos, bam_calend(&b->core, bam1_cigar(b)))) {
-          /*fprintf(stderr, "Skipping because of bed: h->target_name[b->core.tid=%d] = %s; b->core.pos = %d\n", b->core.tid, h->target_name[b->core.tid], b->core.pos);*/
-          return 1;
-     }
-     if (b->core.qual < min_mq) {
-          /*fprintf(stderr, "Skipping because of flag or min_mq\n");*/
-          return 2;
-     } 
-     if (((b->core.flag & flag_on) != flag_on) || (b->core.flag & flag_off)) {
-          /*fprintf(stderr, "Skipping because of flag\n");*/
-          return 3;
-     }
-
-     /*fprintf(stderr, "Not skipping\n");*/
-     return 0;
-}
 
+/* state shared by bamstats_worker()s */
+typedef struct {
+     pthread_mutex_t lock; /* protects next_tid, next_beg and rc */
+     const char *bam_file;
+     const char *fa; /* for CRAM decoding */
+     const bam_header_t *h;
+     hts_idx_t *idx; /* shared among all threads. NULL for CRAM */
+     refcache_t *refcache;
+     bamstats_t *total; /* threads merge their counts into this */
+     int next_tid, next_beg; /* next chunk to hand out */
+     int rc;
+} bamstats_pool_t;
 
 
 static void
-usage(bamstats_conf_t *bamstats_conf)
+usage(const bamstats_conf_t *bamstats_conf)
 {
      fprintf(stderr, "%s: Compiles statistics from BAM files\n\n", MYNAME);
 
@@ -135,6 +91,7 @@ usage(bamstats_conf_t *bamstats_conf)
      fprintf(stderr, "  -o | --out FILE       Write stats to this output file [- = stdout]\n");
      fprintf(stderr, "  -q | --min-bq INT     Ignore any base with baseQ smaller than INT [%d]\n", bamstats_conf->min_bq);
      fprintf(stderr, "  -m | --min-mq INT     Ignore reads with mapQ smaller than INT [%d]\n", bamstats_conf->min_mq);
+     fprintf(stderr, "       --threads INT    Number of threads to count with. Needs an indexed BAM file [1]\n");
 #ifdef USE_ALNERRPROF
      fprintf(stderr, "       --opcat          Report cigar OP categories instead of error profile\n");
 #endif
@@ -142,165 +99,186 @@ usage(bamstats_conf_t *bamstats_conf)
 /* usage() */
 
 
-
-void
-write_cat_stats(char *target_name, unsigned long int **read_cat_counts, 
-           unsigned long int num_reads, FILE *out)
+/* counts all reads of fp in file order */
+static int
+bamstats_stream(htsFile *fp, const bam_header_t *h, bamstats_t *s)
 {
-     int i, j;
-     fprintf(out, "# Listing of proportions of reads with certain number of BAM operations (op)\n");
-     fprintf(out, "# proportions are in scientific notation or missing altogether if no reads for that count were found\n");
-     fprintf(out, "# chrom\top-category\top-count\tread-proportion\n");
-
-     for (i=0; i<NUM_OP_CATS; i++) {
-          unsigned long int cat_sum = 0;
-          for (j=0; j<MAX_READ_LEN; j++) {
-               if (read_cat_counts[i][j]) {
-#if 0
-                    fprintf(out, "%s\t%s\t%d\t%g\t(%lu/%lu)\n", 
-                            target_name, op_cat_str[i], j, read_cat_counts[i][j]/(double)num_reads, read_cat_counts[i][j], num_reads);
-#else
-                    fprintf(out, "%s\t%s\t%d\t%g\n", 
-                            target_name, op_cat_str[i], j, read_cat_counts[i][j]/(double)num_reads);
-#endif
-                    cat_sum += read_cat_counts[i][j];
-               }
+     bam1_t *b = bam_init1();
+     unsigned long int num_reads = 0;
+     int r;
+     int rc = 0;
+
+     while ((r = sam_read1(fp, (bam_header_t *)h, b)) >= 0) { /* read one alignment from `in' */
+          if (bamstats_add(s, h, b)) {
+               rc = 1;
+               break;
           }
-          if (cat_sum != num_reads) {
-               LOG_FIXME("fail cat_sum=%lu != num_reads=%lu\n", cat_sum, num_reads);
+          num_reads += 1;
+          if (0 == num_reads%1000000) {
+               LOG_VERBOSE("Still alive and happily crunching away on read number %lu\n", num_reads);
           }
      }
+     if (r < -1) {
+          LOG_FATAL("%s\n", "BAM file is truncated.");
+          rc = 1;
+     }
+     bam_destroy1(b);
+     return rc;
 }
+/* bamstats_stream() */
 
 
-int 
-bamstats(samfile_t *sam, bamstats_conf_t *bamstats_conf)
+/* hands out next chunk. returns 0 if there is none left (or another
+ * thread failed) */
+static int
+bamstats_pool_next(bamstats_pool_t *pool, int *tid, int *beg, int *end)
 {
-     char *target_name = NULL; /* chrom name */
-     char *ref = NULL; /* reference sequence */
-
-     unsigned long int **read_cat_counts;
-     unsigned long int num_good_reads = 0;
-     unsigned long int num_ign_reads = 0;
-     unsigned long int num_zero_matches = 0;
+     int got = 0;
+
+     pthread_mutex_lock(& pool->lock);
+     while (! pool->rc && pool->next_tid < pool->h->n_targets) {
+          int len = pool->h->target_len[pool->next_tid];
+          if (pool->next_beg < len) {
+               *tid = pool->next_tid;
+               *beg = pool->next_beg;
+               *end = MIN(*beg + BAMSTATS_CHUNK_SIZE, len);
+               pool->next_beg = *end;
+               got = 1;
+               break;
+          }
+          pool->next_tid += 1;
+          pool->next_beg = 0;
+     }
+     pthread_mutex_unlock(& pool->lock);
+     return got;
+}
+/* bamstats_pool_next() */
 
-#ifdef USE_ALNERRPROF
-     double alnerrprof[MAX_READ_LEN];
-     unsigned long int alnerrprof_usedpos[MAX_READ_LEN];
-#endif
 
-     int max_obs_read_len = 0;
-     int r, i, rc;
+/* counts chunks into a thread-local table, which gets merged into
+ * the pool total once all chunks are handed out */
+static void *
+bamstats_worker(void *arg)
+{
+     bamstats_pool_t *pool = (bamstats_pool_t *)arg;
+     bamstats_t *local = bamstats_new(& pool->total->conf, pool->refcache);
+     htsFile *fp = NULL;
+     bam_header_t *h = NULL;
+     hts_idx_t *idx = NULL;
      bam1_t *b = bam_init1();
+     int tid, beg, end;
+     int rc = 0;
 
-     if (bamstats_conf->type == TYPE_OPCAT) {
-         /* count_cigar_ops/read_cat_counts assume roughtly equal read length */
-         LOG_WARN("%s\n", "cigar op counts not using base qualities and assuming (roughly) equal read length");/* (which could be easily implemented for matches");*/
+     if (NULL == (fp = hts_open(pool->bam_file, "r"))) {
+          LOG_FATAL("Couldn't open %s\n", pool->bam_file);
+          rc = 1;
+          goto done;
      }
-
-#ifdef USE_ALNERRPROF
-     memset(alnerrprof_usedpos, 0, MAX_READ_LEN * sizeof(unsigned long int));
-     memset(alnerrprof, 0, MAX_READ_LEN * sizeof(double));
-#endif
-
-     read_cat_counts = calloc(NUM_OP_CATS, sizeof(unsigned long int *));
-     for (i=0; i<NUM_OP_CATS; i++) {
-          read_cat_counts[i] = calloc(MAX_READ_LEN, sizeof(unsigned long int));
+     if (fp->is_cram && hts_set_fai_filename(fp, pool->fa)) {
+          LOG_FATAL("Couldn't use reference %s for decoding %s\n", pool->fa, pool->bam_file);
+          rc = 1;
+          goto done;
+     }
+     if (NULL == (h = sam_hdr_read(fp))) {
+          LOG_FATAL("Couldn't read header of %s\n", pool->bam_file);
+          rc = 1;
+          goto done;
+     }
+     /* CRAM indices are bound to their file handle */
+     if (NULL == (idx = pool->idx ? pool->idx : sam_index_load(fp, pool->bam_file))) {
+          LOG_FATAL("Couldn't load index for %s\n", pool->bam_file);
+          rc = 1;
+          goto done;
      }
-     
-     while ((r = samread(sam, b)) >= 0) { /* read one alignment from `in' */
-          int counts[NUM_OP_CATS];
-          int ref_len = -1;
-          if (skip_aln(sam->header, b, bamstats_conf->min_mq, 
-                       bamstats_conf->samflags_on, bamstats_conf->samflags_off,
-                       bamstats_conf->bed)) {
-               num_ign_reads += 1;
-               continue;
-          }
-          num_good_reads += 1;
-
-          if (b->core.l_qseq > max_obs_read_len) {
-              max_obs_read_len = b->core.l_qseq;
-              if (max_obs_read_len>=MAX_READ_LEN) {
-                  LOG_FATAL("%s\n", "Reached maximum read length");
-                  return 1;
-              }
-          }
-
-          if (0 == (num_good_reads+num_ign_reads)%1000000) {
-               LOG_VERBOSE("Still alive and happily crunching away on read number %d\n", (num_good_reads+num_ign_reads));
-          }
-
-          /* load ref only if necessary. also triggers output of
-           * stats per chrom */
-          if (ref == NULL || strcmp(target_name, sam->header->target_name[b->core.tid]) != 0) {
-               /* write report. use macro to avoid code duplication with below */
-               WRITE_STATS;
-
-               /* reset everything for next chrom... */
-               for (i=0; i<NUM_OP_CATS; i++) {
-                    memset(read_cat_counts[i], 0, MAX_READ_LEN * sizeof(unsigned long int));
-               }
-
-#ifdef USE_ALNERRPROF
-               memset(alnerrprof_usedpos, 0, MAX_READ_LEN * sizeof(unsigned long int));
-               memset(alnerrprof, 0, MAX_READ_LEN * sizeof(double));
-#endif
-               max_obs_read_len = 0;
-               num_good_reads = num_ign_reads = num_zero_matches = 0;
 
-               target_name = sam->header->target_name[b->core.tid];
-               ref = faidx_fetch_seq(bamstats_conf->fai, target_name,
-                                     0, 0x7fffffff, &ref_len);
-               strtoupper(ref);/* safeguard */
-          }
+     while (! rc && bamstats_pool_next(pool, &tid, &beg, &end)) {
+          hts_itr_t *iter;
+          int r;
 
-          if (bamstats_conf->type == TYPE_OPCAT) {
-               if (-1 == count_cigar_ops(counts, NULL, b, ref, bamstats_conf->min_mq, sam->header->target_name[b->core.tid])) {
-                    LOG_WARN("%s\n", "count_cigar_ops failed on read. ignoring"); /* FIXME print read */
-                    continue;
-               }
-          } else {
-#ifdef USE_ALNERRPROF
-               calc_read_alnerrprof(alnerrprof, alnerrprof_usedpos, b, ref);
-#endif
+          if (NULL == (iter = sam_itr_queryi(idx, tid, beg, end))) {
+               LOG_FATAL("Couldn't query %s:%d-%d\n", h->target_name[tid], beg+1, end);
+               rc = 1;
+               break;
           }
-
-          if (bamstats_conf->type == TYPE_OPCAT) {
-               for (i=0; i<NUM_OP_CATS; i++) {
-                    assert(counts[i]<MAX_READ_LEN);               
-                    read_cat_counts[i][counts[i]] += 1;
+          while ((r = sam_itr_next(fp, iter, b)) >= 0) {
+               if (b->core.pos < beg) {
+                    continue; /* counted with previous chunk */
                }
-               if (0 == counts[OP_MATCH]) {
-                    LOG_DEBUG("Got read with zero matches after filtering with min_mq %d: name:%s cigar:%s qual:%s\n", 
-                              bamstats_conf->min_mq, bam1_qname(b), cigar_str_from_bam(b), bam1_qual(b));
-                    num_zero_matches += 1;
+               if (bamstats_add(local, h, b)) {
+                    rc = 1;
+                    break;
                }
           }
-#if 0
-          LOG_DEBUG("good/ign=%u/%u: m=%d mm=%d i=%d d=%d\n", num_good_reads, num_ign_reads,
-                    counts[OP_MATCH], counts[OP_MISMATCH], counts[OP_INS], counts[OP_DEL]);               
-#endif
+          if (r < -1) {
+               LOG_FATAL("%s\n", "BAM file is truncated.");
+               rc = 1;
+          }
+          hts_itr_destroy(iter);
      }
-               
-     /* don't forget to output last seen chrom. use macro to avoid code duplication with above */
-     WRITE_STATS;
 
-     
-     for (i=0; i<NUM_OP_CATS; i++) {
-          free(read_cat_counts[i]);
+done:
+     bamstats_merge(pool->total, local);
+     bamstats_free(local);
+     bam_destroy1(b);
+     if (idx && idx != pool->idx) {
+          hts_idx_destroy(idx);
      }
-     free(read_cat_counts);
-     
-     if (r < -1) {
-          LOG_FATAL("%s\n", "BAM file is truncated.\n");
-          rc = 1;
-     } else {
-          rc = 0;
-          bam_destroy1(b);
+     if (h) {
+          bam_header_destroy(h);
      }
-     return rc;
+     if (fp) {
+          hts_close(fp);
+     }
+     if (rc) {
+          pthread_mutex_lock(& pool->lock);
+          pool->rc = rc;
+          pthread_mutex_unlock(& pool->lock);
+     }
+     return NULL;
 }
+/* bamstats_worker() */
+
+
+/* counts all placed reads with num_threads threads, each working on
+ * index regions */
+static int
+bamstats_threaded(htsFile *fp, const char *bam_file, const char *fa,
+                  const bam_header_t *h, hts_idx_t *idx,
+                  refcache_t *refcache, bamstats_t *total,
+                  const int num_threads)
+{
+     bamstats_pool_t pool;
+     pthread_t *threads;
+     int i;
+
+     memset(& pool, 0, sizeof(bamstats_pool_t));
+     pthread_mutex_init(& pool.lock, NULL);
+     pool.bam_file = bam_file;
+     pool.fa = fa;
+     pool.h = h;
+     pool.idx = fp->is_cram ? NULL : idx;
+     pool.refcache = refcache;
+     pool.total = total;
+
+     if (NULL == (threads = malloc(num_threads * sizeof(pthread_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<num_threads; i++) {
+          if (pthread_create(& threads[i], NULL, bamstats_worker, & pool)) {
+               LOG_FATAL("Couldn't create thread #%d\n", i+1);
+               exit(1);
+          }
+     }
+     for (i=0; i<num_threads; i++) {
+          pthread_join(threads[i], NULL);
+     }
+     free(threads);
+     pthread_mutex_destroy(& pool.lock);
+     return pool.rc;
+}
+/* bamstats_threaded() */
 
 
 int 
@@ -308,7 +286,17 @@ main_bamstats(int argc, char *argv[])
 {
      char *bamfile = NULL;
      char *bedfile = NULL;
-     samfile_t *sam =  NULL;
+     char *fa = NULL;
+     faidx_t *fai = NULL;
+     void *bed = NULL;
+     void *bed_tidx = NULL; /* bed resolved against header */
+     FILE *out = stdout;
+     htsFile *fp = NULL;
+     bam_header_t *h = NULL;
+     hts_idx_t *idx = NULL;
+     refcache_t *refcache = NULL;
+     bamstats_t *stats = NULL;
+     int num_threads = 1;
      int rc = 0;
      bamstats_conf_t bamstats_conf;
 #ifdef USE_ALNERRPROF
@@ -317,17 +305,7 @@ main_bamstats(int argc, char *argv[])
      static int report_opcat = 1;
 #endif     
 
-     memset(&bamstats_conf, 0, sizeof(bamstats_conf_t));
-     bamstats_conf.out = stdout;
-     bamstats_conf.min_mq = DEFAULT_MIN_MQ;
-     bamstats_conf.min_bq = DEFAULT_MIN_BQ;
-     /* will skip read if any of the following is set */
-     bamstats_conf.samflags_off = 0;
-     bamstats_conf.samflags_off |= 0x4; /* segment unmapped */
-     bamstats_conf.samflags_off |= 0x100; /* secondary alignment */
-     bamstats_conf.samflags_off |= 0x200; /* not passing quality controls */
-     bamstats_conf.samflags_off |= 0x400; /* PCR or optical duplicate */
-     bamstats_conf.samflags_off |= 0x800; /* supplementary alignment */
+     bamstats_conf_init(& bamstats_conf);
 
      /* FIXME enable BAQ on request ? */
 
@@ -345,6 +323,7 @@ main_bamstats(int argc, char *argv[])
                {"out", required_argument, NULL, 'o'},
                {"min-bq", required_argument, NULL, 'q'},
                {"min-mq", required_argument, NULL, 'm'},
+               {"threads", required_argument, NULL, 't'}, /* long only */
 
                {"help", no_argument, NULL, 'h'},
                {"verbose", no_argument, &verbose, 1},
@@ -378,9 +357,9 @@ main_bamstats(int argc, char *argv[])
               break;
 
           case 'f':
-               bamstats_conf.fa = strdup(optarg);
-               bamstats_conf.fai = fai_load(optarg);
-               if (bamstats_conf.fai == 0)  {
+               fa = strdup(optarg);
+               fai = fai_load(optarg);
+               if (fai == 0)  {
                     rc = 1;
                     goto free_and_exit;
                }
@@ -393,9 +372,9 @@ main_bamstats(int argc, char *argv[])
                          rc = 1;
                          goto free_and_exit;
                     }
-                    bamstats_conf.out = fopen(optarg, "w");
+                    out = fopen(optarg, "w");
                } else {
-                    bamstats_conf.out = stdout;
+                    out = stdout;
                }
                break;
                
@@ -407,6 +386,10 @@ main_bamstats(int argc, char *argv[])
               bamstats_conf.min_mq = atoi(optarg); 
               break;
 
+          case 't': 
+              num_threads = atoi(optarg); 
+              break;
+
          case '?': 
                LOG_FATAL("%s\n", "Unrecognized arguments found. Exiting...\n"); 
                rc = 1;
@@ -416,7 +399,7 @@ main_bamstats(int argc, char *argv[])
                break;
           }
      }
-     bamstats_conf.type = report_opcat;
+     bamstats_conf.type = report_opcat ? BAMSTATS_OPCAT : BAMSTATS_ALNERRPROF;
      
      if (argc == 2) {
           fprintf(stderr, "\n");
@@ -431,54 +414,116 @@ main_bamstats(int argc, char *argv[])
           goto free_and_exit;
      }
      bamfile = (argv + optind + 1)[0];
-     /*if (0 != strcmp(optarg, "-")) {*/
+     if (0 != strcmp(bamfile, "-")) {
           if (!file_exists(bamfile)) {
                LOG_FATAL("BAM file %s does not exist.\n\n", bamfile);
                rc = 1;
                goto free_and_exit;
           }
-/*     }*/
+     }
      
-     if (NULL == bamstats_conf.fa) {
+     if (NULL == fa) {
           LOG_FATAL("%s\n\n", "ERROR: Missing reference fasta argument");
           usage(&bamstats_conf);
           rc = 1;
           goto free_and_exit;
      }
 
+     if (num_threads < 1) {
+          LOG_FATAL("%s\n", "Number of threads has to be >= 1");
+          rc = 1;
+          goto free_and_exit;
+     }
+
      if (bedfile) {
           LOG_VERBOSE("%s\n", "NOTE: bed routines don't make use of indexing and are therefore as slow as reading the whole BAM file."); /* FIXME */
-          bamstats_conf.bed = bed_read(bedfile);
-          if (! bamstats_conf.bed) {
-               LOG_FATAL("BAM file %s does not exist.\n\n", bedfile);
+          bed = bed_read(bedfile);
+          if (! bed) {
+               LOG_FATAL("BED file %s does not exist.\n\n", bedfile);
                rc = 1;
                goto free_and_exit;
           }
      }
 
-
+     if (bamstats_conf.type == BAMSTATS_OPCAT) {
+         /* count_cigar_ops/read_cat_counts assume roughtly equal read length */
+         LOG_WARN("%s\n", "cigar op counts not using base qualities and assuming (roughly) equal read length");/* (which could be easily implemented for matches");*/
+     }
     
-     if ((sam = samopen(bamfile, "rb", NULL)) == 0) {
+     if (NULL == (fp = hts_open(bamfile, "r"))) {
           LOG_FATAL("Failed to open \"%s\" for reading.\n", bamfile);
           rc = 1;
+          goto free_and_exit;
+     }
+     if (fp->is_cram && hts_set_fai_filename(fp, fa)) {
+          LOG_FATAL("Couldn't use reference %s for decoding %s\n", fa, bamfile);
+          rc = 1;
+          goto free_and_exit;
+     }
+     if (NULL == (h = sam_hdr_read(fp))) {
+          LOG_FATAL("Couldn't read header of %s\n", bamfile);
+          rc = 1;
+          goto free_and_exit;
+     }
+     if (bed) {
+          /* shared by all threads */
+          bed_tidx = bed_tidx_init(bed, h->n_targets, h->target_name);
+          bamstats_conf.bed_tidx = bed_tidx;
+     }
+     if (NULL == (refcache = refcache_new(fai, REFCACHE_DEFAULT_MAX_BYTES))) {
+          rc = 1;
+          goto free_and_exit;
+     }
+     refcache_open_store(refcache, fa);
+     stats = bamstats_new(& bamstats_conf, refcache);
+
+     if (num_threads > 1 && 0 != strcmp(bamfile, "-")) {
+          if (NULL == (idx = sam_index_load(fp, bamfile))) {
+               LOG_WARN("Couldn't load index for %s. Falling back to one thread\n", bamfile);
+               num_threads = 1;
+          }
+     } else if (num_threads > 1) {
+          LOG_WARN("%s\n", "Can't use more than one thread when reading from stdin");
+          num_threads = 1;
+     }
+
+     if (num_threads > 1) {
+          rc = bamstats_threaded(fp, bamfile, fa, h, idx, refcache, stats, num_threads);
      } else {
-          rc = bamstats(sam, &bamstats_conf);
-          samclose(sam);
+          rc = bamstats_stream(fp, h, stats);
+     }
+     if (0 == rc) {
+          bamstats_write(stats, out);
      }
 
 free_and_exit:
 
-     if (bamstats_conf.out != stdout) {
-          fclose(bamstats_conf.out);
+     /* stats might hold a reference */
+     bamstats_free(stats);
+     refcache_free(refcache);
+     if (idx) {
+          hts_idx_destroy(idx);
+     }
+     if (h) {
+          bam_header_destroy(h);
      }
-     free(bamstats_conf.fa);
-     if (bamstats_conf.fai) {
-         fai_destroy(bamstats_conf.fai);
+     if (fp) {
+          hts_close(fp);
+     }
+     if (out != stdout) {
+          fclose(out);
+     }
+     free(fa);
+     if (fai) {
+         fai_destroy(fai);
      }
 
      free(bedfile);
-     if (bamstats_conf.bed) {
-          bed_destroy(bamstats_conf.bed);
+     if (bed_tidx) {
+          bed_tidx_destroy(bed_tidx);
+     }
+     if (bed) {
+          bed_destroy(bed);
      }
 
      if (0==rc) {
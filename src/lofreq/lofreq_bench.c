@@ -0,0 +1,825 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+/* lofreq-bench: repeatable micro- and end-to-end benchmarks for the
+ * numerical kernels and the pileup. All inputs are synthetic and
+ * generated from a fixed seed, so that numbers are comparable between
+ * builds. Results go to stdout as JSON lines, one per benchmark and
+ * parameter set, including a checksum of the results that should
+ * only change if the computation changes.
+ *
+ * Build with 'make lofreq-bench' in src/lofreq (or 'make bench' at
+ * the top level, which also runs it). See devel-doc/debug.README
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "htslib/faidx.h"
+
+#include "log.h"
+#include "utils.h"
+#include "snpcaller.h"
+#include "kprobaln_ext.h"
+#include "viterbi.h"
+#include "multtest.h"
+#include "fet.h"
+#include "vcf.h"
+#include "plp.h"
+#include "profile.h"
+
+
+#define BENCH_DEFAULT_SEED 13
+#define BENCH_DEFAULT_MIN_TIME 0.5 /* seconds per benchmark */
+
+
+typedef struct {
+     double min_time;
+     uint64_t seed;
+     int quick;
+     const char *only; /* run only benchmarks whose name contains this */
+     const char *bam;
+     const char *ref;
+     const char *reg;
+} bench_conf_t;
+
+static uint64_t rng_state;
+
+
+/* splitmix64: same sequence on all platforms, unlike rand() */
+static uint64_t
+rng_next(void)
+{
+     uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+     z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+     z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+     return z ^ (z >> 31);
+}
+/* rng_next() */
+
+
+/* uniform in [0,1) */
+static double
+rng_unif(void)
+{
+     return (rng_next() >> 11) * (1.0/9007199254740992.0);
+}
+/* rng_unif() */
+
+
+static int
+rng_int(const int n)
+{
+     return (int)(rng_next() % (uint64_t)n);
+}
+/* rng_int() */
+
+
+/* random phred quality in [lo, hi] */
+static int
+rng_qual(const int lo, const int hi)
+{
+     return lo + rng_int(hi-lo+1);
+}
+/* rng_qual() */
+
+
+static int
+bench_wanted(const bench_conf_t *conf, const char *name)
+{
+     return NULL == conf->only || NULL != strstr(name, conf->only);
+}
+/* bench_wanted() */
+
+
+/* params is a JSON object body, e.g. "\"N\": 100" */
+static void
+bench_report(const char *name, const char *params, const long int reps,
+             const long int ops_per_rep, const uint64_t ns, const double checksum)
+{
+     printf("{\"bench\": \"%s\", %s%s\"reps\": %ld, \"total_s\": %.6f,"
+            " \"ns_per_op\": %.3f, \"checksum\": %.10g}\n",
+            name, params, params[0] ? ", " : "", reps, ns/1e9,
+            ns/(double)reps/(double)ops_per_rep, checksum);
+     fflush(stdout);
+}
+/* bench_report() */
+
+
+/* ---------- Poisson-binomial ---------- */
+
+
+static void
+bench_pb(const bench_conf_t *conf)
+{
+     const int params[][2] = {{100, 5}, {1000, 10}, {10000, 10}, {10000, 100}, {100000, 20}};
+     const int num_params = conf->quick ? 3 : sizeof(params)/sizeof(params[0]);
+     const char *names[] = {"pruned_calc_prob_dist", "linear_calc_prob_dist"};
+     int p, kernel;
+
+     for (kernel=0; kernel<2; kernel++) {
+          if (! bench_wanted(conf, names[kernel])) {
+               continue;
+          }
+          for (p=0; p<num_params; p++) {
+               const int N = params[p][0];
+               const int K = params[p][1];
+               double *err_probs;
+               double checksum = 0.0;
+               long int reps = 0, batch = 1;
+               uint64_t ns = 0;
+               char pstr[64];
+               int i;
+
+               rng_state = conf->seed;
+               if (NULL == (err_probs = malloc(N * sizeof(double)))) {
+                    LOG_FATAL("%s\n", "Memory allocation failed");
+                    exit(1);
+               }
+               for (i=0; i<N; i++) {
+                    err_probs[i] = PHREDQUAL_TO_PROB(rng_qual(20, 40));
+               }
+               qsort(err_probs, N, sizeof(double), dbl_cmp);
+
+               /* bonf=1 and sig=1 means no pruning, i.e. full DP */
+               while (ns < conf->min_time*1e9) {
+                    uint64_t start = prof_now();
+                    for (i=0; i<batch; i++) {
+                         double *probvec;
+                         if (0 == kernel) {
+                              probvec = pruned_calc_prob_dist(err_probs, N, K, 1, 1.0);
+                         } else {
+                              probvec = linear_calc_prob_dist(err_probs, N, K, 1, 1.0);
+                         }
+                         checksum = probvec[K];
+                         free(probvec);
+                    }
+                    ns += prof_now() - start;
+                    reps += batch;
+                    batch *= 2;
+               }
+               snprintf(pstr, sizeof(pstr), "\"N\": %d, \"K\": %d", N, K);
+               /* op = one read (DP row) */
+               bench_report(names[kernel], pstr, reps, N, ns, checksum);
+               free(err_probs);
+          }
+     }
+}
+/* bench_pb() */
+
+
+/* ---------- BAQ/IDAQ ---------- */
+
+
+static void
+bench_kpa(const bench_conf_t *conf)
+{
+     const int read_lens[] = {100, 150, 250};
+     const int num_lens = sizeof(read_lens)/sizeof(read_lens[0]);
+     const int num_reads = 256;
+     const int bw = 7; /* as in bam_prob_realn_core_ext() */
+     int l, with_pd;
+
+     for (with_pd=0; with_pd<2; with_pd++) {
+          const char *name = with_pd ? "kpa_ext_glocal_idaq" : "kpa_ext_glocal_baq";
+          if (! bench_wanted(conf, name)) {
+               continue;
+          }
+          for (l=0; l<num_lens; l++) {
+               const int l_query = read_lens[l];
+               const int l_ref = l_query + bw;
+               uint8_t *refs, *queries, *quals, *q;
+               int *state;
+               kpa_ext_ws_t ws;
+               kpa_ext_par_t par = kpa_ext_par_lofreq_illumina;
+               double checksum = 0.0;
+               long int reps = 0, batch = 1;
+               uint64_t ns = 0;
+               char pstr[64];
+               int i, j;
+
+               rng_state = conf->seed;
+               refs = malloc(num_reads * l_ref);
+               queries = malloc(num_reads * l_query);
+               quals = malloc(num_reads * l_query);
+               q = malloc(l_query);
+               state = malloc(l_query * sizeof(int));
+               if (! refs || ! queries || ! quals || ! q || ! state) {
+                    LOG_FATAL("%s\n", "Memory allocation failed");
+                    exit(1);
+               }
+               /* reads taken from the middle of their ref window
+                * with about 1% mismatches and one 1bp deletion each */
+               for (i=0; i<num_reads; i++) {
+                    uint8_t *r = refs + i*l_ref;
+                    uint8_t *s = queries + i*l_query;
+                    int del_pos = 10 + rng_int(l_query-20);
+                    for (j=0; j<l_ref; j++) {
+                         r[j] = rng_int(4);
+                    }
+                    for (j=0; j<l_query; j++) {
+                         int rpos = bw/2 + j + (j >= del_pos ? 1 : 0);
+                         s[j] = rng_unif() < 0.01 ? (r[rpos]+1)%4 : r[rpos];
+                         quals[i*l_query+j] = rng_qual(10, 40);
+                    }
+               }
+               par.bw = bw;
+               kpa_ext_ws_init(&ws);
+
+               /* checksum from one untimed pass over all reads, which
+                * also warms up the workspace */
+               for (i=0; i<num_reads; i++) {
+                    double **pd = NULL;
+                    int ret_bw;
+                    kpa_ext_glocal(&ws, refs + i*l_ref, l_ref, queries + i*l_query, l_query,
+                                   quals + i*l_query, &par, state, q,
+                                   with_pd ? &pd : NULL, &ret_bw);
+                    for (j=0; j<l_query; j++) {
+                         checksum += q[j];
+                    }
+               }
+
+               while (ns < conf->min_time*1e9) {
+                    uint64_t start = prof_now();
+                    for (j=0; j<batch; j++) {
+                         double **pd = NULL;
+                         int ret_bw;
+                         i = j % num_reads;
+                         kpa_ext_glocal(&ws, refs + i*l_ref, l_ref, queries + i*l_query, l_query,
+                                        quals + i*l_query, &par, state, q,
+                                        with_pd ? &pd : NULL, &ret_bw);
+                    }
+                    ns += prof_now() - start;
+                    reps += batch;
+                    batch *= 2;
+               }
+               snprintf(pstr, sizeof(pstr), "\"read_len\": %d", l_query);
+               bench_report(name, pstr, reps, 1, ns, checksum);
+
+               kpa_ext_ws_free(&ws);
+               free(refs); free(queries); free(quals); free(q); free(state);
+          }
+     }
+}
+/* bench_kpa() */
+
+
+/* ---------- Viterbi ---------- */
+
+
+static void
+bench_viterbi(const bench_conf_t *conf)
+{
+     const int read_lens[] = {100, 150, 250};
+     const int num_lens = sizeof(read_lens)/sizeof(read_lens[0]);
+     const int num_reads = 256;
+     const int rwin = 10; /* padding as in lofreq_viterbi.c */
+     const int band_pad = 3*rwin;
+     const char *name = "viterbi_banded";
+     int l;
+
+     if (! bench_wanted(conf, name)) {
+          return;
+     }
+     for (l=0; l<num_lens; l++) {
+          const int l_query = read_lens[l];
+          const int l_ref = l_query + 2*rwin + 1;
+          char *refs, *queries, *quals, *aln;
+          viterbi_ws_t ws;
+          double checksum = 0.0;
+          long int reps = 0, batch = 1;
+          uint64_t ns = 0;
+          char pstr[64];
+          int i, j;
+
+          rng_state = conf->seed;
+          refs = malloc(num_reads * (l_ref+1));
+          queries = malloc(num_reads * (l_query+1));
+          quals = malloc(num_reads * (l_query+1));
+          aln = malloc(2*l_query);
+          if (! refs || ! queries || ! quals || ! aln) {
+               LOG_FATAL("%s\n", "Memory allocation failed");
+               exit(1);
+          }
+          /* one 1bp deletion per read, as realigned by lofreq viterbi */
+          for (i=0; i<num_reads; i++) {
+               char *r = refs + i*(l_ref+1);
+               char *s = queries + i*(l_query+1);
+               char *bq = quals + i*(l_query+1);
+               int del_pos = 10 + rng_int(l_query-20);
+               for (j=0; j<l_ref; j++) {
+                    r[j] = "ACGT"[rng_int(4)];
+               }
+               r[l_ref] = '\0';
+               for (j=0; j<l_query; j++) {
+                    s[j] = r[rwin + j + (j >= del_pos ? 1 : 0)];
+                    bq[j] = 33 + rng_qual(10, 40);
+               }
+               s[l_query] = bq[l_query] = '\0';
+          }
+          viterbi_ws_init(&ws);
+
+          /* checksum from one untimed pass, see bench_kpa() */
+          for (i=0; i<num_reads; i++) {
+               checksum += viterbi_banded(&ws, refs + i*(l_ref+1), queries + i*(l_query+1),
+                                          quals + i*(l_query+1), aln, 20,
+                                          rwin-band_pad, rwin+1+band_pad);
+               for (j=0; j<2*l_query && aln[j]; j++) {
+                    checksum += aln[j];
+               }
+          }
+
+          while (ns < conf->min_time*1e9) {
+               uint64_t start = prof_now();
+               for (j=0; j<batch; j++) {
+                    i = j % num_reads;
+                    viterbi_banded(&ws, refs + i*(l_ref+1), queries + i*(l_query+1),
+                                   quals + i*(l_query+1), aln, 20,
+                                   rwin-band_pad, rwin+1+band_pad);
+               }
+               ns += prof_now() - start;
+               reps += batch;
+               batch *= 2;
+          }
+          snprintf(pstr, sizeof(pstr), "\"read_len\": %d", l_query);
+          bench_report(name, pstr, reps, 1, ns, checksum);
+
+          viterbi_ws_free(&ws);
+          free(refs); free(queries); free(quals); free(aln);
+     }
+}
+/* bench_viterbi() */
+
+
+/* ---------- multiple testing ---------- */
+
+
+static void
+bench_multtest(const bench_conf_t *conf)
+{
+     const long int sizes[] = {1000000, 10000000, 100000000};
+     const int num_sizes = conf->quick ? 1 : sizeof(sizes)/sizeof(sizes[0]);
+     const char *names[] = {"fdr", "holm_bonf_corr"};
+     int s, m;
+
+     for (m=0; m<2; m++) {
+          if (! bench_wanted(conf, names[m])) {
+               continue;
+          }
+          for (s=0; s<num_sizes; s++) {
+               const long int n = sizes[s];
+               double *pvalues, *data;
+               double checksum = 0.0;
+               long int reps = 0;
+               uint64_t ns = 0;
+               char pstr[64];
+               long int i;
+
+               rng_state = conf->seed;
+               pvalues = malloc(n * sizeof(double));
+               data = malloc(n * sizeof(double));
+               if (! pvalues || ! data) {
+                    LOG_WARN("Not enough memory for %s with %ld pvalues. Skipping\n", names[m], n);
+                    free(pvalues); free(data);
+                    continue;
+               }
+               /* mostly uniform (null) with 0.1% true positives */
+               for (i=0; i<n; i++) {
+                    pvalues[i] = rng_unif() < 0.001 ? rng_unif()*1e-9 : rng_unif();
+               }
+
+               /* input gets modified, so copy outside of timing. big
+                * inputs take long enough to run only once */
+               do {
+                    uint64_t start;
+                    memcpy(data, pvalues, n * sizeof(double));
+                    start = prof_now();
+                    if (0 == m) {
+                         long int *irejected = NULL;
+                         checksum = fdr(data, n, 0.001, n, &irejected);
+                         free(irejected);
+                    } else {
+                         holm_bonf_corr(data, n, 0.001, n);
+                         checksum = 0.0;
+                         for (i=0; i<n; i++) {
+                              checksum += data[i] < 0.001 ? 1 : 0;
+                         }
+                    }
+                    ns += prof_now() - start;
+                    reps += 1;
+               } while (ns < conf->min_time*1e9);
+
+               snprintf(pstr, sizeof(pstr), "\"num_pvalues\": %ld", n);
+               bench_report(names[m], pstr, reps, n, ns, checksum);
+               free(pvalues); free(data);
+          }
+     }
+}
+/* bench_multtest() */
+
+
+/* ---------- Fisher's exact test (strand bias) ---------- */
+
+
+static void
+bench_fisher(const bench_conf_t *conf)
+{
+     /* more tables than kt_fisher_exact() memoizes, i.e. this measures
+      * the test itself */
+     const int num_tables = 10000;
+     const int depths[] = {100, 1000, 10000, 100000};
+     const int num_depths = conf->quick ? 2 : sizeof(depths)/sizeof(depths[0]);
+     const char *names[] = {"fisher_exact_full", "fisher_exact"};
+     int d, m;
+
+     for (m=0; m<2; m++) {
+          if (! bench_wanted(conf, names[m])) {
+               continue;
+          }
+          for (d=0; d<num_depths; d++) {
+               const int dp = depths[d];
+               int *tables;
+               double checksum = 0.0;
+               long int reps = 0;
+               uint64_t ns = 0;
+               char pstr[64];
+               int i;
+
+               rng_state = conf->seed;
+               if (NULL == (tables = malloc(4 * num_tables * sizeof(int)))) {
+                    LOG_FATAL("%s\n", "Memory allocation failed");
+                    exit(1);
+               }
+               /* DP4 of a variant with AF up to 10% and some strand bias */
+               for (i=0; i<num_tables; i++) {
+                    int alt = 1 + rng_int(MAX(1, dp/10));
+                    int ref = dp - alt;
+                    int ref_fw = ref/2 + rng_int(MAX(1, ref/10));
+                    int alt_fw = rng_int(alt+1);
+                    tables[4*i] = ref_fw;
+                    tables[4*i+1] = ref - ref_fw;
+                    tables[4*i+2] = alt_fw;
+                    tables[4*i+3] = alt - alt_fw;
+               }
+
+               while (ns < conf->min_time*1e9) {
+                    uint64_t start = prof_now();
+                    checksum = 0.0;
+                    for (i=0; i<num_tables; i++) {
+                         double left, right, two;
+                         const int *t = & tables[4*i];
+                         if (0 == m) {
+                              (void) kt_fisher_exact_full(t[0], t[1], t[2], t[3], &left, &right, &two);
+                         } else {
+                              (void) kt_fisher_exact(t[0], t[1], t[2], t[3], &left, &right, &two);
+                         }
+                         checksum += PROB_TO_PHREDQUAL_SAFE(two);
+                    }
+                    ns += prof_now() - start;
+                    reps += 1;
+               }
+               snprintf(pstr, sizeof(pstr), "\"depth\": %d", dp);
+               bench_report(names[m], pstr, reps, num_tables, ns, checksum);
+               free(tables);
+          }
+     }
+}
+/* bench_fisher() */
+
+
+/* ---------- error probabilities of a column ---------- */
+
+
+static void
+bench_errprobs(const bench_conf_t *conf)
+{
+     const int depths[] = {100, 1000, 10000};
+     const int num_depths = sizeof(depths)/sizeof(depths[0]);
+     const char *name = "plp_to_errprobs";
+     varcall_conf_t varcall_conf;
+     int d;
+
+     if (! bench_wanted(conf, name)) {
+          return;
+     }
+     init_varcall_conf(&varcall_conf);
+     varcall_conf.flag |= VARCALL_USE_BAQ | VARCALL_USE_MQ;
+     for (d=0; d<num_depths; d++) {
+          const int dp = depths[d];
+          plp_col_t p;
+          double *err_probs;
+          int num_err_probs;
+          int alt_bases[3], alt_counts[3], alt_raw_counts[3];
+          double checksum = 0.0;
+          long int reps = 0, batch = 1;
+          uint64_t ns = 0;
+          char pstr[64];
+          int i, j;
+
+          rng_state = conf->seed;
+          plp_col_init(&p);
+          p.ref_base = 'A';
+          p.coverage_plp = dp;
+          /* 2% errors spread over the three other bases */
+          for (i=0; i<dp; i++) {
+               int nt4 = rng_int(50) ? 0 : 1 + rng_int(3);
+               PLP_COL_ADD_QUAL(& p.base_quals[nt4], rng_qual(2, 40));
+               PLP_COL_ADD_QUAL(& p.baq_quals[nt4], rng_qual(2, 40));
+               PLP_COL_ADD_QUAL(& p.map_quals[nt4], rng_int(20) ? 60 : rng_qual(0, 59));
+          }
+
+          plp_to_errprobs(&err_probs, &num_err_probs,
+                          alt_bases, alt_counts, alt_raw_counts, &p, &varcall_conf);
+          for (j=0; j<num_err_probs; j++) {
+               checksum += err_probs[j];
+          }
+          free(err_probs);
+
+          while (ns < conf->min_time*1e9) {
+               uint64_t start = prof_now();
+               for (j=0; j<batch; j++) {
+                    plp_to_errprobs(&err_probs, &num_err_probs,
+                                    alt_bases, alt_counts, alt_raw_counts, &p, &varcall_conf);
+                    free(err_probs);
+               }
+               ns += prof_now() - start;
+               reps += batch;
+               batch *= 2;
+          }
+          snprintf(pstr, sizeof(pstr), "\"depth\": %d", dp);
+          bench_report(name, pstr, reps, dp, ns, checksum);
+          plp_col_free(&p);
+     }
+}
+/* bench_errprobs() */
+
+
+/* ---------- VCF parsing ---------- */
+
+
+static void
+bench_vcf_parse(const bench_conf_t *conf)
+{
+     const int num_vars = conf->quick ? 100000 : 1000000;
+     const char *name = "vcf_parse_var";
+     char path[] = "/tmp/lofreq-bench.XXXXXX";
+     FILE *fh;
+     int fd, i;
+     double checksum = 0.0;
+     long int reps = 0;
+     uint64_t ns = 0;
+     char pstr[64];
+
+     if (! bench_wanted(conf, name)) {
+          return;
+     }
+     if (-1 == (fd = mkstemp(path)) || NULL == (fh = fdopen(fd, "w"))) {
+          LOG_ERROR("Couldn't create temporary file %s\n", path);
+          return;
+     }
+     rng_state = conf->seed;
+     fprintf(fh, "##fileformat=VCFv4.0\n");
+     fprintf(fh, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+     for (i=0; i<num_vars; i++) {
+          int dp = 100 + rng_int(10000);
+          int ac = 1 + rng_int(dp/10);
+          fprintf(fh, "chr%d\t%d\t.\t%c\t%c\t%d\tPASS\tDP=%d;AF=%f;SB=%d;DP4=%d,%d,%d,%d\n",
+                  1 + i*22/num_vars, 1 + i*10 + rng_int(10), "ACGT"[i%4], "ACGT"[(i+1)%4],
+                  rng_int(1000), dp, ac/(float)dp, rng_int(100),
+                  (dp-ac)/2, (dp-ac)-(dp-ac)/2, ac/2, ac-ac/2);
+     }
+     fclose(fh);
+
+     do {
+          vcf_file_t vcf_file;
+          uint64_t start = prof_now();
+          if (vcf_file_open(& vcf_file, path, 0, 'r')) {
+               LOG_ERROR("Couldn't open %s\n", path);
+               break;
+          }
+          vcf_skip_header(& vcf_file);
+          checksum = 0.0;
+          while (1) {
+               var_t *var;
+               vcf_new_var(&var);
+               if (vcf_parse_var(& vcf_file, var)) {
+                    vcf_free_var(&var);
+                    break;
+               }
+               checksum += var->pos;
+               vcf_free_var(&var);
+          }
+          vcf_file_close(& vcf_file);
+          ns += prof_now() - start;
+          reps += 1;
+     } while (ns < conf->min_time*1e9);
+
+     snprintf(pstr, sizeof(pstr), "\"num_vars\": %d", num_vars);
+     bench_report(name, pstr, reps, num_vars, ns, checksum);
+     unlink(path);
+}
+/* bench_vcf_parse() */
+
+
+/* ---------- pileup ---------- */
+
+
+typedef struct {
+     long int num_cols;
+     long int sum_cov;
+} plp_stats_t;
+
+static void
+count_plp_col(const plp_col_t *p, void *conf)
+{
+     plp_stats_t *stats = (plp_stats_t *)conf;
+     stats->num_cols += 1;
+     stats->sum_cov += p->coverage_plp;
+}
+/* count_plp_col() */
+
+
+/* end-to-end: BAM decode, BAQ/IDAQ, source quality and
+ * compile_plp_col(), i.e. everything before calling */
+static void
+bench_pileup(const bench_conf_t *conf)
+{
+     const char *name = "mpileup";
+     const char *bam = conf->bam;
+     mplp_conf_t mplp_conf;
+     plp_stats_t stats;
+     long int reps = 0;
+     uint64_t ns = 0;
+
+     if (! bench_wanted(conf, name)) {
+          return;
+     }
+     if (access(conf->bam, R_OK) || access(conf->ref, R_OK)) {
+          LOG_WARN("Skipping %s benchmark: can't read %s or %s\n", name, conf->bam, conf->ref);
+          return;
+     }
+
+     init_mplp_conf(& mplp_conf);
+     mplp_conf.flag |= MPLP_USE_SQ;
+     mplp_conf.fa = strdup(conf->ref);
+     if (NULL == (mplp_conf.fai = fai_load(conf->ref))) {
+          LOG_ERROR("Couldn't load index for %s\n", conf->ref);
+          free(mplp_conf.fa);
+          return;
+     }
+     if (conf->reg) {
+          mplp_conf.reg = strdup(conf->reg);
+     }
+
+     do {
+          uint64_t start = prof_now();
+          memset(&stats, 0, sizeof(plp_stats_t));
+          if (mpileup(& mplp_conf, &count_plp_col, (void*)&stats, 1, &bam)) {
+               LOG_ERROR("%s\n", "mpileup() failed");
+               break;
+          }
+          ns += prof_now() - start;
+          reps += 1;
+     } while (ns < conf->min_time*1e9);
+
+     if (reps) {
+          printf("{\"bench\": \"%s\", \"bam\": \"%s\", \"columns\": %ld, \"reps\": %ld, \"total_s\": %.6f,"
+                 " \"ns_per_op\": %.3f, \"checksum\": %ld}\n",
+                 name, conf->bam, stats.num_cols, reps, ns/1e9,
+                 stats.num_cols ? ns/(double)reps/stats.num_cols : 0.0, stats.sum_cov);
+     }
+
+     free(mplp_conf.fa);
+     free(mplp_conf.reg);
+     fai_destroy(mplp_conf.fai);
+}
+/* bench_pileup() */
+
+
+static void
+usage(const bench_conf_t *conf)
+{
+     fprintf(stderr, "Usage: lofreq-bench [options]\n\n");
+     fprintf(stderr, "Runs benchmarks on synthetic inputs (generated from a fixed seed) and prints results as JSON lines.\n");
+     fprintf(stderr, "ns_per_op is per read (DP row) for Poisson-binomial kernels, per read for kpa_ext_glocal and viterbi,\n");
+     fprintf(stderr, "per p-value for fdr/holm_bonf_corr, per table for fisher_exact*, per record for vcf_parse_var and per column for mpileup.\n\n");
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -b | --bench STR      Only run benchmarks whose name contains STR\n");
+     fprintf(stderr, "  -t | --min-time FLOAT Minimum time per benchmark in seconds [%g]\n", conf->min_time);
+     fprintf(stderr, "  -s | --seed INT       Seed for synthetic inputs [%llu]\n", (unsigned long long)conf->seed);
+     fprintf(stderr, "  -q | --quick          Smaller inputs only (e.g. for quick regression checks)\n");
+     fprintf(stderr, "       --bam FILE       BAM file for mpileup benchmark [%s]\n", conf->bam);
+     fprintf(stderr, "       --ref FILE       Reference for mpileup benchmark [%s]\n", conf->ref);
+     fprintf(stderr, "  -r | --region STR    Region for mpileup benchmark\n");
+     fprintf(stderr, "  -h | --help           Print this help\n");
+}
+/* usage() */
+
+
+int
+main(int argc, char *argv[])
+{
+     bench_conf_t conf;
+     int c;
+
+     memset(&conf, 0, sizeof(bench_conf_t));
+     conf.min_time = BENCH_DEFAULT_MIN_TIME;
+     conf.seed = BENCH_DEFAULT_SEED;
+     /* same small data set as used by tests/pb_kernel.sh etc. */
+     conf.bam = "../../tests/data/denv2-pseudoclonal/denv2-pseudoclonal.bam";
+     conf.ref = "../../tests/data/denv2-pseudoclonal/denv2-pseudoclonal_cons.fa";
+
+     while (1) {
+          static struct option long_opts[] = {
+               {"bench", required_argument, NULL, 'b'},
+               {"min-time", required_argument, NULL, 't'},
+               {"seed", required_argument, NULL, 's'},
+               {"quick", no_argument, NULL, 'q'},
+               {"bam", required_argument, NULL, 'B'}, /* long only */
+               {"ref", required_argument, NULL, 'R'}, /* long only */
+               {"region", required_argument, NULL, 'r'},
+               {"help", no_argument, NULL, 'h'},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          static const char *long_opts_str = "b:t:s:qr:h";
+          int long_opts_index = 0;
+          c = getopt_long(argc, argv, long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'b':
+               conf.only = optarg;
+               break;
+          case 't':
+               conf.min_time = atof(optarg);
+               break;
+          case 's':
+               conf.seed = strtoull(optarg, NULL, 10);
+               break;
+          case 'q':
+               conf.quick = 1;
+               break;
+          case 'B':
+               conf.bam = optarg;
+               break;
+          case 'R':
+               conf.ref = optarg;
+               break;
+          case 'r':
+               conf.reg = optarg;
+               break;
+          case 'h':
+               usage(&conf);
+               return 0;
+          default:
+               usage(&conf);
+               return 1;
+          }
+     }
+     if (conf.quick && conf.min_time == BENCH_DEFAULT_MIN_TIME) {
+          conf.min_time = 0.1;
+     }
+
+     bench_pb(&conf);
+     bench_kpa(&conf);
+     bench_viterbi(&conf);
+     bench_multtest(&conf);
+     bench_fisher(&conf);
+     bench_errprobs(&conf);
+     bench_vcf_parse(&conf);
+     bench_pileup(&conf);
+
+     return 0;
+}
+/* main() */
@@ -46,6 +46,9 @@
 #include <float.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
 
 /* libbam includes */
 #include "htslib/faidx.h"
@@ -66,7 +69,17 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end);
 #include "utils.h"
 #include "log.h"
 #include "plp.h"
+#include "samutils.h"
+#include "refcache.h"
+#include "qualcache.h"
 #include "defaults.h"
+#include "lofreq_call.h"
+#include "profile.h"
+#include "plpstats.h"
+#include "bamstats.h"
+#include "binplan.h"
+#include "shard.h"
+#include "covblock.h"
 
 #if 1
 #define MYNAME "lofreq call"
@@ -78,19 +91,24 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end);
 #define BUF_SIZE 1<<16
 
 
-/* number of tests performed (CONSVAR doesn't count). for downstream
- * multiple testing correction. corresponds to bonf if bonf_dynamic is
- * true. */
-long long int num_snv_tests = 0;
-long long int num_indel_tests = 0;
-/* FIXME extend to keep some more stats, e.g. num_pos_with_cov etc */
+/* the number of tests performed are counted in varcall_conf_t, so
+ * that each thread can keep its own. FIXME extend to keep some more
+ * stats, e.g. num_pos_with_cov etc */
 
-long int indel_calls_wo_idaq = 0;
+
+/* multi-threaded calling: the genome (or region) is split into
+ * MT_CHUNKS_PER_THREAD chunks of about equal work (estimated from the
+ * BAM index, see binplan.h) per thread. threads pick chunks in
+ * order. if there are no chunks left an idle thread will split the
+ * remainder of the biggest running chunk if it's at least twice
+ * MT_MIN_STEAL_SIZE long */
+#define MT_CHUNKS_PER_THREAD 4
+#define MT_MIN_STEAL_SIZE 5000
 
 
 /* variant reporter to be used for all types */
 void
-report_var(vcf_file_t *vcf_file, const plp_col_t *p, const char *ref,
+report_var(varcall_conf_t *conf, const plp_col_t *p, const char *ref,
            const char *alt, const float af, const int qual,
            const int is_indel, const int is_consvar,
            const dp4_counts_t *dp4)
@@ -101,11 +119,9 @@ report_var(vcf_file_t *vcf_file, const plp_col_t *p, const char *ref,
 
      vcf_new_var(&var);
      var->chrom = strdup(p->target);
+     var->tid = p->tid;
      var->pos = p->pos;
 
-     if (is_indel && ! p->has_indel_aqs) {
-          indel_calls_wo_idaq += 1;
-     }
      /* var->id = NA */
      var->ref = strdup(ref);
      var->alt = strdup(alt);
@@ -129,8 +145,17 @@ report_var(vcf_file_t *vcf_file, const plp_col_t *p, const char *ref,
      }
      vcf_var_sprintf_info(var, is_indel? p->coverage_plp - p->num_tails : p->coverage_plp,
                           af, sb_qual, dp4, is_indel, p->hrun, is_consvar);
+     if (p->ds_frac < 1.0) {
+          char ds_info[32];
+          snprintf(ds_info, sizeof(ds_info), "DSF=%f", p->ds_frac);
+          vcf_var_add_to_info(var, ds_info);
+     }
 
-     vcf_write_var(vcf_file, var);
+     if (conf->var_emit) {
+          conf->var_emit(var, conf->var_emit_data);
+          return;
+     }
+     vcf_write_var(& conf->vcf_out, var);
      vcf_free_var(&var);
 }
 /* report_var() */
@@ -163,7 +188,7 @@ report_cons_sub(const plp_col_t *p, varcall_conf_t *conf){
 
      LOG_DEBUG("cons var snp: %s %d %c>%s\n",
                p->target, p->pos+1, p->ref_base, p->cons_base);
-     report_var(& conf->vcf_out, p, report_ref, p->cons_base,
+     report_var(conf, p, report_ref, p->cons_base,
                 af, qual, is_indel, is_consvar, &dp4);
 }
 
@@ -202,7 +227,7 @@ report_cons_ins(const plp_col_t *p, varcall_conf_t *conf) {
 
      LOG_DEBUG("Consensus insertion: %s %d %s>%s\n",
                p->target, p->pos+1, report_ins_ref, report_ins_alt);
-     report_var(& conf->vcf_out, p, report_ins_ref, report_ins_alt,
+     report_var(conf, p, report_ins_ref, report_ins_alt,
                 af, qual, is_indel, is_consvar, &dp4);
      return;
 }
@@ -242,7 +267,7 @@ report_cons_del(const plp_col_t *p, varcall_conf_t *conf) {
 
      LOG_DEBUG("Consensus deletion: %s %d %s>%s\n",
                p->target, p->pos+1, report_del_ref, report_del_alt);
-     report_var(&conf->vcf_out, p, report_del_ref, report_del_alt,
+     report_var(conf, p, report_del_ref, report_del_alt,
                 af, qual, is_indel, is_consvar, &dp4);
 
 }
@@ -300,28 +325,12 @@ ins_to_str(const ins_event *it, const char refbase,
      (*refstr)[1] = (*altstr)[j+1] = '\0';     
 }
 
-int
-call_alt_ins(const plp_col_t *p, double *bi_err_probs, int bi_num_err_probs,
-             varcall_conf_t *conf, ins_event *it) {
-
-     int ins_counts[3];
-     long double bi_pvalues[3];
-
-     // prep for snpcaller
-     ins_counts[0] = it->count;
-     ins_counts[1] = ins_counts[2] = 0;
-     LOG_DEBUG("%s %d: passing down %d quals with noncons_ins_counts"
-               "(%d, %d, %d) to snpcaller()\n", p->target, p->pos+1,
-               bi_num_err_probs, ins_counts[0], ins_counts[1], ins_counts[2]);
-     // compute p-value for insertion
-     if (snpcaller(bi_pvalues, bi_err_probs, bi_num_err_probs, ins_counts,
-                   conf->bonf_indel, conf->sig)) {
-          fprintf(stderr, "FATAL: snpcaller() failed at %s:%s():%d\n",
-                  __FILE__, __FUNCTION__, __LINE__);
-          return 1;
-     }
+/* reports insertion it if bi_pvalue is significant */
+void
+report_alt_ins(const plp_col_t *p, const long double bi_pvalue,
+               varcall_conf_t *conf, ins_event *it) {
+
      // see if there was an insertion
-     long double bi_pvalue = bi_pvalues[0];
      if (bi_pvalue*conf->bonf_indel < conf->sig) {
           char *report_ins_ref;
           char *report_ins_alt;
@@ -341,7 +350,10 @@ call_alt_ins(const plp_col_t *p, double *bi_err_probs, int bi_num_err_probs,
           LOG_DEBUG("Low freq insertion: %s %d %s>%s pv-prob:%Lg;pv-qual:%d\n",
                     p->target, p->pos+1, report_ins_ref, report_ins_alt,
                     bi_pvalue, qual);
-          report_var(&conf->vcf_out, p, report_ins_ref, report_ins_alt,
+          if (! p->has_indel_aqs) {
+               conf->indel_calls_wo_idaq += 1;
+          }
+          report_var(conf, p, report_ins_ref, report_ins_alt,
                      af, qual, is_indel, is_consvar, &dp4);
 
           free(report_ins_ref); free(report_ins_alt);
@@ -354,39 +366,14 @@ else if (debug) {
           LOG_DEBUG("insignificant ins: %s %d %s>%s pv-prob:%Lg;pv-qual:%d\n", p->target, p->pos+1, report_ins_ref, report_ins_alt, bi_pvalue, PROB_TO_PHREDQUAL(bi_pvalue));
      }
 #endif
-     return 0;
 }
+/* report_alt_ins() */
 
-int call_alt_del(const plp_col_t *p, double *bd_err_probs, int bd_num_err_probs,
-                 varcall_conf_t *conf, del_event *it) {
-
-     int del_counts[3];
-     long double bd_pvalues[3];
+/* reports deletion it if bd_pvalue is significant */
+void
+report_alt_del(const plp_col_t *p, const long double bd_pvalue,
+               varcall_conf_t *conf, del_event *it) {
 
-     /* prep for snpcaller */
-     del_counts[0] = it->count;
-     del_counts[1] = del_counts[2] = 0;
-    
-#if 0 
-     int k;
-     for (k = 0; k < bd_num_err_probs; k++) {
-          LOG_DEBUG("bd_err_prob: %lg\n", bd_err_probs[k]);
-     }
-#endif
-     
-     LOG_DEBUG("%s %d: passing down %d quals with noncons_del_counts"
-               "(%d, %d, %d) to snpcaller()\n", p->target, p->pos+1,
-               bd_num_err_probs, del_counts[0], del_counts[1], del_counts[2]);
-
-     /* snpcaller for deletion */
-     if (snpcaller(bd_pvalues, bd_err_probs, bd_num_err_probs, del_counts,
-                   conf->bonf_indel, conf->sig)) {
-          fprintf(stderr, "FATAL: snpcaller() failed at %s:%s():%d\n",
-                  __FILE__, __FUNCTION__, __LINE__);
-          return 1;
-     }
-     /* compute p-value deletion */
-     long double bd_pvalue = bd_pvalues[0];
      if (bd_pvalue*conf->bonf_indel < conf->sig) {
           const int is_indel = 1;
           const int is_consvar = 0;
@@ -407,7 +394,10 @@ int call_alt_del(const plp_col_t *p, double *bd_err_probs, int bd_num_err_probs,
           LOG_DEBUG("Low freq deletion: %s %d %s>%s pv-prob:%Lg;pv-qual:%d\n",
                     p->target, p->pos+1, report_del_ref, report_del_alt,
                     bd_pvalue, qual);
-          report_var(&conf->vcf_out, p, report_del_ref, report_del_alt,
+          if (! p->has_indel_aqs) {
+               conf->indel_calls_wo_idaq += 1;
+          }
+          report_var(conf, p, report_del_ref, report_del_alt,
                      af, qual, is_indel, is_consvar, &dp4);
           free(report_del_ref);
           free(report_del_alt);
@@ -420,8 +410,8 @@ else if (debug) {
           LOG_DEBUG("delignificant del: %s %d %s>%s pv-prob:%Lg;pv-qual:%d\n", p->target, p->pos+1, report_del_ref, report_del_alt, bd_pvalue, PROB_TO_PHREDQUAL(bd_pvalue));
      }
 #endif
-     return 0;
 }
+/* report_alt_del() */
 
 /* allocates bc_err_probs (to size bc_num_err_probs; also set here) and sets
  * values. user must free.
@@ -613,13 +603,147 @@ warn_old_fai(const char *fa)
 }
 
 
+/* Multiallelic, low AF, 1bp indels with pattern XY>X and X>XY
+ * (see e.g. ecoli spike-in) where Y is T or A are filtered. Seem to happen because 
+ * of overestimated indel qual in Illumina homopolyer stretches. 
+ * ign_indels will be set to 1 for each affected base.
+ *
+ * FIXME make switch
+ */
+static void
+find_ign_indels(const plp_col_t *p, int ign_indels[NUM_NT4])
+{
+     if (p->num_ins && p->ins_quals.n && p->num_dels && p->del_quals.n) {
+          const float max_af = 0.05;
+          ins_event *ins_ev, *ins_ev_tmp;
+          del_event *del_ev, *del_ev_tmp;
+          /* counts of observed 1-base indels */
+          int ins_dict[NUM_NT4] = {0};
+          int del_dict[NUM_NT4] = {0};
+          int i;
+          const char at[] = "AT\0";
+
+          HASH_ITER(hh_ins, p->ins_event_counts, ins_ev, ins_ev_tmp) {
+               /*LOG_FIXME("ins: %s count=%d fw/rv=%d/%d\n", ins_ev->key, ins_ev->count, ins_ev->fw_rv[0], ins_ev->fw_rv[1]);*/
+               if (strlen(ins_ev->key)==1 && strchr(at, ins_ev->key[0])!=NULL) {
+                    ins_dict[bam_nt4_table[(int)ins_ev->key[0]]] = ins_ev->count;
+               }
+          }
+          HASH_ITER(hh_del, p->del_event_counts, del_ev, del_ev_tmp) {
+               /*LOG_FIXME("del: %s count=%d fw/rv=%d/%d\n", del_ev->key, del_ev->count, del_ev->fw_rv[0], del_ev->fw_rv[1]);*/
+               if (strlen(del_ev->key)==1 && strchr(at, del_ev->key[0])!=NULL) {
+                    del_dict[bam_nt4_table[(int)del_ev->key[0]]] = del_ev->count;
+               }
+          }
+          for (i=0; i<NUM_NT4; i++) {
+               if (ins_dict[i] && del_dict[i]) {
+                    float ins_af = ins_dict[i]/((float)(p->coverage_plp - p->num_tails));
+                    float del_af = del_dict[i]/((float)(p->coverage_plp - p->num_tails));
+                    if (ins_af<max_af && del_af<max_af) {
+                         LOG_DEBUG("Ignoring multi-allelic XY>X:X>XY indel of low AF next to Poly-AT at %s:%d\n", p->target, p->pos+1);
+                         ign_indels[i] = 1;
+                    }
+               }
+          }
+     }
+}
+
+
+typedef void (*indel_errprobs_func_t)(double **, int *, const plp_col_t *,
+                                      varcall_conf_t *, char [MAX_INDELSIZE]);
+typedef void (*indel_errprobs_shared_func_t)(double **, int *, double **, int *,
+                                             const plp_col_t *, varcall_conf_t *,
+                                             char **, const int);
+
+/* computes pvalues for num_events indel events of one type (given by
+ * keys and counts) at p with a single Poisson-binomial (see
+ * snpcaller_shared()) instead of one per event. errprobs_func is
+ * plp_to_ins_errprobs() or plp_to_del_errprobs() and shared_func the
+ * corresponding plp_to_ins_errprobs_shared() or
+ * plp_to_del_errprobs_shared(), which is used with idaq, where the
+ * error probs of reads with an event differ per event. bonf should be
+ * the smallest Bonferroni factor used for any of the events.
+ *
+ * returns non-zero on error
+ */
+static int
+indel_pvalues(long double *pvalues, const plp_col_t *p, varcall_conf_t *conf,
+              indel_errprobs_func_t errprobs_func,
+              indel_errprobs_shared_func_t shared_func,
+              char **keys, const int *counts, const int num_events,
+              const long long int bonf)
+{
+     double *err_probs;
+     int num_err_probs;
+     double *ext;
+     int num_ext;
+     const double **ext_err_probs;
+     int *num_ext_err_probs;
+     int i, rc;
+     /* without idaq (or without alignment qualities in the bam) the
+      * error probs are the same for all events */
+     const int event_indep = ! (conf->flag & VARCALL_USE_IDAQ) || ! p->has_indel_aqs;
+
+     if (event_indep) {
+          PROF_START(t_errprobs);
+          errprobs_func(&err_probs, &num_err_probs, p, conf, keys[0]);
+          PROF_STOP(PROF_ERRPROBS, t_errprobs);
+          qsort(err_probs, num_err_probs, sizeof(double), dbl_cmp);
+          LOG_DEBUG("%s %d: passing down %d indel quals for %d events to snpcaller_shared()\n",
+                    p->target, p->pos+1, num_err_probs, num_events);
+          rc = snpcaller_shared(pvalues, counts, num_events,
+                                err_probs, num_err_probs, NULL, NULL,
+                                bonf, conf->sig);
+          free(err_probs);
+          return rc;
+     }
+
+     if (NULL == (ext_err_probs = malloc(num_events * sizeof(double *)))
+         || NULL == (num_ext_err_probs = malloc(num_events * sizeof(int)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     PROF_START(t_errprobs);
+     shared_func(&err_probs, &num_err_probs, &ext, &num_ext, p, conf, keys, num_events);
+     PROF_STOP(PROF_ERRPROBS, t_errprobs);
+
+     qsort(err_probs, num_err_probs, sizeof(double), dbl_cmp);
+     for (i=0; i<num_events; i++) {
+          ext_err_probs[i] = ext + i * num_ext;
+          num_ext_err_probs[i] = num_ext;
+          qsort(ext + i * num_ext, num_ext, sizeof(double), dbl_cmp);
+     }
+     LOG_DEBUG("%s %d: passing down %d shared indel quals for %d events to snpcaller_shared()\n",
+               p->target, p->pos+1, num_err_probs, num_events);
+     rc = snpcaller_shared(pvalues, counts, num_events,
+                           err_probs, num_err_probs,
+                           ext_err_probs, num_ext_err_probs,
+                           bonf, conf->sig);
+
+     free(err_probs);
+     free(ext);
+     free(ext_err_probs);
+     free(num_ext_err_probs);
+
+     return rc;
+}
+/* indel_pvalues() */
+
+
+/* all events of one indel type at a column are tested with one
+ * Poisson-binomial, see indel_pvalues(). with bonf_dynamic, each
+ * event still gets its own Bonferroni factor as if tested one by one */
 void 
 call_indels(const plp_col_t *p, varcall_conf_t *conf)
 {
-
-     double *bi_err_probs, *bd_err_probs; /* error probs for indel calling */
-     int bi_num_err_probs, bd_num_err_probs;
      int ign_indels[NUM_NT4] = {0};
+     char **keys; /* event keys for indel_pvalues() */
+     int *counts;
+     long double *pvalues;
+     int num_events, i;
+     long long int bonf_first;
 
      if (p->num_non_indels + p->num_ins + p->num_dels < conf->min_cov) {
           return;
@@ -638,90 +762,104 @@ call_indels(const plp_col_t *p, varcall_conf_t *conf)
       }
 #endif
 
-      /* Multiallelic, low AF, 1bp indels with pattern XY>X and X>XY
-       * (see e.g. ecoli spike-in) where Y is T or A are filtered here. Seem to happen because 
-       * of overestimated indel qual in Illumina homopolyer stretches 
-       *
-       * FIXME make switch
-       */
-      if (p->num_ins && p->ins_quals.n && p->num_dels && p->del_quals.n) {
-           const float max_af = 0.05;
-           ins_event *ins_ev, *ins_ev_tmp;
-           del_event *del_ev, *del_ev_tmp;
-           /* counts of observed 1-base indels */
-           int ins_dict[NUM_NT4] = {0};
-           int del_dict[NUM_NT4] = {0};
-           int i;
-           const char at[] = "AT\0";
-
-           HASH_ITER(hh_ins, p->ins_event_counts, ins_ev, ins_ev_tmp) {
-                /*LOG_FIXME("ins: %s count=%d fw/rv=%d/%d\n", ins_ev->key, ins_ev->count, ins_ev->fw_rv[0], ins_ev->fw_rv[1]);*/
-                if (strlen(ins_ev->key)==1 && strchr(at, ins_ev->key[0])!=NULL) {
-                     ins_dict[bam_nt4_table[(int)ins_ev->key[0]]] = ins_ev->count;
-                }
-           }
-           HASH_ITER(hh_del, p->del_event_counts, del_ev, del_ev_tmp) {
-                /*LOG_FIXME("del: %s count=%d fw/rv=%d/%d\n", del_ev->key, del_ev->count, del_ev->fw_rv[0], del_ev->fw_rv[1]);*/
-                if (strlen(del_ev->key)==1 && strchr(at, del_ev->key[0])!=NULL) {
-                     del_dict[bam_nt4_table[(int)del_ev->key[0]]] = del_ev->count;
-                }
-           }
-           for (i=0; i<NUM_NT4; i++) {
-                if (ins_dict[i] && del_dict[i]) {
-                     float ins_af = ins_dict[i]/((float)(p->coverage_plp - p->num_tails));
-                     float del_af = del_dict[i]/((float)(p->coverage_plp - p->num_tails));
-                     if (ins_af<max_af && del_af<max_af) {
-                          LOG_DEBUG("Ignoring multi-allelic XY>X:X>XY indel of low AF next to Poly-AT at %s:%d\n", p->target, p->pos+1);
-                          ign_indels[i] = 1;
-                     }
-                }
-           }
-      }      
+      find_ign_indels(p, ign_indels);
 
       /*if (p->num_ins && p->ins_quals.n) { FIXME check for ins_quals.n breaks if 100% consvar. why was this needed? see also del */
       if (p->num_ins) {
            ins_event *it, *it_tmp;
+           ins_event **events;
+           const int max_events = HASH_CNT(hh_ins, p->ins_event_counts);
+
+           if (NULL == (events = malloc(max_events * sizeof(ins_event *)))
+               || NULL == (keys = malloc(max_events * sizeof(char *)))
+               || NULL == (counts = malloc(max_events * sizeof(int)))
+               || NULL == (pvalues = malloc(max_events * sizeof(long double)))) {
+                fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                        __FILE__, __FUNCTION__, __LINE__);
+                exit(1);
+           }
+           num_events = 0;
            HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
                 if (strlen(it->key)==1 && ign_indels[bam_nt4_table[(int)it->key[0]]]) {
                      continue;
                 }
-                plp_to_ins_errprobs(&bi_err_probs, &bi_num_err_probs,
-                                    p, conf, it->key);
-                qsort(bi_err_probs, bi_num_err_probs, sizeof(double), dbl_cmp);
+                events[num_events] = it;
+                keys[num_events] = it->key;
+                counts[num_events] = it->count;
+                num_events += 1;
+           }
+
+           bonf_first = conf->bonf_indel + (conf->bonf_dynamic ? 1 : 0);
+           if (num_events && indel_pvalues(pvalues, p, conf, plp_to_ins_errprobs,
+                                           plp_to_ins_errprobs_shared, keys, counts, num_events,
+                                           bonf_first)) {
+                fprintf(stderr, "FATAL: snpcaller_shared() failed at %s:%s():%d\n",
+                        __FILE__, __FUNCTION__, __LINE__);
+                num_events = -1;
+           }
+           for (i=0; i<num_events; i++) {
                 if (conf->bonf_dynamic) {
                      conf->bonf_indel += 1;
                 }
-                num_indel_tests += 1;
-                if (call_alt_ins(p, bi_err_probs, bi_num_err_probs, conf, it)) {
-                     free(bi_err_probs);
-                     return;
-                }
-                free(bi_err_probs);
+                conf->num_indel_tests += 1;
+                report_alt_ins(p, pvalues[i], conf, events[i]);
+           }
+           free(events);
+           free(keys);
+           free(counts);
+           free(pvalues);
+           if (num_events < 0) {
+                return;
            }
       }
 
       /*if (p->num_dels && p->del_quals.n) { FIXME check for del_quals.n breaks if 100% consvar. why was this needed? see also ins */
       if (p->num_dels) {
            del_event *it, *it_tmp;
+           del_event **events;
+           const int max_events = HASH_CNT(hh_del, p->del_event_counts);
+
+           if (NULL == (events = malloc(max_events * sizeof(del_event *)))
+               || NULL == (keys = malloc(max_events * sizeof(char *)))
+               || NULL == (counts = malloc(max_events * sizeof(int)))
+               || NULL == (pvalues = malloc(max_events * sizeof(long double)))) {
+                fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                        __FILE__, __FUNCTION__, __LINE__);
+                exit(1);
+           }
+           num_events = 0;
            HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
                 if (strlen(it->key)==1 && ign_indels[bam_nt4_table[(int)it->key[0]]]) {
                      continue;
                 }
-                plp_to_del_errprobs(&bd_err_probs, &bd_num_err_probs,
-                                    p, conf, it->key);
-                qsort(bd_err_probs, bd_num_err_probs, sizeof(double), dbl_cmp);
+                events[num_events] = it;
+                keys[num_events] = it->key;
+                counts[num_events] = it->count;
+                num_events += 1;
+           }
+
+           bonf_first = conf->bonf_indel + (conf->bonf_dynamic ? 1 : 0);
+           if (num_events && indel_pvalues(pvalues, p, conf, plp_to_del_errprobs,
+                                           plp_to_del_errprobs_shared, keys, counts, num_events,
+                                           bonf_first)) {
+                fprintf(stderr, "FATAL: snpcaller_shared() failed at %s:%s():%d\n",
+                        __FILE__, __FUNCTION__, __LINE__);
+                num_events = -1;
+           }
+           for (i=0; i<num_events; i++) {
                 if (conf->bonf_dynamic) {
                      conf->bonf_indel += 1;
                 }
-                num_indel_tests += 1;
-                if (call_alt_del(p, bd_err_probs, bd_num_err_probs, conf, it)) {
-                     free(bd_err_probs);
-                     return;
-                }
-                free(bd_err_probs);
+                conf->num_indel_tests += 1;
+                report_alt_del(p, pvalues[i], conf, events[i]);
            }
+           free(events);
+           free(keys);
+           free(counts);
+           free(pvalues);
       }
 }
+/* call_indels() */
 
 
 /* we always use the reference for calculating a quality.
@@ -741,6 +879,10 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
      int alt_raw_counts[NUM_NONCONS_BASES]; /* raw, unfiltered alt-counts */
      int alt_bases[NUM_NONCONS_BASES];/* actual alt bases */
      int got_alt_bases = 0;
+     errprob_hist_t bc_err_hist; /* histogram of bc_err_probs */
+     int use_hist;
+     int max_alt_count = 0;
+     int rc;
 
      if (p->num_bases < conf->min_cov) {
           return;
@@ -753,9 +895,11 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
           return;
      }
 
+      PROF_START(t_errprobs);
       plp_to_errprobs(&bc_err_probs, &bc_num_err_probs,
                       alt_bases, alt_counts, alt_raw_counts,
                       p, conf);
+      PROF_STOP(PROF_ERRPROBS, t_errprobs);
 
 #if 0
       for (i=0; i<NUM_NONCONS_BASES; i++) {
@@ -777,9 +921,40 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
            return;
       }
 
-      /* sorting in ascending order should in theory be numerically
-       * more stable and also make snpcaller faster */
-      qsort(bc_err_probs, bc_num_err_probs, sizeof(double), dbl_cmp);
+      if (conf->bonf_dynamic) {
+           if (1 == conf->bonf_subst) {
+                conf->bonf_subst = NUM_NONCONS_BASES; /* otherwise we start with 1+NUM_NONCONS_BASES */
+           } else {
+                conf->bonf_subst += NUM_NONCONS_BASES; /* will do one test per non-cons nuc */
+           }
+      }
+      conf->num_snv_tests += NUM_NONCONS_BASES;
+
+      for (i=0; i<NUM_NONCONS_BASES; i++) {
+           max_alt_count = MAX(max_alt_count, alt_counts[i]);
+      }
+      /* most columns can't be significant. rule those out cheaply
+       * before histogram building, sorting and snpcaller() */
+      if (errprobs_screen_nonsig(bc_err_probs, bc_num_err_probs, max_alt_count,
+                                 conf->bonf_subst, conf->sig)) {
+           LOG_DEBUG("%s %d: screening rules out significance\n", p->target, p->pos+1);
+           free(bc_err_probs);
+           return;
+      }
+
+      /* at high coverage there are only few distinct error probs,
+       * in which case the histogram based computation is cheaper */
+      if (errprob_hist_build(&bc_err_hist, bc_err_probs, bc_num_err_probs)) {
+           free(bc_err_probs);
+           return;
+      }
+      use_hist = errprob_hist_is_cheaper(&bc_err_hist, max_alt_count);
+      if (! use_hist) {
+           errprob_hist_free(&bc_err_hist);
+           /* sorting in ascending order should in theory be numerically
+            * more stable and also make snpcaller faster */
+           qsort(bc_err_probs, bc_num_err_probs, sizeof(double), dbl_cmp);
+      }
 
  #ifdef TRACE
       {
@@ -789,21 +964,19 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
            }
       }
  #endif
-      if (conf->bonf_dynamic) {
-           if (1 == conf->bonf_subst) {
-                conf->bonf_subst = NUM_NONCONS_BASES; /* otherwise we start with 1+NUM_NONCONS_BASES */
-           } else {
-                conf->bonf_subst += NUM_NONCONS_BASES; /* will do one test per non-cons nuc */
-           }
-      }
-      num_snv_tests += NUM_NONCONS_BASES;
-
       LOG_DEBUG("%s %d: passing down %d quals with noncons_counts"
                 " (%d, %d, %d) to snpcaller(num_snv_tests=%lld conf->bonf=%lld, conf->sig=%f)\n", p->target, p->pos+1,
-                bc_num_err_probs, alt_counts[0], alt_counts[1], alt_counts[2], num_snv_tests, conf->bonf_subst, conf->sig);
-
-      if (snpcaller(pvalues, bc_err_probs, bc_num_err_probs,
-                   alt_counts, conf->bonf_subst, conf->sig)) {
+                bc_num_err_probs, alt_counts[0], alt_counts[1], alt_counts[2], conf->num_snv_tests, conf->bonf_subst, conf->sig);
+
+      if (use_hist) {
+           rc = snpcaller_hist(pvalues, &bc_err_hist,
+                               alt_counts, conf->bonf_subst, conf->sig);
+           errprob_hist_free(&bc_err_hist);
+      } else {
+           rc = snpcaller(pvalues, bc_err_probs, bc_num_err_probs,
+                          alt_counts, conf->bonf_subst, conf->sig);
+      }
+      if (rc) {
            fprintf(stderr, "FATAL: snpcaller() failed at %s:%s():%d\n",
                    __FILE__, __FUNCTION__, __LINE__);
            free(bc_err_probs);
@@ -849,7 +1022,7 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
                 dp4.alt_fw = p->fw_counts[alt_nt4];
                 dp4.alt_rv = p->rv_counts[alt_nt4];
 
-                report_var(& conf->vcf_out, p, report_ref, report_alt,
+                report_var(conf, p, report_ref, report_alt,
                            af, PROB_TO_PHREDQUAL(pvalue),
                            is_indel, is_consvar, &dp4);
                 LOG_DEBUG("low freq snp: %s %d %c>%c pv-prob:%Lg;pv-qual:%d"
@@ -869,6 +1042,33 @@ call_snvs(const plp_col_t *p, varcall_conf_t *conf)
 }
 
 
+/* don't call snvs if indels only or consensus indel (the latter is in theory
+ * possible but has messy downstream effects). in some cases we might not have
+ * an official indel consensus (AQ, BI/BD missing). Catch those by simply
+ * not calling anyhthing if the indel coverage is higher than the
+ * 'substitution' coverage
+ *
+ * don't call snvs on consensus indels. problem is we might not know there
+ * is one because indel qualities could be missing and we therefore didn't record
+ * anything etc. safest and easiest hack is to look at the
+ * difference between coverage and the number of bases (which might not work 
+ * if many bases were filtered)
+ *
+ * FIXME overhaul. see also https://github.com/CSB5/lofreq/issues/26
+ */
+static int
+snvs_callable(const plp_col_t *p, const varcall_conf_t *conf)
+{
+#ifdef CALL_SNVS_ON_CONS_INDELS
+     return ! conf->only_indels;
+#else
+     return (! conf->only_indels &&
+             ! (p->cons_base[0] == '+' || p->cons_base[0] == '-') &&
+             ! (p->num_bases*2 < p->coverage_plp));
+#endif
+}
+
+
 /* Assuming conf->min_bq and read-level filtering was already done
  * upstream. altbase mangling happens here however.
  *
@@ -889,139 +1089,1469 @@ call_vars(const plp_col_t *p, void *confp)
 
      /* call snvs
       */
-     /* don't call snvs if indels only or consensus indel (the latter is in theory
-      * possible but has messy downstream effects). in some cases we might not have
-      * an official indel consensus (AQ, BI/BD missing). Catch those by simply
-      * not calling anyhthing if the indel coverage is higher than the
-      * 'substitution' coverage
-      */
 #if 0
      LOG_FIXME("%s:%d: p->del_quals.n=%d p->ins_quals.n=%d p->num_dels=%d p->num_ins=%d p->num_ign_indels=%d p->num_bases=%d p->cov=%d\n", 
                p->target, p->pos+1,
                p->del_quals.n, p->ins_quals.n,
                p->num_dels, p->num_ins, p->num_ign_indels, p->num_bases, p->coverage_plp);
 #endif
-
-     /* don't call snvs on consensus indels. problem is we might not know there
-      * is one because indel qualities could be missing and we therefore didn't record
-      * anything etc. safest and easiest hack is to look at the
-      * difference between coverage and the number of bases (which might not work 
-      * if many bases were filtered)
-      *
-      * FIXME overhaul. see also https://github.com/CSB5/lofreq/issues/26
-      */
-#ifdef CALL_SNVS_ON_CONS_INDELS
-     if (! conf->only_indels) {
+     if (snvs_callable(p, conf)) {
           call_snvs(p, conf);
      }
-#else
-     if (! conf->only_indels &&                                  \
-         ! (p->cons_base[0] == '+' || p->cons_base[0] == '-') && \
-         ! (p->num_bases*2 < p->coverage_plp)) {
-          call_snvs(p, conf);
+}
+/* call_vars() */
+
+
+/* Counts the tests that call_vars() would (at most) perform, but
+ * without computing any error probabilities. Used for determining the
+ * Bonferroni factors before the actual calling (bonf 'auto'). Unlike
+ * the dynamic version this doesn't depend on the calling order, so
+ * that the factor is fixed and exact even if run in several threads.
+ * The BAQ, IDAQ etc. can be switched off for this, because none of the
+ * checks here depend on them.
+ */
+void
+count_tests(const plp_col_t *p, void *confp)
+{
+     varcall_conf_t *conf = (varcall_conf_t *)confp;
+
+     if (p->ref_base == 'N') {
+          return;
+     }
+
+     if (! conf->no_indels &&
+         p->num_non_indels + p->num_ins + p->num_dels >= conf->min_cov) {
+          int ign_indels[NUM_NT4] = {0};
+          find_ign_indels(p, ign_indels);
+          if (p->num_ins) {
+               ins_event *it, *it_tmp;
+               HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
+                    if (strlen(it->key)==1 && ign_indels[bam_nt4_table[(int)it->key[0]]]) {
+                         continue;
+                    }
+                    conf->num_indel_tests += 1;
+               }
+          }
+          if (p->num_dels) {
+               del_event *it, *it_tmp;
+               HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
+                    if (strlen(it->key)==1 && ign_indels[bam_nt4_table[(int)it->key[0]]]) {
+                         continue;
+                    }
+                    conf->num_indel_tests += 1;
+               }
+          }
      }
-#endif
 
+     /* see call_snvs() */
+     if (snvs_callable(p, conf) && p->num_bases >= conf->min_cov) {
+          conf->num_snv_tests += NUM_NONCONS_BASES;
+     }
 }
-/* call_vars() */
+/* count_tests() */
 
 
+/* multi-threaded calling
+ */
 
-static void
-usage(const mplp_conf_t *mplp_conf, const varcall_conf_t *varcall_conf)
+typedef enum {
+     CHUNK_PENDING,
+     CHUNK_RUNNING,
+     CHUNK_DONE
+} chunk_state_t;
+
+typedef struct call_chunk_s {
+     plp_region_t region;
+     chunk_state_t state;
+     char *vcf_buf; /* in-memory vcf output. valid once done */
+     size_t vcf_buf_len;
+     struct call_chunk_s *next; /* chunks are kept in genomic order */
+} call_chunk_t;
+
+typedef struct {
+     pthread_mutex_t lock; /* protects everything below, but not region->end (see plp_region_t) */
+     call_chunk_t *chunks;
+     call_chunk_t *unflushed; /* first chunk not written to vcf_out yet */
+     const mplp_conf_t *mplp_conf;
+     void (*plp_proc_func)(const plp_col_t*, void*); /* e.g. call_vars */
+     const varcall_conf_t *varcall_conf; /* template for per chunk copies */
+     const char *bam_file;
+     bam_header_t *h;
+     hts_idx_t *idx; /* shared among all threads. NULL for CRAM */
+     refcache_t *refcache; /* shared reference sequences. NULL if mplp_conf has one */
+     vcf_file_t *vcf_out;
+     int no_steal; /* reads of a chunk have to stay with it (bamstats side pass) */
+     int rc;
+
+     /* summed up over all chunks */
+     long long int num_snv_tests;
+     long long int num_indel_tests;
+     long int indel_calls_wo_idaq;
+} call_pool_t;
+
+
+static call_chunk_t *
+call_chunk_new(int tid, int beg, int end)
 {
-     fprintf(stderr, "%s: call variants from BAM file\n\n", MYNAME);
+     call_chunk_t *c;
+     if (NULL == (c = calloc(1, sizeof(call_chunk_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     c->region.tid = tid;
+     c->region.beg = beg;
+     c->region.end = end;
+     c->region.cur = beg-1;
+     pthread_mutex_init(& c->region.lock, NULL);
+     c->state = CHUNK_PENDING;
+     return c;
+}
 
-     fprintf(stderr, "Usage: %s [options] in.bam\n\n", MYNAME);
-     fprintf(stderr, "Options:\n");
 
-     fprintf(stderr, "- Reference:\n");
-     fprintf(stderr, "       -f | --ref FILE              Indexed reference fasta file (gzip supported) [null]\n");
+/* splits [beg, end) of tid into chunks of about chunk_work (but at
+ * least twice MT_MIN_STEAL_SIZE long) and appends them to tail (which
+ * is updated). no work at all gives one chunk. returns number of
+ * chunks added */
+static int
+call_pool_add_chunks(call_chunk_t **tail, const binplan_t *plan,
+                     int tid, int beg, int end, double chunk_work)
+{
+     int n = 0;
+     while (beg < end) {
+          int cend = chunk_work > 0.0 ? binplan_next_cut(plan, tid, beg, end, chunk_work) : end;
+          if (cend - beg < 2*MT_MIN_STEAL_SIZE) {
+               cend = MIN(beg + 2*MT_MIN_STEAL_SIZE, end);
+          }
+          (*tail)->next = call_chunk_new(tid, beg, cend);
+          (*tail) = (*tail)->next;
+          beg = cend;
+          n += 1;
+     }
+     return n;
+}
 
-     fprintf(stderr, "- Output:\n");
-     fprintf(stderr, "       -o | --out FILE              Vcf output file [- = stdout]\n");
 
-     fprintf(stderr, "- Regions:\n");
-     fprintf(stderr, "       -r | --region STR            Limit calls to this region (chrom:start-end) [null]\n");
-     fprintf(stderr, "       -l | --bed FILE              List of positions (chr pos) or regions (BED) [null]\n");
+/* returns non-zero on error */
+static int
+call_pool_init(call_pool_t *pool, const mplp_conf_t *mplp_conf,
+               void (*plp_proc_func)(const plp_col_t*, void*),
+               const varcall_conf_t *varcall_conf, const char *bam_file,
+               vcf_file_t *vcf_out, const int num_threads)
+{
+     htsFile *fp;
+     hts_idx_t *idx;
+     call_chunk_t head; /* dummy head */
+     call_chunk_t *tail = &head;
+     binplan_t *plan;
+     double total_work = 0.0;
+     double chunk_work;
+     int num_chunks = 0;
+     int tid;
+
+     memset(pool, 0, sizeof(call_pool_t));
+     pthread_mutex_init(& pool->lock, NULL);
+     pool->mplp_conf = mplp_conf;
+     pool->plp_proc_func = plp_proc_func;
+     pool->varcall_conf = varcall_conf;
+     pool->bam_file = bam_file;
+     pool->vcf_out = vcf_out;
+     pool->no_steal = (mplp_conf->bamstats != NULL);
+
+     if (NULL == (fp = hts_open(bam_file, "r"))) {
+          LOG_FATAL("Couldn't open %s\n", bam_file);
+          return -1;
+     }
+     if (NULL == (pool->h = sam_hdr_read(fp))) {
+          LOG_FATAL("Couldn't read header of %s\n", bam_file);
+          hts_close(fp);
+          return -1;
+     }
+     if (NULL == (idx = sam_index_load(fp, bam_file))) {
+          LOG_FATAL("Couldn't load index for %s (multi-threaded calling needs one)\n", bam_file);
+          hts_close(fp);
+          return -1;
+     }
+     if (fp->is_cram) {
+          /* CRAM indices are bound to their file handle, so every
+           * thread loads its own (see mpileup()) */
+          hts_idx_destroy(idx);
+     } else {
+          pool->idx = idx;
+     }
+     hts_close(fp);
+     if (mplp_conf->fai && ! mplp_conf->refcache) {
+          if (NULL == (pool->refcache = refcache_new(mplp_conf->fai, REFCACHE_DEFAULT_MAX_BYTES))) {
+               return -1;
+          }
+          refcache_open_store(pool->refcache, mplp_conf->fa);
+     }
 
-     fprintf(stderr, "- Base-call quality:\n");
-     fprintf(stderr, "       -q | --min-bq INT            Skip any base with baseQ smaller than INT [%d]\n", varcall_conf->min_bq);
-     fprintf(stderr, "       -Q | --min-alt-bq INT        Skip alternate bases with baseQ smaller than INT [%d]\n", varcall_conf->min_alt_bq);
-     fprintf(stderr, "       -R | --def-alt-bq INT        Overwrite baseQs of alternate bases (that passed bq filter) with this value (-1: use median ref-bq; 0: keep) [%d]\n", varcall_conf->def_alt_bq);
+     /* determine total work first so that we can determine the chunk size */
+     plan = binplan_load(bam_file, pool->h);
+     if (mplp_conf->reg) {
+          int beg, end;
+          if (bam_parse_region(pool->h, mplp_conf->reg, &tid, &beg, &end) < 0) {
+               LOG_FATAL("Malformatted region or wrong seqname: %s\n", mplp_conf->reg);
+               binplan_free(plan);
+               return -1;
+          }
+          if (end > pool->h->target_len[tid]) {
+               end = pool->h->target_len[tid];
+          }
+          total_work = binplan_work(plan, tid, beg, end);
+          chunk_work = total_work/(num_threads*MT_CHUNKS_PER_THREAD);
+          num_chunks = call_pool_add_chunks(&tail, plan, tid, beg, end, chunk_work);
 
-     fprintf(stderr, "       -j | --min-jq INT            Skip any base with joinedQ smaller than INT [%d]\n", varcall_conf->min_jq);
-     fprintf(stderr, "       -J | --min-alt-jq INT        Skip alternate bases with joinedQ smaller than INT [%d]\n", varcall_conf->min_alt_jq);
-     fprintf(stderr, "       -K | --def-alt-jq INT        Overwrite joinedQs of alternate bases (that passed jq filter) with this value (-1: use median ref-bq; 0: keep) [%d]\n", varcall_conf->def_alt_jq);
+     } else {
+          for (tid=0; tid<pool->h->n_targets; tid++) {
+               if (mplp_conf->bed && ! bed_overlap(mplp_conf->bed, pool->h->target_name[tid],
+                                                   0, pool->h->target_len[tid])) {
+                    continue;
+               }
+               total_work += binplan_work(plan, tid, 0, pool->h->target_len[tid]);
+          }
+          chunk_work = total_work/(num_threads*MT_CHUNKS_PER_THREAD);
+          for (tid=0; tid<pool->h->n_targets; tid++) {
+               if (mplp_conf->bed && ! bed_overlap(mplp_conf->bed, pool->h->target_name[tid],
+                                                   0, pool->h->target_len[tid])) {
+                    continue;
+               }
+               num_chunks += call_pool_add_chunks(&tail, plan, tid, 0, pool->h->target_len[tid], chunk_work);
+          }
+     }
+     pool->chunks = pool->unflushed = head.next;
+     LOG_VERBOSE("Split work of %g (%s) into %d chunks for %d threads\n",
+                 total_work, plan->from_index ? "index bytes" : "bp", num_chunks, num_threads);
+     binplan_free(plan);
+     return 0;
+}
 
-     fprintf(stderr, "- Base-alignment (BAQ) and indel-aligment (IDAQ) qualities:\n");
-     fprintf(stderr, "       -B | --no-baq                Disable use of base-alignment quality (BAQ)\n");
-     fprintf(stderr, "       -A | --no-idaq               Don't use IDAQ values (NOT recommended under ANY circumstances other than debugging)\n");
-     fprintf(stderr, "       -D | --del-baq               Delete pre-existing BAQ values, i.e. compute even if already present in BAM\n");
-     fprintf(stderr, "       -e | --no-ext-baq            Use 'normal' BAQ (samtools default) instead of extended BAQ (both computed on the fly if not already present in %s tag)\n", BAQ_TAG);
-     fprintf(stderr, "- Mapping quality:\n");
-     fprintf(stderr, "       -m | --min-mq INT            Skip reads with mapping quality smaller than INT [%d]\n", mplp_conf->min_mq);
-     fprintf(stderr, "       -M | --max-mq INT            Cap mapping quality at INT [%d]\n", mplp_conf->max_mq);
-     fprintf(stderr, "       -N | --no-mq                 Don't merge mapping quality in LoFreq's model\n");
 
-     fprintf(stderr, "- Indels:\n");
-     fprintf(stderr, "            --call-indels           Enable indel calls (note: preprocess your file to include indel alignment qualities!)\n");
-     fprintf(stderr, "            --only-indels           Only call indels; no SNVs\n");
+static void
+call_pool_free(call_pool_t *pool)
+{
+     call_chunk_t *c = pool->chunks;
+
+     while (c) {
+          call_chunk_t *next = c->next;
+          pthread_mutex_destroy(& c->region.lock);
+          free(c->vcf_buf);
+          free(c);
+          c = next;
+     }
+     refcache_free(pool->refcache);
+     if (pool->idx) {
+          hts_idx_destroy(pool->idx);
+     }
+     if (pool->h) {
+          bam_header_destroy(pool->h);
+     }
+     pthread_mutex_destroy(& pool->lock);
+}
 
-     fprintf(stderr, "- Source quality:\n");
-     fprintf(stderr, "       -s | --src-qual              Enable computation of source quality\n");
-     fprintf(stderr, "       -S | --ign-vcf FILE          Ignore variants in this vcf file for source quality computation. Multiple files can be given separated by commas\n"),
-     fprintf(stderr, "       -T | --def-nm-q INT          If >= 0, then replace non-match base qualities with this default value [%d]\n", mplp_conf->def_nm_q);
 
-     fprintf(stderr, "- P-values:\n");
-     fprintf(stderr, "       -a | --sig                   P-Value cutoff / significance level [%f]\n", varcall_conf->sig);
-     fprintf(stderr, "       -b | --bonf                  Bonferroni factor. 'dynamic' (increase per actually performed test) or INT ['dynamic']\n");
+/* splits the remainder of the running chunk with the most positions
+ * left and returns the new second half (or NULL if nothing is worth
+ * stealing). must be called with pool lock held */
+static call_chunk_t *
+call_pool_steal(call_pool_t *pool)
+{
+     call_chunk_t *c;
+     call_chunk_t *victim = NULL;
+     call_chunk_t *stolen = NULL;
+     int max_left = 0;
+
+     for (c = pool->chunks; c; c = c->next) {
+          int left;
+          if (c->state != CHUNK_RUNNING) {
+               continue;
+          }
+          pthread_mutex_lock(& c->region.lock);
+          left = c->region.end - (c->region.cur+1);
+          pthread_mutex_unlock(& c->region.lock);
+          if (left > max_left) {
+               max_left = left;
+               victim = c;
+          }
+     }
+     if (! victim || max_left < 2*MT_MIN_STEAL_SIZE) {
+          return NULL;
+     }
 
-     fprintf(stderr, "- Misc.:\n");
-     fprintf(stderr, "       -C | --min-cov INT           Test only positions having at least this coverage [%d]\n", varcall_conf->min_cov);
-     fprintf(stderr, "                                    (note: without --no-default-filter default filters (incl. coverage) kick in after predictions are done)\n");
-     fprintf(stderr, "       -d | --max-depth INT         Cap coverage at this depth [%d]\n", mplp_conf->max_depth);
-     fprintf(stderr, "            --illumina-1.3          Assume the quality is Illumina-1.3-1.7/ASCII+64 encoded\n");
-     fprintf(stderr, "            --use-orphan            Count anomalous read pairs (i.e. where mate is not aligned properly)\n");
-     fprintf(stderr, "            --plp-summary-only      No variant calling. Just output pileup summary per column\n");
-     fprintf(stderr, "            --no-default-filter     Don't run default 'lofreq filter' automatically after calling variants\n");
-     fprintf(stderr, "            --verbose               Be verbose\n");
-     fprintf(stderr, "            --debug                 Enable debugging\n");
+     pthread_mutex_lock(& victim->region.lock);
+     /* owner might have progressed in the meantime */
+     max_left = victim->region.end - (victim->region.cur+1);
+     if (max_left >= 2*MT_MIN_STEAL_SIZE) {
+          int mid = victim->region.cur+1 + max_left/2;
+          stolen = call_chunk_new(victim->region.tid, mid, victim->region.end);
+          victim->region.end = mid;
+     }
+     pthread_mutex_unlock(& victim->region.lock);
+
+     if (stolen) {
+          LOG_DEBUG("Stole %s:%d-%d\n", pool->h->target_name[stolen->region.tid],
+                    stolen->region.beg+1, stolen->region.end);
+          /* insert right after victim to keep output order */
+          stolen->next = victim->next;
+          victim->next = stolen;
+     }
+     return stolen;
 }
-/* usage() */
 
 
-int
-main_call(int argc, char *argv[])
+/* returns next chunk to work on or NULL if there is none left */
+static call_chunk_t *
+call_pool_next_chunk(call_pool_t *pool)
 {
-     /* based on bam_mpileup() */
-     int c, i;
-     static int use_orphan = 0;
-     static int only_indels = 0;
-     static int no_indels = 1;
+     call_chunk_t *c;
 
-     static int plp_summary_only = 0;
-     static int no_default_filter = 0;
-     static int illumina_1_3 = 0;
-     char *bam_file = NULL;
-     char *bed_file = NULL;
-     char *vcf_out = NULL; /* == - == stdout */
-     char vcf_tmp_template[] = "/tmp/lofreq2-call-dyn-bonf.XXXXXX";
-     char *vcf_tmp_out = NULL; /* write to this file first, then filter */
-     mplp_conf_t mplp_conf;
-     varcall_conf_t varcall_conf;
-     /*void (*plp_proc_func)(const plp_col_t*, const varcall_conf_t*);*/
-     void (*plp_proc_func)(const plp_col_t*, void*);
-     int rc = 0;
-     char *ign_vcf = NULL;
+     pthread_mutex_lock(& pool->lock);
+     if (pool->rc) {
+          pthread_mutex_unlock(& pool->lock);
+          return NULL;
+     }
+     for (c = pool->chunks; c; c = c->next) {
+          if (c->state == CHUNK_PENDING) {
+               break;
+          }
+     }
+     if (! c && ! pool->no_steal) {
+          c = call_pool_steal(pool);
+     }
+     if (c) {
+          c->state = CHUNK_RUNNING;
+     }
+     pthread_mutex_unlock(& pool->lock);
+     return c;
+}
 
 
-/* FIXME add sens test:
-construct p such with
-quality_range = [20, 25, 30, 35, 40]
-coverage_range = [10, 50, 100, 500, 1000, 5000, 10000]
-refbase = 'A'
-snpbase = 'C'
+/* marks chunk as done, adds up stats and writes all chunks that are
+ * ready in order */
+static void
+call_pool_chunk_done(call_pool_t *pool, call_chunk_t *chunk,
+                     const varcall_conf_t *chunk_conf, int rc)
+{
+     pthread_mutex_lock(& pool->lock);
+
+     chunk->state = CHUNK_DONE;
+     if (rc) {
+          pool->rc = rc;
+     }
+     pool->num_snv_tests += chunk_conf->num_snv_tests;
+     pool->num_indel_tests += chunk_conf->num_indel_tests;
+     pool->indel_calls_wo_idaq += chunk_conf->indel_calls_wo_idaq;
+
+     while (pool->unflushed && pool->unflushed->state == CHUNK_DONE) {
+          call_chunk_t *c = pool->unflushed;
+          if (c->vcf_buf_len) {
+               if (vcf_file_write(pool->vcf_out, c->vcf_buf, c->vcf_buf_len) < 0) {
+                    LOG_ERROR("%s\n", "Couldn't write variants");
+                    pool->rc = -1;
+               }
+          }
+          free(c->vcf_buf);
+          c->vcf_buf = NULL;
+          c->vcf_buf_len = 0;
+          pool->unflushed = c->next;
+     }
+
+     pthread_mutex_unlock(& pool->lock);
+}
+
+
+static void *
+call_worker(void *arg)
+{
+     call_pool_t *pool = (call_pool_t *)arg;
+     mplp_conf_t mplp_conf;
+     varcall_conf_t varcall_conf;
+     call_chunk_t *chunk;
+
+     memcpy(& mplp_conf, pool->mplp_conf, sizeof(mplp_conf_t));
+     mplp_conf.reg = NULL;
+     mplp_conf.idx = pool->idx;
+     if (pool->refcache) {
+          mplp_conf.refcache = pool->refcache;
+     }
+
+     while (NULL != (chunk = call_pool_next_chunk(pool))) {
+          int rc;
+
+          /* tests are counted per chunk. with bonf_dynamic the factors
+           * used while calling this chunk are therefore smaller than
+           * those of a single-threaded run, which only means less
+           * pruning: the default filter applies the summed up totals
+           * (see mpileup_call_threaded()) */
+          memcpy(& varcall_conf, pool->varcall_conf, sizeof(varcall_conf_t));
+          varcall_conf.num_snv_tests = varcall_conf.num_indel_tests = 0;
+          varcall_conf.indel_calls_wo_idaq = 0;
+          if (vcf_file_open_mem(& varcall_conf.vcf_out, & chunk->vcf_buf, & chunk->vcf_buf_len)) {
+               LOG_FATAL("%s\n", "Couldn't open in-memory vcf");
+               call_pool_chunk_done(pool, chunk, & varcall_conf, -1);
+               break;
+          }
+          mplp_conf.region = & chunk->region;
+
+          rc = mpileup(& mplp_conf, pool->plp_proc_func, (void*) & varcall_conf,
+                       1, & pool->bam_file);
+
+          vcf_file_close(& varcall_conf.vcf_out);
+          call_pool_chunk_done(pool, chunk, & varcall_conf, rc);
+     }
+     return NULL;
+}
+
+
+/* multi-threaded version of mpileup() for plp_proc_funcs using
+ * varcall_conf_t, i.e. call_vars() or count_tests(). writes variants in
+ * order to varcall_conf->vcf_out and sets the number of tests and
+ * dynamic bonferroni factors as if run in one thread. returns non-zero
+ * on error.
+ */
+int
+mpileup_call_threaded(const mplp_conf_t *mplp_conf,
+                      void (*plp_proc_func)(const plp_col_t*, void*),
+                      varcall_conf_t *varcall_conf,
+                      const char *bam_file, const int num_threads)
+{
+     call_pool_t pool;
+     pthread_t *threads;
+     int i;
+     int rc;
+
+     if (call_pool_init(& pool, mplp_conf, plp_proc_func, varcall_conf, bam_file,
+                        & varcall_conf->vcf_out, num_threads)) {
+          call_pool_free(& pool);
+          return 1;
+     }
+
+     if (NULL == (threads = malloc(num_threads * sizeof(pthread_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          call_pool_free(& pool);
+          return 1;
+     }
+     for (i=0; i<num_threads; i++) {
+          if (pthread_create(& threads[i], NULL, call_worker, & pool)) {
+               LOG_FATAL("Couldn't create thread #%d\n", i+1);
+               exit(1);
+          }
+     }
+     for (i=0; i<num_threads; i++) {
+          pthread_join(threads[i], NULL);
+     }
+     free(threads);
+
+     rc = pool.rc;
+     varcall_conf->num_snv_tests += pool.num_snv_tests;
+     varcall_conf->num_indel_tests += pool.num_indel_tests;
+     varcall_conf->indel_calls_wo_idaq += pool.indel_calls_wo_idaq;
+     /* reproduce what dynamic counting in one thread would give */
+     if (varcall_conf->bonf_dynamic) {
+          if (varcall_conf->num_snv_tests) {
+               varcall_conf->bonf_subst = varcall_conf->num_snv_tests;
+          }
+          varcall_conf->bonf_indel = 1 + varcall_conf->num_indel_tests;
+     }
+
+     call_pool_free(& pool);
+     return rc;
+}
+/* mpileup_call_threaded() */
+
+
+/* multi-sample calling: all samples are piled up together, so that
+ * reference and bed are processed once per position instead of once
+ * per BAM file. each sample keeps its own varcall_conf_t (output and
+ * test counts)
+ */
+
+typedef struct {
+     void (*plp_proc_func)(const plp_col_t*, void*); /* e.g. call_vars */
+     varcall_conf_t *varcall_confs; /* one per sample */
+} multi_call_t;
+
+
+static void
+multi_plp_proc(const plp_col_t **plp_cols, const int n, void *confp)
+{
+     multi_call_t *mc = (multi_call_t *) confp;
+     int i;
+
+     for (i=0; i<n; i++) {
+          mc->plp_proc_func(plp_cols[i], (void*) & mc->varcall_confs[i]);
+     }
+}
+/* multi_plp_proc() */
+
+
+/* runs lofreq filter on vcf_tmp_out and writes to vcf_out. applies
+ * snv/indel quality thresholds derived from the dynamic bonferroni
+ * factors if needed. filter runs with num_threads threads. returns
+ * non-zero on error.
+ */
+static int
+default_filter(const char *vcf_tmp_out, const char *vcf_out,
+               const varcall_conf_t *varcall_conf,
+               const int no_default_filter, const int bgzf_threads,
+               const int num_threads)
+{
+     char cmd[BUF_SIZE];
+     int len;
+
+     snprintf(cmd, BUF_SIZE,
+              "lofreq filter -i %s -o %s",
+              vcf_tmp_out, NULL==vcf_out ? "-" : vcf_out);
+     len = strlen(cmd);
+
+     if (no_default_filter) {
+          len += sprintf(cmd+len, " %s", "--no-defaults");
+     }
+     if (bgzf_threads > 1) {
+          len += sprintf(cmd+len, " --bgzf-threads %d", bgzf_threads);
+     }
+     if (num_threads > 1) {
+          len += sprintf(cmd+len, " --threads %d", num_threads);
+     }
+
+     if (varcall_conf->bonf_dynamic) {
+          int snvqual_thresh = INT_MAX;
+          int indelqual_thresh = INT_MAX;
+
+          if (varcall_conf->bonf_subst) {
+               snvqual_thresh = PROB_TO_PHREDQUAL(varcall_conf->sig/varcall_conf->bonf_subst);
+               if (snvqual_thresh < 0) {
+                    snvqual_thresh = 0;
+               }
+          }
+          if (varcall_conf->bonf_indel) {
+               indelqual_thresh =  PROB_TO_PHREDQUAL(varcall_conf->sig/varcall_conf->bonf_indel);
+               if (indelqual_thresh < 0) {
+                    indelqual_thresh = 0;
+               }
+          }
+
+          len += sprintf(cmd+len,/* appending to str with format. see http://stackoverflow.com/questions/14023024/strcat-for-formatted-strings */
+                         " --snvqual-thresh %d --indelqual-thresh %d",
+                         snvqual_thresh, indelqual_thresh);
+     } else {
+          LOG_VERBOSE("%s\n", "No SNV/indel-quality filtering needed (already applied during call since bonf was fixed)");
+     }
+
+     LOG_VERBOSE("Executing %s\n", cmd);
+     if (0 != system(cmd)) {
+          LOG_ERROR("The following command failed: %s\n", cmd);
+          return 1;
+     }
+     /*if (! debug)*/
+     (void) unlink(vcf_tmp_out);
+     return 0;
+}
+/* default_filter() */
+
+
+/* output file for bam_file in multi-sample mode:
+ * <out_prefix><basename of bam_file without .bam>.vcf.gz. caller has
+ * to free
+ */
+static char *
+multi_sample_vcf_name(const char *out_prefix, const char *bam_file)
+{
+     const char *base;
+     char *vcf_name;
+     int len;
+
+     base = strrchr(bam_file, '/');
+     base = base ? base+1 : bam_file;
+     len = strlen(base);
+     if (len > 4 && 0 == strcmp(& base[len-4], ".bam")) {
+          len -= 4;
+     }
+     vcf_name = malloc(strlen(out_prefix) + len + strlen(".vcf.gz") + 1);
+     if (NULL == vcf_name) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(vcf_name, "%s%.*s.vcf.gz", out_prefix, len, base);
+     return vcf_name;
+}
+/* multi_sample_vcf_name() */
+
+
+/* calls variants in num_bams>1 BAM files (see multi_call_t) and
+ * writes them to one vcf file per sample. varcall_conf serves as
+ * template. returns non-zero on error.
+ */
+static int
+call_multi_sample(const mplp_conf_t *mplp_conf, const varcall_conf_t *varcall_conf,
+                  const char **bam_files, const int num_bams,
+                  const char *out_prefix, const int bonf_auto,
+                  const int no_default_filter, const int bgzf_threads)
+{
+     const mplp_conf_t **mplp_confs = NULL;
+     varcall_conf_t *varcall_confs = NULL;
+     char **vcf_outs = NULL;
+     char **vcf_tmp_outs = NULL;
+     multi_call_t mc;
+     int direct_out = (no_default_filter && ! varcall_conf->bonf_dynamic);
+     int i, j;
+     int rc = 1;
+
+     mplp_confs = calloc(num_bams, sizeof(mplp_conf_t *));
+     varcall_confs = calloc(num_bams, sizeof(varcall_conf_t));
+     vcf_outs = calloc(num_bams, sizeof(char *));
+     vcf_tmp_outs = calloc(num_bams, sizeof(char *));
+     if (! mplp_confs || ! varcall_confs || ! vcf_outs || ! vcf_tmp_outs) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     for (i=0; i<num_bams; i++) {
+          vcf_outs[i] = multi_sample_vcf_name(out_prefix, bam_files[i]);
+          for (j=0; j<i; j++) {
+               if (0 == strcmp(vcf_outs[i], vcf_outs[j])) {
+                    LOG_FATAL("BAM files %s and %s would be written to the same output file %s\n",
+                              bam_files[j], bam_files[i], vcf_outs[i]);
+                    goto free_and_exit;
+               }
+          }
+          if (file_exists(vcf_outs[i])) {
+               LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", vcf_outs[i]);
+               goto free_and_exit;
+          }
+          mplp_confs[i] = mplp_conf;
+          memcpy(& varcall_confs[i], varcall_conf, sizeof(varcall_conf_t));
+     }
+
+     if (bonf_auto) {
+          /* first pass for all samples at once: count tests. see main_call() */
+          mplp_conf_t count_mplp_conf;
+          varcall_conf_t *count_confs;
+
+          memcpy(& count_mplp_conf, mplp_conf, sizeof(mplp_conf_t));
+          count_mplp_conf.flag &= ~(MPLP_BAQ | MPLP_IDAQ | MPLP_USE_SQ);
+          count_mplp_conf.qual_cache = NULL;
+          if (NULL == (count_confs = malloc(num_bams * sizeof(varcall_conf_t)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          for (i=0; i<num_bams; i++) {
+               mplp_confs[i] = & count_mplp_conf;
+               memcpy(& count_confs[i], varcall_conf, sizeof(varcall_conf_t));
+          }
+          mc.plp_proc_func = &count_tests;
+          mc.varcall_confs = count_confs;
+
+          LOG_VERBOSE("%s\n", "Counting tests to determine Bonferroni factors");
+          if (mpileup_multi(mplp_confs, &multi_plp_proc, (void*) &mc,
+                            num_bams, bam_files)) {
+               free(count_confs);
+               goto free_and_exit;
+          }
+          for (i=0; i<num_bams; i++) {
+               mplp_confs[i] = mplp_conf;
+               varcall_confs[i].bonf_subst = MAX(1, count_confs[i].num_snv_tests);
+               varcall_confs[i].bonf_indel = MAX(1, count_confs[i].num_indel_tests);
+               LOG_VERBOSE("Bonferroni factors for %s determined as %lld (substitutions) and %lld (indels)\n",
+                           bam_files[i], varcall_confs[i].bonf_subst, varcall_confs[i].bonf_indel);
+          }
+          free(count_confs);
+     }
+
+     for (i=0; i<num_bams; i++) {
+          const char *out;
+          if (direct_out) {
+               out = vcf_outs[i];
+          } else {
+               char vcf_tmp_template[] = "/tmp/lofreq2-call-dyn-bonf.XXXXXX";
+               vcf_tmp_outs[i] = strdup(mktemp(vcf_tmp_template));
+               if (NULL == vcf_tmp_outs[i]) {
+                    LOG_FATAL("%s\n", "Couldn't create temporary vcf file");
+                    goto free_and_exit;
+               }
+               out = vcf_tmp_outs[i];
+          }
+          if (vcf_file_open(& varcall_confs[i].vcf_out, out,
+                            HAS_GZIP_EXT(out), 'w')) {
+               LOG_ERROR("Couldn't open %s\n", out);
+               goto free_and_exit;
+          }
+          if (direct_out) {
+               (void) vcf_file_set_threads(& varcall_confs[i].vcf_out, bgzf_threads);
+          }
+          vcf_write_new_header(& varcall_confs[i].vcf_out,
+                               mplp_conf->cmdline, mplp_conf->fa);
+     }
+
+     mc.plp_proc_func = &call_vars;
+     mc.varcall_confs = varcall_confs;
+     rc = mpileup_multi(mplp_confs, &multi_plp_proc, (void*) &mc,
+                        num_bams, bam_files);
+
+     for (i=0; i<num_bams; i++) {
+          vcf_file_close(& varcall_confs[i].vcf_out);
+     }
+     if (rc) {
+          goto free_and_exit;
+     }
+
+     for (i=0; i<num_bams; i++) {
+          if (varcall_confs[i].indel_calls_wo_idaq && varcall_confs[i].flag & VARCALL_USE_IDAQ) {
+               LOG_WARN("%ld indel calls (before filtering) in %s were made without indel alignment-quality!"
+                        " Did you forget to indel alignment-quality to your bam-file?\n",
+                        varcall_confs[i].indel_calls_wo_idaq, bam_files[i]);
+          }
+          if (! direct_out) {
+               if (default_filter(vcf_tmp_outs[i], vcf_outs[i], & varcall_confs[i],
+                                  no_default_filter, bgzf_threads, 1)) {
+                    rc = 1;
+                    goto free_and_exit;
+               }
+          }
+     }
+
+     for (i=0; i<num_bams; i++) {
+          /* see main_call() */
+          int org_verbose = verbose;
+          verbose = 1;
+          LOG_VERBOSE("Number of substitution tests performed for %s: %lld\n",
+                      bam_files[i], varcall_confs[i].num_snv_tests);
+          LOG_VERBOSE("Number of indel tests performed for %s: %lld\n",
+                      bam_files[i], varcall_confs[i].num_indel_tests);
+          verbose = org_verbose;
+     }
+
+free_and_exit:
+     for (i=0; i<num_bams; i++) {
+          free(vcf_outs[i]);
+          free(vcf_tmp_outs[i]);
+     }
+     free(vcf_outs);
+     free(vcf_tmp_outs);
+     free(varcall_confs);
+     free(mplp_confs);
+     return rc;
+}
+/* call_multi_sample() */
+
+
+/* plp_proc_func wrapper storing every column it sees in a pileup
+ * stats file before passing it on (see --stats-out)
+ */
+typedef struct {
+     void (*plp_proc_func)(const plp_col_t*, void*);
+     void *plp_proc_conf;
+     plpstats_t *stats;
+} plpstats_store_conf_t;
+
+
+static void
+plpstats_store(const plp_col_t *p, void *confp)
+{
+     plpstats_store_conf_t *conf = (plpstats_store_conf_t *) confp;
+
+     /* errors are sticky and reported by plpstats_close() */
+     (void) plpstats_write_col(conf->stats, p);
+     conf->plp_proc_func(p, conf->plp_proc_conf);
+}
+/* plpstats_store() */
+
+
+/* plp_proc_func wrapper adding every column it sees to coverage
+ * blocks before passing it on (see --cov-blocks). plp_proc_func can
+ * be NULL, i.e. only blocks are written
+ */
+typedef struct {
+     void (*plp_proc_func)(const plp_col_t*, void*);
+     void *plp_proc_conf;
+     covblock_t *blocks;
+} covblock_store_conf_t;
+
+
+static void
+covblock_store(const plp_col_t *p, void *confp)
+{
+     covblock_store_conf_t *conf = (covblock_store_conf_t *) confp;
+
+     covblock_add_col(conf->blocks, p);
+     if (conf->plp_proc_func) {
+          conf->plp_proc_func(p, conf->plp_proc_conf);
+     }
+}
+/* covblock_store() */
+
+
+/* skip_col_func for columns without alt evidence, which call_vars()
+ * doesn't need but blocks do */
+static void
+covblock_store_skipped(const plp_col_t *p, void *confp)
+{
+     covblock_add_col((covblock_t *) confp, p);
+}
+/* covblock_store_skipped() */
+
+
+/* calls variants on all columns of a pileup stats file, i.e. replaces
+ * the mpileup() pass (see --from-stats)
+ */
+static int
+call_from_stats(plpstats_t *stats, varcall_conf_t *varcall_conf)
+{
+     plp_col_t p;
+     int ret;
+
+     plp_col_init(& p);
+     while (1 == (ret = plpstats_read_col(stats, & p))) {
+          call_vars(& p, (void*) varcall_conf);
+     }
+     plp_col_free(& p);
+     LOG_VERBOSE("Called variants on %ld stored columns\n", stats->num_cols);
+     return ret < 0 ? 1 : 0;
+}
+/* call_from_stats() */
+
+
+/* checksum of everything shards of one job have to agree on: BAM,
+ * reference, pileup and calling parameters, but not region or
+ * output. see --manifest. shards may run on different machines, so
+ * BAM and reference are identified by content (@SQ names, lengths and
+ * M5 tags, and the lengths in the fasta index), not by their paths,
+ * sizes or times */
+static uint64_t
+call_params_checksum(const mplp_conf_t *mplp_conf, const varcall_conf_t *varcall_conf,
+                     const char *bam_file, const int bonf_auto)
+{
+     const char *magic = "lofreq call parameters";
+     uint64_t h = qual_cache_hash64(0, magic, strlen(magic));
+     int v[] = {varcall_conf->min_bq, varcall_conf->min_alt_bq, varcall_conf->def_alt_bq,
+                varcall_conf->min_jq, varcall_conf->min_alt_jq, varcall_conf->def_alt_jq,
+                varcall_conf->min_cov, varcall_conf->flag, varcall_conf->no_indels,
+                varcall_conf->only_indels, varcall_conf->bonf_dynamic, bonf_auto,
+                mplp_conf->max_depth, mplp_conf->ds_depth, (int) mplp_conf->ds_seed,
+                mplp_conf->flag & ~(MPLP_ALT_ONLY | MPLP_REF_HIST)};
+     int bed = (NULL != mplp_conf->bed);
+     htsFile *fp;
+     int i;
+
+     if (NULL != (fp = hts_open(bam_file, "r"))) {
+          bam_header_t *header = sam_hdr_read(fp);
+          if (header) {
+               const char *line = header->text;
+               const char *text_end = header->text + header->l_text;
+
+               h = qual_cache_hash64(h, & header->n_targets, sizeof(header->n_targets));
+               for (i=0; i<header->n_targets; i++) {
+                    /* including the terminating null */
+                    h = qual_cache_hash64(h, header->target_name[i], strlen(header->target_name[i])+1);
+                    h = qual_cache_hash64(h, & header->target_len[i], sizeof(header->target_len[i]));
+               }
+               while (line < text_end) {
+                    const char *line_end = memchr(line, '\n', text_end-line);
+                    char m5[64];
+                    if (! line_end) {
+                         line_end = text_end;
+                    }
+                    if (line_end-line > 3 && 0 == strncmp(line, "@SQ", 3)
+                        && sq_tag(m5, sizeof(m5), line, line_end, "M5")) {
+                         h = qual_cache_hash64(h, m5, strlen(m5)+1);
+                    }
+                    line = line_end+1;
+               }
+               bam_header_destroy(header);
+          }
+          hts_close(fp);
+     }
+     if (mplp_conf->fai) {
+          int n = faidx_nseq(mplp_conf->fai);
+          h = qual_cache_hash64(h, & n, sizeof(n));
+          for (i=0; i<n; i++) {
+               const char *name = faidx_iseq(mplp_conf->fai, i);
+               int len = faidx_seq_len(mplp_conf->fai, name);
+               h = qual_cache_hash64(h, name, strlen(name)+1);
+               h = qual_cache_hash64(h, & len, sizeof(len));
+          }
+     }
+
+     h = mplp_params_checksum(h, mplp_conf);
+     h = qual_cache_hash64(h, v, sizeof(v));
+     h = qual_cache_hash64(h, & varcall_conf->sig, sizeof(varcall_conf->sig));
+     h = qual_cache_hash64(h, & bed, sizeof(bed));
+     if (! varcall_conf->bonf_dynamic && ! bonf_auto) {
+          h = qual_cache_hash64(h, & varcall_conf->bonf_subst, sizeof(varcall_conf->bonf_subst));
+     }
+     return h;
+}
+/* call_params_checksum() */
+
+
+/* writes manifest for the shard of a job called (see shard.h), once
+ * vcf_out is complete. returns non-zero on error */
+static int
+write_shard_manifest(const char *manifest, const char *vcf_out,
+                     const mplp_conf_t *mplp_conf, const varcall_conf_t *varcall_conf,
+                     const char *bam_file, const int bonf_auto)
+{
+     shard_manifest_t m;
+     char vcf_resolved[PATH_MAX];
+     htsFile *fp;
+     bam_header_t *h;
+     int rc;
+
+     if (NULL == (fp = hts_open(bam_file, "r"))) {
+          LOG_ERROR("Couldn't open %s\n", bam_file);
+          return 1;
+     }
+     if (NULL == (h = sam_hdr_read(fp))) {
+          LOG_ERROR("Couldn't read header of %s\n", bam_file);
+          hts_close(fp);
+          return 1;
+     }
+     hts_close(fp);
+
+     memset(& m, 0, sizeof(shard_manifest_t));
+     /* merge might run elsewhere. see main_merge() */
+     m.vcf = realpath(vcf_out, vcf_resolved) ? vcf_resolved : (char *) vcf_out;
+     m.vcf_checksum = shard_file_checksum(vcf_out);
+     m.bam = (char *) bam_file;
+     m.ref = mplp_conf->fa;
+     m.region = mplp_conf->reg;
+     m.params_checksum = call_params_checksum(mplp_conf, varcall_conf, bam_file, bonf_auto);
+     m.sig = varcall_conf->sig;
+     if (bonf_auto) {
+          m.bonf = SHARD_BONF_AUTO;
+     } else if (varcall_conf->bonf_dynamic) {
+          m.bonf = SHARD_BONF_DYNAMIC;
+     } else {
+          m.bonf = SHARD_BONF_FIXED;
+     }
+     m.bonf_subst = varcall_conf->bonf_subst;
+     m.bonf_indel = varcall_conf->bonf_indel;
+     m.num_snv_tests = varcall_conf->num_snv_tests;
+     m.num_indel_tests = varcall_conf->num_indel_tests;
+     m.num_seqs = h->n_targets;
+     m.seqs = h->target_name;
+     m.cmdline = (char *) mplp_conf->cmdline;
+
+     rc = shard_manifest_write(manifest, & m);
+     bam_header_destroy(h);
+     return rc;
+}
+/* write_shard_manifest() */
+
+
+/* checkpointing of long single-threaded runs (see --checkpoint):
+ * unfiltered calls go to the checkpoint path plus CHECKPOINT_VCF_EXT
+ * and every interval seconds the last column processed, the test
+ * counters and the flushed offset of that file are recorded. a
+ * resumed run truncates the file to that offset and continues after
+ * that column. text format, one tab-separated key and value per line
+ */
+#define CHECKPOINT_MAGIC "lofreq_checkpoint"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_VCF_EXT ".vcf"
+#define DEFAULT_CHECKPOINT_INTERVAL 300
+/* the clock is only looked at every so many columns */
+#define CHECKPOINT_CHECK_COLS 1000
+
+typedef struct {
+     uint64_t params_checksum; /* of call_params_checksum() and region */
+     int tid; /* last column processed */
+     long int pos;
+     long int vcf_offset;
+     long long int bonf_subst, bonf_indel;
+     long long int num_snv_tests, num_indel_tests;
+     long int indel_calls_wo_idaq;
+} checkpoint_t;
+
+/* plp_proc_func wrapper writing checkpoints */
+typedef struct {
+     void (*plp_proc_func)(const plp_col_t*, void*);
+     void *plp_proc_conf;
+     varcall_conf_t *varcall_conf;
+     const char *path;
+     checkpoint_t state;
+     int interval; /* seconds. 0: after every column */
+     time_t last_write;
+     long int num_cols;
+} checkpoint_conf_t;
+
+
+static int
+checkpoint_write(checkpoint_conf_t *c)
+{
+     const varcall_conf_t *vc = c->varcall_conf;
+     checkpoint_t *ck = & c->state;
+     char tmp_path[PATH_MAX];
+     FILE *fh;
+
+     /* everything up to here has to be on disk before it's recorded */
+     if (vcf_file_flush(& c->varcall_conf->vcf_out)) {
+          LOG_WARN("Couldn't flush output for checkpoint %s\n", c->path);
+          return 1;
+     }
+     ck->vcf_offset = vcf_file_tell(& c->varcall_conf->vcf_out);
+     ck->bonf_subst = vc->bonf_subst;
+     ck->bonf_indel = vc->bonf_indel;
+     ck->num_snv_tests = vc->num_snv_tests;
+     ck->num_indel_tests = vc->num_indel_tests;
+     ck->indel_calls_wo_idaq = vc->indel_calls_wo_idaq;
+
+     /* written to a tmp file first and then renamed, so that a crash
+      * never leaves a partial checkpoint behind */
+     snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", c->path);
+     if (NULL == (fh = fopen(tmp_path, "w"))) {
+          LOG_WARN("Couldn't write checkpoint %s\n", tmp_path);
+          return 1;
+     }
+     fprintf(fh, "%s\t%d\n", CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+     fprintf(fh, "params_checksum\t%016"PRIx64"\n", ck->params_checksum);
+     fprintf(fh, "tid\t%d\n", ck->tid);
+     fprintf(fh, "pos\t%ld\n", ck->pos);
+     fprintf(fh, "vcf_offset\t%ld\n", ck->vcf_offset);
+     fprintf(fh, "bonf_subst\t%lld\n", ck->bonf_subst);
+     fprintf(fh, "bonf_indel\t%lld\n", ck->bonf_indel);
+     fprintf(fh, "num_snv_tests\t%lld\n", ck->num_snv_tests);
+     fprintf(fh, "num_indel_tests\t%lld\n", ck->num_indel_tests);
+     fprintf(fh, "indel_calls_wo_idaq\t%ld\n", ck->indel_calls_wo_idaq);
+     if (ferror(fh) | fclose(fh) || rename(tmp_path, c->path)) {
+          LOG_WARN("Couldn't write checkpoint %s\n", c->path);
+          (void) unlink(tmp_path);
+          return 1;
+     }
+     LOG_DEBUG("Checkpoint written after column %d:%ld\n", ck->tid, ck->pos+1);
+     return 0;
+}
+/* checkpoint_write() */
+
+
+/* returns 0 on success, i.e. if a valid checkpoint was read into ck */
+static int
+checkpoint_read(const char *path, checkpoint_t *ck)
+{
+     FILE *fh;
+     char key[64];
+     char magic[64];
+     int version;
+     long long int val;
+     int n = 0;
+
+     memset(ck, 0, sizeof(checkpoint_t));
+     ck->tid = -1;
+     if (NULL == (fh = fopen(path, "r"))) {
+          return 1;
+     }
+     if (2 != fscanf(fh, "%63s %d", magic, &version)
+         || 0 != strcmp(magic, CHECKPOINT_MAGIC) || version != CHECKPOINT_VERSION) {
+          LOG_ERROR("%s is not a valid checkpoint\n", path);
+          fclose(fh);
+          return 1;
+     }
+     if (2 != fscanf(fh, "%63s %"SCNx64, key, & ck->params_checksum)
+         || 0 != strcmp(key, "params_checksum")) {
+          LOG_ERROR("%s is not a valid checkpoint\n", path);
+          fclose(fh);
+          return 1;
+     }
+     while (2 == fscanf(fh, "%63s %lld", key, &val)) {
+          n += 1;
+          if (0 == strcmp(key, "tid")) {
+               ck->tid = (int) val;
+          } else if (0 == strcmp(key, "pos")) {
+               ck->pos = (long int) val;
+          } else if (0 == strcmp(key, "vcf_offset")) {
+               ck->vcf_offset = (long int) val;
+          } else if (0 == strcmp(key, "bonf_subst")) {
+               ck->bonf_subst = val;
+          } else if (0 == strcmp(key, "bonf_indel")) {
+               ck->bonf_indel = val;
+          } else if (0 == strcmp(key, "num_snv_tests")) {
+               ck->num_snv_tests = val;
+          } else if (0 == strcmp(key, "num_indel_tests")) {
+               ck->num_indel_tests = val;
+          } else if (0 == strcmp(key, "indel_calls_wo_idaq")) {
+               ck->indel_calls_wo_idaq = (long int) val;
+          } else {
+               n -= 1;
+          }
+     }
+     fclose(fh);
+     if (n != 8 || ck->tid < 0 || ck->vcf_offset <= 0) {
+          LOG_ERROR("Incomplete checkpoint %s\n", path);
+          return 1;
+     }
+     return 0;
+}
+/* checkpoint_read() */
+
+
+static void
+checkpoint_plp_proc(const plp_col_t *p, void *confp)
+{
+     checkpoint_conf_t *c = (checkpoint_conf_t *) confp;
+
+     c->plp_proc_func(p, c->plp_proc_conf);
+     /* column is completely processed now */
+     c->state.tid = p->tid;
+     c->state.pos = p->pos;
+     c->num_cols += 1;
+     if (0 == c->interval || 0 == c->num_cols % CHECKPOINT_CHECK_COLS) {
+          time_t now = time(NULL);
+          if (now - c->last_write >= c->interval) {
+               /* not fatal: worst case an older checkpoint is used */
+               (void) checkpoint_write(c);
+               c->last_write = now;
+          }
+     }
+}
+/* checkpoint_plp_proc() */
+
+
+/* continues a run from checkpoint ck, i.e. piles up everything after
+ * its last column, one target at a time via the index
+ */
+static int
+mpileup_resume(const mplp_conf_t *mplp_conf,
+               void (*plp_proc_func)(const plp_col_t*, void*),
+               void *plp_proc_conf, const char *bam_file,
+               const checkpoint_t *ck)
+{
+     mplp_conf_t resume_conf;
+     plp_region_t region;
+     htsFile *fp;
+     bam_header_t *h;
+     int tid, last_tid;
+     int reg_tid = -1, reg_beg = 0, reg_end = 0;
+     int rc = 0;
+
+     if (NULL == (fp = hts_open(bam_file, "r")) || NULL == (h = sam_hdr_read(fp))) {
+          LOG_ERROR("Couldn't read header of %s\n", bam_file);
+          if (fp) {
+               hts_close(fp);
+          }
+          return 1;
+     }
+     hts_close(fp);
+     if (ck->tid >= h->n_targets) {
+          LOG_ERROR("Checkpoint doesn't match %s\n", bam_file);
+          bam_header_destroy(h);
+          return 1;
+     }
+     if (mplp_conf->reg && bam_parse_region(h, mplp_conf->reg, &reg_tid, &reg_beg, &reg_end) < 0) {
+          LOG_ERROR("Couldn't parse region %s\n", mplp_conf->reg);
+          bam_header_destroy(h);
+          return 1;
+     }
+
+     memcpy(& resume_conf, mplp_conf, sizeof(mplp_conf_t));
+     /* reg takes precedence over region in mpileup() */
+     resume_conf.reg = NULL;
+     resume_conf.region = & region;
+     memset(& region, 0, sizeof(plp_region_t));
+     pthread_mutex_init(& region.lock, NULL);
+
+     last_tid = mplp_conf->reg ? reg_tid : h->n_targets-1;
+     for (tid = ck->tid; 0 == rc && tid <= last_tid; tid++) {
+          region.tid = tid;
+          region.beg = (tid == ck->tid) ? ck->pos+1 : 0;
+          region.end = h->target_len[tid];
+          if (mplp_conf->reg) {
+               region.beg = MAX(region.beg, reg_beg);
+               region.end = MIN(region.end, reg_end);
+          }
+          if (region.beg >= region.end) {
+               continue;
+          }
+          region.cur = region.beg;
+          LOG_VERBOSE("Resuming at %s:%d\n", h->target_name[tid], region.beg+1);
+          rc = mpileup(& resume_conf, plp_proc_func, plp_proc_conf, 1, & bam_file);
+     }
+
+     pthread_mutex_destroy(& region.lock);
+     bam_header_destroy(h);
+     return rc;
+}
+/* mpileup_resume() */
+
+
+/* lofreq serve answers each query with the variant records found in
+ * it, followed by this line */
+#define SERVE_END_OF_QUERY "//"
+
+/* converts a serve query into region string reg. queries are regions
+ * (chrom or chrom:start-end), positions (chrom pos) or VCF records
+ * (chrom pos id ref ...), in which case the whole reference allele is
+ * queried. returns 1 if line is to be skipped, i.e. empty or comment
+ */
+static int
+serve_query_to_region(const char *line, char *reg, const size_t reg_size)
+{
+     char chrom[BUF_SIZE];
+     char id[BUF_SIZE];
+     char ref[BUF_SIZE];
+     long int pos;
+     int n;
+
+     if ('\0' == line[0] || '#' == line[0]) {
+          return 1;
+     }
+     if (strlen(line) >= BUF_SIZE) {
+          /* too long for any of the above. rejected by parser */
+          snprintf(reg, reg_size, "%s", line);
+          return 0;
+     }
+     n = sscanf(line, "%s %ld %s %s", chrom, &pos, id, ref);
+     if (n < 2) {
+          snprintf(reg, reg_size, "%s", line);
+     } else if (n < 4) {
+          snprintf(reg, reg_size, "%s:%ld-%ld", chrom, pos, pos);
+     } else {
+          snprintf(reg, reg_size, "%s:%ld-%ld", chrom, pos, pos + (long int) strlen(ref) - 1);
+     }
+     return 0;
+}
+/* serve_query_to_region() */
+
+
+/* lofreq serve: answers queries read line by line from stdin (see
+ * serve_query_to_region()) with the (unfiltered) variant calls in
+ * them. BAM file, header, index and reference stay loaded, so that
+ * each query only costs its pileup */
+static int
+call_serve(mplp_conf_t *mplp_conf, varcall_conf_t *varcall_conf,
+           const char *bam_file)
+{
+     plp_input_t *input;
+     plp_region_t region;
+     char *line = NULL;
+     size_t line_size = 0;
+     char reg[BUF_SIZE];
+     long int num_queries = 0;
+     int rc = 0;
+
+     if (NULL == (input = plp_input_open(mplp_conf, bam_file))) {
+          return 1;
+     }
+     memset(& region, 0, sizeof(plp_region_t));
+     pthread_mutex_init(& region.lock, NULL);
+     mplp_conf->input = input;
+     mplp_conf->region = & region;
+
+     /* header goes out before first query */
+     vcf_file_flush(& varcall_conf->vcf_out);
+     LOG_VERBOSE("Answering queries on %s read from stdin\n", bam_file);
+
+     while (getline(& line, & line_size, stdin) > 0) {
+          line[strcspn(line, "\r\n")] = '\0';
+          if (serve_query_to_region(line, reg, sizeof(reg))) {
+               continue;
+          }
+          if (plp_input_parse_region(input, reg, & region.tid, & region.beg, & region.end)) {
+               LOG_ERROR("Ignoring invalid query '%s'\n", line);
+          } else {
+               region.cur = region.beg;
+               LOG_DEBUG("Query %ld: %s\n", num_queries+1, reg);
+               if (mpileup(mplp_conf, &call_vars, varcall_conf, 1, &bam_file)) {
+                    LOG_ERROR("Pileup failed for query '%s'\n", line);
+                    rc = 1;
+               }
+          }
+          num_queries += 1;
+          vcf_printf(& varcall_conf->vcf_out, "%s\n", SERVE_END_OF_QUERY);
+          vcf_file_flush(& varcall_conf->vcf_out);
+          if (rc) {
+               break;
+          }
+     }
+     LOG_VERBOSE("Answered %ld queries\n", num_queries);
+
+     free(line);
+     mplp_conf->region = NULL;
+     mplp_conf->input = NULL;
+     pthread_mutex_destroy(& region.lock);
+     plp_input_close(input);
+     return rc;
+}
+/* call_serve() */
+
+
+static void
+usage_serve(void)
+{
+     fprintf(stderr, "lofreq serve: keep BAM file, index and reference loaded and call variants on queries read from stdin\n\n");
+     fprintf(stderr, "Usage: lofreq serve [call options] in.bam\n\n");
+     fprintf(stderr, "Options are those of '%s', except for output, region, threads and pileup stats options.\n", MYNAME);
+     fprintf(stderr, "Queries are one per line: a region (chrom:start-end), a position (chrom pos) or a VCF record\n");
+     fprintf(stderr, "(chrom pos id ref ..., querying the whole reference allele). Lines starting with # are skipped.\n");
+     fprintf(stderr, "A VCF header is written once. After that, each query is answered with the variant records in it\n");
+     fprintf(stderr, "and a line '%s'. Calls are unfiltered (as with --no-default-filter) and, unless --bonf INT\n", SERVE_END_OF_QUERY);
+     fprintf(stderr, "is given, not Bonferroni corrected, so that answers don't depend on earlier queries.\n");
+}
+/* usage_serve() */
+
+
+
+static void
+usage(const mplp_conf_t *mplp_conf, const varcall_conf_t *varcall_conf)
+{
+     fprintf(stderr, "%s: call variants from BAM file\n\n", MYNAME);
+
+     fprintf(stderr, "Usage: %s [options] in.bam [in2.bam ...]\n\n", MYNAME);
+     fprintf(stderr, "(CRAM files can be used instead of BAM files; they're decoded against the reference)\n\n");
+     fprintf(stderr, "Options:\n");
+
+     fprintf(stderr, "- Reference:\n");
+     fprintf(stderr, "       -f | --ref FILE              Indexed reference fasta file (gzip supported) [null]\n");
+
+     fprintf(stderr, "- Output:\n");
+     fprintf(stderr, "       -o | --out FILE              Vcf output file [- = stdout]. BCF if FILE ends in .bcf\n");
+     fprintf(stderr, "                                    (with more than one BAM file: required output prefix, i.e. one vcf per sample\n");
+     fprintf(stderr, "                                    named FILE<BAM basename without .bam>.vcf.gz)\n");
+
+     fprintf(stderr, "- Regions:\n");
+     fprintf(stderr, "       -r | --region STR            Limit calls to this region (chrom:start-end) [null]\n");
+     fprintf(stderr, "       -l | --bed FILE              List of positions (chr pos) or regions (BED) [null]\n");
+
+     fprintf(stderr, "- Base-call quality:\n");
+     fprintf(stderr, "       -q | --min-bq INT            Skip any base with baseQ smaller than INT [%d]\n", varcall_conf->min_bq);
+     fprintf(stderr, "       -Q | --min-alt-bq INT        Skip alternate bases with baseQ smaller than INT [%d]\n", varcall_conf->min_alt_bq);
+     fprintf(stderr, "       -R | --def-alt-bq INT        Overwrite baseQs of alternate bases (that passed bq filter) with this value (-1: use median ref-bq; 0: keep) [%d]\n", varcall_conf->def_alt_bq);
+
+     fprintf(stderr, "       -j | --min-jq INT            Skip any base with joinedQ smaller than INT [%d]\n", varcall_conf->min_jq);
+     fprintf(stderr, "       -J | --min-alt-jq INT        Skip alternate bases with joinedQ smaller than INT [%d]\n", varcall_conf->min_alt_jq);
+     fprintf(stderr, "       -K | --def-alt-jq INT        Overwrite joinedQs of alternate bases (that passed jq filter) with this value (-1: use median ref-bq; 0: keep) [%d]\n", varcall_conf->def_alt_jq);
+
+     fprintf(stderr, "- Base-alignment (BAQ) and indel-aligment (IDAQ) qualities:\n");
+     fprintf(stderr, "       -B | --no-baq                Disable use of base-alignment quality (BAQ)\n");
+     fprintf(stderr, "       -A | --no-idaq               Don't use IDAQ values (NOT recommended under ANY circumstances other than debugging)\n");
+     fprintf(stderr, "       -D | --del-baq               Delete pre-existing BAQ values, i.e. compute even if already present in BAM\n");
+     fprintf(stderr, "       -e | --no-ext-baq            Use 'normal' BAQ (samtools default) instead of extended BAQ (both computed on the fly if not already present in %s tag)\n", BAQ_TAG);
+     fprintf(stderr, "            --qual-cache FILE       Cache BAQ, IDAQ and source qualities in this file (e.g. aln.bam%s) and reuse them in\n", QUAL_CACHE_EXT);
+     fprintf(stderr, "                                    later calls. Recreated automatically if BAM, reference or relevant options change\n");
+     fprintf(stderr, "- Mapping quality:\n");
+     fprintf(stderr, "       -m | --min-mq INT            Skip reads with mapping quality smaller than INT [%d]\n", mplp_conf->min_mq);
+     fprintf(stderr, "       -M | --max-mq INT            Cap mapping quality at INT [%d]\n", mplp_conf->max_mq);
+     fprintf(stderr, "       -N | --no-mq                 Don't merge mapping quality in LoFreq's model\n");
+
+     fprintf(stderr, "- Indels:\n");
+     fprintf(stderr, "            --call-indels           Enable indel calls (note: preprocess your file to include indel alignment qualities!)\n");
+     fprintf(stderr, "            --only-indels           Only call indels; no SNVs\n");
+
+     fprintf(stderr, "- Source quality:\n");
+     fprintf(stderr, "       -s | --src-qual              Enable computation of source quality\n");
+     fprintf(stderr, "       -S | --ign-vcf FILE          Ignore variants in this vcf file for source quality computation. Multiple files can be given separated by commas\n"),
+     fprintf(stderr, "       -T | --def-nm-q INT          If >= 0, then replace non-match base qualities with this default value [%d]\n", mplp_conf->def_nm_q);
+
+     fprintf(stderr, "- P-values:\n");
+     fprintf(stderr, "       -a | --sig                   P-Value cutoff / significance level [%f]\n", varcall_conf->sig);
+     fprintf(stderr, "       -b | --bonf                  Bonferroni factor. 'dynamic' (increase per actually performed test), 'auto' (count possible tests in a\n");
+     fprintf(stderr, "                                    fast first pass; no filtering needed afterwards) or INT ['dynamic']\n");
+     fprintf(stderr, "                                    With --threads, 'dynamic' counts tests per chunk while calling, so less is pruned\n");
+     fprintf(stderr, "                                    early; the final filter uses the total count, so output is the same\n");
+
+     fprintf(stderr, "- Misc.:\n");
+     fprintf(stderr, "       -C | --min-cov INT           Test only positions having at least this coverage [%d]\n", varcall_conf->min_cov);
+     fprintf(stderr, "                                    (note: without --no-default-filter default filters (incl. coverage) kick in after predictions are done)\n");
+     fprintf(stderr, "       -d | --max-depth INT         Cap coverage at this depth [%d]\n", mplp_conf->max_depth);
+     fprintf(stderr, "            --downsample INT        Downsample columns deeper than this to about this depth (strand-balanced, reproducible).\n");
+     fprintf(stderr, "                                    Kept fraction is reported as DSF. 0 = off [%d]\n", mplp_conf->ds_depth);
+     fprintf(stderr, "            --downsample-seed INT   Seed for downsampling [%u]\n", mplp_conf->ds_seed);
+     fprintf(stderr, "            --illumina-1.3          Assume the quality is Illumina-1.3-1.7/ASCII+64 encoded\n");
+     fprintf(stderr, "            --use-orphan            Count anomalous read pairs (i.e. where mate is not aligned properly)\n");
+     fprintf(stderr, "            --plp-summary-only      No variant calling. Just output pileup summary per column\n");
+     fprintf(stderr, "            --threads INT           Number of threads to use for calling. Needs an indexed BAM file [1]\n");
+     fprintf(stderr, "            --bgzf-threads INT      Number of compression threads for bgzipped output [1]\n");
+     fprintf(stderr, "            --io-threads INT        Read BAM input ahead in a separate thread, overlapping I/O and decompression with calling.\n");
+     fprintf(stderr, "                                    Values > 1 also decompress with that many threads (needs htslib >= 1.4). 0 = off [%d]\n", mplp_conf->io_threads);
+     fprintf(stderr, "            --pb-kernel STR         Poisson-binomial kernel: 'log' (exact) or 'linear' (vectorized; faster at high coverage) ['log']\n");
+     fprintf(stderr, "            --compact-ref           Only keep counts of quality tuples for reference bases (much less memory at\n");
+     fprintf(stderr, "                                    high coverage; same calls)\n");
+     fprintf(stderr, "            --no-default-filter     Don't run default 'lofreq filter' automatically after calling variants\n");
+     fprintf(stderr, "            --stats-out FILE        Also store per-column pileup statistics in this file (e.g. aln.bam%s) for re-calling with --from-stats\n", PLPSTATS_EXT);
+     fprintf(stderr, "            --stats-all-cols        Store all columns with --stats-out, not only those with alt evidence. Needed for\n");
+     fprintf(stderr, "                                    combining stats of different read sets with 'lofreq stats-merge'\n");
+     fprintf(stderr, "            --from-stats FILE       Call from stored pileup statistics instead of a BAM file. Pileup options (e.g. BAQ, mapping quality,\n");
+     fprintf(stderr, "                                    region) are those used for --stats-out; calling options (e.g. base quality, sig, bonf) apply\n");
+     fprintf(stderr, "            --bamstats FILE         Also write read statistics (as 'lofreq bamstats', but using -m and -q) to this file\n");
+     fprintf(stderr, "            --manifest FILE         Write a shard manifest (number of tests, parameters, checksums) to this file, so that\n");
+     fprintf(stderr, "                                    output of calls on different regions can be combined with 'lofreq merge'\n");
+     fprintf(stderr, "            --cov-blocks FILE       Also write coverage as gVCF-style reference blocks (min/median depth, fraction\n");
+     fprintf(stderr, "                                    passing filters) to this file. Replaces per-column output of --plp-summary-only\n");
+     fprintf(stderr, "            --cov-bands LIST        Comma separated lower bounds of depth bands for --cov-blocks [%s]\n", COVBLOCK_DEFAULT_BANDS);
+     fprintf(stderr, "            --checkpoint FILE       Regularly record progress in this file (unfiltered calls go to FILE%s), so that\n", CHECKPOINT_VCF_EXT);
+     fprintf(stderr, "                                    an interrupted run can be continued with --resume. Single-threaded. Removed on success\n");
+     fprintf(stderr, "            --checkpoint-interval INT  Seconds between checkpoints (0: after every column) [%d]\n", DEFAULT_CHECKPOINT_INTERVAL);
+     fprintf(stderr, "            --resume                Continue from --checkpoint FILE if it exists (otherwise start from scratch)\n");
+     fprintf(stderr, "            --profile FILE          Write per-stage counters and timings (JSON) to this file ('-' for stderr) at exit\n");
+     fprintf(stderr, "            --verbose               Be verbose\n");
+     fprintf(stderr, "            --debug                 Enable debugging\n");
+}
+/* usage() */
+
+
+int
+main_call(int argc, char *argv[])
+{
+     /* based on bam_mpileup() */
+     int c, i;
+     static int use_orphan = 0;
+     static int only_indels = 0;
+     static int no_indels = 1;
+
+     static int plp_summary_only = 0;
+     static int no_default_filter = 0;
+     static int resume = 0;
+     static int compact_ref = 0;
+     static int stats_all_cols = 0;
+     static int illumina_1_3 = 0;
+     char *bam_file = NULL;
+     const char **bam_files = NULL;
+     int num_bams = 0;
+     char *bed_file = NULL;
+     char *vcf_out = NULL; /* == - == stdout */
+     char vcf_tmp_template[] = "/tmp/lofreq2-call-dyn-bonf.XXXXXX";
+     char *vcf_tmp_out = NULL; /* write to this file first, then filter */
+     mplp_conf_t mplp_conf;
+     varcall_conf_t varcall_conf;
+     /*void (*plp_proc_func)(const plp_col_t*, const varcall_conf_t*);*/
+     void (*plp_proc_func)(const plp_col_t*, void*);
+     int rc = 0;
+     char *ign_vcf = NULL;
+     int num_threads = 1;
+     int bgzf_threads = 1;
+     int bonf_auto = 0;
+     char *profile_file = NULL;
+     char *stats_out = NULL;
+     char *from_stats = NULL;
+     char *bamstats_out = NULL;
+     char *manifest_out = NULL;
+     char *checkpoint = NULL;
+     int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+     int resuming = 0; /* resume requested and checkpoint found */
+     checkpoint_t resume_ck;
+     checkpoint_conf_t checkpoint_conf;
+     char *cov_blocks_out = NULL;
+     char *cov_bands = NULL;
+     covblock_t cov_blocks;
+     covblock_store_conf_t covblock_store_conf;
+     bamstats_t *bamstats = NULL;
+     plpstats_t plpstats;
+     plpstats_store_conf_t plpstats_store_conf;
+     void *plp_proc_conf = NULL;
+     /* same options, but answering queries from stdin (see call_serve()) */
+     int serve = (argc > 1 && 0 == strcmp(argv[1], "serve"));
+
+
+/* FIXME add sens test:
+construct p such with
+quality_range = [20, 25, 30, 35, 40]
+coverage_range = [10, 50, 100, 500, 1000, 5000, 10000]
+refbase = 'A'
+snpbase = 'C'
 for cov in coverage_range:
     for q in quality_range:
         num_noncons = 1
@@ -1043,6 +2573,7 @@ for cov in coverage_range:
 
      /* default pileup options */
      init_mplp_conf(& mplp_conf);
+     memset(& plpstats, 0, sizeof(plpstats_t));
 
      /* default snvcall options */
      init_varcall_conf(& varcall_conf);
@@ -1091,6 +2622,25 @@ for cov in coverage_range:
               {"illumina-1.3", no_argument, &illumina_1_3, 1},
               {"use-orphan", no_argument, &use_orphan, 1},
               {"plp-summary-only", no_argument, &plp_summary_only, 1},
+              {"threads", required_argument, NULL, 't'}, /* long only */
+              {"bgzf-threads", required_argument, NULL, 'Z'}, /* long only */
+              {"io-threads", required_argument, NULL, 'I'}, /* long only */
+              {"pb-kernel", required_argument, NULL, 'P'}, /* long only */
+              {"qual-cache", required_argument, NULL, 'Y'}, /* long only */
+              {"downsample", required_argument, NULL, 'W'}, /* long only */
+              {"downsample-seed", required_argument, NULL, 'X'}, /* long only */
+              {"profile", required_argument, NULL, 'F'}, /* long only */
+              {"stats-out", required_argument, NULL, 'G'}, /* long only */
+              {"from-stats", required_argument, NULL, 'H'}, /* long only */
+              {"bamstats", required_argument, NULL, 'U'}, /* long only */
+              {"manifest", required_argument, NULL, 'O'}, /* long only */
+              {"checkpoint", required_argument, NULL, 'k'}, /* long only */
+              {"checkpoint-interval", required_argument, NULL, 'E'}, /* long only */
+              {"resume", no_argument, &resume, 1},
+              {"cov-blocks", required_argument, NULL, 'g'}, /* long only */
+              {"cov-bands", required_argument, NULL, 'V'}, /* long only */
+              {"compact-ref", no_argument, &compact_ref, 1},
+              {"stats-all-cols", no_argument, &stats_all_cols, 1},
               {"no-default-filter", no_argument, &no_default_filter, 1},
               {"verbose", no_argument, &verbose, 1},
               {"debug", no_argument, &debug, 1},
@@ -1248,9 +2798,15 @@ for cov in coverage_range:
               }
               break;
          case 'b':
+              bonf_auto = 0;
               if (0 == strncmp(optarg, "dynamic", 7)) {
                    varcall_conf.bonf_dynamic = 1;
 
+              } else if (0 == strncmp(optarg, "auto", 4)) {
+                   /* determined in first pass (see below) */
+                   varcall_conf.bonf_dynamic = 0;
+                   bonf_auto = 1;
+
               } else {
                    varcall_conf.bonf_dynamic = 0;
 
@@ -1270,8 +2826,120 @@ for cov in coverage_range:
               mplp_conf.max_depth = atoi(optarg);
               break;
 
+         case 't':
+              num_threads = atoi(optarg);
+              if (num_threads < 1) {
+                   LOG_FATAL("%s\n", "Number of threads has to be at least one");
+                   return 1;
+              }
+              break;
+
+         case 'Z':
+              bgzf_threads = atoi(optarg);
+              if (bgzf_threads < 1) {
+                   LOG_FATAL("%s\n", "Number of compression threads has to be at least one");
+                   return 1;
+              }
+              break;
+
+         case 'I':
+              mplp_conf.io_threads = atoi(optarg);
+              if (mplp_conf.io_threads < 0) {
+                   LOG_FATAL("%s\n", "Number of input threads can't be negative");
+                   return 1;
+              }
+              break;
+
+         case 'P':
+              if (0 == strcmp(optarg, "log")) {
+                   pb_kernel = PB_KERNEL_LOG;
+              } else if (0 == strcmp(optarg, "linear")) {
+                   pb_kernel = PB_KERNEL_LINEAR;
+              } else {
+                   LOG_FATAL("Unknown Poisson-binomial kernel '%s'\n", optarg);
+                   return 1;
+              }
+              break;
+
+         case 'Y':
+              mplp_conf.qual_cache = strdup(optarg);
+              break;
+
+         case 'W':
+              mplp_conf.ds_depth = atoi(optarg);
+              if (mplp_conf.ds_depth < 0) {
+                   LOG_FATAL("%s\n", "Downsampling depth can't be negative");
+                   return 1;
+              }
+              break;
+
+         case 'X':
+              mplp_conf.ds_seed = strtoul(optarg, NULL, 10);
+              break;
+
+         case 'F':
+              profile_file = strdup(optarg);
+              prof_enable();
+              break;
+
+         case 'G':
+              if (file_exists(optarg)) {
+                   LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                   return 1;
+              }
+              stats_out = strdup(optarg);
+              break;
+
+         case 'H':
+              from_stats = strdup(optarg);
+              break;
+
+         case 'U':
+              if (file_exists(optarg)) {
+                   LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                   return 1;
+              }
+              bamstats_out = strdup(optarg);
+              break;
+
+         case 'O':
+              if (file_exists(optarg)) {
+                   LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                   return 1;
+              }
+              manifest_out = strdup(optarg);
+              break;
+
+         case 'k':
+              checkpoint = strdup(optarg);
+              break;
+
+         case 'g':
+              if (file_exists(optarg)) {
+                   LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                   return 1;
+              }
+              cov_blocks_out = strdup(optarg);
+              break;
+
+         case 'V':
+              cov_bands = strdup(optarg);
+              break;
+
+         case 'E':
+              checkpoint_interval = atoi(optarg);
+              if (checkpoint_interval < 0) {
+                   LOG_FATAL("%s\n", "Checkpoint interval can't be negative");
+                   return 1;
+              }
+              break;
+
          case 'h':
-              usage(& mplp_conf, & varcall_conf);
+              if (serve) {
+                   usage_serve();
+              } else {
+                   usage(& mplp_conf, & varcall_conf);
+              }
               return 0; /* WARN: not printing defaults if some args where parsed */
 
          case '?':
@@ -1311,6 +2979,124 @@ for cov in coverage_range:
          mplp_conf.flag &= ~MPLP_NO_ORPHAN;
     }
 
+    if (num_threads > 1 && plp_summary_only) {
+         LOG_WARN("%s\n", "Pileup summary is always computed in one thread");
+         num_threads = 1;
+    }
+
+    if (stats_out && from_stats) {
+         LOG_FATAL("%s\n", "Can't store and read pileup stats at the same time");
+         return 1;
+    }
+    if ((stats_out || from_stats) && plp_summary_only) {
+         LOG_FATAL("%s\n", "Pileup stats can't be used with pileup summary only");
+         return 1;
+    }
+    if (from_stats && bonf_auto) {
+         /* count_tests() needs all columns, but only those with alt
+          * evidence are stored */
+         LOG_FATAL("%s\n", "Can't determine Bonferroni factor automatically"
+                   " when calling from pileup stats. Use 'dynamic' or a number");
+         return 1;
+    }
+    if (bamstats_out && from_stats) {
+         LOG_FATAL("%s\n", "Read statistics need a BAM file and can't be computed when calling from pileup stats");
+         return 1;
+    }
+    if (stats_all_cols && ! stats_out) {
+         LOG_WARN("%s\n", "--stats-all-cols only makes sense with --stats-out. Ignoring it");
+         stats_all_cols = 0;
+    }
+    if ((stats_out || from_stats) && num_threads > 1) {
+         LOG_WARN("%s\n", "Pileup stats are always stored and read in one thread");
+         num_threads = 1;
+    }
+
+    if (manifest_out) {
+         if (NULL == vcf_out || 0 == strcmp(vcf_out, "-")) {
+              LOG_FATAL("%s\n", "Need an output file (-o) for writing a shard manifest");
+              return 1;
+         }
+         if (from_stats || plp_summary_only || serve) {
+              LOG_FATAL("%s\n", "Shard manifests can only be written when calling from a BAM file");
+              return 1;
+         }
+    }
+
+    if (resume && ! checkpoint) {
+         LOG_FATAL("%s\n", "Need a checkpoint file (--checkpoint) to resume from");
+         return 1;
+    }
+    if (checkpoint) {
+         if (from_stats || plp_summary_only || serve) {
+              LOG_FATAL("%s\n", "Checkpoints can only be used when calling from a BAM file");
+              return 1;
+         }
+         if (stats_out || bamstats_out) {
+              /* both would have to be resumed as well */
+              LOG_FATAL("%s\n", "Checkpoints can't be used with pileup stats or read statistics");
+              return 1;
+         }
+         if (file_exists(checkpoint) && ! resume) {
+              LOG_FATAL("Checkpoint %s exists. Use --resume to continue from it or delete it\n", checkpoint);
+              return 1;
+         }
+         if (num_threads > 1) {
+              LOG_WARN("%s\n", "Runs with checkpoints always call in one thread");
+              num_threads = 1;
+         }
+    }
+
+    if (cov_bands && ! cov_blocks_out) {
+         LOG_FATAL("%s\n", "Depth bands only make sense with --cov-blocks");
+         return 1;
+    }
+    if (cov_blocks_out) {
+         if (from_stats || serve) {
+              /* stats only keep columns with alt evidence */
+              LOG_FATAL("%s\n", "Coverage blocks can only be written when calling from a BAM file");
+              return 1;
+         }
+         if (checkpoint) {
+              LOG_FATAL("%s\n", "Coverage blocks can't be resumed from checkpoints");
+              return 1;
+         }
+         if (num_threads > 1) {
+              /* blocks need columns in order */
+              LOG_WARN("%s\n", "Coverage blocks are always written in one thread");
+              num_threads = 1;
+         }
+    }
+
+    if (serve) {
+         if (vcf_out && 0 != strcmp(vcf_out, "-")) {
+              LOG_FATAL("%s\n", "Answers to queries always go to stdout");
+              return 1;
+         }
+         if (mplp_conf.reg) {
+              LOG_FATAL("%s\n", "Regions are given as queries on stdin, not as option");
+              return 1;
+         }
+         if (stats_out || from_stats || bamstats_out || plp_summary_only) {
+              LOG_FATAL("%s\n", "Pileup stats, read statistics and pileup summary can't be used when serving queries");
+              return 1;
+         }
+         if (bonf_auto) {
+              LOG_FATAL("%s\n", "Can't determine Bonferroni factor automatically when serving queries");
+              return 1;
+         }
+         if (num_threads > 1) {
+              LOG_WARN("%s\n", "Queries are always answered in one thread");
+              num_threads = 1;
+         }
+         if (varcall_conf.bonf_dynamic) {
+              /* would grow with every query */
+              varcall_conf.bonf_dynamic = 0;
+              varcall_conf.bonf_subst = 1;
+              varcall_conf.bonf_indel = 1;
+         }
+    }
+
     if (no_indels && only_indels) {
          LOG_FATAL("%s\n", "Invalid user request to predict no-indels *and* only-indels!? Exiting...\n");
          return -1;
@@ -1318,31 +3104,143 @@ for cov in coverage_range:
 
     if (argc == 2) {
         fprintf(stderr, "\n");
-        usage(& mplp_conf, & varcall_conf);
+        if (serve) {
+             usage_serve();
+        } else {
+             usage(& mplp_conf, & varcall_conf);
+        }
         return 1;
     }
 
-   /* get bam file argument
+   /* get bam file argument(s)
     */
-    if (1 != argc - optind - 1) {
-         int i;
-         LOG_FATAL("%s\n", "Need exactly one BAM file as last argument");
-         for (i=optind+1; i<argc; i++) {
-              LOG_FATAL("Unknown arg: %s\n", argv[i]);
+    num_bams = argc - optind - 1;
+    if (from_stats) {
+         if (num_bams > 0) {
+              LOG_FATAL("%s\n", "BAM files can't be given when calling from pileup stats");
+              return 1;
          }
+    } else if (num_bams < 1) {
+         LOG_FATAL("%s\n", "Need at least one BAM file as last argument");
          return 1;
     }
+    bam_files = (const char **) argv + optind + 1;
     bam_file = (argv + optind + 1)[0];
-        if (0 == strcmp(bam_file, "-")) {
+    if (from_stats) {
+         if (plpstats_read_open(& plpstats, from_stats)) {
+              return 1;
+         }
+         if (! mplp_conf.fa && plpstats.ref_fa[0]) {
+              mplp_conf.fa = strdup(plpstats.ref_fa);
+         }
+         if (! varcall_conf.no_indels && ! (plpstats.mplp_flag & MPLP_IDAQ)) {
+              LOG_WARN("Pileup stats in %s were stored without indel alignment qualities\n", from_stats);
+         }
+         if (mplp_conf.reg || bed_file) {
+              LOG_WARN("%s\n", "Region and bed file only restrict source quality ignore positions"
+                       " when calling from pileup stats. Columns are those stored");
+         }
+         if (mplp_conf.qual_cache) {
+              LOG_WARN("%s\n", "Alignment quality cache not needed when calling from pileup stats. Ignoring it");
+              free(mplp_conf.qual_cache);
+              mplp_conf.qual_cache = NULL;
+         }
+    } else if (serve && num_bams > 1) {
+         LOG_FATAL("%s\n", "Queries can only be served for one BAM file");
+         rc = 1;
+         goto free_and_exit;
+    } else if (num_bams > 1) {
+         /* all samples are piled up in one go by call_multi_sample() */
+         for (i=0; i<num_bams; i++) {
+              if (0 == strcmp(bam_files[i], "-")) {
+                   LOG_FATAL("%s\n", "Can't read from stdin if more than one BAM file is given");
+                   rc = 1;
+                   goto free_and_exit;
+              }
+              if (! file_exists(bam_files[i])) {
+                   LOG_FATAL("BAM file %s does not exist. Exiting...\n", bam_files[i]);
+                   rc = 1;
+                   goto free_and_exit;
+              }
+         }
+         if (NULL == vcf_out || 0 == strcmp(vcf_out, "-")) {
+              LOG_FATAL("%s\n", "Need an output prefix (-o) if more than one BAM file is given");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (plp_summary_only) {
+              LOG_FATAL("%s\n", "Pileup summary only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (stats_out) {
+              LOG_FATAL("%s\n", "Pileup stats only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (bamstats_out) {
+              LOG_FATAL("%s\n", "Read statistics only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (manifest_out) {
+              LOG_FATAL("%s\n", "Shard manifests only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (checkpoint) {
+              LOG_FATAL("%s\n", "Checkpoints only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (cov_blocks_out) {
+              LOG_FATAL("%s\n", "Coverage blocks only supported for one BAM file");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (num_threads > 1) {
+              LOG_WARN("%s\n", "Multiple BAM files are always processed in one thread");
+              num_threads = 1;
+         }
+         if (mplp_conf.qual_cache) {
+              LOG_WARN("%s\n", "Alignment quality cache only supported for one BAM file. Ignoring it");
+              free(mplp_conf.qual_cache);
+              mplp_conf.qual_cache = NULL;
+         }
+    } else if (0 == strcmp(bam_file, "-")) {
+         if (manifest_out) {
+              LOG_FATAL("%s\n", "Can't write shard manifest when reading from stdin");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (checkpoint) {
+              LOG_FATAL("%s\n", "Can't resume from checkpoints when reading from stdin");
+              rc = 1;
+              goto free_and_exit;
+         }
          if (mplp_conf.reg) {
               LOG_FATAL("%s\n", "Need index if region was given and"
                         " index file can't be provided when using stdin mode.");
-              return 1;
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (num_threads > 1) {
+              LOG_FATAL("%s\n", "Need index for multi-threaded calling and"
+                        " index file can't be provided when using stdin mode.");
+              rc = 1;
+              goto free_and_exit;
+         }
+         if (bonf_auto) {
+              LOG_FATAL("%s\n", "Can't determine Bonferroni factor automatically"
+                        " when using stdin mode (needs two passes).");
+              rc = 1;
+              goto free_and_exit;
          }
     } else {
          if (! file_exists(bam_file)) {
               LOG_FATAL("BAM file %s does not exist. Exiting...\n", bam_file);
-              return 1;
+              rc = 1;
+              goto free_and_exit;
          }
     }
 
@@ -1351,20 +3249,24 @@ for cov in coverage_range:
     if (mplp_conf.min_mq > mplp_conf.max_mq) {
          LOG_FATAL("Minimum mapping quality (%d) larger than maximum mapping quality (%d)\n",
                    mplp_conf.min_mq, mplp_conf.max_mq);
-         return 1;
+         rc = 1;
+         goto free_and_exit;
     }
     if (varcall_conf.min_bq > varcall_conf.min_alt_bq) {
          LOG_FATAL("Minimum base-call quality for all bases (%d) larger than minimum base-call quality for alternate bases (%d)\n",
                    varcall_conf.min_bq, varcall_conf.min_alt_bq);
-         return 1;
+         rc = 1;
+         goto free_and_exit;
     }
     if (mplp_conf.flag & MPLP_BAQ && ! mplp_conf.fa && ! plp_summary_only) {
          LOG_FATAL("%s\n", "Can't compute BAQ with no reference...\n");
-         return 1;
+         rc = 1;
+         goto free_and_exit;
     }
     if ( ! mplp_conf.fa && ! plp_summary_only) {
          LOG_FATAL("%s\n", "Need a reference for calling variants...\n");
-         return 1;
+         rc = 1;
+         goto free_and_exit;
     }
 
     if (! plp_summary_only & ! mplp_conf.fa) {
@@ -1375,31 +3277,50 @@ for cov in coverage_range:
      * we can directly write to requested output file. otherwise we
      * use a tmp file that gets filtered.
      */
-    if (no_default_filter && ! varcall_conf.bonf_dynamic) {
+    if (num_bams > 1) {
+         /* one output per sample. opened by call_multi_sample() */
+         ;
+    } else if (checkpoint) {
+         /* unfiltered calls are kept next to the checkpoint, which
+          * needs an offset, i.e. no compression. opened once the
+          * checkpoint was verified (below) */
+         vcf_tmp_out = malloc(strlen(checkpoint) + strlen(CHECKPOINT_VCF_EXT) + 1);
+         if (NULL == vcf_tmp_out) {
+              fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                      __FILE__, __FUNCTION__, __LINE__);
+              rc = 1;
+              goto free_and_exit;
+         }
+         sprintf(vcf_tmp_out, "%s%s", checkpoint, CHECKPOINT_VCF_EXT);
+    } else if (serve || (no_default_filter && ! varcall_conf.bonf_dynamic)) {
          if (NULL == vcf_out || 0 == strcmp(vcf_out, "-")) {
               if (vcf_file_open(& varcall_conf.vcf_out, "-",
                                 0, 'w')) {
                    LOG_ERROR("%s\n", "Couldn't open stdout");
-                   return 1;
+                   rc = 1;
+                   goto free_and_exit;
               }
          } else {
               if (vcf_file_open(& varcall_conf.vcf_out, vcf_out,
                                 HAS_GZIP_EXT(vcf_out), 'w')) {
                    LOG_ERROR("Couldn't open %s\n", vcf_out);
-                   return 1;
+                   rc = 1;
+                   goto free_and_exit;
               }
+              (void) vcf_file_set_threads(& varcall_conf.vcf_out, bgzf_threads);
          }
     } else {
          vcf_tmp_out = strdup(mktemp(vcf_tmp_template));
          if (NULL == vcf_tmp_out) {
               LOG_FATAL("%s\n", "Couldn't create temporary vcf file");
-              return 1;
+              rc = 1;
+              goto free_and_exit;
          }
          if (vcf_file_open(& varcall_conf.vcf_out, vcf_tmp_out,
                            HAS_GZIP_EXT(vcf_tmp_out), 'w')) {
               LOG_ERROR("Couldn't open %s\n", vcf_tmp_out);
-              free(vcf_tmp_out);
-              return 1;
+              rc = 1;
+              goto free_and_exit;
          }
     }
 
@@ -1416,8 +3337,8 @@ for cov in coverage_range:
          mplp_conf.bed = bed_read(bed_file);
          if (! mplp_conf.bed) {
               LOG_ERROR("Couldn't read %s\n", bed_file);
-              free(vcf_tmp_out);
-              return 1;
+              rc = 1;
+              goto free_and_exit;
          }
     }
 
@@ -1430,36 +3351,257 @@ for cov in coverage_range:
          /* note strtok destroys input i.e. ign_vcf */
          char *f = strtok(ign_vcf, ",");
          while (NULL != f) {
-              if (source_qual_load_ign_vcf(f, mplp_conf.bed)) {
+              if (source_qual_load_ign_vcf(f)) {
                    LOG_FATAL("Loading of ignore positions from %s failed.", f);
-                   free(vcf_tmp_out);
-                   return 1;
+                   rc = 1;
+                   goto free_and_exit;
               }
               f = strtok(NULL, " ");
          }
          free(ign_vcf);
     }
 
+    if (mplp_conf.fai) {
+         /* shared by all passes and threads */
+         mplp_conf.refcache = refcache_new(mplp_conf.fai, REFCACHE_DEFAULT_MAX_BYTES);
+         refcache_open_store(mplp_conf.refcache, mplp_conf.fa);
+    }
+
+    if (checkpoint) {
+         uint64_t params_checksum = call_params_checksum(& mplp_conf, & varcall_conf,
+                                                       bam_file, bonf_auto);
+         if (mplp_conf.reg) {
+              params_checksum = qual_cache_hash64(params_checksum, mplp_conf.reg,
+                                                  strlen(mplp_conf.reg));
+         }
+         if (bed_file) {
+              params_checksum = qual_cache_hash64(params_checksum, bed_file,
+                                                  strlen(bed_file));
+         }
+
+         if (resume && file_exists(checkpoint)) {
+              if (checkpoint_read(checkpoint, & resume_ck)) {
+                   rc = 1;
+                   goto free_and_exit;
+              }
+              if (resume_ck.params_checksum != params_checksum) {
+                   LOG_FATAL("Checkpoint %s was written by a run with different input or parameters\n",
+                             checkpoint);
+                   rc = 1;
+                   goto free_and_exit;
+              }
+              /* drop whatever was written after the checkpoint */
+              if (truncate(vcf_tmp_out, resume_ck.vcf_offset)) {
+                   LOG_FATAL("Couldn't truncate %s for resuming: %s\n", vcf_tmp_out, strerror(errno));
+                   rc = 1;
+                   goto free_and_exit;
+              }
+              resuming = 1;
+         } else if (resume) {
+              LOG_VERBOSE("No checkpoint %s found. Starting from scratch\n", checkpoint);
+         }
+
+         if (vcf_file_open(& varcall_conf.vcf_out, vcf_tmp_out, 0, resuming ? 'a' : 'w')) {
+              LOG_ERROR("Couldn't open %s\n", vcf_tmp_out);
+              rc = 1;
+              goto free_and_exit;
+         }
+
+         memset(& checkpoint_conf, 0, sizeof(checkpoint_conf_t));
+         checkpoint_conf.varcall_conf = & varcall_conf;
+         checkpoint_conf.path = checkpoint;
+         checkpoint_conf.interval = checkpoint_interval;
+         checkpoint_conf.last_write = time(NULL);
+         checkpoint_conf.state.params_checksum = params_checksum;
+         checkpoint_conf.state.tid = -1;
+    }
+
+    if (num_bams > 1) {
+         rc = call_multi_sample(& mplp_conf, & varcall_conf, bam_files, num_bams,
+                                vcf_out, bonf_auto, no_default_filter, bgzf_threads);
+         goto free_and_exit;
+    }
+
     if (plp_summary_only) {
          plp_proc_func = &plp_summary;
 
     } else {
          /* or use PACKAGE_STRING */
-         vcf_write_new_header(& varcall_conf.vcf_out,
-                              mplp_conf.cmdline, mplp_conf.fa);
+         if (! resuming) {
+              vcf_write_new_header(& varcall_conf.vcf_out,
+                                   mplp_conf.cmdline, mplp_conf.fa);
+         }
          plp_proc_func = &call_vars;
+         /* call_vars() ignores columns without alt evidence */
+         mplp_conf.flag |= MPLP_ALT_ONLY;
+         if (compact_ref) {
+              if (stats_out) {
+                   /* stats need qualities of all reads */
+                   LOG_WARN("%s\n", "Compact reference qualities can't be used with --stats-out. Ignoring it");
+              } else {
+                   mplp_conf.flag |= MPLP_REF_HIST;
+              }
+         }
+    }
+
+    if (mplp_conf.qual_cache) {
+         if (0 == strcmp(bam_file, "-")) {
+              LOG_WARN("%s\n", "Can't use alignment quality cache when reading from stdin");
+              free(mplp_conf.qual_cache);
+              mplp_conf.qual_cache = NULL;
+         } else if (mplp_qual_cache_build(& mplp_conf, bam_file)) {
+              /* not fatal: everything just gets computed on the fly */
+              LOG_WARN("Couldn't create alignment quality cache %s\n", mplp_conf.qual_cache);
+         }
+    }
+
+    if (serve) {
+         rc = call_serve(& mplp_conf, & varcall_conf, bam_file);
+         vcf_file_close(& varcall_conf.vcf_out);
+         goto free_and_exit;
+    }
+
+    if (resuming) {
+         /* counted tests and factors (fixed, counted in the first pass
+          * or dynamic) as of the checkpoint */
+         varcall_conf.bonf_subst = resume_ck.bonf_subst;
+         varcall_conf.bonf_indel = resume_ck.bonf_indel;
+         varcall_conf.num_snv_tests = resume_ck.num_snv_tests;
+         varcall_conf.num_indel_tests = resume_ck.num_indel_tests;
+         varcall_conf.indel_calls_wo_idaq = resume_ck.indel_calls_wo_idaq;
+
+    } else if (bonf_auto && ! plp_summary_only) {
+         /* first pass: count tests, i.e. determine bonferroni
+          * factors. no need for computing BAQ etc. */
+         mplp_conf_t count_mplp_conf;
+         varcall_conf_t count_conf;
+
+         memcpy(& count_mplp_conf, & mplp_conf, sizeof(mplp_conf_t));
+         /* count_tests() needs all columns */
+         count_mplp_conf.flag &= ~(MPLP_BAQ | MPLP_IDAQ | MPLP_USE_SQ | MPLP_ALT_ONLY);
+         count_mplp_conf.qual_cache = NULL;
+         memcpy(& count_conf, & varcall_conf, sizeof(varcall_conf_t));
+
+         LOG_VERBOSE("%s\n", "Counting tests to determine Bonferroni factors");
+         if (num_threads > 1) {
+              rc = mpileup_call_threaded(&count_mplp_conf, &count_tests, &count_conf,
+                                         bam_file, num_threads);
+         } else {
+              rc = mpileup(&count_mplp_conf, &count_tests, (void*)&count_conf,
+                           1, (const char **) argv + optind + 1);
+         }
+         if (rc) {
+              goto free_and_exit;
+         }
+         varcall_conf.bonf_subst = MAX(1, count_conf.num_snv_tests);
+         varcall_conf.bonf_indel = MAX(1, count_conf.num_indel_tests);
+         LOG_VERBOSE("Bonferroni factors determined as %lld (substitutions) and %lld (indels)\n",
+                     varcall_conf.bonf_subst, varcall_conf.bonf_indel);
+    }
+
+    if (bamstats_out) {
+         /* counted as side pass of the calling pass (not the counting pass above) */
+         bamstats_conf_t bamstats_conf;
+         bamstats_conf_init(& bamstats_conf);
+         bamstats_conf.type = BAMSTATS_OPCAT;
+         bamstats_conf.min_mq = mplp_conf.min_mq;
+         bamstats_conf.min_bq = varcall_conf.min_bq;
+         bamstats = bamstats_new(& bamstats_conf, (refcache_t *) mplp_conf.refcache);
+         mplp_conf.bamstats = bamstats;
+    }
+
+    if (cov_blocks_out) {
+         if (covblock_open(& cov_blocks, cov_blocks_out,
+                           cov_bands ? cov_bands : COVBLOCK_DEFAULT_BANDS,
+                           mplp_conf.cmdline, mplp_conf.fa)) {
+              rc = 1;
+              goto free_and_exit;
+         }
+         /* blocks need all columns, but only the depth of those
+          * skipped with MPLP_ALT_ONLY */
+         mplp_conf.skip_col_func = &covblock_store_skipped;
+         mplp_conf.skip_col_conf = (void*) & cov_blocks;
+    }
+    if (stats_all_cols) {
+         /* stats of columns without alt evidence are needed when
+          * merged with those of other reads (see lofreq stats-merge) */
+         mplp_conf.flag &= ~MPLP_ALT_ONLY;
+    }
+
+    plp_proc_conf = (void*) & varcall_conf;
+    if (cov_blocks_out) {
+         /* pileup summary is replaced by blocks */
+         covblock_store_conf.plp_proc_func = plp_summary_only ? NULL : plp_proc_func;
+         covblock_store_conf.plp_proc_conf = plp_proc_conf;
+         covblock_store_conf.blocks = & cov_blocks;
+         plp_proc_func = &covblock_store;
+         plp_proc_conf = (void*) & covblock_store_conf;
+    }
+    if (stats_out) {
+         if (plpstats_write_open(& plpstats, stats_out, & mplp_conf)) {
+              rc = 1;
+              goto free_and_exit;
+         }
+         plpstats_store_conf.plp_proc_func = plp_proc_func;
+         plpstats_store_conf.plp_proc_conf = plp_proc_conf;
+         plpstats_store_conf.stats = & plpstats;
+         plp_proc_func = &plpstats_store;
+         plp_proc_conf = (void*) & plpstats_store_conf;
+    }
+    if (checkpoint) {
+         checkpoint_conf.plp_proc_func = plp_proc_func;
+         checkpoint_conf.plp_proc_conf = plp_proc_conf;
+         plp_proc_func = &checkpoint_plp_proc;
+         plp_proc_conf = (void*) & checkpoint_conf;
     }
 
-    rc = mpileup(&mplp_conf, plp_proc_func, (void*)&varcall_conf,
-                 1, (const char **) argv + optind + 1);
+    if (from_stats) {
+         rc = call_from_stats(& plpstats, & varcall_conf);
+    } else if (resuming) {
+         rc = mpileup_resume(&mplp_conf, plp_proc_func, plp_proc_conf,
+                             bam_file, & resume_ck);
+    } else if (num_threads > 1) {
+         rc = mpileup_call_threaded(&mplp_conf, plp_proc_func, &varcall_conf,
+                                    bam_file, num_threads);
+    } else {
+         rc = mpileup(&mplp_conf, plp_proc_func, plp_proc_conf,
+                      1, (const char **) argv + optind + 1);
+    }
+    if (stats_out) {
+         if (plpstats_close(& plpstats)) {
+              LOG_ERROR("Couldn't write pileup stats to %s\n", stats_out);
+              rc = rc ? rc : 1;
+         } else {
+              LOG_VERBOSE("Stored pileup stats of %ld columns in %s\n", plpstats.num_cols, stats_out);
+         }
+    }
+    if (cov_blocks_out) {
+         if (covblock_close(& cov_blocks)) {
+              LOG_ERROR("Couldn't write coverage blocks to %s\n", cov_blocks_out);
+              rc = rc ? rc : 1;
+         }
+    }
+    if (bamstats) {
+         if (0 == rc) {
+              FILE *bamstats_fh;
+              if (NULL == (bamstats_fh = fopen(bamstats_out, "w"))) {
+                   LOG_ERROR("Couldn't open %s for writing read statistics\n", bamstats_out);
+                   rc = 1;
+              } else {
+                   bamstats_write(bamstats, bamstats_fh);
+                   fclose(bamstats_fh);
+              }
+         }
+         mplp_conf.bamstats = NULL;
+         bamstats_free(bamstats);
+    }
     if (rc) {
-         free(vcf_tmp_out);
-         return rc;
+         goto free_and_exit;
     }
 
-    if (indel_calls_wo_idaq && varcall_conf.flag & VARCALL_USE_IDAQ) {
+    if (varcall_conf.indel_calls_wo_idaq && varcall_conf.flag & VARCALL_USE_IDAQ) {
          LOG_WARN("%ld indel calls (before filtering) were made without indel alignment-quality!"
-                  " Did you forget to indel alignment-quality to your bam-file?\n", indel_calls_wo_idaq);
+                  " Did you forget to indel alignment-quality to your bam-file?\n", varcall_conf.indel_calls_wo_idaq);
     }
 
     vcf_file_close(& varcall_conf.vcf_out);
@@ -1474,57 +3616,24 @@ for cov in coverage_range:
     if (plp_summary_only) {
          LOG_VERBOSE("%s\n", "No filtering needed: didn't run in SNV calling mode");
 
-    } else if (no_default_filter && ! varcall_conf.bonf_dynamic) {
+    } else if (no_default_filter && ! varcall_conf.bonf_dynamic && ! checkpoint) {
          /* vcf file needs no filtering and was already printed to
           * final destination. already taken care of above. */
          LOG_VERBOSE("%s\n", "No filtering needed or requested: variants already written to final destination");
 
     } else {
-         char cmd[BUF_SIZE];
-         int len;
-
-         snprintf(cmd, BUF_SIZE,
-                  "lofreq filter -i %s -o %s",
-                  vcf_tmp_out, NULL==vcf_out ? "-" : vcf_out);
-         len = strlen(cmd);
-
-         if (no_default_filter) {
-              len += sprintf(cmd+len, " %s", "--no-defaults");
-         }
-
-         if (varcall_conf.bonf_dynamic) {
-              int snvqual_thresh = INT_MAX;
-              int indelqual_thresh = INT_MAX;
-
-              if (varcall_conf.bonf_subst) {
-                   snvqual_thresh = PROB_TO_PHREDQUAL(varcall_conf.sig/varcall_conf.bonf_subst);
-                   if (snvqual_thresh < 0) {
-                        snvqual_thresh = 0;
-                   }
-              }
-              if (varcall_conf.bonf_indel) {
-                   indelqual_thresh =  PROB_TO_PHREDQUAL(varcall_conf.sig/varcall_conf.bonf_indel);
-                   if (indelqual_thresh < 0) {
-                        indelqual_thresh = 0;
-                   }
-              }         
-                             
-              len += sprintf(cmd+len,/* appending to str with format. see http://stackoverflow.com/questions/14023024/strcat-for-formatted-strings */
-                             " --snvqual-thresh %d --indelqual-thresh %d",
-                             snvqual_thresh, indelqual_thresh);
-         } else {
-              LOG_VERBOSE("%s\n", "No SNV/indel-quality filtering needed (already applied during call since bonf was fixed)");
-         }
+         rc = default_filter(vcf_tmp_out, vcf_out, & varcall_conf,
+                             no_default_filter, bgzf_threads, num_threads);
+    }
 
-         LOG_VERBOSE("Executing %s\n", cmd);
-         if (0 != (rc = system(cmd))) {
-              LOG_ERROR("The following command failed: %s\n", cmd);
-              rc = 1;
+    if (checkpoint && rc==0) {
+         /* calls are complete: nothing to resume anymore */
+         (void) unlink(checkpoint);
+    }
 
-         } else {
-              /*if (! debug)*/
-              (void) unlink(vcf_tmp_out);
-         }
+    if (manifest_out && rc==0) {
+         rc = write_shard_manifest(manifest_out, vcf_out, & mplp_conf, & varcall_conf,
+                                   bam_file, bonf_auto);
     }
 
     if (! plp_summary_only && rc==0) {
@@ -1535,18 +3644,37 @@ for cov in coverage_range:
          int org_verbose = verbose;
          verbose = 1;
          /* lofreq2_call_parallel.py and used by lofreq2_somatic.py */
-         LOG_VERBOSE("Number of substitution tests performed: %lld\n", num_snv_tests);
-         LOG_VERBOSE("Number of indel tests performed: %lld\n", num_indel_tests);
+         LOG_VERBOSE("Number of substitution tests performed: %lld\n", varcall_conf.num_snv_tests);
+         LOG_VERBOSE("Number of indel tests performed: %lld\n", varcall_conf.num_indel_tests);
          verbose = org_verbose;
     }
 
+free_and_exit:
     source_qual_free_ign_vars();
 
+    if (profile_file) {
+         prof_write_json(profile_file);
+         free(profile_file);
+    }
+
+    if (from_stats) {
+         (void) plpstats_close(& plpstats);
+         free(from_stats);
+    }
+    free(stats_out);
+    free(bamstats_out);
+    free(manifest_out);
+    free(checkpoint);
+    free(cov_blocks_out);
+    free(cov_bands);
+
     free(vcf_tmp_out);
     free(vcf_out);
     free(mplp_conf.alnerrprof_file);
+    free(mplp_conf.qual_cache);
     free(mplp_conf.reg);
     free(mplp_conf.fa);
+    refcache_free(mplp_conf.refcache);
     if (mplp_conf.fai) {
          fai_destroy(mplp_conf.fai);
     }
@@ -28,6 +28,13 @@
 #ifndef LOFREQ_CALL_H
 #define LOFREQ_CALL_H
 
+#include "plp.h"
+
+/* pileup callback calling variants in one column. confp is a
+ * varcall_conf_t (see snpcaller.h), to whose vcf_out calls are
+ * written */
+void call_vars(const plp_col_t *p, void *confp);
+
 int main_call(int argc, char *argv[]);
 
 #endif
@@ -32,6 +32,7 @@
 
 #include <ctype.h>
 #include <assert.h>
+#include <getopt.h>
 
 
 /* lofreq includes */
@@ -46,7 +47,14 @@ usage()
 {
      fprintf(stderr,
              "\n%s: Check whether given BAM file was created with given reference\n\n", MYNAME);
-     fprintf(stderr,"Usage: %s ref.fa in.bam\n\n", MYNAME);
+     fprintf(stderr,"Usage: %s [options] ref.fa in.bam\n\n", MYNAME);
+     fprintf(stderr,"Options:\n");
+#ifdef HAVE_HTS_MD5
+     fprintf(stderr,"       --md5   Also compare @SQ M5 tags with digests of reference sequences\n");
+     fprintf(stderr,"               (computed once and cached in ref.fa.md5)\n");
+#endif
+     fprintf(stderr,"  -h | --help  Display this help\n\n");
+     fprintf(stderr,"Sequence lengths are checked against the fasta index only\n\n");
 }
 
 
@@ -54,18 +62,47 @@ int main_checkref(int argc, char *argv[])
 {
      char *bam_file;
      char *fasta_file;
-     
-     if (argc != 4) {
+     static int check_md5 = 0;
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+#ifdef HAVE_HTS_MD5
+               {"md5", no_argument, &check_md5, 1},
+#endif
+               {"help", no_argument, NULL, 'h'},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          static const char *long_opts_str = "h";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 0:
+               /* flag set */
+               break;
+          case 'h':
+               usage();
+               return 0;
+          default:
+               usage();
+               return 1;
+          }
+     }
+     if (2 != argc - optind - 1) {
          usage();
          return 1;
      }
 
-     /* get bam file argument
+     /* get fasta and bam file argument
       */
-    fasta_file = argv[2];
-    bam_file = argv[3];
+    fasta_file = argv[optind+1];
+    bam_file = argv[optind+2];
 
-    if (checkref(fasta_file, bam_file)) {
+    if (checkref(fasta_file, bam_file, check_md5)) {
          printf("Failed\n");
          return 1;
     } else {
@@ -43,6 +43,8 @@
 #include "utils.h"
 #include "multtest.h"
 #include "defaults.h"
+#include "vcfpipe.h"
+#include "htslib/kstring.h"
 
 
 #if 1
@@ -51,7 +53,6 @@
 #define MYNAME PACKAGE
 #endif
 
-#define FILTER_ID_STRSIZE 64
 #define FILTER_STRSIZE 128
 
 #define ALT_STRAND_RATIO 0.85
@@ -70,32 +71,6 @@ typedef struct {
      char id_max[FILTER_ID_STRSIZE];
 } af_filter_t;
 
-typedef struct {
-     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
-     int mtc_type;/* holm; holmbonf; fdr; none */
-     double alpha;
-     long int ntests;
-     char id[FILTER_ID_STRSIZE];
-     int no_compound; /* otherwise ALT_STRAND_RATIO of var bases have to be on one strand as well */
-     int incl_indels; /* if 1, also apply to indels */
-} sb_filter_t;
-
-typedef struct {
-     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
-     int mtc_type;/* holm; holmbonf; fdr; none */
-     double alpha;
-     long int ntests;
-     char id[FILTER_ID_STRSIZE];
-} snvqual_filter_t;
-
-typedef struct {
-     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
-     int mtc_type;/* holm; holmbonf; fdr; none */
-     double alpha;
-     long int ntests;
-     char id[FILTER_ID_STRSIZE];
-} indelqual_filter_t;
-
 typedef struct {
      vcf_file_t vcf_in;
      vcf_file_t vcf_out;
@@ -111,13 +86,9 @@ typedef struct {
      indelqual_filter_t indelqual_filter;
 } filter_conf_t;
 
-typedef struct mtc_qual_s {
-     int is_indel;/* if not, snv assumed */
-     int var_qual;
-     int sb_qual;
-     int is_alt_mostly_on_one_strand;
-} mtc_qual_t;
 
+/* only used to warn once. with --threads the filter threads may race
+ * on these, which at worst repeats a warning */
 static int varq_missing_warning_printed = 0;
 static int af_missing_warning_printed = 0;
 static int dp_missing_warning_printed = 0;
@@ -157,8 +128,8 @@ usage(const filter_conf_t* filter_conf)
 
      fprintf(stderr,"Options:\n");
      fprintf(stderr, "  Files:\n");
-     fprintf(stderr, "  -i | --in FILE                 VCF input file (no streaming supported; gzip supported)\n");
-     fprintf(stderr, "  -o | --out FILE                VCF output file (default: - for stdout; gzip supported).\n");
+     fprintf(stderr, "  -i | --in FILE                 VCF input file (default: - for stdin; gzip and .bcf supported)\n");
+     fprintf(stderr, "  -o | --out FILE                VCF output file (default: - for stdout; gzip and .bcf supported).\n");
 
      fprintf(stderr, "  Coverage (DP):\n");
      fprintf(stderr, "  -v | --cov-min INT             Minimum coverage allowed (<1=off)\n");
@@ -197,7 +168,12 @@ usage(const filter_conf_t* filter_conf)
      fprintf(stderr, "       --only-indels             Keep InDels only\n");
      fprintf(stderr, "       --only-snvs               Keep SNVs only\n");
      fprintf(stderr, "       --print-all               Print all, not just passed variants\n");
+     fprintf(stderr, "       --spill                   For multiple testing correction, parse input only once and spill\n"
+                     "                                 parsed variants to a temporary file (default for gzip and stdin)\n");
+     fprintf(stderr, "       --no-spill                For multiple testing correction, parse input twice (no streaming)\n");
      fprintf(stderr, "       --no-defaults             Remove all default filter settings\n");
+     fprintf(stderr, "       --threads INT             Number of threads parsing and filtering variants [1]\n");
+     fprintf(stderr, "       --bgzf-threads INT        Number of (de)compression threads for bgzipped output (and input with htslib >= 1.4) [1]\n");
      fprintf(stderr, "       --verbose                 Be verbose\n");
      fprintf(stderr, "       --debug                   Enable debugging\n");
      fprintf(stderr, "\nNOTE: without --no-defaults LoFreq's predefined filters are on (run with --verbose to see details)\n");
@@ -238,7 +214,8 @@ int alt_mostly_on_one_strand(var_t *var)
 
 void apply_af_filter(var_t *var, af_filter_t *af_filter)
 {
-     char *af_char = NULL;
+     const char *af_char = NULL;
+     int af_len;
      float af;
 
      if (af_missing_warning_printed) {
@@ -246,7 +223,7 @@ void apply_af_filter(var_t *var, af_filter_t *af_filter)
      }
 
      if (af_filter->min > 0 || af_filter->max > 0) {
-          if ( ! vcf_var_has_info_key(&af_char, var, "AF")) {
+          if ( ! vcf_var_info_view(&af_char, &af_len, var, "AF")) {
                if ( ! af_missing_warning_printed) {
                     LOG_WARN("%s\n", "Requested AF filtering failed since AF tag is missing in variant");
                     af_missing_warning_printed = 1;
@@ -255,11 +232,10 @@ void apply_af_filter(var_t *var, af_filter_t *af_filter)
           }
           af = strtof(af_char, (char **)NULL); /* atof */
           if (errno==ERANGE) {
-               LOG_ERROR("Couldn't parse EF from af_char %s. Disabling AF filtering", af_char);
+               LOG_ERROR("Couldn't parse EF from af_char %.*s. Disabling AF filtering", af_len, af_char);
                af_missing_warning_printed = 1;
                return;
           }
-          free(af_char);
 
           if (af_filter->min > 0.0 && af < af_filter->min) {
                vcf_var_add_to_filter(var, af_filter->id_min);
@@ -273,7 +249,8 @@ void apply_af_filter(var_t *var, af_filter_t *af_filter)
 
 void apply_dp_filter(var_t *var, dp_filter_t *dp_filter)
 {
-     char *dp_char = NULL;
+     const char *dp_char = NULL;
+     int dp_len;
      int cov;
 
      if (dp_missing_warning_printed) {
@@ -281,7 +258,7 @@ void apply_dp_filter(var_t *var, dp_filter_t *dp_filter)
      }
 
      if (dp_filter->min > 0 || dp_filter->max > 0) {
-          if ( ! vcf_var_has_info_key(&dp_char, var, "DP")) {
+          if ( ! vcf_var_info_view(&dp_char, &dp_len, var, "DP")) {
                if ( ! dp_missing_warning_printed) {
 #ifdef DEBUG
                     vcf_file_t f; f.fh = stderr; f.gz = 0; vcf_write_var(&f, var);
@@ -298,7 +275,6 @@ void apply_dp_filter(var_t *var, dp_filter_t *dp_filter)
                LOG_FATAL("%s\n", "errpr during int conversion");
                exit(1);
           }
-          free(dp_char);
  
           if (dp_filter->min > 0 && cov < dp_filter->min) {
                vcf_var_add_to_filter(var, dp_filter->id_min);
@@ -336,14 +312,15 @@ void apply_indelqual_threshold(var_t *var, indelqual_filter_t *indelqual_filter)
 
 void apply_sb_threshold(var_t *var, sb_filter_t *sb_filter)
 {
-     char *sb_char = NULL;
+     const char *sb_char = NULL;
+     int sb_len;
      int sb;
 
      if (! sb_filter->thresh) {
           return;
      }
 
-     if ( ! vcf_var_has_info_key(&sb_char, var, "SB")) {
+     if ( ! vcf_var_info_view(&sb_char, &sb_len, var, "SB")) {
           if ( ! sb_missing_warning_printed) {
                LOG_WARN("%s\n", "Requested SB filtering failed since SB tag is missing in variant");
                sb_missing_warning_printed = 1;
@@ -351,7 +328,6 @@ void apply_sb_threshold(var_t *var, sb_filter_t *sb_filter)
           return;
      }
      sb = atoi(sb_char);
-     free(sb_char);
 
      if (sb > sb_filter->thresh) {
           if (sb_filter->no_compound || alt_mostly_on_one_strand(var)) {
@@ -377,6 +353,7 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
 {
      long int *orig_idx = NULL; /* of size num_ign */
      double *errprobs = NULL;
+     int *quals = NULL; /* phred values of errprobs */
      long int num_ign = 0;
      long int i;
 
@@ -386,6 +363,8 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
      if ( ! errprobs) { LOG_FATAL("%s\n", "out of memory"); return -1; }
      orig_idx = malloc(num_vars * sizeof(long int));
      if ( ! orig_idx) { LOG_FATAL("%s\n", "out of memory"); return -1; }
+     quals = malloc(num_vars * sizeof(int));
+     if ( ! quals) { LOG_FATAL("%s\n", "out of memory"); return -1; }
 
      num_ign = 0;
      for (i=0; i<num_vars; i++) {
@@ -393,12 +372,14 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
                num_ign += 1;
                continue;
           }          
+          quals[i-num_ign] = mtc_quals[i].var_qual;
           errprobs[i-num_ign] = PHREDQUAL_TO_PROB(mtc_quals[i].var_qual);
           orig_idx[i-num_ign] = i;
      }
      if (num_vars-num_ign <= 0) {
           free(errprobs);
           free(orig_idx);
+          free(quals);
           return 0;
      }
 
@@ -429,16 +410,16 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
                     snvqual_filter->ntests);
           
      } else if (snvqual_filter->mtc_type == MTC_HOLMBONF) {
-          holm_bonf_corr(errprobs, num_vars-num_ign, 
-                         snvqual_filter->alpha, snvqual_filter->ntests);
+          holm_bonf_corr_phred(errprobs, quals, num_vars-num_ign, 
+                               snvqual_filter->alpha, snvqual_filter->ntests);
           
      } else if (snvqual_filter->mtc_type == MTC_FDR) {
           long int num_rej = 0;
           long int *idx_rej; /* indices of rejected i.e. significant values */
           
-          num_rej = fdr(errprobs, num_vars-num_ign, 
-                        snvqual_filter->alpha, snvqual_filter->ntests, 
-                        &idx_rej);
+          num_rej = fdr_phred(quals, num_vars-num_ign, 
+                              snvqual_filter->alpha, snvqual_filter->ntests, 
+                              &idx_rej);
           /* first pretend none are significant */
           for (i=0; i<num_vars-num_ign; i++) {
                errprobs[i] = DBL_MAX;
@@ -453,6 +434,7 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
           LOG_FATAL("Internal error: unknown MTC type %d\n", snvqual_filter->mtc_type);
           free(orig_idx);
           free(errprobs);
+          free(quals);
           return -1;
      }
      
@@ -464,6 +446,7 @@ int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_fi
 
      free(orig_idx);
      free(errprobs);
+     free(quals);
 
      return 0;
 }
@@ -482,6 +465,7 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
 {
      long int *orig_idx = NULL; /* of size num_ign */
      double *errprobs = NULL;
+     int *quals = NULL; /* phred values of errprobs */
      long int num_ign = 0;
      long int i;
 
@@ -492,6 +476,8 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
      if ( ! errprobs) { LOG_FATAL("%s\n", "out of memory"); return -1; }
      orig_idx = malloc(num_vars * sizeof(long int));
      if ( ! orig_idx) { LOG_FATAL("%s\n", "out of memory"); return -1; }
+     quals = malloc(num_vars * sizeof(int));
+     if ( ! quals) { LOG_FATAL("%s\n", "out of memory"); return -1; }
 
      num_ign = 0;
      for (i=0; i<num_vars; i++) {
@@ -499,12 +485,14 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
                num_ign += 1;
                continue;
           }
+          quals[i-num_ign] = mtc_quals[i].var_qual;
           errprobs[i-num_ign] = PHREDQUAL_TO_PROB(mtc_quals[i].var_qual);
           orig_idx[i-num_ign] = i;
      }
      if (num_vars-num_ign <= 0) {
           free(errprobs);
           free(orig_idx);
+          free(quals);
           return 0;
      }
 
@@ -533,17 +521,17 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
                     indelqual_filter->ntests);
           
      } else if (indelqual_filter->mtc_type == MTC_HOLMBONF) {
-          holm_bonf_corr(errprobs, num_vars-num_ign, 
-                         indelqual_filter->alpha, indelqual_filter->ntests);
+          holm_bonf_corr_phred(errprobs, quals, num_vars-num_ign, 
+                               indelqual_filter->alpha, indelqual_filter->ntests);
           
      } else if (indelqual_filter->mtc_type == MTC_FDR) {
           long int num_rej = 0;
           long int *idx_rej; /* indices of rejected i.e. significant values */
           
 
-          num_rej = fdr(errprobs, num_vars-num_ign, 
-                        indelqual_filter->alpha, indelqual_filter->ntests, 
-                        &idx_rej);
+          num_rej = fdr_phred(quals, num_vars-num_ign, 
+                              indelqual_filter->alpha, indelqual_filter->ntests, 
+                              &idx_rej);
           /* first pretend none are significant */
           for (i=0; i<num_vars-num_ign; i++) {
                errprobs[i] = DBL_MAX;
@@ -558,6 +546,7 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
           LOG_FATAL("Internal error: unknown MTC type %d\n", indelqual_filter->mtc_type);
           free(orig_idx);
           free(errprobs);
+          free(quals);
           return -1;
      }
      
@@ -569,6 +558,7 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
 
      free(orig_idx);
      free(errprobs);
+     free(quals);
 
      return 0;
 }
@@ -582,6 +572,7 @@ int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelq
 int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const long int num_vars)
 {
      double *sb_probs = NULL;
+     int *sb_quals = NULL; /* phred values of sb_probs */
      long int i;
      long int num_ign = 0;
      long int *orig_idx = NULL;/* we might ignore some variants (missing values etc). keep track of real indices of kept vars */
@@ -593,6 +584,8 @@ int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const lon
      if ( ! sb_probs) {LOG_FATAL("%s\n", "out of memory"); return -1;}
      orig_idx = malloc(num_vars * sizeof(long int));
      if ( ! orig_idx) {LOG_FATAL("%s\n", "out of memory"); return -1;}
+     sb_quals = malloc(num_vars * sizeof(int));
+     if ( ! sb_quals) {LOG_FATAL("%s\n", "out of memory"); return -1;}
 
      num_ign = 0;
      for (i=0; i<num_vars; i++) {          
@@ -602,11 +595,13 @@ int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const lon
                continue;
           }
 
+          sb_quals[i-num_ign] = mtc_quals[i].sb_qual;
           sb_probs[i-num_ign] = PHREDQUAL_TO_PROB(mtc_quals[i].sb_qual);
           orig_idx[i-num_ign] = i;
      }
      if (num_vars-num_ign <= 0) {
           free(sb_probs);
+          free(sb_quals);
           free(orig_idx);
           return 0;
      }
@@ -635,16 +630,16 @@ int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const lon
                     sb_filter->ntests);
           
      } else if (sb_filter->mtc_type == MTC_HOLMBONF) {
-          holm_bonf_corr(sb_probs, num_vars-num_ign, 
-                         sb_filter->alpha, sb_filter->ntests);
+          holm_bonf_corr_phred(sb_probs, sb_quals, num_vars-num_ign, 
+                               sb_filter->alpha, sb_filter->ntests);
           
      } else if (sb_filter->mtc_type == MTC_FDR) {
           long int num_rej = 0;
           long int *idx_rej; /* indices of rejected i.e. significant values */
           
-          num_rej = fdr(sb_probs, num_vars-num_ign, 
-                        sb_filter->alpha, sb_filter->ntests, 
-                        &idx_rej);
+          num_rej = fdr_phred(sb_quals, num_vars-num_ign, 
+                              sb_filter->alpha, sb_filter->ntests, 
+                              &idx_rej);
 
           /* first pretend none are significant */
           for (i=0; i<num_vars-num_ign; i++) {
@@ -672,6 +667,7 @@ int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const lon
 
      free(orig_idx);
      free(sb_probs);
+     free(sb_quals);
 
      return 0;
 }
@@ -774,88 +770,515 @@ void cfg_filter_to_vcf_header(filter_conf_t *cfg, char **header)
 }
 
 
-/* mtc_quals allocated here. size returned on exit or -1 on error */
+/* fills mtc_qual from var. var itself is left untouched */
+void
+mtc_qual_from_var(mtc_qual_t *mtc_qual, const var_t *var)
+{
+     const char *sb_char = NULL;
+     int sb_len;
+
+     mtc_qual->is_indel = vcf_var_is_indel(var);
+
+     /* variant quality */
+     if (var->qual==-1) {
+          /* missing qualities to fake value */
+          if (! varq_missing_warning_printed) {
+               LOG_WARN("%s\n", "Missing variant quality in at least once case. Assuming INT_MAX");
+               varq_missing_warning_printed = 1;
+          }
+          mtc_qual->var_qual = INT_MAX;
+     } else {
+          mtc_qual->var_qual = var->qual;
+     }
+
+     /* strand bias */
+     if ( ! vcf_var_info_view(&sb_char, &sb_len, var, "SB")) {
+          if ( ! sb_missing_warning_printed) {
+               LOG_WARN("%s\n", "At least one variant has no SB tag! Assuming 0");
+               sb_missing_warning_printed = 1;
+          }
+          mtc_qual->sb_qual = 0;
+     } else {
+          mtc_qual->sb_qual = atoi(sb_char);
+     }
+
+     /* vcf_var_info_view() and friends don't modify var */
+     mtc_qual->is_alt_mostly_on_one_strand = alt_mostly_on_one_strand((var_t *)var);
+}
+/* mtc_qual_from_var() */
+
+
+/* appends a new element to mtc_quals, growing it by doubling. returns
+ * pointer to new element */
+static mtc_qual_t *
+mtc_quals_append(mtc_qual_t **mtc_quals, long int *mtc_qual_size, const long int num_vars)
+{
+     if (num_vars >= *mtc_qual_size) {
+          *mtc_qual_size = *mtc_qual_size ? 2 * (*mtc_qual_size) : 16384;
+          (*mtc_quals) = realloc((*mtc_quals), (*mtc_qual_size) * sizeof(mtc_qual_t));
+          if (! (*mtc_quals)) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+     }
+     return & (*mtc_quals)[num_vars];
+}
+/* mtc_quals_append() */
+
+
+/* growing array of mtc quals, filled in input order by
+ * mtc_quals_write() */
+typedef struct {
+     mtc_qual_t *mtc_quals;
+     long int size;
+     long int num_vars;
+} mtc_quals_buf_t;
+
+
+/* vcfpipe_func_t: parses line (taken over by rec given as wdata) and
+ * appends its mtc_qual_t in binary form to out. stops at the first
+ * line that can't be parsed */
+static int
+mtc_qual_from_line(kstring_t *line, long int idx, kstring_t *out, void *wdata)
+{
+     vcf_rec_t *rec = (vcf_rec_t *) wdata;
+     mtc_qual_t mtc_qual;
+     kstring_t tmp;
+
+     /* swap instead of copy. the reader will reuse whatever we leave */
+     tmp = rec->line;
+     rec->line = *line;
+     *line = tmp;
+     if (vcf_rec_parse_line(rec)) {
+          /* how to distinguish between error and EOF? */
+          return 1;
+     }
+     /* ingest anything: we keep adding filters */
+     mtc_qual_from_var(& mtc_qual, & rec->var);
+     kputsn((const char *) & mtc_qual, sizeof(mtc_qual_t), out);
+     return 0;
+}
+/* mtc_qual_from_line() */
+
+
+/* vcfpipe_write_t for mtc_qual_from_line(). out is a mtc_quals_buf_t */
+static int
+mtc_quals_write(const char *buf, size_t len, void *out)
+{
+     mtc_quals_buf_t *m = (mtc_quals_buf_t *) out;
+     size_t off;
+
+     for (off = 0; off + sizeof(mtc_qual_t) <= len; off += sizeof(mtc_qual_t)) {
+          memcpy(mtc_quals_append(& m->mtc_quals, & m->size, m->num_vars),
+                 buf + off, sizeof(mtc_qual_t));
+          m->num_vars += 1;
+     }
+     return 0;
+}
+/* mtc_quals_write() */
+
+
+/* mtc_quals allocated here. size returned on exit or -1 on error.
+ * variants are parsed with num_threads threads (see vcfpipe.h) and
+ * bgzipped input decompressed with bgzf_threads threads */
 long int
-mtc_quals_from_vcf_file(mtc_qual_t **mtc_quals, const char *vcf_in)
+mtc_quals_from_vcf_file(mtc_qual_t **mtc_quals, const char *vcf_in,
+                        const int num_threads, const int bgzf_threads)
 {
-     long int num_vars = 0;
-     long int mtc_qual_size = 0;
-     int mtc_qual_incr = 16384;
+     mtc_quals_buf_t m;
      vcf_file_t vcffh;
+     vcf_rec_t *recs;
+     void **wdata;
+     long int rc;
+     int i;
 
      if (vcf_file_open(&vcffh, vcf_in,
                        HAS_GZIP_EXT(vcf_in), 'r')) {
           LOG_ERROR("Couldn't open %s\n", vcf_in);
           return -1;
      }
+     (void) vcf_file_set_threads(&vcffh, bgzf_threads);
 
     if (0 !=  vcf_skip_header(&vcffh)) {
          LOG_WARN("%s\n", "vcf_skip_header() failed");
          return -1;
     }
 
-    mtc_qual_size += mtc_qual_incr;
-    (*mtc_quals) = calloc(mtc_qual_size, sizeof(mtc_qual_t));
-     
-    while (1) {
-         var_t *var;
-         int rc;
-         int is_indel = 0;
-         char *sb_char = NULL;
-         
+    if (NULL == (recs = malloc(num_threads * sizeof(vcf_rec_t)))
+        ||
+        NULL == (wdata = malloc(num_threads * sizeof(void *)))) {
+         fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                 __FILE__, __FUNCTION__, __LINE__);
+         exit(1);
+    }
+    for (i = 0; i < num_threads; i++) {
+         vcf_rec_init(& recs[i]);
+         wdata[i] = & recs[i];
+    }
 
-         vcf_new_var(&var);
-         rc = vcf_parse_var(&vcffh, var);
-         if (rc) {
-              /* how to distinguish between error and EOF? */
-              break;
-         }
-         num_vars += 1;
-         /* ingest anything: we keep adding filters */
+    memset(&m, 0, sizeof(mtc_quals_buf_t));
+    rc = vcfpipe_run(&vcffh, mtc_quals_write, &m,
+                     mtc_qual_from_line, wdata, num_threads);
 
+    for (i = 0; i < num_threads; i++) {
+         vcf_rec_free(& recs[i]);
+    }
+    free(recs);
+    free(wdata);
+    vcf_file_close(&vcffh);
 
-         if (num_vars > mtc_qual_size) {
-              mtc_qual_size += mtc_qual_incr;
-              (*mtc_quals) = realloc((*mtc_quals), mtc_qual_size * sizeof(mtc_qual_t));
-         }
+    (*mtc_quals) = m.mtc_quals;
+    if (rc < 0) {
+         return -1;
+    }
+    return m.num_vars;
+}
+/* mtc_quals_from_vcf_file() */
+
+
+/* Spill file used by the single-pass mode: variants are parsed only
+ * once, their qualities collected for MTC and the parsed records
+ * written to an anonymous temporary file in a compact binary form
+ * (no text/gzip to redo), from where they are streamed back after MTC
+ * was computed. Record: int32 length of what follows, var_idx, pos,
+ * qual, then strings chrom, id, ref, alt, filter, info, format,
+ * num_samples and samples. Strings are written as int32 length (-1
+ * for NULL) followed by the chars. Records are assembled in a buffer
+ * and written/read with one call each.
+ */
+static void
+spill_put(kstring_t *buf, const void *data, const int len)
+{
+     if (kputsn((const char *)data, len, buf) < 0) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+}
+/* spill_put() */
 
-        
-         is_indel = vcf_var_is_indel(var);
-         (*mtc_quals)[num_vars-1].is_indel = is_indel;
-
-         /* variant quality */
-         if (var->qual==-1) {
-              /* missing qualities to fake value */
-              var->qual = INT_MAX;
-              if (! varq_missing_warning_printed) {
-                   LOG_WARN("%s\n", "Missing variant quality in at least once case. Assuming INT_MAX");
-                   varq_missing_warning_printed = 1;
-              }
-              (*mtc_quals)[num_vars-1].var_qual = INT_MAX;
-         } else {
-              (*mtc_quals)[num_vars-1].var_qual = var->qual;
-         }
 
-         /* strand bias */
-         if ( ! vcf_var_has_info_key(&sb_char, var, "SB")) {
-               if ( ! sb_missing_warning_printed) {
-                    LOG_WARN("%s\n", "At least one variant has no SB tag! Assuming 0");
-                    sb_missing_warning_printed = 1;
+static void
+spill_put_str(kstring_t *buf, const char *str)
+{
+     int32_t len = str ? (int32_t)strlen(str) : -1;
+     spill_put(buf, &len, sizeof(int32_t));
+     if (len>0) {
+          spill_put(buf, str, len);
+     }
+}
+/* spill_put_str() */
+
+
+/* reads from buf at offset *off. returns non-zero if out of bounds */
+static int
+spill_get(void *data, const int len, const kstring_t *buf, size_t *off)
+{
+     if ((*off) + len > buf->l) {
+          return -1;
+     }
+     memcpy(data, buf->s + (*off), len);
+     (*off) += len;
+     return 0;
+}
+/* spill_get() */
+
+
+static int
+spill_get_str(char **str, const kstring_t *buf, size_t *off)
+{
+     int32_t len;
+     if (spill_get(&len, sizeof(int32_t), buf, off)) {
+          return -1;
+     }
+     if (len<0) {
+          (*str) = NULL;
+          return 0;
+     }
+     if ((*off) + len > buf->l) {
+          return -1;
+     }
+     if (NULL == ((*str) = malloc(len+1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     memcpy((*str), buf->s + (*off), len);
+     (*str)[len] = '\0';
+     (*off) += len;
+     return 0;
+}
+/* spill_get_str() */
+
+
+/* buf is used as scratch. returns non-zero on error */
+static int
+spill_write_var(FILE *fh, kstring_t *buf, const long int var_idx, const var_t *var)
+{
+     int64_t idx = var_idx;
+     int64_t pos = var->pos;
+     int32_t qual = var->qual;
+     int32_t num_samples = var->num_samples;
+     int32_t rec_len;
+     int i;
+
+     buf->l = 0;
+     spill_put(buf, &idx, sizeof(int64_t));
+     spill_put(buf, &pos, sizeof(int64_t));
+     spill_put(buf, &qual, sizeof(int32_t));
+     spill_put_str(buf, var->chrom);
+     spill_put_str(buf, var->id);
+     spill_put_str(buf, var->ref);
+     spill_put_str(buf, var->alt);
+     spill_put_str(buf, var->filter);
+     spill_put_str(buf, var->info);
+     spill_put_str(buf, var->format);
+     spill_put(buf, &num_samples, sizeof(int32_t));
+     for (i=0; i<var->num_samples; i++) {
+          spill_put_str(buf, var->samples[i]);
+     }
+
+     rec_len = buf->l;
+     if (fwrite(&rec_len, sizeof(int32_t), 1, fh) != 1
+         || fwrite(buf->s, 1, buf->l, fh) != buf->l) {
+          return -1;
+     }
+     return 0;
+}
+/* spill_write_var() */
+
+
+/* var allocated here. buf is used as scratch. returns 1 on EOF, -1
+ * on error, 0 otherwise */
+static int
+spill_read_var(FILE *fh, kstring_t *buf, long int *var_idx, var_t **var)
+{
+     int64_t idx, pos;
+     int32_t qual, num_samples, rec_len;
+     size_t off = 0;
+     int i;
+
+     if (fread(&rec_len, sizeof(int32_t), 1, fh) != 1) {
+          return feof(fh) ? 1 : -1;
+     }
+     if (buf->m < (size_t)rec_len) {
+          buf->m = rec_len;
+          if (NULL == (buf->s = realloc(buf->s, buf->m))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+     }
+     buf->l = rec_len;
+     if (fread(buf->s, 1, buf->l, fh) != buf->l) {
+          return -1;
+     }
+
+     vcf_new_var(var);
+     if (spill_get(&idx, sizeof(int64_t), buf, &off)
+         || spill_get(&pos, sizeof(int64_t), buf, &off)
+         || spill_get(&qual, sizeof(int32_t), buf, &off)
+         || spill_get_str(& (*var)->chrom, buf, &off)
+         || spill_get_str(& (*var)->id, buf, &off)
+         || spill_get_str(& (*var)->ref, buf, &off)
+         || spill_get_str(& (*var)->alt, buf, &off)
+         || spill_get_str(& (*var)->filter, buf, &off)
+         || spill_get_str(& (*var)->info, buf, &off)
+         || spill_get_str(& (*var)->format, buf, &off)
+         || spill_get(&num_samples, sizeof(int32_t), buf, &off)) {
+          vcf_free_var(var);
+          return -1;
+     }
+     (*var_idx) = idx;
+     (*var)->pos = pos;
+     (*var)->qual = qual;
+     if (num_samples>0) {
+          if (NULL == ((*var)->samples = calloc(num_samples, sizeof(char*)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          (*var)->num_samples = num_samples;
+          for (i=0; i<num_samples; i++) {
+               if (spill_get_str(& (*var)->samples[i], buf, &off)) {
+                    vcf_free_var(var);
+                    return -1;
                }
-               (*mtc_quals)[num_vars-1].sb_qual = 0;
-         } else {
-              (*mtc_quals)[num_vars-1].sb_qual = atoi(sb_char);
-              free(sb_char);
-         }
+          }
+     }
+     return 0;
+}
+/* spill_read_var() */
 
-         (*mtc_quals)[num_vars-1].is_alt_mostly_on_one_strand =  alt_mostly_on_one_strand(var);
 
-         vcf_free_var(&var);
-    }
-    vcf_file_close(&vcffh);
+/* runs all requested multiple testing corrections on mtc_quals.
+ * returns non-zero on error */
+static int
+apply_filters_mtc(filter_conf_t *cfg, mtc_qual_t *mtc_quals, const long int num_vars)
+{
+     if (cfg->sb_filter.mtc_type != MTC_NONE) {
+          if (apply_sb_filter_mtc(mtc_quals, & cfg->sb_filter, num_vars)) {
+               LOG_FATAL("%s\n", "Multiple testing correction on strand-bias pvalues failed");
+               return -1;
+          }
+     }
+     if (cfg->indelqual_filter.mtc_type != MTC_NONE) {
+          if (apply_indelqual_filter_mtc(mtc_quals, & cfg->indelqual_filter, num_vars)) {
+               LOG_FATAL("%s\n", "Multiple testing correction on indel quality pvalues failed");
+               return -1;
+          }
+     }
+     if (cfg->snvqual_filter.mtc_type != MTC_NONE) {
+          if (apply_snvqual_filter_mtc(mtc_quals, & cfg->snvqual_filter, num_vars)) {
+               LOG_FATAL("%s\n", "Multiple testing correction on SNV quality pvalues failed");
+               return -1;
+          }
+     }
+#ifdef TRACE
+     {
+          long int i;
+          for (i=0; i<num_vars; i++) {
+               LOG_WARN("mtc_quals #%ld sb_qual=%d var_qual=%d is_indel=%d\n", 
+                        i, mtc_quals[i].sb_qual, mtc_quals[i].var_qual, mtc_quals[i].is_indel);
+          }
+     }
+#endif
+     return 0;
+}
+/* apply_filters_mtc() */
+
+
+/* applies all filters to var. mtc_qual is the var's (corrected)
+ * entry and only needed if mtc was requested. returns 1 if var is to
+ * be written, i.e. unless filtered and only passed ones are to be
+ * printed, 0 otherwise. cfg is only read, so this can run in several
+ * threads at once. */
+static int
+filter_var(filter_conf_t *cfg, var_t *var, const mtc_qual_t *mtc_qual)
+{
+     int is_indel = vcf_var_is_indel(var);
+
+     /* filters applying to all types of variants
+      */
+     apply_af_filter(var, & cfg->af_filter);
+     apply_dp_filter(var, & cfg->dp_filter);
+
+     /* quality threshold per variant type
+      */
+     if (! is_indel) {
+          if (cfg->snvqual_filter.thresh) {
+               assert(cfg->snvqual_filter.mtc_type == MTC_NONE);
+               apply_snvqual_threshold(var, & cfg->snvqual_filter);
+          } else if (cfg->snvqual_filter.mtc_type != MTC_NONE) {
+               if (mtc_qual->var_qual != -1) {
+                    vcf_var_add_to_filter(var, cfg->snvqual_filter.id);
+               }
+          }
+
+     } else {
+          if (cfg->indelqual_filter.thresh) {
+               assert(cfg->indelqual_filter.mtc_type == MTC_NONE);
+               apply_indelqual_threshold(var, & cfg->indelqual_filter);
+          } else if (cfg->indelqual_filter.mtc_type != MTC_NONE) {
+               if (mtc_qual->var_qual != -1) {
+                    vcf_var_add_to_filter(var, cfg->indelqual_filter.id);
+               }
+          }
+     }
+         
+     /* sb filter 
+      */
+     if (cfg->sb_filter.thresh) {
+          if (! is_indel || cfg->sb_filter.incl_indels) {
+               assert(cfg->sb_filter.mtc_type == MTC_NONE);
+               apply_sb_threshold(var, & cfg->sb_filter);
+          }
+     } else if (cfg->sb_filter.mtc_type != MTC_NONE) {
+          if (! is_indel || cfg->sb_filter.incl_indels) {
+               if (mtc_qual->sb_qual == -1) {
+                    vcf_var_add_to_filter(var, cfg->sb_filter.id);
+               }
+          }              
+     }
+         
+     /* output
+      */
+     if (cfg->print_only_passed && ! (VCF_VAR_PASSES(var))) {
+          return 0;
+     }
+
+     /* add pass if no filters were set */
+     if (! var->filter || strlen(var->filter)<=1) {
+          char pass_str[] = "PASS";
+          if (var->filter) {
+               free(var->filter);
+          }
+          var->filter = strdup(pass_str);
+     }
+
+     return 1;
+}
+/* filter_var() */
+
+
+/* like filter_var() but also writes var to output if needed. returns
+ * 1 if written, 0 otherwise. */
+static int
+filter_and_write_var(filter_conf_t *cfg, var_t *var, const mtc_qual_t *mtc_qual)
+{
+     if (! filter_var(cfg, var, mtc_qual)) {
+          return 0;
+     }
+     vcf_write_var(& cfg->vcf_out, var);
+     return 1;
+}
+/* filter_and_write_var() */
+
+
+/* per-thread state of the pipelined filter pass */
+typedef struct {
+     filter_conf_t *cfg;
+     const mtc_qual_t *mtc_quals; /* NULL if no mtc requested */
+     vcf_rec_t rec;
+} filter_worker_t;
+
+
+/* vcfpipe_func_t: parses line (taken over by the worker's record),
+ * filters it and formats it to out if it is to be written. idx is
+ * the index of the variant in mtc_quals. stops at the first line that
+ * can't be parsed */
+static int
+filter_line(kstring_t *line, long int idx, kstring_t *out, void *wdata)
+{
+     filter_worker_t *w = (filter_worker_t *) wdata;
+     var_t *var = & w->rec.var;
+     kstring_t tmp;
+     int is_indel;
+
+     /* swap instead of copy. the reader will reuse whatever we leave */
+     tmp = w->rec.line;
+     w->rec.line = *line;
+     *line = tmp;
+     if (vcf_rec_parse_line(& w->rec)) {
+          /* how to distinguish between error and EOF? */
+          return 1;
+     }
+
+     is_indel = vcf_var_is_indel(var);
+     if (w->cfg->only_snvs && is_indel) {
+          return 0;
+     } else if (w->cfg->only_indels && ! is_indel) {
+          return 0;
+     }
 
-    return num_vars;
+     if (filter_var(w->cfg, var, w->mtc_quals ? & w->mtc_quals[idx] : NULL)) {
+          vcf_format_var(out, var);
+     }
+     return 0;
 }
+/* filter_line() */
+
 
 int
 main_filter(int argc, char *argv[])
@@ -872,6 +1295,13 @@ main_filter(int argc, char *argv[])
      long int num_vars;
      static int no_defaults = 0;
      long int var_idx = -1;
+     static int spill = -1; /* auto */
+     int bgzf_threads = 1;
+     int num_threads = 1;
+     int use_mtc;
+     FILE *spill_fh = NULL;
+     kstring_t spill_buf = {0, 0, NULL};
+     vcf_rec_t rec;
 
      /* default filter options */
      memset(&cfg, 0, sizeof(filter_conf_t));
@@ -897,6 +1327,10 @@ main_filter(int argc, char *argv[])
               {"no-defaults", no_argument, &no_defaults, 1},
               {"only-indels", no_argument, &only_indels, 1},
               {"only-snvs", no_argument, &only_snvs, 1},
+              {"spill", no_argument, &spill, 1},
+              {"no-spill", no_argument, &spill, 0},
+              {"bgzf-threads", required_argument, NULL, 'Z'}, /* long only */
+              {"threads", required_argument, NULL, 'T'}, /* long only */
 
               {"help", no_argument, NULL, 'h'},
               {"in", required_argument, NULL, 'i'},
@@ -947,6 +1381,20 @@ main_filter(int argc, char *argv[])
          case 'i':
               vcf_in = strdup(optarg);
               break;
+         case 'Z':
+              bgzf_threads = atoi(optarg);
+              if (bgzf_threads < 1) {
+                   LOG_FATAL("%s\n", "Number of compression threads has to be at least one");
+                   return 1;
+              }
+              break;
+         case 'T':
+              num_threads = atoi(optarg);
+              if (num_threads < 1) {
+                   LOG_FATAL("%s\n", "Number of threads has to be at least one");
+                   return 1;
+              }
+              break;
          case 'o':
               if (0 != strcmp(optarg, "-")) {
                    if (file_exists(optarg)) {
@@ -1142,9 +1590,26 @@ main_filter(int argc, char *argv[])
 
     /* missing file args default to stdin and stdout
      */
-    /* no streaming allowed for vcf_in: we need to determine thresholds first */
+    /* the two-pass mode can't stream vcf_in: we need to determine thresholds first */
+    use_mtc = (cfg.sb_filter.mtc_type != MTC_NONE || cfg.snvqual_filter.mtc_type != MTC_NONE || cfg.indelqual_filter.mtc_type != MTC_NONE);
     if  (! vcf_in) {
-         LOG_FATAL("%s\n", "Input VCF missing. No streaming allowed. Need to determine auto threshold in memory friendly manner first.");
+         if (use_mtc && spill == 0) {
+              LOG_FATAL("%s\n", "Input VCF missing. No streaming allowed with --no-spill. Need to determine auto threshold in memory friendly manner first.");
+              return 1;
+         }
+         vcf_in = malloc(2 * sizeof(char));
+         strcpy(vcf_in, "-");
+    }
+    /* spilling is only worth it if reparsing is expensive (gzip) or
+     * impossible (stdin). the spilling pass runs single-threaded
+     * though, whereas both passes of the two-pass mode are pipelined
+     * (and gzip input decompressed in parallel), so with threads
+     * only spill if we have to */
+    if (spill == -1) {
+         spill = (0 == strcmp(vcf_in, "-") || (num_threads == 1 && HAS_GZIP_EXT(vcf_in)));
+    }
+    if (use_mtc && ! spill && 0 == strcmp(vcf_in, "-")) {
+         LOG_FATAL("%s\n", "Can't read VCF from stdin with --no-spill");
          return 1;
     }
     if  (! vcf_out) {
@@ -1155,47 +1620,23 @@ main_filter(int argc, char *argv[])
 
 
 
-    /* First pass parsing to get qualities for MTC computation (if needed)
+    /* First pass parsing to get qualities for MTC computation (if
+     * needed and not done on the fly while spilling)
      */
-    if (cfg.sb_filter.mtc_type != MTC_NONE || cfg.snvqual_filter.mtc_type != MTC_NONE || cfg.indelqual_filter.mtc_type != MTC_NONE) {
-#ifdef TRACE
-         long int i = 0;
-#endif
+    if (use_mtc && ! spill) {
          LOG_VERBOSE("%s\n", "At least one type of multiple testing correction requested. Doing first pass of vcf");
 
-         if ((num_vars = mtc_quals_from_vcf_file(& mtc_quals, vcf_in)) < 0) {
+         if ((num_vars = mtc_quals_from_vcf_file(& mtc_quals, vcf_in,
+                                                 num_threads, bgzf_threads)) < 0) {
               LOG_ERROR("Couldn't parse %s\n", vcf_in);
               return 1;
          }
-
-         if (cfg.sb_filter.mtc_type != MTC_NONE) {
-              if (apply_sb_filter_mtc(mtc_quals, & cfg.sb_filter, num_vars)) {
-                   LOG_FATAL("%s\n", "Multiple testing correction on strand-bias pvalues failed");
-                   return -1;
-              }
-         }
-         if (cfg.indelqual_filter.mtc_type != MTC_NONE) {
-              if (apply_indelqual_filter_mtc(mtc_quals, & cfg.indelqual_filter, num_vars)) {
-                   LOG_FATAL("%s\n", "Multiple testing correction on indel quality pvalues failed");
-                   return -1;
-              }
-         }
-         if (cfg.snvqual_filter.mtc_type != MTC_NONE) {
-              if (apply_snvqual_filter_mtc(mtc_quals, & cfg.snvqual_filter, num_vars)) {
-                   LOG_FATAL("%s\n", "Multiple testing correction on SNV quality pvalues failed");
-                   return -1;
-              }
-         }
-#ifdef TRACE
-         for (i=0; i<num_vars; i++) {
-              LOG_WARN("mtc_quals #%ld sb_qual=%d var_qual=%d is_indel=%d\n", 
-                       i, mtc_quals[i].sb_qual, mtc_quals[i].var_qual, mtc_quals[i].is_indel);
+         if (apply_filters_mtc(& cfg, mtc_quals, num_vars)) {
+              return -1;
          }
-#endif
          LOG_VERBOSE("%s\n", "MTC application completed");
-    } else {
+    } else if (! use_mtc) {
          LOG_VERBOSE("%s\n", "No multiple testing correction requested. First pass of vcf skipped");
-
     }
 
     
@@ -1209,6 +1650,8 @@ main_filter(int argc, char *argv[])
          LOG_ERROR("Couldn't open %s\n", vcf_out);
          return 1;
     }
+    (void) vcf_file_set_threads(& cfg.vcf_in, bgzf_threads);
+    (void) vcf_file_set_threads(& cfg.vcf_out, bgzf_threads);
     free(vcf_in);
     free(vcf_out);
 
@@ -1228,97 +1671,105 @@ main_filter(int argc, char *argv[])
     free(vcf_header);
 
 
-    /* read in variants
+    /* single pass: parse variants once, collect mtc quals and spill
+     * parsed records
      */
-    while (1) {
-         var_t *var;
+    if (use_mtc && spill) {
+         long int mtc_qual_size = 0;
+         long int num_spilled = 0;
          int rc;
-         int is_indel = 0;
 
-         vcf_new_var(&var);
-         rc = vcf_parse_var(& cfg.vcf_in, var);
-         if (rc) {
-              /* how to distinguish between error and EOF? */
-              break;
+         LOG_VERBOSE("%s\n", "At least one type of multiple testing correction requested. Collecting qualities and spilling parsed variants");
+         if (NULL == (spill_fh = tmpfile())) {
+              LOG_FATAL("Couldn't create temporary spill file: %s\n", strerror(errno));
+              return 1;
          }
-         var_idx += 1;
 
-         is_indel = vcf_var_is_indel(var);
+         num_vars = 0;
+         vcf_rec_init(&rec);
+         while (1) {
+              var_t *var = & rec.var;
+              int is_indel;
 
-         if (cfg.only_snvs && is_indel) {
-              vcf_free_var(&var);
-              continue;
-         } else if (cfg.only_indels && ! is_indel) {
-              vcf_free_var(&var);
-              continue;
+              rc = vcf_rec_parse(& cfg.vcf_in, &rec);
+              if (rc) {
+                   /* how to distinguish between error and EOF? */
+                   break;
+              }
+              mtc_qual_from_var(mtc_quals_append(& mtc_quals, & mtc_qual_size, num_vars), var);
+              num_vars += 1;
+
+              is_indel = vcf_var_is_indel(var);
+              if ((cfg.only_snvs && is_indel) || (cfg.only_indels && ! is_indel)) {
+                   continue;
+              }
+              if (spill_write_var(spill_fh, &spill_buf, num_vars-1, var)) {
+                   LOG_FATAL("Couldn't write to spill file: %s\n", strerror(errno));
+                   return 1;
+              }
+              num_spilled += 1;
          }
+         vcf_rec_free(&rec);
+         LOG_VERBOSE("Parsed %ld variants (%ld spilled)\n", num_vars, num_spilled);
 
+         if (apply_filters_mtc(& cfg, mtc_quals, num_vars)) {
+              return -1;
+         }
+         LOG_VERBOSE("%s\n", "MTC application completed");
 
-         /* filters applying to all types of variants
-          */
-         apply_af_filter(var, & cfg.af_filter);
-         apply_dp_filter(var, & cfg.dp_filter);
+         rewind(spill_fh);
+         while (1) {
+              var_t *var;
 
-         /* quality threshold per variant type
-          */
-         if (! is_indel) {
-              if (cfg.snvqual_filter.thresh) {
-                   assert(cfg.snvqual_filter.mtc_type == MTC_NONE);
-                   apply_snvqual_threshold(var, & cfg.snvqual_filter);
-              } else if (cfg.snvqual_filter.mtc_type != MTC_NONE) {
-                   if (mtc_quals[var_idx].var_qual != -1) {
-                        vcf_var_add_to_filter(var, cfg.snvqual_filter.id);
+              rc = spill_read_var(spill_fh, &spill_buf, & var_idx, & var);
+              if (rc) {
+                   if (rc<0) {
+                        LOG_FATAL("%s\n", "Couldn't read back spill file");
+                        return 1;
                    }
+                   break;
               }
+              (void) filter_and_write_var(& cfg, var, & mtc_quals[var_idx]);
+              vcf_free_var(&var);
 
-         } else {
-              if (cfg.indelqual_filter.thresh) {
-                   assert(cfg.indelqual_filter.mtc_type == MTC_NONE);
-                   apply_indelqual_threshold(var, & cfg.indelqual_filter);
-              } else if (cfg.indelqual_filter.mtc_type != MTC_NONE) {
-                   if (mtc_quals[var_idx].var_qual != -1) {
-                        vcf_var_add_to_filter(var, cfg.indelqual_filter.id);
-                   }
-              }
-         }
-         
-         /* sb filter 
-          */
-         if (cfg.sb_filter.thresh) {
-              if (! is_indel || cfg.sb_filter.incl_indels) {
-                   assert(cfg.sb_filter.mtc_type == MTC_NONE);
-                   apply_sb_threshold(var, & cfg.sb_filter);
+              if (var_idx%1000==0) {
+                   (void) vcf_file_flush(& cfg.vcf_out);
               }
-         } else if (cfg.sb_filter.mtc_type != MTC_NONE) {
-              if (! is_indel || cfg.sb_filter.incl_indels) {
-                   if (mtc_quals[var_idx].sb_qual == -1) {
-                        vcf_var_add_to_filter(var, cfg.sb_filter.id);
-                   }
-              }              
          }
-         
+         fclose(spill_fh);
+         free(spill_buf.s);
 
-         /* output
+    } else {
+         /* read in, filter and write variants, pipelined if
+          * num_threads>1. output is flushed after every batch
           */
-         if (cfg.print_only_passed && ! (VCF_VAR_PASSES(var))) {
-              vcf_free_var(&var);
-              continue;
+         filter_worker_t *workers;
+         void **wdata;
+         int i;
+
+         if (NULL == (workers = malloc(num_threads * sizeof(filter_worker_t)))
+             ||
+             NULL == (wdata = malloc(num_threads * sizeof(void *)))) {
+              fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                      __FILE__, __FUNCTION__, __LINE__);
+              exit(1);
          }
-
-         /* add pass if no filters were set */
-         if (! var->filter || strlen(var->filter)<=1) {
-              char pass_str[] = "PASS";
-              if (var->filter) {
-                   free(var->filter);
-              }
-              var->filter = strdup(pass_str);
+         for (i = 0; i < num_threads; i++) {
+              workers[i].cfg = & cfg;
+              workers[i].mtc_quals = mtc_quals;
+              vcf_rec_init(& workers[i].rec);
+              wdata[i] = & workers[i];
          }
-
-         vcf_write_var(& cfg.vcf_out, var);
-         vcf_free_var(&var);
-
-         if (var_idx%1000==0) {
-              (void) vcf_file_flush(& cfg.vcf_out);
+         num_vars = vcfpipe_run(& cfg.vcf_in, vcfpipe_write_vcf, & cfg.vcf_out,
+                                filter_line, wdata, num_threads);
+         for (i = 0; i < num_threads; i++) {
+              vcf_rec_free(& workers[i].rec);
+         }
+         free(workers);
+         free(wdata);
+         if (num_vars < 0) {
+              LOG_FATAL("%s\n", "Couldn't write filtered variants");
+              return 1;
          }
     }
 
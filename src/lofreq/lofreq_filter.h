@@ -28,6 +28,55 @@
 #ifndef LOFREQ_FILTER_H
 #define LOFREQ_FILTER_H
 
+#include "vcf.h"
+
+#define FILTER_ID_STRSIZE 64
+
+typedef struct {
+     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
+     int mtc_type;/* holm; holmbonf; fdr; none */
+     double alpha;
+     long int ntests;
+     char id[FILTER_ID_STRSIZE];
+     int no_compound; /* otherwise ALT_STRAND_RATIO of var bases have to be on one strand as well */
+     int incl_indels; /* if 1, also apply to indels */
+} sb_filter_t;
+
+typedef struct {
+     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
+     int mtc_type;/* holm; holmbonf; fdr; none */
+     double alpha;
+     long int ntests;
+     char id[FILTER_ID_STRSIZE];
+} snvqual_filter_t;
+
+typedef struct {
+     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
+     int mtc_type;/* holm; holmbonf; fdr; none */
+     double alpha;
+     long int ntests;
+     char id[FILTER_ID_STRSIZE];
+} indelqual_filter_t;
+
+typedef struct mtc_qual_s {
+     int is_indel;/* if not, snv assumed */
+     int var_qual;
+     int sb_qual;
+     int is_alt_mostly_on_one_strand;
+} mtc_qual_t;
+
+
+int alt_mostly_on_one_strand(var_t *var);
+
+void mtc_qual_from_var(mtc_qual_t *mtc_qual, const var_t *var);
+
+/* multiple testing correction on all of mtc_quals (which are
+ * modified!). see lofreq_filter.c for details. all return -1 on
+ * error */
+int apply_snvqual_filter_mtc(mtc_qual_t *mtc_quals, snvqual_filter_t *snvqual_filter, const long int num_vars);
+int apply_indelqual_filter_mtc(mtc_qual_t *mtc_quals, indelqual_filter_t *indelqual_filter,  const long int num_vars);
+int apply_sb_filter_mtc(mtc_qual_t *mtc_quals, sb_filter_t *sb_filter, const long int num_vars);
+
 int main_filter(int argc, char *argv[]);
 
 #endif
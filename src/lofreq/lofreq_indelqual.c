@@ -36,7 +36,9 @@
 #include "log.h"
 #include "utils.h"
 #include "defaults.h"
+#include "refcache.h"
 #include "lofreq_indelqual.h"
+#include "bampipe.h"
 
 
 char DINDELQ[] = "!MMMLKEC@=<;:988776"; /* 1-based 18 */
@@ -55,6 +57,7 @@ typedef struct {
      samfile_t *in;
      bamFile out;
      faidx_t *fai;
+     refcache_t *refcache;
      int *hpcount;
      int rlen;
      uint32_t tid;
@@ -93,8 +96,6 @@ static int uniform_fetch_func(bam1_t *b, void *data)
      }
      bam_aux_append(b, BD_TAG, 'Z', c->l_qseq+1, (uint8_t*) dq);
 
-     bam_write1(tmp->out, b);
-
      free(iq);
      free(dq);
 
@@ -104,7 +105,7 @@ static int uniform_fetch_func(bam1_t *b, void *data)
 
 /* Stores an array of ints that corresponds to the length of the
  * homopolymer at the start of each homopolymer*/
-int find_homopolymers(char *query, int *count, int qlen)
+int find_homopolymers(const char *query, int *count, int qlen)
 {
      int i, j;
      int curr_i = 0;
@@ -131,36 +132,14 @@ int find_homopolymers(char *query, int *count, int qlen)
 }
 
 
-static int dindel_fetch_func(bam1_t *b, void *data)
+/* adds dindel's indel qualities for all bases of b, given the
+ * homopolymer counts (see find_homopolymers()) of its target of length
+ * rlen. overwrites existing values. returns 0 */
+int dindel_add_quals(bam1_t *b, const int *hpcount, int rlen)
 {
-     data_t_dindel *tmp = (data_t_dindel*)data;
      bam1_core_t *c = &b->core;
-     int rlen;
      uint8_t *to_delete;
 
-     /* don't change reads failing default mask: BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP */
-     if (c->flag & BAM_DEF_MASK) {
-          /* fprintf(stderr, "skipping read: %s at pos %d\n", bam1_qname(b), c->pos); */
-          bam_write1(tmp->out, b);
-          return 0;
-     }
-
-     /* get the reference sequence and compute homopolymer array */
-     if (tmp->tid != c->tid) {
-             /*fprintf(stderr, "fetching reference sequence %s\n",
-               tmp->in->header->target_name[c->tid]); */
-          char *ref = fai_fetch(tmp->fai, tmp->in->header->target_name[c->tid], &rlen);
-          strtoupper(ref);/* safeguard */
-          int rlen = strlen(ref);
-          tmp->tid = c->tid;
-          if (tmp->hpcount) free(tmp->hpcount);
-          tmp->hpcount = (int*)malloc(rlen*sizeof(int));
-          find_homopolymers(ref, tmp->hpcount, rlen);
-          free(ref);
-          tmp->rlen = rlen;
-          /* fprintf(stderr, "fetched reference sequence\n");*/
-     }
-
      /* parse the cigar string */
      uint32_t *cigar = bam1_cigar(b);
      uint8_t indelq[c->l_qseq+1];
@@ -173,10 +152,10 @@ static int dindel_fetch_func(bam1_t *b, void *data)
           if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
                for (j = 0; j < oplen; j++) {
                        /*fprintf(stderr, "query:%d, ref:%d, count:%d\n", 
-                         y, x, tmp->hpcount[x+1]); */
+                         y, x, hpcount[x+1]); */
                     /* FIXME clang complains: The left operand of '>' is a garbage value */
-                    indelq[y] = (x > tmp->rlen-2) ? DINDELQ[0] : (tmp->hpcount[x+1]>18 ?
-                         DINDELQ[0] : DINDELQ[tmp->hpcount[x+1]]);
+                    indelq[y] = (x > rlen-2) ? DINDELQ[0] : (hpcount[x+1]>18 ?
+                         DINDELQ[0] : DINDELQ[hpcount[x+1]]);
                     x++; 
                     y++;
                }
@@ -208,19 +187,88 @@ static int dindel_fetch_func(bam1_t *b, void *data)
      }
      bam_aux_append(b, BD_TAG, 'Z', c->l_qseq+1, indelq);
 
-     bam_write1(tmp->out, b);
      return 0;
 }
 
 
+static int dindel_fetch_func(bam1_t *b, void *data)
+{
+     data_t_dindel *tmp = (data_t_dindel*)data;
+     bam1_core_t *c = &b->core;
+     int rlen;
+
+     /* don't change reads failing default mask: BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP */
+     if (c->flag & BAM_DEF_MASK) {
+          /* fprintf(stderr, "skipping read: %s at pos %d\n", bam1_qname(b), c->pos); */
+          return 0;
+     }
+
+     /* get the reference sequence and compute homopolymer array */
+     if (tmp->tid != c->tid) {
+             /*fprintf(stderr, "fetching reference sequence %s\n",
+               tmp->in->header->target_name[c->tid]); */
+          const char *ref = refcache_get(tmp->refcache, tmp->in->header->target_name[c->tid], &rlen);
+          if (! ref) {
+               LOG_FATAL("Couldn't fetch sequence '%s'\n", tmp->in->header->target_name[c->tid]);
+               exit(1);
+          }
+          tmp->tid = c->tid;
+          if (tmp->hpcount) free(tmp->hpcount);
+          tmp->hpcount = (int*)malloc(rlen*sizeof(int));
+          find_homopolymers(ref, tmp->hpcount, rlen);
+          refcache_release(tmp->refcache, tmp->in->header->target_name[c->tid]);
+          tmp->rlen = rlen;
+          /* fprintf(stderr, "fetched reference sequence\n");*/
+     }
+
+     return dindel_add_quals(b, tmp->hpcount, tmp->rlen);
+}
+
+
+/* opens bam_out (- for stdout) for writing, with num_threads
+ * compression threads */
+static bamFile
+open_bam_out(const char *bam_out, int num_threads)
+{
+     bamFile out;
+     if (!bam_out || bam_out[0] == '-') {
+          out = bam_dopen(fileno(stdout), "w");
+     } else {
+          out = bam_open(bam_out, "w");
+     }
+     if (out && num_threads > 1 && bgzf_mt(out, num_threads, 256)) {
+          LOG_WARN("%s\n", "Couldn't enable multi-threaded compression");
+     }
+     return out;
+}
+
+
+/* returns an array of num_threads worker data pointers, all set to data */
+static void **
+shared_wdata(void *data, int num_threads)
+{
+     void **wdata;
+     int i;
+     if (NULL == (wdata = malloc(num_threads * sizeof(void *)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i = 0; i < num_threads; i++) {
+          wdata[i] = data;
+     }
+     return wdata;
+}
+
+
 int add_uniform(const char *bam_in, const char *bam_out,
-                const int ins_qual, const int del_qual)
+                const int ins_qual, const int del_qual, const int num_threads)
 {
 	data_t_uniform tmp;
     uint8_t iq = ENCODE_Q(ins_qual+33);
     uint8_t dq = ENCODE_Q(del_qual+33);
-    bam1_t *b = NULL;
-    int count = 0;
+    void **wdata;
+    long int count;
 
 	if ((tmp.in = samopen(bam_in, "rb", 0)) == 0) {
          LOG_FATAL("Failed to open BAM file %s\n", bam_in);
@@ -230,32 +278,34 @@ int add_uniform(const char *bam_in, const char *bam_out,
     tmp.iq = iq;
     tmp.dq = dq;
 
-    if (!bam_out || bam_out[0] == '-') {
-         tmp.out = bam_dopen(fileno(stdout), "w");
-    } else {
-         tmp.out = bam_open(bam_out, "w");
-    }
+    tmp.out = open_bam_out(bam_out, num_threads);
     bam_header_write(tmp.out, tmp.in->header);
     
-    b = bam_init1();
-    while (samread(tmp.in, b) >= 0) {
-         count++;
-         uniform_fetch_func(b, &tmp); 
-    }
-    bam_destroy1(b);
+    /* uniform_fetch_func() only reads tmp, so all threads can share it */
+    wdata = shared_wdata(&tmp, num_threads);
+    count = bampipe_run(tmp.in, bampipe_write_bam, tmp.out, uniform_fetch_func,
+                        wdata, num_threads);
+    free(wdata);
     
     samclose(tmp.in);
     bam_close(tmp.out);
-    LOG_VERBOSE("Processed %d reads\n", count);
+    if (count < 0) {
+         LOG_ERROR("%s\n", "Failed to process reads");
+         return 1;
+    }
+    LOG_VERBOSE("Processed %ld reads\n", count);
     return 0;
 }
 
 
-int add_dindel(const char *bam_in, const char *bam_out, const char *ref)
+int add_dindel(const char *bam_in, const char *bam_out, const char *ref,
+               const int num_threads)
 {
 	data_t_dindel tmp;
-    int count = 0;
-    bam1_t *b = NULL;
+    data_t_dindel *wtmp;
+    void **wdata;
+    long int count;
+    int i;
 
 	if ((tmp.in = samopen(bam_in, "rb", 0)) == 0) {
          LOG_FATAL("Failed to open BAM file %s\n", bam_in);
@@ -266,29 +316,45 @@ int add_dindel(const char *bam_in, const char *bam_out, const char *ref)
          return 1;
     }
     /*warn_old_fai(ref);*/
+    tmp.refcache = refcache_new(tmp.fai, REFCACHE_DEFAULT_MAX_BYTES);
+    refcache_open_store(tmp.refcache, ref);
 
-    if (!bam_out || bam_out[0] == '-') {
-         tmp.out = bam_dopen(fileno(stdout), "w");
-    } else {
-         tmp.out = bam_open(bam_out, "w");
-    }
+    tmp.out = open_bam_out(bam_out, num_threads);
     bam_header_write(tmp.out, tmp.in->header);
     
-    b = bam_init1();
     tmp.tid = -1;
     tmp.hpcount = 0;
     tmp.rlen = 0;
-    while (samread(tmp.in, b) >= 0) {
-         count++;
-         dindel_fetch_func(b, &tmp); 
+
+    /* homopolymer counts are per thread. refcache is shared */
+    wtmp = malloc(num_threads * sizeof(data_t_dindel));
+    wdata = shared_wdata(NULL, num_threads);
+    if (! wtmp) {
+         fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                 __FILE__, __FUNCTION__, __LINE__);
+         exit(1);
+    }
+    for (i = 0; i < num_threads; i++) {
+         memcpy(& wtmp[i], & tmp, sizeof(data_t_dindel));
+         wdata[i] = & wtmp[i];
+    }
+    count = bampipe_run(tmp.in, bampipe_write_bam, tmp.out, dindel_fetch_func,
+                        wdata, num_threads);
+    for (i = 0; i < num_threads; i++) {
+         free(wtmp[i].hpcount);
     }
-    bam_destroy1(b);
+    free(wtmp);
+    free(wdata);
     
-    if (tmp.hpcount) free(tmp.hpcount);
     samclose(tmp.in);
     bam_close(tmp.out);
+    refcache_free(tmp.refcache);
     fai_destroy(tmp.fai);
-	LOG_VERBOSE("Processed %d reads\n", count);
+    if (count < 0) {
+         LOG_ERROR("%s\n", "Failed to process reads");
+         return 1;
+    }
+	LOG_VERBOSE("Processed %ld reads\n", count);
 	return 0;
 }
 
@@ -309,6 +375,7 @@ usage()
      fprintf(stderr, "  -f | --ref                Reference sequence used for mapping\n");
      fprintf(stderr, "                            (Only required for --dindel)\n");
      fprintf(stderr, "  -o | --out FILE           Output BAM file [- = stdout = default]\n");
+     fprintf(stderr, "       --threads INT        Number of threads for processing and compression [1]\n");
      fprintf(stderr, "       --verbose            Be verbose\n");
      fprintf(stderr, "\n");
      fprintf(stderr,
@@ -346,6 +413,7 @@ int main_indelqual(int argc, char *argv[])
      static int dindel = 0;
      int uni_iq = -1;
      int uni_dq = -1;
+     int num_threads = 1;
      while (1) {
           static struct option long_opts[] = {
                /* see usage sync */
@@ -356,6 +424,7 @@ int main_indelqual(int argc, char *argv[])
                {"out", required_argument, NULL, 'o'},
                {"uniform", required_argument, NULL, 'u'},
                {"ref", required_argument, NULL, 'f'},
+               {"threads", required_argument, NULL, 't'}, /* long only */
                {0, 0, 0, 0} /* sentinel */
           };
           
@@ -393,6 +462,13 @@ int main_indelqual(int argc, char *argv[])
                }
                bam_out = strdup(optarg);
                break;
+          case 't':
+               num_threads = atoi(optarg);
+               if (num_threads < 1) {
+                    LOG_FATAL("%s\n", "Number of threads has to be at least one");
+                    return 1;
+               }
+               break;
           case '?':
                LOG_FATAL("%s\n", "unrecognized arguments found. Exiting...\n");
                return 1;
@@ -434,14 +510,14 @@ int main_indelqual(int argc, char *argv[])
                LOG_FATAL("%s\n", "Can't insert both, uniform and dindel qualities");
                return -1;
           }
-          return add_uniform(bam_in, bam_out, uni_iq, uni_dq);
+          return add_uniform(bam_in, bam_out, uni_iq, uni_dq, num_threads);
 
      } else if (dindel) {
           if (! ref) {
                LOG_FATAL("%s\n", "Need reference for Dindel model");
                return -1;
           }
-          return add_dindel(bam_in, bam_out, ref);          
+          return add_dindel(bam_in, bam_out, ref, num_threads);          
 
      } else {
           LOG_FATAL("%s\n", "Please specify either dindel or uniform mode");
@@ -28,6 +28,12 @@
 #ifndef LOFREQ_INDELQUAL
 #define LOFREQ_INDELQUAL
 
+#include "sam.h"
+
 int main_indelqual(int argc, char *argv[]);
 
+int find_homopolymers(const char *query, int *count, int qlen);
+
+int dindel_add_quals(bam1_t *b, const int *hpcount, int rlen);
+
 #endif
@@ -2,8 +2,12 @@
 
 /* This is an almost one to one copy of the corresponding bits in samtools */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <getopt.h>
 
 /* samtools includes */
 #include "bam.h"
@@ -15,6 +19,9 @@ int bam_idxstats(int argc, char *argv[]);
 
 /* lofreq includes */
 #include "log.h"
+#include "utils.h"
+#include "refstore.h"
+#include "binplan.h"
 
 
 #if 1
@@ -27,14 +34,28 @@ int bam_idxstats(int argc, char *argv[]);
 int main_faidx(int argc, char *argv[]) 
 {
      char *fi; char *fa;
+     int ref_store = 0;
      
-     fa = argv[2];
+     if (argc == 4 && 0 == strcmp(argv[2], "--ref-store")) {
+          ref_store = 1;
+          fa = argv[3];
+     } else if (argc == 3) {
+          fa = argv[2];
+     } else {
+          fprintf(stderr, "Usage: %s faidx [--ref-store] ref.fa\n\n", MYNAME);
+          fprintf(stderr, "  --ref-store  Also build a memory-mapped reference store (ref.fa%s), which will\n", REFSTORE_EXT);
+          fprintf(stderr, "               be used instead of extracting sequences from the fasta file\n");
+          return 1;
+     }
      fi = samfaipath(fa);
      if (! fi) {
           return 1;
      }
-
      free(fi);
+
+     if (ref_store) {
+          return refstore_build(fa);
+     }
      return 0;
 }
 
@@ -50,3 +71,100 @@ main_idxstats(int argc, char *argv[])
 {
     return bam_idxstats(argc-1, argv+1);
 }
+
+
+static void
+usage_binplan(const int num_bins)
+{
+     fprintf(stderr, "%s binplan: Split BAM file into bins of about equal calling work, as estimated\n", MYNAME);
+     fprintf(stderr, "from its BAI index (or length if there is none). Bins are printed as BED plus work\n\n");
+     fprintf(stderr, "Usage: %s binplan [options] in.bam\n\n", MYNAME);
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -n | --num-bins INT  Number of bins to aim for. Small sequences give bins of their own [%d]\n", num_bins);
+}
+/* usage_binplan() */
+
+
+int
+main_binplan(int argc, char *argv[])
+{
+     int num_bins = 16;
+     const char *bam_file;
+     htsFile *fp;
+     bam_header_t *h;
+     binplan_t *plan;
+     double total_work = 0.0;
+     double bin_work;
+     int tid;
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+               {"num-bins", required_argument, NULL, 'n'},
+               {"help", no_argument, NULL, 'h'},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          static const char *long_opts_str = "n:h";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'n':
+               num_bins = atoi(optarg);
+               break;
+          case 'h':
+               usage_binplan(num_bins);
+               return 0;
+          default:
+               usage_binplan(num_bins);
+               return 1;
+          }
+     }
+     if (1 != argc - optind - 1) {
+          usage_binplan(num_bins);
+          return 1;
+     }
+     if (num_bins < 1) {
+          LOG_FATAL("%s\n", "Number of bins has to be >= 1");
+          return 1;
+     }
+     bam_file = argv[optind+1];
+
+     if (NULL == (fp = hts_open(bam_file, "r"))) {
+          LOG_FATAL("Couldn't open %s\n", bam_file);
+          return 1;
+     }
+     if (NULL == (h = sam_hdr_read(fp))) {
+          LOG_FATAL("Couldn't read header of %s\n", bam_file);
+          hts_close(fp);
+          return 1;
+     }
+     hts_close(fp);
+
+     plan = binplan_load(bam_file, h);
+     for (tid=0; tid<h->n_targets; tid++) {
+          total_work += binplan_work(plan, tid, 0, h->target_len[tid]);
+     }
+     bin_work = total_work/num_bins;
+     for (tid=0; tid<h->n_targets; tid++) {
+          int beg = 0;
+          /* sequences without reads don't need calling */
+          if (plan->from_index && binplan_work(plan, tid, 0, h->target_len[tid]) <= 0.0) {
+               continue;
+          }
+          while (beg < (int) h->target_len[tid]) {
+               int end = binplan_next_cut(plan, tid, beg, h->target_len[tid], bin_work);
+               printf("%s\t%d\t%d\t%.0f\n", h->target_name[tid], beg, end,
+                      binplan_work(plan, tid, beg, end));
+               beg = end;
+          }
+     }
+
+     binplan_free(plan);
+     bam_header_destroy(h);
+     return 0;
+}
+/* main_binplan() */
@@ -4,5 +4,6 @@
 int main_faidx(int argc, char *argv[]);
 int main_index(int argc, char *argv[]);
 int main_idxstats(int argc, char *argv[]);
+int main_binplan(int argc, char *argv[]);
 
 #endif
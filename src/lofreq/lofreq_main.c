@@ -36,17 +36,19 @@
 /* lofreq includes */
 #include "log.h"
 #include "utils.h"
-#ifdef USE_ALNERRPROF
 #include "lofreq_bamstats.h"
-#endif
 #include "lofreq_alnqual.h"
 #include "lofreq_checkref.h"
 #include "lofreq_filter.h"
 #include "lofreq_index.h"
 #include "lofreq_indelqual.h"
+#include "lofreq_prep.h"
+#include "lofreq_somatic.h"
 #include "lofreq_call.h"
 #include "lofreq_uniq.h"
 #include "lofreq_vcfset.h"
+#include "lofreq_merge.h"
+#include "lofreq_statsmerge.h"
 #include "lofreq_viterbi.h"
 
 #ifndef __DATE__
@@ -146,6 +148,19 @@ add_local_dir_to_path(char *argv0) {
 
 
 
+/* returns 1 if arg is one of the command's (i.e. argv[2] onwards) arguments */
+static int has_arg(int argc, char *argv[], const char *arg)
+{
+     int i;
+     for (i=2; i<argc; i++) {
+          if (0 == strcmp(argv[i], arg)) {
+               return 1;
+          }
+     }
+     return 0;
+}
+
+
 static void usage(const char *myname)
 {
 
@@ -164,21 +179,23 @@ static void usage(const char *myname)
      fprintf(stderr, "  Main Commands:\n");
      fprintf(stderr, "    call          : Call variants\n");
      fprintf(stderr, "    call-parallel : Call variants in parallel\n");
-     fprintf(stderr, "    somatic       : Call somatic variants\n");
+     fprintf(stderr, "    somatic       : Call somatic variants (--one-pass for single pass mode)\n");
+     fprintf(stderr, "    serve         : Call variants on queries read from stdin, keeping BAM and reference loaded\n");
+     fprintf(stderr, "    merge         : Merge calls on different regions (see call --manifest) and correct for all tests\n");
+     fprintf(stderr, "    stats-merge   : Merge pileup stats of different reads (see call --stats-out) for re-calling\n");
      fprintf(stderr, "\n");
      fprintf(stderr, "  Preprocessing Commands\n");
      fprintf(stderr, "    viterbi       : Viterbi realignment\n");
      fprintf(stderr, "    indelqual     : Insert indel qualities\n");
      fprintf(stderr, "    alnqual       : Insert base and indel alignment qualities\n");
+     fprintf(stderr, "    prep          : viterbi, indelqual (Dindel) and alnqual in one pass\n");
      fprintf(stderr, "\n");
      fprintf(stderr, "  Other Commands:\n");
      fprintf(stderr, "    checkref      : Check that reference fasta and BAM file match\n");
      fprintf(stderr, "    filter        : Filter variants in VCF file\n");
      fprintf(stderr, "    uniq          : Test whether variants predicted in only one sample really are unique\n");
      fprintf(stderr, "    plpsummary    : Print pileup summary per position\n");
-#ifdef USE_ALNERRPROF
      fprintf(stderr, "    bamstats      : Collect BAM statistics\n");
-#endif
      fprintf(stderr, "    vcfset        : VCF set operations\n");
 
      fprintf(stderr, "    version       : Print version info\n");
@@ -187,6 +204,7 @@ static void usage(const char *myname)
      fprintf(stderr, "    faidx         : Create index for fasta file\n");
      fprintf(stderr, "    index         : Create index for BAM file\n");
      fprintf(stderr, "    idxstats      : Print stats for indexed BAM file\n");
+     fprintf(stderr, "    binplan       : Split indexed BAM file into bins of equal calling work\n");
      fprintf(stderr, "\n");
      fprintf(stderr, "  Extra Tools (if installed):\n");
      fprintf(stderr, "    vcfplot       : Plot VCF statistics\n");
@@ -209,12 +227,21 @@ int main(int argc, char *argv[])
      if (strcmp(argv[1], "call") == 0)  {
           return main_call(argc, argv);
 
+     } else if (strcmp(argv[1], "serve") == 0)  {
+          return main_call(argc, argv);
+
      } else if (strcmp(argv[1], "uniq") == 0)  {
           return main_uniq(argc, argv);
 
      } else if (strcmp(argv[1], "vcfset") == 0)  {
           return main_vcfset(argc, argv);
 
+     } else if (strcmp(argv[1], "merge") == 0)  {
+          return main_merge(argc, argv);
+
+     } else if (strcmp(argv[1], "stats-merge") == 0)  {
+          return main_statsmerge(argc, argv);
+
      } else if (strcmp(argv[1], "viterbi") == 0){
           return main_viterbi(argc,argv);
 
@@ -224,12 +251,18 @@ int main(int argc, char *argv[])
      } else if (strcmp(argv[1], "index") == 0)  {
           return main_index(argc, argv);
 
+     } else if (strcmp(argv[1], "binplan") == 0)  {
+          return main_binplan(argc, argv);
+
      } else if (strcmp(argv[1], "indelqual") == 0){
           return main_indelqual(argc, argv);
 
      } else if (strcmp(argv[1], "alnqual") == 0)  {
           return main_alnqual(argc-1, argv+1);
 
+     } else if (strcmp(argv[1], "prep") == 0)  {
+          return main_prep(argc, argv);
+
      } else if (strcmp(argv[1], "idxstats") == 0)  {
           return main_idxstats(argc, argv);
 
@@ -247,6 +280,9 @@ int main(int argc, char *argv[])
      } else if (strcmp(argv[1], "filter") == 0) {
           return main_filter(argc, argv);
 
+     } else if (strcmp(argv[1], "somatic") == 0 && has_arg(argc, argv, "--one-pass")) {
+          return main_somatic(argc, argv);
+
      } else if (strcmp(argv[1], "somatic") == 0 ||
                 strcmp(argv[1], "vcfplot") == 0 ||
                 strcmp(argv[1], "call-parallel") == 0) {
@@ -287,10 +323,8 @@ int main(int argc, char *argv[])
                free(argv_execvp);
                return 0;
           }
-#ifdef USE_ALNERRPROF
      } else if (strcmp(argv[1], "bamstats") == 0) {
           return main_bamstats(argc, argv);
-#endif
      } else if (strcmp(argv[1], "plpsummary") == 0) {
           /* modify args to  main_call() */
           char **argv_tmp = calloc(argc+1, sizeof(char*));
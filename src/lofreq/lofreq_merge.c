@@ -0,0 +1,419 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* lofreq merge: combines shards of a job called by region (see
+ * shard.h). shard VCFs are merged in one streaming pass in BAM header
+ * order and the multiple testing correction of the whole job is
+ * applied, i.e. no separate lofreq filter run is needed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <limits.h>
+
+/* lofreq includes */
+#include "lofreq_merge.h"
+#include "shard.h"
+#include "vcf.h"
+#include "log.h"
+#include "utils.h"
+#include "defaults.h"
+
+
+#if 1
+#define MYNAME "lofreq merge"
+#else
+#define MYNAME PACKAGE
+#endif
+
+
+/* one input shard and its current record */
+typedef struct {
+     const char *manifest_path;
+     shard_manifest_t manifest;
+     char vcf_path[PATH_MAX];
+     vcf_file_t vcf;
+     vcf_rec_t rec;
+     int has_rec; /* 0 after EOF */
+     int rank; /* of rec.var.chrom in BAM header */
+} merge_shard_t;
+
+/* sequence name with rank, for looking up sort order */
+typedef struct {
+     const char *name;
+     int rank;
+} merge_seq_t;
+
+
+static void
+usage(void)
+{
+     fprintf(stderr, "%s: Merge VCF files of calls on different regions (shards) of one job\n\n", MYNAME);
+     fprintf(stderr, "Usage: %s [options] shard1.manifest [shard2.manifest ...]\n\n", MYNAME);
+     fprintf(stderr, "Shards are calls made with 'lofreq call --manifest'. Their VCF files are merged in BAM header order\n");
+     fprintf(stderr, "and the Bonferroni correction of the whole job, as given by the number of tests of all shards, is applied\n");
+     fprintf(stderr, "(unless a fixed Bonferroni factor was used). Records not passing it are dropped.\n\n");
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -o | --out FILE  Output VCF file (gzip supported) [- = stdout]\n");
+     fprintf(stderr, "       --no-mtc    Only merge, keeping all records (e.g. for running 'lofreq filter' with defaults afterwards)\n");
+}
+/* usage() */
+
+
+static int
+merge_seq_cmp(const void *a, const void *b)
+{
+     return strcmp(((const merge_seq_t *) a)->name, ((const merge_seq_t *) b)->name);
+}
+/* merge_seq_cmp() */
+
+
+/* -1 if unknown */
+static int
+merge_seq_rank(const merge_seq_t *seqs, const int num_seqs, const char *name)
+{
+     merge_seq_t key;
+     const merge_seq_t *hit;
+
+     key.name = name;
+     hit = bsearch(& key, seqs, num_seqs, sizeof(merge_seq_t), merge_seq_cmp);
+     return hit ? hit->rank : -1;
+}
+/* merge_seq_rank() */
+
+
+/* reads next record of s. returns non-zero on error, i.e. unknown
+ * sequence or unsorted input */
+static int
+merge_shard_next(merge_shard_t *s, const merge_seq_t *seqs, const int num_seqs)
+{
+     int prev_rank = s->rank;
+     long int prev_pos = s->has_rec ? s->rec.var.pos : -1;
+
+     if (0 != vcf_rec_parse(& s->vcf, & s->rec)) {
+          s->has_rec = 0;
+          return 0;
+     }
+     /* binary search is cheap compared to parsing */
+     s->rank = merge_seq_rank(seqs, num_seqs, s->rec.var.chrom);
+     if (s->rank < 0) {
+          LOG_ERROR("Sequence %s of %s not in BAM header of shard\n", s->rec.var.chrom, s->vcf_path);
+          return 1;
+     }
+     if (s->has_rec && (s->rank < prev_rank || (s->rank == prev_rank && s->rec.var.pos < prev_pos))) {
+          LOG_ERROR("%s is not sorted (at %s:%ld)\n", s->vcf_path, s->rec.var.chrom, s->rec.var.pos+1);
+          return 1;
+     }
+     s->has_rec = 1;
+     return 0;
+}
+/* merge_shard_next() */
+
+
+/* finds the shard VCF: as recorded or, if moved along with the
+ * manifest (e.g. copied from another node), next to the manifest.
+ * returns non-zero if not found or if checksum doesn't match */
+static int
+merge_shard_find_vcf(merge_shard_t *s)
+{
+     const shard_manifest_t *m = & s->manifest;
+     char buf[PATH_MAX];
+
+     snprintf(s->vcf_path, PATH_MAX, "%s", m->vcf);
+     if (! file_exists(s->vcf_path)) {
+          char *vcf_copy = strdup(m->vcf);
+          strncpy(buf, s->manifest_path, PATH_MAX-1);
+          buf[PATH_MAX-1] = '\0';
+          snprintf(s->vcf_path, PATH_MAX, "%s/%s", dirname(buf), basename(vcf_copy));
+          free(vcf_copy);
+          if (! file_exists(s->vcf_path)) {
+               LOG_ERROR("VCF file %s of shard %s not found\n", m->vcf, s->manifest_path);
+               return 1;
+          }
+     }
+     if (shard_file_checksum(s->vcf_path) != m->vcf_checksum) {
+          LOG_ERROR("Checksum of %s doesn't match the one in shard manifest %s\n",
+                    s->vcf_path, s->manifest_path);
+          return 1;
+     }
+     return 0;
+}
+/* merge_shard_find_vcf() */
+
+
+int
+main_merge(int argc, char *argv[])
+{
+     char *vcf_out = NULL;
+     vcf_file_t vcf_out_fh;
+     merge_shard_t *shards = NULL;
+     int num_shards;
+     merge_seq_t *seqs = NULL;
+     const shard_manifest_t *m0;
+     long long int bonf_subst = 0, bonf_indel = 0;
+     long long int num_snv_tests = 0, num_indel_tests = 0;
+     int snvqual_thresh = 0, indelqual_thresh = 0;
+     long int num_in = 0, num_out = 0;
+     char *header = NULL;
+     char header_line[1024];
+     int i, j;
+     int rc = 0;
+     static int no_mtc = 0;
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+               {"out", required_argument, NULL, 'o'},
+               {"no-mtc", no_argument, &no_mtc, 1},
+               {"help", no_argument, NULL, 'h'},
+               {"verbose", no_argument, &verbose, 1},
+               {"debug", no_argument, &debug, 1},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          static const char *long_opts_str = "o:h";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'o':
+               if (0 != strcmp(optarg, "-")) {
+                    if (file_exists(optarg)) {
+                         LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                         return 1;
+                    }
+               }
+               vcf_out = strdup(optarg);
+               break;
+          case 'h':
+               usage();
+               return 0;
+          case '?':
+               LOG_FATAL("%s\n", "Unrecognized arguments found. Exiting...\n");
+               return 1;
+          default:
+               break;
+          }
+     }
+     num_shards = argc - optind - 1;
+     if (num_shards < 1) {
+          usage();
+          return 1;
+     }
+     if (NULL == vcf_out) {
+          vcf_out = strdup("-");
+     }
+
+     if (NULL == (shards = calloc(num_shards, sizeof(merge_shard_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     /* read and check manifests before touching any VCF file
+      */
+     for (i=0; i<num_shards; i++) {
+          merge_shard_t *s = & shards[i];
+          const shard_manifest_t *m;
+
+          s->manifest_path = argv[optind+1+i];
+          if (shard_manifest_read(s->manifest_path, & s->manifest)) {
+               num_shards = i;
+               rc = 1;
+               goto free_and_exit;
+          }
+          m = & s->manifest;
+          m0 = & shards[0].manifest;
+          if (i) {
+               int same = (m->params_checksum == m0->params_checksum
+                           && m->bonf == m0->bonf && m->sig == m0->sig
+                           && m->num_seqs == m0->num_seqs);
+               for (j=0; same && j<m->num_seqs; j++) {
+                    same = (0 == strcmp(m->seqs[j], m0->seqs[j]));
+               }
+               if (! same) {
+                    LOG_ERROR("Shard %s was called on a different BAM file or reference, or with different"
+                              " parameters than %s\n", s->manifest_path, shards[0].manifest_path);
+                    num_shards = i+1;
+                    rc = 1;
+                    goto free_and_exit;
+               }
+          }
+          bonf_subst += m->bonf_subst;
+          bonf_indel += m->bonf_indel;
+          num_snv_tests += m->num_snv_tests;
+          num_indel_tests += m->num_indel_tests;
+          LOG_DEBUG("Shard %s: region %s, %lld substitution and %lld indel tests\n",
+                    s->manifest_path, m->region, m->num_snv_tests, m->num_indel_tests);
+     }
+     m0 = & shards[0].manifest;
+     for (i=0; i<num_shards; i++) {
+          if (merge_shard_find_vcf(& shards[i])) {
+               rc = 1;
+               goto free_and_exit;
+          }
+     }
+
+     /* same as default_filter() in lofreq call and the final filter
+      * step of lofreq2_call_pparallel.py, but for all shards
+      */
+     if (SHARD_BONF_DYNAMIC == m0->bonf) {
+          bonf_subst = MAX(1, num_snv_tests);
+          bonf_indel = MAX(1, num_indel_tests);
+     }
+     if (no_mtc) {
+          LOG_VERBOSE("%s\n", "Not applying multiple testing correction as requested");
+     } else if (SHARD_BONF_FIXED != m0->bonf) {
+          snvqual_thresh = MAX(0, PROB_TO_PHREDQUAL(m0->sig/MAX(1, bonf_subst)));
+          indelqual_thresh = MAX(0, PROB_TO_PHREDQUAL(m0->sig/MAX(1, bonf_indel)));
+          LOG_VERBOSE("Bonferroni factors for all %d shards are %lld (substitutions) and %lld (indels),"
+                      " i.e. quality thresholds %d and %d\n", num_shards, bonf_subst, bonf_indel,
+                      snvqual_thresh, indelqual_thresh);
+     } else {
+          LOG_VERBOSE("%s\n", "Fixed Bonferroni factor was already applied by shards");
+     }
+
+     if (NULL == (seqs = malloc(m0->num_seqs * sizeof(merge_seq_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<m0->num_seqs; i++) {
+          seqs[i].name = m0->seqs[i];
+          seqs[i].rank = i;
+     }
+     qsort(seqs, m0->num_seqs, sizeof(merge_seq_t), merge_seq_cmp);
+
+     /* open all shards. header is taken from the first one
+      */
+     for (i=0; i<num_shards; i++) {
+          merge_shard_t *s = & shards[i];
+          char *shard_header = NULL;
+
+          if (vcf_file_open(& s->vcf, s->vcf_path, HAS_GZIP_EXT(s->vcf_path), 'r')) {
+               LOG_ERROR("Couldn't open %s\n", s->vcf_path);
+               num_shards = i;
+               rc = 1;
+               goto free_and_exit;
+          }
+          vcf_rec_init(& s->rec);
+          if (0 != vcf_parse_header(& shard_header, & s->vcf)) {
+               LOG_ERROR("Couldn't parse header of %s\n", s->vcf_path);
+               free(shard_header);
+               num_shards = i+1;
+               rc = 1;
+               goto free_and_exit;
+          }
+          if (i) {
+               free(shard_header);
+          } else {
+               header = shard_header;
+          }
+          if (merge_shard_next(s, seqs, m0->num_seqs)) {
+               num_shards = i+1;
+               rc = 1;
+               goto free_and_exit;
+          }
+     }
+
+     if (vcf_file_open(& vcf_out_fh, vcf_out, HAS_GZIP_EXT(vcf_out), 'w')) {
+          LOG_ERROR("Couldn't open %s\n", vcf_out);
+          rc = 1;
+          goto free_and_exit;
+     }
+     snprintf(header_line, sizeof(header_line),
+              "##lofreq_merge=<shards=%d,num_snv_tests=%lld,num_indel_tests=%lld,snvqual_thresh=%d,indelqual_thresh=%d>\n",
+              num_shards, num_snv_tests, num_indel_tests, snvqual_thresh, indelqual_thresh);
+     vcf_header_add(& header, header_line);
+     vcf_write_header(& vcf_out_fh, header);
+
+     /* k-way merge. ties go to the shard given first, so that output
+      * only depends on the order of arguments
+      */
+     while (0 == rc) {
+          merge_shard_t *min = NULL;
+          var_t *var;
+
+          for (i=0; i<num_shards; i++) {
+               merge_shard_t *s = & shards[i];
+               if (! s->has_rec) {
+                    continue;
+               }
+               if (! min || s->rank < min->rank
+                   || (s->rank == min->rank && s->rec.var.pos < min->rec.var.pos)) {
+                    min = s;
+               }
+          }
+          if (! min) {
+               break;
+          }
+
+          var = & min->rec.var;
+          num_in += 1;
+          if (var->qual < 0 || var->qual >= (vcf_var_is_indel(var) ? indelqual_thresh : snvqual_thresh)) {
+               vcf_write_var(& vcf_out_fh, var);
+               num_out += 1;
+          }
+          rc = merge_shard_next(min, seqs, m0->num_seqs);
+     }
+     if (vcf_file_close(& vcf_out_fh)) {
+          LOG_ERROR("Couldn't write %s\n", vcf_out);
+          rc = 1;
+     }
+     LOG_VERBOSE("Merged %ld records of %d shards. %ld passed\n", num_in, num_shards, num_out);
+
+     if (0 == rc) {
+          /* same as lofreq call. parsed by downstream scripts */
+          int org_verbose = verbose;
+          verbose = 1;
+          LOG_VERBOSE("Number of substitution tests performed: %lld\n", num_snv_tests);
+          LOG_VERBOSE("Number of indel tests performed: %lld\n", num_indel_tests);
+          verbose = org_verbose;
+     }
+
+free_and_exit:
+     for (i=0; i<num_shards; i++) {
+          if (shards[i].vcf.path) {
+               vcf_file_close(& shards[i].vcf);
+               vcf_rec_free(& shards[i].rec);
+          }
+          shard_manifest_free(& shards[i].manifest);
+     }
+     free(shards);
+     free(seqs);
+     free(header);
+     free(vcf_out);
+     return rc;
+}
+/* main_merge() */
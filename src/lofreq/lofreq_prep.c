@@ -0,0 +1,441 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Single pass version of the standard preprocessing chain
+ * viterbi | indelqual --dindel | alnqual. Each read is decoded and
+ * encoded only once and all stages share the reference sequence and
+ * homopolymer counts of the current target.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htslib/faidx.h"
+#include "sam.h"
+
+#include "log.h"
+#include "utils.h"
+#include "refcache.h"
+#include "bampipe.h"
+#include "bam_md_ext.h"
+#include "viterbi.h"
+#include "lofreq_viterbi.h"
+#include "lofreq_indelqual.h"
+#include "lofreq_prep.h"
+
+
+#define MYNAME "lofreq prep"
+
+
+/* homopolymer counts per target, computed on first use and shared
+ * between threads. freed once no thread uses them anymore */
+typedef struct {
+     pthread_mutex_t lock;
+     int n;
+     int **hp;
+     int *users;
+} hp_cache_t;
+
+
+typedef struct {
+     int del_flag;
+     int q2def;
+     int viterbi;
+     int dindel;
+     int baq_flag;
+     int ext_baq;
+     int idaq_flag;
+} prep_conf_t;
+
+
+/* per thread data for prep_func() */
+typedef struct {
+     const prep_conf_t *conf;
+     refcache_t *refcache; /* shared */
+     hp_cache_t *hp_cache; /* shared */
+     bam_header_t *header;
+     int tid;
+     const char *ref; /* acquired from refcache */
+     int reflen;
+     const int *hp; /* acquired from hp_cache */
+     viterbi_ws_t vws;
+     kpa_ext_ws_t kws;
+} prep_data_t;
+
+
+static void
+hp_cache_init(hp_cache_t *c, int n)
+{
+     pthread_mutex_init(& c->lock, NULL);
+     c->n = n;
+     c->hp = calloc(n, sizeof(int *));
+     c->users = calloc(n, sizeof(int));
+     if (! c->hp || ! c->users) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+}
+
+
+static void
+hp_cache_free(hp_cache_t *c)
+{
+     int i;
+     for (i = 0; i < c->n; i++) {
+          free(c->hp[i]);
+     }
+     free(c->hp);
+     free(c->users);
+     pthread_mutex_destroy(& c->lock);
+}
+
+
+static const int *
+hp_cache_get(hp_cache_t *c, int tid, const char *ref, int reflen)
+{
+     const int *hp;
+     pthread_mutex_lock(& c->lock);
+     if (! c->hp[tid]) {
+          if (NULL == (c->hp[tid] = malloc(reflen * sizeof(int)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          find_homopolymers(ref, c->hp[tid], reflen);
+     }
+     c->users[tid] += 1;
+     hp = c->hp[tid];
+     pthread_mutex_unlock(& c->lock);
+     return hp;
+}
+
+
+static void
+hp_cache_release(hp_cache_t *c, int tid)
+{
+     pthread_mutex_lock(& c->lock);
+     c->users[tid] -= 1;
+     if (c->users[tid] == 0) {
+          free(c->hp[tid]);
+          c->hp[tid] = NULL;
+     }
+     pthread_mutex_unlock(& c->lock);
+}
+
+
+/* releases current target (if any) and acquires tid's reference and
+ * homopolymer counts. returns non-zero on error */
+static int
+prep_set_target(prep_data_t *d, int tid)
+{
+     if (d->tid >= 0) {
+          if (d->hp) {
+               hp_cache_release(d->hp_cache, d->tid);
+          }
+          refcache_release(d->refcache, d->header->target_name[d->tid]);
+     }
+     d->tid = tid;
+     d->hp = NULL;
+     if (NULL == (d->ref = refcache_get(d->refcache, d->header->target_name[tid], & d->reflen))) {
+          LOG_FATAL("Couldn't fetch sequence '%s'\n", d->header->target_name[tid]);
+          d->tid = -1;
+          return 1;
+     }
+     if (d->conf->dindel) {
+          d->hp = hp_cache_get(d->hp_cache, tid, d->ref, d->reflen);
+     }
+     return 0;
+}
+
+
+/* bampipe_func_t running all enabled stages on one read in the order
+ * of the original pipeline */
+static int
+prep_func(bam1_t *b, void *data)
+{
+     prep_data_t *d = (prep_data_t *)data;
+     const prep_conf_t *conf = d->conf;
+     bam1_core_t *c = &b->core;
+
+     if (c->tid >= 0 && c->tid != d->tid) {
+          if (prep_set_target(d, c->tid)) {
+               return 1;
+          }
+     }
+
+     /* lofreq viterbi */
+     if (conf->viterbi && (c->tid >= 0 || (c->flag & BAM_FUNMAP))) {
+          viterbi_realn_read(b, ! (c->flag & BAM_FUNMAP) && viterbi_needs_realn(b),
+                             d->ref, d->reflen, d->header, & d->vws,
+                             conf->del_flag, conf->q2def, 0);
+     }
+
+     /* lofreq indelqual --dindel */
+     if (conf->dindel && ! (c->flag & BAM_DEF_MASK)) {
+          dindel_add_quals(b, d->hp, d->reflen);
+     }
+
+     /* lofreq alnqual */
+     if ((conf->baq_flag || conf->idaq_flag) && c->tid >= 0) {
+          bam_prob_realn_core_ext(b, d->ref, conf->baq_flag, conf->ext_baq,
+                                  conf->idaq_flag, & d->kws);
+     }
+     return 0;
+}
+
+
+static void
+usage(void)
+{
+     fprintf(stderr, "%s: Viterbi realignment, Dindel indel qualities and alignment qualities (BAQ, IDAQ) in one pass\n\n", MYNAME);
+     fprintf(stderr, "Usage: %s [options] in.bam\n", MYNAME);
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -f | --ref FILE       Indexed reference fasta file (mandatory)\n");
+     fprintf(stderr, "  -o | --out FILE       Output BAM file [- = stdout = default]\n");
+     fprintf(stderr, "  -k | --keepflags      Don't delete flags MC, MD, NM and AS during realignment\n");
+     fprintf(stderr, "  -q | --defqual INT    Assume INT as quality for all bases with BQ2 during realignment.\n");
+     fprintf(stderr, "                        Default (=-1) is to use median quality of bases in read.\n");
+     fprintf(stderr, "       --no-viterbi     Skip Viterbi realignment\n");
+     fprintf(stderr, "       --no-dindel      Skip insertion of Dindel's indel qualities\n");
+     fprintf(stderr, "  -B | --no-baq         Don't compute base alignment qualities\n");
+     fprintf(stderr, "  -A | --no-idaq        Don't compute indel alignment qualities\n");
+     fprintf(stderr, "  -e | --no-ext-baq     Use default instead of extended BAQ\n");
+     fprintf(stderr, "       --threads INT    Number of threads for processing and compression [1]\n");
+     fprintf(stderr, "       --verbose        Be verbose\n");
+     fprintf(stderr, "\n");
+     fprintf(stderr, "Same as 'lofreq viterbi | lofreq indelqual --dindel | lofreq alnqual -b -r'.\n");
+     fprintf(stderr, "Existing indel and alignment qualities will be overwritten.\n");
+     fprintf(stderr, "NOTE: Output BAM file will (likely) be unsorted (use samtools sort, e.g. lofreq prep ... | samtools sort -')\n");
+}
+
+
+int main_prep(int argc, char *argv[])
+{
+     prep_conf_t conf;
+     char *ref_fa = NULL;
+     char *bam_out = NULL;
+     char *bam_in;
+     static int no_viterbi = 0;
+     static int no_dindel = 0;
+     int num_threads = 1;
+     samfile_t *in;
+     bamFile out;
+     faidx_t *fai;
+     refcache_t *refcache;
+     hp_cache_t hp_cache;
+     prep_data_t *wdata;
+     void **wdata_ptrs;
+     long int count;
+     int rc = 0;
+     int i;
+
+     memset(& conf, 0, sizeof(prep_conf_t));
+     conf.del_flag = 1;
+     conf.q2def = -1;
+     conf.baq_flag = 2; /* recompute: alignments might have changed */
+     conf.ext_baq = 1;
+     conf.idaq_flag = 2;
+
+     if (argc == 2) {
+          usage();
+          return 1;
+     }
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+               /* see usage sync */
+               {"help", no_argument, NULL, 'h'},
+               {"verbose", no_argument, &verbose, 1},
+               {"debug", no_argument, &debug, 1},
+               {"ref", required_argument, NULL, 'f'},
+               {"out", required_argument, NULL, 'o'},
+               {"keepflags", no_argument, NULL, 'k'},
+               {"defqual", required_argument, NULL, 'q'},
+               {"no-viterbi", no_argument, &no_viterbi, 1},
+               {"no-dindel", no_argument, &no_dindel, 1},
+               {"no-baq", no_argument, NULL, 'B'},
+               {"no-idaq", no_argument, NULL, 'A'},
+               {"no-ext-baq", no_argument, NULL, 'e'},
+               {"threads", required_argument, NULL, 't'}, /* long only */
+               {0, 0, 0, 0} /* sentinel */
+          };
+          /* keep in sync with long_opts and usage */
+          static const char *long_opts_str = "hf:o:kq:BAe";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, /* skipping 'lofreq', just leaving 'command', i.e. call */
+                          long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'h':
+               usage();
+               return 0;
+          case 'f':
+               if (! file_exists(optarg)) {
+                    LOG_FATAL("Reference fasta file '%s' does not exist. Exiting...\n", optarg);
+                    return 1;
+               }
+               ref_fa = strdup(optarg);
+               break;
+          case 'o':
+               if (0 != strcmp(optarg, "-")) {
+                    if (file_exists(optarg)) {
+                         LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                         return 1;
+                    }
+               }
+               bam_out = strdup(optarg);
+               break;
+          case 'k':
+               conf.del_flag = 0;
+               break;
+          case 'q':
+               conf.q2def = atoi(optarg);
+               break;
+          case 'B':
+               conf.baq_flag = 0;
+               break;
+          case 'A':
+               conf.idaq_flag = 0;
+               break;
+          case 'e':
+               conf.ext_baq = 0;
+               break;
+          case 't':
+               num_threads = atoi(optarg);
+               if (num_threads < 1) {
+                    LOG_FATAL("%s\n", "Number of threads has to be at least one");
+                    return 1;
+               }
+               break;
+          case '?':
+               LOG_FATAL("%s\n", "unrecognized arguments found. Exiting...\n");
+               return 1;
+          default:
+               break;
+          }
+     }
+     conf.viterbi = ! no_viterbi;
+     conf.dindel = ! no_dindel;
+
+     if (! ref_fa) {
+          LOG_FATAL("%s\n", "Need reference fasta file");
+          usage();
+          return 1;
+     }
+     if (1 != argc - optind - 1) {
+          LOG_FATAL("%s\n", "Need exactly one BAM file as last argument");
+          usage();
+          return 1;
+     }
+     bam_in = (argv + optind + 1)[0];
+     if ((0 != strcmp(bam_in, "-")) && ! file_exists(bam_in)) {
+          LOG_FATAL("BAM file %s does not exist. Exiting...\n", bam_in);
+          return 1;
+     }
+     if (! conf.viterbi && ! conf.dindel && ! conf.baq_flag && ! conf.idaq_flag) {
+          LOG_FATAL("%s\n", "Nothing to do: all stages switched off");
+          return 1;
+     }
+
+     if (NULL == (fai = fai_load(ref_fa))) {
+          LOG_FATAL("Failed to load index for reference file %s\n", ref_fa);
+          return 1;
+     }
+     if ((in = samopen(bam_in, "rb", 0)) == 0) {
+          LOG_FATAL("Failed to open BAM file %s\n", bam_in);
+          return 1;
+     }
+     if (!bam_out || bam_out[0] == '-') {
+          out = bam_dopen(fileno(stdout), "w");
+     } else {
+          out = bam_open(bam_out, "w");
+     }
+     if (num_threads > 1 && bgzf_mt(out, num_threads, 256)) {
+          LOG_WARN("%s\n", "Couldn't enable multi-threaded compression");
+     }
+     bam_header_write(out, in->header);
+
+     refcache = refcache_new(fai, REFCACHE_DEFAULT_MAX_BYTES);
+     refcache_open_store(refcache, ref_fa);
+     hp_cache_init(& hp_cache, in->header->n_targets);
+     wdata = calloc(num_threads, sizeof(prep_data_t));
+     wdata_ptrs = malloc(num_threads * sizeof(void *));
+     if (! wdata || ! wdata_ptrs) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i = 0; i < num_threads; i++) {
+          wdata[i].conf = & conf;
+          wdata[i].refcache = refcache;
+          wdata[i].hp_cache = & hp_cache;
+          wdata[i].header = in->header;
+          wdata[i].tid = -1;
+          viterbi_ws_init(& wdata[i].vws);
+          kpa_ext_ws_init(& wdata[i].kws);
+          wdata_ptrs[i] = & wdata[i];
+     }
+
+     count = bampipe_run(in, bampipe_write_bam, out, prep_func, wdata_ptrs, num_threads);
+     if (count < 0) {
+          LOG_ERROR("%s\n", "Preprocessing failed");
+          rc = 1;
+     } else {
+          LOG_VERBOSE("Processed %ld reads\n", count);
+     }
+
+     for (i = 0; i < num_threads; i++) {
+          if (wdata[i].tid >= 0) {
+               if (wdata[i].hp) {
+                    hp_cache_release(& hp_cache, wdata[i].tid);
+               }
+               refcache_release(refcache, in->header->target_name[wdata[i].tid]);
+          }
+          viterbi_ws_free(& wdata[i].vws);
+          kpa_ext_ws_free(& wdata[i].kws);
+     }
+     free(wdata);
+     free(wdata_ptrs);
+     hp_cache_free(& hp_cache);
+     refcache_free(refcache);
+     samclose(in);
+     bam_close(out);
+     fai_destroy(fai);
+     free(ref_fa);
+     free(bam_out);
+     return rc;
+}
+/* main_prep() */
@@ -0,0 +1,798 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Single pass tumor/normal somatic caller. Same logic as the
+ * multi-stage lofreq2_somatic.py (relaxed calls in tumor and normal,
+ * stringent filtering of tumor calls, removal of calls present in
+ * normal and finally the uniq test against the normal), but both BAM
+ * files are piled up in lockstep by mpileup_multi() and calls are
+ * handed over as var_t (see varcall_conf_t.var_emit), i.e. nothing
+ * is written or parsed in between. The normal is only tested at
+ * positions where the tumor has a (relaxed) call. It is piled up
+ * twice, once with the settings of the relaxed normal calls and once
+ * with those of lofreq uniq.
+ *
+ * Tumor calls are kept as multiple testing qualities only. Variants
+ * themselves are only kept if they can still pass the tumor filter
+ * (using the number of tests performed so far) and are not present in
+ * the normal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+#include "htslib/faidx.h"
+
+#include "log.h"
+#include "utils.h"
+#include "vcf.h"
+#include "plp.h"
+#include "snpcaller.h"
+#include "multtest.h"
+#include "defaults.h"
+#include "lofreq_call.h"
+#include "lofreq_filter.h"
+#include "lofreq_uniq.h"
+#include "lofreq_somatic.h"
+
+
+/* from bedidx.c */
+void *bed_read(const char *fn);
+void bed_destroy(void *_h);
+
+
+#define MYNAME "lofreq somatic"
+
+/* defaults as in lofreq2_somatic.py */
+#define SOMATIC_DEFAULT_ALPHA_N 0.10
+#define SOMATIC_DEFAULT_ALPHA_T 0.01
+#define SOMATIC_DEFAULT_MIN_COV 7
+#define SOMATIC_DEFAULT_MAX_COV 100000
+#define SOMATIC_DEFAULT_MTC_ALPHA_T 1.0
+#define SOMATIC_DEFAULT_INDEL_MTC_ALPHA_T 0.01
+#define SOMATIC_DEFAULT_SB_MTC_ALPHA 0.001
+#define SOMATIC_DEFAULT_SNV_UNIQ_MTC_ALPHA 0.001
+#define SOMATIC_DEFAULT_INDEL_UNIQ_MTC_ALPHA 0.0001
+#define SOMATIC_UNI_FREQ 0.5
+
+#define VCF_SOMATIC_FINAL_EXT "somatic_final.snvs.vcf.gz"
+#define VCF_INDELS_SOMATIC_FINAL_EXT "somatic_final.indels.vcf.gz"
+
+#define SNV 0
+#define INDEL 1
+
+
+/* calls made by call_vars() for one column. see somatic_collect_var() */
+typedef struct {
+     var_t **vars;
+     int num_vars, vars_size;
+} somatic_vars_t;
+
+
+/* relaxed tumor calls of one type */
+typedef struct {
+     mtc_qual_t *mtc_quals; /* for all calls */
+     long int *cand_idx; /* index of call in cands or -1 */
+     long int num_calls, calls_size;
+     var_t **cands; /* only calls that might end up as somatic */
+     long int num_cands, cands_size;
+} somatic_calls_t;
+
+
+typedef struct {
+     varcall_conf_t tumor_conf;
+     varcall_conf_t normal_conf;
+     uniq_conf_t uniq_conf;
+
+     int min_cov;
+     int max_cov;
+     int mtc_type[2]; /* tumor multiple testing correction. SNV and INDEL */
+     double mtc_alpha[2];
+     double sb_alpha;
+     int uniq_mtc_type[2];
+     double uniq_alpha[2];
+
+     somatic_calls_t calls[2];
+
+     somatic_vars_t tvars, nvars; /* per column */
+} somatic_conf_t;
+
+
+/* varcall_conf_t.var_emit for call_vars(): keeps var in data, a
+ * somatic_vars_t */
+static void
+somatic_collect_var(var_t *var, void *data)
+{
+     somatic_vars_t *sv = (somatic_vars_t *) data;
+
+     if (sv->num_vars >= sv->vars_size) {
+          sv->vars_size = sv->vars_size ? 2 * sv->vars_size : 16;
+          sv->vars = realloc(sv->vars, sv->vars_size * sizeof(var_t *));
+          if (! sv->vars) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+     }
+     sv->vars[sv->num_vars++] = var;
+}
+/* somatic_collect_var() */
+
+
+static void
+somatic_calls_free(somatic_calls_t *sc)
+{
+     long int i;
+     for (i=0; i<sc->num_cands; i++) {
+          if (sc->cands[i]) {
+               vcf_free_var(& sc->cands[i]);
+          }
+     }
+     free(sc->cands);
+     free(sc->mtc_quals);
+     free(sc->cand_idx);
+}
+
+
+/* returns 1 if DP of var is within the [min_cov, max_cov] as in
+ * lofreq filter --cov-min/--cov-max */
+static int
+somatic_dp_ok(const var_t *var, const int min_cov, const int max_cov)
+{
+     const char *dp_char = NULL;
+     int dp_len;
+     long int cov;
+
+     if (! vcf_var_info_view(&dp_char, &dp_len, var, "DP")) {
+          return 1;
+     }
+     cov = strtol(dp_char, (char **) NULL, 10);
+     if (min_cov > 0 && cov < min_cov) {
+          return 0;
+     }
+     if (max_cov > 0 && cov > max_cov) {
+          return 0;
+     }
+     return 1;
+}
+
+
+/* returns 1 if var (called in tumor) was called in normal as
+ * well. same as vcfset -a complement: snvs have to match exactly,
+ * indels only by position. normal calls are all from the same
+ * column, i.e. have the same position by construction. */
+static int
+somatic_in_normal(const var_t *var, const int is_indel,
+                  var_t **nvars, const int num_nvars)
+{
+     int i;
+     if (is_indel) {
+          return num_nvars > 0;
+     }
+     for (i=0; i<num_nvars; i++) {
+          if (0 == strcmp(var->ref, nvars[i]->ref) && 0 == strcmp(var->alt, nvars[i]->alt)) {
+               return 1;
+          }
+     }
+     return 0;
+}
+
+
+/* mpileup_multi() callback. cols[0] is the tumor, cols[1] the
+ * normal piled up for calling and cols[2] the normal piled up for the
+ * uniq test */
+static void
+somatic_proc(const plp_col_t **cols, const int n, void *confp)
+{
+     somatic_conf_t *conf = (somatic_conf_t *) confp;
+     const plp_col_t *tumor = cols[0];
+     const plp_col_t *normal = cols[1];
+     const plp_col_t *normal_uniq = cols[2];
+     int num_tvars, num_nvars = 0;
+     int i;
+
+     if (n != 3) {
+          LOG_FATAL("Internal error: expected three samples, got %d\n", n);
+          exit(1);
+     }
+     if (tumor->coverage_plp < 1) {
+          return;
+     }
+
+     conf->tvars.num_vars = 0;
+     call_vars(tumor, & conf->tumor_conf);
+     if (! (num_tvars = conf->tvars.num_vars)) {
+          return;
+     }
+
+     conf->nvars.num_vars = 0;
+     if (normal->coverage_plp > 0) {
+          call_vars(normal, & conf->normal_conf);
+          num_nvars = conf->nvars.num_vars;
+     }
+
+     for (i=0; i<num_tvars; i++) {
+          var_t *var = conf->tvars.vars[i];
+          int is_indel = vcf_var_is_indel(var);
+          somatic_calls_t *sc = & conf->calls[is_indel ? INDEL : SNV];
+          long long int ntests = is_indel ? conf->tumor_conf.num_indel_tests : conf->tumor_conf.num_snv_tests;
+          double prob;
+          int keep;
+
+          if (sc->num_calls >= sc->calls_size) {
+               sc->calls_size = sc->calls_size ? 2 * sc->calls_size : 16384;
+               sc->mtc_quals = realloc(sc->mtc_quals, sc->calls_size * sizeof(mtc_qual_t));
+               sc->cand_idx = realloc(sc->cand_idx, sc->calls_size * sizeof(long int));
+               if (! sc->mtc_quals || ! sc->cand_idx) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          mtc_qual_from_var(& sc->mtc_quals[sc->num_calls], var);
+          sc->cand_idx[sc->num_calls] = -1;
+
+          /* the number of tests can only grow, so anything not
+           * significant now won't be later either. without bonferroni
+           * we can only rely on the uncorrected value */
+          prob = PHREDQUAL_TO_PROB(sc->mtc_quals[sc->num_calls].var_qual);
+          if (conf->mtc_type[is_indel ? INDEL : SNV] == MTC_BONF) {
+               prob *= ntests;
+          }
+          keep = (prob < conf->mtc_alpha[is_indel ? INDEL : SNV]
+                  && somatic_dp_ok(var, conf->min_cov, conf->max_cov)
+                  && ! somatic_in_normal(var, is_indel, conf->nvars.vars, num_nvars));
+
+          if (keep) {
+               vcf_var_add_to_info(var, "SOMATIC");
+               conf->uniq_conf.var = var;
+               uniq_snv(normal_uniq, & conf->uniq_conf);
+               conf->uniq_conf.var = NULL;
+
+               if (sc->num_cands >= sc->cands_size) {
+                    sc->cands_size = sc->cands_size ? 2 * sc->cands_size : 1024;
+                    sc->cands = realloc(sc->cands, sc->cands_size * sizeof(var_t *));
+                    if (! sc->cands) {
+                         fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                                 __FILE__, __FUNCTION__, __LINE__);
+                         exit(1);
+                    }
+               }
+               sc->cand_idx[sc->num_calls] = sc->num_cands;
+               sc->cands[sc->num_cands++] = var;
+          } else {
+               vcf_free_var(& var);
+          }
+          sc->num_calls += 1;
+     }
+     for (i=0; i<num_nvars; i++) {
+          vcf_free_var(& conf->nvars.vars[i]);
+     }
+}
+/* somatic_proc() */
+
+
+/* applies the tumor filters to all calls of one type and then the
+ * uniq filter to the remaining candidates. those passing are written
+ * to vcf_out. returns number of somatic variants or -1 on error */
+static long int
+somatic_filter_and_write(somatic_conf_t *conf, const int type, vcf_file_t *vcf_out)
+{
+     somatic_calls_t *sc = & conf->calls[type];
+     var_t **raw = NULL;
+     long int num_raw = 0;
+     long int num_written = 0;
+     uniq_filter_t uniq_filter;
+     char mtc_buf[64];
+     long int i;
+
+     if (type == SNV) {
+          sb_filter_t sb_filter;
+          snvqual_filter_t snvqual_filter;
+
+          memset(& sb_filter, 0, sizeof(sb_filter_t));
+          sb_filter.mtc_type = MTC_FDR;
+          sb_filter.alpha = conf->sb_alpha;
+          if (apply_sb_filter_mtc(sc->mtc_quals, & sb_filter, sc->num_calls)) {
+               return -1;
+          }
+          memset(& snvqual_filter, 0, sizeof(snvqual_filter_t));
+          snvqual_filter.mtc_type = conf->mtc_type[SNV];
+          snvqual_filter.alpha = conf->mtc_alpha[SNV];
+          snvqual_filter.ntests = conf->tumor_conf.num_snv_tests;
+          if (apply_snvqual_filter_mtc(sc->mtc_quals, & snvqual_filter, sc->num_calls)) {
+               return -1;
+          }
+     } else {
+          /* sb filter not applied to indels (see lofreq filter --sb-incl-indels) */
+          indelqual_filter_t indelqual_filter;
+
+          memset(& indelqual_filter, 0, sizeof(indelqual_filter_t));
+          indelqual_filter.mtc_type = conf->mtc_type[INDEL];
+          indelqual_filter.alpha = conf->mtc_alpha[INDEL];
+          indelqual_filter.ntests = conf->tumor_conf.num_indel_tests;
+          if (apply_indelqual_filter_mtc(sc->mtc_quals, & indelqual_filter, sc->num_calls)) {
+               return -1;
+          }
+     }
+
+     /* -1 means significant for var_qual, but filter for sb_qual */
+     raw = malloc((sc->num_cands+1) * sizeof(var_t *));
+     if (! raw) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<sc->num_calls; i++) {
+          long int idx = sc->cand_idx[i];
+          if (idx < 0) {
+               continue;
+          }
+          if (sc->mtc_quals[i].var_qual == -1 &&
+              (type == INDEL || sc->mtc_quals[i].sb_qual != -1)) {
+               raw[num_raw++] = sc->cands[idx];
+          } else {
+               vcf_free_var(& sc->cands[idx]);
+               sc->cands[idx] = NULL;
+          }
+     }
+     LOG_VERBOSE("%ld %s left after filtering and removal of normal calls\n",
+                 num_raw, type == SNV ? "SNVs" : "indels");
+
+     memset(& uniq_filter, 0, sizeof(uniq_filter_t));
+     uniq_filter.mtc_type = conf->uniq_mtc_type[type];
+     uniq_filter.alpha = conf->uniq_alpha[type];
+     mtc_str(mtc_buf, uniq_filter.mtc_type);
+     snprintf(uniq_filter.id, FILTER_ID_STRSIZE, "uq_%s", mtc_buf);
+     if (num_raw && apply_uniq_filter_mtc(& uniq_filter, raw, num_raw)) {
+          free(raw);
+          return -1;
+     }
+
+     for (i=0; i<num_raw; i++) {
+          var_t *var = raw[i];
+          if (! VCF_VAR_PASSES(var)) {
+               continue;
+          }
+          if (! var->filter || strlen(var->filter)<=1) {
+               free(var->filter);
+               var->filter = strdup("PASS");
+          }
+          vcf_write_var(vcf_out, var);
+          num_written += 1;
+     }
+     free(raw);
+     return num_written;
+}
+/* somatic_filter_and_write() */
+
+
+/* opens vcf for final output and writes header. returns non-zero on
+ * error */
+static int
+somatic_vcf_open(vcf_file_t *vcf, const char *path, const mplp_conf_t *mplp_conf)
+{
+     vcf_file_t mem;
+     char *header = NULL;
+     size_t header_size = 0;
+
+     if (vcf_file_open(vcf, path, HAS_GZIP_EXT(path), 'w')) {
+          LOG_ERROR("Couldn't open %s\n", path);
+          return 1;
+     }
+     if (vcf_file_open_mem(& mem, & header, & header_size)) {
+          return 1;
+     }
+     vcf_write_new_header(& mem, mplp_conf->cmdline, mplp_conf->fa);
+     vcf_file_close(& mem);
+     vcf_header_add(& header, "##INFO=<ID=UQ,Number=1,Type=Integer,Description=\"Phred-scaled uniq score at this position\">\n");
+     vcf_header_add(& header, "##INFO=<ID=SOMATIC,Number=0,Type=Flag,Description=\"Somatic event\">\n");
+     vcf_write_header(vcf, header);
+     free(header);
+     return 0;
+}
+
+
+static void
+usage(const somatic_conf_t *conf)
+{
+     char tmtc[64], imtc[64];
+     mtc_str(tmtc, conf->mtc_type[SNV]);
+     mtc_str(imtc, conf->mtc_type[INDEL]);
+
+     fprintf(stderr, "%s --one-pass: Call somatic variants from a normal/tumor pair in a single pass\n\n", MYNAME);
+     fprintf(stderr, "Usage: %s --one-pass [options] -n normal.bam -t tumor.bam -f ref.fa -o outprefix\n\n", MYNAME);
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -n | --normal FILE            Normal BAM file\n");
+     fprintf(stderr, "  -t | --tumor FILE             Tumor BAM file\n");
+     fprintf(stderr, "  -o | --outprefix STR          Prefix for output files\n");
+     fprintf(stderr, "  -f | --ref FILE               Indexed reference fasta file\n");
+     fprintf(stderr, "  -l | --bed FILE               BED file listing regions to restrict analysis to\n");
+     fprintf(stderr, "  -r | --region STR             Limit calls to this region (chrom:start-end)\n");
+     fprintf(stderr, "       --call-indels            Also call indels\n");
+     fprintf(stderr, "       --min-cov INT            Minimum coverage for somatic calls [%d]\n", conf->min_cov);
+     fprintf(stderr, "       --max-cov INT            Maximum coverage for somatic calls [%d]\n", conf->max_cov);
+     fprintf(stderr, "       --tumor-mtc STR          Type of multiple testing correction for tumor: bonf, holm-bonf or fdr [%s]\n", tmtc);
+     fprintf(stderr, "       --tumor-mtc-alpha FLOAT  Multiple testing correction alpha for tumor [%f]\n", conf->mtc_alpha[SNV]);
+     fprintf(stderr, "       --indel-tumor-mtc STR    Type of multiple testing correction for tumor indels [%s]\n", imtc);
+     fprintf(stderr, "       --indel-tumor-mtc-alpha FLOAT  Multiple testing correction alpha for tumor indels [%f]\n", conf->mtc_alpha[INDEL]);
+     fprintf(stderr, "       --normal-alpha FLOAT     Significance threshold for (relaxed) calls in normal [%f]\n", conf->normal_conf.sig);
+     fprintf(stderr, "       --tumor-alpha FLOAT      Significance threshold for (relaxed) calls in tumor [%f]\n", conf->tumor_conf.sig);
+     fprintf(stderr, "       --use-orphan             Use orphaned/anomalous reads from pairs in tumor (always on for normal)\n");
+     fprintf(stderr, "       --baq-off                Switch use of BAQ off in tumor (always off for normal)\n");
+     fprintf(stderr, "       --src-qual               Use source quality in tumor\n");
+     fprintf(stderr, "  -S | --ign-vcf FILE           Ignore variants in this vcf-file for source quality computation (implies --src-qual)\n");
+     fprintf(stderr, "       --verbose                Be verbose\n");
+     fprintf(stderr, "       --debug                  Enable debugging\n");
+     fprintf(stderr, "\n");
+     fprintf(stderr, "Both BAM files are read only once and in lockstep. Only the final somatic calls\n");
+     fprintf(stderr, "(%s%s and with --call-indels %s%s) are written.\n",
+             "<outprefix>", VCF_SOMATIC_FINAL_EXT, "<outprefix>", VCF_INDELS_SOMATIC_FINAL_EXT);
+     fprintf(stderr, "Unlike the default mode, source quality is off unless requested, because the normal\n");
+     fprintf(stderr, "calls aren't known in advance. Use the default mode for --dbsnp, --germline and --threads.\n");
+}
+/* usage() */
+
+
+int
+main_somatic(int argc, char *argv[])
+{
+     somatic_conf_t conf;
+     mplp_conf_t tumor_mplp_conf, normal_mplp_conf, uniq_mplp_conf;
+     const mplp_conf_t *mplp_confs[3];
+     const char *bam_files[3]; /* tumor first, then normal twice */
+     char *bam_normal = NULL, *bam_tumor = NULL;
+     char *outprefix = NULL;
+     char *bed_file = NULL;
+     char *ign_vcf = NULL;
+     char *vcf_out_paths[2] = {NULL, NULL};
+     static int no_indels = 1;
+     static int use_orphan = 0;
+     static int baq_off = 0;
+     static int src_qual = 0;
+     int rc = 0;
+     int i, t;
+
+     memset(& conf, 0, sizeof(somatic_conf_t));
+     init_mplp_conf(& tumor_mplp_conf);
+     init_varcall_conf(& conf.tumor_conf);
+     init_varcall_conf(& conf.normal_conf);
+
+     conf.min_cov = SOMATIC_DEFAULT_MIN_COV;
+     conf.max_cov = SOMATIC_DEFAULT_MAX_COV;
+     conf.mtc_type[SNV] = conf.mtc_type[INDEL] = MTC_BONF;
+     conf.mtc_alpha[SNV] = SOMATIC_DEFAULT_MTC_ALPHA_T;
+     conf.mtc_alpha[INDEL] = SOMATIC_DEFAULT_INDEL_MTC_ALPHA_T;
+     conf.sb_alpha = SOMATIC_DEFAULT_SB_MTC_ALPHA;
+     conf.uniq_mtc_type[SNV] = conf.uniq_mtc_type[INDEL] = MTC_FDR;
+     conf.uniq_alpha[SNV] = SOMATIC_DEFAULT_SNV_UNIQ_MTC_ALPHA;
+     conf.uniq_alpha[INDEL] = SOMATIC_DEFAULT_INDEL_UNIQ_MTC_ALPHA;
+     conf.tumor_conf.sig = SOMATIC_DEFAULT_ALPHA_T;
+     conf.normal_conf.sig = SOMATIC_DEFAULT_ALPHA_N;
+     conf.uniq_conf.uni_freq = SOMATIC_UNI_FREQ;
+
+     if (argc == 2) {
+          usage(& conf);
+          return 1;
+     }
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+               /* see usage sync */
+               {"help", no_argument, NULL, 'h'},
+               {"verbose", no_argument, &verbose, 1},
+               {"debug", no_argument, &debug, 1},
+               {"one-pass", no_argument, NULL, '1'}, /* long only. see lofreq_main.c */
+               {"normal", required_argument, NULL, 'n'},
+               {"tumor", required_argument, NULL, 't'},
+               {"outprefix", required_argument, NULL, 'o'},
+               {"ref", required_argument, NULL, 'f'},
+               {"bed", required_argument, NULL, 'l'},
+               {"region", required_argument, NULL, 'r'},
+               {"call-indels", no_argument, &no_indels, 0},
+               {"min-cov", required_argument, NULL, 'C'}, /* long only */
+               {"max-cov", required_argument, NULL, 'D'}, /* long only */
+               {"tumor-mtc", required_argument, NULL, 'm'}, /* long only */
+               {"tumor-mtc-alpha", required_argument, NULL, 'a'}, /* long only */
+               {"indel-tumor-mtc", required_argument, NULL, 'M'}, /* long only */
+               {"indel-tumor-mtc-alpha", required_argument, NULL, 'A'}, /* long only */
+               {"normal-alpha", required_argument, NULL, 'N'}, /* long only */
+               {"tumor-alpha", required_argument, NULL, 'T'}, /* long only */
+               {"use-orphan", no_argument, &use_orphan, 1},
+               {"baq-off", no_argument, &baq_off, 1},
+               {"src-qual", no_argument, &src_qual, 1},
+               {"ign-vcf", required_argument, NULL, 'S'},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          /* keep in sync with long_opts and usage */
+          static const char *long_opts_str = "hn:t:o:f:l:r:S:";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, /* skipping 'lofreq', just leaving 'command', i.e. somatic */
+                          long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'h':
+               usage(& conf);
+               return 0;
+          case '1':
+               break;
+          case 'n':
+               bam_normal = strdup(optarg);
+               break;
+          case 't':
+               bam_tumor = strdup(optarg);
+               break;
+          case 'o':
+               outprefix = strdup(optarg);
+               break;
+          case 'f':
+               if (! file_exists(optarg)) {
+                    LOG_FATAL("Reference fasta file '%s' does not exist. Exiting...\n", optarg);
+                    return 1;
+               }
+               tumor_mplp_conf.fa = strdup(optarg);
+               tumor_mplp_conf.fai = fai_load(optarg);
+               if (tumor_mplp_conf.fai == 0)  {
+                    free(tumor_mplp_conf.fa);
+                    return 1;
+               }
+               break;
+          case 'l':
+               bed_file = strdup(optarg);
+               break;
+          case 'r':
+               tumor_mplp_conf.reg = strdup(optarg);
+               break;
+          case 'C':
+               conf.min_cov = atoi(optarg);
+               break;
+          case 'D':
+               conf.max_cov = atoi(optarg);
+               break;
+          case 'm':
+          case 'M':
+               if (-1 == (conf.mtc_type[c == 'm' ? SNV : INDEL] = mtc_str_to_type(optarg))) {
+                    LOG_FATAL("Unknown multiple testing correction type '%s'\n", optarg);
+                    return 1;
+               }
+               if (MTC_NONE == conf.mtc_type[c == 'm' ? SNV : INDEL]) {
+                    LOG_FATAL("%s\n", "Multiple testing correction can't be switched off");
+                    return 1;
+               }
+               break;
+          case 'a':
+               conf.mtc_alpha[SNV] = strtod(optarg, (char **)NULL);
+               break;
+          case 'A':
+               conf.mtc_alpha[INDEL] = strtod(optarg, (char **)NULL);
+               break;
+          case 'N':
+               conf.normal_conf.sig = strtof(optarg, (char **)NULL);
+               break;
+          case 'T':
+               conf.tumor_conf.sig = strtof(optarg, (char **)NULL);
+               break;
+          case 'S':
+               ign_vcf = strdup(optarg);
+               src_qual = 1;
+               break;
+          case '?':
+               LOG_FATAL("%s\n", "unrecognized arguments found. Exiting...\n");
+               return 1;
+          default:
+               break;
+          }
+     }
+
+     if (argc - 1 - optind != 0) {
+          LOG_FATAL("%s\n", "Unknown extra arguments found");
+          return 1;
+     }
+     if (! bam_normal || ! bam_tumor || ! tumor_mplp_conf.fa || ! outprefix) {
+          LOG_FATAL("%s\n", "Normal and tumor BAM, reference and output prefix are mandatory");
+          usage(& conf);
+          return 1;
+     }
+     if (conf.tumor_conf.sig <= 0 || conf.normal_conf.sig <= 0) {
+          LOG_FATAL("%s\n", "Invalid significance threshold");
+          return 1;
+     }
+     bam_files[0] = bam_tumor;
+     bam_files[1] = bam_normal;
+     bam_files[2] = bam_normal;
+     for (i=0; i<2; i++) {
+          if (! file_exists(bam_files[i])) {
+               LOG_FATAL("BAM file %s does not exist. Exiting...\n", bam_files[i]);
+               return 1;
+          }
+     }
+     vcf_out_paths[SNV] = malloc(strlen(outprefix) + strlen(VCF_SOMATIC_FINAL_EXT) + 1);
+     vcf_out_paths[INDEL] = malloc(strlen(outprefix) + strlen(VCF_INDELS_SOMATIC_FINAL_EXT) + 1);
+     if (! vcf_out_paths[SNV] || ! vcf_out_paths[INDEL]) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(vcf_out_paths[SNV], "%s%s", outprefix, VCF_SOMATIC_FINAL_EXT);
+     sprintf(vcf_out_paths[INDEL], "%s%s", outprefix, VCF_INDELS_SOMATIC_FINAL_EXT);
+     for (t=0; t<(no_indels ? 1 : 2); t++) {
+          if (file_exists(vcf_out_paths[t])) {
+               LOG_FATAL("Cowardly refusing to overwrite already existing file %s\n", vcf_out_paths[t]);
+               return 1;
+          }
+     }
+
+     /* tumor: relaxed calling as in lofreq2_somatic.py. bonferroni
+      * factor 1, filtering done here at the end */
+     tumor_mplp_conf.max_depth = (int)(conf.max_cov * 1.01);
+     if (baq_off) {
+          tumor_mplp_conf.flag &= ~MPLP_BAQ;
+          conf.tumor_conf.flag &= ~VARCALL_USE_BAQ;
+     }
+     if (use_orphan) {
+          tumor_mplp_conf.flag &= ~MPLP_NO_ORPHAN;
+     }
+     if (src_qual) {
+          tumor_mplp_conf.flag |= MPLP_USE_SQ;
+          conf.tumor_conf.flag |= VARCALL_USE_SQ;
+     }
+     conf.tumor_conf.min_cov = conf.min_cov;
+     conf.tumor_conf.bonf_dynamic = 0;
+     conf.tumor_conf.bonf_subst = 1;
+     conf.tumor_conf.no_indels = no_indels;
+     if (no_indels) {
+          conf.tumor_conf.flag &= ~VARCALL_USE_IDAQ;
+          tumor_mplp_conf.flag &= ~MPLP_IDAQ;
+     }
+     if (bed_file) {
+          tumor_mplp_conf.bed = bed_read(bed_file);
+          if (! tumor_mplp_conf.bed) {
+               LOG_ERROR("Couldn't read %s\n", bed_file);
+               return 1;
+          }
+     }
+     tumor_mplp_conf.cmdline[0] = '\0';
+     for (i=0; i<argc; i++) {
+          strncat(tumor_mplp_conf.cmdline, argv[i],
+                  sizeof(tumor_mplp_conf.cmdline)-strlen(tumor_mplp_conf.cmdline)-2);
+          strcat(tumor_mplp_conf.cmdline, " ");
+     }
+
+     /* normal: relaxed calling with orphans, but without BAQ, MQ and
+      * IDAQ (lofreq call --use-orphan -B -N -A) */
+     memcpy(& normal_mplp_conf, & tumor_mplp_conf, sizeof(mplp_conf_t));
+     normal_mplp_conf.flag &= ~(MPLP_NO_ORPHAN | MPLP_BAQ | MPLP_IDAQ | MPLP_USE_SQ);
+     conf.normal_conf.flag &= ~(VARCALL_USE_BAQ | VARCALL_USE_MQ | VARCALL_USE_IDAQ | VARCALL_USE_SQ);
+     conf.normal_conf.bonf_dynamic = 0;
+     conf.normal_conf.bonf_subst = 1;
+     conf.normal_conf.no_indels = no_indels;
+
+     /* normal for the uniq test: same pileup settings as lofreq uniq
+      * (i.e. no orphans, MQ >= 1). only the depth cap is shared with
+      * the other two, see mpileup_core() */
+     memset(& uniq_mplp_conf, 0, sizeof(mplp_conf_t));
+     uniq_mplp_conf.max_mq = DEFAULT_MAX_MQ;
+     uniq_mplp_conf.min_mq = 1;
+     uniq_mplp_conf.min_plp_bq = DEFAULT_MIN_PLP_BQ;
+     uniq_mplp_conf.max_depth = DEFAULT_MAX_PLP_DEPTH;
+     uniq_mplp_conf.flag = MPLP_NO_ORPHAN;
+     uniq_mplp_conf.bed = tumor_mplp_conf.bed;
+     uniq_mplp_conf.fa = tumor_mplp_conf.fa; /* only for decoding CRAM */
+
+     if (debug) {
+          dump_mplp_conf(& tumor_mplp_conf, stderr);
+          dump_varcall_conf(& conf.tumor_conf, stderr);
+          dump_mplp_conf(& normal_mplp_conf, stderr);
+          dump_varcall_conf(& conf.normal_conf, stderr);
+          dump_mplp_conf(& uniq_mplp_conf, stderr);
+     }
+
+     if (ign_vcf) {
+          /* note strtok destroys input i.e. ign_vcf */
+          char *f = strtok(ign_vcf, ",");
+          while (NULL != f) {
+               if (source_qual_load_ign_vcf(f)) {
+                    LOG_FATAL("Loading of ignore positions from %s failed.", f);
+                    return 1;
+               }
+               f = strtok(NULL, ",");
+          }
+          free(ign_vcf);
+     }
+
+     conf.tumor_conf.var_emit = somatic_collect_var;
+     conf.tumor_conf.var_emit_data = & conf.tvars;
+     conf.normal_conf.var_emit = somatic_collect_var;
+     conf.normal_conf.var_emit_data = & conf.nvars;
+
+     mplp_confs[0] = & tumor_mplp_conf;
+     mplp_confs[1] = & normal_mplp_conf;
+     mplp_confs[2] = & uniq_mplp_conf;
+     rc = mpileup_multi(mplp_confs, &somatic_proc, (void*)&conf, 3, bam_files);
+     if (rc) {
+          LOG_FATAL("%s\n", "mpileup failed");
+          goto clean_and_exit;
+     }
+     LOG_VERBOSE("Number of substitution tests performed: %lld\n", conf.tumor_conf.num_snv_tests);
+     LOG_VERBOSE("Number of indel tests performed: %lld\n", conf.tumor_conf.num_indel_tests);
+
+     for (t=0; t<(no_indels ? 1 : 2); t++) {
+          vcf_file_t vcf_out;
+          long int num_somatic;
+
+          if (somatic_vcf_open(& vcf_out, vcf_out_paths[t], & tumor_mplp_conf)) {
+               rc = 1;
+               goto clean_and_exit;
+          }
+          num_somatic = somatic_filter_and_write(& conf, t, & vcf_out);
+          vcf_file_close(& vcf_out);
+          if (num_somatic < 0) {
+               LOG_FATAL("Filtering of somatic %s failed\n", t == SNV ? "SNVs" : "indels");
+               rc = 1;
+               goto clean_and_exit;
+          }
+          LOG_VERBOSE("%ld somatic %s written to %s\n", num_somatic,
+                      t == SNV ? "SNVs" : "indels", vcf_out_paths[t]);
+     }
+
+clean_and_exit:
+     free(conf.tvars.vars);
+     free(conf.nvars.vars);
+     for (t=0; t<2; t++) {
+          somatic_calls_free(& conf.calls[t]);
+          free(vcf_out_paths[t]);
+     }
+     source_qual_free_ign_vars();
+     if (tumor_mplp_conf.bed) {
+          bed_destroy(tumor_mplp_conf.bed);
+     }
+     if (tumor_mplp_conf.fai) {
+          fai_destroy(tumor_mplp_conf.fai);
+     }
+     free(tumor_mplp_conf.fa);
+     free(tumor_mplp_conf.reg);
+     free(bed_file);
+     free(outprefix);
+     free(bam_normal);
+     free(bam_tumor);
+
+     if (0 == rc) {
+          LOG_VERBOSE("%s\n", "Successful exit.");
+     }
+     return rc;
+}
+/* main_somatic() */
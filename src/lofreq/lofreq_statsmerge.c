@@ -0,0 +1,350 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* lofreq stats-merge: adds up pileup stats (see plpstats.h) of
+ * separate runs on disjoint sets of reads of the same sample, e.g. a
+ * top-up lane, so that variants can be re-called on all reads with
+ * lofreq call --from-stats without piling up the old reads again.
+ * Inputs are merged in one streaming pass in reference order.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+
+#include "htslib/faidx.h"
+
+/* lofreq includes */
+#include "lofreq_statsmerge.h"
+#include "plp.h"
+#include "plpstats.h"
+#include "log.h"
+#include "utils.h"
+
+
+#if 1
+#define MYNAME "lofreq stats-merge"
+#else
+#define MYNAME PACKAGE
+#endif
+
+
+/* one input file and its current column */
+typedef struct {
+     const char *path;
+     plpstats_t stats;
+     plp_col_t col;
+     int has_col; /* 0 after EOF */
+     int rank; /* of col.target in reference */
+} statsmerge_in_t;
+
+/* sequence name with rank, for looking up sort order */
+typedef struct {
+     const char *name;
+     int rank;
+} statsmerge_seq_t;
+
+
+static void
+usage(void)
+{
+     fprintf(stderr, "%s: Merge pileup stats of different reads of one sample\n\n", MYNAME);
+     fprintf(stderr, "Usage: %s [options] -o out%s in1%s in2%s [...]\n\n", MYNAME, PLPSTATS_EXT, PLPSTATS_EXT, PLPSTATS_EXT);
+     fprintf(stderr, "Inputs are pileup stats written by 'lofreq call --stats-out --stats-all-cols' on disjoint sets of\n");
+     fprintf(stderr, "reads (e.g. different sequencing lanes of one sample) with the same reference and pileup options.\n");
+     fprintf(stderr, "Their statistics are added up per column, so that calling from the output with 'lofreq call\n");
+     fprintf(stderr, "--from-stats' gives the calls on all reads, without piling up any of them again.\n\n");
+     fprintf(stderr, "Options:\n");
+     fprintf(stderr, "  -o | --out FILE  Output pileup stats file (required)\n");
+     fprintf(stderr, "  -f | --ref FILE  Indexed reference fasta file, determining the order of sequences [as stored in inputs]\n");
+     fprintf(stderr, "       --verbose   Be verbose\n");
+     fprintf(stderr, "       --debug     Enable debugging\n");
+}
+/* usage() */
+
+
+static int
+statsmerge_seq_cmp(const void *a, const void *b)
+{
+     return strcmp(((const statsmerge_seq_t *) a)->name, ((const statsmerge_seq_t *) b)->name);
+}
+/* statsmerge_seq_cmp() */
+
+
+/* reads next column of in. returns non-zero on error, i.e. read
+ * error, unknown sequence or unsorted input */
+static int
+statsmerge_in_next(statsmerge_in_t *in, const statsmerge_seq_t *seqs, const int num_seqs)
+{
+     int prev_rank = in->rank;
+     int prev_pos = in->has_col ? in->col.pos : -1;
+     statsmerge_seq_t key;
+     const statsmerge_seq_t *hit;
+     int ret;
+
+     ret = plpstats_read_col(& in->stats, & in->col);
+     if (ret <= 0) {
+          in->has_col = 0;
+          if (ret < 0) {
+               LOG_ERROR("Couldn't read %s\n", in->path);
+               return 1;
+          }
+          return 0;
+     }
+     key.name = in->col.target;
+     if (NULL == (hit = bsearch(& key, seqs, num_seqs, sizeof(statsmerge_seq_t), statsmerge_seq_cmp))) {
+          LOG_ERROR("Sequence %s of %s not found in reference\n", in->col.target, in->path);
+          return 1;
+     }
+     in->rank = hit->rank;
+     if (in->has_col && (in->rank < prev_rank || (in->rank == prev_rank && in->col.pos <= prev_pos))) {
+          LOG_ERROR("%s is not sorted in reference order (at %s:%d)\n", in->path, in->col.target, in->col.pos+1);
+          return 1;
+     }
+     in->has_col = 1;
+     return 0;
+}
+/* statsmerge_in_next() */
+
+
+int
+main_statsmerge(int argc, char *argv[])
+{
+     char *stats_out = NULL;
+     char *ref_fa = NULL;
+     statsmerge_in_t *ins = NULL;
+     int num_ins = 0;
+     statsmerge_seq_t *seqs = NULL;
+     int num_seqs = 0;
+     faidx_t *fai = NULL;
+     mplp_conf_t out_conf;
+     plpstats_t out;
+     int out_open = 0;
+     long int num_in_cols = 0;
+     int i;
+     int rc = 0;
+
+     while (1) {
+          int c;
+          static struct option long_opts[] = {
+               {"out", required_argument, NULL, 'o'},
+               {"ref", required_argument, NULL, 'f'},
+               {"help", no_argument, NULL, 'h'},
+               {"verbose", no_argument, &verbose, 1},
+               {"debug", no_argument, &debug, 1},
+               {0, 0, 0, 0} /* sentinel */
+          };
+          static const char *long_opts_str = "o:f:h";
+          int long_opts_index = 0;
+
+          c = getopt_long(argc-1, argv+1, long_opts_str, long_opts, & long_opts_index);
+          if (c == -1) {
+               break;
+          }
+          switch (c) {
+          case 'o':
+               if (file_exists(optarg)) {
+                    LOG_FATAL("Cowardly refusing to overwrite file '%s'. Exiting...\n", optarg);
+                    return 1;
+               }
+               stats_out = strdup(optarg);
+               break;
+          case 'f':
+               ref_fa = strdup(optarg);
+               break;
+          case 'h':
+               usage();
+               return 0;
+          case '?':
+               LOG_FATAL("%s\n", "Unrecognized arguments found. Exiting...\n");
+               return 1;
+          default:
+               break;
+          }
+     }
+     if (argc - optind - 1 < 1) {
+          usage();
+          return 1;
+     }
+     if (NULL == stats_out) {
+          LOG_FATAL("%s\n", "Output file missing (-o)");
+          return 1;
+     }
+
+     if (NULL == (ins = calloc(argc - optind - 1, sizeof(statsmerge_in_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     /* open and check all inputs before writing anything
+      */
+     for (i=0; i<argc-optind-1; i++) {
+          statsmerge_in_t *in = & ins[i];
+
+          in->path = argv[optind+1+i];
+          if (plpstats_read_open(& in->stats, in->path)) {
+               rc = 1;
+               goto free_and_exit;
+          }
+          plp_col_init(& in->col);
+          num_ins += 1;
+          if (in->stats.mplp_flag & MPLP_ALT_ONLY) {
+               /* columns without alt evidence in one input could
+                * have it in another, but their reference reads would
+                * be missing */
+               LOG_ERROR("%s only contains columns with alt evidence and can't be merged."
+                         " Store with 'lofreq call --stats-all-cols'\n", in->path);
+               rc = 1;
+               goto free_and_exit;
+          }
+          if (i && in->stats.mplp_flag != ins[0].stats.mplp_flag) {
+               LOG_ERROR("Pileup options used for %s differ from %s\n", in->path, ins[0].path);
+               rc = 1;
+               goto free_and_exit;
+          }
+          if (i && strcmp(in->stats.ref_fa, ins[0].stats.ref_fa)) {
+               LOG_WARN("Reference of %s (%s) differs from the one of %s (%s)\n",
+                        in->path, in->stats.ref_fa, ins[0].path, ins[0].stats.ref_fa);
+          }
+     }
+
+     /* sequence order is that of the reference, which is also the
+      * order of BAM headers created against it
+      */
+     if (NULL == ref_fa) {
+          ref_fa = strdup(ins[0].stats.ref_fa);
+     }
+     if (! ref_fa[0] || NULL == (fai = fai_load(ref_fa))) {
+          LOG_ERROR("Couldn't load index of reference '%s'. Use -f\n", ref_fa);
+          rc = 1;
+          goto free_and_exit;
+     }
+     num_seqs = faidx_nseq(fai);
+     if (NULL == (seqs = malloc(num_seqs * sizeof(statsmerge_seq_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<num_seqs; i++) {
+          seqs[i].name = faidx_iseq(fai, i);
+          seqs[i].rank = i;
+     }
+     qsort(seqs, num_seqs, sizeof(statsmerge_seq_t), statsmerge_seq_cmp);
+
+     for (i=0; i<num_ins; i++) {
+          if (statsmerge_in_next(& ins[i], seqs, num_seqs)) {
+               rc = 1;
+               goto free_and_exit;
+          }
+     }
+
+     /* header is taken from first input. its command line is used for
+      * the VCF header when calling from the output */
+     memset(& out_conf, 0, sizeof(mplp_conf_t));
+     out_conf.flag = ins[0].stats.mplp_flag;
+     out_conf.fa = ref_fa;
+     strncpy(out_conf.cmdline, ins[0].stats.cmdline, sizeof(out_conf.cmdline)-1);
+     if (plpstats_write_open(& out, stats_out, & out_conf)) {
+          rc = 1;
+          goto free_and_exit;
+     }
+     out_open = 1;
+
+     /* k-way merge. columns present in several inputs are added to
+      * the one of the input given first
+      */
+     while (0 == rc) {
+          statsmerge_in_t *min = NULL;
+
+          for (i=0; i<num_ins; i++) {
+               statsmerge_in_t *in = & ins[i];
+               if (! in->has_col) {
+                    continue;
+               }
+               if (! min || in->rank < min->rank
+                   || (in->rank == min->rank && in->col.pos < min->col.pos)) {
+                    min = in;
+               }
+          }
+          if (! min) {
+               break;
+          }
+
+          num_in_cols += 1;
+          for (i=0; i<num_ins && 0 == rc; i++) {
+               statsmerge_in_t *in = & ins[i];
+               if (in == min || ! in->has_col
+                   || in->rank != min->rank || in->col.pos != min->col.pos) {
+                    continue;
+               }
+               num_in_cols += 1;
+               if (plpstats_col_merge(& min->col, & in->col)) {
+                    rc = 1;
+               } else {
+                    rc = statsmerge_in_next(in, seqs, num_seqs);
+               }
+          }
+          if (rc) {
+               break;
+          }
+          /* writer starts a new target whenever tid changes */
+          min->col.tid = min->rank;
+          if (plpstats_write_col(& out, & min->col)) {
+               LOG_ERROR("Couldn't write to %s\n", stats_out);
+               rc = 1;
+               break;
+          }
+          rc = statsmerge_in_next(min, seqs, num_seqs);
+     }
+
+free_and_exit:
+     if (out_open) {
+          if (plpstats_close(& out)) {
+               LOG_ERROR("Couldn't write to %s\n", stats_out);
+               rc = 1;
+          } else if (0 == rc) {
+               LOG_VERBOSE("Merged %ld columns of %d files into %ld columns in %s\n",
+                           num_in_cols, num_ins, out.num_cols, stats_out);
+          }
+     }
+     for (i=0; i<num_ins; i++) {
+          plpstats_close(& ins[i].stats);
+          plp_col_free(& ins[i].col);
+     }
+     free(ins);
+     free(seqs);
+     if (fai) {
+          fai_destroy(fai);
+     }
+     free(ref_fa);
+     free(stats_out);
+     return rc;
+}
+/* main_statsmerge() */
@@ -66,6 +66,14 @@
 #include "defaults.h"
 #include "snpcaller.h"
 #include "multtest.h"
+#include "sam.h"
+#include "lofreq_uniq.h"
+
+/* from bedidx.c */
+void *bed_init(void);
+int bed_add(void *_h, const char *ref, unsigned int beg, unsigned int end);
+void bed_index(void *_h);
+void bed_destroy(void *_h);
 
 #if 1
 #define MYNAME "lofreq uniq"
@@ -77,7 +85,11 @@
 
 #define BUF_SIZE 1<<16
 
-#define FILTER_ID_STRSIZE 64
+/* batched mode: variants on the same sequence further apart than
+ * this are piled up in separate regions, i.e. the bam index is used to
+ * jump ahead instead of reading through */
+#define UNIQ_BATCH_MAX_GAP 100000
+
 #define FILTER_STRSIZE 128
 
 const char *uniq_flag = "UNIQ";
@@ -86,24 +98,18 @@ const char *uniq_phred_tag = "UQ";
 
 
 typedef struct {
-     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
-     int mtc_type;/* holm; holmbonf; fdr; none */
-     double alpha;
-     long int ntests;
-     char id[FILTER_ID_STRSIZE];
-} uniq_filter_t;
+     int tid;
+     var_t *var;
+} uniq_batch_var_t;
 
 
+/* state for uniq_batch_proc() */
 typedef struct {
-     float uni_freq;
-     vcf_file_t vcf_out;
-     vcf_file_t vcf_in;
-     int use_det_lim;
-     int output_all; /* catch! doesn't actually work if there's no coverage in BAM because mpileup will skip target function */
-     uniq_filter_t uniq_filter;
-     /* changing per pos: the var to test */
-     var_t *var;
-} uniq_conf_t;
+     uniq_conf_t *uniq_conf;
+     uniq_batch_var_t *vars; /* sorted and on one tid */
+     int num_vars;
+     int next; /* first var whose position wasn't reached yet */
+} uniq_batch_t;
 
 
 
@@ -239,7 +245,10 @@ uniq_snv(const plp_col_t *p, void *confp)
      }
 #endif
 
-     if (0 != strcmp(p->target, conf->var->chrom) || p->pos != conf->var->pos) {
+     /* integer compare if var was resolved against the BAM header already */
+     if (p->pos != conf->var->pos ||
+         (conf->var->tid >= 0 ? p->tid != conf->var->tid
+          : 0 != strcmp(p->target, conf->var->chrom))) {
           LOG_ERROR("wrong pileup for var. pileup for %s %d. var for %s %d\n",
                     p->target, p->pos+1, conf->var->chrom, conf->var->pos+1);
           return;
@@ -394,6 +403,159 @@ uniq_snv(const plp_col_t *p, void *confp)
 }
 
 
+/* pileup callback for batched mode. calls uniq_snv() for all
+ * variants at this column. variants at positions without coverage are
+ * skipped as in the per-variant mode. */
+static void
+uniq_batch_proc(const plp_col_t *p, void *confp)
+{
+     uniq_batch_t *batch = (uniq_batch_t *)confp;
+
+     while (batch->next < batch->num_vars
+            && batch->vars[batch->next].var->pos < p->pos) {
+          batch->next += 1;
+     }
+     while (batch->next < batch->num_vars
+            && batch->vars[batch->next].var->pos == p->pos) {
+          batch->uniq_conf->var = batch->vars[batch->next].var;
+          uniq_snv(p, batch->uniq_conf);
+          batch->next += 1;
+     }
+     batch->uniq_conf->var = NULL;
+}
+
+
+static int
+uniq_batch_var_cmp(const void *a, const void *b)
+{
+     const uniq_batch_var_t *va = (const uniq_batch_var_t *)a;
+     const uniq_batch_var_t *vb = (const uniq_batch_var_t *)b;
+
+     if (va->tid != vb->tid) {
+          return va->tid < vb->tid ? -1 : 1;
+     }
+     if (va->var->pos != vb->var->pos) {
+          return va->var->pos < vb->var->pos ? -1 : 1;
+     }
+     return 0;
+}
+
+
+/* Processes all variants with a single pass over the BAM file,
+ * instead of one indexed mpileup() per variant (which reloads the
+ * index each time). Variants are sorted and grouped into regions,
+ * which are piled up with a shared index. Only reads and columns
+ * overlapping variant positions are looked at. Returns non-zero on
+ * error.
+ */
+static int
+uniq_batched(uniq_conf_t *uniq_conf, const mplp_conf_t *mplp_conf,
+             var_t **vars, const int num_vars, const char *bam_file)
+{
+     mplp_conf_t batch_mplp_conf;
+     uniq_batch_var_t *bvars = NULL;
+     int num_bvars = 0;
+     bamFile fp;
+     bam_header_t *header;
+     bam_index_t *idx;
+     void *bed;
+     int i, rc = 0;
+
+     if (NULL == (fp = bam_open(bam_file, "r"))) {
+          LOG_FATAL("Couldn't open %s\n", bam_file);
+          return -1;
+     }
+     header = bam_header_read(fp);
+     bam_close(fp);
+     if (! header) {
+          LOG_FATAL("Couldn't read header of %s\n", bam_file);
+          return -1;
+     }
+     if (NULL == (idx = bam_index_load(bam_file))) {
+          LOG_FATAL("Couldn't load index for %s\n", bam_file);
+          bam_header_destroy(header);
+          return -1;
+     }
+     if (NULL == (bvars = malloc(num_vars * sizeof(uniq_batch_var_t)))
+         || NULL == (bed = bed_init())) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     for (i=0; i<num_vars; i++) {
+          int tid = bam_get_tid(header, vars[i]->chrom);
+          if (tid < 0) {
+               LOG_WARN("Sequence %s of variant at %ld not found in %s. Skipping\n",
+                        vars[i]->chrom, vars[i]->pos+1, bam_file);
+               continue;
+          }
+#ifdef DISABLE_INDELS
+          if (vcf_var_has_info_key(NULL, vars[i], "INDEL")) {
+               LOG_WARN("Skipping indel var at %s %d\n",
+                        vars[i]->chrom, vars[i]->pos+1);
+               continue;
+          }
+#endif
+          vars[i]->tid = tid;
+          bvars[num_bvars].tid = tid;
+          bvars[num_bvars].var = vars[i];
+          num_bvars += 1;
+          if (bed_add(bed, vars[i]->chrom, vars[i]->pos, vars[i]->pos+1)) {
+               LOG_FATAL("%s\n", "bed_add() failed");
+               exit(1);
+          }
+     }
+     bed_index(bed);
+     qsort(bvars, num_bvars, sizeof(uniq_batch_var_t), uniq_batch_var_cmp);
+
+     memcpy(& batch_mplp_conf, mplp_conf, sizeof(mplp_conf_t));
+     batch_mplp_conf.reg = NULL;
+     batch_mplp_conf.idx = idx;
+     batch_mplp_conf.bed = bed;
+
+     i = 0;
+     while (i < num_bvars && 0 == rc) {
+          uniq_batch_t batch;
+          plp_region_t region;
+          int j = i+1;
+
+          while (j < num_bvars && bvars[j].tid == bvars[i].tid
+                 && bvars[j].var->pos - bvars[j-1].var->pos <= UNIQ_BATCH_MAX_GAP) {
+               j++;
+          }
+
+          memset(& region, 0, sizeof(plp_region_t));
+          region.tid = bvars[i].tid;
+          region.beg = bvars[i].var->pos;
+          region.end = bvars[j-1].var->pos+1;
+          region.cur = region.beg-1;
+          pthread_mutex_init(& region.lock, NULL);
+          batch_mplp_conf.region = & region;
+
+          batch.uniq_conf = uniq_conf;
+          batch.vars = & bvars[i];
+          batch.num_vars = j-i;
+          batch.next = 0;
+
+          LOG_VERBOSE("Processing variants %d-%d of %d in %s:%d-%d\n",
+                      i+1, j, num_bvars, header->target_name[region.tid],
+                      region.beg+1, region.end);
+          rc = mpileup(& batch_mplp_conf, &uniq_batch_proc, (void*) & batch,
+                       1, & bam_file);
+          pthread_mutex_destroy(& region.lock);
+          i = j;
+     }
+
+     free(bvars);
+     bed_destroy(bed);
+     bam_index_destroy(idx);
+     bam_header_destroy(header);
+     return rc;
+}
+/* uniq_batched() */
+
+
 static void
 usage(const uniq_conf_t* uniq_conf)
 {
@@ -411,8 +573,8 @@ usage(const uniq_conf_t* uniq_conf)
 
      fprintf(stderr,"Usage: %s [options] indexed-in.bam\n\n", MYNAME);
      fprintf(stderr,"Options:\n");
-     fprintf(stderr, "  -v | --vcf-in FILE      Input vcf file listing variants [- = stdin; gzip supported]\n");
-     fprintf(stderr, "  -o | --vcf-out FILE     Output vcf file [- = stdout; gzip supported]\n");
+     fprintf(stderr, "  -v | --vcf-in FILE      Input vcf file listing variants [- = stdin; gzip and .bcf supported]\n");
+     fprintf(stderr, "  -o | --vcf-out FILE     Output vcf file [- = stdout; gzip and .bcf supported]\n");
      fprintf(stderr, "  -f | --uni-freq         Assume variants have uniform test frequency of this value (unused if <=0) [%f]\n", uniq_conf->uni_freq);
      fprintf(stderr, "  -t | --uniq-thresh INT  Minimum uniq phred-value required. Conflicts with -m. 0 for off (default=%d)\n", uniq_conf->uniq_filter.thresh);
      fprintf(stderr, "  -m | --uniq-mtc STRING  Uniq multiple testing correction type. One of 'bonf', 'holm' or 'fdr'. (default=%s)\n", mtc_type_str[uniq_conf->uniq_filter.mtc_type]);
@@ -423,6 +585,7 @@ usage(const uniq_conf_t* uniq_conf)
      fprintf(stderr, "       --use-det-lim      Report variants if they are above implied detection limit\n");
      fprintf(stderr, "                          Default is to use binomial test to check for frequency differences\n");
      fprintf(stderr, "       --use-orphan       Don't ignore anomalous read pairs / orphan reads\n");
+     fprintf(stderr, "       --no-batch         Run one indexed pileup per variant instead of one pass over the BAM\n");
      fprintf(stderr, "       --verbose          Be verbose\n");
      fprintf(stderr, "       --debug            Enable debugging\n");
 }
@@ -447,6 +610,7 @@ main_uniq(int argc, char *argv[])
      static int use_orphan = 0;
      static int output_all = 0;
      static int is_somatic = 0;
+     static int no_batch = 0;
 
      /* default uniq options */
      memset(&uniq_conf, 0, sizeof(uniq_conf_t));
@@ -480,6 +644,7 @@ main_uniq(int argc, char *argv[])
               {"use-orphan", no_argument, &use_orphan, 1},
               {"output-all", no_argument, &output_all, 1},
               {"is-somatic", no_argument, &is_somatic, 1},
+              {"no-batch", no_argument, &no_batch, 1},
 
               {"vcf-in", required_argument, NULL, 'v'},
               {"vcf-out", required_argument, NULL, 'o'},
@@ -692,7 +857,20 @@ main_uniq(int argc, char *argv[])
 
     plp_proc_func = &uniq_snv;
 
-    for (i=0; i<num_vars; i++) {
+    if (! no_batch) {
+         rc = uniq_batched(& uniq_conf, & mplp_conf, vars, num_vars, bam_file);
+         if (rc) {
+              LOG_FATAL("%s\n", "Batched pileup failed");
+              goto clean_and_exit;
+         }
+         if (uniq_conf.uniq_filter.thresh) {
+              for (i=0; i<num_vars; i++) {
+                   apply_uniq_threshold(vars[i], & uniq_conf.uniq_filter);
+              }
+         }
+    }
+
+    for (i=0; i<num_vars && no_batch; i++) {
          char reg_buf[BUF_SIZE];
          if (i%100==0) {
               LOG_VERBOSE("Processing variant %d of %d\n", i+1, num_vars);
@@ -28,6 +28,37 @@
 #ifndef LOFREQ_UNIQ_H
 #define LOFREQ_UNIQ_H
 
+#include "vcf.h"
+#include "plp.h"
+
+#define FILTER_ID_STRSIZE 64
+
+typedef struct {
+     int thresh;/* use if > 0; otherwise use multiple testing correction that's if >0 */
+     int mtc_type;/* holm; holmbonf; fdr; none */
+     double alpha;
+     long int ntests;
+     char id[FILTER_ID_STRSIZE];
+} uniq_filter_t;
+
+
+typedef struct {
+     float uni_freq;
+     vcf_file_t vcf_out;
+     vcf_file_t vcf_in;
+     int use_det_lim;
+     int output_all; /* catch! doesn't actually work if there's no coverage in BAM because mpileup will skip target function */
+     uniq_filter_t uniq_filter;
+     /* changing per pos: the var to test */
+     var_t *var;
+} uniq_conf_t;
+
+
+/* pileup callback testing conf->var against the column. see lofreq_uniq.c */
+void uniq_snv(const plp_col_t *p, void *confp);
+
+int apply_uniq_filter_mtc(uniq_filter_t *uniq_filter, var_t **vars, const int num_vars);
+
 int main_uniq(int argc, char *argv[]);
 
 #endif
@@ -73,6 +73,33 @@ typedef struct {
 } vcfset_conf_t;
 
 
+/* a second vcf file (there can be several). variants are looked up
+ * by streaming through the file alongside vcf1 (merge-join), which
+ * needs vcf1 to be sorted in the same chromosome order. if vcf1
+ * turns out not to be sorted we fall back to tabix queries for each
+ * vcf1 variant. the index is needed in both cases, since that's
+ * where the chromosome order comes from.
+ */
+typedef struct {
+     char *path;
+     tbx_t *tbx;
+     htsFile *hts;
+     int use_merge;
+
+     /* merge-join state */
+     vcf_file_t vcf;
+     var_t *next; /* lookahead. NULL on EOF */
+     int next_tid;
+     long int next_pos; /* kept, since next might have been handed on already */
+     var_t **cur; /* all variants at cur_tid:cur_pos */
+     int num_cur, max_cur;
+     int cur_tid;
+     long int cur_pos;
+     int last_tid1; /* position of last vcf1 variant in this file's chromosome order */
+     long int last_pos1;
+} vcf2_t;
+
+
 
 static void
 usage(const vcfset_conf_t* vcfset_conf)
@@ -81,9 +108,11 @@ usage(const vcfset_conf_t* vcfset_conf)
      fprintf(stderr, "Usage: %s [options] -a op -1 1.vcf -2 2.vcf \n", MYNAME);
 
      fprintf(stderr,"Options:\n");
-     fprintf(stderr, "  -1 | --vcf1 FILE      1st VCF input file (bgzip supported)\n");
-     fprintf(stderr, "  -2 | --vcf2 FILE      2nd VCF input file (mandatory - except for concat - and needs to be tabix indexed)\n");
-     fprintf(stderr, "  -o | --vcfout         VCF output file (default: - for stdout; gzip supported).\n");
+     fprintf(stderr, "  -1 | --vcf1 FILE      1st VCF input file (bgzip and .bcf supported)\n");
+     fprintf(stderr, "  -2 | --vcf2 FILE      2nd VCF input file (mandatory - except for concat - and needs to be tabix indexed).\n"
+             "                        Can be given several times: intersect then means in vcf1 and all of them,\n"
+             "                        complement means in vcf1 but none of them\n");
+     fprintf(stderr, "  -o | --vcfout         VCF output file (default: - for stdout; gzip and .bcf supported).\n");
      fprintf(stderr, "  -a | --action         Set operation to perform: intersect, complement or concat.\n"
              "                        - intersect = vcf1 AND vcf2.\n"
              "                        - complement = vcf1 \\ vcf2.\n"
@@ -94,16 +123,262 @@ usage(const vcfset_conf_t* vcfset_conf)
      fprintf(stderr, "       --only-passed    Ignore variants marked as filtered\n");
      fprintf(stderr, "       --only-snvs      Ignore anything but SNVs in both input files\n");
      fprintf(stderr, "       --only-indels    Ignore anything but indels in both input files\n");
+     fprintf(stderr, "       --no-merge       Always use index queries for vcf2, even if vcf1 is sorted\n");
      fprintf(stderr, "       --verbose        Be verbose\n");
      fprintf(stderr, "       --debug          Enable debugging\n");
 
-     fprintf(stderr, "\nNote, vcf1 is always fully parsed, whereas indexing is used for vcf2.\n");
-     fprintf(stderr, "Therefore, use the bigger file as vcf2 to speed things up.\n");
+     fprintf(stderr, "\nNote, if vcf1 is sorted (like vcf2), both are read in one go. Otherwise\n");
+     fprintf(stderr, "vcf1 is fully parsed, whereas indexing is used for vcf2. In that case use\n");
+     fprintf(stderr, "the bigger file as vcf2 to speed things up.\n");
      fprintf(stderr, "Header/meta-data for the output file is taken from vcf1\n");
 }
 /* usage() */
 
 
+/* returns 1 if var2 counts as match for var1, 0 otherwise */
+static int
+var2_matches(const vcfset_conf_t *vcfset_conf, const var_t *var1, const var_t *var2)
+{
+     int var2_is_indel = vcf_var_is_indel(var2);
+
+     if (var1->pos != var2->pos) {
+          return 0;
+
+     } else if (vcfset_conf->only_passed && ! VCF_VAR_PASSES(var2)) {
+          return 0;
+
+     } else if (vcfset_conf->only_snvs && var2_is_indel) {
+          return 0;
+
+     } else if (vcfset_conf->only_indels && ! var2_is_indel) {
+          return 0;
+
+     } else if (vcfset_conf->only_pos) {
+#ifdef TRACE
+          LOG_DEBUG("Pos match for var2 %s:%d\n", var2->chrom, var2->pos);
+#endif
+          return 1;
+
+     } else {
+          if (0==strcmp(var1->ref, var2->ref) && 0==strcmp(var1->alt, var2->alt)) {
+#ifdef TRACE
+               LOG_DEBUG("Full match for var2 %s:%d\n", var2->chrom, var2->pos);
+#endif
+               return 1;/* FIXME: check type as well i.e. snv vs indel */
+          }
+     }
+     return 0;
+}
+/* var2_matches() */
+
+
+/* reads next variant of vcf2 into lookahead */
+static void
+vcf2_read_next(vcf2_t *v)
+{
+     int prev_tid = v->next_tid;
+     long int prev_pos = v->next_pos;
+
+     v->next = NULL;
+     vcf_new_var(& v->next);
+     if (vcf_parse_var(& v->vcf, v->next)) {
+          vcf_free_var(& v->next);
+          v->next = NULL;
+          return;
+     }
+     v->next_tid = tbx_name2id(v->tbx, v->next->chrom);
+     v->next_pos = v->next->pos;
+     /* tabix guaranteed sorting when indexing, but the index might
+      * be stale */
+     if (v->next_tid < prev_tid || (v->next_tid == prev_tid && v->next->pos < prev_pos)) {
+          LOG_WARN("%s is not sorted or doesn't match its index. Using index queries only\n", v->path);
+          v->use_merge = 0;
+     }
+}
+/* vcf2_read_next() */
+
+
+static void
+vcf2_clear_cur(vcf2_t *v)
+{
+     int i;
+     for (i=0; i<v->num_cur; i++) {
+          vcf_free_var(& v->cur[i]);
+     }
+     v->num_cur = 0;
+}
+
+
+/* returns 0 on success, non-zero otherwise */
+static int
+vcf2_open(vcf2_t *v, const char *path, int use_merge)
+{
+     memset(v, 0, sizeof(vcf2_t));
+     v->path = strdup(path);
+     if (HAS_BCF_EXT(path)) {
+          /* queries go through tabix */
+          LOG_FATAL("BCF not supported for %s: 2nd VCF input files have to be bgzipped and tabix indexed VCF\n", path);
+          return -1;
+     }
+     v->hts = hts_open(path, "r");
+     if (! v->hts) {
+          LOG_FATAL("Couldn't load %s\n", path);
+          return -1;
+     }
+     v->tbx = tbx_index_load(path);
+     if (! v->tbx) {
+          LOG_FATAL("Couldn't load tabix index for %s\n", path);
+          return -1;
+     }
+
+     v->use_merge = use_merge;
+     v->cur_tid = v->last_tid1 = v->next_tid = -1;
+     v->cur_pos = v->last_pos1 = v->next_pos = -1;
+     if (v->use_merge) {
+          if (vcf_file_open(& v->vcf, path, HAS_GZIP_EXT(path), 'r')) {
+               LOG_ERROR("Couldn't open %s\n", path);
+               return -1;
+          }
+          if (0 != vcf_skip_header(& v->vcf)) {
+               LOG_WARN("skip header failed for %s\n", path);
+          }
+          vcf2_read_next(v);
+     }
+     return 0;
+}
+/* vcf2_open() */
+
+
+static void
+vcf2_close(vcf2_t *v)
+{
+     if (v->vcf.path) {
+          vcf_file_close(& v->vcf);
+     }
+     if (v->next) {
+          vcf_free_var(& v->next);
+     }
+     vcf2_clear_cur(v);
+     free(v->cur);
+     if (v->hts) {
+          hts_close(v->hts);
+     }
+     if (v->tbx) {
+          tbx_destroy(v->tbx);
+     }
+     free(v->path);
+}
+/* vcf2_close() */
+
+
+/* look for var1 in vcf2 with a tabix query. returns 1 if found, 0 if
+ * not found and -1 on error */
+static int
+vcf2_match_index(const vcfset_conf_t *vcfset_conf, vcf2_t *v, const var_t *var1)
+{
+     kstring_t var2_kstr = {0, 0, 0};
+     hts_itr_t *var2_itr = NULL;
+     char regbuf[1024];
+     int var2_match = 0;
+
+     snprintf(regbuf, 1024, "%s:%ld-%ld", var1->chrom, var1->pos+1, var1->pos+1);
+     var2_itr = tbx_itr_querys(v->tbx, regbuf);
+     if (! var2_itr) {
+          return 0;
+     }
+     while (tbx_itr_next(v->hts, v->tbx, var2_itr, &var2_kstr) >= 0) {
+          var_t *var2 = NULL;
+          int rc;
+
+          vcf_new_var(&var2);
+          rc = vcf_parse_var_from_line(var2_kstr.s, var2);
+          if (rc) {
+               LOG_FATAL("%s\n", "Error while parsing variant returned from tabix");
+               tbx_itr_destroy(var2_itr);
+               free(var2_kstr.s);
+               return -1;
+          }
+          /* iterator returns anything overlapping with that
+           * position, i.e. this also includes up/downstream
+           * indels. var2_matches() makes sure actual position matches */
+          var2_match = var2_matches(vcfset_conf, var1, var2);
+          vcf_free_var(&var2);
+          if (var2_match) {
+               break;/* no need to continue */
+          }
+     }
+     tbx_itr_destroy(var2_itr);
+     free(var2_kstr.s);
+     return var2_match;
+}
+/* vcf2_match_index() */
+
+
+/* look for var1 in vcf2 by advancing the stream up to var1's
+ * position. returns 1 if found, 0 if not found and -1 on error */
+static int
+vcf2_match(const vcfset_conf_t *vcfset_conf, vcf2_t *v, const var_t *var1)
+{
+     int tid1;
+     int i;
+
+     if (! v->use_merge) {
+          return vcf2_match_index(vcfset_conf, v, var1);
+     }
+
+     tid1 = tbx_name2id(v->tbx, var1->chrom);
+     if (tid1 < 0) {
+          /* no variants on this chromosome in vcf2 */
+          return 0;
+     }
+     if (tid1 < v->last_tid1 || (tid1 == v->last_tid1 && var1->pos < v->last_pos1)) {
+          LOG_VERBOSE("vcf1 is not sorted like %s. Falling back to index queries\n", v->path);
+          v->use_merge = 0;
+          return vcf2_match_index(vcfset_conf, v, var1);
+     }
+     v->last_tid1 = tid1;
+     v->last_pos1 = var1->pos;
+
+     if (tid1 != v->cur_tid || var1->pos != v->cur_pos) {
+          vcf2_clear_cur(v);
+          while (v->next && v->use_merge &&
+                 (v->next_tid < tid1 || (v->next_tid == tid1 && v->next->pos < var1->pos))) {
+               vcf_free_var(& v->next);
+               vcf2_read_next(v);
+          }
+          while (v->next && v->use_merge &&
+                 v->next_tid == tid1 && v->next->pos == var1->pos) {
+               if (v->num_cur == v->max_cur) {
+                    v->max_cur = v->max_cur ? 2*v->max_cur : 8;
+                    v->cur = realloc(v->cur, v->max_cur * sizeof(var_t *));
+                    if (! v->cur) {
+                         fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                                 __FILE__, __FUNCTION__, __LINE__);
+                         exit(1);
+                    }
+               }
+               v->cur[v->num_cur++] = v->next;
+               vcf2_read_next(v);
+          }
+          if (! v->use_merge) {
+               /* vcf2 itself turned out broken while reading */
+               vcf2_clear_cur(v);
+               return vcf2_match_index(vcfset_conf, v, var1);
+          }
+          v->cur_tid = tid1;
+          v->cur_pos = var1->pos;
+     }
+
+     for (i=0; i<v->num_cur; i++) {
+          if (var2_matches(vcfset_conf, var1, v->cur[i])) {
+               return 1;
+          }
+     }
+     return 0;
+}
+/* vcf2_match() */
+
+
 
 
 int 
@@ -120,8 +395,11 @@ main_vcfset(int argc, char *argv[])
      static int only_snvs = 0;
      static int only_indels = 0;
      static int count_only = 0;
-     tbx_t *vcf2_tbx = NULL; /* index for second vcf file */
-     htsFile *vcf2_hts = NULL;
+     static int no_merge = 0;
+     char **vcf_in2s = NULL; /* all second vcf files */
+     int num_vcf2 = 0;
+     vcf2_t *vcf2s = NULL;
+     int i;
      char *add_info_field = NULL;
      int vcf_concat_findex = 0;
      vcf_in1 = vcf_in2 = vcf_out = NULL;
@@ -152,6 +430,7 @@ main_vcfset(int argc, char *argv[])
               {"only-indels", no_argument, &only_indels, 1},
               {"only-snvs", no_argument, &only_snvs, 1},
               {"count-only", no_argument, &count_only, 1},
+              {"no-merge", no_argument, &no_merge, 1},
 
               {"vcf1", required_argument, NULL, '1'},
               {"vcf2", required_argument, NULL, '2'},
@@ -185,7 +464,11 @@ main_vcfset(int argc, char *argv[])
               break;
 
          case '2': 
-              vcf_in2 = strdup(optarg);
+              if (! vcf_in2) {
+                   vcf_in2 = strdup(optarg);
+              }
+              vcf_in2s = realloc(vcf_in2s, (num_vcf2+1) * sizeof(char *));
+              vcf_in2s[num_vcf2++] = strdup(optarg);
               break;
 
          case 'o':
@@ -293,16 +576,12 @@ main_vcfset(int argc, char *argv[])
          return 1;
     }
 
-    if (vcf_in2) {
-         vcf2_hts = hts_open(vcf_in2, "r");
-         if (!vcf2_hts) {
-              LOG_FATAL("Couldn't load %s\n", vcf_in2);
-              return 1;
-         }
-         vcf2_tbx = tbx_index_load(vcf_in2);
-         if (!vcf2_tbx) {
-              LOG_FATAL("Couldn't load tabix index for %s\n", vcf_in2);
-              return 1;
+    if (num_vcf2) {
+         vcf2s = calloc(num_vcf2, sizeof(vcf2_t));
+         for (i=0; i<num_vcf2; i++) {
+              if (vcf2_open(& vcf2s[i], vcf_in2s[i], ! no_merge)) {
+                   return 1;
+              }
          }
     }
 
@@ -347,10 +626,7 @@ main_vcfset(int argc, char *argv[])
          var_t *var1 = NULL;
          int rc;
          int is_indel;
-         kstring_t var2_kstr = {0, 0, 0};
-         hts_itr_t *var2_itr = NULL;
-         char regbuf[1024];
-         int var2_match = 0;
+         int num_matches = 0;
 
          vcf_new_var(&var1);
          rc = vcf_parse_var(& vcfset_conf.vcf_in1, var1);
@@ -423,75 +699,29 @@ main_vcfset(int argc, char *argv[])
               continue;
          }
 
-         /* use index access to vcf2 */
-         snprintf(regbuf, 1024, "%s:%ld-%ld", var1->chrom, var1->pos+1, var1->pos+1);
-         var2_itr = tbx_itr_querys(vcf2_tbx, regbuf);
-         if (! var2_itr) {
-              var2_match = 0;
-         } else {
-              var2_match = 0;
-              while (tbx_itr_next(vcf2_hts, vcf2_tbx, var2_itr, &var2_kstr) >= 0) {
-                   var_t *var2 = NULL;
-                   int var2_is_indel = 0;
-
-                   vcf_new_var(&var2);
-                   rc = vcf_parse_var_from_line(var2_kstr.s, var2);
-                   /* LOG_FIXME("%d:%s>%s looking at var2 %d:%s>%s (reg %s)\n", 
-                             var1->pos+1, var1->ref, var1->alt,
-                             var2->pos+1, var2->ref, var2->alt, regbuf); */
-                   if (rc) {
-                        LOG_FATAL("%s\n", "Error while parsing variant returned from tabix");
-                        return -1;
-                   }
-
-                   var2_is_indel = vcf_var_is_indel(var2);
-
-                   /* iterator returns anything overlapping with that 
-                    * position, i.e. this also includes up/downstream
-                    * indels, so make sure actual position matches */
-                   if (var1->pos != var2->pos) {
-                        var2_match = 0;
-
-                   } else if (vcfset_conf.only_passed && ! VCF_VAR_PASSES(var2)) {
-                        var2_match = 0;
-
-                   } else if (vcfset_conf.only_snvs && var2_is_indel) {
-                        var2_match = 0;
-
-                   } else if (vcfset_conf.only_indels && ! var2_is_indel) {
-                        var2_match = 0;
-
-                   } else if (vcfset_conf.only_pos) {
-#ifdef TRACE
-                        LOG_DEBUG("Pos match for var2 %s:%d\n", var2->chrom, var2->pos);
-#endif
-                        var2_match = 1;
-
-                   } else {
-                        if (0==strcmp(var1->ref, var2->ref) && 0==strcmp(var1->alt, var2->alt)) {
-#ifdef TRACE
-                             LOG_DEBUG("Full match for var2 %s:%d\n", var2->chrom, var2->pos);
-#endif
-                             var2_match = 1;/* FIXME: check type as well i.e. snv vs indel */                             
-                        }
-                   }
-                   vcf_free_var(&var2);
-                   if (var2_match) {
-                        break;/* no need to continue */
-                   }
+         for (i=0; i<num_vcf2; i++) {
+              int var2_match = vcf2_match(& vcfset_conf, & vcf2s[i], var1);
+              if (var2_match < 0) {
+                   return -1;
+              }
+              num_matches += var2_match;
+              if (vcfset_conf.vcf_setop == SETOP_COMPLEMENT && var2_match) {
+                   break;/* no need to continue */
+              } else if (vcfset_conf.vcf_setop == SETOP_INTERSECT && ! var2_match) {
+                   break;/* no need to continue */
               }
          }
 
          if (vcfset_conf.vcf_setop == SETOP_COMPLEMENT) {
-              /* relative complement : elements in A but not B */
-              if (!var2_match) {
+              /* relative complement : elements in A but not B (nor C...) */
+              if (0 == num_matches) {
                    num_vars_out += 1;
                    if (! count_only) {
                         vcf_write_var(& vcfset_conf.vcf_out, var1);
                    }
               }
          } else if (vcfset_conf.vcf_setop == SETOP_INTERSECT) {
-              if (var2_match) {
+              if (num_matches == num_vcf2) {
                    num_vars_out += 1;
                    if (! count_only) {
                         vcf_write_var(& vcfset_conf.vcf_out, var1);
@@ -504,14 +734,17 @@ main_vcfset(int argc, char *argv[])
          }
 
          vcf_free_var(& var1);
-         tbx_itr_destroy(var2_itr);
     }/* while (1) */
 
     vcf_file_close(& vcfset_conf.vcf_in1);
-    if (vcf_in2) {
-         hts_close(vcf2_hts);
-         tbx_destroy(vcf2_tbx);
+    for (i=0; i<num_vcf2; i++) {
+         LOG_VERBOSE("%s was accessed via %s\n", vcf2s[i].path,
+                     vcf2s[i].use_merge ? "merge-join" : "index queries");
+         vcf2_close(& vcf2s[i]);
+         free(vcf_in2s[i]);
     }
+    free(vcf2s);
+    free(vcf_in2s);
     LOG_VERBOSE("Parsed %d variants from 1st vcf file (ignoring %d non-passed of those)\n", 
                 num_vars_vcf1 + num_vars_vcf1_ign, num_vars_vcf1_ign);
     LOG_VERBOSE("Wrote %d variants to output\n", 
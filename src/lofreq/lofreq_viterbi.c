@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "htslib/faidx.h"
 #include "sam.h"
@@ -38,20 +39,32 @@
 #include "log.h"
 #include "lofreq_viterbi.h"
 #include "utils.h"
+#include "refcache.h"
+#include "bampipe.h"
 
 #define SANGERQUAL_TO_PHRED(c) ((int)(c)-33)
 
 /* FIXME: implement auto clipping of Q2 tails */
 
 #define RWIN 10
+/* slack on either side of the diagonal band spanned by the original
+ * alignment (see viterbi_banded()) */
+#define BAND_PAD (3*RWIN)
 
 typedef struct {
      samfile_t *in;
      bamFile out;
      faidx_t *fai;
+     refcache_t *refcache;
      uint32_t tid;
-     char *ref;
+     const char *ref; /* acquired from refcache */
      int reflen;
+     viterbi_ws_t vws;
+     int del_flag;
+     int q2def;
+     int reclip;
+     long int num_mapped;
+     long int num_passed; /* mapped, but without indels. see viterbi_needs_realn() */
 } tmpstruct_t;
 
 static void replace_cigar(bam1_t *b, int n, uint32_t *cigar)
@@ -103,17 +116,43 @@ void remain(char *bqual, int *remaining){
      }   
 }
 
-static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip)
+/* returns 1 if b's alignment contains an indel, i.e. if realignment
+ * could change it. only looks at the CIGAR. realignment never
+ * introduces indels (or moves reads without any), so for all other
+ * reads viterbi_realn_read() is a no-op apart from removing tags */
+int viterbi_needs_realn(const bam1_t *b)
+{
+     const uint32_t *cigar = bam1_cigar(b);
+     int i;
+
+     for (i = 0; i < b->core.n_cigar; i++) {
+          int op = cigar[i]&0xf;
+          if (op == BAM_CINS || op == BAM_CDEL) {
+               return 1;
+          }
+     }
+     return 0;
+}
+
+
+/* realigns one read in place. refseq (of length reflen) is the
+ * reference sequence of the read's target and only needed for mapped
+ * reads. header is only used for log messages. needs_realn is the
+ * result of viterbi_needs_realn(b), which callers usually need
+ * anyway. returns 0 if the read was realigned or left untouched on
+ * purpose, 1 if it couldn't be handled (and was left untouched) */
+int viterbi_realn_read(bam1_t *b, const int needs_realn,
+                       const char *refseq, int reflen,
+                       const bam_header_t *header, viterbi_ws_t *vws,
+                       int del_flag, int q2def, int reclip)
 {
      /* see
       https://github.com/lh3/bwa/blob/426e54740ca2b9b08e013f28560d01a570a0ab15/ksw.c
       for optimizations and speedups
      */
-     tmpstruct_t *tmp = (tmpstruct_t*)data;
      bam1_core_t *c = &b->core;
      uint8_t *seq = bam1_seq(b);
      uint32_t *cigar = bam1_cigar(b);
-     int reflen;
     
      if (del_flag) {
           uint8_t *old_nm;
@@ -145,22 +184,13 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
      }
 
      if (c->flag & BAM_FUNMAP) {
-          bam_write1(tmp->out, b);
           return 0;
      }
-
-     /* fetch reference sequence if incorrect tid */
-     if (tmp->tid != c->tid) {
-          if (tmp->ref) free(tmp->ref);
-          if ((tmp->ref = 
-               fai_fetch(tmp->fai, tmp->in->header->target_name[c->tid], &reflen)) == 0) {
-               fprintf(stderr, "failed to find reference sequence %s\n", 
-                                tmp->in->header->target_name[c->tid]);
-          }
-          strtoupper(tmp->ref);/* safeguard */
-          tmp->tid = c->tid;
-          tmp->reflen = reflen;
+     /* skip the copying below for the vast majority of reads */
+     if (! needs_realn) {
+          return 0;
      }
+
      int i;
 
      // remove soft clipped bases
@@ -172,6 +202,7 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
      int z = 0; // coordinate on query w/o softclip
 
      int indels = 0;
+     int ins_len = 0, del_len = 0;
 
      // parse cigar string
      for (i = 0; i < c->n_cigar; ++i) {
@@ -187,11 +218,11 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
           } else if (op == BAM_CHARD_CLIP) {
                /* in theory we should do nothing here but hard clipping info gets lost here FIXME
                 */               
-               bam_write1(tmp->out, b);
                return 1;
           } else if (op == BAM_CDEL) {
                x += oplen;
                indels += 1;
+               del_len += oplen;
           } else if (op == BAM_CINS) {
                for (j = 0; j < oplen; j++) {
                     query[z] = bam_nt16_rev_table[bam1_seqi(seq, y)];
@@ -200,20 +231,19 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
                     z++;
                }
                indels += 1;
+               ins_len += oplen;
           } else if (op == BAM_CSOFT_CLIP) {
                for (j = 0; j < oplen; j++) {
                     y++;
                }
           } else {
                LOG_WARN("Unknown cigar op %d. Not touching read %s\n", op, bam1_qname(b));
-               bam_write1(tmp->out, b);
                return 1;
           }
      }
      query[z] = bqual[z] = '\0';
 
      if (indels == 0) {
-          bam_write1(tmp->out, b);
           return 0;
      }
     int len_remaining = 0;
@@ -236,7 +266,6 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
 			
 			replace_cigar(b,c->n_cigar,cigar);
 		}
-        bam_write1(tmp->out, b);
         return 0;
     }
     int remaining[len_remaining+1];
@@ -247,19 +276,22 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
     }
     
      /* get reference with RWIN padding */
-     char ref[c->l_qseq+1+indels+RWIN*2];
+     char ref[x-c->pos+1+RWIN*2];
      int lower = c->pos - RWIN;
      lower = lower < 0? 0: lower;
      int upper = x + RWIN;
-     upper = upper > tmp->reflen? tmp->reflen: upper;
+     upper = upper > reflen? reflen: upper;
      for (z = 0, i = lower; i < upper; z++, i++) {
-          ref[z] = tmp->ref[i];
+          ref[z] = refseq[i];
      }
      ref[z] = '\0';
 
      /* run viterbi */
      char *aln = malloc(sizeof(char)*(2*(c->l_qseq)));
-     int shift = viterbi(ref, query, bqual, aln, q2def);
+     /* band around the original alignment: the first query base is
+      * on diagonal c->pos-lower and indels move it */
+     int shift = viterbi_banded(vws, ref, query, bqual, aln, q2def,
+                                c->pos-lower-ins_len-BAND_PAD, c->pos-lower+del_len+BAND_PAD);
 
      /* convert to cigar */
      uint32_t *realn_cigar = 0;
@@ -315,7 +347,7 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
      if (shift-(c->pos-lower) != 0) {
           LOG_VERBOSE("Read %s with shift of %d at original pos %s:%d\n", 
                       bam1_qname(b), shift-(c->pos-lower),
-                      tmp->in->header->target_name[c->tid], c->pos);
+                      header->target_name[c->tid], c->pos);
           c->pos = c->pos + (shift - (c->pos - lower));
      }
      
@@ -337,12 +369,53 @@ static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip
 		}
 	}
      replace_cigar(b, realn_n_cigar, realn_cigar);
-     bam_write1(tmp->out, b);
      free(aln);
      free(realn_cigar);
      return 0;
 }
 
+static int fetch_func(bam1_t *b, void *data, int del_flag, int q2def, int reclip)
+{
+     tmpstruct_t *tmp = (tmpstruct_t*)data;
+     bam1_core_t *c = &b->core;
+     int reflen;
+     int needs_realn = 0;
+
+     /* fetch reference sequence if incorrect tid. not needed for unmapped reads */
+     if (! (c->flag & BAM_FUNMAP) && tmp->tid != c->tid) {
+          if (tmp->ref) {
+               refcache_release(tmp->refcache, tmp->in->header->target_name[tmp->tid]);
+          }
+          if ((tmp->ref = 
+               refcache_get(tmp->refcache, tmp->in->header->target_name[c->tid], &reflen)) == 0) {
+               fprintf(stderr, "failed to find reference sequence %s\n", 
+                                tmp->in->header->target_name[c->tid]);
+          }
+          tmp->tid = c->tid;
+          tmp->reflen = reflen;
+     }
+     if (! (c->flag & BAM_FUNMAP)) {
+          tmp->num_mapped += 1;
+          needs_realn = viterbi_needs_realn(b);
+          if (! needs_realn) {
+               tmp->num_passed += 1;
+          }
+     }
+     return viterbi_realn_read(b, needs_realn, tmp->ref, tmp->reflen, tmp->in->header, & tmp->vws,
+                               del_flag, q2def, reclip);
+}
+
+
+/* bampipe_func_t for fetch_func(). records not realigned are passed on
+ * unchanged */
+static int viterbi_func(bam1_t *b, void *data)
+{
+     tmpstruct_t *tmp = (tmpstruct_t*)data;
+     fetch_func(b, tmp, tmp->del_flag, tmp->q2def, tmp->reclip);
+     return 0;
+}
+
+
 static void usage()
 {
      fprintf(stderr, "Usage: lofreq viterbi [options] in.bam\n");
@@ -356,6 +429,7 @@ static void usage()
      fprintf(stderr, "                         FILE HAS TO BE PREVIOUSLY UNCLIPPED!!!\n");
 #endif
      fprintf(stderr, "     -o | --out FILE     Output BAM file [- = stdout = default]\n");
+     fprintf(stderr, "          --threads INT  Number of threads for realignment and compression [1]\n");
      fprintf(stderr, "          --verbose      Be verbose\n");
      fprintf(stderr, "\n");
      fprintf(stderr, "NOTE: Output BAM file will (likely) be unsorted (use samtools sort, e.g. lofreq viterbi ... | samtools sort -')\n");
@@ -368,8 +442,15 @@ int main_viterbi(int argc, char *argv[])
      static int del_flag = 1;
      static int q2default = -1;
 	 static int reclip = 0;
+     static int no_band = 0;
      char *bam_out = NULL;
-     bam1_t *b = NULL;
+     char *ref_fa = NULL;
+     int num_threads = 1;
+     int rc = 0;
+     long int num_mapped = 0, num_passed = 0;
+     tmpstruct_t *wtmp;
+     void **wdata;
+     int i;
  
      if (argc == 2) {
           usage();
@@ -386,6 +467,9 @@ int main_viterbi(int argc, char *argv[])
 			   {"reclip",	no_argument, NULL, 'r'},
                {"out", required_argument, NULL, 'o'},
                {"defqual", required_argument, NULL, 'q'},
+               {"threads", required_argument, NULL, 't'}, /* long only */
+               /* full matrix instead of a band. for testing only (see tests/viterbi.sh) */
+               {"no-band", no_argument, &no_band, 1},
                {0,0,0,0}
           };
           
@@ -404,6 +488,8 @@ int main_viterbi(int argc, char *argv[])
                     return 1;
                }
                tmp.fai = fai_load(optarg);	
+               free(ref_fa);
+               ref_fa = strdup(optarg);
                break;
           case 'k':
                del_flag = 0;
@@ -423,6 +509,13 @@ int main_viterbi(int argc, char *argv[])
                }
                bam_out = strdup(optarg);
                break;
+          case 't':
+               num_threads = atoi(optarg);
+               if (num_threads < 1) {
+                    LOG_FATAL("%s\n", "Number of threads has to be at least one");
+                    return 1;
+               }
+               break;
           case '?':
                LOG_FATAL("%s\n", "Unrecognized arguments found. Exiting\n");
                usage();
@@ -454,24 +547,60 @@ int main_viterbi(int argc, char *argv[])
      } else {
           tmp.out = bam_open(bam_out, "w");
      }
+     if (num_threads > 1 && bgzf_mt(tmp.out, num_threads, 256)) {
+          LOG_WARN("%s\n", "Couldn't enable multi-threaded compression");
+     }
      bam_header_write(tmp.out, tmp.in->header);
      
-     b = bam_init1();
      tmp.tid = -1;
      tmp.ref = 0;
-     while (samread(tmp.in, b) >= 0){
-          fetch_func(b, &tmp, del_flag, q2default, reclip);
+     tmp.refcache = refcache_new(tmp.fai, REFCACHE_DEFAULT_MAX_BYTES);
+     refcache_open_store(tmp.refcache, ref_fa);
+     tmp.del_flag = del_flag;
+     tmp.q2def = q2default;
+     tmp.reclip = reclip;
+
+     /* one copy per thread, sharing input, output and refcache */
+     wtmp = malloc(num_threads * sizeof(tmpstruct_t));
+     wdata = malloc(num_threads * sizeof(void *));
+     if (! wtmp || ! wdata) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
      }
-     bam_destroy1(b);
-     
+     for (i = 0; i < num_threads; i++) {
+          memcpy(& wtmp[i], & tmp, sizeof(tmpstruct_t));
+          viterbi_ws_init(& wtmp[i].vws);
+          wtmp[i].vws.no_band = no_band;
+          wdata[i] = & wtmp[i];
+     }
+
+     if (bampipe_run(tmp.in, bampipe_write_bam, tmp.out, viterbi_func,
+                     wdata, num_threads) < 0) {
+          LOG_ERROR("%s\n", "Realignment failed");
+          rc = 1;
+     }
+
+     for (i = 0; i < num_threads; i++) {
+          if (wtmp[i].ref) {
+               refcache_release(wtmp[i].refcache, wtmp[i].in->header->target_name[wtmp[i].tid]);
+          }
+          viterbi_ws_free(& wtmp[i].vws);
+          num_mapped += wtmp[i].num_mapped;
+          num_passed += wtmp[i].num_passed;
+     }
+     LOG_VERBOSE("%ld mapped reads, of which %ld had no indels and were passed through without realignment\n",
+                 num_mapped, num_passed);
+     free(wtmp);
+     free(wdata);
      samclose(tmp.in);
      bam_close(tmp.out);
-     if (tmp.ref)
-          free(tmp.ref);
+     refcache_free(tmp.refcache);
      fai_destroy(tmp.fai);
+     free(ref_fa);
      free(bam_out);
 
      LOG_VERBOSE("%s\n", "NOTE: Output BAM file will be unsorted (use samtools sort, e.g. samtools sort -')");
 
-     return 0;
+     return rc;
 }
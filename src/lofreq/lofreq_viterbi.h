@@ -29,7 +29,19 @@
 #ifndef LOFREQ_VITERBI_FILE
 #define LOFREQ_VITERBI_FILE
 
+#include "sam.h"
+#include "viterbi.h"
+
 /* funcion prototypes here */
 int main_viterbi(int argc, char *argv[]);
 
+/* 1 if b contains an indel, i.e. if viterbi_realn_read() could
+ * change its alignment */
+int viterbi_needs_realn(const bam1_t *b);
+
+int viterbi_realn_read(bam1_t *b, const int needs_realn,
+                       const char *refseq, int reflen,
+                       const bam_header_t *header, viterbi_ws_t *vws,
+                       int del_flag, int q2def, int reclip);
+
 #endif
@@ -33,6 +33,9 @@
 #include <math.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <assert.h>
 
 /* lofreq includes */
 #include "utils.h"
@@ -188,6 +191,284 @@ fdr(double data[], long int size, double alpha, long int num_tests, long int **i
      return nrejected;
 }
 
+/* Histogram of phred-scaled pvalues used by the *_phred() variants
+ * below. Since pvalues are always derived from integer qualities,
+ * sorting them is the same as counting them per quality and walking
+ * the histogram from highest to lowest quality, i.e. in order of
+ * increasing pvalue. INT_MAX (which PHREDQUAL_TO_PROB() maps to
+ * DBL_MIN) is kept separately to not blow up the range and merged in
+ * at its proper position.
+ */
+#define MTC_PHRED_MIN_RANGE (1<<16)
+
+typedef struct {
+     int min_q, max_q;
+     long int *counts; /* of size max_q-min_q+1 */
+     long int num_missing; /* INT_MAX */
+} phred_hist_t;
+
+/* bucket iterator, i.e. one bucket per distinct pvalue in increasing
+ * order. bucket index of INT_MAX is -1 */
+typedef struct {
+     const phred_hist_t *h;
+     int missing_done; /* INT_MAX bucket already returned */
+     int q; /* next quality to look at */
+} phred_hist_iter_t;
+
+
+/* returns -1 if range is too large for a histogram (caller should
+ * fall back to sorting) or on error, 0 otherwise */
+static int
+phred_hist_build(phred_hist_t *h, const int quals[], long int size)
+{
+     long int i;
+     long int range;
+
+     memset(h, 0, sizeof(phred_hist_t));
+     h->min_q = INT_MAX;
+     h->max_q = INT_MIN;
+     for (i=0; i<size; i++) {
+          if (quals[i] == INT_MAX) {
+               h->num_missing += 1;
+               continue;
+          }
+          if (quals[i] < h->min_q) {
+               h->min_q = quals[i];
+          }
+          if (quals[i] > h->max_q) {
+               h->max_q = quals[i];
+          }
+     }
+     if (h->num_missing == size) {
+          h->min_q = h->max_q = 0;
+     }
+
+     range = (long int)h->max_q - (long int)h->min_q + 1;
+     if (range < 1 || (range > MTC_PHRED_MIN_RANGE && range > 2*size)) {
+          return -1;
+     }
+     if (NULL == (h->counts = calloc(range, sizeof(long int)))) {
+          return -1;
+     }
+     for (i=0; i<size; i++) {
+          if (quals[i] != INT_MAX) {
+               h->counts[quals[i] - h->min_q] += 1;
+          }
+     }
+     return 0;
+}
+
+
+static void
+phred_hist_iter_init(phred_hist_iter_t *it, const phred_hist_t *h)
+{
+     it->h = h;
+     it->missing_done = h->num_missing ? 0 : 1;
+     it->q = h->max_q;
+}
+
+
+/* returns 0 if exhausted. otherwise sets bucket index (qual-min_q or
+ * -1 for INT_MAX), pvalue and count of next bucket */
+static int
+phred_hist_iter_next(phred_hist_iter_t *it, long int *bucket, double *p, long int *count)
+{
+     const phred_hist_t *h = it->h;
+
+     while (it->q >= h->min_q && 0 == h->counts[it->q - h->min_q]) {
+          it->q -= 1;
+     }
+
+     if (! it->missing_done) {
+          /* DBL_MIN goes before any quality with a higher pvalue */
+          if (it->q < h->min_q || PHREDQUAL_TO_PROB(it->q) >= DBL_MIN) {
+               it->missing_done = 1;
+               *bucket = -1;
+               *p = PHREDQUAL_TO_PROB(INT_MAX);
+               *count = h->num_missing;
+               return 1;
+          }
+     }
+     if (it->q < h->min_q) {
+          return 0;
+     }
+     *bucket = it->q - h->min_q;
+     *p = PHREDQUAL_TO_PROB(it->q);
+     *count = h->counts[it->q - h->min_q];
+     it->q -= 1;
+     return 1;
+}
+
+
+/* Same as holm_bonf_corr(), but for pvalues given as phred-scaled
+ * integer qualities (converted with PHREDQUAL_TO_PROB), which avoids
+ * the sort and works in linear time. Uncorrected or corrected
+ * pvalues are written to data, which is of size size as well.
+ *
+ * Results are identical to holm_bonf_corr() on the converted values
+ * (pvalues within DBL_EPSILON of each other, which dbl_cmp treats as
+ * equal, are taken in their true order here but in whatever order
+ * qsort leaves them there). Falls back to holm_bonf_corr() if the
+ * range of qualities is too large.
+ */
+void
+holm_bonf_corr_phred(double data[], const int quals[], long int size, double alpha, long int num_tests)
+{
+     phred_hist_t h;
+     phred_hist_iter_t it;
+     double *corr = NULL; /* corrected value per bucket */
+     double corr_missing = 0.0;
+     long int bucket, count;
+     long int rank = 0;
+     long int lp;
+     double p, pp = 0.0, tp;
+     int first = 1;
+     long int i;
+
+     if (size < 1) {
+          return;
+     }
+     if (phred_hist_build(&h, quals, size)
+         || NULL == (corr = malloc((h.max_q - h.min_q + 1) * sizeof(double)))) {
+          free(h.counts);
+          for (i=0; i<size; i++) {
+               data[i] = PHREDQUAL_TO_PROB(quals[i]);
+          }
+          holm_bonf_corr(data, size, alpha, num_tests);
+          return;
+     }
+
+     if (num_tests<1) {
+          lp = size;
+     } else {
+          lp = num_tests;
+     }
+
+     phred_hist_iter_init(&it, &h);
+     while (phred_hist_iter_next(&it, &bucket, &p, &count)) {
+          double c;
+          /* see holm_bonf_corr(): lp is only updated if the pvalue
+           * differs from the first one of the current group */
+          if (first) {
+               pp = p;
+               first = 0;
+          } else if (dbl_cmp(&p, &pp) != 0) {
+               if (num_tests<1) {
+                    lp = size-rank;
+               } else {
+                    lp = num_tests-rank;
+               }
+               pp = p;
+          }
+          tp = p * 1. / lp;
+          if (dbl_cmp(&tp, &alpha) < 0) {
+               c = p * lp;
+          } else {
+               c = p;
+          }
+          if (bucket < 0) {
+               corr_missing = c;
+          } else {
+               corr[bucket] = c;
+          }
+          rank += count;
+     }
+
+     for (i=0; i<size; i++) {
+          if (quals[i] == INT_MAX) {
+               data[i] = corr_missing;
+          } else {
+               data[i] = corr[quals[i] - h.min_q];
+          }
+     }
+     free(corr);
+     free(h.counts);
+}
+
+
+/* Same as fdr(), but for pvalues given as phred-scaled integer
+ * qualities (converted with PHREDQUAL_TO_PROB), which avoids the sort
+ * and works in linear time. Rejected indices are returned in
+ * increasing index order (fdr() returns them in order of pvalues).
+ * See holm_bonf_corr_phred() regarding identity of results. Falls
+ * back to fdr() if the range of qualities is too large.
+ */
+long int
+fdr_phred(const int quals[], long int size, double alpha, long int num_tests, long int **irejected)
+{
+     phred_hist_t h;
+     phred_hist_iter_t it;
+     long int bucket, count;
+     long int rank = 0;
+     long int nrejected = 0;
+     long int n;
+     double p;
+     double p_thresh = 0.0; /* all pvalues up to and incl. this one are rejected */
+     long int bucket_thresh = 0;
+     long int i, j;
+
+     *irejected = NULL;
+     if (size < 1) {
+          return 0;
+     }
+     if (phred_hist_build(&h, quals, size)) {
+          double *data;
+          free(h.counts);
+          if (NULL == (data = malloc(size * sizeof(double)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          for (i=0; i<size; i++) {
+               data[i] = PHREDQUAL_TO_PROB(quals[i]);
+          }
+          nrejected = fdr(data, size, alpha, num_tests, irejected);
+          free(data);
+          return nrejected;
+     }
+
+     if (num_tests<1) {
+          n = size;
+     } else {
+          n = num_tests;
+     }
+
+     /* largest rank m with p(m) < alpha * (m/M). the condition is
+      * monotonous in the rank for one pvalue, so it's enough to check
+      * the last rank of each bucket */
+     phred_hist_iter_init(&it, &h);
+     while (phred_hist_iter_next(&it, &bucket, &p, &count)) {
+          rank += count;
+          if (p < (alpha*rank/(float)n)) {
+               nrejected = rank;
+               p_thresh = p;
+               bucket_thresh = bucket;
+          }
+     }
+
+     if (nrejected) {
+          (*irejected) = (long int*) malloc(nrejected * sizeof(long int));
+          j = 0;
+          for (i=0; i<size; i++) {
+               int rej;
+               if (quals[i] == INT_MAX) {
+                    rej = (bucket_thresh == -1 || PHREDQUAL_TO_PROB(INT_MAX) <= p_thresh);
+               } else if (bucket_thresh == -1) {
+                    rej = (PHREDQUAL_TO_PROB(quals[i]) < p_thresh);
+               } else {
+                    rej = (quals[i] - h.min_q >= bucket_thresh);
+               }
+               if (rej) {
+                    (*irejected)[j++] = i;
+               }
+          }
+          assert(j == nrejected);
+     }
+     free(h.counts);
+     return nrejected;
+}
+
+
 int
 mtc_str_to_type(char *t) {
      if (0 == strcmp(t, "bonf") || 0 == strcmp(t, "bonferroni")) {
@@ -58,6 +58,12 @@ holm_bonf_corr(double data[], long int size, double alpha, long int num_tests);
 long int
 fdr(double data[], long int size, double alpha, long int num_tests, long int **irejected);
 
+void
+holm_bonf_corr_phred(double data[], const int quals[], long int size, double alpha, long int num_tests);
+
+long int
+fdr_phred(const int quals[], long int size, double alpha, long int num_tests, long int **irejected);
+
 int
 mtc_str_to_type(char *t);
 
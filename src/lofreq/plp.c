@@ -35,8 +35,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fenv.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "htslib/kstring.h"
+#include "htslib/bgzf.h"
 #include "sam.h"
 
 #include "log.h"
@@ -45,6 +48,11 @@
 #include "samutils.h"
 #include "snpcaller.h"
 #include "bam_md_ext.h"
+#include "refcache.h"
+#include "qualcache.h"
+#include "profile.h"
+#include "readahead.h"
+#include "bamstats.h"
 
 /* bam_md.c
 const char bam_nt16_nt4_table[] = { 4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4 };
@@ -59,6 +67,10 @@ int missing_baq_warning_printed = 0;
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
 int bed_overlap(const void *_h, const char *chr, int beg, int end);
+void *bed_tidx_init(const void *_h, int n_targets, char * const *target_names);
+void bed_tidx_destroy(void *_t);
+int bed_tidx_overlap(const void *_t, int tid, int beg, int end);
+int bed_tidx_next(const void *_t, int tid, int pos, int *beg, int *end);
 
 /* From the SAM spec: "tags starting with `X', `Y' and `Z' or tags
  * containing lowercase letters in either position are reserved for
@@ -66,6 +78,39 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end);
 */
 #define SRC_QUAL_TAG "sq"
 
+/* aux tags needed per read in compile_plp_col() are looked up once
+ * in mplp_func() and their offsets (+1; 0 = missing) are kept in an
+ * aux_cache_t owned by the file's mplp_aux_t, so that they don't have
+ * to be searched for in the aux block for every column a read
+ * covers. the pileup works on copies of the records, so entries are
+ * found via b->id, which mplp_func() sets and bam_copy1() keeps. see
+ * aux_cache_add() and aux_cache_get() */
+enum {
+     AUX_CACHE_BI = 0,
+     AUX_CACHE_BD,
+     AUX_CACHE_AI,
+     AUX_CACHE_AD,
+     AUX_CACHE_BAQ,
+     AUX_CACHE_SQ,
+     NUM_AUX_CACHE
+};
+/* power of two. grown while reads in a slot might still be in the pileup */
+#define AUX_CACHE_INIT_SIZE 1024
+#define AUX_CACHE_MAX_SIZE (1<<20)
+
+typedef struct {
+     uint64_t id; /* 0: unused */
+     int32_t tid, pos, end; /* end: leftmost position after the read */
+     int l_data; /* for validation against the copy in the pileup */
+     uint32_t off[NUM_AUX_CACHE];
+} aux_cache_entry_t;
+
+typedef struct {
+     aux_cache_entry_t *entries; /* indexed by id & (size-1) */
+     int size;
+     uint64_t last_id;
+} aux_cache_t;
+
 /* results on icga dream syn1.2 suggest that somatic calls made extra
  * with this settings are likely fp whereas the ones missing a likely
  * tp, therefore disabled */
@@ -91,13 +136,65 @@ const unsigned char bam_nt4_table[256] = {
      4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
 };
 
+/* Memo for source_qual(). The poisson-binomial result only depends on
+ * the multiset of error probs and the number of non-matches and since
+ * qualities are discrete this canonical form (number of non-matches
+ * plus histogram of qualities) repeats across many reads. Also holds
+ * scratch buffers reused between calls. One per mplp_aux_t, i.e. not
+ * shared between threads.
+ */
+#define SQ_MEMO_MAX_ENTRIES 100000
+#define SQ_MEMO_NUM_QUALS 256
+
+typedef struct {
+     int *key; /* num_non_matches, then (qual, count) pairs by decreasing qual */
+     int key_len; /* in bytes */
+     int src_qual;
+     UT_hash_handle hh;
+} sq_memo_entry_t;
+
+typedef struct {
+     sq_memo_entry_t *table;
+     int num_entries;
+     int *op_quals[NUM_OP_CATS];
+     int op_quals_cap;
+     double *err_probs;
+     int err_probs_cap;
+     int key[3+2*SQ_MEMO_NUM_QUALS]; /* scratch for key of current read */
+} sq_memo_t;
+
+/* an index query derived from bed regions. see bed_queries_init() */
 typedef struct {
-     bamFile fp;
-     bam_iter_t iter;
+     int tid, beg, end;
+} bed_query_t;
+
+typedef struct {
+     htsFile *fp; /* BAM or CRAM */
+     hts_itr_t *iter;
+     hts_idx_t *iter_idx; /* index iter was created from, if owned. kept until the end, since CRAM iterators need it */
      bam_header_t *h;
      int ref_id;
-     char *ref;
+     const char *ref; /* acquired from refcache (own reference) */
+     refcache_t *refcache;
+     kpa_ext_ws_t realn_ws; /* reused by bam_prob_realn_core_ext() */
+     sq_memo_t sq_memo; /* reused by source_qual() */
+     qual_cache_t *qcache; /* optional alignment quality cache to read from */
+     int64_t voff; /* virtual file offset at end of last read returned */
+     int sq; /* source quality of last read returned or QUAL_CACHE_NO_SQ */
+     const void *bed_tidx; /* optional. conf->bed resolved against h (shared). if NULL conf->bed is used */
+     /* if set, reads are fetched via these index queries (derived
+      * from bed) one after another, instead of streaming the whole
+      * file */
+     bed_query_t *bed_queries;
+     int num_bed_queries, cur_bed_query;
+     hts_idx_t *bed_idx;
+     int bed_idx_owned;
      const mplp_conf_t *conf;
+     readahead_t *readahead; /* optional. if set, records come from here instead of fp (see mplp_read()) */
+     bamstats_t *bamstats; /* optional. local side pass counts for conf->bamstats */
+     aux_cache_t aux_cache; /* aux offsets of reads returned. see aux_cache_add() */
+     int error; /* set by mplp_func() on errors that should fail the pileup */
+     int stats_tid, stats_beg, stats_end; /* only reads starting in here are counted. stats_tid < 0: all */
 } mplp_aux_t;
 
 typedef struct {
@@ -122,6 +219,9 @@ void init_mplp_conf(mplp_conf_t *c)
      c->min_plp_bq = DEFAULT_MIN_PLP_BQ;/* note: different from DEFAULT_MIN_BQ */
      c->min_plp_idq = DEFAULT_MIN_PLP_IDQ;
      c->max_depth = DEFAULT_MAX_PLP_DEPTH;
+     c->ds_depth = 0;
+     c->ds_seed = DEFAULT_DS_SEED;
+     c->io_threads = 0;
      c->flag = MPLP_NO_ORPHAN | MPLP_BAQ | MPLP_EXT_BAQ | MPLP_IDAQ;
 }
 
@@ -137,6 +237,148 @@ base_count(const plp_col_t *p, char base)
 
 
 
+#define PLP_QUAL_HIST_MIN_SLOTS 64
+/* values are stored as value+1 in 16 bits for hashing */
+#define PLP_QUAL_HIST_MAX_VAL 65534
+
+
+static void
+plp_qual_hist_init(plp_qual_hist_t *h)
+{
+     memset(h, 0, sizeof(plp_qual_hist_t));
+}
+/* plp_qual_hist_init() */
+
+
+static void
+plp_qual_hist_free(plp_qual_hist_t *h)
+{
+     free(h->tuples);
+     free(h->slots);
+     plp_qual_hist_init(h);
+}
+/* plp_qual_hist_free() */
+
+
+static uint64_t
+plp_qual_hist_key(const int bq, const int baq, const int mq, const int sq)
+{
+     return ((uint64_t)(bq+1) << 48) | ((uint64_t)(baq+1) << 32)
+          | ((uint64_t)(mq+1) << 16) | (uint64_t)(sq+1);
+}
+/* plp_qual_hist_key() */
+
+
+static int
+plp_qual_hist_slot(const plp_qual_hist_t *h, const uint64_t key)
+{
+     uint64_t x = key * 0x9E3779B97F4A7C15ULL;
+     return (int) ((x >> 32) & (uint64_t)(h->num_slots-1));
+}
+/* plp_qual_hist_slot() */
+
+
+/* clears only the slots in use, i.e. cost is independent of the
+ * largest column seen. in reverse order of insertion, so that probe
+ * sequences stay intact while clearing */
+static void
+plp_qual_hist_reset(plp_qual_hist_t *h)
+{
+     int i;
+
+     for (i=h->n-1; i>=0; i--) {
+          const plp_qual_tuple_t *t = & h->tuples[i];
+          int s = plp_qual_hist_slot(h, plp_qual_hist_key(t->bq, t->baq, t->mq, t->sq));
+          while (h->slots[s] != i+1) {
+               s = (s+1) & (h->num_slots-1);
+          }
+          h->slots[s] = 0;
+     }
+     h->n = 0;
+     h->total = 0;
+}
+/* plp_qual_hist_reset() */
+
+
+/* rehashes all tuples into num_slots slots. non-zero on error */
+static int
+plp_qual_hist_rehash(plp_qual_hist_t *h, const int num_slots)
+{
+     int *slots;
+     int i;
+
+     if (NULL == (slots = calloc(num_slots, sizeof(int)))) {
+          return 1;
+     }
+     free(h->slots);
+     h->slots = slots;
+     h->num_slots = num_slots;
+     for (i=0; i<h->n; i++) {
+          const plp_qual_tuple_t *t = & h->tuples[i];
+          int s = plp_qual_hist_slot(h, plp_qual_hist_key(t->bq, t->baq, t->mq, t->sq));
+          while (h->slots[s]) {
+               s = (s+1) & (h->num_slots-1);
+          }
+          h->slots[s] = i+1;
+     }
+     return 0;
+}
+/* plp_qual_hist_rehash() */
+
+
+/* counts tuple. returns non-zero if values are out of range or on
+ * allocation failure, i.e. if the caller has to store them otherwise */
+static int
+plp_qual_hist_add(plp_qual_hist_t *h, const int bq, const int baq, const int mq, const int sq)
+{
+     uint64_t key;
+     int s;
+
+     if (bq < -1 || bq > PLP_QUAL_HIST_MAX_VAL || baq < -1 || baq > PLP_QUAL_HIST_MAX_VAL
+         || mq < -1 || mq > PLP_QUAL_HIST_MAX_VAL || sq < -1 || sq > PLP_QUAL_HIST_MAX_VAL) {
+          return 1;
+     }
+     /* load factor at most 1/2 */
+     if (2*(h->n+1) > h->num_slots) {
+          if (plp_qual_hist_rehash(h, h->num_slots ? 2*h->num_slots : PLP_QUAL_HIST_MIN_SLOTS)) {
+               return 1;
+          }
+     }
+
+     key = plp_qual_hist_key(bq, baq, mq, sq);
+     s = plp_qual_hist_slot(h, key);
+     while (h->slots[s]) {
+          plp_qual_tuple_t *t = & h->tuples[h->slots[s]-1];
+          if (t->bq == bq && t->baq == baq && t->mq == mq && t->sq == sq) {
+               t->count += 1;
+               h->total += 1;
+               return 0;
+          }
+          s = (s+1) & (h->num_slots-1);
+     }
+
+     if (h->n == h->size) {
+          int size = h->size ? 2*h->size : PLP_QUAL_HIST_MIN_SLOTS/2;
+          plp_qual_tuple_t *tuples = realloc(h->tuples, size * sizeof(plp_qual_tuple_t));
+          if (NULL == tuples) {
+               return 1;
+          }
+          h->tuples = tuples;
+          h->size = size;
+     }
+     h->tuples[h->n].bq = bq;
+     h->tuples[h->n].baq = baq;
+     h->tuples[h->n].mq = mq;
+     h->tuples[h->n].sq = sq;
+     h->tuples[h->n].count = 1;
+     h->n += 1;
+     h->slots[s] = h->n;
+     h->total += 1;
+     return 0;
+}
+/* plp_qual_hist_add() */
+
+
 void
 plp_col_init(plp_col_t *p) {
     int i;
@@ -144,10 +386,14 @@ plp_col_init(plp_col_t *p) {
     const int grow_by_size = 1000;
 
     p->target =  NULL;
+    p->tid = -1;
+    p->ds_keep = NULL;
+    p->ds_keep_size = 0;
     p->pos = -INT_MAX;
     p->ref_base = '\0';
     p->cons_base[0] = 'N'; p->cons_base[1] = '\0';
     p->coverage_plp = 0;
+    p->ds_frac = 1.0;
     p->num_bases = 0;
     p->num_ign_indels = 0;
     p->num_non_indels = 0;
@@ -162,6 +408,7 @@ plp_col_init(plp_col_t *p) {
          p->fw_counts[i] = 0;
          p->rv_counts[i] = 0;
     }
+    plp_qual_hist_init(& p->ref_hist);
 
     p->num_heads = p->num_tails = 0;
 
@@ -170,12 +417,65 @@ plp_col_init(plp_col_t *p) {
     int_varray_init(& p->ins_map_quals, 0);
     int_varray_init(& p->ins_source_quals, 0);
     p->ins_event_counts = NULL;
+    p->ins_event_pool = NULL;
 
     p->num_dels = p->sum_dels = 0;
     int_varray_init(& p->del_quals, 0);
     int_varray_init(& p->del_map_quals, 0);
     int_varray_init(& p->del_source_quals, 0);
     p->del_event_counts = NULL;
+    p->del_event_pool = NULL;
+
+    p->non_ins_fw_rv[0] = p->non_ins_fw_rv[1] = 0;
+    p->non_del_fw_rv[0] = p->non_del_fw_rv[1] = 0;
+
+    p->has_indel_aqs = 0;
+    p->hrun = 0;
+}
+
+
+/* same as plp_col_init() but keeps memory allocated for quality
+ * arrays so that the column can be reused without any
+ * malloc traffic. plp_col_init() must have been called before once
+ */
+void
+plp_col_reset(plp_col_t *p) {
+    int i;
+
+    p->pos = -INT_MAX;
+    p->ref_base = '\0';
+    p->cons_base[0] = 'N'; p->cons_base[1] = '\0';
+    p->coverage_plp = 0;
+    p->ds_frac = 1.0;
+    p->num_bases = 0;
+    p->num_ign_indels = 0;
+    p->num_non_indels = 0;
+    for (i=0; i<NUM_NT4; i++) {
+         p->base_quals[i].n = 0;
+         p->baq_quals[i].n = 0;
+         p->map_quals[i].n = 0;
+         p->source_quals[i].n = 0;
+#ifdef USE_ALNERRPROF
+         p->alnerr_qual[i].n = 0;
+#endif
+         p->fw_counts[i] = 0;
+         p->rv_counts[i] = 0;
+    }
+    plp_qual_hist_reset(& p->ref_hist);
+
+    p->num_heads = p->num_tails = 0;
+
+    p->num_ins = p->sum_ins = 0;
+    p->ins_quals.n = 0;
+    p->ins_map_quals.n = 0;
+    p->ins_source_quals.n = 0;
+    recycle_ins_event_counts(&p->ins_event_counts, &p->ins_event_pool);
+
+    p->num_dels = p->sum_dels = 0;
+    p->del_quals.n = 0;
+    p->del_map_quals.n = 0;
+    p->del_source_quals.n = 0;
+    recycle_del_event_counts(&p->del_event_counts, &p->del_event_pool);
 
     p->non_ins_fw_rv[0] = p->non_ins_fw_rv[1] = 0;
     p->non_del_fw_rv[0] = p->non_del_fw_rv[1] = 0;
@@ -189,7 +489,7 @@ void
 plp_col_free(plp_col_t *p) {
     int i;
 
-    free(p->target);
+    free(p->ds_keep);
     for (i=0; i<NUM_NT4; i++) {
          int_varray_free(& p->base_quals[i]);
          int_varray_free(& p->baq_quals[i]);
@@ -199,6 +499,7 @@ plp_col_free(plp_col_t *p) {
          int_varray_free(& p->alnerr_qual[i]);
 #endif
     }
+    plp_qual_hist_free(& p->ref_hist);
 
     int_varray_free(& p->ins_quals);
     int_varray_free(& p->ins_map_quals);
@@ -209,6 +510,8 @@ plp_col_free(plp_col_t *p) {
 
     destruct_ins_event_counts(&p->ins_event_counts);
     destruct_del_event_counts(&p->del_event_counts);
+    free_ins_event_pool(&p->ins_event_pool);
+    free_del_event_pool(&p->del_event_pool);
 }
 
 
@@ -228,6 +531,9 @@ void plp_col_debug_print(const plp_col_t *p, FILE *stream)
      fprintf(stream, " heads:%d tails:%d", p->num_heads, p->num_tails);
      fprintf(stream, " ins:%d del:%d", p->num_ins, p->num_dels);
      fprintf(stream, " hrun=%d", p->hrun);
+     if (p->ref_hist.total) {
+          fprintf(stream, " ref_hist:%ld/%d", p->ref_hist.total, p->ref_hist.n);
+     }
      fprintf(stream, "\n");
 
 #if 0
@@ -285,8 +591,13 @@ dump_mplp_conf(const mplp_conf_t *c, FILE *stream)
      fprintf(stream, "  flag & MPLP_REDO_IDAQ = %d\n", c->flag & MPLP_REDO_IDAQ ? 1:0);
      fprintf(stream, "  flag & MPLP_USE_SQ     = %d\n", c->flag & MPLP_USE_SQ ? 1:0);
      fprintf(stream, "  flag & MPLP_ILLUMINA13 = %d\n", c->flag & MPLP_ILLUMINA13 ? 1:0);
+     fprintf(stream, "  flag & MPLP_ALT_ONLY   = %d\n", c->flag & MPLP_ALT_ONLY ? 1:0);
+     fprintf(stream, "  flag & MPLP_REF_HIST   = %d\n", c->flag & MPLP_REF_HIST ? 1:0);
 
      fprintf(stream, "  max_depth    = %d\n", c->max_depth);
+     fprintf(stream, "  ds_depth     = %d\n", c->ds_depth);
+     fprintf(stream, "  ds_seed      = %u\n", c->ds_seed);
+     fprintf(stream, "  io_threads   = %d\n", c->io_threads);
      fprintf(stream, "  min_plp_bq   = %d\n", c->min_plp_bq);
      fprintf(stream, "  min_plp_idq  = %d\n", c->min_plp_idq);
      fprintf(stream, "  def_nm_q     = %d\n", c->def_nm_q);
@@ -302,48 +613,95 @@ dump_mplp_conf(const mplp_conf_t *c, FILE *stream)
 
 
 
-static var_hash_t *source_qual_ign_vars_hash = NULL; /* must be declared NULL ! */
+/* positions of variants to ignore for source quality computation.
+ * one sorted array of unique positions per chromosome, which is a lot
+ * smaller than string keys for each variant and can be queried without
+ * any allocation (see ign_list_get() and ign_list_has_pos()).
+ */
+struct ign_pos_s {
+     char *chrom; /* key */
+     int *pos; /* zero-based. sorted and unique after loading */
+     int n, m;
+     UT_hash_handle hh;
+};
 
+static ign_pos_t *source_qual_ign_pos = NULL; /* must be declared NULL ! */
+static long int source_qual_num_ign_pos = 0; /* sum of n over all chromosomes */
 
-int
-var_in_ign_list(var_t *var) {
-     char *key = NULL;
-     var_hash_t *match = NULL;
 
-     /* using key_pos_only i.e. chrom and pos only
-      *
-      * NOTE: source quality will pass down fake vars without ref and
-      * alt so only vcf_var_key_pos_only will work!
-      */
-     vcf_var_key_pos_only(&key, var);
-     HASH_FIND_STR(source_qual_ign_vars_hash, key, match);
-     free(key);
+const ign_pos_t *
+ign_list_get(const char *chrom)
+{
+     ign_pos_t *list = NULL;
 
-     if (NULL == match) {
+     if (NULL == source_qual_ign_pos) {
+          return NULL;
+     }
+     HASH_FIND_STR(source_qual_ign_pos, chrom, list);
+     return list;
+}
+/* ign_list_get() */
+
+
+int
+ign_list_has_pos(const ign_pos_t *list, const long int pos)
+{
+     int lo = 0, hi;
+
+     if (NULL == list) {
           return 0;
-     } else {
-          return 1;
      }
+     hi = list->n;
+     while (lo < hi) {
+          int mid = lo + (hi-lo)/2;
+          if (list->pos[mid] < pos) {
+               lo = mid+1;
+          } else {
+               hi = mid;
+          }
+     }
+     return lo < list->n && list->pos[lo] == pos;
+}
+/* ign_list_has_pos() */
+
+
+int
+var_in_ign_list(var_t *var) {
+     /* using chrom and pos only */
+     return ign_list_has_pos(ign_list_get(var->chrom), var->pos);
 }
 
 
 void
 source_qual_free_ign_vars()
 {
-     var_hash_free_table(source_qual_ign_vars_hash);
+     ign_pos_t *list, *list_tmp;
+
+     HASH_ITER(hh, source_qual_ign_pos, list, list_tmp) {
+          HASH_DEL(source_qual_ign_pos, list);
+          free(list->chrom);
+          free(list->pos);
+          free(list);
+     }
+     source_qual_ign_pos = NULL;
+     source_qual_num_ign_pos = 0;
 }
 
 
-/* FIXME ignore variants outside given region  (mplp_conf.reg)
- (on top of bed as well)
- * and use tabix API if indexed */
+/* loads variant positions to be ignored for source quality from
+ * vcf_path. can be called repeatedly for several files. note,
+ * variants outside the region given with -r or the bed file are
+ * deliberately kept: source quality counts mismatches over whole
+ * reads, i.e. also outside the region, and the alignment quality
+ * cache is shared between regions
+ */
 int
-source_qual_load_ign_vcf(const char *vcf_path, void *bed)
+source_qual_load_ign_vcf(const char *vcf_path)
 {
      vcf_file_t vcf_file;
      const int read_only_passed = 0;
      unsigned int num_total_vars = 0;
-     unsigned int num_kept_vars = 0;
+     ign_pos_t *list = NULL, *list_tmp;
 
      if (vcf_file_open(& vcf_file, vcf_path,
                       HAS_GZIP_EXT(vcf_path), 'r')) {
@@ -361,7 +719,6 @@ source_qual_load_ign_vcf(const char *vcf_path, void *bed)
      */
     while (1) {
          var_t *var;
-         char *key;
          int rc;
 
          vcf_new_var(&var);
@@ -377,24 +734,48 @@ source_qual_load_ign_vcf(const char *vcf_path, void *bed)
               continue;
          }
 
-         if (bed && ! bed_overlap(bed, var->chrom, var->pos, var->pos+1)) {
-              vcf_free_var(&var);
-              continue;
+         /* vcf files are usually sorted, so list is mostly still right */
+         if (NULL == list || 0 != strcmp(list->chrom, var->chrom)) {
+              HASH_FIND_STR(source_qual_ign_pos, var->chrom, list);
+              if (NULL == list) {
+                   if (NULL == (list = calloc(1, sizeof(ign_pos_t)))) {
+                        fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                                __FILE__, __FUNCTION__, __LINE__);
+                        exit(1);
+                   }
+                   list->chrom = strdup(var->chrom);
+                   HASH_ADD_KEYPTR(hh, source_qual_ign_pos, list->chrom, strlen(list->chrom), list);
+              }
          }
-
-         /* using key_pos_only i.e. chrom and pos only */
-         vcf_var_key_pos_only(&key, var);
-         /* since we only need the key and no other info we do
-          * not need to save the var (and save NULL instead) */
+         if (list->n == list->m) {
+              list->m = list->m ? list->m*2 : 1024;
+              if (NULL == (list->pos = realloc(list->pos, list->m * sizeof(int)))) {
+                   fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                           __FILE__, __FUNCTION__, __LINE__);
+                   exit(1);
+              }
+         }
+         list->pos[list->n++] = var->pos;
          vcf_free_var(&var);
-         var_hash_add(& source_qual_ign_vars_hash, key, NULL);
-         /* FIXME key used within vcf_free_var; dont free! */
     }
 
-    num_kept_vars = HASH_COUNT(source_qual_ign_vars_hash);
-    if (num_kept_vars) {
-         LOG_VERBOSE("Ignoring %d variants for SQ computation after reading %s\n",
-                     num_kept_vars, vcf_path);
+    /* sort and remove duplicates (multi-allelic, several files) */
+    source_qual_num_ign_pos = 0;
+    HASH_ITER(hh, source_qual_ign_pos, list, list_tmp) {
+         int i, j = 0;
+         qsort(list->pos, list->n, sizeof(int), int_cmp);
+         for (i = 0; i < list->n; i++) {
+              if (0 == i || list->pos[i] != list->pos[j-1]) {
+                   list->pos[j++] = list->pos[i];
+              }
+         }
+         list->n = j;
+         source_qual_num_ign_pos += list->n;
+    }
+
+    if (source_qual_num_ign_pos) {
+         LOG_VERBOSE("Ignoring %ld variant positions for SQ computation after reading %s\n",
+                     source_qual_num_ign_pos, vcf_path);
     } else {
          LOG_WARN("None of the %d variants in %s were kept\n",
                   num_total_vars, vcf_path);
@@ -406,6 +787,75 @@ source_qual_load_ign_vcf(const char *vcf_path, void *bed)
 
 
 
+static void
+sq_memo_init(sq_memo_t *m)
+{
+     memset(m, 0, sizeof(sq_memo_t));
+}
+/* sq_memo_init() */
+
+
+static void
+sq_memo_clear(sq_memo_t *m)
+{
+     sq_memo_entry_t *e, *e_tmp;
+
+     HASH_ITER(hh, m->table, e, e_tmp) {
+          HASH_DEL(m->table, e);
+          free(e->key);
+          free(e);
+     }
+     m->num_entries = 0;
+}
+/* sq_memo_clear() */
+
+
+static void
+sq_memo_free(sq_memo_t *m)
+{
+     int i;
+
+     sq_memo_clear(m);
+     for (i=0; i<NUM_OP_CATS; i++) {
+          free(m->op_quals[i]);
+          m->op_quals[i] = NULL;
+     }
+     m->op_quals_cap = 0;
+     free(m->err_probs);
+     m->err_probs = NULL;
+     m->err_probs_cap = 0;
+}
+/* sq_memo_free() */
+
+
+static void
+sq_memo_reserve(sq_memo_t *m, int qlen)
+{
+     int i;
+
+     if (qlen > m->op_quals_cap) {
+          for (i=0; i<NUM_OP_CATS; i++) {
+               /* over allocating */
+               if (NULL == (m->op_quals[i] = realloc(m->op_quals[i], qlen * sizeof(int)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          m->op_quals_cap = qlen;
+     }
+     if (qlen > m->err_probs_cap) {
+          if (NULL == (m->err_probs = realloc(m->err_probs, qlen * sizeof(double)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          m->err_probs_cap = qlen;
+     }
+}
+/* sq_memo_reserve() */
+
+
 /* Estimate as to how likely it is that this read, given the mapping,
  * comes from this reference genome. P(r not from g|mapping) = 1 - P(r
  * from g).
@@ -425,15 +875,22 @@ source_qual_load_ign_vcf(const char *vcf_path, void *bed)
  *
  * If target is non-NULL will ignore SNPs via var_in_ign_list
  *
+ * memo is optional (see sq_memo_t). results are identical with
+ * and without.
+ *
  * Returns -1 on error or if NA. otherwise source quality
  *
  */
 int
 source_qual(const bam1_t *b, const char *ref,
-            const int nonmatch_qual, char *target, int min_bq)
+            const int nonmatch_qual, char *target, int min_bq,
+            sq_memo_t *memo)
 {
      int op_counts[NUM_OP_CATS];
-     int **op_quals = NULL;
+     int qual_hist[SQ_MEMO_NUM_QUALS];
+     sq_memo_t tmp_memo;
+     sq_memo_entry_t *memo_entry = NULL;
+     int key_len, hist_off;
 
      double *probvec = NULL;
      int num_non_matches = -1; /* non-matching operations */
@@ -449,26 +906,19 @@ source_qual(const bam1_t *b, const char *ref,
 
      int qlen = b->core.l_qseq;
 
-     /* alloc op_quals
-      */
-     if (NULL == (op_quals = malloc(NUM_OP_CATS * sizeof(int *)))) {
-          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
-                  __FILE__, __FUNCTION__, __LINE__);
-          exit(1);
-     }
-     for (i=0; i<NUM_OP_CATS; i++) {
-          if (NULL == (op_quals[i] = malloc(qlen * sizeof(int)))) {/* over allocating */
-               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
-                       __FILE__, __FUNCTION__, __LINE__);
-               free(op_quals);
-               exit(1);
-          }
+     if (! memo) {
+          sq_memo_init(& tmp_memo);
+          memo = & tmp_memo;
      }
+     sq_memo_reserve(memo, qlen);
 
-     /* count match operations and get qualities for them
+     /* count match operations and get qualities for them. qualities
+      * are not needed if they all get replaced with nonmatch_qual
+      * anyway
       */
      /* LOG_FIXME("%s\n", "Don't know ref name in count_cigar_ops which would be needed as hash key");*/
-     num_err_probs = count_cigar_ops(op_counts, op_quals, b, ref, min_bq, target);
+     num_err_probs = count_cigar_ops(op_counts, nonmatch_qual >= 0 ? NULL : memo->op_quals,
+                                     b, ref, min_bq, target);
      if (1 > num_err_probs) {
 #ifdef TRACE
           LOG_DEBUG("count_cigar_ops returned %d counts on read %s\n", num_err_probs, bam1_qname(b));
@@ -477,16 +927,10 @@ source_qual(const bam1_t *b, const char *ref,
           goto free_and_exit;
      }
 
-     /* alloc and fill err_probs with quals returned per op-cat from
-      * count_cigar_ops
+     /* histogram of quals returned per op-cat from count_cigar_ops
       */
-     if (NULL == (err_probs = malloc(num_err_probs * sizeof(double)))) {
-          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
-                  __FILE__, __FUNCTION__, __LINE__);
-          exit(1);
-     }
+     memset(qual_hist, 0, sizeof(qual_hist));
      num_non_matches = 0;
-     err_prob_idx = 0;
      for (i=0; i<NUM_OP_CATS; i++) {
 #ifdef SOURCEQUAL_IGNORES_INDELS
           /* pretend it never happened: remove counts and ignore qualities */
@@ -498,19 +942,15 @@ source_qual(const bam1_t *b, const char *ref,
           if (i!=OP_MATCH) {
                num_non_matches += op_counts[i];
           }
+          if (nonmatch_qual >= 0) {
+               continue;
+          }
           for (j=0; j<op_counts[i]; j++) {
-               int qual;
-               if (nonmatch_qual >= 0) {
-                    qual = nonmatch_qual;
-               } else {
-                    qual = op_quals[i][j];
-               }
-               err_probs[err_prob_idx] = PHREDQUAL_TO_PROB(qual);
-               /*LOG_FIXME("err_probs[%d] = %f (nonmatch_qual=%d op_quals[i=%d][j=%d]=%d)\n", err_prob_idx, err_probs[err_prob_idx], nonmatch_qual, i, j, op_quals[i][j]);*/
-               err_prob_idx += 1;
+               int qual = memo->op_quals[i][j];
+               assert(qual >= 0 && qual < SQ_MEMO_NUM_QUALS);
+               qual_hist[qual] += 1;
           }
      }
-     assert(err_prob_idx == num_err_probs);
 
      /*  need num_non_matches-1 */
      orig_num_non_matches = num_non_matches;
@@ -526,6 +966,48 @@ source_qual(const bam1_t *b, const char *ref,
           goto free_and_exit;
      }
 
+     /* canonical key: num_non_matches followed by (qual, count) by
+      * decreasing qual, which is the order of increasing error probs
+      * as needed for poissbin below
+      */
+     key_len = 0;
+     memo->key[key_len++] = num_non_matches;
+#ifdef SOURCEQUAL_USES_PAIRS
+     memo->key[key_len++] = ((b->core.flag&BAM_FPAIRED) && (b->core.flag&BAM_FPROPER_PAIR));
+#endif
+     hist_off = key_len;
+     if (nonmatch_qual >= 0) {
+          memo->key[key_len++] = nonmatch_qual;
+          memo->key[key_len++] = num_err_probs;
+     } else {
+          for (i=SQ_MEMO_NUM_QUALS-1; i>=0; i--) {
+               if (qual_hist[i]) {
+                    memo->key[key_len++] = i;
+                    memo->key[key_len++] = qual_hist[i];
+               }
+          }
+     }
+     key_len *= sizeof(int);
+
+     HASH_FIND(hh, memo->table, memo->key, key_len, memo_entry);
+     if (memo_entry) {
+          src_qual = memo_entry->src_qual;
+          goto free_and_exit;
+     }
+
+     /* fill err_probs from key, which makes them sorted already. in
+      * theory should be numerically more stable and also make
+      * poissbin faster */
+     err_probs = memo->err_probs;
+     err_prob_idx = 0;
+     for (i=hist_off; i<key_len/(int)sizeof(int); i+=2) {
+          double e = PHREDQUAL_TO_PROB(memo->key[i]);
+          for (j=0; j<memo->key[i+1]; j++) {
+               err_probs[err_prob_idx++] = e;
+          }
+     }
+     assert(err_prob_idx == num_err_probs);
+
 #ifdef SOURCEQUAL_USES_PAIRS
      if ((b->core.flag&BAM_FPAIRED) && (b->core.flag&BAM_FPROPER_PAIR)) {
           double median_err = dbl_median(err_probs, num_err_probs);
@@ -534,15 +1016,13 @@ source_qual(const bam1_t *b, const char *ref,
              perfect perfect match, using length and median prob of 
              current one */
           
-          num_err_probs *= 2;
-          if (NULL == (err_probs = realloc(err_probs, num_err_probs * sizeof(double)))) {
-               fprintf(stderr, "FATAL: couldn't reallocate memory at %s:%s():%d\n",
-                       __FILE__, __FUNCTION__, __LINE__);
-               exit(1);
-          }
-          for (i=err_prob_idx-1; i<num_err_probs; i++) {
+          sq_memo_reserve(memo, 2*num_err_probs);
+          err_probs = memo->err_probs;
+          for (i=num_err_probs; i<2*num_err_probs; i++) {
                err_probs[i] = median_err;
           }
+          num_err_probs *= 2;
+          qsort(err_probs, num_err_probs, sizeof(double), dbl_cmp);
           LOG_FIXME("median_err = %f\n", median_err);
      }
 #endif
@@ -551,10 +1031,6 @@ source_qual(const bam1_t *b, const char *ref,
       * given quals? or: how likely is this read from the genome.
       * 1-src_value = prob read is not from genome
       */
-
-     /* sorting in theory should be numerically more stable and also
-      * make poissbin faster */
-     qsort(err_probs, num_err_probs, sizeof(double), dbl_cmp);
      probvec = poissbin(&unused_pval, err_probs,
                         num_err_probs, num_non_matches, 1.0, 0.05);
      /* need prob not pv */
@@ -572,14 +1048,28 @@ source_qual(const bam1_t *b, const char *ref,
      free(probvec);
      src_qual = PROB_TO_PHREDQUAL(1.0 - src_prob);
 
+     /* remember. simply start over if full */
+     if (memo != & tmp_memo) {
+          if (memo->num_entries >= SQ_MEMO_MAX_ENTRIES) {
+               sq_memo_clear(memo);
+          }
+          if (NULL == (memo_entry = malloc(sizeof(sq_memo_entry_t)))
+              || NULL == (memo_entry->key = malloc(key_len))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          memcpy(memo_entry->key, memo->key, key_len);
+          memo_entry->key_len = key_len;
+          memo_entry->src_qual = src_qual;
+          HASH_ADD_KEYPTR(hh, memo->table, memo_entry->key, key_len, memo_entry);
+          memo->num_entries += 1;
+     }
 
 free_and_exit:
-     for (i=0; i<NUM_OP_CATS; i++) {
-          free(op_quals[i]);
+     if (memo == & tmp_memo) {
+          sq_memo_free(& tmp_memo);
      }
-     free(op_quals);
-
-     free(err_probs);
 
      /* if we wanted to use softening from precomputed stats then add
       * all non-matches up instead of using the matches */
@@ -598,18 +1088,238 @@ free_and_exit:
 
 
 
+static void
+aux_cache_free(aux_cache_t *ac)
+{
+     free(ac->entries);
+     memset(ac, 0, sizeof(aux_cache_t));
+}
+/* aux_cache_free() */
+
+
+/* doubles the number of slots, keeping all entries */
+static void
+aux_cache_grow(aux_cache_t *ac)
+{
+     int new_size = ac->size ? ac->size*2 : AUX_CACHE_INIT_SIZE;
+     aux_cache_entry_t *entries = calloc(new_size, sizeof(aux_cache_entry_t));
+     int i;
+
+     if (! entries) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<ac->size; i++) {
+          const aux_cache_entry_t *e = & ac->entries[i];
+          if (e->id) {
+               entries[e->id & (uint64_t)(new_size-1)] = *e;
+          }
+     }
+     free(ac->entries);
+     ac->entries = entries;
+     ac->size = new_size;
+}
+/* aux_cache_grow() */
+
+
+/* assigns b a new id and records the offsets of the aux tags needed
+ * in compile_plp_col(). has to be called once b doesn't change
+ * anymore */
+static void
+aux_cache_add(aux_cache_t *ac, bam1_t *b)
+{
+     const char *tags[NUM_AUX_CACHE];
+     aux_cache_entry_t *e;
+     int i;
+
+     tags[AUX_CACHE_BI] = BI_TAG;
+     tags[AUX_CACHE_BD] = BD_TAG;
+     tags[AUX_CACHE_AI] = AI_TAG;
+     tags[AUX_CACHE_AD] = AD_TAG;
+     tags[AUX_CACHE_BAQ] = BAQ_TAG;
+     tags[AUX_CACHE_SQ] = SRC_QUAL_TAG;
+
+     if (! ac->size) {
+          aux_cache_grow(ac);
+     }
+     b->id = ++ac->last_id;
+     /* an older read in this slot might still be waiting in the
+      * pileup if it ends after the current read starts. overwriting
+      * it is safe though, because aux_cache_get() then falls back
+      * to bam_aux_get() */
+     e = & ac->entries[b->id & (uint64_t)(ac->size-1)];
+     while (e->id && e->tid == b->core.tid && e->end >= b->core.pos
+            && ac->size < AUX_CACHE_MAX_SIZE) {
+          aux_cache_grow(ac);
+          e = & ac->entries[b->id & (uint64_t)(ac->size-1)];
+     }
+
+     e->id = b->id;
+     e->tid = b->core.tid;
+     e->pos = b->core.pos;
+     e->end = bam_calend(&b->core, bam1_cigar(b));
+     e->l_data = b->l_data;
+     for (i=0; i<NUM_AUX_CACHE; i++) {
+          uint8_t *aux = bam_aux_get(b, tags[i]);
+#ifdef USE_OLD_AI_AD
+          /* temporary fix preventing problems due to the fact that we changed AI AD to ai ad
+           * to be deleted soon
+           */
+          if (! aux && i == AUX_CACHE_AI) {
+               aux = bam_aux_get(b, "AI");
+          }
+          if (! aux && i == AUX_CACHE_AD) {
+               aux = bam_aux_get(b, "AD");
+          }
+#endif
+          e->off[i] = aux ? (uint32_t)(aux - b->data) + 1 : 0;
+     }
+}
+/* aux_cache_add() */
+
+
+/* sets aux[] to what bam_aux_get() would return for the tags cached
+ * by aux_cache_add(). falls back to bam_aux_get() if ac is NULL, the
+ * read wasn't passed through aux_cache_add() or its entry was
+ * overwritten, or the offsets don't fit the record */
+static void
+aux_cache_get(const aux_cache_t *ac, const bam1_t *b, uint8_t *aux[NUM_AUX_CACHE])
+{
+     int i;
+
+     if (ac && ac->size && b->id) {
+          const aux_cache_entry_t *e = & ac->entries[b->id & (uint64_t)(ac->size-1)];
+          if (e->id == b->id && e->l_data == b->l_data
+              && e->tid == b->core.tid && e->pos == b->core.pos) {
+               for (i=0; i<NUM_AUX_CACHE; i++) {
+                    /* the type char is needed at least */
+                    if (e->off[i] > (uint32_t)b->l_data) {
+                         break;
+                    }
+                    aux[i] = e->off[i] ? b->data + e->off[i] - 1 : NULL;
+               }
+               if (i == NUM_AUX_CACHE) {
+                    return;
+               }
+          }
+     }
+
+     aux[AUX_CACHE_BI] = bam_aux_get(b, BI_TAG);
+     aux[AUX_CACHE_BD] = bam_aux_get(b, BD_TAG);
+     aux[AUX_CACHE_AI] = bam_aux_get(b, AI_TAG);
+     aux[AUX_CACHE_AD] = bam_aux_get(b, AD_TAG);
+     aux[AUX_CACHE_BAQ] = bam_aux_get(b, BAQ_TAG);
+     aux[AUX_CACHE_SQ] = bam_aux_get(b, SRC_QUAL_TAG);
+#ifdef USE_OLD_AI_AD
+     if (! aux[AUX_CACHE_AI]) {
+          aux[AUX_CACHE_AI] = bam_aux_get(b, "AI");
+     }
+     if (! aux[AUX_CACHE_AD]) {
+          aux[AUX_CACHE_AD] = bam_aux_get(b, "AD");
+     }
+#endif
+}
+/* aux_cache_get() */
+
+
 /* not part of offical samtools/htslib API but part of samtools */
+/* reads next alignment from current bed query, moving on to the next
+ * query once exhausted. reads overlapping two queries are only
+ * returned once. same return values as sam_itr_next() */
+static int
+bed_queries_read(mplp_aux_t *ma, bam1_t *b)
+{
+     while (1) {
+          const bed_query_t *q;
+          int ret;
+
+          if (ma->cur_bed_query >= ma->num_bed_queries) {
+               return -1;
+          }
+          q = & ma->bed_queries[ma->cur_bed_query];
+          if (! ma->iter) {
+               ma->iter = sam_itr_queryi(ma->bed_idx, q->tid, q->beg, q->end);
+          }
+          ret = sam_itr_next(ma->fp, ma->iter, b);
+          if (ret < -1) {
+               return ret;
+          } else if (ret < 0) {
+               hts_itr_destroy(ma->iter);
+               ma->iter = NULL;
+               ma->cur_bed_query += 1;
+               continue;
+          }
+          /* queries don't overlap and are sorted, so reads starting
+           * before the end of the previous query on the same target
+           * were already returned by it */
+          if (ma->cur_bed_query > 0) {
+               const bed_query_t *prev = & ma->bed_queries[ma->cur_bed_query-1];
+               if (b->core.tid == prev->tid && b->core.pos < prev->end) {
+                    continue;
+               }
+          }
+          return ret;
+     }
+}
+/* bed_queries_read() */
+
+
+/* reads next record of ma (bed queries, region or whole file) and the
+ * virtual offset after it. readahead_read_t for readahead_start() */
+static int
+mplp_read(void *data, bam1_t *b, int64_t *voff)
+{
+     mplp_aux_t *ma = (mplp_aux_t*)data;
+     int ret;
+
+     if (ma->bed_queries) {
+          ret = bed_queries_read(ma, b);
+     } else {
+          ret = ma->iter? sam_itr_next(ma->fp, ma->iter, b) : sam_read1(ma->fp, ma->h, b);
+     }
+     if (ret >= 0) {
+          /* CRAM has no virtual offsets (and no qual cache) */
+          *voff = ma->fp->is_cram ? -1 : bgzf_tell(ma->fp->fp.bgzf);
+     }
+     return ret;
+}
+/* mplp_read() */
+
+
 static int
 mplp_func(void *data, bam1_t *b)
 {
      mplp_aux_t *ma = (mplp_aux_t*)data;
      int ret, skip = 0;
+     int cache_hit = 0, cached_sq = QUAL_CACHE_NO_SQ;
 
      do {
           int has_ref;
-          ret = ma->iter? bam_iter_read(ma->fp, ma->iter, b) : bam_read1(ma->fp, b);
+          PROF_START(t_read);
+          if (ma->readahead) {
+               /* only the time spent waiting for the read-ahead thread */
+               ret = readahead_read(ma->readahead, b, & ma->voff);
+          } else {
+               ret = mplp_read(ma, b, & ma->voff);
+          }
+          PROF_STOP(PROF_BAM_READ, t_read);
           if (ret < 0)
                break;
+          cache_hit = 0;
+
+          /* side pass: sees every read, before any filtering, but
+           * each only once, i.e. not the ones overlapping from a
+           * neighbouring region */
+          if (ma->bamstats && (ma->stats_tid < 0 ||
+                               (b->core.tid == ma->stats_tid &&
+                                b->core.pos >= ma->stats_beg && b->core.pos < ma->stats_end))) {
+               if (bamstats_add(ma->bamstats, ma->h, b)) {
+                    /* ends the pileup like a read error */
+                    ma->error = 1;
+                    return -2;
+               }
+          }
 
 #ifdef TRACE
           LOG_DEBUG("Got read %s with flag %d\n", bam1_qname(b), core.flag);
@@ -626,7 +1336,11 @@ mplp_func(void *data, bam1_t *b)
                skip = 1; 
                continue;
           }
-          if (ma->conf->bed) { /* test overlap */
+          if (ma->bed_tidx) { /* test overlap */
+               skip = !bed_tidx_overlap(ma->bed_tidx, b->core.tid, b->core.pos, bam_calend(&b->core, bam1_cigar(b)));
+               if (skip)
+                    continue;
+          } else if (ma->conf->bed) {
                skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_calend(&b->core, bam1_cigar(b)));
                if (skip)
                     continue;
@@ -644,15 +1358,17 @@ mplp_func(void *data, bam1_t *b)
            * the reads mapping to first position have a reference
            * attached as well and therefore baq, sq etc can be
            * applied */
-          if (! has_ref && ma->conf->fai) {
+          if (! has_ref && ma->refcache) {
                int ref_len = -1;
-               ma->ref = faidx_fetch_seq(ma->conf->fai, ma->h->target_name[b->core.tid], 0, 0x7fffffff, &ref_len);
+               if (ma->ref) {
+                    refcache_release(ma->refcache, ma->h->target_name[ma->ref_id]);
+               }
+               ma->ref = refcache_get(ma->refcache, ma->h->target_name[b->core.tid], &ref_len);
                if (!ma->ref) {
                     LOG_FATAL("Couldn't fetch sequence '%s'.\n", ma->h->target_name[b->core.tid]);
                     exit(1);/* FIXME just returning would just skip calls for this seq */
 
                } else {
-                    strtoupper(ma->ref);/* safeguard */
                     ma->ref_id = b->core.tid;
                     has_ref = 1;
                }
@@ -667,7 +1383,10 @@ mplp_func(void *data, bam1_t *b)
                fflush(stdout);
           }
 #endif
-          if (ma->conf->flag & MPLP_BAQ || ma->conf->flag & MPLP_IDAQ) {
+          if (ma->qcache && (ma->conf->flag & (MPLP_BAQ | MPLP_IDAQ | MPLP_USE_SQ))) {
+               cache_hit = qual_cache_apply(ma->qcache, ma->voff, b, &cached_sq);
+          }
+          if (! cache_hit && (ma->conf->flag & MPLP_BAQ || ma->conf->flag & MPLP_IDAQ)) {
                int baq_flag = ma->conf->flag & MPLP_BAQ ? 1 : 0;
                int baq_ext =  ma->conf->flag & MPLP_EXT_BAQ ? 1 : 0;
                int idaq_flag = ma->conf->flag & MPLP_IDAQ ? 1 : 0;
@@ -680,9 +1399,11 @@ mplp_func(void *data, bam1_t *b)
                     baq_flag = 2;
                }                    
 
-               if (bam_prob_realn_core_ext(b, ma->ref, baq_flag, baq_ext, idaq_flag)) {
+               PROF_START(t_realn);
+               if (bam_prob_realn_core_ext(b, ma->ref, baq_flag, baq_ext, idaq_flag, & ma->realn_ws)) {
                     LOG_ERROR("bam_prob_realn_core() failed for %s\n", bam1_qname(b));
                }
+               PROF_STOP(PROF_BAQ_IDAQ, t_realn);
 
 #if 0
                {
@@ -728,20 +1449,35 @@ mplp_func(void *data, bam1_t *b)
      * have BAQ info yet (only interesting if it's supposed to be used
      * instead of BQ) only have the ref but not the cons base.
      */
-    if (ma->ref && ma->ref_id == b->core.tid && ma->conf->flag & MPLP_USE_SQ) {
+    ma->sq = QUAL_CACHE_NO_SQ;
+    if (ret >= 0 && cache_hit && cached_sq != QUAL_CACHE_NO_SQ) {
+         int sq = cached_sq;
+         bam_aux_append(b, SRC_QUAL_TAG, 'i', sizeof(sq), (uint8_t*) &sq);
+         ma->sq = sq;
+
+    } else if (ma->ref && ma->ref_id == b->core.tid && ma->conf->flag & MPLP_USE_SQ) {
+         PROF_START(t_sq);
          int sq = source_qual(b, ma->ref, ma->conf->def_nm_q,
-                              ma->h->target_name[b->core.tid], DEFAULT_MIN_BQ/* FIXME could use->conf->min_bq which is set to a conservative 3 */);
+                              ma->h->target_name[b->core.tid], DEFAULT_MIN_BQ/* FIXME could use->conf->min_bq which is set to a conservative 3 */,
+                              & ma->sq_memo);
+         PROF_STOP(PROF_SOURCE_QUAL, t_sq);
          /* -1 indicates error or NA, but can't be stored as uint. hack is to use 0 instead */
          if (sq<0) {
               sq=0;
          }
          bam_aux_append(b, SRC_QUAL_TAG, 'i', sizeof(sq), (uint8_t*) &sq);
+         ma->sq = sq;
 #if 0
          int sq2 = bam_aux2i(bam_aux_get(b, SRC_QUAL_TAG));
          LOG_WARN("sq=%d sq2=%d\n", sq, sq2);
 #endif
     }
 
+    /* has to come last */
+    if (ret >= 0) {
+         aux_cache_add(& ma->aux_cache, b);
+    }
+
     return ret;
 }
 
@@ -753,7 +1489,8 @@ mplp_func(void *data, bam1_t *b)
                 * which is in the sequence context of GTTT will
                 * receive an hrun value of 3. same for ins G>GT */
 int
-get_hrun(const int pos, const char *ref, const int ref_len)
+get_hrun(const int pos, const char *ref, const int ref_len,
+         const unsigned char *ref_hrun)
 {
      char c;
      int hrun=1;
@@ -764,6 +1501,11 @@ get_hrun(const int pos, const char *ref, const int ref_len)
      if (i>=ref_len) {
         return hrun;
      }   
+     /* precomputed length of run containing pos+1 (which includes
+      * extending to the left). only exact below the cap */
+     if (ref_hrun && ref_hrun[i] < REFCACHE_MAX_HRUN) {
+          return ref_hrun[i];
+     }
      
      c=toupper(ref[i]);
      for (i=i+1; i<ref_len; i++) {
@@ -775,21 +1517,191 @@ get_hrun(const int pos, const char *ref, const int ref_len)
           }
      }
 
-     /* extend to the left in case not left aligned */
-     for (i=pos; i>=0; i--) {
-          /*LOG_DEBUG("to left: %c vs %c at %d\n", c, toupper(ref[i]), i+1);*/
-          if (toupper(ref[i])==c) {
-               hrun+=1;
-          } else {
-               break;
+     /* extend to the left in case not left aligned */
+     for (i=pos; i>=0; i--) {
+          /*LOG_DEBUG("to left: %c vs %c at %d\n", c, toupper(ref[i]), i+1);*/
+          if (toupper(ref[i])==c) {
+               hrun+=1;
+          } else {
+               break;
+          }
+     }
+
+     return hrun;
+}
+
+/* cheap pre-scan used for MPLP_ALT_ONLY: columns with only reference
+ * bases (after min_plp_bq filtering, as in compile_plp_col()) and no
+ * indels can't yield calls and don't need to be compiled. same for
+ * columns without reference base ('N'). conservative, i.e. might
+ * return 1 for columns which won't be called. returns 1 if the column
+ * needs to be compiled, 0 otherwise.
+ */
+static int
+plp_might_have_alt(const bam_pileup1_t *plp, const int n_plp,
+                   const mplp_conf_t *conf, const char ref_base)
+{
+     int i;
+     int ref_nt4;
+
+     if ('N' == ref_base) {
+          return 0;
+     }
+     ref_nt4 = bam_nt4_table[(int)ref_base];
+     for (i = 0; i < n_plp; ++i) {
+          const bam_pileup1_t *p = plp + i;
+          if (p->indel) {
+               return 1;
+          }
+          if (p->is_del || bam1_qual(p->b)[p->qpos] < conf->min_plp_bq) {
+               continue;
+          }
+          if (bam_nt16_nt4_table[bam1_seqi(bam1_seq(p->b), p->qpos)] != ref_nt4) {
+               return 1;
+          }
+     }
+     return 0;
+}
+/* plp_might_have_alt() */
+
+
+/* reproducible per read uniform 32bit value used for downsampling.
+ * based on the read name only, so that the same reads are kept in
+ * consecutive columns. mates get the same value, but are only kept or
+ * dropped together if that falls on the same side of the threshold
+ * for both, which differs per strand and column. FNV-1a plus murmur3
+ * finalizer */
+static inline uint32_t
+plp_read_hash(const bam1_t *b, const uint32_t seed)
+{
+     const char *c;
+     uint32_t h = 2166136261u ^ seed;
+
+     for (c = bam1_qname(b); *c; c++) {
+          h ^= (unsigned char) *c;
+          h *= 16777619u;
+     }
+     h ^= h >> 16;
+     h *= 0x85ebca6bu;
+     h ^= h >> 13;
+     h *= 0xc2b2ae35u;
+     h ^= h >> 16;
+     return h;
+}
+
+
+/* strand-balanced downsampling of columns deeper than conf->ds_depth.
+ * each strand gets half of ds_depth (or more if the other strand has
+ * fewer reads) and reads are kept with the corresponding probability,
+ * decided by plp_read_hash(). that's a reservoir sample in expectation,
+ * computed in one pass, and with a fixed seed the same reads survive
+ * in every run and every thread. keep[i] is set for kept reads.
+ * returns the number of kept reads.
+ */
+static int
+plp_col_downsample(char *keep, const bam_pileup1_t *plp, const int n_plp,
+                   const mplp_conf_t *conf)
+{
+     int i, n_strand[2] = {0, 0};
+     double frac[2];
+     uint32_t thresh[2];
+     int k_fw, num_kept = 0;
+
+     for (i = 0; i < n_plp; ++i) {
+          n_strand[bam1_strand(plp[i].b) ? 1 : 0] += 1;
+     }
+     k_fw = conf->ds_depth / 2;
+     if (n_strand[0] < k_fw) {
+          k_fw = n_strand[0];
+     } else if (n_strand[1] < conf->ds_depth - k_fw) {
+          k_fw = conf->ds_depth - n_strand[1];
+     }
+     frac[0] = n_strand[0] ? k_fw / (double) n_strand[0] : 1.0;
+     frac[1] = n_strand[1] ? (conf->ds_depth - k_fw) / (double) n_strand[1] : 1.0;
+     for (i = 0; i < 2; i++) {
+          thresh[i] = frac[i] >= 1.0 ? UINT32_MAX : (uint32_t) (frac[i] * UINT32_MAX);
+     }
+
+     for (i = 0; i < n_plp; ++i) {
+          const int s = bam1_strand(plp[i].b) ? 1 : 0;
+          keep[i] = plp_read_hash(plp[i].b, conf->ds_seed) <= thresh[s];
+          num_kept += keep[i];
+     }
+     return num_kept;
+}
+/* plp_col_downsample() */
+
+
+/* sets coverage_plp and ds_frac of plp_col (coverage as in the
+ * original mpileup, i.e. after read-level filtering, and after
+ * downsampling). returns the keep flags of the downsampled reads, or
+ * NULL if all reads are kept
+ */
+static char *
+plp_col_ds_coverage(plp_col_t *plp_col, const bam_pileup1_t *plp, const int n_plp,
+                    const mplp_conf_t *conf)
+{
+     plp_col->coverage_plp = n_plp;
+     plp_col->ds_frac = 1.0;
+     if (conf->ds_depth <= 0 || n_plp <= conf->ds_depth) {
+          return NULL;
+     }
+     if (n_plp > plp_col->ds_keep_size) {
+          plp_col->ds_keep_size = n_plp;
+          kroundup32(plp_col->ds_keep_size);
+          plp_col->ds_keep = realloc(plp_col->ds_keep, plp_col->ds_keep_size);
+          if (NULL == plp_col->ds_keep) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+     }
+     plp_col->coverage_plp = plp_col_downsample(plp_col->ds_keep, plp, n_plp, conf);
+     plp_col->ds_frac = plp_col->coverage_plp / (float) n_plp;
+     return plp_col->ds_keep;
+}
+/* plp_col_ds_coverage() */
+
+
+/* depth-only version of compile_plp_col() for columns skipped with
+ * MPLP_ALT_ONLY (see mplp_conf_t.skip_col_func): sets position,
+ * reference base and the same coverage_plp, ds_frac and num_bases,
+ * which only need the base qualities. everything else stays empty
+ */
+static void
+compile_plp_col_depth(plp_col_t *plp_col, const bam_pileup1_t *plp, const int n_plp,
+                      const mplp_conf_t *conf, const char ref_base,
+                      const int tid, const char *target_name, const int pos)
+{
+     char *ds_keep;
+     int i;
+
+     plp_col_reset(plp_col);
+     plp_col->tid = tid;
+     plp_col->target = target_name;
+     plp_col->pos = pos;
+     plp_col->ref_base = ref_base;
+     ds_keep = plp_col_ds_coverage(plp_col, plp, n_plp, conf);
+     for (i = 0; i < n_plp; ++i) {
+          const bam_pileup1_t *p = plp + i;
+          if (ds_keep && ! ds_keep[i]) {
+               continue;
+          }
+          /* as num_bases in compile_plp_col() */
+          if (! (p->is_del || p->is_refskip)
+              && bam1_qual(p->b)[p->qpos] >= conf->min_plp_bq) {
+               plp_col->num_bases += 1;
           }
      }
-
-     return hrun;
 }
+/* compile_plp_col_depth() */
 
-/* Press pileup info into one data-structure. plp_col members
- * allocated here. Called must free with plp_col_free();
+
+/* Press pileup info into one data-structure. plp_col must have been
+ * initialized with plp_col_init() and can be reused for consecutive
+ * columns (memory is kept). Caller must free with plp_col_free();
+ * hrun is precomputed by caller (-1 if there is no reference), since
+ * it only depends on the position and is the same for all samples.
  *
  * FIXME this used to be a convenience function and turned into a big
  * and slow monster. keeping copies of everything is inefficient and
@@ -799,10 +1711,14 @@ get_hrun(const int pos, const char *ref, const int ref_len)
 void compile_plp_col(plp_col_t *plp_col,
                  const bam_pileup1_t *plp, const int n_plp,
                  const mplp_conf_t *conf, const char *ref, const int pos,
-                 const int ref_len, const char *target_name)
+                 const int ref_len, const int hrun,
+                 const int tid, const char *target_name,
+                 const aux_cache_t *aux_cache)
 {
      int i;
      char ref_base;
+     const char *ds_keep = NULL; /* reads kept after downsampling. NULL: all */
+     int ref_hist_nt4 = -1; /* MPLP_REF_HIST: reference base counted in ref_hist. -1: none */
 
      /* "base counts" minus error-probs before base-level filtering
       * for each base. temporary data-structure for cheaply determining
@@ -818,23 +1734,25 @@ void compile_plp_col(plp_col_t *plp_col,
       * n_plp[i] - m
       */
      ref_base = (ref && pos < ref_len)? ref[pos] : 'N';
+     /* plp_to_errprobs() expects ref_base as in bam_nt4_rev_table */
+     if ((conf->flag & MPLP_REF_HIST) && bam_nt4_table[(int)ref_base] < NUM_NT4-1
+         && bam_nt4_rev_table[bam_nt4_table[(int)ref_base]] == ref_base) {
+          ref_hist_nt4 = bam_nt4_table[(int)ref_base];
+     }
 
-     plp_col_init(plp_col);
-     plp_col->target = strdup(target_name);
+     plp_col_reset(plp_col);
+     /* no copy needed: target_name is owned by the BAM header */
+     plp_col->tid = tid;
+     plp_col->target = target_name;
      plp_col->pos = pos;
      plp_col->ref_base = ref_base;
-     plp_col->coverage_plp = n_plp;  /* this is coverage as in the original mpileup,
-                                    i.e. after read-level filtering */
+     ds_keep = plp_col_ds_coverage(plp_col, plp, n_plp, conf);
      plp_col->num_bases = 0;
      plp_col->num_ign_indels = 0;
      plp_col->num_non_indels = 0;
      LOG_DEBUG("Processing %s:%d\n", plp_col->target, plp_col->pos+1);
      
-     if (ref) {
-          plp_col->hrun = get_hrun(pos, ref, ref_len);
-     } else {
-          plp_col->hrun = -1;
-     }
+     plp_col->hrun = hrun;
 
      for (i = 0; i < n_plp; ++i) {
           /* inserted parts of pileup_seq() here.
@@ -860,29 +1778,26 @@ void compile_plp_col(plp_col_t *plp_col,
 #ifdef USE_ALNERRPROF
           int aq = 0;
 #endif
-          uint8_t *bi = bam_aux_get(p->b, BI_TAG);
-          uint8_t *bd = bam_aux_get(p->b, BD_TAG);
-          uint8_t *ai = bam_aux_get(p->b, AI_TAG);
-          uint8_t *ad = bam_aux_get(p->b, AD_TAG);
+          uint8_t *aux[NUM_AUX_CACHE];
+          uint8_t *bi, *bd, *ai, *ad;
           uint8_t *baq_aux = NULL; /* full baq value (not offset as "BQ"!) */
 
-#ifdef USE_OLD_AI_AD
-          /* temporary fix preventing problems due to the fact that we changed AI AD to ai ad
-           * to be deleted soon
-           */
-          if (! ai) {
-               ai = bam_aux_get(p->b, "AI");
-          }
-          if (! ad) {
-               ad = bam_aux_get(p->b, "AD");
+          if (ds_keep && ! ds_keep[i]) {
+               continue;
           }
-#endif
+
+          aux_cache_get(aux_cache, p->b, aux);
+          bi = aux[AUX_CACHE_BI];
+          bd = aux[AUX_CACHE_BD];
+          ai = aux[AUX_CACHE_AI];
+          ad = aux[AUX_CACHE_AD];
+
           if (conf->flag & MPLP_USE_SQ) {
-               sq = bam_aux2i(bam_aux_get(p->b, SRC_QUAL_TAG)); /* lofreq internally computed on the fly */
+               sq = bam_aux2i(aux[AUX_CACHE_SQ]); /* lofreq internally computed on the fly */
           }
 
           if (conf->flag & MPLP_BAQ) {
-               baq_aux = bam_aux_get(p->b, BAQ_TAG);
+               baq_aux = aux[AUX_CACHE_BAQ];
                /* should have been recomputed already */
                if (! baq_aux) {
                     if (! missing_baq_warning_printed) {
@@ -949,14 +1864,8 @@ void compile_plp_col(plp_col_t *plp_col,
                     LOG_WARN("Base quality above allowed maximum detected (%d > %d). Using max instead\n", bq, SANGER_PHRED_MAX, bam1_qname(p->b));
                     bq = SANGER_PHRED_MAX;
                }
-               PLP_COL_ADD_QUAL(& plp_col->base_quals[nt4], bq);
-
                if (baq_aux) {
                     baq = baq_aux[p->qpos]-33;
-                    PLP_COL_ADD_QUAL(& plp_col->baq_quals[nt4], baq);
-               } else if (conf->flag & MPLP_BAQ)  {
-                    /* baq was enabled but failed. set to -1 */
-                    PLP_COL_ADD_QUAL(& plp_col->baq_quals[nt4], -1);
                }
 
                /* samtools check to detect Sanger max value: problem
@@ -966,10 +1875,27 @@ void compile_plp_col(plp_col_t *plp_col,
                 * gets executed, which is why we remove it:
                 * if (mq > 126) mq = 126;
                 */
-               PLP_COL_ADD_QUAL(& plp_col->map_quals[nt4], mq);
 
-               if (conf->flag & MPLP_USE_SQ) {
-                    PLP_COL_ADD_QUAL(& plp_col->source_quals[nt4], sq);
+               if (nt4 == ref_hist_nt4
+                   && 0 == plp_qual_hist_add(& plp_col->ref_hist, bq,
+                                             baq_aux ? baq : -1, mq,
+                                             conf->flag & MPLP_USE_SQ ? sq : -1)) {
+                    ; /* only counted */
+               } else {
+                    PLP_COL_ADD_QUAL(& plp_col->base_quals[nt4], bq);
+
+                    if (baq_aux) {
+                         PLP_COL_ADD_QUAL(& plp_col->baq_quals[nt4], baq);
+                    } else if (conf->flag & MPLP_BAQ)  {
+                         /* baq was enabled but failed. set to -1 */
+                         PLP_COL_ADD_QUAL(& plp_col->baq_quals[nt4], -1);
+                    }
+
+                    PLP_COL_ADD_QUAL(& plp_col->map_quals[nt4], mq);
+
+                    if (conf->flag & MPLP_USE_SQ) {
+                         PLP_COL_ADD_QUAL(& plp_col->source_quals[nt4], sq);
+                    }
                }
 #ifdef USE_ALNERRPROF
                if (alnerrprof) {
@@ -1094,7 +2020,7 @@ check_indel:
 
 
                          /*LOG_DEBUG("Insertion of %s at %d with iq %d iaq %d\n", ins_seq, pos, iq, iaq);*/
-                         add_ins_sequence(&plp_col->ins_event_counts,
+                         add_ins_sequence(&plp_col->ins_event_counts, &plp_col->ins_event_pool,
                               ins_seq, iq, iaq, mq, sq,
                               bam1_strand(p->b)? 1: 0);
 
@@ -1150,7 +2076,7 @@ check_indel:
                               }
                          }
 #endif
-                         add_del_sequence(&plp_col->del_event_counts,
+                         add_del_sequence(&plp_col->del_event_counts, &plp_col->del_event_pool,
                               del_seq, dq, daq, mq, sq,
                               bam1_strand(p->b)? 1: 0);
                          PLP_COL_ADD_QUAL(& plp_col->ins_quals, iq);
@@ -1277,7 +2203,8 @@ check_indel:
 #endif
 
      for (i = 0; i < NUM_NT4; ++i) {
-          assert(plp_col->fw_counts[i] + plp_col->rv_counts[i] == plp_col->base_quals[i].n);
+          assert(plp_col->fw_counts[i] + plp_col->rv_counts[i] == plp_col->base_quals[i].n
+                 + (i == ref_hist_nt4 ? plp_col->ref_hist.total : 0));
           assert(plp_col->base_quals[i].n == plp_col->baq_quals[i].n);
           assert(plp_col->base_quals[i].n == plp_col->map_quals[i].n);
           assert(plp_col->map_quals[i].n == plp_col->source_quals[i].n);
@@ -1287,45 +2214,419 @@ check_indel:
 
 
 
+/* checksum of the loaded ignore positions (see
+ * source_qual_load_ign_vcf()). independent of chromosome order */
+static uint64_t
+ign_pos_checksum()
+{
+     ign_pos_t *list, *list_tmp;
+     uint64_t sum = 0;
+
+     HASH_ITER(hh, source_qual_ign_pos, list, list_tmp) {
+          uint64_t h = qual_cache_hash64(0, list->chrom, strlen(list->chrom));
+          h = qual_cache_hash64(h, list->pos, list->n * sizeof(int));
+          sum += h;
+     }
+     return sum;
+}
+/* ign_pos_checksum() */
+
+
+/* continues checksum h with the pileup parameters that alignment
+ * qualities depend on, i.e. no file names or metadata */
+uint64_t
+mplp_params_checksum(uint64_t h, const mplp_conf_t *conf)
+{
+     int flag = conf->flag & (MPLP_NO_ORPHAN | MPLP_BAQ | MPLP_REDO_BAQ | MPLP_EXT_BAQ
+                              | MPLP_IDAQ | MPLP_REDO_IDAQ | MPLP_USE_SQ | MPLP_ILLUMINA13);
+     uint64_t ign_sum = conf->flag & MPLP_USE_SQ ? ign_pos_checksum() : 0;
+
+     h = qual_cache_hash64(h, &flag, sizeof(flag));
+     h = qual_cache_hash64(h, &conf->max_mq, sizeof(conf->max_mq));
+     h = qual_cache_hash64(h, &conf->min_mq, sizeof(conf->min_mq));
+     h = qual_cache_hash64(h, &conf->def_nm_q, sizeof(conf->def_nm_q));
+     /* the positions themselves: same number of positions from a
+      * different --ign-vcf must not match */
+     h = qual_cache_hash64(h, &ign_sum, sizeof(ign_sum));
+     return h;
+}
+/* mplp_params_checksum() */
+
+
+/* checksum of all inputs and parameters that the values stored in
+ * the alignment quality cache for bam_file depend on. the cache is
+ * local, so file sizes and times are good enough to identify inputs */
+uint64_t
+mplp_qual_cache_checksum(const mplp_conf_t *conf, const char *bam_file)
+{
+     const char *magic = "lofreq alignment quality cache";
+     uint64_t h = 0;
+     struct stat st;
+     int64_t v;
+
+     h = qual_cache_hash64(h, magic, strlen(magic));
+     if (0 == stat(bam_file, &st)) {
+          v = st.st_size; h = qual_cache_hash64(h, &v, sizeof(v));
+          v = st.st_mtime; h = qual_cache_hash64(h, &v, sizeof(v));
+     }
+     if (conf->fa && 0 == stat(conf->fa, &st)) {
+          h = qual_cache_hash64(h, conf->fa, strlen(conf->fa));
+          v = st.st_size; h = qual_cache_hash64(h, &v, sizeof(v));
+          v = st.st_mtime; h = qual_cache_hash64(h, &v, sizeof(v));
+     }
+     return mplp_params_checksum(h, conf);
+}
+/* mplp_qual_cache_checksum() */
+
+
+/* creates alignment quality cache mplp_conf->qual_cache for bam_file
+ * unless a valid one exists already. runs mplp_func() sequentially over
+ * the whole file, i.e. caches exactly the values a pileup would
+ * compute. returns non-zero on error */
+int
+mplp_qual_cache_build(const mplp_conf_t *mplp_conf, const char *bam_file)
+{
+     uint64_t checksum = mplp_qual_cache_checksum(mplp_conf, bam_file);
+     qual_cache_writer_t *w;
+     mplp_aux_t ma;
+     bam1_t *b;
+     refcache_t *refcache = NULL;
+     int rc = 0;
+
+     if (qual_cache_is_valid(mplp_conf->qual_cache, checksum)) {
+          LOG_VERBOSE("Reusing alignment quality cache %s\n", mplp_conf->qual_cache);
+          return 0;
+     }
+     LOG_VERBOSE("Creating alignment quality cache %s\n", mplp_conf->qual_cache);
+
+     memset(&ma, 0, sizeof(mplp_aux_t));
+     if (NULL == (ma.fp = hts_open(bam_file, "r"))) {
+          LOG_ERROR("Couldn't open %s\n", bam_file);
+          return -1;
+     }
+     if (ma.fp->is_cram) {
+          /* entries are keyed by BGZF virtual offsets */
+          LOG_ERROR("Alignment quality cache not supported for CRAM input (%s)\n", bam_file);
+          hts_close(ma.fp);
+          return -1;
+     }
+     if (NULL == (ma.h = sam_hdr_read(ma.fp))) {
+          LOG_ERROR("Couldn't read header of %s\n", bam_file);
+          hts_close(ma.fp);
+          return -1;
+     }
+     if (NULL == (w = qual_cache_writer_open(mplp_conf->qual_cache, checksum))) {
+          bam_header_destroy(ma.h);
+          hts_close(ma.fp);
+          return -1;
+     }
+     if (mplp_conf->refcache) {
+          refcache = (refcache_t *) mplp_conf->refcache;
+     } else if (mplp_conf->fai) {
+          refcache = refcache_new(mplp_conf->fai, REFCACHE_DEFAULT_MAX_BYTES);
+          refcache_open_store(refcache, mplp_conf->fa);
+     }
+     ma.refcache = refcache;
+     ma.conf = mplp_conf;
+     kpa_ext_ws_init(& ma.realn_ws);
+     sq_memo_init(& ma.sq_memo);
+
+     if (mplp_conf->io_threads > 0) {
+          ma.readahead = readahead_start(mplp_read, &ma);
+     }
+     b = bam_init1();
+     while (mplp_func(&ma, b) >= 0) {
+          if (qual_cache_write(w, ma.voff, b, ma.sq)) {
+               rc = -1;
+               break;
+          }
+     }
+     bam_destroy1(b);
+     readahead_stop(ma.readahead);
+
+     if (rc) {
+          /* don't leave a partial cache behind */
+          qual_cache_writer_close(w);
+          unlink(mplp_conf->qual_cache);
+     } else {
+          rc = qual_cache_writer_close(w);
+     }
+     kpa_ext_ws_free(& ma.realn_ws);
+     sq_memo_free(& ma.sq_memo);
+     if (ma.ref) {
+          refcache_release(refcache, ma.h->target_name[ma.ref_id]);
+     }
+     if (refcache && refcache != mplp_conf->refcache) {
+          refcache_free(refcache);
+     }
+     bam_header_destroy(ma.h);
+     hts_close(ma.fp);
+     return rc;
+}
+/* mplp_qual_cache_build() */
+
+
 /* not part of offical samtools/htslib API but part of samtools */
+static void
+bed_queries_free(mplp_aux_t *ma)
+{
+     free(ma->bed_queries);
+     ma->bed_queries = NULL;
+     ma->num_bed_queries = 0;
+     if (ma->bed_idx && ma->bed_idx_owned) {
+          hts_idx_destroy(ma->bed_idx);
+     }
+     ma->bed_idx = NULL;
+}
+
+
+/* turns bed regions into a list of index queries for ma, so that only
+ * the parts of the file covered by bed are read. regions whose reads
+ * start in the same bgzf block where the previous ones end are
+ * coalesced into one query, since seeking wouldn't save anything
+ * there. returns 0 on success (queries might still be empty if bed
+ * doesn't overlap the file) and non-zero if index was not available,
+ * in which case the whole file has to be streamed as before */
+static int
+bed_queries_init(mplp_aux_t *ma, const mplp_conf_t *mplp_conf, const char *fn)
+{
+     int tid;
+     int max_queries = 0;
+     uint64_t last_off = 0; /* end offset of last query */
+
+     if (mplp_conf->idx) {
+          ma->bed_idx = (hts_idx_t *) mplp_conf->idx;
+          ma->bed_idx_owned = 0;
+     } else {
+          if (NULL == (ma->bed_idx = sam_index_load(ma->fp, fn))) {
+               return -1;
+          }
+          ma->bed_idx_owned = 1;
+     }
+
+     ma->num_bed_queries = 0;
+     for (tid=0; tid < ma->h->n_targets; tid++) {
+          int beg, end;
+          int pos = 0;
+          while (bed_tidx_next(ma->bed_tidx, tid, pos, &beg, &end)) {
+               hts_itr_t *iter;
+               bed_query_t *last;
+               pos = end;
+               if (end <= beg) {
+                    end = beg+1;
+               }
+
+               /* only looks at index, no i/o */
+               iter = sam_itr_queryi(ma->bed_idx, tid, beg, end);
+               if (! iter) {
+                    continue;
+               }
+               if (iter->n_off == 0) {
+                    /* no reads here */
+                    hts_itr_destroy(iter);
+                    continue;
+               }
+               last = ma->num_bed_queries ? & ma->bed_queries[ma->num_bed_queries-1] : NULL;
+               if (last && last->tid == tid && (iter->off[0].u >> 16) <= (last_off >> 16)) {
+                    last->end = end;
+               } else {
+                    if (ma->num_bed_queries == max_queries) {
+                         max_queries = max_queries ? 2*max_queries : 1024;
+                         ma->bed_queries = realloc(ma->bed_queries, max_queries * sizeof(bed_query_t));
+                         if (! ma->bed_queries) {
+                              fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                                      __FILE__, __FUNCTION__, __LINE__);
+                              exit(1);
+                         }
+                    }
+                    last = & ma->bed_queries[ma->num_bed_queries++];
+                    last->tid = tid;
+                    last->beg = beg;
+                    last->end = end;
+                    last_off = 0;
+               }
+               if (iter->off[iter->n_off-1].v > last_off) {
+                    last_off = iter->off[iter->n_off-1].v;
+               }
+               hts_itr_destroy(iter);
+          }
+     }
+     if (! ma->bed_queries) {
+          /* bed doesn't overlap with any read: make sure nothing gets read */
+          ma->bed_queries = calloc(1, sizeof(bed_query_t));
+     }
+     ma->cur_bed_query = 0;
+     LOG_VERBOSE("Using %d index queries for bed regions on %s\n", ma->num_bed_queries, fn);
+     return 0;
+}
+/* bed_queries_init() */
+
+
+/* opens BAM or CRAM file fn ("-" for stdin) for mpileup(). CRAM
+ * gets decoded against conf->fa and, if htslib supports it, with
+ * only the fields used here. returns NULL on error */
+static htsFile *
+mplp_hts_open(const char *fn, const mplp_conf_t *conf)
+{
+     htsFile *fp;
+
+     if (NULL == (fp = hts_open(fn, "r"))) {
+          return NULL;
+     }
+     if (! fp->is_cram) {
+          return fp;
+     }
+     if (conf->fa && hts_set_fai_filename(fp, conf->fa)) {
+          LOG_ERROR("Couldn't use reference %s for decoding %s\n", conf->fa, fn);
+          hts_close(fp);
+          return NULL;
+     }
+#ifdef HAVE_CRAM_REQUIRED_FIELDS
+     {
+          /* no mate position, template length etc. read names are
+           * only needed for downsampling (and debugging output) */
+          int fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR
+               | SAM_SEQ | SAM_QUAL | SAM_AUX;
+          if (conf->ds_depth > 0) {
+               fields |= SAM_QNAME;
+          }
+          if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, fields)) {
+               LOG_DEBUG("Couldn't restrict decoded CRAM fields for %s\n", fn);
+          }
+     }
+#endif
+     return fp;
+}
+/* mplp_hts_open() */
+
+
+/* see plp_input_open() */
+struct plp_input_s {
+     htsFile *fp;
+     bam_header_t *h;
+     hts_idx_t *idx;
+};
+
+/* decompressed BGZF blocks kept per plp_input_t, so that queries
+ * close to earlier ones don't decompress again */
+#define PLP_INPUT_CACHE_SIZE (64*1024*1024)
+
+
+plp_input_t *
+plp_input_open(const mplp_conf_t *conf, const char *fn)
+{
+     plp_input_t *in;
+
+     if (0 == strcmp(fn, "-")) {
+          LOG_ERROR("%s\n", "Can't query regions on stdin");
+          return NULL;
+     }
+     if (NULL == (in = calloc(1, sizeof(plp_input_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     if (NULL == (in->fp = mplp_hts_open(fn, conf))) {
+          LOG_ERROR("Couldn't open %s\n", fn);
+          free(in);
+          return NULL;
+     }
+     if (NULL == (in->h = sam_hdr_read(in->fp))) {
+          LOG_ERROR("Couldn't read header of %s\n", fn);
+          plp_input_close(in);
+          return NULL;
+     }
+     if (NULL == (in->idx = sam_index_load(in->fp, fn))) {
+          LOG_ERROR("Couldn't load index for %s\n", fn);
+          plp_input_close(in);
+          return NULL;
+     }
+     if (! in->fp->is_cram) {
+          bgzf_set_cache_size(in->fp->fp.bgzf, PLP_INPUT_CACHE_SIZE);
+     }
+     return in;
+}
+/* plp_input_open() */
+
+
 int
-mpileup(const mplp_conf_t *mplp_conf,
-        void (*plp_proc_func)(const plp_col_t*, void*),
-        void *plp_proc_conf,
-        const int n, const char **fn)
+plp_input_parse_region(const plp_input_t *in, const char *reg, int *tid, int *beg, int *end)
+{
+     if (bam_parse_region(in->h, reg, tid, beg, end) < 0 || *tid < 0) {
+          return 1;
+     }
+     *end = MIN(*end, (int) in->h->target_len[*tid]);
+     return (*beg >= *end);
+}
+/* plp_input_parse_region() */
+
+
+void
+plp_input_close(plp_input_t *in)
+{
+     if (! in) {
+          return;
+     }
+     if (in->idx) {
+          hts_idx_destroy(in->idx);
+     }
+     if (in->h) {
+          bam_header_destroy(in->h);
+     }
+     hts_close(in->fp);
+     free(in);
+}
+/* plp_input_close() */
+
+
+/* the actual mpileup() and mpileup_multi(). exactly one of
+ * plp_proc_func (n==1) and plp_multi_func is used. mplp_confs[0]
+ * determines region, bed and reference for all samples */
+static int
+mpileup_core(const mplp_conf_t **mplp_confs,
+             void (*plp_proc_func)(const plp_col_t*, void*),
+             void (*plp_multi_func)(const plp_col_t**, const int, void*),
+             void *plp_proc_conf,
+             const int n, const char **fn)
 {
+    const mplp_conf_t *mplp_conf = mplp_confs[0];
     mplp_aux_t **data;
     int i, tid, pos, *n_plp, tid0 = -1, beg0 = 0, end0 = 1u<<29, ref_len = -1, ref_tid = -1, max_depth;
+    int hrun;
+    int rc = 0;
     const bam_pileup1_t **plp;
     bam_mplp_t iter;
     bam_header_t *h = 0;
-    char *ref;
+    const char *ref = NULL; /* acquired from refcache */
+    const unsigned char *ref_hrun = NULL; /* acquired from refcache as well. see get_hrun() */
+    refcache_t *refcache = NULL;
+    void *bed_tidx = NULL;
     kstring_t buf;
     long long int plp_counter = 0; /* note: some cols are simply skipped */
-
-    /* paranoid exit. n only allowed to be one in our case (not much
-     * of an *m*pileup, I know...) */
-    if (1 != n) {
-         fprintf(stderr, "FATAL(%s:%s): need exactly one BAM files as input (got %d)\n",
-                 __FILE__, __FUNCTION__, n);
-         for (i=0; i<n; i++) {
-              fprintf(stderr, "%s\n", fn[i]);
-         }
-         return 1;
-    }
+    plp_col_t plp_col; /* reused for all columns */
+    plp_col_t *plp_cols = NULL; /* one per sample if n>1. reused as well */
+    const plp_col_t **plp_col_ptrs = NULL;
 
     memset(&buf, 0, sizeof(kstring_t));
     data = calloc(n, sizeof(mplp_aux_t*));
     plp = calloc(n, sizeof(bam_pileup1_t*));
     n_plp = calloc(n, sizeof(int));
+    if (n > 1) {
+         plp_cols = calloc(n, sizeof(plp_col_t));
+         plp_col_ptrs = calloc(n, sizeof(plp_col_t*));
+         if (! plp_cols || ! plp_col_ptrs) {
+              fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                      __FILE__, __FUNCTION__, __LINE__);
+              exit(1);
+         }
+    }
 
 
     /* read the header and initialize data
      *
-     * note: most of this is overkill since it deals with multiple bam
-     * files, whereas we allow only one. however, if we keep it close
-     * to the original source then a diff against future versions of
-     * samtools is easier
+     * note: we keep this close to the original source, so that a
+     * diff against future versions of samtools is easier. more than
+     * one file is only used by mpileup_multi()
      *
      */
     for (i = 0; i < n; ++i) {
@@ -1337,34 +2638,86 @@ mpileup(const mplp_conf_t *mplp_conf,
           }
         }
         data[i] = calloc(1, sizeof(mplp_aux_t));
-        data[i]->fp = strcmp(fn[i], "-") == 0? bam_dopen(fileno(stdin), "r") : bam_open(fn[i], "r");
-        data[i]->conf = mplp_conf;
-        h_tmp = bam_header_read(data[i]->fp);
+        if (mplp_confs[i]->input) {
+             /* reading from the current offset makes no sense */
+             if (! mplp_conf->reg && ! mplp_conf->region) {
+                  LOG_FATAL("%s\n", "Internal error: open input needs a region");
+                  exit(1);
+             }
+             data[i]->fp = mplp_confs[i]->input->fp;
+        } else if (NULL == (data[i]->fp = mplp_hts_open(fn[i], mplp_confs[i]))) {
+             fprintf(stderr,"[%s] fail to open %s\n", __func__, fn[i]);
+             exit(1);
+        }
+        data[i]->conf = mplp_confs[i];
+        kpa_ext_ws_init(& data[i]->realn_ws);
+        sq_memo_init(& data[i]->sq_memo);
+        h_tmp = mplp_confs[i]->input ? mplp_confs[i]->input->h : sam_hdr_read(data[i]->fp);
         if ( !h_tmp ) {
              fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
              exit(1);
         }
         data[i]->h = i? h : h_tmp; /* for i==0, "h" has not been set yet */
+        if (i) {
+             /* all samples are piled up against the same targets */
+             int j;
+             int same = (h_tmp->n_targets == h->n_targets);
+             for (j=0; same && j<h->n_targets; j++) {
+                  same = (h_tmp->target_len[j] == h->target_len[j] &&
+                          0 == strcmp(h_tmp->target_name[j], h->target_name[j]));
+             }
+             if (! same) {
+                  LOG_FATAL("Sequences in BAM header of %s differ from those in %s\n", fn[i], fn[0]);
+                  exit(1);
+             }
+        }
 
         if (mplp_conf->reg) {
             int beg, end;
-            bam_index_t *idx;
-            idx = bam_index_load(fn[i]);
-            if (idx == 0) {
-                fprintf(stderr, "[%s] fail to load index for %d-th input.\n", __func__, i+1);
-                exit(1);
+            hts_idx_t *idx;
+            if (mplp_confs[i]->input) {
+                 idx = mplp_confs[i]->input->idx;
+            } else {
+                 idx = sam_index_load(data[i]->fp, fn[i]);
+                 if (idx == 0) {
+                      fprintf(stderr, "[%s] fail to load index for %d-th input.\n", __func__, i+1);
+                      exit(1);
+                 }
+                 data[i]->iter_idx = idx;
             }
             if (bam_parse_region(h_tmp, mplp_conf->reg, &tid, &beg, &end) < 0) {
                 fprintf(stderr, "[%s] malformatted region or wrong seqname for %d-th input.\n", __func__, i+1);
                 exit(1);
             }
             if (i == 0) tid0 = tid, beg0 = beg, end0 = end;
-            data[i]->iter = bam_iter_query(idx, tid, beg, end);
-            bam_index_destroy(idx);
+            data[i]->iter = sam_itr_queryi(idx, tid, beg, end);
+
+        } else if (mplp_conf->region) {
+            hts_idx_t *idx;
+            const plp_region_t *r = mplp_conf->region;
+            /* CRAM indices are bound to their file handle, so can't be shared */
+            if (mplp_confs[i]->input) {
+                 idx = mplp_confs[i]->input->idx;
+            } else if (mplp_confs[i]->idx && ! data[i]->fp->is_cram) {
+                 idx = (hts_idx_t *) mplp_confs[i]->idx;
+            } else {
+                 idx = sam_index_load(data[i]->fp, fn[i]);
+                 if (idx == 0) {
+                      fprintf(stderr, "[%s] fail to load index for %d-th input.\n", __func__, i+1);
+                      exit(1);
+                 }
+                 data[i]->iter_idx = idx;
+            }
+            if (r->tid < 0 || r->tid >= h_tmp->n_targets) {
+                fprintf(stderr, "[%s] invalid region tid %d for %d-th input.\n", __func__, r->tid, i+1);
+                exit(1);
+            }
+            if (i == 0) tid0 = r->tid, beg0 = r->beg, end0 = r->end;
+            data[i]->iter = sam_itr_queryi(idx, r->tid, r->beg, r->end);
         }
         if (i == 0) {
              h = h_tmp;
-        } else {
+        } else if (! mplp_confs[i]->input) {
             bam_header_destroy(h_tmp);
         }
     }
@@ -1374,18 +2727,67 @@ mpileup(const mplp_conf_t *mplp_conf,
               LOG_DEBUG("BAM header target #%d: name=%s len=%d\n", i, h->target_name[i], h->target_len[i]);
          }
     }
-    if (tid0 >= 0 && mplp_conf->fai) { /* region is set */
-         ref = faidx_fetch_seq(mplp_conf->fai, h->target_name[tid0], 0, 0x7fffffff, &ref_len);
+    /* the main loop and mplp_func() (which reads ahead) each hold
+     * their own reference to the cached sequence, so that it's only
+     * fetched once */
+    if (mplp_conf->refcache) {
+         refcache = (refcache_t *) mplp_conf->refcache;
+    } else if (mplp_conf->fai) {
+         refcache = refcache_new(mplp_conf->fai, REFCACHE_DEFAULT_MAX_BYTES);
+         refcache_open_store(refcache, mplp_conf->fa);
+    }
+    /* resolve bed once, so that lookups don't need target names */
+    if (mplp_conf->bed) {
+         if (NULL == (bed_tidx = bed_tidx_init(mplp_conf->bed, h->n_targets, h->target_name))) {
+              fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                      __FILE__, __FUNCTION__, __LINE__);
+              exit(1);
+         }
+    }
+    for (i = 0; i < n; ++i) {
+         data[i]->refcache = refcache;
+         data[i]->bed_tidx = bed_tidx;
+         /* only visit bed regions, unless a region was given anyway.
+          * query coalescing needs BAM index offsets, so CRAM is always
+          * streamed */
+         if (bed_tidx && ! data[i]->iter && 0 != strcmp(fn[i], "-") && ! data[i]->fp->is_cram) {
+              if (bed_queries_init(data[i], mplp_confs[i], fn[i])) {
+                   LOG_VERBOSE("No index found for %s. Reading whole file for bed regions\n", fn[i]);
+              }
+         }
+         if (mplp_confs[i]->qual_cache && 0 != strcmp(fn[i], "-") && ! data[i]->fp->is_cram) {
+              data[i]->qcache = qual_cache_open(mplp_confs[i]->qual_cache,
+                                                mplp_qual_cache_checksum(mplp_confs[i], fn[i]));
+         }
+         if (mplp_confs[i]->bamstats) {
+              bamstats_conf_t stats_conf;
+              memcpy(& stats_conf, & ((bamstats_t *) mplp_confs[i]->bamstats)->conf, sizeof(bamstats_conf_t));
+              stats_conf.bed_tidx = bed_tidx;
+              data[i]->bamstats = bamstats_new(& stats_conf, refcache);
+              data[i]->stats_tid = tid0;
+              data[i]->stats_beg = beg0;
+              data[i]->stats_end = end0;
+         }
+         if (mplp_confs[i]->io_threads > 0) {
+              /* bgzf_mt() only works on input with htslib >= 1.4.
+               * reading ahead works with all */
+              if (mplp_confs[i]->io_threads > 1 && ! data[i]->fp->is_cram && ! mplp_confs[i]->input &&
+                  bgzf_mt(data[i]->fp->fp.bgzf, mplp_confs[i]->io_threads, 256)) {
+                   LOG_DEBUG("No multi-threaded decompression for %s with this htslib\n", fn[i]);
+              }
+              data[i]->readahead = readahead_start(mplp_read, data[i]);
+         }
+    }
+    if (tid0 >= 0 && refcache) { /* region is set */
+         ref = refcache_get(refcache, h->target_name[tid0], &ref_len);
          if (NULL == ref || h->target_len[tid0] != ref_len) {
               LOG_FATAL("Reference fasta file doesn't seem to contain the right sequence(s) for this BAM file. (mismatch for seq %s listed in BAM header)\n", h->target_name[tid0]);
               return -1;
          }
-         strtoupper(ref);/* safeguard */
+         ref_hrun = refcache_get_hrun(refcache, h->target_name[tid0], &ref_len);
          ref_tid = tid0;
-         for (i = 0; i < n; ++i) data[i]->ref = ref, data[i]->ref_id = tid0;
     } else {
          ref_tid = -1;
-         ref = 0;
     }
     iter = bam_mplp_init(n, mplp_func, (void**)data);
     max_depth = mplp_conf->max_depth;
@@ -1403,29 +2805,50 @@ mpileup(const mplp_conf_t *mplp_conf,
 #endif
 
     LOG_DEBUG("%s\n", "Starting pileup loop");
+    plp_col_init(& plp_col);
+    for (i = 0; n > 1 && i < n; ++i) {
+         plp_col_init(& plp_cols[i]);
+         plp_col_ptrs[i] = & plp_cols[i];
+    }
     while (bam_mplp_auto(iter, &tid, &pos, n_plp, plp) > 0) {
-        plp_col_t plp_col;
         int i=0; /* NOTE: mpileup originally iterated over n */
 
-        if (mplp_conf->reg && (pos < beg0 || pos >= end0))
+        if ((mplp_conf->reg || mplp_conf->region) && (pos < beg0 || pos >= end0))
              continue; /* out of the region requested */
-        if (mplp_conf->bed && tid >= 0 && !bed_overlap(mplp_conf->bed, h->target_name[tid], pos, pos+1))
+        if (mplp_conf->region) {
+             /* end might have been lowered by another thread */
+             int stop;
+             pthread_mutex_lock(& mplp_conf->region->lock);
+             stop = (pos >= mplp_conf->region->end);
+             if (! stop) {
+                  mplp_conf->region->cur = pos;
+             }
+             pthread_mutex_unlock(& mplp_conf->region->lock);
+             if (stop) {
+                  break;
+             }
+        }
+        if (bed_tidx && tid >= 0 && !bed_tidx_overlap(bed_tidx, tid, pos, pos+1))
              continue;
         if (tid != ref_tid) {
-            free(ref); ref = 0;
-            if (mplp_conf->fai) {
-                 ref = faidx_fetch_seq(mplp_conf->fai, h->target_name[tid], 0, 0x7fffffff, &ref_len);
+            if (ref) {
+                 refcache_release(refcache, h->target_name[ref_tid]);
+                 ref = NULL;
+            }
+            if (ref_hrun) {
+                 refcache_release(refcache, h->target_name[ref_tid]);
+                 ref_hrun = NULL;
+            }
+            if (refcache) {
+                 ref = refcache_get(refcache, h->target_name[tid], &ref_len);
                  if (NULL == ref || h->target_len[tid] != ref_len) {
-                      LOG_DEBUG("ref %s at %p h->target_len[tid]=%d ref_len=%d\n", h->target_name[tid], ref, h->target_name[tid], ref_len)
+                      LOG_DEBUG("ref %s at %p h->target_len[tid]=%d ref_len=%d\n", h->target_name[tid], ref, h->target_len[tid], ref_len)
                       LOG_FATAL("Reference fasta file doesn't seem to contain the right sequence(s) for this BAM file. (mismatch for seq %s listed in BAM header).\n", h->target_name[tid]);
                       return -1;
                  }
-                 strtoupper(ref);/* safeguard */
+                 ref_hrun = refcache_get_hrun(refcache, h->target_name[tid], &ref_len);
                  LOG_DEBUG("%s\n", "sequence fetched");
             }
-            for (i = 0; i < n; ++i)  {
-                 data[i]->ref = ref, data[i]->ref_id = tid;
-            }
             ref_tid = tid;
         }
         i=0; /* i is 1 for first pos which is a bug due to the removal
@@ -1437,14 +2860,49 @@ mpileup(const mplp_conf_t *mplp_conf,
                          " %d of %s...\n", pos+1, h->target_name[tid]);
         }
 
-        compile_plp_col(&plp_col, plp[i], n_plp[i], mplp_conf,
-                        ref, pos, ref_len, h->target_name[tid]);
+        if (n == 1 && mplp_conf->flag & MPLP_ALT_ONLY &&
+            ! plp_might_have_alt(plp[i], n_plp[i], mplp_conf,
+                                 (ref && pos < ref_len)? ref[pos] : 'N')) {
+             if (mplp_conf->skip_col_func) {
+                  compile_plp_col_depth(&plp_col, plp[i], n_plp[i], mplp_conf,
+                                        (ref && pos < ref_len)? ref[pos] : 'N',
+                                        tid, h->target_name[tid], pos);
+                  (*mplp_conf->skip_col_func)(& plp_col, mplp_conf->skip_col_conf);
+             }
+             continue;
+        }
+
+        /* column state depending only on the reference is shared
+         * by all samples */
+        hrun = ref ? get_hrun(pos, ref, ref_len, ref_hrun) : -1;
 
-        (*plp_proc_func)(& plp_col, plp_proc_conf);
+        if (n == 1) {
+             PROF_START(t_compile);
+             compile_plp_col(&plp_col, plp[i], n_plp[i], mplp_conf,
+                             ref, pos, ref_len, hrun, tid, h->target_name[tid],
+                             & data[i]->aux_cache);
+             PROF_STOP(PROF_COMPILE_PLP_COL, t_compile);
 
-        plp_col_free(& plp_col);
+             (*plp_proc_func)(& plp_col, plp_proc_conf);
+        } else {
+             /* samples without coverage here get an empty column */
+             for (i = 0; i < n; ++i) {
+                  PROF_START(t_compile);
+                  compile_plp_col(&plp_cols[i], plp[i], n_plp[i], mplp_confs[i],
+                                  ref, pos, ref_len, hrun, tid, h->target_name[tid],
+                                  & data[i]->aux_cache);
+                  PROF_STOP(PROF_COMPILE_PLP_COL, t_compile);
+             }
+             (*plp_multi_func)(plp_col_ptrs, n, plp_proc_conf);
+        }
 
     } /* while bam_mplp_auto */
+    plp_col_free(& plp_col);
+    for (i = 0; n > 1 && i < n; ++i) {
+         plp_col_free(& plp_cols[i]);
+    }
+    free(plp_cols);
+    free(plp_col_ptrs);
 
 #ifdef USE_ALNERRPROF
     if (alnerrprof) {
@@ -1454,13 +2912,100 @@ mpileup(const mplp_conf_t *mplp_conf,
 #endif
     free(buf.s);
     bam_mplp_destroy(iter);
-    bam_header_destroy(h);
+    if (ref) {
+         refcache_release(refcache, h->target_name[ref_tid]);
+    }
+    if (ref_hrun) {
+         refcache_release(refcache, h->target_name[ref_tid]);
+    }
+    for (i = 0; i < n; ++i) {
+        /* before closing anything the read-ahead thread might still use */
+        readahead_stop(data[i]->readahead);
+    }
     for (i = 0; i < n; ++i) {
-        bam_close(data[i]->fp);
-        if (data[i]->iter) bam_iter_destroy(data[i]->iter);
+        if (data[i]->error) {
+             LOG_ERROR("Pileup of %s failed\n", fn[i]);
+             rc = 1;
+        }
+        if (data[i]->bamstats) {
+             bamstats_merge((bamstats_t *) mplp_confs[i]->bamstats, data[i]->bamstats);
+             bamstats_free(data[i]->bamstats);
+        }
+        if (data[i]->iter) hts_itr_destroy(data[i]->iter);
+        if (data[i]->iter_idx) hts_idx_destroy(data[i]->iter_idx);
+        if (! mplp_confs[i]->input) {
+             hts_close(data[i]->fp);
+        }
+        bed_queries_free(data[i]);
+        kpa_ext_ws_free(& data[i]->realn_ws);
+        sq_memo_free(& data[i]->sq_memo);
+        aux_cache_free(& data[i]->aux_cache);
+        qual_cache_close(data[i]->qcache);
+        if (data[i]->ref) {
+             refcache_release(refcache, h->target_name[data[i]->ref_id]);
+        }
         free(data[i]);
     }
-    free(data); free(plp); free(ref); free(n_plp);
-    return 0;
+    if (! mplp_conf->input) {
+         bam_header_destroy(h);
+    }
+    bed_tidx_destroy(bed_tidx);
+    if (refcache && refcache != mplp_conf->refcache) {
+         refcache_free(refcache);
+    }
+    free(data); free(plp); free(n_plp);
+    return rc;
+}
+/* mpileup_core() */
+
+
+int
+mpileup(const mplp_conf_t *mplp_conf,
+        void (*plp_proc_func)(const plp_col_t*, void*),
+        void *plp_proc_conf,
+        const int n, const char **fn)
+{
+    int i;
+
+    /* paranoid exit. n only allowed to be one in our case (not much
+     * of an *m*pileup, I know...). see mpileup_multi() for more */
+    if (1 != n) {
+         fprintf(stderr, "FATAL(%s:%s): need exactly one BAM files as input (got %d)\n",
+                 __FILE__, __FUNCTION__, n);
+         for (i=0; i<n; i++) {
+              fprintf(stderr, "%s\n", fn[i]);
+         }
+         return 1;
+    }
+    return mpileup_core(&mplp_conf, plp_proc_func, NULL, plp_proc_conf, n, fn);
 }
 /* mpileup() */
+
+
+int
+mpileup_multi(const mplp_conf_t **mplp_confs,
+              void (*plp_proc_func)(const plp_col_t**, const int, void*),
+              void *plp_proc_conf,
+              const int n, const char **fn)
+{
+    int i;
+
+    if (n < 2) {
+         fprintf(stderr, "FATAL(%s:%s): need at least two BAM files as input (got %d)\n",
+                 __FILE__, __FUNCTION__, n);
+         return 1;
+    }
+    for (i=0; i<n; i++) {
+         if (0 == strcmp(fn[i], "-")) {
+              LOG_FATAL("%s\n", "Can't read more than one sample from stdin");
+              return 1;
+         }
+    }
+    if (mplp_confs[0]->region) {
+         /* shared regions are only used by threaded single sample calling */
+         LOG_FATAL("%s\n", "Internal error: regions not supported for multiple samples");
+         return 1;
+    }
+    return mpileup_core(mplp_confs, NULL, plp_proc_func, plp_proc_conf, n, fn);
+}
+/* mpileup_multi() */
@@ -29,6 +29,8 @@
 #ifndef PLP_H
 #define PLP_H
 
+#include <pthread.h>
+
 #include "htslib/faidx.h"
 #include "utils.h"
 #include "vcf.h"
@@ -44,6 +46,8 @@
 #define MPLP_REDO_IDAQ   0x200
 #define MPLP_USE_SQ      0x400
 #define MPLP_ILLUMINA13  0x800
+#define MPLP_ALT_ONLY    0x1000 /* skip columns without alt evidence, i.e. only reference bases and no indels. for callers like call_vars() which ignore those anyway */
+#define MPLP_REF_HIST    0x2000 /* compact mode: qualities of reference bases are only counted in plp_col_t.ref_hist. for callers using plp_to_errprobs() only */
 
 
 extern const char *bam_nt4_rev_table; /* similar to bam_nt16_rev_table */
@@ -52,6 +56,29 @@ extern const char *bam_nt4_rev_table; /* similar to bam_nt16_rev_table */
 extern const unsigned char bam_nt4_table[256];
 
 
+/* region given as tid and coordinates, used by mpileup() instead of
+ * mplp_conf->reg if set. end might be lowered (under lock) by another
+ * thread while mpileup() is running on this region, which is how idle
+ * threads steal work. mpileup() sets cur to the last position
+ * processed.
+ */
+typedef struct {
+     int tid;
+     int beg, end; /* zero-based, half-open */
+     int cur;
+     pthread_mutex_t lock;
+} plp_region_t;
+
+
+/* input file kept open across mpileup() calls, together with its
+ * header, index and cache of decompressed blocks (see
+ * plp_input_open()). used by lofreq serve for many small queries */
+typedef struct plp_input_s plp_input_t;
+
+/* pileup column. see below */
+typedef struct plp_col_s plp_col_t;
+
+
 /* mpileup configuration structure 
  */
 typedef struct {
@@ -64,18 +91,54 @@ typedef struct {
      char *reg;
      char *fa;
      faidx_t *fai;
+     void *refcache; /* optional refcache_t for fai which can be shared between threads and calls. won't be freed by mpileup() */
      void *bed;
      char *alnerrprof_file; /* logically belongs to varcall_conf, but we need it here since only here the bam header is known */
+     void *idx; /* optional preloaded bam index which can be shared between threads. won't be freed by mpileup() */
+     plp_region_t *region; /* optional. overrides reg. see above */
+     char *qual_cache; /* optional alignment quality cache file (see qualcache.h). only used if valid */
+     int ds_depth; /* if > 0: columns deeper than this are downsampled to about this depth. see plp_col_downsample() */
+     unsigned int ds_seed; /* seed for downsampling. same seed, same reads */
+     int io_threads; /* if > 0: read BAM records ahead in a separate thread (see readahead.h). if > 1 also decompress with this many threads if htslib supports it */
+     plp_input_t *input; /* optional. used instead of opening the (only) input file. needs region. won't be closed by mpileup() */
+     void *bamstats; /* optional bamstats_t (see bamstats.h). if set, reads are counted into it as side pass. shared, i.e. threads merge into it. won't be freed by mpileup() */
+     /* optional, single sample only: called for columns skipped with
+      * MPLP_ALT_ONLY. these only have position, reference base and
+      * the depth counts coverage_plp, ds_frac and num_bases set,
+      * i.e. no qualities. used by coverage blocks */
+     void (*skip_col_func)(const plp_col_t*, void*);
+     void *skip_col_conf;
      char cmdline[1024];
 } mplp_conf_t;
 
 
+/* counts of distinct quality tuples, i.e. of reads with the same base,
+ * baq, mapping and source quality (-1 if not available)
+ */
+typedef struct {
+     int bq, baq, mq, sq;
+     int count;
+} plp_qual_tuple_t;
+
 typedef struct {
-     char *target; /* chromsome or sequence name */
+     plp_qual_tuple_t *tuples; /* in order of first occurrence */
+     int n, size;
+     int *slots; /* open addressing: index+1 into tuples, 0 if empty */
+     int num_slots; /* power of 2 */
+     long int total; /* sum of counts */
+} plp_qual_hist_t;
+
+
+struct plp_col_s {
+     const char *target; /* chromsome or sequence name. interned, i.e. points into the BAM header names and is only valid while mpileup() runs */
+     int tid; /* index of target in BAM header. compare this instead of target */
      int pos; /* position */
      char ref_base; /* uppercase reference base (given by fasta) */
      char cons_base[MAX_INDELSIZE]; /* uppercase consensus base according to base-counts, after read-level filtering. */
-     int coverage_plp; /* original samtools value. upper count limit for all kept values */
+     int coverage_plp; /* original samtools value (after downsampling). upper count limit for all kept values */
+     float ds_frac; /* fraction of reads kept by downsampling. 1.0 if not downsampled */
+     char *ds_keep; /* internal work buffer for downsampling */
+     int ds_keep_size;
      int num_bases; /* number of bases after base filtering */
      /* num_ins and num_dels gives 'num_indels' */
      int num_ign_indels; /* a hack: indels often get filtered because of low quality of missing qualities in bam file. we need to know nevertheless they are present. this is the count of all "ignored" indels */
@@ -88,6 +151,11 @@ typedef struct {
      int_varray_t baq_quals[NUM_NT4]; 
      int_varray_t map_quals[NUM_NT4]; 
      int_varray_t source_quals[NUM_NT4]; 
+     /* MPLP_REF_HIST only: quality tuples of reference bases, which
+      * are then not added to the arrays above (with the exception of
+      * values that don't fit into the histogram). i.e. reads of the
+      * reference base are those in the arrays plus ref_hist.total */
+     plp_qual_hist_t ref_hist;
 #ifdef USE_ALNERRPROF
      int_varray_t alnerr_qual[NUM_NT4]; /* FIXME this should be precomputed and then build into model */
 #endif
@@ -116,12 +184,14 @@ typedef struct {
      int_varray_t ins_map_quals;
      int_varray_t ins_source_quals;
      ins_event *ins_event_counts;
+     ins_event *ins_event_pool; /* recycled events. see plp_col_reset() */
 
      int num_dels, sum_dels;
      int_varray_t del_quals; 
      int_varray_t del_map_quals;
      int_varray_t del_source_quals;
      del_event *del_event_counts;
+     del_event *del_event_pool; /* recycled events. see plp_col_reset() */
      
      /* fw or rv counts for all non-indel events 
       * fw = 0, rv = 1*/
@@ -140,12 +210,19 @@ typedef struct {
                 * which is in the sequence context of GTTT will
                 * receive an hrun value of 3. same for ins G>GT.
                 */
-     /* changes here should be reflected in plp_col_init, plp_col_free etc. */
-} plp_col_t;
+     /* changes here should be reflected in plp_col_init, plp_col_reset, plp_col_free etc. */
+};
 
 
 #define PLP_COL_ADD_QUAL(p, q)   int_varray_add_value((p), (q))
 
+void plp_col_init(plp_col_t *p);
+
+/* clears p for reuse, keeping allocated memory */
+void plp_col_reset(plp_col_t *p);
+
+void plp_col_free(plp_col_t *p);
+
 /* initialize members of preallocated varcall_conf */
 void init_mplp_conf(mplp_conf_t *c);
 
@@ -161,8 +238,52 @@ mpileup(const mplp_conf_t *mplp_conf,
         void *plp_proc_conf, 
         const int n, const char **fn);
 
+/* like mpileup(), but piles up n>1 samples in lockstep, each with its
+ * own configuration. mplp_confs[0] determines region, bed and
+ * reference for all of them. plp_proc_func receives one column per
+ * sample for each position covered in at least one sample (columns
+ * of samples without coverage are empty). */
+int
+mpileup_multi(const mplp_conf_t **mplp_confs,
+              void (*plp_proc_func)(const plp_col_t**, const int, void*),
+              void *plp_proc_conf,
+              const int n, const char **fn);
+
+/* opens fn (BAM or CRAM) and loads header and index once for
+ * repeated region queries via mplp_conf_t.input. NULL on error */
+plp_input_t *
+plp_input_open(const mplp_conf_t *conf, const char *fn);
+
+/* parses region string reg (chrom:start-end) against header of in
+ * into tid and zero-based half-open beg and end. non-zero on error */
+int
+plp_input_parse_region(const plp_input_t *in, const char *reg, int *tid, int *beg, int *end);
+
+void
+plp_input_close(plp_input_t *in);
+
+uint64_t
+mplp_params_checksum(uint64_t h, const mplp_conf_t *conf);
+
+uint64_t
+mplp_qual_cache_checksum(const mplp_conf_t *conf, const char *bam_file);
+
+int
+mplp_qual_cache_build(const mplp_conf_t *mplp_conf, const char *bam_file);
+
+/* positions to ignore for source quality. see source_qual_load_ign_vcf() */
+typedef struct ign_pos_s ign_pos_t;
+
+int
+source_qual_load_ign_vcf(const char *vcf_path);
+
+/* ignore list for chrom. NULL if none (cheap: no allocation) */
+const ign_pos_t *
+ign_list_get(const char *chrom);
+
+/* 1 if pos is in list (which can be NULL), 0 otherwise */
 int
-source_qual_load_ign_vcf(const char *vcf_path, void *bed);
+ign_list_has_pos(const ign_pos_t *list, const long int pos);
 
 void
 source_qual_free_ign_vars();
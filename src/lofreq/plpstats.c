@@ -0,0 +1,822 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+/* Per-column sufficient statistics store. See plpstats.h.
+ *
+ * File layout (bgzf compressed, native byte order, like qualcache.c):
+ *
+ * magic[4] version(i32) mplp_flag(i32) str(ref_fa) str(cmdline)
+ * records...
+ *
+ * with str being len(i32) data[len] and records starting with a
+ * type(i32):
+ *
+ * PLPSTATS_REC_TARGET: str(name). following columns are on this target
+ * PLPSTATS_REC_COL: one plp_col_t (see plpstats_write_col())
+ *
+ * Histograms of quality tuples are stored as
+ *
+ * mask(i32) num_entries(i32) and per entry: one value(i32) per array
+ * in mask followed by count(i32)
+ *
+ * where mask has bit i set if array i was non-empty. All non-empty
+ * arrays of a tuple have the same length by construction.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+#include "plp.h"
+#include "plpstats.h"
+
+
+#define PLPSTATS_VERSION 1
+#define PLPSTATS_REC_TARGET 1
+#define PLPSTATS_REC_COL 2
+#define PLPSTATS_MAX_TUPLE 4
+
+static const char plpstats_magic[4] = {'L', 'P', 'S', '\1'};
+
+typedef struct {
+     int v[PLPSTATS_MAX_TUPLE];
+} qual_tuple_t;
+
+
+static int
+qual_tuple_cmp(const void *a, const void *b)
+{
+     return memcmp(a, b, sizeof(qual_tuple_t));
+}
+/* qual_tuple_cmp() */
+
+
+static void
+w_bytes(plpstats_t *s, const void *data, const size_t len)
+{
+     if (! s->err && bgzf_write(s->fp, data, len) != (ssize_t)len) {
+          s->err = 1;
+     }
+}
+/* w_bytes() */
+
+
+static void
+w_i32(plpstats_t *s, const int32_t v)
+{
+     w_bytes(s, &v, sizeof(int32_t));
+}
+/* w_i32() */
+
+
+static void
+w_i64(plpstats_t *s, const int64_t v)
+{
+     w_bytes(s, &v, sizeof(int64_t));
+}
+/* w_i64() */
+
+
+static void
+w_str(plpstats_t *s, const char *str)
+{
+     int32_t len = str ? strlen(str) : 0;
+     w_i32(s, len);
+     w_bytes(s, str, len);
+}
+/* w_str() */
+
+
+static void
+r_bytes(plpstats_t *s, void *data, const size_t len)
+{
+     if (! s->err && bgzf_read(s->fp, data, len) != (ssize_t)len) {
+          s->err = 1;
+     }
+}
+/* r_bytes() */
+
+
+static int32_t
+r_i32(plpstats_t *s)
+{
+     int32_t v = 0;
+     r_bytes(s, &v, sizeof(int32_t));
+     return v;
+}
+/* r_i32() */
+
+
+static int64_t
+r_i64(plpstats_t *s)
+{
+     int64_t v = 0;
+     r_bytes(s, &v, sizeof(int64_t));
+     return v;
+}
+/* r_i64() */
+
+
+/* returns malloced string. NULL on error */
+static char *
+r_str(plpstats_t *s)
+{
+     int32_t len = r_i32(s);
+     char *str;
+
+     if (s->err || len < 0) {
+          s->err = 1;
+          return NULL;
+     }
+     if (NULL == (str = malloc(len+1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     r_bytes(s, str, len);
+     str[len] = '\0';
+     return str;
+}
+/* r_str() */
+
+
+static qual_tuple_t *
+tuples_reserve(plpstats_t *s, const int n)
+{
+     if (n > s->tuples_size) {
+          s->tuples_size = n > 2*s->tuples_size ? n : 2*s->tuples_size;
+          if (NULL == (s->tuples = realloc(s->tuples, s->tuples_size * sizeof(qual_tuple_t)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+     }
+     return (qual_tuple_t *)s->tuples;
+}
+/* tuples_reserve() */
+
+
+/* writes histogram of the num_arrs parallel arrays. empty ones are
+ * skipped */
+static void
+w_hist(plpstats_t *s, const int_varray_t **arrs, const int num_arrs)
+{
+     qual_tuple_t *t;
+     int32_t mask = 0;
+     int n = 0, num_entries = 0;
+     int a, i, j;
+
+     for (a=0; a<num_arrs; a++) {
+          if (arrs[a]->n) {
+               if (n && arrs[a]->n != n) {
+                    LOG_FATAL("Internal error: quality arrays of different length (%d vs %d)\n",
+                              n, arrs[a]->n);
+                    exit(1);
+               }
+               n = arrs[a]->n;
+               mask |= 1<<a;
+          }
+     }
+
+     t = tuples_reserve(s, n);
+     for (i=0; i<n; i++) {
+          memset(&t[i], 0, sizeof(qual_tuple_t));
+          for (a=0; a<num_arrs; a++) {
+               if (mask & 1<<a) {
+                    t[i].v[a] = arrs[a]->data[i];
+               }
+          }
+     }
+     qsort(t, n, sizeof(qual_tuple_t), qual_tuple_cmp);
+     for (i=0; i<n; i++) {
+          if (0 == i || qual_tuple_cmp(&t[i], &t[i-1])) {
+               num_entries += 1;
+          }
+     }
+
+     w_i32(s, mask);
+     w_i32(s, num_entries);
+     for (i=0; i<n; i=j) {
+          for (j=i+1; j<n && 0 == qual_tuple_cmp(&t[i], &t[j]); j++) {
+               ;
+          }
+          for (a=0; a<num_arrs; a++) {
+               if (mask & 1<<a) {
+                    w_i32(s, t[i].v[a]);
+               }
+          }
+          w_i32(s, j-i);
+     }
+}
+/* w_hist() */
+
+
+/* reads a histogram written by w_hist() and appends its values to
+ * arrs */
+static void
+r_hist(plpstats_t *s, int_varray_t **arrs, const int num_arrs)
+{
+     int32_t mask = r_i32(s);
+     int32_t num_entries = r_i32(s);
+     int e, a, c;
+
+     if (s->err || num_entries < 0 || mask >= 1<<num_arrs) {
+          s->err = 1;
+          return;
+     }
+     for (e=0; e<num_entries && ! s->err; e++) {
+          int v[PLPSTATS_MAX_TUPLE];
+          int32_t count;
+          for (a=0; a<num_arrs; a++) {
+               v[a] = (mask & 1<<a) ? r_i32(s) : 0;
+          }
+          count = r_i32(s);
+          for (c=0; c<count; c++) {
+               for (a=0; a<num_arrs; a++) {
+                    if (mask & 1<<a) {
+                         int_varray_add_value(arrs[a], v[a]);
+                    }
+               }
+          }
+     }
+}
+/* r_hist() */
+
+
+int
+plpstats_write_open(plpstats_t *s, const char *path, const mplp_conf_t *mplp_conf)
+{
+     memset(s, 0, sizeof(plpstats_t));
+     s->mode = 'w';
+     s->last_tid = -1;
+     if (NULL == (s->fp = bgzf_open(path, "w"))) {
+          LOG_ERROR("Couldn't open %s for writing\n", path);
+          return -1;
+     }
+     s->mplp_flag = mplp_conf->flag;
+     w_bytes(s, plpstats_magic, 4);
+     w_i32(s, PLPSTATS_VERSION);
+     w_i32(s, s->mplp_flag);
+     w_str(s, mplp_conf->fa);
+     w_str(s, mplp_conf->cmdline);
+     if (s->err) {
+          LOG_ERROR("Couldn't write to %s\n", path);
+          bgzf_close(s->fp);
+          s->fp = NULL;
+          return -1;
+     }
+     return 0;
+}
+/* plpstats_write_open() */
+
+
+/**
+ * @brief Appends column p. Returns non-zero on error
+ */
+int
+plpstats_write_col(plpstats_t *s, const plp_col_t *p)
+{
+     const int_varray_t *arrs[PLPSTATS_MAX_TUPLE];
+     ins_event *ins_it, *ins_it_tmp;
+     del_event *del_it, *del_it_tmp;
+     int i;
+
+     if (p->tid != s->last_tid) {
+          w_i32(s, PLPSTATS_REC_TARGET);
+          w_str(s, p->target);
+          s->last_tid = p->tid;
+     }
+
+     w_i32(s, PLPSTATS_REC_COL);
+     w_i32(s, p->pos);
+     w_i32(s, p->ref_base);
+     w_str(s, p->cons_base);
+     w_i32(s, p->coverage_plp);
+     w_bytes(s, &p->ds_frac, sizeof(float));
+     w_i32(s, p->num_bases);
+     w_i32(s, p->num_ign_indels);
+     w_i32(s, p->num_heads);
+     w_i32(s, p->num_tails);
+     w_i32(s, p->num_non_indels);
+     w_i32(s, p->num_ins);
+     w_i32(s, p->sum_ins);
+     w_i32(s, p->num_dels);
+     w_i32(s, p->sum_dels);
+     w_i32(s, p->has_indel_aqs);
+     w_i32(s, p->hrun);
+     for (i=0; i<NUM_NT4; i++) {
+          w_i64(s, p->fw_counts[i]);
+          w_i64(s, p->rv_counts[i]);
+     }
+     for (i=0; i<2; i++) {
+          w_i64(s, p->non_ins_fw_rv[i]);
+          w_i64(s, p->non_del_fw_rv[i]);
+     }
+
+     for (i=0; i<NUM_NT4; i++) {
+          arrs[0] = & p->base_quals[i];
+          arrs[1] = & p->baq_quals[i];
+          arrs[2] = & p->map_quals[i];
+          arrs[3] = & p->source_quals[i];
+          w_hist(s, arrs, 4);
+     }
+
+     /* no-event qualities. source qualities are not parallel to
+      * these, see compile_plp_col() */
+     arrs[0] = & p->ins_quals;
+     arrs[1] = & p->ins_map_quals;
+     w_hist(s, arrs, 2);
+     arrs[0] = & p->ins_source_quals;
+     w_hist(s, arrs, 1);
+     arrs[0] = & p->del_quals;
+     arrs[1] = & p->del_map_quals;
+     w_hist(s, arrs, 2);
+     arrs[0] = & p->del_source_quals;
+     w_hist(s, arrs, 1);
+
+     /* events in hash order, so that they get called in the same order */
+     w_i32(s, HASH_CNT(hh_ins, p->ins_event_counts));
+     HASH_ITER(hh_ins, p->ins_event_counts, ins_it, ins_it_tmp) {
+          w_str(s, ins_it->key);
+          w_i64(s, ins_it->fw_rv[0]);
+          w_i64(s, ins_it->fw_rv[1]);
+          arrs[0] = & ins_it->ins_quals;
+          arrs[1] = & ins_it->ins_aln_quals;
+          arrs[2] = & ins_it->ins_map_quals;
+          arrs[3] = & ins_it->ins_source_quals;
+          w_hist(s, arrs, 4);
+     }
+     w_i32(s, HASH_CNT(hh_del, p->del_event_counts));
+     HASH_ITER(hh_del, p->del_event_counts, del_it, del_it_tmp) {
+          w_str(s, del_it->key);
+          w_i64(s, del_it->fw_rv[0]);
+          w_i64(s, del_it->fw_rv[1]);
+          arrs[0] = & del_it->del_quals;
+          arrs[1] = & del_it->del_aln_quals;
+          arrs[2] = & del_it->del_map_quals;
+          arrs[3] = & del_it->del_source_quals;
+          w_hist(s, arrs, 4);
+     }
+
+     s->num_cols += 1;
+     return s->err;
+}
+/* plpstats_write_col() */
+
+
+int
+plpstats_read_open(plpstats_t *s, const char *path)
+{
+     char magic[4];
+     int32_t version;
+
+     memset(s, 0, sizeof(plpstats_t));
+     s->mode = 'r';
+     s->tid = -1;
+     if (NULL == (s->fp = bgzf_open(path, "r"))) {
+          LOG_ERROR("Couldn't open %s\n", path);
+          return -1;
+     }
+     r_bytes(s, magic, 4);
+     version = r_i32(s);
+     if (s->err || memcmp(magic, plpstats_magic, 4)) {
+          LOG_ERROR("%s is not a LoFreq pileup stats file\n", path);
+          plpstats_close(s);
+          return -1;
+     }
+     if (version != PLPSTATS_VERSION) {
+          LOG_ERROR("Unsupported version %d of pileup stats file %s\n", version, path);
+          plpstats_close(s);
+          return -1;
+     }
+     s->mplp_flag = r_i32(s);
+     s->ref_fa = r_str(s);
+     s->cmdline = r_str(s);
+     if (s->err) {
+          LOG_ERROR("Couldn't read header of %s\n", path);
+          plpstats_close(s);
+          return -1;
+     }
+     return 0;
+}
+/* plpstats_read_open() */
+
+
+/* reads the event histogram for the last inserted event (key) by
+ * adding reads one by one, then fixing strand counts */
+static void
+r_ins_event(plpstats_t *s, plp_col_t *p)
+{
+     int_varray_t arrs[4];
+     int_varray_t *arr_ptrs[4];
+     char *key = r_str(s);
+     long int fw_rv[2];
+     ins_event *it;
+     int a, i;
+
+     fw_rv[0] = r_i64(s);
+     fw_rv[1] = r_i64(s);
+     for (a=0; a<4; a++) {
+          int_varray_init(&arrs[a], 0);
+          arr_ptrs[a] = &arrs[a];
+     }
+     r_hist(s, arr_ptrs, 4);
+     if (! s->err && arrs[0].n) {
+          for (i=0; i<arrs[0].n; i++) {
+               add_ins_sequence(& p->ins_event_counts, & p->ins_event_pool, key,
+                                arrs[0].data[i], arrs[1].data[i],
+                                arrs[2].data[i], arrs[3].data[i], 0);
+          }
+          it = find_ins_sequence(& p->ins_event_counts, key);
+          it->fw_rv[0] = fw_rv[0];
+          it->fw_rv[1] = fw_rv[1];
+     }
+     for (a=0; a<4; a++) {
+          int_varray_free(&arrs[a]);
+     }
+     free(key);
+}
+/* r_ins_event() */
+
+
+/* same as r_ins_event() but for deletions */
+static void
+r_del_event(plpstats_t *s, plp_col_t *p)
+{
+     int_varray_t arrs[4];
+     int_varray_t *arr_ptrs[4];
+     char *key = r_str(s);
+     long int fw_rv[2];
+     del_event *it;
+     int a, i;
+
+     fw_rv[0] = r_i64(s);
+     fw_rv[1] = r_i64(s);
+     for (a=0; a<4; a++) {
+          int_varray_init(&arrs[a], 0);
+          arr_ptrs[a] = &arrs[a];
+     }
+     r_hist(s, arr_ptrs, 4);
+     if (! s->err && arrs[0].n) {
+          for (i=0; i<arrs[0].n; i++) {
+               add_del_sequence(& p->del_event_counts, & p->del_event_pool, key,
+                                arrs[0].data[i], arrs[1].data[i],
+                                arrs[2].data[i], arrs[3].data[i], 0);
+          }
+          it = find_del_sequence(& p->del_event_counts, key);
+          it->fw_rv[0] = fw_rv[0];
+          it->fw_rv[1] = fw_rv[1];
+     }
+     for (a=0; a<4; a++) {
+          int_varray_free(&arrs[a]);
+     }
+     free(key);
+}
+/* r_del_event() */
+
+
+/**
+ * @brief Reads the next column into p, which has to be initialized
+ * with plp_col_init() and will be reset here. p->target stays valid
+ * until plpstats_close(). Returns 1 if a column was read, 0 at end of
+ * file and -1 on error.
+ */
+int
+plpstats_read_col(plpstats_t *s, plp_col_t *p)
+{
+     int_varray_t *arrs[PLPSTATS_MAX_TUPLE];
+     int32_t type;
+     int32_t num_events;
+     int i;
+
+     while (1) {
+          int ret = bgzf_read(s->fp, &type, sizeof(int32_t));
+          if (0 == ret) {
+               return 0;
+          } else if (ret != sizeof(int32_t)) {
+               return -1;
+          }
+          if (PLPSTATS_REC_COL == type) {
+               break;
+          } else if (PLPSTATS_REC_TARGET != type) {
+               LOG_ERROR("Unknown record type %d in pileup stats file\n", type);
+               return -1;
+          }
+          if (s->num_targets == s->max_targets) {
+               s->max_targets = s->max_targets ? 2*s->max_targets : 64;
+               if (NULL == (s->targets = realloc(s->targets, s->max_targets * sizeof(char *)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          if (NULL == (s->targets[s->num_targets] = r_str(s))) {
+               return -1;
+          }
+          s->tid = s->num_targets;
+          s->num_targets += 1;
+     }
+     if (s->tid < 0) {
+          LOG_ERROR("%s\n", "Column without target in pileup stats file");
+          return -1;
+     }
+
+     plp_col_reset(p);
+     p->target = s->targets[s->tid];
+     p->tid = s->tid;
+     p->pos = r_i32(s);
+     p->ref_base = r_i32(s);
+     {
+          char *cons_base = r_str(s);
+          if (cons_base) {
+               strncpy(p->cons_base, cons_base, MAX_INDELSIZE-1);
+               p->cons_base[MAX_INDELSIZE-1] = '\0';
+               free(cons_base);
+          }
+     }
+     p->coverage_plp = r_i32(s);
+     r_bytes(s, &p->ds_frac, sizeof(float));
+     p->num_bases = r_i32(s);
+     p->num_ign_indels = r_i32(s);
+     p->num_heads = r_i32(s);
+     p->num_tails = r_i32(s);
+     p->num_non_indels = r_i32(s);
+     p->num_ins = r_i32(s);
+     p->sum_ins = r_i32(s);
+     p->num_dels = r_i32(s);
+     p->sum_dels = r_i32(s);
+     p->has_indel_aqs = r_i32(s);
+     p->hrun = r_i32(s);
+     for (i=0; i<NUM_NT4; i++) {
+          p->fw_counts[i] = r_i64(s);
+          p->rv_counts[i] = r_i64(s);
+     }
+     for (i=0; i<2; i++) {
+          p->non_ins_fw_rv[i] = r_i64(s);
+          p->non_del_fw_rv[i] = r_i64(s);
+     }
+
+     for (i=0; i<NUM_NT4; i++) {
+          arrs[0] = & p->base_quals[i];
+          arrs[1] = & p->baq_quals[i];
+          arrs[2] = & p->map_quals[i];
+          arrs[3] = & p->source_quals[i];
+          r_hist(s, arrs, 4);
+     }
+     arrs[0] = & p->ins_quals;
+     arrs[1] = & p->ins_map_quals;
+     r_hist(s, arrs, 2);
+     arrs[0] = & p->ins_source_quals;
+     r_hist(s, arrs, 1);
+     arrs[0] = & p->del_quals;
+     arrs[1] = & p->del_map_quals;
+     r_hist(s, arrs, 2);
+     arrs[0] = & p->del_source_quals;
+     r_hist(s, arrs, 1);
+
+     num_events = r_i32(s);
+     for (i=0; i<num_events && ! s->err; i++) {
+          r_ins_event(s, p);
+     }
+     num_events = r_i32(s);
+     for (i=0; i<num_events && ! s->err; i++) {
+          r_del_event(s, p);
+     }
+
+     if (s->err) {
+          LOG_ERROR("%s\n", "Truncated or corrupt pileup stats file");
+          return -1;
+     }
+     s->num_cols += 1;
+     return 1;
+}
+/* plpstats_read_col() */
+
+
+static void
+int_varray_append(int_varray_t *dst, const int_varray_t *src)
+{
+     int i;
+     for (i=0; i<src->n; i++) {
+          int_varray_add_value(dst, src->data[i]);
+     }
+}
+/* int_varray_append() */
+
+
+/* recomputes the consensus of a merged column from its qualities.
+ * same rules as the end of compile_plp_col() in plp.c: an indel event
+ * is the consensus if the sum of its qualities is larger than that of
+ * all non-events, otherwise the base with the highest sum of base
+ * probabilities */
+static void
+col_cons_from_quals(plp_col_t *p)
+{
+     double base_counts[NUM_NT4] = { 0 };
+     int ins_nonevent_qual = 0, del_nonevent_qual = 0;
+     int ins_maxevent_qual = 0, del_maxevent_qual = 0;
+     const char *ins_maxevent_key = NULL, *del_maxevent_key = NULL;
+     ins_event *ins_it, *ins_it_tmp;
+     del_event *del_it, *del_it_tmp;
+     int i, j;
+
+     for (i=0; i<NUM_NT4; i++) {
+          for (j=0; j<p->base_quals[i].n; j++) {
+               double count_incr = 1.0 - PHREDQUAL_TO_PROB(p->base_quals[i].data[j]);
+               base_counts[i] += (count_incr == 0.0 ? DBL_MIN : count_incr);
+          }
+     }
+     for (j=0; j<p->ins_quals.n; j++) {
+          ins_nonevent_qual += p->ins_quals.data[j];
+     }
+     for (j=0; j<p->del_quals.n; j++) {
+          del_nonevent_qual += p->del_quals.data[j];
+     }
+     HASH_ITER(hh_ins, p->ins_event_counts, ins_it, ins_it_tmp) {
+          if (ins_it->cons_quals > ins_maxevent_qual) {
+               ins_maxevent_key = ins_it->key;
+               ins_maxevent_qual = ins_it->cons_quals;
+          }
+     }
+     HASH_ITER(hh_del, p->del_event_counts, del_it, del_it_tmp) {
+          if (del_it->cons_quals > del_maxevent_qual) {
+               del_maxevent_key = del_it->key;
+               del_maxevent_qual = del_it->cons_quals;
+          }
+     }
+
+     if (ins_maxevent_qual > ins_nonevent_qual) {
+          p->cons_base[0] = '+';
+          strncpy(p->cons_base+1, ins_maxevent_key, MAX_INDELSIZE-2);
+     } else if (del_maxevent_qual > del_nonevent_qual) {
+          p->cons_base[0] = '-';
+          strncpy(p->cons_base+1, del_maxevent_key, MAX_INDELSIZE-2);
+     } else {
+          p->cons_base[0] = bam_nt4_rev_table[argmax_d(base_counts, NUM_NT4)];
+          p->cons_base[1] = '\0';
+     }
+     p->cons_base[MAX_INDELSIZE-1] = '\0';
+}
+/* col_cons_from_quals() */
+
+
+/**
+ * @brief Adds the statistics of column src to dst, which has to be
+ * the same column (target and position) piled up from different
+ * reads, e.g. another sequencing lane of the same sample. Qualities
+ * and counts are added up, indel events merged by sequence (new ones
+ * go after the existing ones) and the consensus recomputed. Returns
+ * non-zero if columns don't match.
+ */
+int
+plpstats_col_merge(plp_col_t *dst, const plp_col_t *src)
+{
+     ins_event *ins_it, *ins_it_tmp;
+     del_event *del_it, *del_it_tmp;
+     int i;
+
+     if (dst->pos != src->pos || dst->ref_base != src->ref_base) {
+          LOG_ERROR("Can't merge pileup stats of different columns (%s:%d %c vs %s:%d %c)\n",
+                    dst->target, dst->pos+1, dst->ref_base,
+                    src->target, src->pos+1, src->ref_base);
+          return -1;
+     }
+
+     /* downsampling: fraction of all reads kept */
+     if (dst->ds_frac < 1.0 || src->ds_frac < 1.0) {
+          double n_plp = dst->coverage_plp / (double) dst->ds_frac
+               + src->coverage_plp / (double) src->ds_frac;
+          double ds_frac = (dst->coverage_plp + src->coverage_plp) / n_plp;
+          dst->ds_frac = ds_frac < 1.0 ? ds_frac : 1.0;
+     }
+     dst->coverage_plp += src->coverage_plp;
+     dst->num_bases += src->num_bases;
+     dst->num_ign_indels += src->num_ign_indels;
+     dst->num_heads += src->num_heads;
+     dst->num_tails += src->num_tails;
+     dst->num_non_indels += src->num_non_indels;
+     dst->num_ins += src->num_ins;
+     dst->sum_ins += src->sum_ins;
+     dst->num_dels += src->num_dels;
+     dst->sum_dels += src->sum_dels;
+     dst->has_indel_aqs |= src->has_indel_aqs;
+     /* hrun only depends on the reference */
+     for (i=0; i<NUM_NT4; i++) {
+          dst->fw_counts[i] += src->fw_counts[i];
+          dst->rv_counts[i] += src->rv_counts[i];
+     }
+     for (i=0; i<2; i++) {
+          dst->non_ins_fw_rv[i] += src->non_ins_fw_rv[i];
+          dst->non_del_fw_rv[i] += src->non_del_fw_rv[i];
+     }
+
+     for (i=0; i<NUM_NT4; i++) {
+          int_varray_append(& dst->base_quals[i], & src->base_quals[i]);
+          int_varray_append(& dst->baq_quals[i], & src->baq_quals[i]);
+          int_varray_append(& dst->map_quals[i], & src->map_quals[i]);
+          int_varray_append(& dst->source_quals[i], & src->source_quals[i]);
+     }
+     int_varray_append(& dst->ins_quals, & src->ins_quals);
+     int_varray_append(& dst->ins_map_quals, & src->ins_map_quals);
+     int_varray_append(& dst->ins_source_quals, & src->ins_source_quals);
+     int_varray_append(& dst->del_quals, & src->del_quals);
+     int_varray_append(& dst->del_map_quals, & src->del_map_quals);
+     int_varray_append(& dst->del_source_quals, & src->del_source_quals);
+
+     /* events are added read by read as in r_ins_event(), which counts
+      * them as forward strand. strand counts are fixed afterwards */
+     HASH_ITER(hh_ins, src->ins_event_counts, ins_it, ins_it_tmp) {
+          ins_event *it;
+          int n = ins_it->ins_quals.n;
+          if (! n) {
+               continue;
+          }
+          for (i=0; i<n; i++) {
+               add_ins_sequence(& dst->ins_event_counts, & dst->ins_event_pool, ins_it->key,
+                                ins_it->ins_quals.data[i], ins_it->ins_aln_quals.data[i],
+                                ins_it->ins_map_quals.data[i], ins_it->ins_source_quals.data[i], 0);
+          }
+          it = find_ins_sequence(& dst->ins_event_counts, ins_it->key);
+          it->fw_rv[0] += ins_it->fw_rv[0] - n;
+          it->fw_rv[1] += ins_it->fw_rv[1];
+     }
+     HASH_ITER(hh_del, src->del_event_counts, del_it, del_it_tmp) {
+          del_event *it;
+          int n = del_it->del_quals.n;
+          if (! n) {
+               continue;
+          }
+          for (i=0; i<n; i++) {
+               add_del_sequence(& dst->del_event_counts, & dst->del_event_pool, del_it->key,
+                                del_it->del_quals.data[i], del_it->del_aln_quals.data[i],
+                                del_it->del_map_quals.data[i], del_it->del_source_quals.data[i], 0);
+          }
+          it = find_del_sequence(& dst->del_event_counts, del_it->key);
+          it->fw_rv[0] += del_it->fw_rv[0] - n;
+          it->fw_rv[1] += del_it->fw_rv[1];
+     }
+
+     col_cons_from_quals(dst);
+     return 0;
+}
+/* plpstats_col_merge() */
+
+
+/**
+ * @brief Closes file and frees everything. Returns non-zero on error
+ * (incl. earlier write errors)
+ */
+int
+plpstats_close(plpstats_t *s)
+{
+     int rc = s->err;
+     int i;
+
+     if (s->fp && bgzf_close(s->fp)) {
+          rc = -1;
+     }
+     s->fp = NULL;
+     if (s->mode == 'r') {
+          free(s->ref_fa);
+          free(s->cmdline);
+     }
+     s->ref_fa = s->cmdline = NULL;
+     for (i=0; i<s->num_targets; i++) {
+          free(s->targets[i]);
+     }
+     free(s->targets);
+     s->targets = NULL;
+     s->num_targets = s->max_targets = 0;
+     free(s->tuples);
+     s->tuples = NULL;
+     s->tuples_size = 0;
+     return rc;
+}
+/* plpstats_close() */
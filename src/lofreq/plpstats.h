@@ -0,0 +1,89 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+#ifndef PLPSTATS_H
+#define PLPSTATS_H
+
+#include "htslib/bgzf.h"
+
+#include "plp.h"
+
+/* Store of per-column sufficient statistics, i.e. a serialized
+ * plp_col_t, written by lofreq call --stats-out and read back by
+ * --from-stats. Everything the callers (call_snvs(), call_indels())
+ * need is kept, with per-read qualities collapsed into histograms of
+ * quality tuples (order of reads doesn't matter for calling). This
+ * allows re-calling with different calling thresholds without
+ * touching the BAM again. Anything that happens during pileup (BAQ,
+ * IDAQ, source quality, read filtering, min_plp_bq etc.) is fixed at
+ * the time of writing. Files of all columns (--stats-all-cols) of
+ * different reads of one sample can be added up with lofreq
+ * stats-merge (see plpstats_col_merge()).
+ */
+
+#define PLPSTATS_EXT ".lps"
+
+typedef struct {
+     BGZF *fp;
+     char mode; /* 'r' or 'w' */
+     char *ref_fa; /* reference used when writing. for vcf header */
+     char *cmdline; /* command line used when writing */
+     int mplp_flag; /* mplp_conf->flag used when writing */
+     int last_tid; /* writer: tid of last column written */
+     int tid; /* reader: index of current target */
+     char **targets; /* reader: target names seen so far */
+     int num_targets, max_targets;
+     int err; /* set on read/write error */
+     void *tuples; /* work buffer for histograms */
+     int tuples_size;
+     long int num_cols; /* stats */
+} plpstats_t;
+
+
+int
+plpstats_write_open(plpstats_t *s, const char *path, const mplp_conf_t *mplp_conf);
+
+int
+plpstats_write_col(plpstats_t *s, const plp_col_t *p);
+
+int
+plpstats_read_open(plpstats_t *s, const char *path);
+
+int
+plpstats_read_col(plpstats_t *s, plp_col_t *p);
+
+int
+plpstats_close(plpstats_t *s);
+
+/* adds column src to dst (same column, different reads). see
+ * lofreq stats-merge */
+int
+plpstats_col_merge(plp_col_t *dst, const plp_col_t *src);
+
+#endif
@@ -0,0 +1,170 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+/* Runtime profiling of hot paths. See profile.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "profile.h"
+
+
+int prof_enabled = 0;
+
+static const char *prof_stage_names[PROF_NUM_STAGES] = {
+     "bam_read",
+     "baq_idaq",
+     "source_qual",
+     "compile_plp_col",
+     "errprobs",
+     "dp",
+     "vcf_write"
+};
+
+static uint64_t prof_calls[PROF_NUM_STAGES];
+static uint64_t prof_ns[PROF_NUM_STAGES];
+
+/* dp stats */
+static uint64_t prof_dp_runs;
+static uint64_t prof_dp_pruned;
+static uint64_t prof_dp_sum_n;
+static uint64_t prof_dp_sum_k;
+static uint64_t prof_dp_sum_n_stop;
+static int prof_dp_max_n;
+static int prof_dp_max_k;
+
+static uint64_t prof_start_ns;
+
+
+uint64_t
+prof_now(void)
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+/* prof_now() */
+
+
+void
+prof_enable(void)
+{
+     prof_start_ns = prof_now();
+     prof_enabled = 1;
+}
+/* prof_enable() */
+
+
+void
+prof_add(const prof_stage_t stage, const uint64_t ns)
+{
+     __sync_fetch_and_add(& prof_calls[stage], 1);
+     __sync_fetch_and_add(& prof_ns[stage], ns);
+}
+/* prof_add() */
+
+
+/* lock free max */
+static void
+prof_update_max(int *max, const int val)
+{
+     int cur = *max;
+     while (val > cur) {
+          int prev = __sync_val_compare_and_swap(max, cur, val);
+          if (prev == cur) {
+               break;
+          }
+          cur = prev;
+     }
+}
+/* prof_update_max() */
+
+
+void
+prof_dp(const int N, const int K, const int n_stop)
+{
+     if (! prof_enabled) {
+          return;
+     }
+     __sync_fetch_and_add(& prof_dp_runs, 1);
+     __sync_fetch_and_add(& prof_dp_sum_n, N);
+     __sync_fetch_and_add(& prof_dp_sum_k, K);
+     __sync_fetch_and_add(& prof_dp_sum_n_stop, n_stop);
+     if (n_stop < N) {
+          __sync_fetch_and_add(& prof_dp_pruned, 1);
+     }
+     prof_update_max(& prof_dp_max_n, N);
+     prof_update_max(& prof_dp_max_k, K);
+}
+/* prof_dp() */
+
+
+int
+prof_write_json(const char *path)
+{
+     FILE *fh;
+     int i;
+     double wall = (prof_now() - prof_start_ns) / 1e9;
+
+     if (0 == strcmp(path, "-")) {
+          fh = stderr;
+     } else if (NULL == (fh = fopen(path, "w"))) {
+          LOG_ERROR("Couldn't open %s for writing profile\n", path);
+          return -1;
+     }
+
+     fprintf(fh, "{\n");
+     fprintf(fh, "  \"wall_time_s\": %.6f,\n", wall);
+     fprintf(fh, "  \"stages\": {\n");
+     for (i=0; i<PROF_NUM_STAGES; i++) {
+          fprintf(fh, "    \"%s\": {\"calls\": %llu, \"time_s\": %.6f, \"mean_us\": %.3f}%s\n",
+                  prof_stage_names[i], (unsigned long long)prof_calls[i], prof_ns[i]/1e9,
+                  prof_calls[i] ? prof_ns[i]/1e3/prof_calls[i] : 0.0,
+                  i<PROF_NUM_STAGES-1 ? "," : "");
+     }
+     fprintf(fh, "  },\n");
+     fprintf(fh, "  \"dp\": {\"runs\": %llu, \"pruned\": %llu, \"mean_n\": %.2f, \"mean_k\": %.2f,"
+             " \"max_n\": %d, \"max_k\": %d, \"mean_stop_frac\": %.4f}\n",
+             (unsigned long long)prof_dp_runs, (unsigned long long)prof_dp_pruned,
+             prof_dp_runs ? prof_dp_sum_n/(double)prof_dp_runs : 0.0,
+             prof_dp_runs ? prof_dp_sum_k/(double)prof_dp_runs : 0.0,
+             prof_dp_max_n, prof_dp_max_k,
+             prof_dp_sum_n ? prof_dp_sum_n_stop/(double)prof_dp_sum_n : 1.0);
+     fprintf(fh, "}\n");
+
+     if (fh != stderr) {
+          fclose(fh);
+     }
+     return 0;
+}
+/* prof_write_json() */
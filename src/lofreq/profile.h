@@ -0,0 +1,81 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+
+/* runtime profiling of hot paths. off by default, in which case each
+ * probe costs a single branch. enabled with prof_enable() (lofreq
+ * call --profile). counters are updated atomically, so probes can be
+ * used from all threads. times are wall-clock (monotonic) and summed
+ * over threads.
+ */
+typedef enum {
+     PROF_BAM_READ = 0, /* reading/decoding alignments in mplp_func() */
+     PROF_BAQ_IDAQ, /* BAQ and/or IDAQ computation in mplp_func() */
+     PROF_SOURCE_QUAL, /* source_qual() */
+     PROF_COMPILE_PLP_COL, /* compile_plp_col() */
+     PROF_ERRPROBS, /* plp_to_errprobs(), plp_to_ins_errprobs() and plp_to_del_errprobs() */
+     PROF_DP, /* Poisson-binomial. see also prof_dp() */
+     PROF_VCF_WRITE, /* vcf_write_var() */
+     PROF_NUM_STAGES
+} prof_stage_t;
+
+
+extern int prof_enabled;
+
+/* start a timer named t for a stage */
+#define PROF_START(t) uint64_t t = prof_enabled ? prof_now() : 0
+/* stop timer t and account it to stage s */
+#define PROF_STOP(s, t) do { if (prof_enabled) { prof_add((s), prof_now()-(t)); } } while (0)
+
+
+void
+prof_enable(void);
+
+uint64_t
+prof_now(void);
+
+void
+prof_add(const prof_stage_t stage, const uint64_t ns);
+
+/* record one Poisson-binomial DP over N error probs up to K
+ * failures, which stopped (pruned) after n_stop of them. n_stop=N
+ * means no pruning */
+void
+prof_dp(const int N, const int K, const int n_stop);
+
+/* write summary as JSON to path ("-" for stderr) */
+int
+prof_write_json(const char *path);
+
+#endif
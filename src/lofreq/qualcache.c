@@ -0,0 +1,572 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Sidecar cache for per-read alignment and source qualities. See
+ * qualcache.h.
+ *
+ * File layout (native byte order; the cache is meant to live next to
+ * the BAM, not to be shared between machines):
+ *
+ * magic[4] checksum(u64) index_offset(i64)
+ * records...
+ * num_blks(i32) blks[num_blks]
+ *
+ * with records sorted by key and grouped into blocks of
+ * QUAL_CACHE_BLK_RECS. Each record is
+ *
+ * key(i64) name_hash(u32) sq(i32) l_qseq(u32) tag_mask(u8)
+ * and for each tag in tag_mask: len(u32) data[len]
+ *
+ * index_offset is only set once everything was written, i.e. an
+ * interrupted write leaves an invalid file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+#include "defaults.h"
+#include "qualcache.h"
+
+#define QUAL_CACHE_BLK_RECS 1024
+
+static const char qual_cache_magic[4] = {'L', 'Q', 'C', '\1'};
+
+/* tags cached. bit i in tag_mask means qual_cache_tags[i] present */
+static const char *qual_cache_tags[] = {BAQ_TAG, AI_TAG, AD_TAG};
+#define NUM_QUAL_CACHE_TAGS 3
+
+#define QUAL_CACHE_HDR_LEN (4 + sizeof(uint64_t) + sizeof(int64_t))
+#define QUAL_CACHE_REC_HDR_LEN (sizeof(int64_t) + 3*sizeof(uint32_t) + 1)
+
+
+/* FNV-1a */
+uint64_t
+qual_cache_hash64(uint64_t h, const void *data, size_t len)
+{
+     const unsigned char *p = (const unsigned char *)data;
+     size_t i;
+
+     if (0 == h) {
+          h = 14695981039346656037ULL;
+     }
+     for (i=0; i<len; i++) {
+          h ^= p[i];
+          h *= 1099511628211ULL;
+     }
+     return h;
+}
+
+
+static uint32_t
+qname_hash(const bam1_t *b)
+{
+     const char *qname = bam1_qname(b);
+     return (uint32_t) qual_cache_hash64(0, qname, strlen(qname));
+}
+
+
+static int
+writer_buf_add(qual_cache_writer_t *w, const void *data, size_t len)
+{
+     if (w->buf_len + len > w->buf_size) {
+          size_t new_size = w->buf_size ? w->buf_size : 1<<16;
+          unsigned char *new_buf;
+          while (new_size < w->buf_len + len) {
+               new_size *= 2;
+          }
+          if (NULL == (new_buf = realloc(w->buf, new_size))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               return -1;
+          }
+          w->buf = new_buf;
+          w->buf_size = new_size;
+     }
+     memcpy(w->buf + w->buf_len, data, len);
+     w->buf_len += len;
+     return 0;
+}
+
+
+/* writes current block (if not empty). returns non-zero on error */
+static int
+writer_flush_blk(qual_cache_writer_t *w)
+{
+     qual_cache_blk_t *blk;
+
+     if (0 == w->num_blks || 0 == w->blks[w->num_blks-1].num_recs) {
+          return 0;
+     }
+     blk = & w->blks[w->num_blks-1];
+     blk->num_bytes = w->buf_len;
+     if (fwrite(w->buf, 1, w->buf_len, w->fp) != w->buf_len) {
+          LOG_ERROR("Couldn't write to %s\n", w->tmp_path);
+          return -1;
+     }
+     w->buf_len = 0;
+     return 0;
+}
+
+
+/**
+ * @brief Opens a new cache for writing. Data goes to a temporary file
+ * which is renamed to path by qual_cache_writer_close(). Returns NULL
+ * on error.
+ */
+qual_cache_writer_t *
+qual_cache_writer_open(const char *path, uint64_t checksum)
+{
+     qual_cache_writer_t *w;
+     int64_t no_index = 0;
+
+     if (NULL == (w = calloc(1, sizeof(qual_cache_writer_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return NULL;
+     }
+     w->path = strdup(path);
+     w->tmp_path = malloc(strlen(path) + 5);
+     sprintf(w->tmp_path, "%s.tmp", path);
+     w->checksum = checksum;
+     w->last_key = -1;
+
+     if (NULL == (w->fp = fopen(w->tmp_path, "wb"))) {
+          LOG_ERROR("Couldn't open %s for writing\n", w->tmp_path);
+          free(w->path); free(w->tmp_path); free(w);
+          return NULL;
+     }
+     if (fwrite(qual_cache_magic, 1, 4, w->fp) != 4
+         || fwrite(&checksum, sizeof(uint64_t), 1, w->fp) != 1
+         || fwrite(&no_index, sizeof(int64_t), 1, w->fp) != 1) {
+          LOG_ERROR("Couldn't write to %s\n", w->tmp_path);
+          fclose(w->fp);
+          unlink(w->tmp_path);
+          free(w->path); free(w->tmp_path); free(w);
+          return NULL;
+     }
+     return w;
+}
+/* qual_cache_writer_open() */
+
+
+/**
+ * @brief Adds the alignment quality tags of b plus source quality sq
+ * (or QUAL_CACHE_NO_SQ) under key. Keys have to be added in
+ * ascending order. Returns non-zero on error.
+ */
+int
+qual_cache_write(qual_cache_writer_t *w, int64_t key, const bam1_t *b, int sq)
+{
+     uint32_t name_hash = qname_hash(b);
+     uint32_t l_qseq = b->core.l_qseq;
+     int32_t sq32 = sq;
+     uint8_t *tags[NUM_QUAL_CACHE_TAGS];
+     uint8_t tag_mask = 0;
+     qual_cache_blk_t *blk;
+     int i;
+
+     if (key <= w->last_key) {
+          LOG_ERROR("Keys not ascending (%lld after %lld) for read %s\n",
+                    (long long int)key, (long long int)w->last_key, bam1_qname(b));
+          return -1;
+     }
+     w->last_key = key;
+
+     if (0 == w->num_blks || w->blks[w->num_blks-1].num_recs == QUAL_CACHE_BLK_RECS) {
+          if (writer_flush_blk(w)) {
+               return -1;
+          }
+          if (w->num_blks == w->max_blks) {
+               qual_cache_blk_t *new_blks;
+               w->max_blks = w->max_blks ? 2*w->max_blks : 1024;
+               if (NULL == (new_blks = realloc(w->blks, w->max_blks * sizeof(qual_cache_blk_t)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    return -1;
+               }
+               w->blks = new_blks;
+          }
+          blk = & w->blks[w->num_blks++];
+          blk->first_key = key;
+          blk->offset = ftell(w->fp);
+          blk->num_bytes = 0;
+          blk->num_recs = 0;
+     }
+     blk = & w->blks[w->num_blks-1];
+
+     for (i=0; i<NUM_QUAL_CACHE_TAGS; i++) {
+          tags[i] = bam_aux_get(b, qual_cache_tags[i]);
+          if (tags[i] && *tags[i] == 'Z') {
+               tag_mask |= 1<<i;
+          } else {
+               tags[i] = NULL;
+          }
+     }
+
+     if (writer_buf_add(w, &key, sizeof(int64_t))
+         || writer_buf_add(w, &name_hash, sizeof(uint32_t))
+         || writer_buf_add(w, &sq32, sizeof(int32_t))
+         || writer_buf_add(w, &l_qseq, sizeof(uint32_t))
+         || writer_buf_add(w, &tag_mask, 1)) {
+          return -1;
+     }
+     for (i=0; i<NUM_QUAL_CACHE_TAGS; i++) {
+          uint32_t len;
+          if (! tags[i]) {
+               continue;
+          }
+          len = strlen((char *)tags[i]+1) + 1; /* incl. terminating 0 */
+          if (writer_buf_add(w, &len, sizeof(uint32_t))
+              || writer_buf_add(w, tags[i]+1, len)) {
+               return -1;
+          }
+     }
+     blk->num_recs += 1;
+     w->num_recs += 1;
+     return 0;
+}
+/* qual_cache_write() */
+
+
+/**
+ * @brief Writes index, finalizes and closes the cache and frees w.
+ * Returns non-zero on error, in which case no cache is created.
+ */
+int
+qual_cache_writer_close(qual_cache_writer_t *w)
+{
+     int64_t index_offset;
+     int32_t num_blks = w->num_blks;
+     int rc = 0;
+
+     if (writer_flush_blk(w)) {
+          rc = -1;
+     }
+     index_offset = ftell(w->fp);
+     if (0 == rc
+         && (fwrite(&num_blks, sizeof(int32_t), 1, w->fp) != 1
+             || (num_blks && fwrite(w->blks, sizeof(qual_cache_blk_t), num_blks, w->fp) != (size_t)num_blks)
+             || fseek(w->fp, 4 + sizeof(uint64_t), SEEK_SET)
+             || fwrite(&index_offset, sizeof(int64_t), 1, w->fp) != 1)) {
+          LOG_ERROR("Couldn't write index to %s\n", w->tmp_path);
+          rc = -1;
+     }
+     if (fclose(w->fp)) {
+          rc = -1;
+     }
+     if (0 == rc && rename(w->tmp_path, w->path)) {
+          LOG_ERROR("Couldn't rename %s to %s\n", w->tmp_path, w->path);
+          rc = -1;
+     }
+     if (rc) {
+          unlink(w->tmp_path);
+     } else {
+          LOG_VERBOSE("Wrote alignment qualities of %lld reads to %s\n",
+                      (long long int)w->num_recs, w->path);
+     }
+
+     free(w->blks);
+     free(w->buf);
+     free(w->path);
+     free(w->tmp_path);
+     free(w);
+     return rc;
+}
+/* qual_cache_writer_close() */
+
+
+/* reads header and returns index offset or -1 if file is not a
+ * complete cache for checksum */
+static int64_t
+read_header(FILE *fp, uint64_t checksum)
+{
+     char magic[4];
+     uint64_t file_checksum;
+     int64_t index_offset;
+
+     if (fread(magic, 1, 4, fp) != 4
+         || fread(&file_checksum, sizeof(uint64_t), 1, fp) != 1
+         || fread(&index_offset, sizeof(int64_t), 1, fp) != 1) {
+          return -1;
+     }
+     if (memcmp(magic, qual_cache_magic, 4) || file_checksum != checksum
+         || index_offset < (int64_t)QUAL_CACHE_HDR_LEN) {
+          return -1;
+     }
+     return index_offset;
+}
+
+
+/**
+ * @brief Returns 1 if path is a complete cache for checksum, 0 otherwise
+ */
+int
+qual_cache_is_valid(const char *path, uint64_t checksum)
+{
+     FILE *fp;
+     int64_t index_offset;
+
+     if (NULL == (fp = fopen(path, "rb"))) {
+          return 0;
+     }
+     index_offset = read_header(fp, checksum);
+     fclose(fp);
+     return index_offset > 0 ? 1 : 0;
+}
+/* qual_cache_is_valid() */
+
+
+/**
+ * @brief Opens cache for reading. Returns NULL if it doesn't exist or
+ * doesn't match checksum, i.e. was created for different input or
+ * parameters.
+ */
+qual_cache_t *
+qual_cache_open(const char *path, uint64_t checksum)
+{
+     qual_cache_t *qc;
+     FILE *fp;
+     int64_t index_offset;
+     int32_t num_blks;
+
+     if (NULL == (fp = fopen(path, "rb"))) {
+          LOG_VERBOSE("Alignment quality cache %s doesn't exist\n", path);
+          return NULL;
+     }
+     if ((index_offset = read_header(fp, checksum)) < 0) {
+          LOG_VERBOSE("Ignoring alignment quality cache %s (incomplete or for different input or parameters)\n", path);
+          fclose(fp);
+          return NULL;
+     }
+     if (fseek(fp, index_offset, SEEK_SET)
+         || fread(&num_blks, sizeof(int32_t), 1, fp) != 1
+         || num_blks < 0) {
+          LOG_WARN("Ignoring corrupt alignment quality cache %s\n", path);
+          fclose(fp);
+          return NULL;
+     }
+
+     if (NULL == (qc = calloc(1, sizeof(qual_cache_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          fclose(fp);
+          return NULL;
+     }
+     qc->fp = fp;
+     qc->cur_blk = -1;
+     qc->num_blks = num_blks;
+     if (num_blks) {
+          qc->blks = malloc(num_blks * sizeof(qual_cache_blk_t));
+          if (! qc->blks
+              || fread(qc->blks, sizeof(qual_cache_blk_t), num_blks, fp) != (size_t)num_blks) {
+               LOG_WARN("Ignoring corrupt alignment quality cache %s\n", path);
+               qual_cache_close(qc);
+               return NULL;
+          }
+     }
+     return qc;
+}
+/* qual_cache_open() */
+
+
+/* loads block and sets up record pointers. returns non-zero on error */
+static int
+load_blk(qual_cache_t *qc, int blk_idx)
+{
+     qual_cache_blk_t *blk = & qc->blks[blk_idx];
+     size_t pos = 0;
+     int i;
+
+     qc->cur_blk = -1;
+     if (blk->num_bytes > qc->buf_size) {
+          free(qc->buf);
+          if (NULL == (qc->buf = malloc(blk->num_bytes))) {
+               qc->buf_size = 0;
+               return -1;
+          }
+          qc->buf_size = blk->num_bytes;
+     }
+     if ((int)blk->num_recs > qc->max_recs) {
+          free(qc->recs);
+          if (NULL == (qc->recs = malloc(blk->num_recs * sizeof(unsigned char *)))) {
+               qc->max_recs = 0;
+               return -1;
+          }
+          qc->max_recs = blk->num_recs;
+     }
+     if (fseek(qc->fp, blk->offset, SEEK_SET)
+         || fread(qc->buf, 1, blk->num_bytes, qc->fp) != blk->num_bytes) {
+          return -1;
+     }
+     for (i=0; i<(int)blk->num_recs; i++) {
+          uint8_t tag_mask;
+          int j;
+          if (pos + QUAL_CACHE_REC_HDR_LEN > blk->num_bytes) {
+               return -1;
+          }
+          qc->recs[i] = qc->buf + pos;
+          tag_mask = qc->buf[pos + QUAL_CACHE_REC_HDR_LEN - 1];
+          pos += QUAL_CACHE_REC_HDR_LEN;
+          for (j=0; j<NUM_QUAL_CACHE_TAGS; j++) {
+               uint32_t len;
+               if (! (tag_mask & (1<<j))) {
+                    continue;
+               }
+               if (pos + sizeof(uint32_t) > blk->num_bytes) {
+                    return -1;
+               }
+               memcpy(&len, qc->buf + pos, sizeof(uint32_t));
+               pos += sizeof(uint32_t) + len;
+          }
+          if (pos > blk->num_bytes) {
+               return -1;
+          }
+     }
+     qc->num_recs = blk->num_recs;
+     qc->cur_blk = blk_idx;
+     return 0;
+}
+
+
+/* returns record for key or NULL */
+static unsigned char *
+find_rec(qual_cache_t *qc, int64_t key)
+{
+     int lo, hi;
+
+     if (0 == qc->num_blks || key < qc->blks[0].first_key) {
+          return NULL;
+     }
+     /* reads mostly come in order, i.e. usually in the current block */
+     if (qc->cur_blk < 0 || key < qc->blks[qc->cur_blk].first_key
+         || (qc->cur_blk+1 < qc->num_blks && key >= qc->blks[qc->cur_blk+1].first_key)) {
+          /* last block with first_key <= key */
+          lo = 0; hi = qc->num_blks-1;
+          while (lo < hi) {
+               int mid = lo + (hi-lo+1)/2;
+               if (qc->blks[mid].first_key <= key) {
+                    lo = mid;
+               } else {
+                    hi = mid-1;
+               }
+          }
+          if (load_blk(qc, lo)) {
+               LOG_WARN("%s\n", "Couldn't read block from alignment quality cache");
+               return NULL;
+          }
+     }
+
+     lo = 0; hi = qc->num_recs-1;
+     while (lo <= hi) {
+          int mid = lo + (hi-lo)/2;
+          int64_t mid_key;
+          memcpy(&mid_key, qc->recs[mid], sizeof(int64_t));
+          if (mid_key == key) {
+               return qc->recs[mid];
+          } else if (mid_key < key) {
+               lo = mid+1;
+          } else {
+               hi = mid-1;
+          }
+     }
+     return NULL;
+}
+
+
+/**
+ * @brief Looks up read b (which ended at virtual file offset key) and
+ * if found replaces its alignment quality tags with the cached ones
+ * and sets sq to the cached source quality (or QUAL_CACHE_NO_SQ).
+ * Returns 1 if found, 0 otherwise.
+ */
+int
+qual_cache_apply(qual_cache_t *qc, int64_t key, bam1_t *b, int *sq)
+{
+     unsigned char *rec = find_rec(qc, key);
+     uint32_t name_hash, l_qseq;
+     int32_t sq32;
+     uint8_t tag_mask;
+     size_t pos;
+     int i;
+
+     if (rec) {
+          memcpy(&name_hash, rec + sizeof(int64_t), sizeof(uint32_t));
+          memcpy(&l_qseq, rec + sizeof(int64_t) + 2*sizeof(uint32_t), sizeof(uint32_t));
+          /* paranoia: don't trust a key match alone */
+          if (name_hash != qname_hash(b) || l_qseq != (uint32_t)b->core.l_qseq) {
+               rec = NULL;
+          }
+     }
+     if (! rec) {
+          qc->num_misses += 1;
+          return 0;
+     }
+     qc->num_hits += 1;
+
+     memcpy(&sq32, rec + sizeof(int64_t) + sizeof(uint32_t), sizeof(int32_t));
+     *sq = sq32;
+     tag_mask = rec[QUAL_CACHE_REC_HDR_LEN - 1];
+     pos = QUAL_CACHE_REC_HDR_LEN;
+     for (i=0; i<NUM_QUAL_CACHE_TAGS; i++) {
+          uint32_t len;
+          uint8_t *old;
+          if (! (tag_mask & (1<<i))) {
+               continue;
+          }
+          memcpy(&len, rec + pos, sizeof(uint32_t));
+          pos += sizeof(uint32_t);
+          if ((old = bam_aux_get(b, qual_cache_tags[i]))) {
+               bam_aux_del(b, old);
+          }
+          bam_aux_append(b, qual_cache_tags[i], 'Z', len, rec + pos);
+          pos += len;
+     }
+     return 1;
+}
+/* qual_cache_apply() */
+
+
+void
+qual_cache_close(qual_cache_t *qc)
+{
+     if (! qc) {
+          return;
+     }
+     LOG_DEBUG("Alignment quality cache: %ld hits, %ld misses\n", qc->num_hits, qc->num_misses);
+     if (qc->fp) {
+          fclose(qc->fp);
+     }
+     free(qc->blks);
+     free(qc->buf);
+     free(qc->recs);
+     free(qc);
+}
+/* qual_cache_close() */
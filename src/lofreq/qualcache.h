@@ -0,0 +1,109 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef QUALCACHE_H
+#define QUALCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sam.h"
+
+/* Sidecar file caching the per-read alignment qualities (BAQ_TAG,
+ * AI_TAG, AD_TAG) and source quality computed in mplp_func(), so that
+ * they don't have to be recomputed when calling on the same BAM
+ * again. Reads are keyed by the BAM virtual file offset at which they
+ * end, which is unique and the same no matter whether the file is read
+ * sequentially or via an index. A checksum of all inputs and
+ * parameters that the values depend on is stored in the header and
+ * the whole file is ignored if it doesn't match.
+ */
+
+#define QUAL_CACHE_EXT ".lqc"
+
+/* source quality not cached for this read */
+#define QUAL_CACHE_NO_SQ INT32_MIN
+
+typedef struct {
+     int64_t first_key;
+     int64_t offset; /* of first record in file */
+     uint32_t num_bytes;
+     uint32_t num_recs;
+} qual_cache_blk_t;
+
+typedef struct {
+     FILE *fp;
+     char *path; /* where to rename tmp file to once done */
+     char *tmp_path;
+     uint64_t checksum;
+     int64_t num_recs;
+     int64_t last_key;
+     qual_cache_blk_t *blks;
+     int num_blks, max_blks;
+     unsigned char *buf; /* current block */
+     size_t buf_len, buf_size;
+} qual_cache_writer_t;
+
+typedef struct {
+     FILE *fp;
+     qual_cache_blk_t *blks;
+     int num_blks;
+     int cur_blk; /* loaded block or -1 */
+     unsigned char *buf;
+     size_t buf_size;
+     unsigned char **recs; /* record starts in buf */
+     int num_recs, max_recs;
+     long int num_hits, num_misses; /* stats */
+} qual_cache_t;
+
+
+uint64_t
+qual_cache_hash64(uint64_t h, const void *data, size_t len);
+
+qual_cache_writer_t *
+qual_cache_writer_open(const char *path, uint64_t checksum);
+
+int
+qual_cache_write(qual_cache_writer_t *w, int64_t key, const bam1_t *b, int sq);
+
+int
+qual_cache_writer_close(qual_cache_writer_t *w);
+
+int
+qual_cache_is_valid(const char *path, uint64_t checksum);
+
+qual_cache_t *
+qual_cache_open(const char *path, uint64_t checksum);
+
+int
+qual_cache_apply(qual_cache_t *qc, int64_t key, bam1_t *b, int *sq);
+
+void
+qual_cache_close(qual_cache_t *qc);
+
+#endif
@@ -0,0 +1,225 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Read-ahead thread for BAM input. See readahead.h. Batches of
+ * records live in a ring of slots which are filled by the reader and
+ * emptied by the consumer in order. Records are handed over by
+ * swapping bam1_t contents, so nothing gets copied.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "readahead.h"
+
+
+typedef struct {
+     bam1_t *recs[READAHEAD_BATCH_SIZE];
+     int rets[READAHEAD_BATCH_SIZE];
+     int64_t voffs[READAHEAD_BATCH_SIZE];
+     int n;
+     int ret; /* < 0 if this batch ended the input (return value of the last read). 0 otherwise */
+     int full; /* set by reader, cleared by consumer */
+} readahead_slot_t;
+
+
+struct readahead_s {
+     pthread_t thread;
+     pthread_mutex_t lock; /* protects full and stop */
+     pthread_cond_t cond; /* signalled on every change of full and stop */
+     readahead_slot_t slots[READAHEAD_NUM_SLOTS];
+     int stop;
+     readahead_read_t read_func;
+     void *data;
+     /* consumer only */
+     int cur_slot;
+     int cur_rec;
+};
+
+
+static void *
+readahead_reader(void *arg)
+{
+     readahead_t *ra = (readahead_t *)arg;
+     long int seq;
+
+     for (seq = 0; ; seq++) {
+          readahead_slot_t *s = & ra->slots[seq % READAHEAD_NUM_SLOTS];
+          int ret = 0;
+
+          pthread_mutex_lock(& ra->lock);
+          while (s->full && ! ra->stop) {
+               pthread_cond_wait(& ra->cond, & ra->lock);
+          }
+          if (ra->stop) {
+               pthread_mutex_unlock(& ra->lock);
+               break;
+          }
+          pthread_mutex_unlock(& ra->lock);
+
+          /* slot is ours until marked as full */
+          s->n = 0;
+          while (s->n < READAHEAD_BATCH_SIZE) {
+               int i = s->n;
+               if ((ret = ra->read_func(ra->data, s->recs[i], & s->voffs[i])) < 0) {
+                    break;
+               }
+               s->rets[i] = ret;
+               s->n++;
+          }
+          s->ret = ret < 0 ? ret : 0;
+
+          pthread_mutex_lock(& ra->lock);
+          s->full = 1;
+          pthread_cond_broadcast(& ra->cond);
+          pthread_mutex_unlock(& ra->lock);
+          if (ret < 0) {
+               break;
+          }
+     }
+     return NULL;
+}
+/* readahead_reader() */
+
+
+/**
+ * @brief Starts reading ahead with read_func(data, ...) in a separate
+ * thread. From now on data must only be used by read_func until
+ * readahead_stop(). Returns NULL if the thread couldn't be created,
+ * in which case the caller should simply read directly.
+ */
+readahead_t *
+readahead_start(readahead_read_t read_func, void *data)
+{
+     readahead_t *ra;
+     int i, j;
+
+     if (NULL == (ra = calloc(1, sizeof(readahead_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i = 0; i < READAHEAD_NUM_SLOTS; i++) {
+          for (j = 0; j < READAHEAD_BATCH_SIZE; j++) {
+               ra->slots[i].recs[j] = bam_init1();
+          }
+     }
+     ra->read_func = read_func;
+     ra->data = data;
+     pthread_mutex_init(& ra->lock, NULL);
+     pthread_cond_init(& ra->cond, NULL);
+
+     if (pthread_create(& ra->thread, NULL, readahead_reader, ra)) {
+          LOG_WARN("%s\n", "Couldn't create read-ahead thread. Reading directly");
+          pthread_mutex_destroy(& ra->lock);
+          pthread_cond_destroy(& ra->cond);
+          for (i = 0; i < READAHEAD_NUM_SLOTS; i++) {
+               for (j = 0; j < READAHEAD_BATCH_SIZE; j++) {
+                    bam_destroy1(ra->slots[i].recs[j]);
+               }
+          }
+          free(ra);
+          return NULL;
+     }
+     return ra;
+}
+/* readahead_start() */
+
+
+/**
+ * @brief Drop-in replacement for read_func() on the consumer side:
+ * returns the next record in b (and its offset in voff) with the
+ * return value read_func() gave for it.
+ */
+int
+readahead_read(readahead_t *ra, bam1_t *b, int64_t *voff)
+{
+     while (1) {
+          readahead_slot_t *s = & ra->slots[ra->cur_slot];
+
+          pthread_mutex_lock(& ra->lock);
+          while (! s->full) {
+               pthread_cond_wait(& ra->cond, & ra->lock);
+          }
+          pthread_mutex_unlock(& ra->lock);
+
+          if (ra->cur_rec < s->n) {
+               int i = ra->cur_rec++;
+               bam1_t tmp = *b;
+               *b = *s->recs[i];
+               *s->recs[i] = tmp;
+               *voff = s->voffs[i];
+               return s->rets[i];
+          }
+          if (s->ret < 0) {
+               /* end of input. slot stays full, so this is sticky */
+               return s->ret;
+          }
+
+          pthread_mutex_lock(& ra->lock);
+          s->full = 0;
+          pthread_cond_broadcast(& ra->cond);
+          pthread_mutex_unlock(& ra->lock);
+          ra->cur_slot = (ra->cur_slot + 1) % READAHEAD_NUM_SLOTS;
+          ra->cur_rec = 0;
+     }
+}
+/* readahead_read() */
+
+
+/**
+ * @brief Stops the read-ahead thread (even if input is not exhausted
+ * yet) and frees ra. Records not taken are discarded.
+ */
+void
+readahead_stop(readahead_t *ra)
+{
+     int i, j;
+
+     if (! ra) {
+          return;
+     }
+     pthread_mutex_lock(& ra->lock);
+     ra->stop = 1;
+     pthread_cond_broadcast(& ra->cond);
+     pthread_mutex_unlock(& ra->lock);
+     pthread_join(ra->thread, NULL);
+
+     pthread_mutex_destroy(& ra->lock);
+     pthread_cond_destroy(& ra->cond);
+     for (i = 0; i < READAHEAD_NUM_SLOTS; i++) {
+          for (j = 0; j < READAHEAD_BATCH_SIZE; j++) {
+               bam_destroy1(ra->slots[i].recs[j]);
+          }
+     }
+     free(ra);
+}
+/* readahead_stop() */
@@ -0,0 +1,63 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+
+#include "sam.h"
+
+/* Bounded read-ahead of BAM records: a background thread reads (and
+ * thereby decompresses and decodes) records into a small ring of
+ * batches, from which the consumer takes them one by one. Overlaps
+ * I/O and decompression with whatever the consumer does, e.g.
+ * pileup and calling.
+ */
+
+/* records per batch and number of batches in flight */
+#define READAHEAD_BATCH_SIZE 256
+#define READAHEAD_NUM_SLOTS 4
+
+/* reads next record into b and stores the virtual file offset after
+ * it in voff. same return values as bam_read1(). only ever called
+ * from the read-ahead thread */
+typedef int (*readahead_read_t)(void *data, bam1_t *b, int64_t *voff);
+
+typedef struct readahead_s readahead_t;
+
+readahead_t *
+readahead_start(readahead_read_t read_func, void *data);
+
+int
+readahead_read(readahead_t *ra, bam1_t *b, int64_t *voff);
+
+void
+readahead_stop(readahead_t *ra);
+
+#endif
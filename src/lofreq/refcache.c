@@ -0,0 +1,434 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Reference sequence cache with reference counting and an LRU limit
+ * for unused sequences. Replaces fetching the same sequence multiple
+ * times by e.g. mplp_func() and mpileup() or different threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+#include "plp.h"
+#include "refcache.h"
+
+
+refcache_t *
+refcache_new(faidx_t *fai, const size_t max_bytes)
+{
+     refcache_t *rc;
+
+     if (NULL == (rc = calloc(1, sizeof(refcache_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return NULL;
+     }
+     rc->fai = fai;
+     rc->max_bytes = max_bytes;
+     pthread_mutex_init(& rc->lock, NULL);
+     pthread_mutex_init(& rc->fai_lock, NULL);
+     pthread_cond_init(& rc->loaded, NULL);
+     return rc;
+}
+/* refcache_new() */
+
+
+static void
+refcache_entry_free(refcache_entry_t *e)
+{
+     free(e->name);
+     if (! e->mapped) {
+          free(e->seq);
+     }
+     free(e->nt4);
+     free(e->hrun);
+     free(e);
+}
+
+
+static size_t
+refcache_entry_bytes(const refcache_entry_t *e)
+{
+     /* mapped sequences live in the (shared) page cache */
+     return (e->mapped ? 0 : e->len) + (e->nt4 ? e->len : 0) + (e->hrun ? e->len : 0);
+}
+
+
+static void
+refcache_lru_unlink(refcache_t *rc, refcache_entry_t *e)
+{
+     if (e->lru_prev) {
+          e->lru_prev->lru_next = e->lru_next;
+     } else {
+          rc->lru_head = e->lru_next;
+     }
+     if (e->lru_next) {
+          e->lru_next->lru_prev = e->lru_prev;
+     } else {
+          rc->lru_tail = e->lru_prev;
+     }
+     e->lru_prev = e->lru_next = NULL;
+     rc->unused_bytes -= refcache_entry_bytes(e);
+}
+
+
+static void
+refcache_lru_push(refcache_t *rc, refcache_entry_t *e)
+{
+     e->lru_prev = NULL;
+     e->lru_next = rc->lru_head;
+     if (rc->lru_head) {
+          rc->lru_head->lru_prev = e;
+     } else {
+          rc->lru_tail = e;
+     }
+     rc->lru_head = e;
+     rc->unused_bytes += refcache_entry_bytes(e);
+}
+
+
+/* evict least recently used unused entries until below limit */
+static void
+refcache_evict(refcache_t *rc)
+{
+     while (rc->unused_bytes > rc->max_bytes && rc->lru_tail) {
+          refcache_entry_t *e = rc->lru_tail;
+          refcache_lru_unlink(rc, e);
+          HASH_DEL(rc->entries, e);
+          LOG_DEBUG("Evicting %s from reference cache\n", e->name);
+          refcache_entry_free(e);
+     }
+}
+
+
+/* drops a reference to e after a failure, i.e. without making it
+ * available for reuse: if nobody else uses it, it's removed from the
+ * hash and freed. must be called with lock held */
+static void
+refcache_abandon(refcache_t *rc, refcache_entry_t *e)
+{
+     e->users -= 1;
+     if (0 == e->users) {
+          HASH_DEL(rc->entries, e);
+          refcache_entry_free(e);
+     }
+}
+
+
+void
+refcache_free(refcache_t *rc)
+{
+     refcache_entry_t *e, *e_tmp;
+     int i;
+
+     if (! rc) {
+          return;
+     }
+     HASH_ITER(hh, rc->entries, e, e_tmp) {
+          if (e->users) {
+               LOG_WARN("Reference %s still in use (%d) when freeing cache\n", e->name, e->users);
+          }
+          HASH_DEL(rc->entries, e);
+          refcache_entry_free(e);
+     }
+     LOG_DEBUG("Reference cache fetched %ld sequences\n", rc->num_fetches);
+     refstore_close(rc->store);
+     for (i=0; i<rc->num_idle_fai; i++) {
+          fai_destroy(rc->idle_fai[i]);
+     }
+     free(rc->fa);
+     pthread_mutex_destroy(& rc->lock);
+     pthread_mutex_destroy(& rc->fai_lock);
+     pthread_cond_destroy(& rc->loaded);
+     free(rc);
+}
+/* refcache_free() */
+
+
+/**
+ * @brief Use the reference store of fasta file fa if there is one
+ * (see refstore.h). Sequences found there aren't copied, just
+ * referenced. Returns 1 if a store is used, 0 otherwise. Call before
+ * any sequence is fetched. fa has to be the file fai was loaded
+ * from: it's also used for opening extra faidx handles, so that
+ * threads can fetch different sequences at the same time.
+ */
+int
+refcache_open_store(refcache_t *rc, const char *fa)
+{
+     if (fa && ! rc->fa) {
+          rc->fa = strdup(fa);
+     }
+     if (! fa || rc->store) {
+          return rc->store != NULL;
+     }
+     rc->store = refstore_open(fa);
+     return rc->store != NULL;
+}
+/* refcache_open_store() */
+
+
+/* fetches name via faidx. called without lock. faidx handles can't be
+ * shared between threads, so if the shared one is busy, an idle extra
+ * handle is used or a new one loaded (if the path is known). extra
+ * handles are kept for later fetches */
+static char *
+refcache_fetch(refcache_t *rc, const char *name, int *len)
+{
+     faidx_t *fai = NULL;
+     char *seq;
+
+     if (0 == pthread_mutex_trylock(& rc->fai_lock)) {
+          seq = faidx_fetch_seq(rc->fai, name, 0, 0x7fffffff, len);
+          pthread_mutex_unlock(& rc->fai_lock);
+          return seq;
+     }
+
+     pthread_mutex_lock(& rc->lock);
+     if (rc->num_idle_fai) {
+          rc->num_idle_fai -= 1;
+          fai = rc->idle_fai[rc->num_idle_fai];
+     }
+     pthread_mutex_unlock(& rc->lock);
+     if (! fai && rc->fa) {
+          fai = fai_load(rc->fa);
+     }
+     if (! fai) {
+          pthread_mutex_lock(& rc->fai_lock);
+          seq = faidx_fetch_seq(rc->fai, name, 0, 0x7fffffff, len);
+          pthread_mutex_unlock(& rc->fai_lock);
+          return seq;
+     }
+
+     seq = faidx_fetch_seq(fai, name, 0, 0x7fffffff, len);
+
+     pthread_mutex_lock(& rc->lock);
+     if (rc->num_idle_fai < REFCACHE_MAX_IDLE_FAI) {
+          rc->idle_fai[rc->num_idle_fai] = fai;
+          rc->num_idle_fai += 1;
+          fai = NULL;
+     }
+     pthread_mutex_unlock(& rc->lock);
+     if (fai) {
+          fai_destroy(fai);
+     }
+     return seq;
+}
+
+
+/* returns entry for name with incremented reference count. fetches
+ * if needed. must be called with lock held. the lock is released
+ * while fetching, so that other threads aren't blocked: the new entry
+ * is marked as loading and others asking for the same sequence wait
+ * for it */
+static refcache_entry_t *
+refcache_acquire(refcache_t *rc, const char *name)
+{
+     refcache_entry_t *e = NULL;
+     char *seq;
+     int len;
+
+     HASH_FIND_STR(rc->entries, name, e);
+     if (e) {
+          if (0 == e->users) {
+               refcache_lru_unlink(rc, e);
+          }
+          e->users += 1;
+          while (e->loading) {
+               pthread_cond_wait(& rc->loaded, & rc->lock);
+          }
+          if (NULL == e->seq) {
+               /* fetch failed */
+               refcache_abandon(rc, e);
+               return NULL;
+          }
+          return e;
+     }
+
+     if (NULL == (e = calloc(1, sizeof(refcache_entry_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return NULL;
+     }
+     e->name = strdup(name);
+     e->users = 1;
+     if (rc->store && NULL != (e->seq = (char *) refstore_get(rc->store, name, &e->len))) {
+          /* already uppercase. never modified */
+          e->mapped = 1;
+          HASH_ADD_KEYPTR(hh, rc->entries, e->name, strlen(e->name), e);
+          return e;
+     }
+
+     e->loading = 1;
+     HASH_ADD_KEYPTR(hh, rc->entries, e->name, strlen(e->name), e);
+     pthread_mutex_unlock(& rc->lock);
+
+     seq = refcache_fetch(rc, name, &len);
+     if (seq) {
+          strtoupper(seq);/* safeguard */
+     }
+
+     pthread_mutex_lock(& rc->lock);
+     e->seq = seq;
+     e->len = len;
+     e->loading = 0;
+     pthread_cond_broadcast(& rc->loaded);
+     if (NULL == seq) {
+          refcache_abandon(rc, e);
+          return NULL;
+     }
+     rc->num_fetches += 1;
+     LOG_DEBUG("Fetched %s (len %d) into reference cache\n", name, e->len);
+     return e;
+}
+
+
+/**
+ * @brief Returns uppercase sequence for name (and sets len) or NULL
+ * if sequence couldn't be fetched. Call refcache_release() when
+ * done. Don't free.
+ */
+const char *
+refcache_get(refcache_t *rc, const char *name, int *len)
+{
+     refcache_entry_t *e;
+
+     pthread_mutex_lock(& rc->lock);
+     e = refcache_acquire(rc, name);
+     pthread_mutex_unlock(& rc->lock);
+     if (! e) {
+          *len = -1;
+          return NULL;
+     }
+     *len = e->len;
+     return e->seq;
+}
+/* refcache_get() */
+
+
+/**
+ * @brief Same as refcache_get() but returns sequence encoded with
+ * bam_nt4_table
+ */
+const unsigned char *
+refcache_get_nt4(refcache_t *rc, const char *name, int *len)
+{
+     refcache_entry_t *e;
+
+     pthread_mutex_lock(& rc->lock);
+     e = refcache_acquire(rc, name);
+     if (e && ! e->nt4) {
+          int i;
+          if (NULL == (e->nt4 = malloc(e->len))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               refcache_abandon(rc, e);
+               e = NULL;
+          } else {
+               for (i=0; i<e->len; i++) {
+                    e->nt4[i] = bam_nt4_table[(unsigned char)e->seq[i]];
+               }
+          }
+     }
+     pthread_mutex_unlock(& rc->lock);
+     if (! e) {
+          *len = -1;
+          return NULL;
+     }
+     *len = e->len;
+     return e->nt4;
+}
+/* refcache_get_nt4() */
+
+
+/**
+ * @brief Same as refcache_get() but returns for each position the
+ * length of the homopolymer run it is part of, capped at
+ * REFCACHE_MAX_HRUN (i.e. values of REFCACHE_MAX_HRUN mean "at least")
+ */
+const unsigned char *
+refcache_get_hrun(refcache_t *rc, const char *name, int *len)
+{
+     refcache_entry_t *e;
+
+     pthread_mutex_lock(& rc->lock);
+     e = refcache_acquire(rc, name);
+     if (e && ! e->hrun) {
+          int beg, end;
+          if (NULL == (e->hrun = malloc(e->len))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               refcache_abandon(rc, e);
+               e = NULL;
+          } else {
+               for (beg = 0; beg < e->len; beg = end) {
+                    int run;
+                    for (end = beg+1; end < e->len && e->seq[end] == e->seq[beg]; end++) {
+                         ;
+                    }
+                    run = end-beg > REFCACHE_MAX_HRUN ? REFCACHE_MAX_HRUN : end-beg;
+                    memset(e->hrun+beg, run, end-beg);
+               }
+          }
+     }
+     pthread_mutex_unlock(& rc->lock);
+     if (! e) {
+          *len = -1;
+          return NULL;
+     }
+     *len = e->len;
+     return e->hrun;
+}
+/* refcache_get_hrun() */
+
+
+/**
+ * @brief Release sequence for name obtained via refcache_get(),
+ * refcache_get_nt4() or refcache_get_hrun()
+ */
+void
+refcache_release(refcache_t *rc, const char *name)
+{
+     refcache_entry_t *e = NULL;
+
+     pthread_mutex_lock(& rc->lock);
+     HASH_FIND_STR(rc->entries, name, e);
+     if (! e || e->users < 1) {
+          LOG_ERROR("Releasing reference %s which is not in use\n", name);
+     } else {
+          e->users -= 1;
+          if (0 == e->users) {
+               refcache_lru_push(rc, e);
+               refcache_evict(rc);
+          }
+     }
+     pthread_mutex_unlock(& rc->lock);
+}
+/* refcache_release() */
@@ -0,0 +1,108 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef REFCACHE_H
+#define REFCACHE_H
+
+#include <pthread.h>
+
+#include "htslib/faidx.h"
+#include "uthash.h"
+#include "refstore.h"
+
+
+/* default limit for memory used by cached but currently unused
+ * sequences */
+#define REFCACHE_DEFAULT_MAX_BYTES (512*1024*1024)
+
+/* cap for homopolymer run lengths stored by refcache_get_hrun() */
+#define REFCACHE_MAX_HRUN 255
+
+/* max number of idle extra faidx handles kept for concurrent fetches */
+#define REFCACHE_MAX_IDLE_FAI 8
+
+
+typedef struct refcache_entry_s {
+     char *name;
+     char *seq; /* uppercase */
+     unsigned char *nt4; /* bam_nt4_table encoded. computed on demand */
+     unsigned char *hrun; /* homopolymer run lengths. computed on demand. see refcache_get_hrun() */
+     int len;
+     int mapped; /* seq points into refstore, i.e. isn't owned */
+     int users; /* reference count */
+     int loading; /* seq is being fetched (without lock). see refcache_acquire() */
+     struct refcache_entry_s *lru_prev, *lru_next; /* only if unused */
+     UT_hash_handle hh;
+} refcache_entry_t;
+
+
+/* cache of reference sequences fetched via faidx, shared by all
+ * users of the same fai (including threads). sequences in use are
+ * never evicted. unused ones are kept until their total size exceeds
+ * max_bytes, in least recently used order. all functions are thread
+ * safe
+ */
+typedef struct {
+     faidx_t *fai; /* not owned. protected by fai_lock */
+     char *fa; /* path of fai, if known. used for loading extra handles (see refcache_fetch()) */
+     faidx_t *idle_fai[REFCACHE_MAX_IDLE_FAI]; /* extra handles. owned */
+     int num_idle_fai;
+     refstore_t *store; /* optional. owned. sequences are taken from here if present (see refcache_open_store()) */
+     size_t max_bytes;
+     size_t unused_bytes;
+     refcache_entry_t *entries; /* hash keyed by name */
+     refcache_entry_t *lru_head, *lru_tail; /* unused entries. head = most recent */
+     long int num_fetches; /* stats */
+     pthread_mutex_t lock; /* for everything but fai */
+     pthread_mutex_t fai_lock;
+     pthread_cond_t loaded; /* signalled when an entry finished loading */
+} refcache_t;
+
+
+refcache_t *
+refcache_new(faidx_t *fai, const size_t max_bytes);
+
+void
+refcache_free(refcache_t *rc);
+
+int
+refcache_open_store(refcache_t *rc, const char *fa);
+
+const char *
+refcache_get(refcache_t *rc, const char *name, int *len);
+
+const unsigned char *
+refcache_get_nt4(refcache_t *rc, const char *name, int *len);
+
+const unsigned char *
+refcache_get_hrun(refcache_t *rc, const char *name, int *len);
+
+void
+refcache_release(refcache_t *rc, const char *name);
+
+#endif
@@ -0,0 +1,383 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+/* Memory-mapped reference store. See refstore.h.
+ *
+ * File layout (native byte order):
+ *
+ * magic[4] version(u32) num_seqs(u32) reserved(u32)
+ * num_seqs x { offset(u64) len(u32) name_len(u32) name[name_len] }
+ * num_seqs x { seq[len] '\0' } at the given offsets
+ *
+ * name_len includes the terminating NUL. Files are written to a
+ * temporary name first and then renamed, so that processes mapping
+ * an older version aren't affected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "htslib/faidx.h"
+
+#include "log.h"
+#include "utils.h"
+#include "refstore.h"
+
+#define REFSTORE_MAGIC "LRS\1"
+#define REFSTORE_VERSION 1
+#define REFSTORE_HEADER_LEN 16
+
+/* fixed size part of a table entry */
+typedef struct {
+     uint64_t offset;
+     uint32_t len;
+     uint32_t name_len;
+} refstore_entry_t;
+
+
+static char *
+refstore_path(const char *fa)
+{
+     char *fn;
+
+     if (NULL == (fn = malloc(strlen(fa) + strlen(REFSTORE_EXT) + 1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(fn, "%s%s", fa, REFSTORE_EXT);
+     return fn;
+}
+/* refstore_path() */
+
+
+/* checks table and sequences of a mapped store and sets up rs->seqs
+ * and rs->hash. returns non-zero if the store is malformed */
+static int
+refstore_parse(refstore_t *rs)
+{
+     const char *map = (const char *) rs->map;
+     size_t pos = REFSTORE_HEADER_LEN;
+     uint32_t version, num_seqs;
+     int i;
+
+     if (rs->map_len < REFSTORE_HEADER_LEN || 0 != memcmp(map, REFSTORE_MAGIC, 4)) {
+          return -1;
+     }
+     memcpy(& version, map+4, sizeof(uint32_t));
+     memcpy(& num_seqs, map+8, sizeof(uint32_t));
+     if (version != REFSTORE_VERSION) {
+          return -1;
+     }
+     if (NULL == (rs->seqs = calloc(num_seqs ? num_seqs : 1, sizeof(refstore_seq_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     rs->num_seqs = num_seqs;
+
+     for (i=0; i<rs->num_seqs; i++) {
+          refstore_entry_t e;
+          refstore_seq_t *s = & rs->seqs[i];
+
+          if (pos + sizeof(refstore_entry_t) > rs->map_len) {
+               return -1;
+          }
+          memcpy(& e, map+pos, sizeof(refstore_entry_t));
+          pos += sizeof(refstore_entry_t);
+          if (0 == e.name_len || pos + e.name_len > rs->map_len
+              || map[pos + e.name_len - 1] != '\0') {
+               return -1;
+          }
+          if (e.len > INT_MAX-1 || e.offset + e.len + 1 > rs->map_len
+              || map[e.offset + e.len] != '\0') {
+               return -1;
+          }
+          s->name = map+pos;
+          s->seq = map+e.offset;
+          s->len = e.len;
+          pos += e.name_len;
+          HASH_ADD_KEYPTR(hh, rs->hash, s->name, strlen(s->name), s);
+     }
+     return 0;
+}
+/* refstore_parse() */
+
+
+/**
+ * @brief Maps the store of fasta file fa (fa + REFSTORE_EXT) if it
+ * exists. Returns NULL if there is none or if it is older than fa or
+ * unusable (with a warning), in which case sequences should come from
+ * faidx as usual.
+ */
+refstore_t *
+refstore_open(const char *fa)
+{
+     char *fn = refstore_path(fa);
+     struct stat fa_st, rs_st;
+     refstore_t *rs = NULL;
+     void *map;
+     int fd;
+
+     if (stat(fn, & rs_st)) {
+          free(fn);
+          return NULL;
+     }
+     if (0 == stat(fa, & fa_st) && rs_st.st_mtime < fa_st.st_mtime) {
+          LOG_WARN("Ignoring reference store %s, which is older than %s\n", fn, fa);
+          free(fn);
+          return NULL;
+     }
+     if (-1 == (fd = open(fn, O_RDONLY))) {
+          LOG_WARN("Couldn't open reference store %s\n", fn);
+          free(fn);
+          return NULL;
+     }
+     map = mmap(NULL, rs_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+     close(fd);
+     if (MAP_FAILED == map) {
+          LOG_WARN("Couldn't map reference store %s\n", fn);
+          free(fn);
+          return NULL;
+     }
+
+     if (NULL == (rs = calloc(1, sizeof(refstore_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     rs->map = map;
+     rs->map_len = rs_st.st_size;
+     if (refstore_parse(rs)) {
+          LOG_WARN("Ignoring malformed reference store %s\n", fn);
+          refstore_close(rs);
+          free(fn);
+          return NULL;
+     }
+     LOG_VERBOSE("Using reference store %s (%d sequences)\n", fn, rs->num_seqs);
+     free(fn);
+     return rs;
+}
+/* refstore_open() */
+
+
+void
+refstore_close(refstore_t *rs)
+{
+     if (! rs) {
+          return;
+     }
+     HASH_CLEAR(hh, rs->hash);
+     free(rs->seqs);
+     munmap(rs->map, rs->map_len);
+     free(rs);
+}
+/* refstore_close() */
+
+
+/**
+ * @brief Returns uppercase, NUL terminated sequence for name (and sets
+ * len) or NULL if not in store. Points into the mapping, i.e. is
+ * valid until refstore_close() and must not be freed or modified.
+ */
+const char *
+refstore_get(const refstore_t *rs, const char *name, int *len)
+{
+     refstore_seq_t *s = NULL;
+
+     HASH_FIND_STR(rs->hash, name, s);
+     if (! s) {
+          *len = -1;
+          return NULL;
+     }
+     *len = s->len;
+     return s->seq;
+}
+/* refstore_get() */
+
+
+/**
+ * @brief Builds store for fasta file fa, which needs to be indexed
+ * already. Sequences are written in index order. Returns non-zero on
+ * error.
+ */
+int
+refstore_build(const char *fa)
+{
+     char *fn = refstore_path(fa);
+     char *tmp_fn = NULL;
+     char *fai_fn = NULL;
+     FILE *fh = NULL;
+     faidx_t *fai = NULL;
+     char **names = NULL;
+     uint32_t *lens = NULL;
+     int num_seqs = 0, max_seqs = 0;
+     uint64_t offset;
+     char hdr[REFSTORE_HEADER_LEN];
+     uint32_t u;
+     char *line = NULL;
+     size_t line_size = 0;
+     int i;
+     int rc = -1;
+
+     /* sequence names and lengths in index order */
+     if (NULL == (fai_fn = malloc(strlen(fa) + strlen(".fai") + 1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(fai_fn, "%s.fai", fa);
+     if (NULL == (fh = fopen(fai_fn, "r"))) {
+          LOG_ERROR("Couldn't open fasta index %s\n", fai_fn);
+          goto free_and_exit;
+     }
+     while (getline(& line, & line_size, fh) > 0) {
+          char *tab = strchr(line, '\t');
+          if (! tab) {
+               continue;
+          }
+          *tab = '\0';
+          if (num_seqs == max_seqs) {
+               max_seqs = max_seqs ? 2*max_seqs : 64;
+               names = realloc(names, max_seqs * sizeof(char *));
+               lens = realloc(lens, max_seqs * sizeof(uint32_t));
+               if (! names || ! lens) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          names[num_seqs] = strdup(line);
+          lens[num_seqs] = strtoul(tab+1, NULL, 10);
+          num_seqs += 1;
+     }
+     fclose(fh);
+     fh = NULL;
+
+     if (NULL == (fai = fai_load(fa))) {
+          LOG_ERROR("Couldn't load fasta index for %s\n", fa);
+          goto free_and_exit;
+     }
+
+     if (NULL == (tmp_fn = malloc(strlen(fn) + strlen(".tmp") + 1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(tmp_fn, "%s.tmp", fn);
+     if (NULL == (fh = fopen(tmp_fn, "wb"))) {
+          LOG_ERROR("Couldn't open %s for writing\n", tmp_fn);
+          goto free_and_exit;
+     }
+
+     memset(hdr, 0, REFSTORE_HEADER_LEN);
+     memcpy(hdr, REFSTORE_MAGIC, 4);
+     u = REFSTORE_VERSION;
+     memcpy(hdr+4, & u, sizeof(uint32_t));
+     u = num_seqs;
+     memcpy(hdr+8, & u, sizeof(uint32_t));
+     if (1 != fwrite(hdr, REFSTORE_HEADER_LEN, 1, fh)) {
+          goto write_error;
+     }
+
+     offset = REFSTORE_HEADER_LEN;
+     for (i=0; i<num_seqs; i++) {
+          offset += sizeof(refstore_entry_t) + strlen(names[i]) + 1;
+     }
+     for (i=0; i<num_seqs; i++) {
+          refstore_entry_t e;
+          e.offset = offset;
+          e.len = lens[i];
+          e.name_len = strlen(names[i]) + 1;
+          if (1 != fwrite(& e, sizeof(refstore_entry_t), 1, fh)
+              || 1 != fwrite(names[i], e.name_len, 1, fh)) {
+               goto write_error;
+          }
+          offset += (uint64_t)lens[i] + 1;
+     }
+
+     /* one sequence in memory at a time */
+     for (i=0; i<num_seqs; i++) {
+          int len;
+          char *seq = faidx_fetch_seq(fai, names[i], 0, 0x7fffffff, &len);
+          if (NULL == seq || (uint32_t)len != lens[i]) {
+               LOG_ERROR("Couldn't fetch sequence %s (or length differs from index)\n", names[i]);
+               free(seq);
+               goto free_and_exit;
+          }
+          strtoupper(seq);
+          if (1 != fwrite(seq, len+1, 1, fh)) {
+               free(seq);
+               goto write_error;
+          }
+          free(seq);
+     }
+
+     if (fclose(fh)) {
+          fh = NULL;
+          goto write_error;
+     }
+     fh = NULL;
+     if (rename(tmp_fn, fn)) {
+          LOG_ERROR("Couldn't rename %s to %s\n", tmp_fn, fn);
+          goto free_and_exit;
+     }
+     LOG_VERBOSE("Wrote %d sequences to reference store %s\n", num_seqs, fn);
+     rc = 0;
+     goto free_and_exit;
+
+write_error:
+     LOG_ERROR("Couldn't write reference store %s\n", tmp_fn);
+
+free_and_exit:
+     if (fh) {
+          fclose(fh);
+     }
+     if (rc && tmp_fn) {
+          (void) unlink(tmp_fn);
+     }
+     if (fai) {
+          fai_destroy(fai);
+     }
+     for (i=0; i<num_seqs; i++) {
+          free(names[i]);
+     }
+     free(names);
+     free(lens);
+     free(line);
+     free(fai_fn);
+     free(tmp_fn);
+     free(fn);
+     return rc;
+}
+/* refstore_build() */
@@ -0,0 +1,79 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef REFSTORE_H
+#define REFSTORE_H
+
+#include <stdint.h>
+
+#include "uthash.h"
+
+/* Precompiled reference store: all sequences of an indexed fasta
+ * file, uppercased, in one file which gets mmap'd read-only. Lookups
+ * return pointers into the mapping, i.e. nothing gets copied and all
+ * processes and threads using the same store share the page cache.
+ * Built with 'lofreq faidx --ref-store' next to the fasta file and
+ * picked up automatically by refcache_open_store() if not older than
+ * the fasta.
+ *
+ * Layout (native byte order): magic, version, number of sequences,
+ * then one table entry per sequence (offset, length, name length,
+ * name) followed by the sequences, each NUL terminated.
+ */
+
+#define REFSTORE_EXT ".lrs"
+
+typedef struct {
+     const char *name; /* points into map */
+     const char *seq; /* points into map */
+     int len;
+     UT_hash_handle hh;
+} refstore_seq_t;
+
+typedef struct {
+     void *map;
+     size_t map_len;
+     int num_seqs;
+     refstore_seq_t *seqs; /* array of num_seqs */
+     refstore_seq_t *hash; /* same entries, keyed by name */
+} refstore_t;
+
+
+refstore_t *
+refstore_open(const char *fa);
+
+void
+refstore_close(refstore_t *rs);
+
+const char *
+refstore_get(const refstore_t *rs, const char *name, int *len);
+
+int
+refstore_build(const char *fa);
+
+#endif
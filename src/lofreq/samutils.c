@@ -31,16 +31,23 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 /* samtools includes */
 #include "sam.h"
 #include "htslib/kstring.h"
+#include "htslib/hts.h"
 
 /* lofreq includes */
 #include "log.h"
 #include "vcf.h"
 #include "plp.h"
 #include "samutils.h"
+#include "refstore.h"
+#include "utils.h"
+#include "uthash.h"
 
 /* libbam:bamaux.c */
 extern void bam_init_header_hash(bam_header_t *header);
@@ -50,7 +57,7 @@ extern void bam_destroy_header_hash(bam_header_t *header);
 
 #define BUF_SIZE 1024
 
-#define MAX_READ_LEN 8192
+#define REF_MD5_EXT ".md5"
 
 #ifdef USE_ALNERRPROF
 
@@ -421,8 +428,8 @@ cigar_str_from_bam(const bam1_t *b)
  * number of elements corresponds to the count entry and can be at max
  * readlen.
  * 
- * If target is non-NULL will ignore preloaded variant positions via
- * var_in_ign_list
+ * If target is non-NULL will ignore preloaded variant positions (see
+ * source_qual_load_ign_vcf())
  *
  * WARNING code duplication with calc_read_alnerrprof but merging the
  * two functions was too complicated (and the latter is unused anyway)
@@ -443,6 +450,8 @@ count_cigar_ops(int *counts, int **quals, const bam1_t *b,
      uint32_t tpos = c->pos; /* pos on genome */
      uint32_t qpos = 0; /* pos on read/query */
      uint32_t k, i;
+     /* looked up once per read. NULL if nothing to ignore here */
+     const ign_pos_t *ign = target ? ign_list_get(target) : NULL;
 #if 0
      int32_t qlen = (int32_t) bam_cigar2qlen(c, cigar); /* read length */
 #else
@@ -495,13 +504,8 @@ count_cigar_ops(int *counts, int **quals, const bam1_t *b,
                     }
 
                     /* for mismatches only */
-                    if (target && actual_op == OP_MISMATCH) {
-                         var_t fake_var;
-                         memset(&fake_var, 0, sizeof(var_t));
-                         fake_var.chrom = target;
-                         fake_var.pos = i;
-                         /* FIXME evil, evil hack. only works as long as var_in_ign_list only uses chrom and pos */
-                         if (var_in_ign_list(&fake_var)) {
+                    if (ign && actual_op == OP_MISMATCH) {
+                         if (ign_list_has_pos(ign, i)) {
 
 #ifdef TRACE
                               fprintf(stderr, "TRACE(%s): MM: ignoring because in ign list at %d (qpos %d)\n", bam1_qname(b), i, qpos);
@@ -525,19 +529,16 @@ count_cigar_ops(int *counts, int **quals, const bam1_t *b,
 
           } else if (op == BAM_CINS || op == BAM_CDEL) {
 
-               if (target) {
+               if (ign) {
                     /* vcf: 
                      * indel at tpos 1 means, that qpos 2 is an insertion  (e.g. A to AT)
                      * del at tpos 1 means, that qpos 2 is missing (e.g. AT to A)
                      */
-                    var_t fake_var;
-                    fake_var.chrom = target;
-                    fake_var.pos = tpos;
+                    long int ign_pos = tpos;
                     if (op==BAM_CINS) {
-                         fake_var.pos -= 1;
+                         ign_pos -= 1;
                     }
-                    /* FIXME see above: only works as long as var_in_ign_list only uses chrom and pos */
-                    if (var_in_ign_list(&fake_var)) {
+                    if (ign_list_has_pos(ign, ign_pos)) {
                          if (op == BAM_CINS) {
                               qpos += l;
                          }
@@ -608,17 +609,230 @@ count_cigar_ops(int *counts, int **quals, const bam1_t *b,
 #undef TRACE
 
 
-/* check match between reference and bam files. prints an error
- * message and return non-zero on mismatch 
+/* MD5 digests of reference sequences, as used for @SQ M5 tags */
+typedef struct {
+     char *name;
+     char md5[33];
+     UT_hash_handle hh;
+} ref_md5_t;
+
+
+static void
+ref_md5_free(ref_md5_t **md5s)
+{
+     ref_md5_t *it, *it_tmp;
+     HASH_ITER(hh, *md5s, it, it_tmp) {
+          HASH_DEL(*md5s, it);
+          free(it->name);
+          free(it);
+     }
+}
+/* ref_md5_free() */
+
+
+static void
+ref_md5_add(ref_md5_t **md5s, const char *name, const char *md5)
+{
+     ref_md5_t *it;
+
+     HASH_FIND_STR(*md5s, name, it);
+     if (! it) {
+          if (NULL == (it = malloc(sizeof(ref_md5_t)))) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               exit(1);
+          }
+          it->name = strdup(name);
+          HASH_ADD_KEYPTR(hh, *md5s, it->name, strlen(it->name), it);
+     }
+     strncpy(it->md5, md5, 32);
+     it->md5[32] = '\0';
+}
+/* ref_md5_add() */
+
+
+#ifdef HAVE_HTS_MD5
+/* digest of seq according to the SAM spec: uppercase and without
+ * characters outside of 33-126 */
+static void
+ref_md5_of_seq(char md5[33], const char *seq, const int len)
+{
+     hts_md5_context *ctx;
+     unsigned char digest[16];
+     char buf[BUF_SIZE];
+     int i, n = 0;
+
+     if (NULL == (ctx = hts_md5_init())) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<len; i++) {
+          if (seq[i] < 33 || seq[i] > 126) {
+               continue;
+          }
+          buf[n++] = toupper(seq[i]);
+          if (n == BUF_SIZE) {
+               hts_md5_update(ctx, buf, n);
+               n = 0;
+          }
+     }
+     hts_md5_update(ctx, buf, n);
+     hts_md5_final(digest, ctx);
+     hts_md5_hex(md5, digest);
+     hts_md5_destroy(ctx);
+}
+/* ref_md5_of_seq() */
+
+
+/* loads digests of all sequences of fasta_file from the cache next
+ * to it (fasta_file.md5: one line of name and digest per sequence),
+ * computing and caching them first if the cache is missing or older
+ * than the fasta file. sequences are taken from rs if not NULL,
+ * otherwise fetched with fai. returns non-zero on error */
+static int
+ref_md5_load(ref_md5_t **md5s, const char *fasta_file,
+             const refstore_t *rs, const faidx_t *fai)
+{
+     char *fn;
+     char *tmp_fn;
+     FILE *fh;
+     char *line = NULL;
+     size_t line_size = 0;
+     int i;
+
+     if (NULL == (fn = malloc(strlen(fasta_file) + strlen(REF_MD5_EXT) + strlen(".tmp") + 1))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(fn, "%s%s", fasta_file, REF_MD5_EXT);
+
+     if (file_exists(fn) && 1 != is_newer(fasta_file, fn)
+         && NULL != (fh = fopen(fn, "r"))) {
+          while (getline(& line, & line_size, fh) > 0) {
+               char *tab = strchr(line, '\t');
+               if (! tab || strlen(tab+1) < 32) {
+                    LOG_WARN("Ignoring malformed line in %s\n", fn);
+                    continue;
+               }
+               *tab = '\0';
+               ref_md5_add(md5s, line, tab+1);
+          }
+          free(line);
+          fclose(fh);
+          LOG_VERBOSE("Loaded %d sequence digests from %s\n", HASH_COUNT(*md5s), fn);
+          free(fn);
+          return 0;
+     }
+
+     /* compute once for all sequences */
+     LOG_VERBOSE("Computing sequence digests of %s\n", fasta_file);
+     for (i=0; i<faidx_nseq(fai); i++) {
+          const char *name = faidx_iseq(fai, i);
+          char md5[33];
+          char *seq;
+          int len;
+
+          if (rs) {
+               seq = (char *) refstore_get(rs, name, &len);
+          } else {
+               seq = faidx_fetch_seq(fai, name, 0, 0x7fffffff, &len);
+          }
+          if (NULL == seq) {
+               LOG_FATAL("Failed to fetch sequence %s from fasta file\n", name);
+               free(fn);
+               return -1;
+          }
+          ref_md5_of_seq(md5, seq, len);
+          ref_md5_add(md5s, name, md5);
+          if (! rs) {
+               free(seq);
+          }
+     }
+
+     /* written to temporary file first, so that concurrent jobs never
+      * see a partial cache */
+     tmp_fn = malloc(strlen(fn) + 16 + 1);
+     if (NULL == tmp_fn) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     sprintf(tmp_fn, "%s.tmp.%d", fn, (int) getpid());
+     if (NULL == (fh = fopen(tmp_fn, "w"))) {
+          LOG_WARN("Couldn't cache sequence digests in %s\n", fn);
+     } else {
+          int err = 0;
+          for (i=0; i<faidx_nseq(fai); i++) {
+               ref_md5_t *it;
+               HASH_FIND_STR(*md5s, faidx_iseq(fai, i), it);
+               if (it && fprintf(fh, "%s\t%s\n", it->name, it->md5) < 0) {
+                    err = 1;
+               }
+          }
+          if (fclose(fh) || err || rename(tmp_fn, fn)) {
+               LOG_WARN("Couldn't cache sequence digests in %s\n", fn);
+               (void) unlink(tmp_fn);
+          } else {
+               LOG_VERBOSE("Cached sequence digests in %s\n", fn);
+          }
+     }
+     free(tmp_fn);
+     free(fn);
+     return 0;
+}
+/* ref_md5_load() */
+#endif
+
+
+/* value of tag (e.g. "SN") of header line, copied to buf. NULL if
+ * not present */
+char *
+sq_tag(char *buf, const size_t size, const char *line, const char *line_end, const char *tag)
+{
+     const char *p = line;
+     size_t len;
+
+     while (NULL != (p = memchr(p, '\t', line_end-p))) {
+          p++;
+          if (line_end-p > 3 && p[0] == tag[0] && p[1] == tag[1] && p[2] == ':') {
+               const char *e;
+               p += 3;
+               e = memchr(p, '\t', line_end-p);
+               len = (e ? e : line_end) - p;
+               if (len >= size) {
+                    len = size-1;
+               }
+               memcpy(buf, p, len);
+               buf[len] = '\0';
+               return buf;
+          }
+     }
+     return NULL;
+}
+/* sq_tag() */
+
+
+/* check match between reference and bam files. lengths are taken
+ * from the fasta index (or reference store) alone, i.e. no sequence
+ * is read. if check_md5 is set, M5 tags of @SQ header lines are also
+ * compared with digests of the reference sequences, which are cached
+ * next to the fasta file (see ref_md5_load()). prints an error
+ * message and return non-zero on mismatch
 */
-int checkref(char *fasta_file, char *bam_file)
+int checkref(char *fasta_file, char *bam_file, const int check_md5)
 {
      int i = -1;
      bam_header_t *header;
-     faidx_t *fai;
-     char *ref;
+     faidx_t *fai = NULL;
+     refstore_t *rs;
      int ref_len = -1;
      bamFile bam_fp;
+     ref_md5_t *ref_md5s = NULL;
+     ref_md5_t *bam_md5s = NULL;
+     int num_md5_checked = 0;
+     int rc = 0;
      
      if (! file_exists(fasta_file)) {
           LOG_FATAL("Fsata file %s does not exist. Exiting...\n", fasta_file);
@@ -637,33 +851,102 @@ int checkref(char *fasta_file, char *bam_file)
           return 1;
      }
      
-     fai = fai_load(fasta_file);
-     if (!fai) {
-          LOG_FATAL("Failed to fasta index for %s\n", fasta_file);
-          return 1;
+     /* lengths can be looked up in the store without copying sequences */
+     rs = refstore_open(fasta_file);
+     if (! rs || check_md5) {
+          fai = fai_load(fasta_file);
+          if (!fai) {
+               LOG_FATAL("Failed to fasta index for %s\n", fasta_file);
+               rc = 1;
+               goto free_and_exit;
+          }
+     }
+
+     if (check_md5) {
+          const char *line = header->text;
+          const char *text_end = header->text + header->l_text;
+
+          while (line < text_end) {
+               const char *line_end = memchr(line, '\n', text_end-line);
+               char sn[BUF_SIZE], m5[64];
+               if (! line_end) {
+                    line_end = text_end;
+               }
+               if (line_end-line > 3 && 0 == strncmp(line, "@SQ", 3)
+                   && sq_tag(sn, sizeof(sn), line, line_end, "SN")
+                   && sq_tag(m5, sizeof(m5), line, line_end, "M5")) {
+                    ref_md5_add(& bam_md5s, sn, m5);
+               }
+               line = line_end+1;
+          }
+          if (! bam_md5s) {
+               LOG_WARN("No M5 tags found in header of %s. Only checking sequence lengths\n", bam_file);
+#ifdef HAVE_HTS_MD5
+          } else if (ref_md5_load(& ref_md5s, fasta_file, rs, fai)) {
+               rc = -1;
+               goto free_and_exit;
+          }
+#else
+          } else {
+               LOG_FATAL("%s\n", "Checking M5 tags needs htslib >= 1.3");
+               rc = -1;
+               goto free_and_exit;
+          }
+#endif
      }
      
      for (i=0; i < header->n_targets; i++) {
+          ref_md5_t *bam_md5 = NULL;
+
           LOG_DEBUG("BAM header target %d of %d: name=%s len=%d\n", 
                     i+1, header->n_targets, header->target_name[i], header->target_len[i]);
           
-          ref = faidx_fetch_seq(fai, header->target_name[i], 
-                                0, 0x7fffffff, &ref_len);
-          if (NULL == ref) {
+          if (rs) {
+               if (NULL == refstore_get(rs, header->target_name[i], &ref_len)) {
+                    ref_len = -1;
+               }
+          } else {
+               ref_len = faidx_seq_len(fai, header->target_name[i]);
+          }
+          if (ref_len < 0) {
                LOG_FATAL("Failed to fetch sequence %s from fasta file\n", header->target_name[i]);
-               return -1;
+               rc = -1;
+               goto free_and_exit;
           }
           if (header->target_len[i] != ref_len) {
                LOG_FATAL("Sequence length mismatch for sequence %s (%dbp in fasta; %dbp in bam)\n", 
-                         header->target_name[i], header->target_len[i], ref_len);
-               return -1;
+                         header->target_name[i], ref_len, header->target_len[i]);
+               rc = -1;
+               goto free_and_exit;
+          }
+
+          HASH_FIND_STR(bam_md5s, header->target_name[i], bam_md5);
+          if (bam_md5) {
+               ref_md5_t *ref_md5 = NULL;
+               HASH_FIND_STR(ref_md5s, header->target_name[i], ref_md5);
+               if (! ref_md5 || strcasecmp(ref_md5->md5, bam_md5->md5)) {
+                    LOG_FATAL("Sequence digest mismatch for sequence %s (%s in fasta; %s in bam)\n",
+                              header->target_name[i], ref_md5 ? ref_md5->md5 : "NA", bam_md5->md5);
+                    rc = -1;
+                    goto free_and_exit;
+               }
+               num_md5_checked += 1;
           }
-          free(ref);
      }
-     
-     fai_destroy(fai);
+     if (check_md5 && bam_md5s) {
+          LOG_VERBOSE("Checked digests of %d of %d sequences (others have no M5 tag)\n",
+                      num_md5_checked, header->n_targets);
+     }
+
+free_and_exit:
+     ref_md5_free(& ref_md5s);
+     ref_md5_free(& bam_md5s);
+     if (fai) {
+          fai_destroy(fai);
+     }
+     refstore_close(rs);
      bam_header_destroy(header);
      bam_close(bam_fp);
 
-     return 0;
+     return rc;
 }
@@ -42,6 +42,9 @@ typedef enum {
         NUM_OP_CATS,
 } op_cat_t;
 
+/* upper limit for read length in per-read-position statistics */
+#define MAX_READ_LEN 8192
+
 #define STR(name) # name
 
 static char *op_cat_str[] = {
@@ -56,6 +59,9 @@ static char *op_cat_str[] = {
 char *
 cigar_str_from_bam(const bam1_t *b);
 
+char *
+sq_tag(char *buf, const size_t size, const char *line, const char *line_end, const char *tag);
+
 int
 count_cigar_ops(int *counts, int **quals,
                 const bam1_t *b, const char *ref, int min_bq,
@@ -90,6 +96,7 @@ free_alnerrprof(alnerrprof_t *alnerrprof);
 
 #endif
 
-int checkref(char *fasta_file, char *bam_file);
+/* see samutils.c */
+int checkref(char *fasta_file, char *bam_file, const int check_md5);
 
 #endif
@@ -0,0 +1,248 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Shard manifests. See shard.h. Example:
+ *
+ * lofreq_shard_manifest	1
+ * vcf	shard1.vcf.gz
+ * vcf_checksum	a1b2...
+ * ...
+ * seq	chr1
+ * seq	chr2
+ *
+ * Unknown keys are ignored by the reader.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "qualcache.h"
+#include "shard.h"
+
+
+static const char *shard_bonf_str[] = {"dynamic", "auto", "fixed"};
+
+
+/* FNV-1a (see qual_cache_hash64()) of the file as is. 0 if the file
+ * can't be read */
+uint64_t
+shard_file_checksum(const char *path)
+{
+     FILE *fh;
+     char buf[1<<16];
+     size_t n;
+     uint64_t h = 0;
+
+     if (NULL == (fh = fopen(path, "rb"))) {
+          return 0;
+     }
+     while ((n = fread(buf, 1, sizeof(buf), fh)) > 0) {
+          h = qual_cache_hash64(h, buf, n);
+     }
+     if (ferror(fh)) {
+          h = 0;
+     }
+     fclose(fh);
+     return h;
+}
+/* shard_file_checksum() */
+
+
+int
+shard_manifest_write(const char *path, const shard_manifest_t *m)
+{
+     FILE *fh;
+     int i;
+
+     if (NULL == (fh = fopen(path, "w"))) {
+          LOG_ERROR("Couldn't open %s for writing shard manifest\n", path);
+          return 1;
+     }
+     fprintf(fh, "%s\t%d\n", SHARD_MANIFEST_MAGIC, SHARD_MANIFEST_VERSION);
+     fprintf(fh, "vcf\t%s\n", m->vcf);
+     fprintf(fh, "vcf_checksum\t%016"PRIx64"\n", m->vcf_checksum);
+     fprintf(fh, "bam\t%s\n", m->bam);
+     fprintf(fh, "ref\t%s\n", m->ref ? m->ref : ".");
+     fprintf(fh, "region\t%s\n", m->region ? m->region : ".");
+     fprintf(fh, "params_checksum\t%016"PRIx64"\n", m->params_checksum);
+     fprintf(fh, "sig\t%g\n", m->sig);
+     fprintf(fh, "bonf\t%s\n", shard_bonf_str[m->bonf]);
+     fprintf(fh, "bonf_subst\t%lld\n", m->bonf_subst);
+     fprintf(fh, "bonf_indel\t%lld\n", m->bonf_indel);
+     fprintf(fh, "num_snv_tests\t%lld\n", m->num_snv_tests);
+     fprintf(fh, "num_indel_tests\t%lld\n", m->num_indel_tests);
+     fprintf(fh, "cmdline\t%s\n", m->cmdline ? m->cmdline : ".");
+     for (i=0; i<m->num_seqs; i++) {
+          fprintf(fh, "seq\t%s\n", m->seqs[i]);
+     }
+     if (ferror(fh) | fclose(fh)) {
+          LOG_ERROR("Couldn't write shard manifest %s\n", path);
+          return 1;
+     }
+     return 0;
+}
+/* shard_manifest_write() */
+
+
+static char *
+shard_strdup(const char *s)
+{
+     char *d = strdup(s);
+     if (! d) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     return d;
+}
+/* shard_strdup() */
+
+
+int
+shard_manifest_read(const char *path, shard_manifest_t *m)
+{
+     FILE *fh;
+     char *line = NULL;
+     size_t line_size = 0;
+     ssize_t len;
+     int line_no = 0;
+     int max_seqs = 0;
+     int have_tests = 0;
+     int rc = 0;
+
+     memset(m, 0, sizeof(shard_manifest_t));
+     if (NULL == (fh = fopen(path, "r"))) {
+          LOG_ERROR("Couldn't open shard manifest %s\n", path);
+          return 1;
+     }
+     while (0 == rc && (len = getline(& line, & line_size, fh)) > 0) {
+          char *key = line;
+          char *val;
+
+          line_no += 1;
+          if ('\n' == line[len-1]) {
+               line[len-1] = '\0';
+          }
+          if (NULL == (val = strchr(line, '\t'))) {
+               LOG_ERROR("Malformed line %d in shard manifest %s\n", line_no, path);
+               rc = 1;
+               break;
+          }
+          *val++ = '\0';
+
+          if (1 == line_no) {
+               if (0 != strcmp(key, SHARD_MANIFEST_MAGIC)) {
+                    LOG_ERROR("%s is not a shard manifest\n", path);
+                    rc = 1;
+               } else if (SHARD_MANIFEST_VERSION != atoi(val)) {
+                    LOG_ERROR("Unsupported version %s of shard manifest %s\n", val, path);
+                    rc = 1;
+               }
+          } else if (0 == strcmp(key, "vcf")) {
+               m->vcf = shard_strdup(val);
+          } else if (0 == strcmp(key, "vcf_checksum")) {
+               m->vcf_checksum = strtoull(val, NULL, 16);
+          } else if (0 == strcmp(key, "bam")) {
+               m->bam = shard_strdup(val);
+          } else if (0 == strcmp(key, "ref")) {
+               m->ref = shard_strdup(val);
+          } else if (0 == strcmp(key, "region")) {
+               m->region = shard_strdup(val);
+          } else if (0 == strcmp(key, "params_checksum")) {
+               m->params_checksum = strtoull(val, NULL, 16);
+          } else if (0 == strcmp(key, "sig")) {
+               m->sig = strtod(val, NULL);
+          } else if (0 == strcmp(key, "bonf")) {
+               int i;
+               for (i=0; i<3 && 0 != strcmp(val, shard_bonf_str[i]); i++) {
+                    ;
+               }
+               if (3 == i) {
+                    LOG_ERROR("Unknown Bonferroni mode '%s' in shard manifest %s\n", val, path);
+                    rc = 1;
+               }
+               m->bonf = (shard_bonf_t) i;
+          } else if (0 == strcmp(key, "bonf_subst")) {
+               m->bonf_subst = strtoll(val, NULL, 10);
+          } else if (0 == strcmp(key, "bonf_indel")) {
+               m->bonf_indel = strtoll(val, NULL, 10);
+          } else if (0 == strcmp(key, "num_snv_tests")) {
+               m->num_snv_tests = strtoll(val, NULL, 10);
+               have_tests |= 1;
+          } else if (0 == strcmp(key, "num_indel_tests")) {
+               m->num_indel_tests = strtoll(val, NULL, 10);
+               have_tests |= 2;
+          } else if (0 == strcmp(key, "cmdline")) {
+               m->cmdline = shard_strdup(val);
+          } else if (0 == strcmp(key, "seq")) {
+               if (m->num_seqs == max_seqs) {
+                    max_seqs = max_seqs ? 2*max_seqs : 64;
+                    if (NULL == (m->seqs = realloc(m->seqs, max_seqs * sizeof(char *)))) {
+                         fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                                 __FILE__, __FUNCTION__, __LINE__);
+                         exit(1);
+                    }
+               }
+               m->seqs[m->num_seqs++] = shard_strdup(val);
+          }
+     }
+     free(line);
+     fclose(fh);
+
+     if (0 == rc && (0 == line_no || ! m->vcf || 3 != have_tests || ! m->num_seqs)) {
+          LOG_ERROR("Incomplete shard manifest %s\n", path);
+          rc = 1;
+     }
+     if (rc) {
+          shard_manifest_free(m);
+     }
+     return rc;
+}
+/* shard_manifest_read() */
+
+
+void
+shard_manifest_free(shard_manifest_t *m)
+{
+     int i;
+
+     free(m->vcf);
+     free(m->bam);
+     free(m->ref);
+     free(m->region);
+     free(m->cmdline);
+     for (i=0; i<m->num_seqs; i++) {
+          free(m->seqs[i]);
+     }
+     free(m->seqs);
+     memset(m, 0, sizeof(shard_manifest_t));
+}
+/* shard_manifest_free() */
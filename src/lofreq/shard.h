@@ -0,0 +1,82 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+/* Manifest of one shard of a calling job that was split by region
+ * (e.g. across cluster nodes), written by lofreq call --manifest and
+ * read by lofreq merge. It records how many tests the shard performed,
+ * so that merge can apply the multiple testing correction of the
+ * whole job, plus checksums for checking that all shards belong
+ * together (same BAM, reference and parameters) and that the shard
+ * VCF is the one written. Text, one tab-separated key and value per
+ * line.
+ */
+
+#define SHARD_MANIFEST_MAGIC "lofreq_shard_manifest"
+#define SHARD_MANIFEST_VERSION 1
+
+typedef enum {
+     SHARD_BONF_DYNAMIC = 0, /* QUAL uncorrected: merge applies sum of performed tests */
+     SHARD_BONF_AUTO, /* factor counted per shard: merge applies sum of factors */
+     SHARD_BONF_FIXED /* factor given by user: already applied */
+} shard_bonf_t;
+
+typedef struct {
+     char *vcf; /* shard output */
+     uint64_t vcf_checksum;
+     char *bam;
+     char *ref;
+     char *region; /* "." if none */
+     uint64_t params_checksum; /* of BAM, reference and calling parameters */
+     double sig;
+     shard_bonf_t bonf;
+     long long int bonf_subst, bonf_indel; /* factors used by shard */
+     long long int num_snv_tests, num_indel_tests;
+     int num_seqs;
+     char **seqs; /* BAM header sequences, i.e. sort order */
+     char *cmdline;
+} shard_manifest_t;
+
+
+uint64_t
+shard_file_checksum(const char *path);
+
+int
+shard_manifest_write(const char *path, const shard_manifest_t *m);
+
+int
+shard_manifest_read(const char *path, shard_manifest_t *m);
+
+void
+shard_manifest_free(shard_manifest_t *m);
+
+#endif
@@ -39,12 +39,18 @@
 #include <float.h>
 #include <errno.h>
 #include <fenv.h>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "fet.h"
 #include "utils.h"
 #include "log.h"
 
 #include "snpcaller.h"
+#include "profile.h"
 #if TIMING
 #include <time.h>
 #endif
@@ -244,8 +250,8 @@ double log_diff(double log_a, double log_b);
 double probvec_tailsum(const double *probvec, int tail_startindex,
                        int probvec_len);
 double *naive_calc_prob_dist(const double *err_probs, int N, int K);
-double *pruned_calc_prob_dist(const double *err_probs, int N, int K,
-                      long long int bonf_factor, double sig_level);
+double *hist_calc_prob_dist(const errprob_hist_t *h, int K,
+                    long long int bonf_factor, double sig_level);
 
 
 
@@ -270,6 +276,73 @@ int mq_trans(int mq) {
 
 
 
+/* PHREDQUAL_TO_PROB() lookup for the common range. filled backwards
+ * so that qual2prob[0] (used as init flag) is set last, which makes
+ * concurrent lazy init harmless. init_varcall_conf() fills it anyway
+ * before any threads are started.
+ */
+#define QUAL2PROB_SIZE 256
+static double qual2prob[QUAL2PROB_SIZE];
+
+static void
+qual2prob_init(void)
+{
+     int q;
+     if (qual2prob[0] != 0.0) {
+          return;
+     }
+     for (q=QUAL2PROB_SIZE-1; q>=0; q--) {
+          qual2prob[q] = PHREDQUAL_TO_PROB(q);
+     }
+}
+
+static inline double
+qual_to_prob(const int q)
+{
+     if (q >= 0 && q < QUAL2PROB_SIZE) {
+          if (qual2prob[0] == 0.0) {
+               qual2prob_init();
+          }
+          return qual2prob[q];
+     }
+     return PHREDQUAL_TO_PROB(q);
+}
+
+
+/* returns the largest error probability p for which
+ * PROB_TO_PHREDQUAL_SAFE(p) >= q, i.e. (p > returned value) is
+ * equivalent to (PROB_TO_PHREDQUAL_SAFE(p) < q). allows filtering on
+ * joined qualities without computing log10 per base. found by
+ * bisection over the (monotonic) bit representation of positive
+ * doubles, so that rounding is exactly as in PROB_TO_PHREDQUAL_SAFE.
+ */
+static double
+phredqual_thresh_prob(const int q)
+{
+     unsigned long long int lo, hi, mid; /* invariant: lo passes, hi fails */
+     double d;
+
+     if (q <= 0) {
+          return DBL_MAX; /* never filter */
+     }
+     d = 0.0;
+     memcpy(&lo, &d, sizeof(d));
+     d = 1.0;
+     memcpy(&hi, &d, sizeof(d));
+     while (hi - lo > 1) {
+          mid = lo + (hi - lo)/2;
+          memcpy(&d, &mid, sizeof(d));
+          if (PROB_TO_PHREDQUAL_SAFE(d) >= q) {
+               lo = mid;
+          } else {
+               hi = mid;
+          }
+     }
+     memcpy(&d, &lo, sizeof(d));
+     return d;
+}
+
+
 /* PJ = PM + (1-PM)*PS + (1-PM)*(1-PS)*PA + (1-PM)*(1-PS)*(1-PA)*PB, where
  * PJ = joined error prob
  * PM = mapping error prob
@@ -294,15 +367,15 @@ int mq_trans(int mq) {
  * phred-score so you might want to change mq before.
  *
  */
-double
-merge_srcq_mapq_baq_and_bq(const int sq, const int mq, const int baq, const int bq)
+static inline double
+merge_quals(const int sq, const int mq, const int baq, const int bq)
 {
      double sp, mp, bap, bp, jp; /* corresponding probs */
 
      if (-1 == sq) {
           sp = 0.0;
      } else {
-          sp = PHREDQUAL_TO_PROB(sq);
+          sp = qual_to_prob(sq);
      }
 
      if (-1 == mq) {
@@ -310,19 +383,19 @@ merge_srcq_mapq_baq_and_bq(const int sq, const int mq, const int baq, const int
      } else if (0 == mq) {
           mp = MQ0_ERRPROB;
      } else {
-          mp = PHREDQUAL_TO_PROB(mq);
+          mp = qual_to_prob(mq);
      }
 
      if (-1 == baq) {
           bap = 0.0;
      } else {
-          bap = PHREDQUAL_TO_PROB(baq);
+          bap = qual_to_prob(baq);
      }
 
      if (-1 == bq) {
           bp = 0.0;
      } else {
-          bp = PHREDQUAL_TO_PROB(bq);
+          bp = qual_to_prob(bq);
      }
 
      /* FIXME do calculations in log space and return Q instead of p */
@@ -335,6 +408,222 @@ merge_srcq_mapq_baq_and_bq(const int sq, const int mq, const int baq, const int
      return jp;
 }
 
+double
+merge_srcq_mapq_baq_and_bq(const int sq, const int mq, const int baq, const int bq)
+{
+     return merge_quals(sq, mq, baq, bq);
+}
+
+
+
+typedef struct {
+     int val;
+     long int count;
+} val_count_t;
+
+static int
+val_count_cmp(const void *a, const void *b)
+{
+     return int_cmp(& ((const val_count_t *)a)->val, & ((const val_count_t *)b)->val);
+}
+/* val_count_cmp() */
+
+
+/* median of the base qualities of reference base nt4 in p, counting
+ * those in ref_hist as well (MPLP_REF_HIST). same result as
+ * int_median() on all of them */
+static int
+ref_bq_median(const plp_col_t *p, const int nt4)
+{
+     const int_varray_t *bqs = & p->base_quals[nt4];
+     const plp_qual_hist_t *h = & p->ref_hist;
+     long int size = bqs->n + h->total;
+     long int rank, cum;
+     val_count_t *vc;
+     int num_vc = 0;
+     int i, lo = -1, hi = -1;
+
+     if (0 == h->total) {
+          return int_median(bqs->data, bqs->n);
+     }
+     if (NULL == (vc = malloc((bqs->n + h->n) * sizeof(val_count_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     for (i=0; i<bqs->n; i++) {
+          vc[num_vc].val = bqs->data[i];
+          vc[num_vc++].count = 1;
+     }
+     for (i=0; i<h->n; i++) {
+          vc[num_vc].val = h->tuples[i].bq;
+          vc[num_vc++].count = h->tuples[i].count;
+     }
+     qsort(vc, num_vc, sizeof(val_count_t), val_count_cmp);
+
+     /* values at (zero-based) ranks size/2-1 and size/2 */
+     rank = size/2;
+     cum = 0;
+     for (i=0; i<num_vc; i++) {
+          cum += vc[i].count;
+          if (lo == -1 && cum > rank-1) {
+               lo = vc[i].val;
+          }
+          if (cum > rank) {
+               hi = vc[i].val;
+               break;
+          }
+     }
+     free(vc);
+     if (size%2 == 0) {
+          return (lo + hi) / 2.0;
+     } else {
+          return hi;
+     }
+}
+/* ref_bq_median() */
+
+
+/* parameters of the errprobs kernels below. filled once per column by
+ * plp_to_errprobs() */
+typedef struct {
+     int min_bq;
+     int min_alt_bq;
+     int alt_bq; /* replacement bq of alt bases (ERRPROBS_REPL_BQ) */
+     double jq_thresh_prob[2]; /* see varcall_conf_t */
+     double alt_jq_prob; /* replacement err prob of alt bases (ERRPROBS_REPL_JQ) */
+} errprobs_param_t;
+
+/* kernel modes: reference base or alt base with alt quality policy */
+#define ERRPROBS_REF      0
+#define ERRPROBS_ALT      1 /* keep alt qualities */
+#define ERRPROBS_REPL_BQ  2 /* alt: replace bq (def_alt_bq != 0) */
+#define ERRPROBS_REPL_JQ  4 /* alt: replace joined q (def_alt_jq != 0) */
+#define ERRPROBS_NUM_MODES 8
+
+typedef int (*errprobs_kernel_t)(double *err_probs, int *alt_count, int *alt_raw_count,
+                                 const int *bqs, const int *baqs, const int *mqs,
+                                 const int *sqs, const int n,
+                                 const errprobs_param_t *ep);
+
+/* converts err probs of n bases (with qualities bqs etc.) for
+ * plp_to_errprobs() and returns their number. template for the
+ * kernels below: all but the first nine arguments are compile time
+ * constants there, so that configuration tests disappear from the
+ * loop. the quality arrays of unused sources are never read.
+ */
+static inline int
+errprobs_kernel(double *err_probs, int *alt_count, int *alt_raw_count,
+                const int *bqs, const int *baqs, const int *mqs,
+                const int *sqs, const int n,
+                const errprobs_param_t *ep,
+                const int use_baq, const int use_mq, const int use_sq,
+                const int mode)
+{
+     const int is_alt = mode & ERRPROBS_ALT;
+     int num = 0;
+     int j;
+
+     for (j=0; j<n; j++) {
+          int bq = bqs[j];
+          int baq = -1;
+          int mq = -1;
+          int sq = -1;
+          double merged_err_prob;
+
+          /* bq filtering for all */
+          if (bq < ep->min_bq) {
+               continue;
+          }
+          if (is_alt) {
+               (*alt_raw_count) += 1;
+               /* ignore altogether if below alt bq threshold */
+               if (bq < ep->min_alt_bq) {
+                    continue;
+               }
+               if (mode & ERRPROBS_REPL_BQ) {
+                    bq = ep->alt_bq;
+               }
+          }
+
+          if (use_baq) {
+               baq = baqs[j];
+          }
+          if (use_mq) {
+               mq = mqs[j];
+               /*according to spec 255 is unknown */
+               if (mq == 255) {
+                    mq = -1;
+               }
+#ifdef SCALE_MQ
+               mq = 254/60.0*mq * pow(mq, SCALE_MQ_FAC)/pow(60, SCALE_MQ_FAC);
+#elif defined(MQ_TRANS_TABLE)
+               mq = mq_trans(mq);
+#endif
+          }
+          if (use_sq) {
+               sq = sqs[j];
+          }
+
+          merged_err_prob = merge_quals(sq, mq, baq, bq);
+
+          /* min merged q filtering for all, i.e.
+           * PROB_TO_PHREDQUAL_SAFE(merged_err_prob) < min_jq */
+          if (merged_err_prob > ep->jq_thresh_prob[0]) {
+               continue;
+          }
+          if (is_alt) {
+               /* apply alt merged qual threshold and overwrite if needed */
+               if (merged_err_prob > ep->jq_thresh_prob[1]) {
+                    continue;
+               }
+               if (mode & ERRPROBS_REPL_JQ) {
+                    merged_err_prob = ep->alt_jq_prob;
+               }
+               (*alt_count) += 1;
+          }
+          err_probs[num++] = merged_err_prob;
+     }
+     return num;
+}
+/* errprobs_kernel() */
+
+
+#define ERRPROBS_KERNEL(baq, mq, sq, mode)                              \
+     static int                                                         \
+     errprobs_kernel_##baq##mq##sq##_##mode(double *err_probs, int *alt_count, int *alt_raw_count, \
+                                            const int *bqs, const int *baqs, const int *mqs, \
+                                            const int *sqs, const int n, \
+                                            const errprobs_param_t *ep) \
+     {                                                                  \
+          return errprobs_kernel(err_probs, alt_count, alt_raw_count,   \
+                                 bqs, baqs, mqs, sqs, n, ep, baq, mq, sq, mode); \
+     }
+#define ERRPROBS_KERNELS(mode)                                          \
+     ERRPROBS_KERNEL(0, 0, 0, mode) ERRPROBS_KERNEL(0, 0, 1, mode)      \
+     ERRPROBS_KERNEL(0, 1, 0, mode) ERRPROBS_KERNEL(0, 1, 1, mode)      \
+     ERRPROBS_KERNEL(1, 0, 0, mode) ERRPROBS_KERNEL(1, 0, 1, mode)      \
+     ERRPROBS_KERNEL(1, 1, 0, mode) ERRPROBS_KERNEL(1, 1, 1, mode)
+#define ERRPROBS_KERNEL_ROW(mode)                                       \
+     { errprobs_kernel_000_##mode, errprobs_kernel_001_##mode,          \
+       errprobs_kernel_010_##mode, errprobs_kernel_011_##mode,          \
+       errprobs_kernel_100_##mode, errprobs_kernel_101_##mode,          \
+       errprobs_kernel_110_##mode, errprobs_kernel_111_##mode }
+
+/* modes 0 (ref), 1, 3, 5 and 7 (alt). 2, 4 and 6 don't exist */
+ERRPROBS_KERNELS(0)
+ERRPROBS_KERNELS(1)
+ERRPROBS_KERNELS(3)
+ERRPROBS_KERNELS(5)
+ERRPROBS_KERNELS(7)
+
+/* indexed by mode and quality sources used (baq<<2 | mq<<1 | sq) */
+static const errprobs_kernel_t errprobs_kernels[ERRPROBS_NUM_MODES][8] = {
+     ERRPROBS_KERNEL_ROW(0), ERRPROBS_KERNEL_ROW(1),
+     ERRPROBS_KERNEL_ROW(0), ERRPROBS_KERNEL_ROW(3),
+     ERRPROBS_KERNEL_ROW(0), ERRPROBS_KERNEL_ROW(5),
+     ERRPROBS_KERNEL_ROW(0), ERRPROBS_KERNEL_ROW(7)
+};
 
 
 void
@@ -345,6 +634,13 @@ plp_to_errprobs(double **err_probs, int *num_err_probs,
      int i, j;
      int alt_idx;
      int avg_ref_bq = -1;
+     double def_alt_jq_prob = -1.0;
+     errprobs_param_t ep;
+     int alt_mode;
+
+#ifdef USE_ALNERRPROF
+     LOG_FATAL("%s\n", "ALNERRPROF not supported anymore\n"); exit(1);
+#endif
 
      if (NULL == ((*err_probs) = malloc(p->coverage_plp * sizeof(double)))) {
           /* coverage = base-count after read level filtering */
@@ -353,6 +649,20 @@ plp_to_errprobs(double **err_probs, int *num_err_probs,
           return;
      }
 
+     /* joined quality filtering is done on probabilities. see
+      * phredqual_thresh_prob() */
+     if (conf->jq_thresh_q[0] != conf->min_jq) {
+          conf->jq_thresh_prob[0] = phredqual_thresh_prob(conf->min_jq);
+          conf->jq_thresh_q[0] = conf->min_jq;
+     }
+     if (conf->jq_thresh_q[1] != conf->min_alt_jq) {
+          conf->jq_thresh_prob[1] = phredqual_thresh_prob(conf->min_alt_jq);
+          conf->jq_thresh_q[1] = conf->min_alt_jq;
+     }
+     if (0 != conf->def_alt_jq && -1 != conf->def_alt_jq) {
+          def_alt_jq_prob = qual_to_prob(conf->def_alt_jq);
+     }
+
      /* determine median ref bq in advance if needed
      */
      if (-1 == conf->def_alt_bq) {
@@ -362,17 +672,29 @@ plp_to_errprobs(double **err_probs, int *num_err_probs,
                if (nt != p->ref_base) {
                     continue;
                }
-               if (p->base_quals[i].n) {
-                    int *ref_quals = malloc(sizeof(int) * p->base_quals[i].n);
-                    memcpy(ref_quals, p->base_quals[i].data, sizeof(int) * p->base_quals[i].n);
-                    avg_ref_bq = int_median(ref_quals, p->base_quals[i].n);
-                    free(ref_quals);
+               if (p->base_quals[i].n || p->ref_hist.total) {
+                    /* int_median() works on a copy */
+                    avg_ref_bq = ref_bq_median(p, i);
                     break; /* there can only be one */
                }
           }
           LOG_DEBUG("avg_ref_bq=%d\n", avg_ref_bq);
      }
 
+     ep.min_bq = conf->min_bq;
+     ep.min_alt_bq = conf->min_alt_bq;
+     ep.alt_bq = (-1 == conf->def_alt_bq) ? avg_ref_bq : conf->def_alt_bq;
+     ep.jq_thresh_prob[0] = conf->jq_thresh_prob[0];
+     ep.jq_thresh_prob[1] = conf->jq_thresh_prob[1];
+     ep.alt_jq_prob = def_alt_jq_prob;
+     alt_mode = ERRPROBS_ALT;
+     if (0 != conf->def_alt_bq) {
+          alt_mode |= ERRPROBS_REPL_BQ;
+     }
+     if (0 != conf->def_alt_jq && -1 != conf->def_alt_jq) {
+          alt_mode |= ERRPROBS_REPL_JQ;
+     }
+
      (*num_err_probs) = 0;
      alt_idx = -1;
      for (i=0; i<NUM_NT4; i++) {
@@ -391,97 +713,122 @@ plp_to_errprobs(double **err_probs, int *num_err_probs,
                alt_raw_counts[alt_idx] = 0;
           }
 
-          for (j=0; j<p->base_quals[i].n; j++) {
-               int bq = -1;
-               int mq = -1;
-               int sq = -1;
-               int baq = -1;
-#ifdef USE_ALNERRPROF
-               int aq = -1;
-               LOG_FATAL("%s\n", "ALNERRPROF not supported anymore\n"); exit(1);
-#endif
-               double merged_err_prob; /* final quality used for snv calling */
-               int merged_qual;
-
-               if (p->base_quals[i].n) {
-                    bq = p->base_quals[i].data[j];
+          if (p->base_quals[i].n) {
+               /* pick kernel for this base's quality sources, i.e.
+                * once per base and not per read */
+               int src = ((conf->flag & VARCALL_USE_BAQ) && p->baq_quals[i].n) << 2
+                    | ((conf->flag & VARCALL_USE_MQ) && p->map_quals[i].n) << 1
+                    | ((conf->flag & VARCALL_USE_SQ) && p->source_quals[i].n);
+               int num = errprobs_kernels[is_alt_base ? alt_mode : ERRPROBS_REF][src](
+                    &(*err_probs)[*num_err_probs],
+                    is_alt_base ? &alt_counts[alt_idx] : NULL,
+                    is_alt_base ? &alt_raw_counts[alt_idx] : NULL,
+                    p->base_quals[i].data, p->baq_quals[i].data,
+                    p->map_quals[i].data, p->source_quals[i].data,
+                    p->base_quals[i].n, &ep);
+               (*num_err_probs) += num;
+               if (is_alt_base && alt_counts[alt_idx] && -1 == conf->def_alt_jq) {
+                    LOG_FATAL("%s\n", "median off ref joined q not implemented yet (FIXME)");
+                    exit(1);
+               }
+          }
 
-                    /* bq filtering for all */
-                    if (bq < conf->min_bq) {
+          /* reference bases only counted (MPLP_REF_HIST): same as
+           * above, but once per quality tuple */
+          if (! is_alt_base && p->ref_hist.n) {
+               for (j=0; j<p->ref_hist.n; j++) {
+                    const plp_qual_tuple_t *t = & p->ref_hist.tuples[j];
+                    int mq = -1;
+                    int sq = -1;
+                    int baq = -1;
+                    double merged_err_prob;
+                    int k;
+
+                    if (t->bq < conf->min_bq) {
                          continue;
                     }
-
-                    /* alt bq threshold and overwrite if needed */
-                    if (is_alt_base) {
-                         alt_raw_counts[alt_idx] += 1;
-                         /* ignore altogether if below alt bq threshold */
-                         if (bq < conf->min_alt_bq) {
-                              continue;
-                         } else if (-1 == conf->def_alt_bq)  {
-                              bq = avg_ref_bq;
-                         } else if (0 != conf->def_alt_bq)  {
-                              bq = conf->def_alt_bq;
-                         }
-                         /* 0: keep original */
-                    }
-               }
-
-               if ((conf->flag & VARCALL_USE_BAQ) && p->baq_quals[i].n) {
-                    baq = p->baq_quals[i].data[j];
-               }
-
-               if ((conf->flag & VARCALL_USE_MQ) && p->map_quals[i].n) {
-                    mq = p->map_quals[i].data[j];
-                    /*according to spec 255 is unknown */
-                    if (mq == 255) {
-                         mq = -1;
+                    if (conf->flag & VARCALL_USE_BAQ) {
+                         baq = t->baq;
                     }
+                    if (conf->flag & VARCALL_USE_MQ) {
+                         mq = t->mq;
+                         if (mq == 255) {
+                              mq = -1;
+                         }
 #ifdef SCALE_MQ
-                    mq = 254/60.0*mq * pow(mq, SCALE_MQ_FAC)/pow(60, SCALE_MQ_FAC);
+                         mq = 254/60.0*mq * pow(mq, SCALE_MQ_FAC)/pow(60, SCALE_MQ_FAC);
 #elif defined(MQ_TRANS_TABLE)
-                    mq = mq_trans(mq);
+                         mq = mq_trans(mq);
 #endif
+                    }
+                    if (conf->flag & VARCALL_USE_SQ) {
+                         sq = t->sq;
+                    }
+                    merged_err_prob = merge_quals(sq, mq, baq, t->bq);
+                    if (merged_err_prob > conf->jq_thresh_prob[0]) {
+                         continue;
+                    }
+                    for (k=0; k<t->count; k++) {
+                         (*err_probs)[(*num_err_probs)++] = merged_err_prob;
+                    }
                }
+          }
+     }
+}
 
-               if ((conf->flag & VARCALL_USE_SQ) && p->source_quals[i].n) {
-                    sq = p->source_quals[i].data[j];
-               }
-
-               merged_err_prob = merge_srcq_mapq_baq_and_bq(sq, mq, baq, bq);
-               merged_qual =  PROB_TO_PHREDQUAL_SAFE(merged_err_prob);
+/* error prob of read j (of those with insertion) of event it. uses
+ * alignment quality only if use_aq */
+static double
+ins_read_errprob(const ins_event *it, const int j, const varcall_conf_t *conf,
+                 const int use_aq)
+{
+     int iq, aq, mq, sq;
+     double final_err_prob;
 
-               /* min merged q filtering for all */
-               if (merged_qual < conf->min_jq) {
-                    continue;
-               }
+     iq = aq = mq = sq = -1;
+     iq = it->ins_quals.data[j];
+     if (use_aq) {
+          aq = it->ins_aln_quals.data[j];
+     }
+     if ((conf->flag & VARCALL_USE_MQ) && it->ins_map_quals.n) {
+          mq = it->ins_map_quals.data[j];
+          /*according to spec 255 is unknown */
+          if (mq == 255) {
+               mq = -1;
+          }
+     }
+     if ((conf->flag & VARCALL_USE_SQ) && it->ins_source_quals.n)  {
+          sq = it->ins_source_quals.data[j];
+     }
 
-               if (is_alt_base) {
-#if 0
-                    LOG_debug("alt_base %d: bq=%d merged q=%d p=%f\n",
-                              alt_idx, bq, PROB_TO_PHREDQUAL_SAFE(merged_err_prob), merged_err_prob);
+     final_err_prob = merge_srcq_mapq_baq_and_bq(sq, mq, aq, iq);
+#ifdef TRACE
+     LOG_DEBUG("+%s IQ:%d IAQ:%d MQ:%d SQ:%d EP:%lg\n",
+               it->key, iq, aq, mq, sq, final_err_prob);
 #endif
-                    /* apply alt merged qual threshold and overwrite if needed
-                     */
-                    if (merged_qual < conf->min_alt_jq) {
-                         continue;
-                    } else if (-1 == conf->def_alt_jq)  {
-                         LOG_FATAL("%s\n", "median off ref joined q not implemented yet (FIXME)");
-                         exit(1);
-                    } else if (0 != conf->def_alt_jq)  {
-                         merged_err_prob = PHREDQUAL_TO_PROB(conf->def_alt_jq);
-                    }
-                    /* 0: keep original */
-                    alt_counts[alt_idx] += 1;
-               }
-               (*err_probs)[(*num_err_probs)++] = merged_err_prob;
+     return final_err_prob;
+}
 
-#if 0
-               LOG_FIXME("%s:%d %c bq=%d mq=%d finalq=%d is_alt_base=%d\n", p->target, p->pos+1, nt, bq, mq, PROB_TO_PHREDQUAL_SAFE(merged_err_prob), is_alt_base);
-#endif
+
+/* error probs of reads without insertion. returns their number */
+static int
+ins_nonevent_errprobs(double *err_probs, const plp_col_t *p, const varcall_conf_t *conf)
+{
+     int i;
+     int iq, mq;
+
+     for (i = 0; i < p->ins_quals.n; i++) {
+          iq = mq = -1;
+          iq = p->ins_quals.data[i];
+          if (conf->flag & VARCALL_USE_MQ) {
+               mq = p->ins_map_quals.data[i];
           }
+          err_probs[i] = merge_srcq_mapq_baq_and_bq(-1, mq, -1, iq);
      }
+     return p->ins_quals.n;
 }
 
+
 /* FIXME merge with plp_to_del_errprobs */
 void
 plp_to_ins_errprobs(double **err_probs, int *num_err_probs,
@@ -496,55 +843,131 @@ plp_to_ins_errprobs(double **err_probs, int *num_err_probs,
           return;
      }
 
-     (*num_err_probs) = 0;
-     int i, j;
-     double final_err_prob;
-     int iq, aq, mq, sq;
-     iq = aq = mq = sq = -1;
+     (*num_err_probs) = ins_nonevent_errprobs(*err_probs, p, conf);
+     int j;
 
-     for (i = 0; i < p->ins_quals.n; i++) {
-          iq = mq = -1;
-          iq = p->ins_quals.data[i];
-          if (conf->flag & VARCALL_USE_MQ) {
-               mq = p->ins_map_quals.data[i];
+     ins_event *it, *it_tmp;
+     HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
+          /* don't use idaq if not wanted or if not indel in question (FIXME does the latter amek sense)? */
+          int use_aq = ((conf->flag & VARCALL_USE_IDAQ) && (0 == strcmp(it->key, key)));
+          for (j = 0; j < it->ins_quals.n; j++) {
+               (*err_probs)[(*num_err_probs)++] = ins_read_errprob(it, j, conf, use_aq);
           }
-          final_err_prob = merge_srcq_mapq_baq_and_bq(-1, mq, -1, iq);
-          (*err_probs)[(*num_err_probs)++] = final_err_prob;
      }
+}
 
+
+/**
+ * @brief Same error probs as plp_to_ins_errprobs() for each of the
+ * num_keys events keys, but split for snpcaller_shared() and with
+ * every read only converted once: shared gets those of reads without
+ * insertion, which are the same for all events. ext gets num_keys
+ * vectors of num_ext values each (the one for keys[i] starting at
+ * ext[i*num_ext]), namely those of all reads with insertion, with
+ * alignment quality only used for reads of keys[i]. Caller has to
+ * free shared and ext.
+ */
+void
+plp_to_ins_errprobs_shared(double **shared, int *num_shared,
+                           double **ext, int *num_ext,
+                           const plp_col_t *p, varcall_conf_t *conf,
+                           char **keys, const int num_keys)
+{
      ins_event *it, *it_tmp;
+     int i, j, off;
+
+     *num_ext = 0;
      HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
-          for (j = 0; j < it->ins_quals.n; j++) {
-               iq = aq = mq = sq = -1;
-               iq = it->ins_quals.data[j];
+          *num_ext += it->ins_quals.n;
+     }
+     if (NULL == ((*shared) = malloc((p->ins_quals.n+1) * sizeof(double)))
+         || NULL == ((*ext) = malloc((num_keys * (*num_ext) + 1) * sizeof(double)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
 
-               /* don't use idaq if not wanted or if not indel in question (FIXME does the latter amek sense)? */
-               if ((conf->flag & VARCALL_USE_IDAQ) && (0 == strcmp(it->key, key))) {
-                    aq = it->ins_aln_quals.data[j];
-               }
+     *num_shared = ins_nonevent_errprobs(*shared, p, conf);
 
-               if ((conf->flag & VARCALL_USE_MQ) && it->ins_map_quals.n) {
-                    mq = it->ins_map_quals.data[j];
-                    /*according to spec 255 is unknown */
-                    if (mq == 255) {
-                         mq = -1;
+     off = 0;
+     HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
+          for (j = 0; j < it->ins_quals.n; j++) {
+               (*ext)[off++] = ins_read_errprob(it, j, conf, 0);
+          }
+     }
+     for (i = 1; i < num_keys; i++) {
+          memcpy((*ext) + i * (*num_ext), *ext, (*num_ext) * sizeof(double));
+     }
+     if (! (conf->flag & VARCALL_USE_IDAQ)) {
+          return;
+     }
+     off = 0;
+     HASH_ITER(hh_ins, p->ins_event_counts, it, it_tmp) {
+          for (i = 0; i < num_keys; i++) {
+               if (0 == strcmp(it->key, keys[i])) {
+                    for (j = 0; j < it->ins_quals.n; j++) {
+                         (*ext)[i * (*num_ext) + off + j] = ins_read_errprob(it, j, conf, 1);
                     }
                }
+          }
+          off += it->ins_quals.n;
+     }
+}
+/* plp_to_ins_errprobs_shared() */
 
-               if ((conf->flag & VARCALL_USE_SQ) && it->ins_source_quals.n)  {
-                    sq = it->ins_source_quals.data[j];
-               }
-               
-               final_err_prob = merge_srcq_mapq_baq_and_bq(sq, mq, aq, iq);
+
+/* same as ins_read_errprob() for deletions */
+static double
+del_read_errprob(const del_event *it, const int j, const varcall_conf_t *conf,
+                 const int use_aq)
+{
+     int dq, aq, mq, sq;
+     double final_err_prob;
+
+     dq = aq = mq = sq = -1;
+     dq = it->del_quals.data[j];
+     if (use_aq) {
+          aq = it->del_aln_quals.data[j];
+     }
+     if ((conf->flag & VARCALL_USE_MQ) && it->del_map_quals.n) {
+          mq = it->del_map_quals.data[j];
+          /*according to spec 255 is unknown */
+          if (mq == 255) {
+               mq = -1;
+          }
+     }
+     if ((conf->flag & VARCALL_USE_SQ) && it->del_source_quals.n) {
+          sq = it->del_source_quals.data[j];
+     }
+
+     final_err_prob = merge_srcq_mapq_baq_and_bq(sq, mq, aq, dq);
 #ifdef TRACE
-               LOG_DEBUG("+%s IQ:%d IAQ:%d MQ:%d SQ:%d EP:%lg\n",
-                         it->key, iq, aq, mq, sq, final_err_prob);
+     LOG_DEBUG("+%s DQ:%d DAQ:%d MQ:%d SQ:%d EP:%lg\n",
+               it->key, dq, aq, mq, sq, final_err_prob);
 #endif
-               (*err_probs)[(*num_err_probs)++] = final_err_prob;
+     return final_err_prob;
+}
+
+
+/* same as ins_nonevent_errprobs() for deletions */
+static int
+del_nonevent_errprobs(double *err_probs, const plp_col_t *p, const varcall_conf_t *conf)
+{
+     int i;
+     int dq, mq;
+
+     for (i = 0; i < p->del_quals.n; i++) {
+          dq = mq = -1;
+          dq = p->del_quals.data[i];
+          if (conf->flag & VARCALL_USE_MQ) {
+               mq = p->del_map_quals.data[i];
           }
+          err_probs[i] = merge_srcq_mapq_baq_and_bq(-1, mq, -1, dq);
      }
+     return p->del_quals.n;
 }
 
+
 /* FIXME merge with plp_to_ins_errprobs */
 void
 plp_to_del_errprobs(double **err_probs, int *num_err_probs,
@@ -558,54 +981,68 @@ plp_to_del_errprobs(double **err_probs, int *num_err_probs,
           return;
      }
 
-     (*num_err_probs) = 0;
-     int i, j;
-     double final_err_prob;
-     int dq, aq, mq, sq;
-     dq = aq = mq = sq = -1;
+     (*num_err_probs) = del_nonevent_errprobs(*err_probs, p, conf);
+     int j;
 
-     for (i = 0; i < p->del_quals.n; i++) {
-          dq = mq = -1;
-          dq = p->del_quals.data[i];
-          if (conf->flag & VARCALL_USE_MQ) {
-               mq = p->del_map_quals.data[i];
+     del_event *it, *it_tmp;
+     HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
+          /* don't use idaq if not wanted or if not indel in question (FIXME does the latter amek sense)? */
+          int use_aq = ((conf->flag & VARCALL_USE_IDAQ) && (0 == strcmp(it->key, key)));
+          for (j = 0; j < it->del_quals.n; j++) {
+               (*err_probs)[(*num_err_probs)++] = del_read_errprob(it, j, conf, use_aq);
           }
-          final_err_prob = merge_srcq_mapq_baq_and_bq(-1, mq, -1, dq);
-          (*err_probs)[(*num_err_probs)++] = final_err_prob;
      }
+}
 
+
+/* same as plp_to_ins_errprobs_shared() for deletions */
+void
+plp_to_del_errprobs_shared(double **shared, int *num_shared,
+                           double **ext, int *num_ext,
+                           const plp_col_t *p, varcall_conf_t *conf,
+                           char **keys, const int num_keys)
+{
      del_event *it, *it_tmp;
+     int i, j, off;
+
+     *num_ext = 0;
      HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
-          for (j = 0; j < it->del_quals.n; j++) {
-               dq = aq = mq = sq = -1;
-               dq = it->del_quals.data[j];
+          *num_ext += it->del_quals.n;
+     }
+     if (NULL == ((*shared) = malloc((p->del_quals.n+1) * sizeof(double)))
+         || NULL == ((*ext) = malloc((num_keys * (*num_ext) + 1) * sizeof(double)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
 
-               /* don't use idaq if not wanted or if not indel in question (FIXME does the latter amek sense)? */
-               if ((conf->flag & VARCALL_USE_IDAQ) && (0 == strcmp(it->key, key))) {
-                    aq = it->del_aln_quals.data[j];
-               }
+     *num_shared = del_nonevent_errprobs(*shared, p, conf);
 
-               if ((conf->flag & VARCALL_USE_MQ) && it->del_map_quals.n) {
-                    mq = it->del_map_quals.data[j];
-                    /*according to spec 255 is unknown */
-                    if (mq == 255) {
-                         mq = -1;
+     off = 0;
+     HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
+          for (j = 0; j < it->del_quals.n; j++) {
+               (*ext)[off++] = del_read_errprob(it, j, conf, 0);
+          }
+     }
+     for (i = 1; i < num_keys; i++) {
+          memcpy((*ext) + i * (*num_ext), *ext, (*num_ext) * sizeof(double));
+     }
+     if (! (conf->flag & VARCALL_USE_IDAQ)) {
+          return;
+     }
+     off = 0;
+     HASH_ITER(hh_del, p->del_event_counts, it, it_tmp) {
+          for (i = 0; i < num_keys; i++) {
+               if (0 == strcmp(it->key, keys[i])) {
+                    for (j = 0; j < it->del_quals.n; j++) {
+                         (*ext)[i * (*num_ext) + off + j] = del_read_errprob(it, j, conf, 1);
                     }
                }
-
-               if ((conf->flag & VARCALL_USE_SQ) && it->del_source_quals.n) {
-                         sq = it->del_source_quals.data[j];
-               }
-
-               final_err_prob = merge_srcq_mapq_baq_and_bq(sq, mq, aq, dq);
-#ifdef TRACE
-               LOG_DEBUG("+%s DQ:%d DAQ:%d MQ:%d SQ:%d EP:%lg\n",
-                         it->key, dq, aq, mq, sq, final_err_prob);
-#endif
-               (*err_probs)[(*num_err_probs)++] = final_err_prob;
           }
+          off += it->del_quals.n;
      }
 }
+/* plp_to_del_errprobs_shared() */
 
 /* initialize members of preallocated varcall_conf */
 void
@@ -620,6 +1057,11 @@ init_varcall_conf(varcall_conf_t *c)
      c->min_jq = DEFAULT_MIN_JQ;
      c->min_alt_jq = DEFAULT_MIN_ALT_JQ;
      c->def_alt_jq = DEFAULT_DEF_ALT_JQ;
+     /* force computation on first use */
+     c->jq_thresh_q[0] = c->jq_thresh_q[1] = -1;
+     c->jq_thresh_prob[0] = c->jq_thresh_prob[1] = DBL_MAX;
+     /* before any threads get started */
+     qual2prob_init();
 
      c->min_cov = DEFAULT_MIN_COV;
      c->bonf_dynamic = 1;
@@ -936,6 +1378,7 @@ pruned_calc_prob_dist(const double *err_probs, int N, int K,
                   fprintf(stderr, "DEBUG(%s:%s:%d): early exit at n=%d K=%d with pvalue %Lg\n",
                           __FILE__, __FUNCTION__, __LINE__, n, K, pvalue);
 #endif
+                  prof_dp(N, K, n);
                   free(probvec_prev);
                   return probvec;
              }
@@ -950,26 +1393,523 @@ pruned_calc_prob_dist(const double *err_probs, int N, int K,
     }
 
     /* return prev because we just swapped (if not pruned) */
+    prof_dp(N, K, N);
     free(probvec);
     return probvec_prev;
 }
 /* pruned_calc_prob_dist */
 
 
-#ifdef PSEUDO_BINOMIAL
-/* binomial test using poissbin. only good for high n and small prob.
- * returns -1 on error */
-int
-pseudo_binomial(long double *pvalue,
-                int num_success, int num_trials, double succ_prob)
-{
-     const long long int bonf = 1.0;
-     const double sig = 1.0;
-     double *probvec = NULL;
-     double *probs;
-     int i;
+/* Poisson-binomial kernel in scaled linear space. Same recursion as
+ * in pruned_calc_prob_dist() but without a log_sum() per cell and
+ * without the per-read expl() and fenv calls for pruning. Values are
+ * kept relative to a common scale (log_scale) and renormalized every
+ * PB_RENORM_INTERVAL reads, which is also when we check for pruning.
+ *
+ * Flushing tiny values to zero during renormalization introduces an
+ * absolute error of at most N/PB_RENORM_INTERVAL*(K+1)*PB_FLUSH_TO_ZERO,
+ * which doesn't matter unless the final pvalue is tiny itself. Then we
+ * recompute with the log space kernel (see PB_LINEAR_MIN_LOG_PVALUE).
+ *
+ * Interval is chosen such that values can't over- or underflow
+ * in-between renormalizations: each step shrinks a value by at most
+ * DBL_EPSILON (pn is clipped as in the log kernel) and grows the max
+ * by at most 2
+ */
+#define PB_RENORM_INTERVAL 8
+#define PB_FLUSH_TO_ZERO 1e-280
+#define PB_LINEAR_MIN_LOG_PVALUE -500.0 /* approx 1e-217 */
 
-     fprintf(stderr, "WARNING(%s): this function only approximates the binomial for high n and small p\n", __FUNCTION__);
+int pb_kernel = PB_KERNEL_LOG;
+
+
+/* cur[k] = prev[k]*q + prev[k-1]*p for k=1..m */
+static inline void
+pb_linear_step(double * restrict cur, const double * restrict prev,
+               const int m, const double p, const double q)
+{
+     int k = 1;
+#if defined(__AVX__)
+     const __m256d vp = _mm256_set1_pd(p);
+     const __m256d vq = _mm256_set1_pd(q);
+     for (; k+4<=m+1; k+=4) {
+          __m256d a = _mm256_mul_pd(_mm256_loadu_pd(prev+k), vq);
+          __m256d b = _mm256_mul_pd(_mm256_loadu_pd(prev+k-1), vp);
+          _mm256_storeu_pd(cur+k, _mm256_add_pd(a, b));
+     }
+#elif defined(__SSE2__)
+     const __m128d vp = _mm_set1_pd(p);
+     const __m128d vq = _mm_set1_pd(q);
+     for (; k+2<=m+1; k+=2) {
+          __m128d a = _mm_mul_pd(_mm_loadu_pd(prev+k), vq);
+          __m128d b = _mm_mul_pd(_mm_loadu_pd(prev+k-1), vp);
+          _mm_storeu_pd(cur+k, _mm_add_pd(a, b));
+     }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+     const float64x2_t vp = vdupq_n_f64(p);
+     const float64x2_t vq = vdupq_n_f64(q);
+     for (; k+2<=m+1; k+=2) {
+          float64x2_t a = vmulq_f64(vld1q_f64(prev+k), vq);
+          float64x2_t b = vmulq_f64(vld1q_f64(prev+k-1), vp);
+          vst1q_f64(cur+k, vaddq_f64(a, b));
+     }
+#endif
+     for (; k<=m; k++) {
+          cur[k] = prev[k]*q + prev[k-1]*p;
+     }
+}
+/* pb_linear_step() */
+
+
+/* divides values 0..m by their max and adds log of max to
+ * log_scale. flushes tiny values to zero */
+static inline void
+pb_linear_renorm(double *v, const int m, double *log_scale)
+{
+     double max = 0.0;
+     double inv;
+     int k;
+
+     for (k=0; k<=m; k++) {
+          if (v[k] > max) {
+               max = v[k];
+          }
+     }
+     assert(max > 0.0);
+     inv = 1.0/max;
+     for (k=0; k<=m; k++) {
+          v[k] *= inv;
+          if (v[k] < PB_FLUSH_TO_ZERO) {
+               v[k] = 0.0;
+          }
+     }
+     *log_scale += log(max);
+}
+/* pb_linear_renorm() */
+
+
+/* converts first K+1 values of v to log space, i.e. into what
+ * pruned_calc_prob_dist() would return */
+static void
+pb_linear_to_log(double *v, const int K, const double log_scale)
+{
+     int k;
+     for (k=0; k<=K; k++) {
+          if (v[k] > 0.0) {
+               v[k] = log(v[k]) + log_scale;
+          } else {
+               v[k] = LOGZERO;
+          }
+     }
+}
+/* pb_linear_to_log() */
+
+
+/**
+ * Drop-in replacement for pruned_calc_prob_dist(), i.e. returns a
+ * probvec in log space. Falls back to the latter if the pvalue is too
+ * small to be computed accurately here.
+ */
+double *
+linear_calc_prob_dist(const double *err_probs, int N, int K,
+                      long long int bonf_factor, double sig_level)
+{
+    double *probvec = NULL;
+    double *probvec_prev = NULL;
+    double *probvec_swp = NULL;
+    double log_scale = 0.0;
+    double log_sig = log(sig_level) - log((double)bonf_factor);
+    int n;
+
+    if (NULL == (probvec = calloc(K+1, sizeof(double)))) {
+        fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                __FILE__, __FUNCTION__, __LINE__);
+        return NULL;
+    }
+    if (NULL == (probvec_prev = calloc(K+1, sizeof(double)))) {
+        fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                __FILE__, __FUNCTION__, __LINE__);
+        free(probvec);
+        return NULL;
+    }
+
+    /* init */
+    probvec_prev[0] = 1.0;
+
+    for (n=1; n<=N; n++) {
+        double pn = err_probs[n-1];
+        double qn;
+
+        assert(pn + DBL_EPSILON >= 0.0 && pn - DBL_EPSILON <= 1.0);
+        /* same clipping as in log space kernel */
+        if (pn < DBL_EPSILON) {
+             pn = DBL_EPSILON;
+        }
+        qn = 1.0 - pn;
+        if (qn < DBL_EPSILON) {
+             qn = DBL_EPSILON;
+        }
+
+        pb_linear_step(probvec, probvec_prev, MIN(n, K-1), pn, qn);
+        probvec[0] = probvec_prev[0] * qn;
+        if (n >= K) {
+             /* prev[K] is zero for n==K */
+             probvec[K] = probvec_prev[K] + probvec_prev[K-1] * pn;
+        }
+
+        if (0 == n % PB_RENORM_INTERVAL) {
+             pb_linear_renorm(probvec, MIN(n, K), &log_scale);
+             if (n > K && probvec[K] > 0.0
+                 && log(probvec[K]) + log_scale > log_sig) {
+#ifdef DEBUG
+                  fprintf(stderr, "DEBUG(%s:%s:%d): early exit at n=%d K=%d\n",
+                          __FILE__, __FUNCTION__, __LINE__, n, K);
+#endif
+                  prof_dp(N, K, n);
+                  free(probvec_prev);
+                  pb_linear_to_log(probvec, K, log_scale);
+                  return probvec;
+             }
+        }
+
+        /* swap */
+        probvec_swp = probvec;
+        probvec = probvec_prev;
+        probvec_prev = probvec_swp;
+    }
+    free(probvec);
+
+    /* probvec_prev is the result because we just swapped */
+    pb_linear_renorm(probvec_prev, MIN(N, K), &log_scale);
+    if (! (probvec_prev[K] > 0.0)
+        || log(probvec_prev[K]) + log_scale < PB_LINEAR_MIN_LOG_PVALUE) {
+         free(probvec_prev);
+         return pruned_calc_prob_dist(err_probs, N, K, bonf_factor, sig_level);
+    }
+    prof_dp(N, K, N);
+    pb_linear_to_log(probvec_prev, K, log_scale);
+    return probvec_prev;
+}
+/* linear_calc_prob_dist */
+
+
+/* log of pmf values of Bin(m,p) below this are considered negligible
+ * relative to the mode or pmf(K) whichever is smaller (approx 1e-20) */
+#define HIST_PMF_LOG_CUTOFF -46.0
+
+static int
+errprob_bin_cmp(const void *a, const void *b)
+{
+     const double pa = ((const errprob_bin_t *)a)->prob;
+     const double pb = ((const errprob_bin_t *)b)->prob;
+     return (pa > pb) - (pa < pb);
+}
+
+
+/* hash double by its bit representation. merged error probs are
+ * computed from a few integers, so identical values have identical
+ * bits */
+static inline unsigned int
+dbl_hash(const double d, const int shift)
+{
+     unsigned long long int u;
+     memcpy(&u, &d, sizeof(u));
+     return (unsigned int)((u * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+
+/**
+ * @brief Builds histogram of distinct error probabilities and
+ * their multiplicity (bins sorted in ascending order of prob).
+ * Uses open addressing instead of sorting all values.
+ *
+ * Returns non-zero on error. Free with errprob_hist_free()
+ */
+int
+errprob_hist_build(errprob_hist_t *h, const double *err_probs, const int num_err_probs)
+{
+     int *table = NULL; /* indices into h->bins; -1 = empty */
+     int table_bits = 6;
+     int i;
+
+     memset(h, 0, sizeof(errprob_hist_t));
+     if (NULL == (h->bins = malloc(MAX(num_err_probs, 1) * sizeof(errprob_bin_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return -1;
+     }
+     while ((1<<table_bits) < 2*MIN(num_err_probs, 1024)) {
+          table_bits++;
+     }
+     if (NULL == (table = malloc((1<<table_bits) * sizeof(int)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          free(h->bins);
+          return -1;
+     }
+     memset(table, -1, (1<<table_bits) * sizeof(int));
+
+     for (i=0; i<num_err_probs; i++) {
+          const double p = err_probs[i];
+          unsigned int mask = (1<<table_bits) - 1;
+          unsigned int slot = dbl_hash(p, 64-table_bits);
+
+          while (-1 != table[slot] && h->bins[table[slot]].prob != p) {
+               slot = (slot+1) & mask;
+          }
+          if (-1 != table[slot]) {
+               h->bins[table[slot]].count += 1;
+               continue;
+          }
+
+          table[slot] = h->num_bins;
+          h->bins[h->num_bins].prob = p;
+          h->bins[h->num_bins].count = 1;
+          h->num_bins += 1;
+
+          /* keep load below 0.5 */
+          if (2*h->num_bins >= (1<<table_bits)) {
+               int j;
+               free(table);
+               table_bits += 1;
+               mask = (1<<table_bits) - 1;
+               if (NULL == (table = malloc((1<<table_bits) * sizeof(int)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    free(h->bins);
+                    return -1;
+               }
+               memset(table, -1, (1<<table_bits) * sizeof(int));
+               for (j=0; j<h->num_bins; j++) {
+                    slot = dbl_hash(h->bins[j].prob, 64-table_bits);
+                    while (-1 != table[slot]) {
+                         slot = (slot+1) & mask;
+                    }
+                    table[slot] = j;
+               }
+          }
+     }
+     free(table);
+     h->num_err_probs = num_err_probs;
+
+     /* sorting in ascending order as in call_snvs() for numerical
+      * stability. cheap since there are only few distinct values */
+     qsort(h->bins, h->num_bins, sizeof(errprob_bin_t), errprob_bin_cmp);
+     return 0;
+}
+/* errprob_hist_build() */
+
+
+void
+errprob_hist_free(errprob_hist_t *h)
+{
+     free(h->bins);
+     h->bins = NULL;
+     h->num_bins = 0;
+     h->num_err_probs = 0;
+}
+/* errprob_hist_free() */
+
+
+/**
+ * @brief Rough cost estimate (number of log-space cell updates) of
+ * hist_calc_prob_dist() relative to pruned_calc_prob_dist()
+ *
+ * Returns 1 if histogram based computation is expected to be
+ * cheaper.
+ */
+int
+errprob_hist_is_cheaper(const errprob_hist_t *h, const int K)
+{
+     long long int cost_hist = 0;
+     long long int cost_plain = (long long int)h->num_err_probs * (K+1);
+     int b;
+     for (b=0; b<h->num_bins; b++) {
+          const long long int m = h->bins[b].count;
+          /* convolution plus pmf/tail computation */
+          cost_hist += MIN(m, K+1) * (K+1) + MIN(m, 2*(K+1));
+     }
+     return cost_hist < cost_plain;
+}
+/* errprob_hist_is_cheaper() */
+
+
+/**
+ * @brief Same as pruned_calc_prob_dist() but works on a histogram of
+ * error probabilities. Each distinct value with multiplicity m is
+ * applied once by convolution with Bin(m,p) instead of m times.
+ *
+ * As in pruned_calc_prob_dist() probvec[K] is the tail, i.e. P(X>=K)
+ * and the result is in log space.
+ */
+double *
+hist_calc_prob_dist(const errprob_hist_t *h, int K,
+                    long long int bonf_factor, double sig_level)
+{
+    double *probvec = NULL;
+    double *probvec_prev = NULL;
+    double *probvec_swp = NULL;
+    double *log_pmf = NULL; /* log of Bin(m,p) pmf for j=0..U */
+    int log_pmf_size = 0;
+    double *log_tail = NULL; /* log P(Bin(m,p) >= t) for t=1..K */
+    double log_sig = log(sig_level) - log((double)bonf_factor);
+    int n = 0; /* number of trials processed so far */
+    int b, k;
+
+    if (NULL == (probvec = malloc((K+1) * sizeof(double)))
+        || NULL == (probvec_prev = malloc((K+1) * sizeof(double)))
+        || NULL == (log_tail = malloc((K+1) * sizeof(double)))) {
+        fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                __FILE__, __FUNCTION__, __LINE__);
+        free(probvec); free(probvec_prev);
+        return NULL;
+    }
+
+    /* init */
+    probvec_prev[0] = 0.0; /* log(1.0) */
+    for (k=1; k<=K; k++) {
+         probvec_prev[k] = LOGZERO;
+    }
+
+    for (b=0; b<h->num_bins; b++) {
+        const int m = h->bins[b].count;
+        double pn = h->bins[b].prob;
+        double log_pn, log_1_pn;
+        double log_pmf_mode;
+        int mode, U; /* pmf is negligible above U */
+        int j, t;
+
+        assert(pn + DBL_EPSILON >= 0.0 && pn - DBL_EPSILON <= 1.0);
+        /* same clipping as in pruned_calc_prob_dist() */
+        if (fabs(pn) < DBL_EPSILON) {
+             log_pn = log(DBL_EPSILON);
+        } else {
+             log_pn = log(pn);
+        }
+        if (fabs(pn-1.0) < DBL_EPSILON) {
+             log_1_pn = log1p(-pn+DBL_EPSILON);
+        } else {
+             log_1_pn = log1p(-pn);
+        }
+
+        /* pmf via recursion pmf(j+1) = pmf(j) * (m-j)/(j+1) * p/(1-p)
+         * until it's negligible past the mode and past K */
+        mode = (int)((m+1) * exp(log_pn));
+        if (mode > m) {
+             mode = m;
+        }
+        if (log_pmf_size < MIN(m, 2*(K+1))+1) {
+             log_pmf_size = MIN(m, 2*(K+1))+1;
+             free(log_pmf);
+             if (NULL == (log_pmf = malloc(log_pmf_size * sizeof(double)))) {
+                  fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                          __FILE__, __FUNCTION__, __LINE__);
+                  free(probvec); free(probvec_prev); free(log_tail);
+                  return NULL;
+             }
+        }
+        log_pmf[0] = m * log_1_pn;
+        log_pmf_mode = log_pmf[0];
+        for (j=0; j<m; j++) {
+             const double next = log_pmf[j] + log((double)(m-j)/(j+1)) + log_pn - log_1_pn;
+             /* past the mode and past K. tail relative to pmf(K) matters */
+             if (j+1 > K && j+1 > mode
+                 && next < MIN(log_pmf_mode, log_pmf[K]) + HIST_PMF_LOG_CUTOFF) {
+                  break;
+             }
+             if (j+1 >= log_pmf_size) {
+                  double *tmp;
+                  log_pmf_size *= 2;
+                  if (NULL == (tmp = realloc(log_pmf, log_pmf_size * sizeof(double)))) {
+                       fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                               __FILE__, __FUNCTION__, __LINE__);
+                       free(log_pmf); free(probvec); free(probvec_prev); free(log_tail);
+                       return NULL;
+                  }
+                  log_pmf = tmp;
+             }
+             log_pmf[j+1] = next;
+             if (next > log_pmf_mode) {
+                  log_pmf_mode = next;
+             }
+        }
+        U = j;
+
+        /* tails by summing from above */
+        for (t=1; t<=K; t++) {
+             log_tail[t] = LOGZERO;
+        }
+        if (U >= 1) {
+             double acc = log_pmf[U];
+             if (U <= K) {
+                  log_tail[U] = acc;
+             }
+             for (j=U-1; j>=1; j--) {
+                  acc = log_sum(acc, log_pmf[j]);
+                  if (j <= K) {
+                       log_tail[j] = acc;
+                  }
+             }
+        }
+
+        /* convolution. entries above n are LOGZERO and skipped */
+        for (k=MIN(n+m, K-1); k>=0; k--) {
+             const int jmin = MAX(0, k-MIN(n, K-1));
+             const int jmax = MIN(k, U);
+             double acc = probvec_prev[k-jmin] + log_pmf[jmin];
+             for (j=jmin+1; j<=jmax; j++) {
+                  acc = log_sum(acc, probvec_prev[k-j] + log_pmf[j]);
+             }
+             probvec[k] = acc;
+        }
+        for (k=MIN(n+m, K-1)+1; k<K; k++) {
+             probvec[k] = LOGZERO;
+        }
+        /* tail: once at K we stay there */
+        probvec[K] = probvec_prev[K];
+        for (k=MAX(0, K-U); k<=MIN(n, K-1); k++) {
+             probvec[K] = log_sum(probvec[K], probvec_prev[k] + log_tail[K-k]);
+        }
+        n += m;
+
+        if (n > K && probvec[K] > log_sig) {
+#ifdef DEBUG
+             fprintf(stderr, "DEBUG(%s:%s:%d): early exit at n=%d K=%d\n",
+                     __FILE__, __FUNCTION__, __LINE__, n, K);
+#endif
+             prof_dp(h->num_err_probs, K, n);
+             free(log_pmf); free(log_tail); free(probvec_prev);
+             return probvec;
+        }
+
+        /* swap */
+        probvec_swp = probvec;
+        probvec = probvec_prev;
+        probvec_prev = probvec_swp;
+    }
+
+    prof_dp(h->num_err_probs, K, h->num_err_probs);
+    free(log_pmf); free(log_tail); free(probvec);
+    return probvec_prev;
+}
+/* hist_calc_prob_dist() */
+
+
+
+#ifdef PSEUDO_BINOMIAL
+/* binomial test using poissbin. only good for high n and small prob.
+ * returns -1 on error */
+int
+pseudo_binomial(long double *pvalue,
+                int num_success, int num_trials, double succ_prob)
+{
+     const long long int bonf = 1.0;
+     const double sig = 1.0;
+     double *probvec = NULL;
+     double *probs;
+     int i;
+
+     fprintf(stderr, "WARNING(%s): this function only approximates the binomial for high n and small p\n", __FUNCTION__);
      if (NULL == (probs = malloc((num_trials) * sizeof(double)))) {
           fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
                   __FILE__, __FUNCTION__, __LINE__);
@@ -992,6 +1932,112 @@ pseudo_binomial(long double *pvalue,
 
 
 
+/* cheap screening test run before the exact Poisson-binomial. X, the
+ * number of errors, is Poisson-binomial with mean mu = sum(p_i). the
+ * Poisson distribution Y with the same mean approximates it with a
+ * total variation distance of at most (1-exp(-mu))/mu * sum(p_i^2)
+ * (Barbour & Hall, 1984). P(Y>=K) minus this distance is therefore a
+ * lower bound for the pvalue P(X>=K). if the lower bound is already
+ * above sig/bonf, the pvalue can't be significant and the O(N*K)
+ * computation can be skipped. the bound is only useful if error
+ * probabilities are small, which is the common case of high coverage
+ * and good qualities. returns 1 if the pvalue is certainly not
+ * significant, 0 otherwise (i.e. the exact computation is needed).
+ */
+#define PB_SCREEN_SLACK 1e-10 /* safety margin for numerical errors */
+static int
+pb_screen_nonsig(const double mu, const double sum_sq, const int K,
+                 const long long int bonf, const double sig)
+{
+     double log_mu, log_term, log_cdf;
+     double tail_lower;
+     int j;
+
+     if (K < 1) {
+          return 1;
+     }
+     if (mu < DBL_EPSILON) {
+          return 0;
+     }
+     /* Poisson cdf P(Y<K) in log space, since exp(-mu) underflows
+      * at high coverage */
+     log_mu = log(mu);
+     log_term = log_cdf = -mu;
+     for (j=1; j<K; j++) {
+          log_term += log_mu - log(j);
+          log_cdf = log_sum(log_cdf, log_term);
+     }
+     if (log_cdf > 0.0) {
+          log_cdf = 0.0;
+     }
+     tail_lower = -expm1(log_cdf) - (-expm1(-mu))/mu * sum_sq - PB_SCREEN_SLACK;
+
+     return tail_lower * (double)bonf > sig;
+}
+/* pb_screen_nonsig() */
+
+
+/* pb_screen_nonsig() for err_probs. O(N+K) */
+int
+errprobs_screen_nonsig(const double *err_probs, const int num_err_probs,
+                       const int K, const long long int bonf, const double sig)
+{
+     double mu = 0.0, sum_sq = 0.0;
+     int i;
+
+     for (i=0; i<num_err_probs; i++) {
+          mu += err_probs[i];
+          sum_sq += err_probs[i] * err_probs[i];
+     }
+     return pb_screen_nonsig(mu, sum_sq, K, bonf, sig);
+}
+/* errprobs_screen_nonsig() */
+
+
+/* pb_screen_nonsig() for histogram of error probs */
+int
+errprob_hist_screen_nonsig(const errprob_hist_t *hist,
+                           const int K, const long long int bonf, const double sig)
+{
+     double mu = 0.0, sum_sq = 0.0;
+     int i;
+
+     for (i=0; i<hist->num_bins; i++) {
+          const double p = hist->bins[i].prob;
+          mu += hist->bins[i].count * p;
+          sum_sq += hist->bins[i].count * p * p;
+     }
+     return pb_screen_nonsig(mu, sum_sq, K, bonf, sig);
+}
+/* errprob_hist_screen_nonsig() */
+
+
+
+/* pvalue for K failures from (log space) probvec. no need for
+ * tailsum here since probvec[K] is the tail already */
+static long double
+probvec_pvalue(const double *probvec, const int K)
+{
+    long double pvalue;
+    int errsv;
+
+    errno = 0;
+    feclearexcept(FE_ALL_EXCEPT);
+
+    pvalue = expl(probvec[K]);
+
+    errsv = errno;
+    if (errsv || fetestexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW)) {
+         if (pvalue < DBL_EPSILON) {
+              pvalue = LDBL_MIN;/* to zero but prevent actual 0 value */
+         } else {
+              pvalue = LDBL_MAX; /* otherwise set to 1 which might pass filters */
+         }
+    }
+    return pvalue;
+}
+
+
 /* main logic. return of probvec (needs to be freed by caller allows
  * to check pvalues for other numbers < (original num_failures), like
  * so: exp(probvec_tailsum(probvec, smaller_numl, orig_num+1)) but
@@ -1006,7 +2052,6 @@ poissbin(long double *pvalue, const double *err_probs,
          const long long int bonf, const double sig)
 {
     double *probvec = NULL;
-    int errsv;
 #if TIMING
     clock_t start = clock();
     int msec;
@@ -1020,46 +2065,60 @@ poissbin(long double *pvalue, const double *err_probs,
     probvec = naive_prob_dist(err_probs, num_err_probs,
                                     num_failures);
 #else
-    probvec = pruned_calc_prob_dist(err_probs, num_err_probs,
-                                    num_failures, bonf, sig);
+    PROF_START(t_dp);
+    if (PB_KERNEL_LINEAR == pb_kernel) {
+         probvec = linear_calc_prob_dist(err_probs, num_err_probs,
+                                         num_failures, bonf, sig);
+    } else {
+         probvec = pruned_calc_prob_dist(err_probs, num_err_probs,
+                                         num_failures, bonf, sig);
+    }
+    PROF_STOP(PROF_DP, t_dp);
 #endif
 #if TIMING
     msec = (clock() - start) * 1000 / CLOCKS_PER_SEC;
     fprintf(stderr, "calc_prob_dist() took %d s %d ms\n", msec/1000, msec%1000);
 #endif
 
-    errno = 0;
-    feclearexcept(FE_ALL_EXCEPT);
+    *pvalue = probvec_pvalue(probvec, num_failures);
 
-    *pvalue = expl(probvec[num_failures]); /* no need for tailsum here */
+    return probvec;
+}
 
-    errsv = errno;
-    if (errsv || fetestexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW)) {
-         if (*pvalue < DBL_EPSILON) {
-              *pvalue = LDBL_MIN;/* to zero but prevent actual 0 value */
-         } else {
-              *pvalue = LDBL_MAX; /* otherwise set to 1 which might pass filters */
-         }
+
+
+/* same as poissbin() but using a histogram of error probs. see
+ * hist_calc_prob_dist() */
+double *
+poissbin_hist(long double *pvalue, const errprob_hist_t *hist,
+              const int num_failures,
+              const long long int bonf, const double sig)
+{
+    double *probvec = NULL;
+
+    *pvalue = LDBL_MAX;
+    PROF_START(t_dp);
+    probvec = hist_calc_prob_dist(hist, num_failures, bonf, sig);
+    PROF_STOP(PROF_DP, t_dp);
+    if (NULL == probvec) {
+         return NULL;
     }
+    *pvalue = probvec_pvalue(probvec, num_failures);
 
     return probvec;
 }
 
 
 
-/**
- * @brief
- *
- * pvalues computed for each of the NUM_NONCONS_BASES noncons_counts
- * will be written to snp_pvalues in the same order. If pvalue was not
- * computed (always insignificant) its value will be set to LDBL_MAX
- *
+/* does the work for snpcaller() and snpcaller_hist(). either
+ * err_probs or hist is used
  */
-int
-snpcaller(long double *snp_pvalues,
-          const double *err_probs, const int num_err_probs,
-          const int *noncons_counts,
-          const long long int bonf_factor, const double sig_level)
+static int
+snpcaller_core(long double *snp_pvalues,
+               const double *err_probs, const int num_err_probs,
+               const errprob_hist_t *hist,
+               const int *noncons_counts,
+               const long long int bonf_factor, const double sig_level)
 {
     double *probvec = NULL;
     int i;
@@ -1097,8 +2156,26 @@ snpcaller(long double *snp_pvalues,
         goto free_and_exit;
     }
 
-    probvec = poissbin(&pvalue, err_probs, num_err_probs,
-                       max_noncons_count, bonf_factor, sig_level);
+    /* the most frequent candidate has the smallest pvalue. if that
+     * can't be significant, neither can the others */
+    if (hist) {
+         if (errprob_hist_screen_nonsig(hist, max_noncons_count, bonf_factor, sig_level)) {
+              goto free_and_exit;
+         }
+    } else if (errprobs_screen_nonsig(err_probs, num_err_probs, max_noncons_count, bonf_factor, sig_level)) {
+         goto free_and_exit;
+    }
+
+    if (hist) {
+         probvec = poissbin_hist(&pvalue, hist,
+                                 max_noncons_count, bonf_factor, sig_level);
+    } else {
+         probvec = poissbin(&pvalue, err_probs, num_err_probs,
+                            max_noncons_count, bonf_factor, sig_level);
+    }
+    if (NULL == probvec) {
+         return -1;
+    }
 
 #if 0
     for (i=1; i<max_noncons_count+1; i++) {
@@ -1159,9 +2236,277 @@ snpcaller(long double *snp_pvalues,
 
     return 0;
 }
+/* snpcaller_core() */
+
+
+/**
+ * @brief
+ *
+ * pvalues computed for each of the NUM_NONCONS_BASES noncons_counts
+ * will be written to snp_pvalues in the same order. If pvalue was not
+ * computed (always insignificant) its value will be set to LDBL_MAX
+ *
+ */
+int
+snpcaller(long double *snp_pvalues,
+          const double *err_probs, const int num_err_probs,
+          const int *noncons_counts,
+          const long long int bonf_factor, const double sig_level)
+{
+     return snpcaller_core(snp_pvalues, err_probs, num_err_probs, NULL,
+                           noncons_counts, bonf_factor, sig_level);
+}
 /* snpcaller() */
 
 
+/**
+ * @brief Same as snpcaller() but using a histogram of error
+ * probabilities (see errprob_hist_build())
+ */
+int
+snpcaller_hist(long double *snp_pvalues,
+               const errprob_hist_t *hist,
+               const int *noncons_counts,
+               const long long int bonf_factor, const double sig_level)
+{
+     return snpcaller_core(snp_pvalues, NULL, hist->num_err_probs, hist,
+                           noncons_counts, bonf_factor, sig_level);
+}
+/* snpcaller_hist() */
+
+
+/* pvalue P(X>=k) from a (log space) probvec of length K+1 whose last
+ * element is the tail P(X>=K) */
+static long double
+probvec_tail_pvalue(const double *probvec, const int k, const int K)
+{
+     long double pvalue;
+     int errsv;
+
+     errno = 0;
+     feclearexcept(FE_ALL_EXCEPT);
+
+     pvalue = expl(probvec_tailsum(probvec, k, K+1));
+
+     errsv = errno;
+     if (errsv || fetestexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW)) {
+          if (pvalue < DBL_EPSILON) {
+               pvalue = LDBL_MIN;/* to zero but prevent actual 0 value */
+          } else {
+               pvalue = LDBL_MAX; /* otherwise set to 1 which might pass filters */
+          }
+     }
+     return pvalue;
+}
+/* probvec_tail_pvalue() */
+
+
+/* continues the log space recursion of pruned_calc_prob_dist() for
+ * another N err_probs. probvec and work are of length K+1, with
+ * probvec[K] being the tail P(X>=K). entries not reached yet have to
+ * be LOGZERO. result ends up in *probvec (pointers get swapped). the
+ * tail can only grow, so this stops early (and returns 1) as soon as
+ * it can't be significant anymore. returns 0 otherwise */
+static int
+pb_log_extend(double **probvec, double **work,
+              const double *err_probs, const int N, const int K,
+              const long long int bonf_factor, const double sig_level)
+{
+     int n, k;
+
+     for (n=0; n<N; n++) {
+          double *prev = *probvec;
+          double *cur = *work;
+          double pn = err_probs[n];
+          double log_pn, log_1_pn;
+
+          /* same clipping as in pruned_calc_prob_dist() */
+          if (fabs(pn) < DBL_EPSILON) {
+               log_pn = log(DBL_EPSILON);
+          } else {
+               log_pn = log(pn);
+          }
+          if (fabs(pn-1.0) < DBL_EPSILON) {
+               log_1_pn = log1p(-pn+DBL_EPSILON);
+          } else {
+               log_1_pn = log1p(-pn);
+          }
+
+          cur[K] = log_sum(prev[K], prev[K-1] + log_pn);
+          for (k=K-1; k>=1; k--) {
+               cur[k] = log_sum(prev[k] + log_1_pn, prev[k-1] + log_pn);
+          }
+          cur[0] = prev[0] + log_1_pn;
+
+          *work = prev;
+          *probvec = cur;
+
+          if (exp(cur[K]) * (double)bonf_factor > sig_level) {
+               prof_dp(N, K, n+1);
+               return 1;
+          }
+     }
+     prof_dp(N, K, N);
+     return 0;
+}
+/* pb_log_extend() */
+
+
+/**
+ * @brief Computes pvalues for num_counts events observed at the same
+ * column with one Poisson-binomial, i.e. one DP up to the largest
+ * count and tail sums for the others (as snpcaller() does for SNVs).
+ *
+ * If ext_err_probs is NULL, err_probs are the error probs for all
+ * events. Otherwise err_probs are only the part shared by all events
+ * and ext_err_probs[i] (num_ext_err_probs[i] values) the remainder for
+ * event i. The DP over the shared part is then done once (in log
+ * space) and only extended per event. This is what's needed for
+ * indels with IDAQ, where the alignment quality only applies to reads
+ * of the event in question. Events that can't be significant
+ * according to errprobs_screen_nonsig() are skipped, and all DPs stop
+ * as soon as their tail gets too big.
+ *
+ * pvalues disagree with one snpcaller() call per event only within
+ * numerical precision. Like there, they are only computed properly
+ * if below sig_level/bonf_factor and are LDBL_MAX otherwise. Use the
+ * smallest Bonferroni factor of all events for bonf_factor.
+ *
+ * Returns non-zero on error.
+ */
+int
+snpcaller_shared(long double *pvalues, const int *counts, const int num_counts,
+                 const double *err_probs, const int num_err_probs,
+                 const double **ext_err_probs, const int *num_ext_err_probs,
+                 const long long int bonf_factor, const double sig_level)
+{
+     double *probvec = NULL;
+     double *work = NULL;
+     double *ext_probvec = NULL;
+     double *ext_work = NULL;
+     long double pvalue;
+     int *todo = NULL; /* events not screened out */
+     double mu = 0.0, sum_sq = 0.0;
+     int max_count = 0;
+     int i, k;
+     int rc = 0;
+
+     for (i=0; i<num_counts; i++) {
+          pvalues[i] = LDBL_MAX;
+          max_count = MAX(max_count, counts[i]);
+     }
+     if (0 == max_count) {
+          return 0;
+     }
+
+     if (NULL == ext_err_probs) {
+          if (errprobs_screen_nonsig(err_probs, num_err_probs, max_count, bonf_factor, sig_level)) {
+               return 0;
+          }
+          probvec = poissbin(&pvalue, err_probs, num_err_probs,
+                             max_count, bonf_factor, sig_level);
+          if (NULL == probvec) {
+               return -1;
+          }
+          /* the largest count has the smallest pvalue. if that can't
+           * be significant, neither can the others */
+          if (pvalue * (double)bonf_factor <= sig_level) {
+               for (i=0; i<num_counts; i++) {
+                    if (counts[i]) {
+                         pvalues[i] = probvec_tail_pvalue(probvec, counts[i], max_count);
+                    }
+               }
+          }
+          free(probvec);
+          return 0;
+     }
+
+     /* screen each event on its own complete vector (shared part plus
+      * its extension) and only run the DPs up to the largest count
+      * left */
+     if (NULL == (todo = calloc(num_counts, sizeof(int)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          return -1;
+     }
+     for (k=0; k<num_err_probs; k++) {
+          mu += err_probs[k];
+          sum_sq += err_probs[k] * err_probs[k];
+     }
+     max_count = 0;
+     for (i=0; i<num_counts; i++) {
+          double ext_mu = mu, ext_sum_sq = sum_sq;
+          if (0 == counts[i]) {
+               continue;
+          }
+          for (k=0; k<num_ext_err_probs[i]; k++) {
+               ext_mu += ext_err_probs[i][k];
+               ext_sum_sq += ext_err_probs[i][k] * ext_err_probs[i][k];
+          }
+          if (! pb_screen_nonsig(ext_mu, ext_sum_sq, counts[i], bonf_factor, sig_level)) {
+               todo[i] = 1;
+               max_count = MAX(max_count, counts[i]);
+          }
+     }
+     if (0 == max_count) {
+          free(todo);
+          return 0;
+     }
+
+     PROF_START(t_dp);
+     if (NULL == (probvec = malloc((max_count+1) * sizeof(double)))
+         || NULL == (work = malloc((max_count+1) * sizeof(double)))
+         || NULL == (ext_probvec = malloc((max_count+1) * sizeof(double)))
+         || NULL == (ext_work = malloc((max_count+1) * sizeof(double)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          rc = -1;
+          goto free_and_exit;
+     }
+
+     probvec[0] = 0.0; /* log(1.0) */
+     for (k=1; k<=max_count; k++) {
+          probvec[k] = LOGZERO;
+     }
+     /* the tail can only grow with more reads. if it's already too
+      * big for the largest count, nothing can be significant */
+     if (pb_log_extend(&probvec, &work, err_probs, num_err_probs, max_count,
+                       bonf_factor, sig_level)) {
+          goto free_and_exit;
+     }
+
+     for (i=0; i<num_counts; i++) {
+          int K = counts[i];
+          if (! todo[i]) {
+               continue;
+          }
+          /* continue with the tail at this event's count folded into
+           * ext_probvec[K], so that pruning is exact for it */
+          memcpy(ext_probvec, probvec, K * sizeof(double));
+          ext_probvec[K] = probvec_tailsum(probvec, K, max_count+1);
+          if (pb_log_extend(&ext_probvec, &ext_work,
+                            ext_err_probs[i], num_ext_err_probs[i], K,
+                            bonf_factor, sig_level)) {
+               continue;
+          }
+          pvalue = probvec_tail_pvalue(ext_probvec, K, K);
+          if (pvalue * (double)bonf_factor <= sig_level) {
+               pvalues[i] = pvalue;
+          }
+     }
+
+ free_and_exit:
+     PROF_STOP(PROF_DP, t_dp);
+     free(todo);
+     free(probvec);
+     free(work);
+     free(ext_probvec);
+     free(ext_work);
+     return rc;
+}
+/* snpcaller_shared() */
+
+
 #ifdef SNPCALLER_MAIN
 
 
@@ -1276,3 +2621,151 @@ int main(int argc, char *argv[]) {
      free(err_probs);
 }
 #endif
+
+
+#ifdef SNPCALLER_SHARED_MAIN
+
+/*
+ * Checks snpcaller_shared() against one snpcaller() call per event on
+ * random columns. Returns non-zero if any event differs in
+ * significance or, if significant, in pvalue. See
+ * tests/snpcaller_shared.sh
+ *
+ * gcc -Wall -g -std=gnu99 -O2 -DSNPCALLER_SHARED_MAIN -I../uthash -I../cdflib90 -I$HTSLIB -o snpcaller_shared snpcaller.c fet.c utils.c log.c profile.c -lm -lz
+ */
+
+/* otherwise in plp.c */
+const char *bam_nt4_rev_table = "ACGTN";
+
+static int
+pvalues_differ(const long double expected, const long double got,
+               const long long int bonf, const double sig)
+{
+     int exp_sig = expected * bonf < sig;
+     int got_sig = got * bonf < sig;
+
+     if (exp_sig != got_sig) {
+          return 1;
+     }
+     return exp_sig && fabsl(logl(expected) - logl(got)) > 1e-6;
+}
+
+
+static double
+rand_errprob(const int min_q, const int max_q)
+{
+     return pow(10, -(min_q + rand() % (max_q-min_q+1))/10.0);
+}
+
+
+int main(int argc, char *argv[]) {
+     const double sig = 0.01;
+     const int num_cols = 2000;
+     int col, num_tested = 0, num_sig = 0, num_bad = 0;
+
+     srand(argc > 1 ? atoi(argv[1]) : 1);
+
+     for (col = 0; col < num_cols; col++) {
+          /* num_common reads without event, num_ext with an event */
+          const int num_common = 20 + rand() % 800;
+          const int num_events = 1 + rand() % 5;
+          const long long int bonf = 1 + rand() % 100000;
+          int counts[5], num_ext[5];
+          double *common, *ext[5], *all;
+          long double pvalues[5];
+          int num_all = 0;
+          int i, j, e;
+
+          for (e = 0; e < num_events; e++) {
+               counts[e] = 1 + rand() % (1 + rand() % 30);
+               num_all += counts[e];
+          }
+
+          common = malloc(num_common * sizeof(double));
+          all = malloc((num_common+num_all) * sizeof(double));
+          if (! common || ! all) {
+               fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                       __FILE__, __FUNCTION__, __LINE__);
+               return 1;
+          }
+          for (i = 0; i < num_common; i++) {
+               common[i] = rand_errprob(10, 40);
+          }
+          /* reads of an event get an extra error only for that event,
+           * as alignment qualities for indels */
+          for (e = 0; e < num_events; e++) {
+               int k = 0;
+               if (NULL == (ext[e] = malloc(num_all * sizeof(double)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    return 1;
+               }
+               for (j = 0; j < num_events; j++) {
+                    for (i = 0; i < counts[j]; i++) {
+                         double p = pow(10, -(20 + (i*7+j) % 20)/10.0);
+                         if (j == e) {
+                              p += (1-p) * 0.01;
+                         }
+                         ext[e][k++] = p;
+                    }
+               }
+               num_ext[e] = num_all;
+          }
+
+          snpcaller_shared(pvalues, counts, num_events, common, num_common,
+                           (const double **)ext, num_ext, bonf, sig);
+          for (e = 0; e < num_events; e++) {
+               long double expected[NUM_NONCONS_BASES];
+               int c[NUM_NONCONS_BASES] = {0};
+
+               c[0] = counts[e];
+               memcpy(all, common, num_common * sizeof(double));
+               memcpy(all+num_common, ext[e], num_all * sizeof(double));
+               qsort(all, num_common+num_all, sizeof(double), dbl_cmp);
+               snpcaller(expected, all, num_common+num_all, c, bonf, sig);
+               num_tested += 1;
+               num_sig += expected[0] * bonf < sig;
+               if (pvalues_differ(expected[0], pvalues[e], bonf, sig)) {
+                    num_bad += 1;
+                    LOG_ERROR("column %d event %d: snpcaller() %Lg snpcaller_shared() %Lg\n",
+                              col, e, expected[0], pvalues[e]);
+               }
+          }
+
+          /* without extra errors all event reads are part of the common
+           * ones */
+          for (i = 0; i < num_all && i < num_common; i++) {
+               common[i] = rand_errprob(20, 40);
+          }
+          if (num_all <= num_common) {
+               snpcaller_shared(pvalues, counts, num_events, common, num_common,
+                                NULL, NULL, bonf, sig);
+               memcpy(all, common, num_common * sizeof(double));
+               qsort(all, num_common, sizeof(double), dbl_cmp);
+               for (e = 0; e < num_events; e++) {
+                    long double expected[NUM_NONCONS_BASES];
+                    int c[NUM_NONCONS_BASES] = {0};
+
+                    c[0] = counts[e];
+                    snpcaller(expected, all, num_common, c, bonf, sig);
+                    num_tested += 1;
+                    num_sig += expected[0] * bonf < sig;
+                    if (pvalues_differ(expected[0], pvalues[e], bonf, sig)) {
+                         num_bad += 1;
+                         LOG_ERROR("column %d event %d without extra errors: snpcaller() %Lg snpcaller_shared() %Lg\n",
+                                   col, e, expected[0], pvalues[e]);
+                    }
+               }
+          }
+
+          for (e = 0; e < num_events; e++) {
+               free(ext[e]);
+          }
+          free(common);
+          free(all);
+     }
+
+     printf("%d events tested, %d significant, %d differ\n", num_tested, num_sig, num_bad);
+     return num_bad ? 1 : 0;
+}
+#endif
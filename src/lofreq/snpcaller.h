@@ -52,6 +52,10 @@ typedef struct {
      long long int bonf_indel;
      float sig;
      vcf_file_t vcf_out;
+     /* if set, calls are handed to var_emit (which takes ownership)
+      * instead of being written to vcf_out */
+     void (*var_emit)(var_t *var, void *data);
+     void *var_emit_data;
      int flag; /* FIXME doc? */
 
      /* FIXME the following two logically don't belong her but
@@ -59,9 +63,35 @@ typedef struct {
      int only_indels; 
      int no_indels; 
 
+     /* number of tests performed (CONSVAR doesn't count). for
+      * downstream multiple testing correction. corresponds to bonf
+      * if bonf_dynamic is true. kept here and not as globals, so
+      * that each thread can count on its own copy */
+     long long int num_snv_tests;
+     long long int num_indel_tests;
+     long int indel_calls_wo_idaq;
+
+     /* cache: error probability thresholds corresponding to min_jq
+      * and min_alt_jq (index 0 and 1) and the qualities they were
+      * computed for. see plp_to_errprobs() */
+     int jq_thresh_q[2];
+     double jq_thresh_prob[2];
 } varcall_conf_t;
 
 
+/* histogram of distinct error probabilities. see errprob_hist_build() */
+typedef struct {
+     double prob;
+     int count;
+} errprob_bin_t;
+
+typedef struct {
+     errprob_bin_t *bins; /* sorted ascending by prob */
+     int num_bins;
+     int num_err_probs; /* sum of all counts */
+} errprob_hist_t;
+
+
 double
 merge_srcq_baseq_and_mapq(const int sq, const int bq, const int mq);
 
@@ -82,6 +112,21 @@ plp_to_del_errprobs(double **err_probs, int *num_err_probs,
                     const plp_col_t *p, varcall_conf_t *conf,
                     char key[MAX_INDELSIZE]);
 
+/* error probs for several indel events at once, split into a part
+ * shared by all events and the rest per event. see
+ * plp_to_ins_errprobs_shared() */
+void
+plp_to_ins_errprobs_shared(double **shared, int *num_shared,
+                           double **ext, int *num_ext,
+                           const plp_col_t *p, varcall_conf_t *conf,
+                           char **keys, const int num_keys);
+
+void
+plp_to_del_errprobs_shared(double **shared, int *num_shared,
+                           double **ext, int *num_ext,
+                           const plp_col_t *p, varcall_conf_t *conf,
+                           char **keys, const int num_keys);
+
 void
 init_varcall_conf(varcall_conf_t *c);
 
@@ -89,6 +134,22 @@ void
 dump_varcall_conf(const varcall_conf_t *c, FILE *stream) ;
 
 
+/* Poisson-binomial kernel used by poissbin(). log is the
+ * original (exact) log space one. linear works in scaled linear
+ * space, is vectorized and a lot faster. pvalues agree within numerical
+ * precision */
+#define PB_KERNEL_LOG 0
+#define PB_KERNEL_LINEAR 1
+extern int pb_kernel;
+
+/* the kernels used by poissbin(). also used by lofreq-bench */
+double *
+pruned_calc_prob_dist(const double *err_probs, int N, int K,
+                      long long int bonf_factor, double sig_level);
+double *
+linear_calc_prob_dist(const double *err_probs, int N, int K,
+                      long long int bonf_factor, double sig_level);
+
 extern double *
 poissbin(long double *pvalue, const double *err_probs,
          const int num_err_probs, const int num_failures, 
@@ -99,5 +160,41 @@ snpcaller(long double *snp_pvalues, const double *err_probs,
           const long long int bonf_factor,
           const double sig_level);
 
+/* pvalues for several events at one column from a single
+ * Poisson-binomial. see snpcaller_shared() */
+int
+snpcaller_shared(long double *pvalues, const int *counts, const int num_counts,
+                 const double *err_probs, const int num_err_probs,
+                 const double **ext_err_probs, const int *num_ext_err_probs,
+                 const long long int bonf_factor, const double sig_level);
+
+/* cheap test whether P(X>=K) can't be significant, in which case
+ * the Poisson-binomial doesn't need to be computed. see
+ * pb_screen_nonsig() */
+int
+errprobs_screen_nonsig(const double *err_probs, const int num_err_probs,
+                       const int K, const long long int bonf, const double sig);
+
+int
+errprob_hist_build(errprob_hist_t *h, const double *err_probs, const int num_err_probs);
+void
+errprob_hist_free(errprob_hist_t *h);
+int
+errprob_hist_is_cheaper(const errprob_hist_t *h, const int K);
+
+int
+errprob_hist_screen_nonsig(const errprob_hist_t *hist,
+                           const int K, const long long int bonf, const double sig);
+
+extern double *
+poissbin_hist(long double *pvalue, const errprob_hist_t *hist,
+              const int num_failures,
+              const long long int bonf, const double sig);
+extern int
+snpcaller_hist(long double *snp_pvalues, const errprob_hist_t *hist,
+               const int *noncons_counts,
+               const long long int bonf_factor,
+               const double sig_level);
+
 
 #endif
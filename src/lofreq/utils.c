@@ -556,7 +556,10 @@ is_newer(const char *p1, const char *p2)
      return s1.st_mtime > s2.st_mtime;
 }
 
-void add_ins_sequence(ins_event **head_ins_counts, char seq[], 
+/* pool (optional) is a list of recycled events (see
+ * recycle_ins_event_counts()), which are used instead of allocating new
+ * ones */
+void add_ins_sequence(ins_event **head_ins_counts, ins_event **pool, char seq[], 
      int ins_qual, int ins_aln_qual, int ins_map_qual, int ins_source_qual, 
      int fw_rv) {
      ins_event *it = NULL;
@@ -575,18 +578,31 @@ void add_ins_sequence(ins_event **head_ins_counts, char seq[],
           int_varray_add_value(& it->ins_source_quals, ins_source_qual);
 
      } else {
-          it = malloc(sizeof(ins_event));
+          if (pool && *pool) {
+               /* recycled: keep memory of quality arrays */
+               it = *pool;
+               *pool = it->hh_ins.next;
+               it->ins_quals.n = 0;
+               it->ins_aln_quals.n = 0;
+               it->ins_map_quals.n = 0;
+               it->ins_source_quals.n = 0;
+          } else {
+               if (NULL == (it = malloc(sizeof(ins_event)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+               int_varray_init(& it->ins_quals, 0);
+               int_varray_init(& it->ins_aln_quals, 0);
+               int_varray_init(& it->ins_map_quals, 0);
+               int_varray_init(& it->ins_source_quals, 0);
+          }
           strncpy((char *)it->key, seq, MAX_INDELSIZE-1);
           it->count = 1;
           it->cons_quals = ins_qual;
           
           it->fw_rv[0] = it->fw_rv[1] = 0;
           it->fw_rv[fw_rv] += 1;
-
-          int_varray_init(& it->ins_quals, 0);
-          int_varray_init(& it->ins_aln_quals, 0);
-          int_varray_init(& it->ins_map_quals, 0);
-          int_varray_init(& it->ins_source_quals, 0);
           
           int_varray_add_value(& it->ins_quals, ins_qual);
           int_varray_add_value(& it->ins_aln_quals, ins_aln_qual);
@@ -615,7 +631,39 @@ void destruct_ins_event_counts(ins_event **head_ins_counts) {
      }
 }
 
-void add_del_sequence(del_event **head_del_counts, char seq[], 
+/* empties hash but moves events to pool for reuse by
+ * add_ins_sequence(). cheaper than destruct_ins_event_counts() when
+ * called for every column. free pool with free_ins_event_pool() */
+void recycle_ins_event_counts(ins_event **head_ins_counts, ins_event **pool) {
+     ins_event *it_ins, *it_next;
+
+     it_ins = *head_ins_counts;
+     /* only frees the hash table itself. items stay linked */
+     HASH_CLEAR(hh_ins, *head_ins_counts);
+     for (; it_ins; it_ins = it_next) {
+          it_next = it_ins->hh_ins.next;
+          it_ins->hh_ins.next = *pool;
+          *pool = it_ins;
+     }
+}
+
+void free_ins_event_pool(ins_event **pool) {
+     ins_event *it_ins, *it_next;
+     for (it_ins = *pool; it_ins; it_ins = it_next) {
+          it_next = it_ins->hh_ins.next;
+          int_varray_free(& it_ins->ins_quals);
+          int_varray_free(& it_ins->ins_aln_quals);
+          int_varray_free(& it_ins->ins_map_quals);
+          int_varray_free(& it_ins->ins_source_quals);
+          free(it_ins);
+     }
+     *pool = NULL;
+}
+
+/* pool (optional) is a list of recycled events (see
+ * recycle_del_event_counts()), which are used instead of allocating new
+ * ones */
+void add_del_sequence(del_event **head_del_counts, del_event **pool, char seq[], 
      int del_qual, int del_aln_qual, int del_map_qual, int del_source_qual, 
      int fw_rv) {
      del_event *it = NULL;
@@ -634,7 +682,25 @@ void add_del_sequence(del_event **head_del_counts, char seq[],
           int_varray_add_value(& it->del_source_quals, del_source_qual);
      
      } else {
-          it = malloc(sizeof(del_event));
+          if (pool && *pool) {
+               /* recycled: keep memory of quality arrays */
+               it = *pool;
+               *pool = it->hh_del.next;
+               it->del_quals.n = 0;
+               it->del_aln_quals.n = 0;
+               it->del_map_quals.n = 0;
+               it->del_source_quals.n = 0;
+          } else {
+               if (NULL == (it = malloc(sizeof(del_event)))) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+               int_varray_init(& it->del_quals, 0);
+               int_varray_init(& it->del_aln_quals, 0);
+               int_varray_init(& it->del_map_quals, 0);
+               int_varray_init(& it->del_source_quals, 0);
+          }
           strncpy((char *)it->key, seq, MAX_INDELSIZE-1);
           it->count = 1;
           it->cons_quals = del_qual;
@@ -642,11 +708,6 @@ void add_del_sequence(del_event **head_del_counts, char seq[],
           it->fw_rv[0] = it->fw_rv[1] = 0;
           it->fw_rv[fw_rv] += 1;
 
-          int_varray_init(& it->del_quals, 0);
-          int_varray_init(& it->del_aln_quals, 0);
-          int_varray_init(& it->del_map_quals, 0);
-          int_varray_init(& it->del_source_quals, 0);
-
           int_varray_add_value(& it->del_quals, del_qual);
           int_varray_add_value(& it->del_aln_quals, del_aln_qual);
           int_varray_add_value(& it->del_map_quals, del_map_qual);
@@ -674,6 +735,35 @@ void destruct_del_event_counts(del_event **head_del_counts) {
      }
 }
 
+/* empties hash but moves events to pool for reuse by
+ * add_del_sequence(). cheaper than destruct_del_event_counts() when
+ * called for every column. free pool with free_del_event_pool() */
+void recycle_del_event_counts(del_event **head_del_counts, del_event **pool) {
+     del_event *it_del, *it_next;
+
+     it_del = *head_del_counts;
+     /* only frees the hash table itself. items stay linked */
+     HASH_CLEAR(hh_del, *head_del_counts);
+     for (; it_del; it_del = it_next) {
+          it_next = it_del->hh_del.next;
+          it_del->hh_del.next = *pool;
+          *pool = it_del;
+     }
+}
+
+void free_del_event_pool(del_event **pool) {
+     del_event *it_del, *it_next;
+     for (it_del = *pool; it_del; it_del = it_next) {
+          it_next = it_del->hh_del.next;
+          int_varray_free(& it_del->del_quals);
+          int_varray_free(& it_del->del_aln_quals);
+          int_varray_free(& it_del->del_map_quals);
+          int_varray_free(& it_del->del_source_quals);
+          free(it_del);
+     }
+     *pool = NULL;
+}
+
 void strtoupper(char *s) {
      for (; *s != '\0'; s++) {
           *s = toupper(*s);
@@ -37,6 +37,7 @@
 #define MAX_INDELSIZE 256
 
 #define HAS_GZIP_EXT(f)  (strlen(f)>3 && 0==strncmp(& f[strlen(f)-3], ".gz", 3))
+#define HAS_BCF_EXT(f)  (strlen(f)>4 && 0==strncmp(& f[strlen(f)-4], ".bcf", 4))
 
 
 #define PHREDQUAL_TO_PROB(phred) (phred==INT_MAX ? DBL_MIN : pow(10.0, -1.0*(phred)/10.0))
@@ -110,11 +111,13 @@ typedef struct {
   UT_hash_handle hh_ins;
 } ins_event;
 
-void add_ins_sequence(ins_event **head_ins_count, char seq[], 
+void add_ins_sequence(ins_event **head_ins_count, ins_event **pool, char seq[], 
   int ins_qual, int ins_aln_qual, int ins_map_qual, int ins_source_qual, 
   int fw_rv);
 ins_event *find_ins_sequence(ins_event *const *head_ins_counts, char seq[]);
 void destruct_ins_event_counts(ins_event **head_ins_counts);
+void recycle_ins_event_counts(ins_event **head_ins_counts, ins_event **pool);
+void free_ins_event_pool(ins_event **pool);
 
 typedef struct {
   char key[MAX_INDELSIZE];
@@ -128,11 +131,13 @@ typedef struct {
   UT_hash_handle hh_del;
 } del_event;
 
-void add_del_sequence(del_event **head_del_counts, char seq[], 
+void add_del_sequence(del_event **head_del_counts, del_event **pool, char seq[], 
   int del_qual, int del_aln_qual, int del_map_qual, int del_source_qual, 
   int fw_rv);
 del_event * find_del_sequence(del_event *const *head_del_counts, char seq[]);
 void destruct_del_event_counts(del_event **head_del_counts);
+void recycle_del_event_counts(del_event **head_del_counts, del_event **pool);
+void free_del_event_pool(del_event **pool);
 
 void
 strtoupper(char *s);
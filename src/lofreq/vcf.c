@@ -42,6 +42,8 @@
 #include "htslib/kstring.h"
 #include "htslib/kseq.h"
 #include "htslib/tbx.h"
+#include "htslib/hts.h"
+#include "htslib/vcf.h"
 
 #include "uthash.h"
 
@@ -49,9 +51,61 @@
 #include "utils.h"
 #include "vcf.h"
 #include "defaults.h"
+#include "profile.h"
 
 #define LINE_BUF_SIZE 1<<12
 
+/* stdio buffer size for uncompressed output files */
+#define VCF_OUT_BUF_SIZE (1<<20)
+
+/* min_shift and number of levels as used by tabix for tbi */
+#define TBI_MIN_SHIFT 14
+#define TBI_N_LVLS 5
+
+
+/* chromosome name to tid mapping for on-the-fly index */
+typedef struct {
+     char *name;
+     int tid;
+     UT_hash_handle hh;
+} otf_idx_name_t;
+
+/* tabix index built on the fly while writing, i.e. the same that
+ * tbx_index_build() would create by reading the file back after
+ * writing. records are seen via vcf_file_write() so that output that
+ * bypasses vcf_write_var() gets indexed as well */
+typedef struct {
+     hts_idx_t *hidx;
+     uint64_t last_off; /* offset of end of header */
+     otf_idx_name_t *names; /* hash */
+     otf_idx_name_t **names_by_tid;
+     int n_names, m_names;
+     int last_tid;
+     kstring_t pending; /* incomplete line from previous write */
+     int failed;
+} vcf_otf_idx_t;
+
+
+/* BCF2 file. everything else in here works on VCF text lines, so
+ * records are converted by htslib from BCF to a line when read (see
+ * vcf_file_getline()) and from a line to BCF when written (see
+ * vcf_file_write()). this only changes the file format: records are
+ * still formatted and parsed as text, and values come back in htslib's
+ * formatting (e.g. AF=0.5 instead of AF=0.500000). when writing, the
+ * header is only known once the first record (or close) is seen, since
+ * it's written in pieces */
+typedef struct {
+     htsFile *fp;
+     bcf_hdr_t *hdr;
+     bcf1_t *rec;
+     kstring_t text; /* reading: header text. writing: header text collected so far */
+     size_t text_off; /* reading: header text already returned */
+     int64_t data_off; /* reading: file offset of first record */
+     kstring_t pending; /* writing: incomplete line */
+     int hdr_written;
+     int failed;
+} vcf_bcf_t;
+
 
 /* this is the actual header. all the other stuff is actually called meta-info 
  * note, newline character is missing here
@@ -143,18 +197,26 @@ int vcf_printf(vcf_file_t *f, char *fmt, ...)
 
      if (len>=64000) {
           LOG_WARN("%s\n", "Truncated vcf_printf");
+          len = 64000-1;
      }
-     if (f->is_bgz) {
-          return bgzf_write(f->fh_bgz, buf, strlen(buf));
-     } else {
-          return fputs(buf, f->fh);
+     if (len<0) {
+          return len;
      }
+     return vcf_file_write(f, buf, len);
 }
 
 int
 vcf_file_seek(vcf_file_t *f, long int offset, int whence) 
 {
-     if (f->is_bgz) {
+     if (f->is_bcf) {
+          /* only rewinding is supported */
+          vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+          if (f->mode != 'r' || offset != 0 || whence != SEEK_SET) {
+               return -1;
+          }
+          b->text_off = 0;
+          return bgzf_seek(b->fp->fp.bgzf, b->data_off, SEEK_SET) < 0 ? -1 : 0;
+     } else if (f->is_bgz) {
           return bgzf_seek(f->fh_bgz, offset, whence);
      } else {
           return fseek(f->fh, offset, whence);
@@ -162,11 +224,538 @@ vcf_file_seek(vcf_file_t *f, long int offset, int whence)
 }
 
 
-/* returns 0 on success. non-zero otherwise */
+/* current offset of uncompressed file. -1 for bgzf, BCF or on error */
+long int
+vcf_file_tell(vcf_file_t *f)
+{
+     if (f->is_bgz || f->is_bcf) {
+          return -1;
+     }
+     return ftell(f->fh);
+}
+
+
+static void
+otf_idx_free(vcf_otf_idx_t *idx)
+{
+     otf_idx_name_t *cur, *tmp;
+
+     if (idx->hidx) {
+          hts_idx_destroy(idx->hidx);
+     }
+     HASH_ITER(hh, idx->names, cur, tmp) {
+          HASH_DEL(idx->names, cur);
+          free(cur->name);
+          free(cur);
+     }
+     free(idx->names_by_tid);
+     free(idx->pending.s);
+     free(idx);
+}
+
+
+static void
+otf_idx_init(vcf_file_t *f)
+{
+     vcf_otf_idx_t *idx;
+
+     if (NULL == (idx = calloc(1, sizeof(vcf_otf_idx_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     idx->last_tid = -1;
+     f->otf_idx = idx;
+}
+
+
+static int
+otf_idx_tid(vcf_otf_idx_t *idx, const char *name, int len)
+{
+     otf_idx_name_t *elem = NULL;
+
+     /* usually the same as before */
+     if (idx->last_tid >= 0) {
+          const char *last = idx->names_by_tid[idx->last_tid]->name;
+          if (0 == strncmp(last, name, len) && last[len] == '\0') {
+               return idx->last_tid;
+          }
+     }
+     HASH_FIND(hh, idx->names, name, len, elem);
+     if (elem) {
+          return elem->tid;
+     }
+
+     if (idx->n_names == idx->m_names) {
+          idx->m_names = idx->m_names ? 2*idx->m_names : 64;
+          idx->names_by_tid = realloc(idx->names_by_tid, idx->m_names * sizeof(otf_idx_name_t *));
+     }
+     elem = malloc(sizeof(otf_idx_name_t));
+     if (! elem || ! idx->names_by_tid || ! (elem->name = strndup(name, len))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     elem->tid = idx->n_names;
+     idx->names_by_tid[idx->n_names++] = elem;
+     HASH_ADD_KEYPTR(hh, idx->names, elem->name, len, elem);
+     return elem->tid;
+}
+
+
+/* parses interval of one vcf record line (without newline) the same
+ * way tabix does for vcf (ref length or INFO END). returns -1 if
+ * parsing failed */
+static int
+otf_idx_parse_intv(const char *line, int len,
+                   const char **chrom, int *chrom_len, int *beg, int *end)
+{
+     const char *p = line;
+     const char *e = line + len;
+     const char *fs[8];
+     int fl[8];
+     int i;
+
+     for (i=0; i<8; i++) {
+          const char *t = memchr(p, '\t', e-p);
+          fs[i] = p;
+          fl[i] = (t ? t : e) - p;
+          if (! t) {
+               i++;
+               break;
+          }
+          p = t+1;
+     }
+     if (i < 4) {
+          return -1;
+     }
+     *chrom = fs[0];
+     *chrom_len = fl[0];
+     *beg = atoi(fs[1])-1;
+     if (*beg < 0) {
+          *beg = 0;
+     }
+     *end = *beg + (fl[3] > 0 ? fl[3] : 1);
+
+     if (i==8) {
+          const char *info = fs[7];
+          const char *info_end = fs[7] + fl[7];
+          while (info < info_end) {
+               const char *sc = memchr(info, ';', info_end-info);
+               if (info_end-info > 4 && 0 == strncmp(info, "END=", 4)) {
+                    int info_e = atoi(info+4);
+                    if (info_e > *beg) {
+                         *end = info_e;
+                    }
+                    break;
+               }
+               if (! sc) {
+                    break;
+               }
+               info = sc+1;
+          }
+     }
+     return 0;
+}
+
+
+/* registers a complete line with the index. has to be called right
+ * after the line was written, since the current file offset marks
+ * its end */
+static void
+otf_idx_add_line(vcf_file_t *f, const char *line, int len)
+{
+     vcf_otf_idx_t *idx = (vcf_otf_idx_t *) f->otf_idx;
+     const char *chrom;
+     int chrom_len, beg, end, tid;
+
+     if (idx->failed) {
+          return;
+     }
+     if (len==0 || line[0] == '#') {
+          if (! idx->hidx) {
+               idx->last_off = bgzf_tell(f->fh_bgz);
+          }
+          return;
+     }
+     if (otf_idx_parse_intv(line, len, &chrom, &chrom_len, &beg, &end)) {
+          LOG_WARN("Can't index unparsable line in %s\n", f->path);
+          idx->failed = 1;
+          return;
+     }
+     if (! idx->hidx) {
+          idx->hidx = hts_idx_init(0, HTS_FMT_TBI, idx->last_off, TBI_MIN_SHIFT, TBI_N_LVLS);
+     }
+     tid = otf_idx_tid(idx, chrom, chrom_len);
+     if (hts_idx_push(idx->hidx, tid, beg, end, bgzf_tell(f->fh_bgz), 1) < 0) {
+          LOG_WARN("Can't index %s (unsorted?)\n", f->path);
+          idx->failed = 1;
+          return;
+     }
+     idx->last_tid = tid;
+}
+
+
+/* sets meta data (tbx_conf_vcf and names) and saves index. same as
+ * in tbx_index() */
+static int
+otf_idx_save(vcf_otf_idx_t *idx, const char *path, uint64_t end_off)
+{
+     uint32_t x[7];
+     uint8_t *meta;
+     int i, l_nm = 0, l;
+     tbx_conf_t conf = tbx_conf_vcf;
+
+     if (! idx->hidx) {
+          /* no records: create empty index as tabix would */
+          idx->hidx = hts_idx_init(0, HTS_FMT_TBI, idx->last_off, TBI_MIN_SHIFT, TBI_N_LVLS);
+     }
+     hts_idx_finish(idx->hidx, end_off);
+
+     for (i=0; i<idx->n_names; i++) {
+          l_nm += strlen(idx->names_by_tid[i]->name) + 1;
+     }
+     memcpy(x, &conf, 24);
+     x[6] = l_nm;
+     if (ed_is_big()) {
+          for (i=0; i<7; i++) {
+               x[i] = ed_swap_4(x[i]);
+          }
+     }
+     if (NULL == (meta = malloc(l_nm + 28))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     memcpy(meta, x, 28);
+     for (l=28, i=0; i<idx->n_names; i++) {
+          int n = strlen(idx->names_by_tid[i]->name) + 1;
+          memcpy(meta + l, idx->names_by_tid[i]->name, n);
+          l += n;
+     }
+     hts_idx_set_meta(idx->hidx, l, meta, 0);/* takes ownership */
+
+     /* return value differs between htslib versions (void in older
+      * ones), so it's ignored here */
+     hts_idx_save(idx->hidx, path, HTS_FMT_TBI);
+     return 0;
+}
+
+
+static int
+bcf_file_open(vcf_file_t *f, const char *path, const char mode)
+{
+     vcf_bcf_t *b;
+
+     if (mode=='a') {
+          LOG_ERROR("Can't append to BCF file %s\n", path);
+          return -1;
+     }
+     if (NULL == (b = calloc(1, sizeof(vcf_bcf_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     f->bcf = b;
+     if (NULL == (b->fp = hts_open(path, mode=='r' ? "rb" : "wb"))) {
+          return -1;
+     }
+     b->rec = bcf_init();
+     if (mode=='r') {
+          if (NULL == (b->hdr = bcf_hdr_read(b->fp))) {
+               LOG_ERROR("Couldn't read BCF header from %s\n", path);
+               return -1;
+          }
+#ifdef HAVE_BCF_HDR_FORMAT
+          if (bcf_hdr_format(b->hdr, 0, & b->text) < 0) {
+               return -1;
+          }
+#else
+          {
+               /* htslib < 1.4 */
+               int len = 0;
+               char *text = bcf_hdr_fmt_text(b->hdr, 0, & len);
+               if (NULL == text) {
+                    return -1;
+               }
+               kputsn(text, len, & b->text);
+               free(text);
+          }
+#endif
+          b->data_off = bgzf_tell(b->fp->fp.bgzf);
+     }
+     return 0;
+}
+
+
+/* adds contig lines for all sequences of the ##reference (if its fai
+ * exists) to header text which doesn't have any. BCF needs them for
+ * all records, but lofreq's own headers don't list them */
+static void
+bcf_hdr_text_add_contigs(kstring_t *text)
+{
+     kstring_t contigs = {0, 0, 0};
+     char *ref, *fai_path, *hline;
+     char line[LINE_BUF_SIZE];
+     FILE *fh;
+     int len;
+
+     if (strstr(text->s, "\n##contig=") || 0 == strncmp(text->s, "##contig=", 9)) {
+          return;
+     }
+     if (NULL == (ref = strstr(text->s, "##reference="))) {
+          return;
+     }
+     ref += strlen("##reference=");
+     if (0 == strncmp(ref, "file://", 7)) {
+          ref += 7;
+     }
+     len = strcspn(ref, "\n");
+     if (NULL == (fai_path = malloc(len + 5))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     memcpy(fai_path, ref, len);
+     strcpy(fai_path + len, ".fai");
+     fh = fopen(fai_path, "r");
+     free(fai_path);
+     if (! fh) {
+          return;
+     }
+     while (fgets(line, sizeof(line), fh)) {
+          char *tab = strchr(line, '\t');
+          if (! tab) {
+               continue;
+          }
+          ksprintf(& contigs, "##contig=<ID=%.*s,length=%ld>\n",
+                   (int)(tab-line), line, strtol(tab+1, NULL, 10));
+     }
+     fclose(fh);
+
+     /* insert before the column header line */
+     if (contigs.l && NULL != (hline = strstr(text->s, VCF_HEADER))) {
+          size_t off = hline - text->s;
+          kstring_t new_text = {0, 0, 0};
+          kputsn(text->s, off, & new_text);
+          kputsn(contigs.s, contigs.l, & new_text);
+          kputs(text->s + off, & new_text);
+          free(text->s);
+          *text = new_text;
+     }
+     free(contigs.s);
+}
+
+
+static int
+bcf_file_write_hdr(vcf_file_t *f)
+{
+     vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+
+     b->hdr_written = 1;
+     if (! b->text.l) {
+          kputs(VCF_HEADER, & b->text);
+          kputc('\n', & b->text);
+     }
+     bcf_hdr_text_add_contigs(& b->text);
+     b->hdr = bcf_hdr_init("r");
+     if (bcf_hdr_parse(b->hdr, b->text.s) || bcf_hdr_write(b->fp, b->hdr) < 0) {
+          LOG_ERROR("Couldn't write BCF header to %s\n", f->path);
+          b->failed = 1;
+          return -1;
+     }
+     return 0;
+}
+
+
+/* converts one record line (without newline) to BCF and writes it.
+ * header lines are collected until the first record */
+static int
+bcf_file_write_line(vcf_file_t *f, kstring_t *line)
+{
+     vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+     int num_ids, num_ctgs;
+
+     if (b->failed) {
+          return -1;
+     }
+     if (! b->hdr_written) {
+          if (line->l && line->s[0] == '#') {
+               kputsn(line->s, line->l, & b->text);
+               kputc('\n', & b->text);
+               return 0;
+          }
+          if (bcf_file_write_hdr(f)) {
+               return -1;
+          }
+     }
+     if (! line->l) {
+          return 0;
+     }
+     /* htslib adds undeclared keys and contigs to the header, which
+      * can't be updated once written */
+     num_ids = b->hdr->n[BCF_DT_ID];
+     num_ctgs = b->hdr->n[BCF_DT_CTG];
+     if (vcf_parse(line, b->hdr, b->rec)) {
+          LOG_ERROR("Couldn't convert record to BCF for %s\n", f->path);
+          b->failed = 1;
+          return -1;
+     }
+     if (b->hdr->n[BCF_DT_ID] != num_ids || b->hdr->n[BCF_DT_CTG] != num_ctgs) {
+          LOG_ERROR("Record uses a contig, INFO or FILTER which is not declared in the header,"
+                    " which BCF doesn't allow. Can't write %s\n", f->path);
+          b->failed = 1;
+          return -1;
+     }
+     if (bcf_write(b->fp, b->hdr, b->rec) < 0) {
+          b->failed = 1;
+          return -1;
+     }
+     return 0;
+}
+
+
+static int
+bcf_file_write(vcf_file_t *f, const char *buf, size_t len)
+{
+     vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+     const char *p = buf;
+     const char *e = buf + len;
+
+     while (p < e) {
+          const char *nl = memchr(p, '\n', e-p);
+          if (! nl) {
+               kputsn(p, e-p, & b->pending);
+               break;
+          }
+          kputsn(p, nl-p, & b->pending);
+          if (bcf_file_write_line(f, & b->pending)) {
+               return -1;
+          }
+          b->pending.l = 0;
+          p = nl+1;
+     }
+     return len;
+}
+
+
+static int
+bcf_file_getline(vcf_file_t *f, kstring_t *str)
+{
+     vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+
+     str->l = 0;
+     if (b->text_off < b->text.l) {
+          const char *p = b->text.s + b->text_off;
+          const char *nl = memchr(p, '\n', b->text.l - b->text_off);
+          size_t n = nl ? (size_t)(nl-p) : b->text.l - b->text_off;
+          kputsn(p, n, str);
+          b->text_off += n + (nl ? 1 : 0);
+          return str->l;
+     }
+     if (bcf_read(b->fp, b->hdr, b->rec) < 0) {
+          return -1;
+     }
+     if (vcf_format(b->hdr, b->rec, str) < 0) {
+          return -1;
+     }
+     if (str->l && str->s[str->l-1] == '\n') {
+          str->s[--str->l] = '\0';
+     }
+     return str->l;
+}
+
+
+/* also builds a CSI index for files written */
+static int
+bcf_file_close(vcf_file_t *f)
+{
+     vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+     int rc = 0;
+
+     if (! b) {
+          return -1;
+     }
+     if (b->fp && f->mode=='w') {
+          if (b->pending.l) {
+               rc = bcf_file_write_line(f, & b->pending);
+          }
+          if (! b->hdr_written) {
+               rc = bcf_file_write_hdr(f);
+          }
+     }
+     if (b->fp && hts_close(b->fp)) {
+          rc = -1;
+     }
+     if (0 == rc && ! b->failed && f->mode=='w' && f->path[0] != '-') {
+          if (bcf_index_build(f->path, TBI_MIN_SHIFT)) {
+               LOG_WARN("indexing of %s failed\n", f->path);
+          }
+     }
+     if (b->failed) {
+          rc = -1;
+     }
+     if (b->hdr) {
+          bcf_hdr_destroy(b->hdr);
+     }
+     if (b->rec) {
+          bcf_destroy(b->rec);
+     }
+     free(b->text.s);
+     free(b->pending.s);
+     free(b);
+     f->bcf = NULL;
+     return rc;
+}
+
+
+/* enables multi-threaded compression for bgzf output and
+ * decompression for bgzf input. no-op for other files, and for input
+ * if htslib can't decompress with threads (< 1.4). since bgzf
+ * offsets aren't known while blocks are still queued for compression,
+ * the index of output files is then built after closing instead of
+ * on the fly. returns 0 on success */
+int
+vcf_file_set_threads(vcf_file_t *f, int num_threads)
+{
+#ifndef HAVE_BGZF_MT_READ
+     if (f->mode == 'r') {
+          return 0;
+     }
+#endif
+     if (f->is_bcf && num_threads > 1) {
+          vcf_bcf_t *b = (vcf_bcf_t *) f->bcf;
+          if (bgzf_mt(b->fp->fp.bgzf, num_threads, 256)) {
+               LOG_WARN("Couldn't enable %d (de)compression threads for %s\n", num_threads, f->path);
+               return -1;
+          }
+          f->num_threads = num_threads;
+          return 0;
+     }
+     if (! f->is_bgz || num_threads < 2) {
+          return 0;
+     }
+     if (bgzf_mt(f->fh_bgz, num_threads, 256)) {
+          LOG_WARN("Couldn't enable %d (de)compression threads for %s\n", num_threads, f->path);
+          return -1;
+     }
+     f->num_threads = num_threads;
+     if (f->otf_idx) {
+          otf_idx_free((vcf_otf_idx_t *) f->otf_idx);
+          f->otf_idx = NULL;
+     }
+     return 0;
+}
+
+
+/* returns 0 on success. non-zero otherwise. mode 'a' (append) is
+ * only supported for uncompressed files. files ending in .bcf are
+ * read or written as BCF2 (always compressed, i.e. bgzip is ignored,
+ * and indexed (CSI) when written) */
 int
 vcf_file_open(vcf_file_t *f, const char *path, const int bgzip, char mode) 
 {
-     if (mode!='r' && mode!='w') {
+     if (mode!='r' && mode!='w' && mode!='a') {
           LOG_FATAL("Internal error: unknown mode %c\n", mode);
           return -1;
      }
@@ -180,18 +769,39 @@ vcf_file_open(vcf_file_t *f, const char *path, const int bgzip, char mode)
 
      f->path = strdup(path);
      f->mode =mode;
+     memset(& f->line, 0, sizeof(kstring_t));
+     memset(& f->wbuf, 0, sizeof(kstring_t));
+     f->num_threads = 1;
+     f->otf_idx = NULL;
+     f->is_bcf = 0;
+     f->bcf = NULL;
+
+     if (path[0] != '-' && HAS_BCF_EXT(path)) {
+          f->is_bcf = 1;
+          f->is_bgz = 0;
+          f->fh = NULL;
+          f->fh_bgz = NULL;
+          return bcf_file_open(f, path, mode);
+     }
      
      if (bgzip) {
           if (path[0] == '-') {
                LOG_FIXME("%s\n", "bgzip support for stdin/stdout not implemented yet");
                return -1;
           }
+          if (mode=='a') {
+               LOG_ERROR("Can't append to bgzip compressed file %s\n", path);
+               return -1;
+          }
           f->is_bgz = 1;
           f->fh = NULL;
           if (mode=='r') {
                f->fh_bgz = bgzf_open(path, "rb");
           } else if (mode=='w') {
                f->fh_bgz = bgzf_open(path, "wb");
+               if (f->fh_bgz) {
+                    otf_idx_init(f);
+               }
           }
 
      } else {
@@ -203,11 +813,15 @@ vcf_file_open(vcf_file_t *f, const char *path, const int bgzip, char mode)
                } else {
                     f->fh = fopen(path, "r");
                }
-          } else if (mode=='w') {
+          } else {
                if (path[0] == '-') {
                     f->fh = stdout;
                } else {
-                    f->fh = fopen(path, "w");
+                    f->fh = fopen(path, mode=='w' ? "w" : "a");
+                    if (f->fh) {
+                         /* records are small. batch them up */
+                         (void) setvbuf(f->fh, NULL, _IOFBF, VCF_OUT_BUF_SIZE);
+                    }
                }
           }
      }     
@@ -220,11 +834,82 @@ vcf_file_open(vcf_file_t *f, const char *path, const int bgzip, char mode)
 }
 
 
+/* opens an in-memory, uncompressed vcf file for writing, e.g. for
+ * collecting output of one thread. buf and size are only valid after
+ * vcf_file_close(). buf has to be freed by caller. returns 0 on
+ * success. non-zero otherwise */
+int
+vcf_file_open_mem(vcf_file_t *f, char **buf, size_t *size)
+{
+     f->path = NULL;
+     f->mode = 'w';
+     f->is_bgz = 0;
+     memset(& f->line, 0, sizeof(kstring_t));
+     memset(& f->wbuf, 0, sizeof(kstring_t));
+     f->num_threads = 1;
+     f->otf_idx = NULL;
+     f->is_bcf = 0;
+     f->bcf = NULL;
+     f->fh_bgz = NULL;
+     f->fh = open_memstream(buf, size);
+     if (! f->fh) {
+          return -1;
+     } else {
+          return 0;
+     }
+}
+
+
+/* writes len bytes from buf as they are, i.e. unformatted. returns
+ * the number of bytes written or a negative number on error */
+int
+vcf_file_write(vcf_file_t *f, const char *buf, size_t len)
+{
+     if (f->is_bcf) {
+          return bcf_file_write(f, buf, len);
+     } else if (f->is_bgz && f->otf_idx) {
+          /* write line by line so that we know where each ends */
+          vcf_otf_idx_t *idx = (vcf_otf_idx_t *) f->otf_idx;
+          const char *p = buf;
+          const char *e = buf + len;
+          while (p < e) {
+               const char *nl = memchr(p, '\n', e-p);
+               size_t n = (nl ? nl+1 : e) - p;
+               if (bgzf_write(f->fh_bgz, p, n) < 0) {
+                    return -1;
+               }
+               if (! nl) {
+                    kputsn(p, n, & idx->pending);
+               } else if (idx->pending.l) {
+                    kputsn(p, n-1, & idx->pending);
+                    otf_idx_add_line(f, idx->pending.s, idx->pending.l);
+                    idx->pending.l = 0;
+               } else {
+                    otf_idx_add_line(f, p, n-1);
+               }
+               p += n;
+          }
+          return len;
+
+     } else if (f->is_bgz) {
+          return bgzf_write(f->fh_bgz, buf, len);
+     } else {
+          if (fwrite(buf, 1, len, f->fh) != len) {
+               return -1;
+          }
+          return len;
+     }
+}
+
+
+/* for bgzf output this is a no-op: bgzf writes out blocks when they
+ * are full and forcing out small ones only hurts compression and
+ * threaded output */
 int
 vcf_file_flush(vcf_file_t *f)
 {
-     if (f->is_bgz) {          
-          return bgzf_flush(f->fh_bgz);
+     if (f->is_bgz || f->is_bcf) {          
+          return 0;
      } else {
           return fflush(f->fh);
      }
@@ -236,7 +921,25 @@ int
 vcf_file_close(vcf_file_t *f) 
 {
      int rc = 0;
-     if (f->is_bgz) {          
+     if (f->is_bcf) {
+          rc = bcf_file_close(f);
+
+     } else if (f->is_bgz && f->otf_idx) {
+          vcf_otf_idx_t *idx = (vcf_otf_idx_t *) f->otf_idx;
+          int failed = idx->failed;
+          if (! failed) {
+               if (bgzf_flush(f->fh_bgz) || otf_idx_save(idx, f->path, bgzf_tell(f->fh_bgz))) {
+                    failed = 1;
+               }
+          }
+          otf_idx_free(idx);
+          f->otf_idx = NULL;
+          rc = bgzf_close(f->fh_bgz);
+          if (failed) {
+               LOG_WARN("indexing of %s failed\n", f->path);
+          }
+
+     } else if (f->is_bgz) {          
           rc = bgzf_close(f->fh_bgz);
           if (rc==0 && f->mode=='w' && f->path && f->path[0] != '-') {
                int min_shift = -1;
@@ -254,6 +957,8 @@ vcf_file_close(vcf_file_t *f)
           }
      }
      free(f->path);
+     free(f->line.s);
+     free(f->wbuf.s);
      return rc;
 }
 
@@ -262,23 +967,22 @@ vcf_file_close(vcf_file_t *f)
 char *
 vcf_file_gets(vcf_file_t *f, int len, char *line) 
 {
-     if (f->is_bgz) {
-          kstring_t str = {0, 0, 0};
-          if (bgzf_getline(f->fh_bgz, '\n', &str) > 0) {
+     if (f->is_bgz || f->is_bcf) {
+          kstring_t *str = & f->line; /* reused */
+          if (f->is_bcf ? bcf_file_getline(f, str) >= 0 : bgzf_getline(f->fh_bgz, '\n', str) > 0) {
                /* will get errors like
                   [E::get_intv] failed to parse TBX_VCF, was wrong -p [type] used?
                   The offending line was: "19,0,1"
                   on just gzipped data. not sure how to catch this. the following is a paranoia check
                */
-               if (str.l<1) {
+               if (str->l<1) {
                     return NULL;
                }
-               strncpy(line, str.s, len-2);
+               strncpy(line, str->s, len-2);
                /* behave like fgets and keep newline */
                line[strlen(line)] = '\n';
                line[strlen(line)+1] = '\0';
                
-               free(str.s);
                return line;
           } else {
                return NULL;
@@ -290,6 +994,33 @@ vcf_file_gets(vcf_file_t *f, int len, char *line)
 }
 
 
+/* reads next line into str without newline (no length limit, unlike
+ * vcf_file_gets()). returns length of line or -1 on EOF or error */
+int
+vcf_file_getline(vcf_file_t *f, kstring_t *str)
+{
+     if (f->is_bcf) {
+          return bcf_file_getline(f, str);
+     } else if (f->is_bgz) {
+          int len = bgzf_getline(f->fh_bgz, '\n', str);
+          if (len < 0) {
+               return -1;
+          }
+          return len;
+     } else {
+          ssize_t len = getline(& str->s, & str->m, f->fh);
+          if (len < 0) {
+               return -1;
+          }
+          if (len > 0 && str->s[len-1] == '\n') {
+               str->s[--len] = '\0';
+          }
+          str->l = len;
+          return (int)len;
+     }
+}
+
+
 int vcf_var_filtered(const var_t *var)
 {
      if (! var->filter) {
@@ -314,61 +1045,105 @@ int vcf_var_is_indel(const var_t *var)
      }
 }
 
-/* value for key will be stored in value if not NULL. value will NULL
- * if not found. Otherwise its allocated here and caller must free.
- * FIXME shoddily written and we should use a hash for info key:val
- * pairs anyway */
+/* Looks up key in var's info field and sets value and value_len to
+ * value of first matching entry (allowing prefix matches as always;
+ * case insensitive). value is a view into var->info and not
+ * terminated, but ends at ';' or '\0' so that atoi etc. work. value is
+ * NULL if entry is a flag or not found. Uses var->info_idx if
+ * present. Returns 1 if found, 0 otherwise.
+ */
 int
-vcf_var_has_info_key(char **value, const var_t *var, const char *key) {
-     const char field_delimiter[] = ";";
-     char *token;
-     char *info;
-     char *info_ptr;
+vcf_var_info_view(const char **value, int *value_len, const var_t *var, const char *key)
+{
+     const char *tok;
+     int tok_len;
+     int key_len;
+     int i = 0;
 
      if (value) {
           (*value) = NULL;
+          (*value_len) = 0;
      }
-
      if (! var->info || ! key) {
           return 0;
      }
-     if (strlen(var->info)<2) {
+     if (var->info[0] == '\0' || var->info[1] == '\0') {
           return 0;
      }
-     info = strdup(var->info);
-     if (! info) {
-          LOG_FATAL("%s\n", "insufficient memory");
-          exit(1);
-     }
-     info_ptr = info;
-     token = info;
-     /* note: strsep modifies ptr. see also
-      * http://stackoverflow.com/questions/21383082/parsing-a-string-in-c-with-strsep-alternative-methods */
-     while (token) {
-          strsep(&info_ptr, field_delimiter);
-          /*fprintf(stderr, "token=%s key=%s\n", token, key);*/
-          if (0 == strncasecmp(key, token, MIN(strlen(token), strlen(key)))) {
+     key_len = strlen(key);
+
+     tok = var->info;
+     while (1) {
+          const char *end;
+          if (var->info_idx) {
+               if (i >= var->info_idx->n) {
+                    break;
+               }
+               tok = var->info_idx->tok[i];
+               tok_len = var->info_idx->tok_len[i];
+               i++;
+               end = tok + tok_len;
+          } else {
+               end = strchr(tok, ';');
+               if (! end) {
+                    end = tok + strlen(tok);
+               }
+               tok_len = end - tok;
+          }
+
+          if (0 == strncasecmp(key, tok, MIN(tok_len, key_len))) {
                if (value) {
-                    char *s = strchr(token, '=');
+                    const char *s = memchr(tok, '=', tok_len);
                     if (NULL != s) {
-                         (*value) = strdup(s+1);
+                         (*value) = s+1;
+                         (*value_len) = tok_len - (s+1-tok);
                     }
                }
-               free(info);
                return 1;
           }
-          token = info_ptr;
-     }
 
-     free(info);
+          if (! var->info_idx) {
+               if (*end == '\0') {
+                    break;
+               }
+               tok = end+1;
+          }
+     }
      return 0;
 }
 
 
+/* value for key will be stored in value if not NULL. value will NULL
+ * if not found. Otherwise its allocated here and caller must free.
+ * See vcf_var_info_view() for a version that doesn't allocate.
+ */
+int
+vcf_var_has_info_key(char **value, const var_t *var, const char *key) {
+     const char *val;
+     int val_len;
+
+     if (value) {
+          (*value) = NULL;
+     }
+     if ( ! vcf_var_info_view(&val, &val_len, var, key)) {
+          return 0;
+     }
+     if (value && val) {
+          (*value) = strndup(val, val_len);
+          if (! (*value)) {
+               LOG_FATAL("%s\n", "insufficient memory");
+               exit(1);
+          }
+     }
+     return 1;
+}
+
+
 void vcf_new_var(var_t **var)
 {
      (*var) = malloc(sizeof(var_t));
      (*var)->chrom = NULL;
+     (*var)->tid = -1;
      (*var)->pos = -1;
      (*var)->id = NULL;
      (*var)->ref = NULL;
@@ -380,6 +1155,8 @@ void vcf_new_var(var_t **var)
      (*var)->format = NULL;
      (*var)->num_samples = 0;
      (*var)->samples = NULL;
+
+     (*var)->info_idx = NULL;
 }
 
 
@@ -412,6 +1189,7 @@ void vcf_cp_var(var_t **dest, var_t *src)
      int i;
      vcf_new_var(dest);
      (*dest)->chrom = strdup(src->chrom);
+     (*dest)->tid = src->tid;
      (*dest)->pos = src->pos;
      if (src->id) {
           (*dest)->id = strdup(src->id);
@@ -441,34 +1219,54 @@ void vcf_cp_var(var_t **dest, var_t *src)
      }
 }
 
-void vcf_write_var(vcf_file_t *vcf_file, const var_t *var)
+/* appends var as record line (with newline) to str */
+void vcf_format_var(kstring_t *str, const var_t *var)
 {
      /* in theory all values are optional */
-
-     vcf_printf(vcf_file, "%s\t%ld\t%s\t%s\t%s\t",
-             NULL == var->chrom ? VCF_MISSING_VAL_STR : var->chrom,
-             var->pos + 1,
-             NULL == var->id ? VCF_MISSING_VAL_STR : var->id,
-             var->ref,
-             var->alt);
+     kputs(NULL == var->chrom ? VCF_MISSING_VAL_STR : var->chrom, str);
+     kputc('\t', str);
+     kputl(var->pos + 1, str);
+     kputc('\t', str);
+     kputs(NULL == var->id ? VCF_MISSING_VAL_STR : var->id, str);
+     kputc('\t', str);
+     kputs(var->ref, str);
+     kputc('\t', str);
+     kputs(var->alt, str);
+     kputc('\t', str);
      if (var->qual>-1) {
-          vcf_printf(vcf_file, "%d", var->qual);
+          kputw(var->qual, str);
      } else {
-          vcf_printf(vcf_file, "%c", VCF_MISSING_VAL_CHAR);
+          kputc(VCF_MISSING_VAL_CHAR, str);
      }
-
-     vcf_printf(vcf_file, "\t%s\t%s",
-             var->filter ? var->filter : VCF_MISSING_VAL_STR,
-             var->info ? var->info : VCF_MISSING_VAL_STR);
+     kputc('\t', str);
+     kputs(var->filter ? var->filter : VCF_MISSING_VAL_STR, str);
+     kputc('\t', str);
+     kputs(var->info ? var->info : VCF_MISSING_VAL_STR, str);
 
      if (var->format) {
           int i=0;
-          vcf_printf(vcf_file, "\t%s", var->format);
+          kputc('\t', str);
+          kputs(var->format, str);
           for (i=0; i<var->num_samples; i++) {
-               vcf_printf(vcf_file, "\t%s", var->samples[i]);
+               kputc('\t', str);
+               kputs(var->samples[i], str);
           }
      }
-     vcf_printf(vcf_file, "\n");
+     kputc('\n', str);
+}
+
+
+/* record is formatted into the file's write buffer and written at
+ * once */
+void vcf_write_var(vcf_file_t *vcf_file, const var_t *var)
+{
+     kstring_t *str = & vcf_file->wbuf;
+     PROF_START(t_write);
+
+     str->l = 0;
+     vcf_format_var(str, var);
+     vcf_file_write(vcf_file, str->s, str->l);
+     PROF_STOP(PROF_VCF_WRITE, t_write);
 }
 
 
@@ -540,25 +1338,20 @@ vcf_var_add_to_filter(var_t *var, const char *filter_name)
 
 int vcf_get_dp4(dp4_counts_t *dp4, var_t *var)
 {
-     const char delimiter[] = ",";
-     char *token;
-     char *dp4_char = NULL;
-     char *dp4_char_cp;
+     const char *dp4_char, *end;
+     int dp4_len;
      int i = 0;
 
-     if ( ! vcf_var_has_info_key(&dp4_char, var, "DP4")) {
+     if ( ! vcf_var_info_view(&dp4_char, &dp4_len, var, "DP4") || ! dp4_char) {
           memset(dp4, -1, sizeof(dp4_counts_t)); /* -1 = error */
           return 1;
      }
-     /* note: strsep modifies ptr */
-     dp4_char_cp = strdup(dp4_char);
-     free(dp4_char);
-     dp4_char = dp4_char_cp;
+     end = dp4_char + dp4_len;
 
      i = 0;
-     /* note: strsep modifies ptr */
-     while (NULL != (token = strsep(& dp4_char, delimiter))) {
-          int val = strtol(token, (char **) NULL, 10); /* = atoi */
+     while (1) {
+          const char *next;
+          int val = strtol(dp4_char, (char **) NULL, 10); /* = atoi */
           if (i==0) {
                dp4->ref_fw = val;
           } else if (i==1) {
@@ -569,8 +1362,11 @@ int vcf_get_dp4(dp4_counts_t *dp4, var_t *var)
                dp4->alt_rv = val;
           }
           i += 1;
+          if (NULL == (next = memchr(dp4_char, ',', end-dp4_char))) {
+               break;
+          }
+          dp4_char = next+1;
      }
-     free(dp4_char_cp);
      if (i != 4) {
           memset(dp4, -1, sizeof(dp4_counts_t)); /* -1 = error */
           return 1;
@@ -646,6 +1442,7 @@ void vcf_write_new_header(vcf_file_t *vcf_file, const char *src, const char *ref
      vcf_printf(vcf_file, "##INFO=<ID=INDEL,Number=0,Type=Flag,Description=\"Indicates that the variant is an INDEL.\">\n");
      vcf_printf(vcf_file, "##INFO=<ID=CONSVAR,Number=0,Type=Flag,Description=\"Indicates that the variant is a consensus variant (as opposed to a low frequency variant).\">\n");
      vcf_printf(vcf_file, "##INFO=<ID=HRUN,Number=1,Type=Integer,Description=\"Homopolymer length to the right of report indel position\">\n");
+     vcf_printf(vcf_file, "##INFO=<ID=DSF,Number=1,Type=Float,Description=\"Fraction of reads kept by downsampling. DP, AF and DP4 refer to the kept reads\">\n");
      vcf_printf(vcf_file, "%s\n", VCF_HEADER);
 }
 
@@ -789,14 +1586,168 @@ int vcf_parse_var_from_line(char *line, var_t *var)
  */
 int vcf_parse_var(vcf_file_t *vcf_file, var_t *var)
 {
-     char line[LINE_BUF_SIZE];
-     char *rc;
+     if (vcf_file_getline(vcf_file, & vcf_file->line) < 0) {
+          return -1;
+     }
+     return vcf_parse_var_from_line(vcf_file->line.s, var);
+}
+
+
+void vcf_rec_init(vcf_rec_t *rec)
+{
+     memset(rec, 0, sizeof(vcf_rec_t));
+     rec->missing[0] = VCF_MISSING_VAL_CHAR;
+     rec->var.pos = -1;
+     rec->var.qual = -1;
+}
+
 
-     rc = vcf_file_gets(vcf_file, sizeof(line), line);
-     if (NULL == rc) {
+void vcf_rec_free(vcf_rec_t *rec)
+{
+     free(rec->var.filter);
+     free(rec->var.samples);
+     free(rec->line.s);
+     free(rec->info_idx.tok);
+     free(rec->info_idx.tok_len);
+     memset(rec, 0, sizeof(vcf_rec_t));
+}
+
+
+static void
+vcf_rec_index_info(vcf_rec_t *rec)
+{
+     vcf_info_idx_t *idx = & rec->info_idx;
+     const char *tok = rec->var.info;
+
+     idx->n = 0;
+     if (tok[0] == '\0' || tok[1] == '\0') {
+          return;
+     }
+     while (1) {
+          const char *end = strchr(tok, ';');
+          if (! end) {
+               end = tok + strlen(tok);
+          }
+          if (idx->n == idx->m) {
+               idx->m = idx->m ? 2*idx->m : 16;
+               idx->tok = realloc(idx->tok, idx->m * sizeof(char *));
+               idx->tok_len = realloc(idx->tok_len, idx->m * sizeof(int));
+               if (! idx->tok || ! idx->tok_len) {
+                    fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                            __FILE__, __FUNCTION__, __LINE__);
+                    exit(1);
+               }
+          }
+          idx->tok[idx->n] = tok;
+          idx->tok_len[idx->n] = end - tok;
+          idx->n += 1;
+          if (*end == '\0') {
+               break;
+          }
+          tok = end+1;
+     }
+}
+
+
+/* parse one variant from stream into rec (see vcf_rec_t), reusing
+ * its memory. same semantics as vcf_parse_var() otherwise. returns
+ * -1 on error or EOF */
+static void
+vcf_rec_reset(vcf_rec_t *rec)
+{
+     var_t *var = & rec->var;
+
+     free(var->filter);
+     var->chrom = var->id = var->ref = var->alt = NULL;
+     var->filter = var->info = var->format = NULL;
+     var->pos = -1;
+     var->qual = -1;
+     var->num_samples = 0;
+     var->info_idx = NULL;
+}
+
+
+int vcf_rec_parse(vcf_file_t *vcf_file, vcf_rec_t *rec)
+{
+     vcf_rec_reset(rec);
+     if (vcf_file_getline(vcf_file, & rec->line) < 0) {
           return -1;
      }
-     return vcf_parse_var_from_line(line, var);
+     return vcf_rec_parse_line(rec);
+}
+
+
+/* like vcf_rec_parse(), but parses the line already in rec->line,
+ * e.g. one read by another thread */
+int vcf_rec_parse_line(vcf_rec_t *rec)
+{
+     var_t *var = & rec->var;
+     char *token;
+     char *line_ptr;
+     int field_no = 0;
+
+     vcf_rec_reset(rec);
+     chomp(rec->line.s);
+
+     line_ptr = rec->line.s;
+     while (NULL != (token = strsep(&line_ptr, "\t"))) {
+          field_no+=1;
+          if (1 == field_no) {
+               var->chrom = token;
+
+          } else if (2 == field_no) {
+               var->pos = atol(token)-1;
+
+          } else if (3 == field_no) {
+               var->id = token;
+
+          } else if (4 == field_no) {
+               var->ref = token;
+
+          } else if (5 == field_no) {
+               var->alt = token;
+
+          } else if (6 == field_no) {
+               if (token[0]==VCF_MISSING_VAL_CHAR) {
+                    var->qual = -1;
+               } else {
+                    var->qual = atoi(token);
+               }
+
+          } else if (7 == field_no) {
+               var->filter = strdup(token);
+
+          } else if (8 == field_no) {
+               var->info = token;
+
+          } else if (9 == field_no) {
+               var->format = token;
+
+          } else if (field_no > 9) {
+               if (var->num_samples == rec->m_samples) {
+                    rec->m_samples = rec->m_samples ? 2*rec->m_samples : 4;
+                    var->samples = realloc(var->samples, rec->m_samples * sizeof(char*));
+               }
+               var->samples[var->num_samples++] = token;
+          }
+     }
+     if (field_no<5) {
+          LOG_WARN("Parsing of variant incomplete. Only got %d fields. Need at least 5 (chrom=%s)\n",
+                   field_no, var->chrom ? var->chrom : "");
+          return -1;
+     }
+     /* allow lenient parsing and fill in missing values*/
+     if (field_no<8) {
+          /* 6-8: qual, filter, info with qual already set */
+          free(var->filter);
+          var->filter = strdup(rec->missing);
+          var->info = rec->missing;
+     }
+
+     vcf_rec_index_info(rec);
+     var->info_idx = & rec->info_idx;
+
+     return 0;
 }
 
 
@@ -32,6 +32,7 @@
 #include <stdarg.h>
 
 #include "htslib/bgzf.h"
+#include "htslib/kstring.h"
 /*#include "zlib.h"*/
 #include "uthash.h"
 
@@ -42,10 +43,28 @@ typedef struct {
      FILE *fh;
      BGZF *fh_bgz;
      char mode;
+     kstring_t line; /* read buffer used by vcf_parse_var() */
+     kstring_t wbuf; /* write buffer used by vcf_write_var() */
+     int num_threads; /* bgzf (de)compression threads. see vcf_file_set_threads() */
+     void *otf_idx; /* tabix index built while writing bgzf output (vcf_otf_idx_t). NULL if not used */
+     int is_bcf; /* BCF2 instead of VCF, selected by extension (see vcf_file_open()) */
+     void *bcf; /* vcf_bcf_t if is_bcf */
 } vcf_file_t;
 
+
+/* index of INFO tokens (key=value or flag) of one record. built once
+ * by vcf_rec_parse() so that info lookups don't have to rescan the
+ * whole string. points into var->info
+ */
+typedef struct {
+     int n, m;
+     const char **tok;
+     int *tok_len;
+} vcf_info_idx_t;
+
 typedef struct {
      char *chrom;
+     int tid; /* optional index of chrom in the BAM header the var was called from or matched against. -1 if unknown */
      long int pos; /* zero offset */
      char *id;
      char *ref;
@@ -58,8 +77,26 @@ typedef struct {
      char *format;
      int num_samples;
      char **samples;
+
+     const vcf_info_idx_t *info_idx; /* optional. only set for vars parsed with vcf_rec_parse() */
 } var_t;
 
+
+/* Reusable record for parsing without allocations: the line is read
+ * into a buffer owned by the record and tokenized in place, i.e. all
+ * fields of var point into that buffer and are only valid until the
+ * next vcf_rec_parse(). The exception is var.filter, which is
+ * allocated as usual, so that filters can be added the usual way.
+ * Don't free or realloc any other field of var.
+ */
+typedef struct {
+     var_t var;
+     kstring_t line;
+     vcf_info_idx_t info_idx;
+     int m_samples;
+     char missing[2];
+} vcf_rec_t;
+
 typedef struct {
      int ref_fw;
      int ref_rv;
@@ -80,6 +117,9 @@ void var_hash_free_elem(var_hash_t *hash_elem_ptr);
 void  var_hash_free_table(var_hash_t *var_hash);
 
 
+/* column header line, without newline. defined in vcf.c */
+extern const char *VCF_HEADER;
+
 #define VCF_MISSING_VAL_STR "."
 #define VCF_MISSING_VAL_CHAR VCF_MISSING_VAL_STR[0]
 
@@ -90,15 +130,25 @@ void  var_hash_free_table(var_hash_t *var_hash);
 
 int
 vcf_file_seek(vcf_file_t *f, long int offset, int whence);
+long int
+vcf_file_tell(vcf_file_t *f);
 int
 vcf_file_open(vcf_file_t *f, const char *path, const int gzip, const char mode);
 int
+vcf_file_open_mem(vcf_file_t *f, char **buf, size_t *size);
+int
+vcf_file_write(vcf_file_t *f, const char *buf, size_t len);
+int
 vcf_file_flush(vcf_file_t *f);
 int
+vcf_file_set_threads(vcf_file_t *f, int num_threads);
+int
 vcf_file_close(vcf_file_t *f);
 char *
 vcf_file_gets(vcf_file_t *f, int len, char *line);
 int
+vcf_file_getline(vcf_file_t *f, kstring_t *str);
+int
 vcf_printf(vcf_file_t *f, char *fmt, ...);
 
 int vcf_get_dp4(dp4_counts_t *dp4, var_t *var);
@@ -116,8 +166,14 @@ int vcf_parse_var_from_line(char *line, var_t *var);
 int vcf_parse_var(vcf_file_t *vcf_file, var_t *var);
 int vcf_parse_vars(var_t ***vars, vcf_file_t *vcf_file, int only_passed);
 
+void vcf_rec_init(vcf_rec_t *rec);
+void vcf_rec_free(vcf_rec_t *rec);
+int vcf_rec_parse(vcf_file_t *vcf_file, vcf_rec_t *rec);
+int vcf_rec_parse_line(vcf_rec_t *rec);
+
 int vcf_var_is_indel(const var_t *var);
 int vcf_var_has_info_key(char **value, const var_t *var, const char *key);
+int vcf_var_info_view(const char **value, int *value_len, const var_t *var, const char *key);
 int vcf_var_filtered(const var_t *var);
 char *vcf_var_add_to_filter(var_t *var, const char *filter_name);
 char *vcf_var_add_to_info(var_t *var, const char *info_str);
@@ -125,6 +181,7 @@ void vcf_var_sprintf_info(var_t *var,
                           const int dp, const float af, const int sb,
                           const dp4_counts_t *dp4,
                           const int is_indel, const int hrun, const int is_consvar);
+void vcf_format_var(kstring_t *str, const var_t *var);
 void vcf_write_var(vcf_file_t *vcf_file, const var_t *var);
 void vcf_write_header(vcf_file_t *vcf_file, const char *header);
 void vcf_write_new_header(vcf_file_t *vcf_file, const char *srcprog, const char *reffa);
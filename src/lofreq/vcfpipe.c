@@ -0,0 +1,341 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+/* Read-process-write pipeline for VCF record lines, analogous to
+ * bampipe.c: one thread reads batches of lines (after the header),
+ * num_threads workers turn each into output text and the calling
+ * thread writes the output in input order. Used by lofreq filter.
+ * Batches live in a ring of slots, each cycling through FREE -> READ
+ * -> BUSY -> DONE -> FREE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "vcfpipe.h"
+
+
+typedef enum {
+     SLOT_FREE = 0,
+     SLOT_READ,
+     SLOT_BUSY,
+     SLOT_DONE
+} slot_state_t;
+
+
+typedef struct {
+     kstring_t lines[VCFPIPE_BATCH_SIZE];
+     int n;
+     long int seq; /* batch number */
+     kstring_t out;
+     slot_state_t state;
+} vcfpipe_slot_t;
+
+
+typedef struct {
+     pthread_mutex_t lock; /* protects everything below except slot contents in use */
+     pthread_cond_t cond; /* signalled on every state change */
+     vcfpipe_slot_t *slots;
+     int num_slots;
+     long int next_work; /* next batch to be processed */
+     long int num_batches; /* only valid once eof is set */
+     long int stop_seq; /* batch in which func asked to stop. -1 if none */
+     int eof;
+     int rc;
+     vcf_file_t *in;
+     vcfpipe_func_t func;
+} vcfpipe_t;
+
+
+typedef struct {
+     vcfpipe_t *pipe;
+     void *wdata;
+} vcfpipe_worker_arg_t;
+
+
+int
+vcfpipe_write_vcf(const char *buf, size_t len, void *out)
+{
+     if (! len) {
+          return 0;
+     }
+     if (vcf_file_write((vcf_file_t *)out, buf, len) < 0) {
+          return -1;
+     }
+     return vcf_file_flush((vcf_file_t *)out);
+}
+/* vcfpipe_write_vcf() */
+
+
+static void *
+vcfpipe_reader(void *arg)
+{
+     vcfpipe_t *p = (vcfpipe_t *)arg;
+     long int seq;
+
+     for (seq = 0; ; seq++) {
+          vcfpipe_slot_t *s = & p->slots[seq % p->num_slots];
+          int n = 0;
+
+          pthread_mutex_lock(& p->lock);
+          while (s->state != SLOT_FREE && ! p->rc && p->stop_seq < 0) {
+               pthread_cond_wait(& p->cond, & p->lock);
+          }
+          if (p->rc || p->stop_seq >= 0) {
+               p->eof = 1;
+               p->num_batches = seq;
+               pthread_cond_broadcast(& p->cond);
+               pthread_mutex_unlock(& p->lock);
+               break;
+          }
+          pthread_mutex_unlock(& p->lock);
+
+          /* slot is ours until marked as read */
+          while (n < VCFPIPE_BATCH_SIZE) {
+               if (vcf_file_getline(p->in, & s->lines[n]) < 0) {
+                    break;
+               }
+               n++;
+          }
+
+          pthread_mutex_lock(& p->lock);
+          if (n) {
+               s->n = n;
+               s->seq = seq;
+               s->state = SLOT_READ;
+          }
+          if (n < VCFPIPE_BATCH_SIZE) {
+               p->eof = 1;
+               p->num_batches = n ? seq+1 : seq;
+          }
+          pthread_cond_broadcast(& p->cond);
+          pthread_mutex_unlock(& p->lock);
+          if (n < VCFPIPE_BATCH_SIZE) {
+               break;
+          }
+     }
+     return NULL;
+}
+/* vcfpipe_reader() */
+
+
+static void *
+vcfpipe_worker(void *arg)
+{
+     vcfpipe_worker_arg_t *wa = (vcfpipe_worker_arg_t *)arg;
+     vcfpipe_t *p = wa->pipe;
+
+     while (1) {
+          vcfpipe_slot_t *s;
+          long int first_idx;
+          int i, rc = 0;
+
+          pthread_mutex_lock(& p->lock);
+          while (1) {
+               s = & p->slots[p->next_work % p->num_slots];
+               if (p->rc || (p->eof && p->next_work >= p->num_batches)
+                   || (p->stop_seq >= 0 && p->next_work > p->stop_seq)) {
+                    s = NULL;
+                    break;
+               }
+               if (s->state == SLOT_READ && s->seq == p->next_work) {
+                    break;
+               }
+               pthread_cond_wait(& p->cond, & p->lock);
+          }
+          if (! s) {
+               pthread_mutex_unlock(& p->lock);
+               break;
+          }
+          s->state = SLOT_BUSY;
+          p->next_work++;
+          pthread_mutex_unlock(& p->lock);
+
+          first_idx = s->seq * VCFPIPE_BATCH_SIZE;
+          s->out.l = 0;
+          for (i = 0; i < s->n && ! rc; i++) {
+               rc = p->func(& s->lines[i], first_idx + i, & s->out, wa->wdata);
+          }
+
+          pthread_mutex_lock(& p->lock);
+          s->state = SLOT_DONE;
+          if (rc < 0) {
+               p->rc = rc;
+          } else if (rc > 0 && (p->stop_seq < 0 || s->seq < p->stop_seq)) {
+               p->stop_seq = s->seq;
+          }
+          pthread_cond_broadcast(& p->cond);
+          pthread_mutex_unlock(& p->lock);
+     }
+     return NULL;
+}
+/* vcfpipe_worker() */
+
+
+/* reads all remaining record lines from in (i.e. the header has to
+ * be read already), applies func to each and writes the output with
+ * write_func to out in input order, once per batch. with num_threads
+ * > 1 func is run in num_threads threads, each using its own entry in
+ * wdata (which must have num_threads entries), and reading happens
+ * in a separate thread. otherwise only wdata[0] is used. returns the
+ * number of lines processed or -1 on error.
+ */
+long int
+vcfpipe_run(vcf_file_t *in, vcfpipe_write_t write_func, void *out,
+            vcfpipe_func_t func, void **wdata, int num_threads)
+{
+     vcfpipe_t p;
+     pthread_t reader;
+     pthread_t *workers;
+     vcfpipe_worker_arg_t *wargs;
+     long int seq;
+     long int num_lines = 0;
+     int i, j;
+
+     if (num_threads <= 1) {
+          kstring_t line = {0, 0, NULL};
+          kstring_t buf = {0, 0, NULL};
+          int rc = 0;
+          while (vcf_file_getline(in, & line) >= 0) {
+               rc = func(& line, num_lines, & buf, wdata[0]);
+               if (rc < 0) {
+                    break;
+               }
+               num_lines++;
+               if (rc > 0 || num_lines % VCFPIPE_BATCH_SIZE == 0) {
+                    if (write_func(buf.s, buf.l, out) < 0) {
+                         LOG_ERROR("%s\n", "Couldn't write output");
+                         rc = -1;
+                         break;
+                    }
+                    buf.l = 0;
+               }
+               if (rc > 0) {
+                    break;
+               }
+          }
+          if (rc == 0 && write_func(buf.s, buf.l, out) < 0) {
+               LOG_ERROR("%s\n", "Couldn't write output");
+               rc = -1;
+          }
+          free(line.s);
+          free(buf.s);
+          return rc < 0 ? -1 : num_lines;
+     }
+
+     memset(& p, 0, sizeof(vcfpipe_t));
+     pthread_mutex_init(& p.lock, NULL);
+     pthread_cond_init(& p.cond, NULL);
+     p.num_slots = 2*num_threads + 2;
+     p.stop_seq = -1;
+     p.in = in;
+     p.func = func;
+     if (NULL == (p.slots = calloc(p.num_slots, sizeof(vcfpipe_slot_t)))
+         ||
+         NULL == (workers = malloc(num_threads * sizeof(pthread_t)))
+         ||
+         NULL == (wargs = malloc(num_threads * sizeof(vcfpipe_worker_arg_t)))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+
+     if (pthread_create(& reader, NULL, vcfpipe_reader, & p)) {
+          LOG_FATAL("%s\n", "Couldn't create reader thread");
+          exit(1);
+     }
+     for (i = 0; i < num_threads; i++) {
+          wargs[i].pipe = & p;
+          wargs[i].wdata = wdata[i];
+          if (pthread_create(& workers[i], NULL, vcfpipe_worker, & wargs[i])) {
+               LOG_FATAL("Couldn't create thread #%d\n", i+1);
+               exit(1);
+          }
+     }
+
+     /* write in order */
+     for (seq = 0; ; seq++) {
+          vcfpipe_slot_t *s = & p.slots[seq % p.num_slots];
+          int last, rc = 0;
+
+          pthread_mutex_lock(& p.lock);
+          while (! p.rc && ! (s->state == SLOT_DONE && s->seq == seq)
+                 && ! (p.eof && seq >= p.num_batches)
+                 && ! (p.stop_seq >= 0 && seq > p.stop_seq)) {
+               pthread_cond_wait(& p.cond, & p.lock);
+          }
+          if (p.rc || s->state != SLOT_DONE || s->seq != seq
+              || (p.stop_seq >= 0 && seq > p.stop_seq)) {
+               pthread_mutex_unlock(& p.lock);
+               break;
+          }
+          /* stop_seq can only decrease to batches not written yet */
+          last = (p.stop_seq == seq);
+          pthread_mutex_unlock(& p.lock);
+
+          if (write_func(s->out.s, s->out.l, out) < 0) {
+               LOG_ERROR("%s\n", "Couldn't write output");
+               rc = -1;
+          }
+          num_lines += s->n;
+
+          pthread_mutex_lock(& p.lock);
+          s->state = SLOT_FREE;
+          if (rc) {
+               p.rc = rc;
+          }
+          pthread_cond_broadcast(& p.cond);
+          pthread_mutex_unlock(& p.lock);
+          if (last) {
+               break;
+          }
+     }
+
+     pthread_join(reader, NULL);
+     for (i = 0; i < num_threads; i++) {
+          pthread_join(workers[i], NULL);
+     }
+
+     for (i = 0; i < p.num_slots; i++) {
+          for (j = 0; j < VCFPIPE_BATCH_SIZE; j++) {
+               free(p.slots[i].lines[j].s);
+          }
+          free(p.slots[i].out.s);
+     }
+     free(p.slots);
+     free(workers);
+     free(wargs);
+     pthread_cond_destroy(& p.cond);
+     pthread_mutex_destroy(& p.lock);
+
+     return p.rc ? -1 : num_lines;
+}
+/* vcfpipe_run() */
@@ -0,0 +1,56 @@
+/* -*- c-file-style: "k&r"; indent-tabs-mode: nil; -*- */
+/*********************************************************************
+* The MIT License (MIT)
+* 
+* Copyright (c) 2013,2014 Genome Institute of Singapore
+* 
+* Permission is hereby granted, free of charge, to any person
+* obtaining a copy of this software and associated documentation files
+* (the "Software"), to deal in the Software without restriction,
+* including without limitation the rights to use, copy, modify, merge,
+* publish, distribute, sublicense, and/or sell copies of the Software,
+* and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+* NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+* BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+* ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+************************************************************************/
+
+#ifndef VCFPIPE_H
+#define VCFPIPE_H
+
+#include "htslib/kstring.h"
+#include "vcf.h"
+
+/* record lines per batch handed to a worker */
+#define VCFPIPE_BATCH_SIZE 4096
+
+/* processes one record line (without newline), which may be modified
+ * in place or swapped with another buffer. idx is the line's number
+ * (zero-based) among all lines read. output is appended to out.
+ * wdata is the worker's entry of the wdata array given to
+ * vcfpipe_run(). returns 0 on success, >0 to stop after this line as
+ * if it was the last one and <0 on error, which stops the pipeline */
+typedef int (*vcfpipe_func_t)(kstring_t *line, long int idx, kstring_t *out, void *wdata);
+
+/* writes the output of one batch. returns <0 on error */
+typedef int (*vcfpipe_write_t)(const char *buf, size_t len, void *out);
+
+int
+vcfpipe_write_vcf(const char *buf, size_t len, void *out);
+
+long int
+vcfpipe_run(vcf_file_t *in, vcfpipe_write_t write_func, void *out,
+            vcfpipe_func_t func, void **wdata, int num_threads);
+
+#endif
@@ -26,8 +26,10 @@
 *
 ************************************************************************/
 
+#include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,7 +64,7 @@ int left_align_indels(char *sref, char *squery, int slen, char *new_state_seq) {
                     if (query[i+ilen] == ref[i]) {
                          ref[i+ilen] = ref[i];
                          ref[i] = '*';
-                         i--;
+                         if (i > 0) { i--; }
                          continue;
                     }
                } else if (query[i+1] == '*') {
@@ -71,7 +73,7 @@ int left_align_indels(char *sref, char *squery, int slen, char *new_state_seq) {
                     if (query[i] == ref[i+dlen]) {
                          query[i+dlen] = query[i];
                          query[i] = '*';
-                         i--;
+                         if (i > 0) { i--; }
                          continue;
                     }
                }
@@ -95,24 +97,11 @@ int left_align_indels(char *sref, char *squery, int slen, char *new_state_seq) {
      return 0;
 }
 
-/* bqual is the base quality phred score representation as string. so use SANGERQUAL_TO_PROB for conversion */
-int viterbi(char *ref, char *query, char *bqual, char *aln, int quality)
+/* transition log-probabilities. only gamma depends on the reference
+ * length, so they are only recomputed if that changes */
+static void
+viterbi_ws_set_tp(viterbi_ws_t *ws, int rlen)
 {
-     //printf("inside viterbi\n");
-     int qlen = strlen(query)+1;
-     int rlen = strlen(ref)+1;
-     
-     double *V_start;
-     double **V_match;
-     double **V_ins;
-     double **V_del;
-          
-     char **ptr_match;
-     char **ptr_ins;
-     char **ptr_del;
-
-     // Define transition probabilities
-     // FIXME: define globally to speed up
 #ifdef PACBIO_REALN
      double alpha = 0.1;
      if (! pacbio_msg_printed) {
@@ -123,210 +112,412 @@ int viterbi(char *ref, char *query, char *bqual, char *aln, int quality)
      double alpha = 0.00001;
 #endif
      double beta = 0.4;
-
      double L = (double)rlen;
      double gamma = 1/(2.*L);
-     int i, k;
+
+     if (ws->tp_rlen == rlen) {
+          return;
+     }
+     memset(ws->tp, 0, sizeof(ws->tp));
+     ws->tp[0][0] = log10((1 - 2*alpha)*(1 - gamma)); // M->M
+     ws->tp[0][1] = log10(alpha*(1 - gamma)); // M->I
+     ws->tp[0][2] = log10(alpha*(1 - gamma)); // M->D
+     ws->tp[0][4] = log10(gamma); // M->E
+     ws->tp[1][0] = log10((1 - beta)*(1 - gamma)); // I->M
+     ws->tp[1][1] = log10(beta*(1 - gamma)); // I->I
+     ws->tp[1][4] = log10(gamma); // I->E
+     ws->tp[2][0] = log10(1- beta); // D->M
+     ws->tp[2][2] = log10(beta); // D->D
+     ws->tp[3][0] = log10((1 - alpha)/L); // S->M
+     ws->tp[3][1] = log10(alpha/L); // S->I
+     ws->tp_rlen = rlen;
+}
+/* viterbi_ws_set_tp() */
+
+
+void
+viterbi_ws_init(viterbi_ws_t *ws)
+{
+     int c;
+
+     memset(ws, 0, sizeof(viterbi_ws_t));
+     ws->tp_rlen = -1;
+     /* emission log-probabilities for every possible sanger qual char */
+     for (c = 0; c < 256; c++) {
+          double bp = SANGERQUAL_TO_PROB((char)c);
+          ws->ep_match[c] = log10(1-bp);
+          ws->ep_match_not[c] = log10(bp/3.);
+     }
+}
+/* viterbi_ws_init() */
+
+
+void
+viterbi_ws_free(viterbi_ws_t *ws)
+{
+     free(ws->rows);
+     free(ws->ptr);
+     free(ws->tmp);
+     free(ws->ub);
+     memset(ws, 0, sizeof(viterbi_ws_t));
+     ws->tp_rlen = -1;
+}
+/* viterbi_ws_free() */
+
+
+static void *
+viterbi_ws_grow(void *buf, size_t *cap, size_t need)
+{
+     if (need <= *cap) {
+          return buf;
+     }
+     if (need < 2 * *cap) {
+          need = 2 * *cap;
+     }
+     if (NULL == (buf = realloc(buf, need))) {
+          fprintf(stderr, "FATAL: couldn't allocate memory at %s:%s():%d\n",
+                  __FILE__, __FUNCTION__, __LINE__);
+          exit(1);
+     }
+     *cap = need;
+     return buf;
+}
+/* viterbi_ws_grow() */
+
+
+/* same as argmax_d(), i.e. first maximum wins */
+#define ARGMAX2(a, b) ((b) > (a) ? 1 : 0)
+
+
+/* Banded version of viterbi(). Only cells whose diagonal k-i (k being
+ * the 1-based position in ref, i the 1-based position in query) lies
+ * within [diag_lo, diag_hi] are computed. Scores are kept for two
+ * query rows only and traceback pointers are packed into one byte
+ * per cell (2 bits match, 2 bits insertion, 1 bit deletion state).
+ *
+ * The result is only used if the best score within the band is
+ * higher than an upper bound for the score of any path that starts
+ * outside the band or leaves it via an edge cell. Otherwise the full
+ * matrix is computed instead. Since all log-probabilities are <= 0,
+ * the rest of a path can't score more than the best emission plus
+ * the best transition per remaining query base (see ws->ub). Paths
+ * to the right of the band are additionally forced into insertions
+ * by the end of the reference. If no outside path can compete, no
+ * outside cell can change an argmax on the optimal path either, so
+ * the result is the same as with viterbi(). Returns the same as
+ * viterbi().
+ */
+int
+viterbi_banded(viterbi_ws_t *ws, const char *ref, const char *query,
+               const char *bqual, char *aln, int quality,
+               int diag_lo, int diag_hi)
+{
+     int qlen = strlen(query)+1;
+     int rlen = strlen(ref)+1;
+     int lo, hi, w, is_full;
+     int i, j, k;
+     double *prev_m, *prev_i, *prev_d, *cur_m, *cur_i, *cur_d, *swp;
      double ep_ins = log10(.25); // Insertion emission probability
-     double tp[5][5] = {{0}};
-
-     tp[0][0] = log10((1 - 2*alpha)*(1 - gamma)); // M->M
-     tp[0][1] = log10(alpha*(1 - gamma)); // M->I
-     tp[0][2] = log10(alpha*(1 - gamma)); // M->D
-     tp[0][4] = log10(gamma); // M->E
-     tp[1][0] = log10((1 - beta)*(1 - gamma)); // I->M
-     tp[1][1] = log10(beta*(1 - gamma)); // I->I
-     tp[1][4] = log10(gamma); // I->E
-     tp[2][0] = log10(1- beta); // D->M
-     tp[2][2] = log10(beta); // D->D
-     tp[3][0] = log10((1 - alpha)/L); // S->M
-     tp[3][1] = log10(alpha/L); // S->I
-     
+     double ep_match_def, ep_match_not_def;
+     double tp00, tp01, tp02, tp10, tp11, tp20, tp22, tp30, tp31;
+     uint8_t *ptr;
+     char end_state = '!';
+     double best_score = INT_MIN;
+     int best_index = 0;
+     int maxslen = qlen+rlen;
+     char current_ptr;
+     char *tmp_state_seq, *tmp_ref, *tmp_query;
+     int si;
+     double *su = NULL; /* su[i]: upper bound for rows i+1..qlen-1 */
+     double leak = INT_MIN; /* upper bound for paths outside the band */
+     double pen_right = 0; /* minimum cost of insertions forced right of the band */
+     int exit_lo, exit_hi; /* can paths leave via the lower/upper edge? */
 
-     // Initialize
-     V_start = malloc(qlen * sizeof(double));
-     V_match = malloc(rlen * sizeof(double*));
-     V_ins = malloc(rlen * sizeof(double*));
-     V_del = malloc(rlen * sizeof(double*));
-     for (i = 0; i < rlen; i++) { 
-          V_match[i] = calloc(qlen, sizeof(double));
-          V_ins[i] = calloc(qlen, sizeof(double));
-          V_del[i] = calloc(qlen, sizeof(double));
+     /* clamp band to actual matrix: k in [1,rlen-1], i in [1,qlen-1] */
+     if (ws->no_band) {
+          diag_lo = INT_MIN/2;
+          diag_hi = INT_MAX/2;
+     }
+     lo = diag_lo;
+     hi = diag_hi;
+     if (lo < 2-qlen) {
+          lo = 2-qlen;
+     }
+     if (hi > rlen-2) {
+          hi = rlen-2;
+     }
+     is_full = (lo == 2-qlen && hi == rlen-2);
+     if (hi < lo) {
+          hi = lo;
      }
+     w = hi - lo + 1;
+     /* insertions move a path to a lower, deletions to a higher diagonal */
+     exit_lo = (lo > 2-qlen);
+     exit_hi = (hi < rlen-2);
 
-     for (i = 0; i < qlen; i++) { 
-          V_start[i] = INT_MIN; 
+     viterbi_ws_set_tp(ws, rlen);
+     tp00 = ws->tp[0][0]; tp01 = ws->tp[0][1]; tp02 = ws->tp[0][2];
+     tp10 = ws->tp[1][0]; tp11 = ws->tp[1][1];
+     tp20 = ws->tp[2][0]; tp22 = ws->tp[2][2];
+     tp30 = ws->tp[3][0]; tp31 = ws->tp[3][1];
+     {
+          double bp = SANGERQUAL_TO_PROB(PHRED_TO_SANGERQUAL(quality));
+          ep_match_def = log10(1-bp);
+          ep_match_not_def = log10(bp/3.);
      }
-     for (k = 0; k < rlen; k++) { 
-          V_match[k][0] = INT_MIN; 
-          V_ins[k][0] = INT_MIN;
-          V_del[k][0] = INT_MIN;
+
+     /* two rows of w cells plus a sentinel on either side for each state */
+     ws->rows = viterbi_ws_grow(ws->rows, &ws->rows_cap, 6 * (w+2) * sizeof(double));
+     ws->ptr = viterbi_ws_grow(ws->ptr, &ws->ptr_cap, (size_t)qlen * w);
+     ws->tmp = viterbi_ws_grow(ws->tmp, &ws->tmp_cap, 3 * (size_t)maxslen);
+     prev_m = ws->rows;
+     prev_i = prev_m + (w+2);
+     prev_d = prev_i + (w+2);
+     cur_m = prev_d + (w+2);
+     cur_i = cur_m + (w+2);
+     cur_d = cur_i + (w+2);
+     ptr = ws->ptr;
+
+     if (! is_full) {
+          const double ep_ins_tp = ep_ins + (tp01 > tp11 ? tp01 : tp11);
+          double tp_max = tp00, min_pen = 0, start = 0;
+          int forced;
+
+          if (tp01 > tp_max) tp_max = tp01;
+          if (tp02 > tp_max) tp_max = tp02;
+          if (tp10 > tp_max) tp_max = tp10;
+          if (tp11 > tp_max) tp_max = tp11;
+          if (tp20 > tp_max) tp_max = tp20;
+          if (tp22 > tp_max) tp_max = tp22;
+
+          ws->ub = viterbi_ws_grow(ws->ub, &ws->ub_cap, (size_t)qlen * sizeof(double));
+          su = ws->ub;
+          su[qlen-1] = 0;
+          for (i = qlen-1; i >= 1; i--) {
+               double ep_best = ep_ins;
+               double m, mn;
+               if (SANGERQUAL_TO_PHRED(bqual[i-1]) == 2) {
+                    m = ep_match_def;
+                    mn = ep_match_not_def;
+               } else {
+                    m = ws->ep_match[(unsigned char)bqual[i-1]];
+                    mn = ws->ep_match_not[(unsigned char)bqual[i-1]];
+               }
+               if (m > ep_best) ep_best = m;
+               if (mn > ep_best) ep_best = mn;
+               if (i == 1) {
+                    start = ep_best + (tp30 > tp31 ? tp30 : tp31) + su[1];
+                    break;
+               }
+               /* what an insertion in this row costs at least */
+               if (i == qlen-1 || ep_best + tp_max - ep_ins_tp < min_pen) {
+                    min_pen = ep_best + tp_max - ep_ins_tp;
+               }
+               su[i-1] = su[i] + ep_best + tp_max;
+          }
+
+          /* right of the band the end of ref leaves room for fewer
+           * matches than there are query bases left */
+          forced = qlen - rlen + hi + 1;
+          if (exit_hi && forced > 0) {
+               /* plus opening one insertion, unless the path starts with it */
+               double tp_ins = tp01 > tp11 ? tp01 : tp11;
+               double tp_start = tp30 > tp31 ? tp30 : tp31;
+               double open_pen = tp_ins - tp01;
+               if (tp_start - tp31 < open_pen) {
+                    open_pen = tp_start - tp31;
+               }
+               pen_right = forced * min_pen + open_pen;
+          }
+          /* paths starting outside the band */
+          if (lo > 0) {
+               leak = start;
+          } else if (exit_hi) {
+               leak = start - pen_right;
+          }
      }
-     for (i = 0; i < qlen; i++) { 
-          V_match[0][i] = INT_MIN; 
-          V_ins[0][i] = INT_MIN;
-          V_del[0][i] = INT_MIN;
+
+     // Initialize: row 0 (and column 0 below) are INT_MIN
+     for (j = 0; j < w+2; j++) {
+          prev_m[j] = prev_i[j] = prev_d[j] = INT_MIN;
      }
-     V_start[0] = 0;
-
-     ptr_match = malloc(rlen * sizeof(char*));
-     ptr_ins = malloc(rlen * sizeof(char*));
-     ptr_del = malloc(rlen * sizeof(char*));
-     for (i=0; i<rlen; i++) {
-          ptr_match[i] = calloc(qlen, sizeof(char));
-          ptr_ins[i] = calloc(qlen, sizeof(char));
-          ptr_del[i] = calloc(qlen, sizeof(char));
-     }    
-    
-     // Recursion
-     double bp;
+
+     // Recursion. cell j+1 of a row is diagonal lo+j. 
      for (i = 1; i < qlen; i++) {
-          double ep_match;
-          double ep_match_not;
+          double vstart = (i == 1) ? 0 : INT_MIN; /* V_start[i-1] */
+          double ep_match, ep_match_not;
+          uint8_t *row_ptr = ptr + (size_t)i * w;
 
           // Define emission probabilities
-		  if ( SANGERQUAL_TO_PHRED(bqual[i-1]) == 2) {
-               bp = SANGERQUAL_TO_PROB(PHRED_TO_SANGERQUAL(quality));
-		  } else {
-               bp = SANGERQUAL_TO_PROB(bqual[i-1]);
-		  }
-          ep_match = log10(1-bp);
-          ep_match_not = log10(bp/3.);
-                    
-          for (k = 1; k < rlen; k++) {
-               int index;
-               
-               // V_Mk(i) = log(e_Mk(x_i)) + max( S_0(i-1) + log(a_(S_0,M_k)),
-               //                                 M_k-1(i-1) + log(a_(M_k-1,M_k)),
-               //                                 I_k-1(i-1) + log(a_(I_k-1,M_k)),
-               //                                 D_k-1(i-1) + log(a_(D_k-1,M_k)) )
-               double mterms[4] = {V_start[i-1] + tp[3][0],
-                                   V_match[k-1][i-1] + tp[0][0],
-                                   V_ins[k-1][i-1] + tp[1][0],
-                                   V_del[k-1][i-1] + tp[2][0]};
-               index = argmax_d(mterms, 4);
-               ptr_match[k][i] = "SMID"[index];
+          if (SANGERQUAL_TO_PHRED(bqual[i-1]) == 2) {
+               ep_match = ep_match_def;
+               ep_match_not = ep_match_not_def;
+          } else {
+               ep_match = ws->ep_match[(unsigned char)bqual[i-1]];
+               ep_match_not = ws->ep_match_not[(unsigned char)bqual[i-1]];
+          }
+
+          cur_m[0] = cur_i[0] = cur_d[0] = INT_MIN;
+          cur_m[w+1] = cur_i[w+1] = cur_d[w+1] = INT_MIN;
+          for (j = 0; j < w; j++) {
+               double mterms[4], iterms[3], dterms[2];
+               int mx, ix, dx;
+
+               k = i + lo + j;
+               if (k < 1 || k >= rlen) {
+                    cur_m[j+1] = cur_i[j+1] = cur_d[j+1] = INT_MIN;
+                    row_ptr[j] = 0;
+                    continue;
+               }
+
+               /* see viterbi() for the recursion: M and I of k-1,i-1
+                * are on the same diagonal in the previous row, I of
+                * k,i-1 one diagonal up and M,D of k-1,i one diagonal
+                * down in the current row */
+               mterms[0] = vstart + tp30;
+               mterms[1] = prev_m[j+1] + tp00;
+               mterms[2] = prev_i[j+1] + tp10;
+               mterms[3] = prev_d[j+1] + tp20;
+               mx = 0;
+               if (mterms[1] > mterms[mx]) mx = 1;
+               if (mterms[2] > mterms[mx]) mx = 2;
+               if (mterms[3] > mterms[mx]) mx = 3;
                if (query[i-1] == ref[k-1]) {
-                    V_match[k][i] = ep_match + mterms[index];
+                    cur_m[j+1] = ep_match + mterms[mx];
                } else {
-                    V_match[k][i] = ep_match_not + mterms[index];
+                    cur_m[j+1] = ep_match_not + mterms[mx];
+               }
+
+               iterms[0] = vstart + tp31;
+               iterms[1] = prev_m[j+2] + tp01;
+               iterms[2] = prev_i[j+2] + tp11;
+               ix = 0;
+               if (iterms[1] > iterms[ix]) ix = 1;
+               if (iterms[2] > iterms[ix]) ix = 2;
+               cur_i[j+1] = ep_ins + iterms[ix];
+
+               dterms[0] = cur_m[j] + tp02;
+               dterms[1] = cur_d[j] + tp22;
+               dx = ARGMAX2(dterms[0], dterms[1]);
+               cur_d[j+1] = dterms[dx];
+
+               row_ptr[j] = (uint8_t)(mx | (ix<<2) | (dx<<4));
+          }
+
+          /* paths leaving the band here. none can end in this row */
+          if (! is_full && i < qlen-1) {
+               k = i + lo;
+               if (exit_lo && k >= 1 && k < rlen) {
+                    double v = (cur_m[1] > cur_i[1] ? cur_m[1] : cur_i[1]) + su[i];
+                    if (v > leak) leak = v;
+               }
+               k = i + hi;
+               if (exit_hi && k >= 1 && k < rlen) {
+                    double v = (cur_m[w] > cur_d[w] ? cur_m[w] : cur_d[w]) + su[i] - pen_right;
+                    if (v > leak) leak = v;
                }
-               
-               // V_Ik(i) = log(e_Ik(x_i)) + max( S_0(i-1) + log(a_(S_0,I_k)),
-               //                                 M_k(i-1) + log(a_(M_k,I_k)),
-               //                                 I_k(i-1) + log(a_(I_k,I_k)) )
-               
-               double iterms[3] = {V_start[i-1] + tp[3][1],
-                                   V_match[k][i-1] + tp[0][1],
-                                   V_ins[k][i-1] + tp[1][1]};
-               index = argmax_d(iterms, 3);
-               ptr_ins[k][i] = "SMI"[index];
-               V_ins[k][i] = ep_ins + iterms[index];
-               
-               // V_Dk(i) = max( M_k-1(i) + log(a_(M_k-1,D_k)),
-               //                D_k-1(i) + log(a_(D_k-1,D_k)) )
-               double dterms[2] = {V_match[k-1][i] + tp[0][2],
-                                   V_del[k-1][i] + tp[2][2]};
-               index = argmax_d(dterms, 2);
-               ptr_del[k][i] = "MD"[index];
-               V_del[k][i] = dterms[index];
-               
-               //fprintf(stderr, "k:%d, i:%d, %f, %f, %f\n", k, i, 
-               //                 V_match[k][i], V_ins[k][i], V_del[k][i]);
           }
+
+          swp = prev_m; prev_m = cur_m; cur_m = swp;
+          swp = prev_i; prev_i = cur_i; cur_i = swp;
+          swp = prev_d; prev_d = cur_d; cur_d = swp;
      }
-     
-     // Termination
+
+     // Termination: prev_* now hold row qlen-1
      // max[M_L(N), I_L(N), D_L(N)]
-     char end_state = '!';
-     double best_score = INT_MIN;
-     int best_index = 0;
-     for (k = 0; k < rlen; k++) {
-          if (V_match[k][qlen-1] > best_score) {
+     for (j = 0; j < w; j++) {
+          k = (qlen-1) + lo + j;
+          if (k < 1 || k >= rlen) {
+               continue;
+          }
+          if (prev_m[j+1] > best_score) {
                end_state = 'M';
-               best_score = V_match[k][qlen-1];
+               best_score = prev_m[j+1];
                best_index = k;
           }
-          if (V_ins[k][qlen-1] > best_score) {
+          if (prev_i[j+1] > best_score) {
                end_state = 'I';
-               best_score = V_ins[k][qlen-1];
+               best_score = prev_i[j+1];
                best_index = k;
           }
      }
-     //fprintf(stderr, "ended on %c, best_score is %f, best_index is %d\n",
-     //     end_state, best_score, best_index);
-     for (i = 0; i < rlen; i++) { 
-          free(V_match[i]);
-          free(V_ins[i]);
-          free(V_del[i]);
+     /* margin for rounding, since the bounds are summed in a
+      * different order than the path scores */
+     if (! is_full && qlen > 1 && (end_state == '!' || ! (best_score > leak + 1e-9))) {
+          return viterbi_banded(ws, ref, query, bqual, aln, quality, INT_MIN/2, INT_MAX/2);
      }
-     free(V_match);
-     free(V_ins);
-     free(V_del);
-     free(V_start);
 
      // Trace-back
      i = qlen - 1;
      k = best_index;
-     int maxslen = qlen+rlen;
-     char current_ptr = end_state;
-     char tmp_state_seq[maxslen], tmp_ref[maxslen], tmp_query[maxslen];
+     current_ptr = end_state;
+     tmp_state_seq = ws->tmp;
+     tmp_ref = tmp_state_seq + maxslen;
+     tmp_query = tmp_ref + maxslen;
      tmp_state_seq[qlen+rlen-1] = tmp_ref[qlen+rlen-1] = tmp_query[qlen+rlen-1] = '\0';
-     int si = qlen+rlen-2;
-     
+     si = qlen+rlen-2;
+
      while (i != 0 && k != 0) {
+          uint8_t p = 0;
+
           tmp_state_seq[si] = current_ptr;
           if (current_ptr == 'S') {
                break;
-          } else if (current_ptr == 'M') {
+          }
+          if (current_ptr == 'M' || current_ptr == 'I' || current_ptr == 'D') {
+               j = k - i - lo;
+               p = ptr[(size_t)i * w + j];
+          }
+          if (current_ptr == 'M') {
                tmp_ref[si] = ref[k-1];
                tmp_query[si] = query[i-1];
-               current_ptr = ptr_match[k][i];
+               current_ptr = "SMID"[p & 3];
                i -= 1;
                k -= 1;
           } else if (current_ptr == 'I') {
                tmp_ref[si] = '*';
                tmp_query[si] = query[i-1];
-               current_ptr = ptr_ins[k][i];
+               current_ptr = "SMI"[(p>>2) & 3];
                i -= 1;
           } else if (current_ptr == 'D') {
                tmp_ref[si] = ref[k-1];
                tmp_query[si] = '*';
-               current_ptr = ptr_del[k][i];
+               current_ptr = "MD"[(p>>4) & 1];
                k -= 1;
           } else {
                return -1;
           }
           si--;
      }
-     for (i=0; i<rlen; i++) {
-          free(ptr_match[i]);
-          free(ptr_ins[i]);
-          free(ptr_del[i]);
-     }
-     free(ptr_match);
-     free(ptr_ins);
-     free(ptr_del);
-
 
      {
           char *state_seq = tmp_state_seq+si+1;
           char *new_ref = tmp_ref+si+1;
           char *new_query = tmp_query+si+1;
-          //fprintf(stderr, "ref:%s, query:%s, state_seq:%s\n", ref+1, query+1, state_seq);
           int state_seq_len = strlen(state_seq);
-          char *new_state_seq = malloc(sizeof(char)*(state_seq_len+1));
-          left_align_indels(new_ref, new_query, state_seq_len, new_state_seq);
-          
+          /* new_state_seq can reuse tmp_state_seq since
+           * left_align_indels() works on copies */
+          left_align_indels(new_ref, new_query, state_seq_len, state_seq);
           if (aln) {
-               strcpy(aln, new_state_seq);
+               strcpy(aln, state_seq);
           }
-     
-          free(new_state_seq);
      }
 
-    return k;
+     return k;
+}
+/* viterbi_banded() */
+
+
+/* bqual is the base quality phred score representation as string. so use SANGERQUAL_TO_PROB for conversion */
+int viterbi(char *ref, char *query, char *bqual, char *aln, int quality)
+{
+     viterbi_ws_t ws;
+     int ret;
 
+     viterbi_ws_init(&ws);
+     ret = viterbi_banded(&ws, ref, query, bqual, aln, quality, INT_MIN/2, INT_MAX/2);
+     viterbi_ws_free(&ws);
+     return ret;
 }
 
 int viterbi_test()
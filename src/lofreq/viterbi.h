@@ -27,6 +27,33 @@
 
 #ifndef VITERBI_H
 #define VITERBI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* reusable buffers and precomputed tables for viterbi_banded(). one
+ * per thread. to be initialized with viterbi_ws_init() */
+typedef struct {
+     double *rows; /* two rows of scores per state */
+     size_t rows_cap;
+     uint8_t *ptr; /* packed traceback pointers */
+     size_t ptr_cap;
+     char *tmp; /* traceback strings */
+     size_t tmp_cap;
+     double *ub; /* score upper bounds for the rest of the query per row */
+     size_t ub_cap;
+     int no_band; /* always compute the full matrix. for testing */
+     int tp_rlen; /* ref length tp was computed for or -1 */
+     double tp[5][5]; /* transition log-probabilities */
+     double ep_match[256]; /* emission log-probabilities per sanger qual char */
+     double ep_match_not[256];
+} viterbi_ws_t;
+
+void viterbi_ws_init(viterbi_ws_t *ws);
+void viterbi_ws_free(viterbi_ws_t *ws);
+int viterbi_banded(viterbi_ws_t *ws, const char *ref, const char *query,
+                   const char *bqual, char *aln, int quality,
+                   int diag_lo, int diag_hi);
 int left_align_indels(char *sref, char *squery, int slen, char *res);
 int viterbi(char *ref, char *query, char *bqual, char *aln, int quality);
 int viterbi_test();
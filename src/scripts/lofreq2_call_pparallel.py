@@ -19,7 +19,6 @@ import multiprocessing
 import tempfile
 import shutil
 import os
-import gzip
 from collections import namedtuple
 
 #--- third-party imports
@@ -129,47 +128,41 @@ def read_bed_coords(fbed):
             yield (chrom, start, end)
 
 
-def total_num_tests_from_logs(log_files):
-    """Extract number of performed tests from all log files and
-    returns their sum (for multiple testing correction)
+def total_num_tests_from_manifests(manifest_files):
+    """Extract number of performed tests from all shard manifests (see
+    lofreq call --manifest) and returns their sum (for multiple
+    testing correction)
     """
 
     total_num_snv_tests = 0
     total_num_indel_tests = 0
-    for f in log_files:
+    for f in manifest_files:
+        fields = dict()
         fh = open(f, 'r')
-        num_snv_tests_found = False
-        num_indel_tests_found = False
-
         for line in fh:
-            if line.startswith('Number of substitution tests performed'):
-                num_snv_tests = int(line.split(':')[1])
-                total_num_snv_tests += num_snv_tests
-                num_snv_tests_found = True
-            if line.startswith('Number of indel tests performed'):
-                num_indel_tests = int(line.split(':')[1])
-                total_num_indel_tests += num_indel_tests
-                num_indel_tests_found = True
-        if not num_snv_tests_found:
-            LOG.fatal("Didn't find number of snv tests in log-file %s" % (f))
-            return (-1, -1)
-        if not num_indel_tests_found:
-            LOG.fatal("Didn't find number of indel tests in log-file %s" % (f))
-            return (-1, -1)
-
+            (key, val) = line.rstrip('\n').split('\t', 1)
+            fields[key] = val
         fh.close()
+        if 'num_snv_tests' not in fields or 'num_indel_tests' not in fields:
+            LOG.fatal("Didn't find number of tests in manifest %s" % (f))
+            return (-1, -1)
+        total_num_snv_tests += int(fields['num_snv_tests'])
+        total_num_indel_tests += int(fields['num_indel_tests'])
 
     return (total_num_snv_tests, total_num_indel_tests)
 
 
-def concat_vcf_files(vcf_files, vcf_out, source=None):
-    """FIXME source unused
+def merge_vcf_files(manifest_files, vcf_out, no_mtc=False):
+    """Merge shard vcf files with lofreq merge, which also applies
+    multiple testing correction over all shards, unless no_mtc
     """
 
-    assert not os.path.exists(vcf_out)
+    assert vcf_out == "-" or not os.path.exists(vcf_out)
 
-    cmd = ['lofreq', 'vcfset', '-a', 'concat', '-o', vcf_out, '-1']
-    cmd.extend(vcf_files)
+    cmd = ['lofreq', 'merge', '-o', vcf_out]
+    if no_mtc:
+        cmd.append('--no-mtc')
+    cmd.extend(manifest_files)
     try:
         subprocess.check_call(cmd)
     except subprocess.CalledProcessError as e:
@@ -289,6 +282,35 @@ def bins_from_bamheader(bam):
     return [(x[0], 0, x[1]) for x in sq_list]
 
 
+def bins_from_binplan(bam, num_bins):
+    """Returns regions/bins of about equal calling work (as estimated
+    from the bam index by lofreq binplan) as 4-tuples of chrom, start,
+    end and work.
+    """
+
+    assert os.path.exists(bam), ("BAM file %s does not exist" % bam)
+    cmd = 'lofreq binplan -n %d %s' % (num_bins, bam)
+    LOG.debug("cmd=%s" % cmd)
+    process = subprocess.Popen(cmd.split(),
+                               shell=False,
+                               stdout=subprocess.PIPE,
+                               stderr=subprocess.PIPE)
+    (stdoutdata, stderrdata) = process.communicate()
+
+    retcode = process.returncode
+    if retcode != 0:
+        LOG.fatal("%s exited with error code '%d'." \
+                  " Command was '%s'. stderr was: '%s'" % (
+                      cmd.split()[0], retcode, cmd, stderrdata))
+        raise OSError
+
+    bins = []
+    for line in str.splitlines(stdoutdata):
+        (chrom, start, end, work) = line.rstrip().split('\t')
+        bins.append((chrom, int(start), int(end), float(work)))
+    return bins
+
+
 def lofreq_cmd_per_bin(lofreq_call_args, bins, tmp_dir):
     """Returns argument for one lofreq call per bins (Regions()).
     Order is by length byt file naming is according to input order
@@ -307,8 +329,8 @@ def lofreq_cmd_per_bin(lofreq_call_args, bins, tmp_dir):
         reg_str = "%s:%d-%d" % (b.chrom, b.start+1, b.end)
         cmd = ' '.join(lofreq_call_args)
         cmd += ' --no-default-filter'# needed here whether user-arg or not
-        cmd += ' -r "%s" -o %s/%d.vcf.gz > %s/%d.log 2>&1' % (
-            reg_str, tmp_dir, i, tmp_dir, i)
+        cmd += ' -r "%s" -o %s/%d.vcf.gz --manifest %s/%d.manifest > %s/%d.log 2>&1' % (
+            reg_str, tmp_dir, i, tmp_dir, i, tmp_dir, i)
         #LOG.warn("DEBUG: yielding %s" % cmd)
         yield cmd
 
@@ -564,10 +586,26 @@ def main():
             bed_sqs = set([b[0] for b in bed_bins])
             bins = [b for b in bam_bins if b[0] in bed_sqs]
             lofreq_call_args.extend(['-l', bed_file])
+            use_binplan = True
         else:
             bins = bed_bins
+            use_binplan = False
     else:
         bins = bam_bins
+        use_binplan = True
+
+    # bam bins are planned by lofreq binplan, i.e. split by coverage
+    # as given by the index, so that deep regions (e.g. amplicons)
+    # don't end up in one long running bin. bed bins are split by
+    # length below
+    presplit = False
+    if use_binplan:
+        sqs = set([b[0] for b in bins])
+        plan = [Region._make(x[0:3]) for x in bins_from_binplan(
+            bam, BIN_PER_THREAD*num_threads) if x[0] in sqs]
+        if len(plan):
+            bins = plan
+            presplit = True
 
     for (i, b) in enumerate(bins):
         LOG.debug("initial bins: #%d %s %d %d len %d" % (
@@ -578,7 +616,7 @@ def main():
     # even after split
     #
     total_length = sum([region_length(b) for b in bins])
-    while True:
+    while not presplit:
         #  inefficient but doesn't matter in practice: should split
         #  max and insert new elements
         # intelligently to avoid sorting whole list.
@@ -652,78 +690,58 @@ def main():
         LOG.fatal("Some commands in pool failed. Can't continue")
         sys.exit(1)
 
-    # concat the output by number
+    # merge the output by number in one streaming pass. number of
+    # tests come from the shard manifests
     #
-    vcf_concat = os.path.join(tmp_dir, "concat.vcf.gz")
-    # maintain order
     vcf_files = [os.path.join(tmp_dir, "%d.vcf.gz" % no)
                  for no in range(len(cmd_list))]
-    if not all([os.path.exists(f) for f in vcf_files]):
-        LOG.fatal("Missing some vcf output from threads")
+    manifest_files = [os.path.join(tmp_dir, "%d.manifest" % no)
+                      for no in range(len(cmd_list))]
+    if not all([os.path.exists(f) for f in vcf_files + manifest_files]):
+        LOG.fatal("Missing some vcf output or manifests from threads")
         sys.exit(1)
-    concat_vcf_files(vcf_files, vcf_concat,
-                     "##source=%s" % ' '.join(sys.argv))
 
-    # filtering
-    #
-    log_files = [os.path.join(tmp_dir, "%d.log" % no)
-                 for no in range(len(cmd_list))]
-    num_snv_tests, num_indel_tests = total_num_tests_from_logs(log_files)
+    num_snv_tests, num_indel_tests = total_num_tests_from_manifests(manifest_files)
     if num_snv_tests == -1 or num_indel_tests == -1:
         sys.exit(1)
     # same as in lofreq_call.c and used by lofreq2_somatic.py
     sys.stderr.write("Number of substitution tests performed: %d\n" % num_snv_tests)
     sys.stderr.write("Number of indel tests performed: %d\n" % num_indel_tests)
 
-    cmd = ['lofreq', 'filter', '-i', vcf_concat, '-o', final_vcf_out]
-    if no_default_filter:
-        cmd.append('--no-defaults')
-
-    if bonf_opt == 'dynamic':
-        # if bonf was computed dynamically, use bonf sum
-        sub_bonf = num_snv_tests
-        indel_bonf = num_indel_tests
-        if sub_bonf == 0:
-            sub_bonf = 1
-        if indel_bonf == 0:
-            indel_bonf = 1
-        sub_phredqual = prob_to_phredqual(sig_opt/float(sub_bonf))
-        indel_phredqual = prob_to_phredqual(sig_opt/float(indel_bonf))
-        cmd.extend(['--snvqual-thresh', "%s" % sub_phredqual])
-        cmd.extend(['--indelqual-thresh', "%s" % indel_phredqual])
-
-    elif bonf_opt == 'auto':
+    if bonf_opt == 'auto':
         raise NotImplementedError
 
-    if bonf_opt not in ['auto', 'dynamic'] and no_default_filter:
-        # if bonf_opt was a fixed int, then it was already used properly and
-        # there's no need to filter against snv qual. if furthermore,
-        # --no-defaults is given we then don't filter at all
-        #
-        LOG.info("Copying concatenated vcf file to final destination")
-        LOG.debug("vcf_concat=%s final_vcf_out=%s" % (vcf_concat, final_vcf_out))
-
-        if final_vcf_out == "-":
-            fh_in = gzip.open(vcf_concat, 'r')
-            fh_out = sys.stdout
-            shutil.copyfileobj(fh_in, fh_out)
-            fh_in.close()
-        else:
-            # check again if final output doesn't exist, just to be sure
-            if os.path.exists(final_vcf_out):
-                LOG.fatal("Cowardly refusing to overwrite %s with %s" % (
-                    final_vcf_out, vcf_concat))
-                sys.exit(1)
-
-            shutil.copy(vcf_concat, final_vcf_out)
-
-            # try to copy index as well if exists
-            tidx_src = vcf_concat + ".tbi"
-            if os.path.exists(tidx_src):
-                tidx_dst = final_vcf_out + ".tbi"
-                shutil.copy(tidx_src, tidx_dst)
+    if no_default_filter:
+        # lofreq merge applies the Bonferroni correction for all
+        # shards (unless bonf was fixed and therefore already
+        # applied), so there's nothing left to filter
+        if final_vcf_out != "-" and os.path.exists(final_vcf_out):
+            LOG.fatal("Cowardly refusing to overwrite %s" % (final_vcf_out))
+            sys.exit(1)
+        LOG.info("Merging vcf files into final destination")
+        merge_vcf_files(manifest_files, final_vcf_out)
 
     else:
+        # default filters need all variants (e.g. for multiple
+        # testing correction of strand bias). so just merge and apply
+        # snv quality thresholds in the same filter run
+        vcf_concat = os.path.join(tmp_dir, "concat.vcf.gz")
+        merge_vcf_files(manifest_files, vcf_concat, no_mtc=True)
+
+        cmd = ['lofreq', 'filter', '-i', vcf_concat, '-o', final_vcf_out]
+        if bonf_opt == 'dynamic':
+            # if bonf was computed dynamically, use bonf sum
+            sub_bonf = num_snv_tests
+            indel_bonf = num_indel_tests
+            if sub_bonf == 0:
+                sub_bonf = 1
+            if indel_bonf == 0:
+                indel_bonf = 1
+            sub_phredqual = prob_to_phredqual(sig_opt/float(sub_bonf))
+            indel_phredqual = prob_to_phredqual(sig_opt/float(indel_bonf))
+            cmd.extend(['--snvqual-thresh', "%s" % sub_phredqual])
+            cmd.extend(['--indelqual-thresh', "%s" % indel_phredqual])
+
         cmd = ' '.join(cmd)# subprocess.call takes string
         LOG.info("Executing %s\n" % (cmd))
         if subprocess.call(cmd, shell=True):
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# columns without alt evidence are skipped before being compiled when
+# calling. --stats-all-cols compiles every column, which must not
+# change calls. -a 1 reports every column with alt evidence
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter -a 1 -b 1 -f $reffa -l $bed -o $outdir/skip.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --no-default-filter -a 1 -b 1 -f $reffa -l $bed -o $outdir/all.vcf --stats-out $outdir/all.lps --stats-all-cols $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+if [ $(grep -vc '^#' $outdir/skip.vcf) -eq 0 ]; then
+    echoerror "No variants called. Check $outdir"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/skip.vcf) <(grep -v '^#' $outdir/all.vcf) >/dev/null; then
+    echoerror "Skipping columns without alt evidence changed calls. Check $outdir"
+    exit 1
+fi
+echook "Skipping columns without alt evidence doesn't change calls"
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else
+    rm $outdir/*
+    rmdir $outdir
+fi
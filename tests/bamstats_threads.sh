@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Counting BAM stats in several threads or as side pass of lofreq call
+# (--bamstats) must give the same result as counting in one thread
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ bamstats -f $reffa -o $outdir/stats_1.txt $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! grep -q '^# Reads used for counting' $outdir/stats_1.txt; then
+    echoerror "No reads counted in $outdir/stats_1.txt"
+    exit 1
+fi
+
+cmd="$LOFREQ bamstats --threads 4 -f $reffa -o $outdir/stats_4.txt $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q $outdir/stats_1.txt $outdir/stats_4.txt >/dev/null; then
+    echoerror "BAM stats counted with 4 threads differ from those counted with one. Check $outdir"
+    exit 1
+fi
+echook "BAM stats counted with one and four threads are identical"
+
+for opts in "" "--threads 2"; do
+    out=$outdir/stats_call.txt
+    cmd="$LOFREQ call --no-default-filter $opts --bamstats $out -f $reffa -o $outdir/raw.vcf $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    if ! diff -q $outdir/stats_1.txt $out >/dev/null; then
+        echoerror "BAM stats from lofreq call $opts differ from those of lofreq bamstats. Check $outdir"
+        exit 1
+    fi
+    rm $out $outdir/raw.vcf
+done
+echook "BAM stats from lofreq call and lofreq bamstats are identical"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
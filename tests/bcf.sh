@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# BCF output and input (by extension) has to give the same variants
+# as VCF. values like AF are only compared numerically, since htslib
+# formats them differently
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+# chrom, pos, ref, alt, filter, DP, AF (rounded) and DP4
+vars() {
+    grep -v '^#' $1 | awk '{dp=""; af=""; dp4="";
+      n=split($8, a, ";"); for (i=1; i<=n; i++) {split(a[i], kv, "=");
+        if (kv[1]=="DP") {dp=kv[2]} else if (kv[1]=="AF") {af=sprintf("%.5f", kv[2])} else if (kv[1]=="DP4") {dp4=kv[2]}}
+      print $1, $2, $4, $5, $7, dp, af, dp4}'
+}
+
+cmd="$LOFREQ call -f $reffa -o $outdir/calls.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call -f $reffa -o $outdir/calls.bcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if [ ! -s $outdir/calls.bcf.csi ]; then
+    echoerror "No index created for $outdir/calls.bcf"
+    exit 1
+fi
+
+# BCF in, VCF out
+cmd="$LOFREQ filter --no-defaults -i $outdir/calls.bcf -o $outdir/from_bcf.vcf"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(vars $outdir/calls.vcf) <(vars $outdir/from_bcf.vcf) >/dev/null; then
+    echoerror "Variants read back from BCF differ. Check $outdir"
+    exit 1
+fi
+echook "lofreq call BCF output gives the same variants"
+
+# BCF in and out, with filtering, and VCF to BCF conversion
+cmd="$LOFREQ filter -v 100 -i $outdir/calls.bcf -o $outdir/filtered.bcf"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ filter -v 100 -i $outdir/calls.vcf -o $outdir/filtered.vcf"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ vcfset -a concat -1 $outdir/filtered.bcf -o $outdir/filtered_concat.vcf"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(vars $outdir/filtered.vcf) <(vars $outdir/filtered_concat.vcf) >/dev/null; then
+    echoerror "Filtering BCF gave different variants than filtering VCF. Check $outdir"
+    exit 1
+fi
+echook "lofreq filter and vcfset handle BCF input and output"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm -f $outdir/*
+    rmdir $outdir
+fi
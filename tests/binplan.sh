@@ -0,0 +1,67 @@
+#!/bin/bash
+
+# lofreq binplan bins have to cover all sequences with reads without
+# gaps or overlaps. threaded calls (which plan chunks the same way)
+# must not depend on the number of threads
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+bins=$outdir/bins.txt
+cmd="$LOFREQ binplan -n 4 $bam"
+if ! eval $cmd > $bins 2>> $log; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if [ ! -s $bins ]; then
+    echoerror "lofreq binplan produced no bins for $bam"
+    exit 1
+fi
+# bins of one sequence have to be contiguous, start at 0 and end at
+# sequence length
+sqlen=$($LOFREQ idxstats $bam | awk '$1!="*" && $3>0 {printf "%s:%d ", $1, $2}')
+res=$(awk -v sqlen="$sqlen" '
+  BEGIN {n=split(sqlen, a, " "); for (i=1; i<=n; i++) {split(a[i], b, ":"); len[b[1]]=b[2]}}
+  {if ($1!=chrom) {if (chrom!="" && last!=len[chrom]) {print "incomplete " chrom}; if ($2!=0) {print "gap " $0}}
+   else if ($2!=last) {print "gap " $0};
+   if ($3<=$2) {print "empty " $0};
+   chrom=$1; last=$3}
+  END {if (last!=len[chrom]) {print "incomplete " chrom}}' $bins)
+if [ -n "$res" ]; then
+    echoerror "lofreq binplan bins are not contiguous: $res. Check $bins"
+    exit 1
+fi
+echook "lofreq binplan bins are contiguous"
+
+cmd="$LOFREQ call --no-default-filter -f $reffa -o $outdir/raw_t1.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --no-default-filter --threads 3 -f $reffa -o $outdir/raw_t3.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/raw_t1.vcf) <(grep -v '^#' $outdir/raw_t3.vcf) >/dev/null; then
+    echoerror "Calls with one and three threads differ. Check $outdir"
+    exit 1
+fi
+echook "Calls with work planned chunks are identical to single threaded calls"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -12,7 +12,7 @@ bam=$basedir/denv2-pseudoclonal.bam
 reffa=$basedir/denv2-pseudoclonal_cons.fa
 
 outdir=$(mktemp -d -t $(basename $0).XXXXXX)
-# not supported anymore out_auto=$outdir/snv_auto.vcf
+out_auto=$outdir/snv_auto.vcf.gz
 out_dynamic=$outdir/snv_dynamic.vcf.gz
 # bed_len.sh $be;# = 9909 * 3 = 29727
 out_29727=$outdir/snv_29727.vcf.gz
@@ -20,11 +20,11 @@ log=$outdir/log.txt
 
 KEEP_TMP=0
 
-#cmd="$LOFREQ call -l $bed -b auto -f $reffa -o $out_auto $bam"
-#if ! eval $cmd >> $log 2>&1; then
-#    echoerror "The following command failed (see $log for more): $cmd"
-#    exit 1
-#fi
+cmd="$LOFREQ call -l $bed -b auto -f $reffa -o $out_auto $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
 
 cmd="$LOFREQ call -l $bed -b dynamic -f $reffa -o $out_dynamic $bam"
 if ! eval $cmd >> $log 2>&1; then
@@ -42,31 +42,31 @@ fi
 
 # make sure we got at least some snvs
 # 
-#if [ $(grep -c '^[^#]' $out_auto) -eq 0 ]; then
-#    echoerror "No SNVs predicted"
-#    exit 1
-#fi
+if [ $(zgrep -c '^[^#]' $out_auto) -eq 0 ]; then
+    echoerror "No SNVs predicted"
+    exit 1
+fi
 
 #echodebug "out_auto=$out_auto"
 #echodebug "out_dynamic=$out_dynamic"
 #echodebug "out_29727=$out_29727"
 
-#ndiff=$($LOFREQ vcfset -a complement -1 $out_auto -2 $out_dynamic 2>>$log | grep -c '^[^#]')
-#if [ $ndiff -ne 0 ]; then
-#    echoerror "Found differences between bonf auto and bonf dynamic outputs"
-#    exit 1
-#fi
+ndiff=$($LOFREQ vcfset -a complement -1 $out_auto -2 $out_dynamic 2>>$log | grep -c '^[^#]')
+if [ $ndiff -ne 0 ]; then
+    echoerror "Found differences between bonf auto and bonf dynamic outputs"
+    exit 1
+fi
 #ndiff=$($LOFREQ vcfset -a complement -2 $out_dynamic -1 $out_auto 2>>$log | grep -c '^[^#]')
 #if [ $ndiff -ne 0 ]; then
 #    echoerror "Found differences between bonf auto and bonf dynamic outputs"
 #    exit 1
 #fi
 
-#ndiff=$($LOFREQ vcfset -a complement -1 $out_auto -2 $out_29727 2>>$log | grep -c '^[^#]')
-#if [ $ndiff -ne 0 ]; then
-#    echoerror "Found differences between bonf auto and bonf 29727 outputs"
-#    exit 1
-#fi
+ndiff=$($LOFREQ vcfset -a complement -1 $out_auto -2 $out_29727 2>>$log | grep -c '^[^#]')
+if [ $ndiff -ne 0 ]; then
+    echoerror "Found differences between bonf auto and bonf 29727 outputs"
+    exit 1
+fi
 
 ndiff=$($LOFREQ vcfset -a complement -2 $out_29727 -1 $out_dynamic 2>>$log | grep -c '^[^#]')
 if [ $ndiff -ne 0 ]; then
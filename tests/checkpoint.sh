@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# calls of a run that got killed and was then resumed from its
+# checkpoint must be identical to those of an uninterrupted run
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call -f $reffa -o $outdir/full.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+# checkpointing itself must not change anything
+cmd="$LOFREQ call -f $reffa -o $outdir/ck.vcf --checkpoint $outdir/ck --checkpoint-interval 0 --resume $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/full.vcf) <(grep -v '^#' $outdir/ck.vcf) >/dev/null; then
+    echoerror "Calls with checkpoints differ from calls without. Check $outdir"
+    exit 1
+fi
+if [ -e $outdir/ck ] || [ -e $outdir/ck.vcf.vcf ]; then
+    echoerror "Checkpoint wasn't removed after successful run"
+    exit 1
+fi
+echook "Calls with checkpoints are identical to calls without"
+
+# kill a run after it wrote its first checkpoint and resume it
+cmd="$LOFREQ call -f $reffa -o $outdir/resumed.vcf --checkpoint $outdir/res --checkpoint-interval 0 $bam"
+eval $cmd >> $log 2>&1 &
+pid=$!
+while kill -0 $pid 2>/dev/null && [ ! -s $outdir/res ]; do
+    sleep 0.01
+done
+kill -9 $pid 2>/dev/null
+wait $pid 2>/dev/null
+if [ ! -e $outdir/res ]; then
+    echowarn "Run finished before it could be killed. Not testing resume"
+else
+    # a run killed while filtering leaves partial output behind
+    rm -f $outdir/resumed.vcf
+    cmd="$LOFREQ call -f $reffa -o $outdir/resumed.vcf --checkpoint $outdir/res --resume $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    if ! diff -q <(grep -v '^#' $outdir/full.vcf) <(grep -v '^#' $outdir/resumed.vcf) >/dev/null; then
+        echoerror "Calls of resumed run differ from calls of uninterrupted run. Check $outdir"
+        exit 1
+    fi
+    echook "Calls of resumed run are identical to calls of uninterrupted run"
+fi
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm -f $outdir/*
+    rmdir $outdir
+fi
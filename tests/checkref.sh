@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# checkref with M5 tags: matching digests pass (and get cached next
+# to the fasta file), mismatching ones fail
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa_orig=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+# cache is created next to the fasta file, so work on a copy
+reffa=$outdir/ref.fa
+cp $reffa_orig $reffa
+cmd="$LOFREQ faidx $reffa"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+cmd="$LOFREQ checkref $reffa $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "checkref failed (see $log for more): $cmd"
+    exit 1
+fi
+echook "checkref passes on lengths"
+
+# --md5 is only compiled in with htslib >= 1.3
+if ! $LOFREQ checkref 2>&1 | grep -q -- '--md5'; then
+    echowarn "checkref was built without --md5 support. Skipping test"
+    rm -f $outdir/*
+    rmdir $outdir
+    exit 0
+fi
+
+# single sequence reference
+md5=$(grep -v '^>' $reffa | tr -d '\n' | tr 'a-z' 'A-Z' | md5sum | cut -d ' ' -f 1)
+for m5 in $md5 00000000000000000000000000000000; do
+    cmd="samtools view -H $bam | sed -e \"/^@SQ/s/\$/\tM5:$m5/\" > $outdir/header.sam && samtools reheader $outdir/header.sam $bam > $outdir/m5_$m5.bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echowarn "Couldn't reheader $bam with samtools. Skipping test"
+        exit 0
+    fi
+done
+
+cmd="$LOFREQ checkref --md5 $reffa $outdir/m5_$md5.bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "checkref --md5 failed on matching digest (see $log for more): $cmd"
+    exit 1
+fi
+if [ ! -s $reffa.md5 ]; then
+    echoerror "No digest cache created for $reffa"
+    exit 1
+fi
+# again, now from cache
+cmd="$LOFREQ checkref --md5 $reffa $outdir/m5_$md5.bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "checkref --md5 failed on matching digest from cache (see $log for more): $cmd"
+    exit 1
+fi
+echook "checkref --md5 passes on matching digest"
+
+if $LOFREQ checkref --md5 $reffa $outdir/m5_00000000000000000000000000000000.bam >> $log 2>&1; then
+    echoerror "checkref --md5 passed on mismatching digest"
+    exit 1
+fi
+echook "checkref --md5 fails on mismatching digest"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
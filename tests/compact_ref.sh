@@ -0,0 +1,45 @@
+#!/bin/bash
+
+# Keeping only counts of quality tuples for reference bases
+# (--compact-ref) must give identical calls, including when the
+# median reference base quality is used for alt bases (--def-alt-bq -1)
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+for opts in "" "--def-alt-bq -1" "--no-baq --src-qual"; do
+    for mode in full compact; do
+        out=$outdir/raw_${mode}.vcf
+        rm -f $out
+        extra=""
+        [ $mode == "compact" ] && extra="--compact-ref"
+        # no filtering, so that insignificant calls get compared as well
+        cmd="$LOFREQ call $opts $extra --no-default-filter -f $reffa -o $out $bam"
+        if ! eval $cmd >> $log 2>&1; then
+            echoerror "The following command failed (see $log for more): $cmd"
+            exit 1
+        fi
+    done
+    if ! diff -q <(grep -v '^#' $outdir/raw_full.vcf) <(grep -v '^#' $outdir/raw_compact.vcf) >/dev/null; then
+        echoerror "Calls with --compact-ref differ (options: '$opts'). Check $outdir"
+        exit 1
+    fi
+    echook "Calls with --compact-ref are identical (options: '$opts')"
+done
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm -f $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# coverage blocks have to cover exactly the piled up columns, without
+# overlap, and must not change the calls made in the same pass
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call -f $reffa -o $outdir/plain.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call -f $reffa -o $outdir/blocks.vcf --cov-blocks $outdir/cov.vcf --cov-bands 0,10,100,1000 $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/plain.vcf) <(grep -v '^#' $outdir/blocks.vcf) >/dev/null; then
+    echoerror "Calls made while writing coverage blocks differ. Check $outdir"
+    exit 1
+fi
+echook "Writing coverage blocks doesn't change calls"
+
+# one line per column starting with the target name
+cmd="$LOFREQ call -f $reffa --plp-summary-only $bam"
+if ! eval $cmd 2>> $log | grep -v '^ ' | cut -f 1,2 > $outdir/cols.txt; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+grep -v '^#' $outdir/cov.vcf | \
+    awk '{split($8, a, /[=;]/); for (i=$2; i<=a[2]; i++) {print $1"\t"i}}' > $outdir/blockcols.txt
+if ! diff -q $outdir/cols.txt $outdir/blockcols.txt >/dev/null; then
+    echoerror "Coverage blocks don't cover exactly the piled up columns. Check $outdir"
+    exit 1
+fi
+num_bad=$(grep -v '^#' $outdir/cov.vcf | \
+    awk '{split($8, a, /[=;]/); if (a[4]>a[6] || a[8]<0 || a[8]>1) {n++}} END {print n+0}')
+if [ "$num_bad" -ne 0 ]; then
+    echoerror "$num_bad coverage blocks with invalid depth or fraction. Check $outdir"
+    exit 1
+fi
+echook "Coverage blocks cover exactly the piled up columns"
+
+# columns without alt evidence only get their depth counted while
+# calling. has to be the same as for fully compiled columns
+cmd="$LOFREQ call -f $reffa --plp-summary-only --cov-blocks $outdir/cov_all.vcf --cov-bands 0,10,100,1000 $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/cov.vcf) <(grep -v '^#' $outdir/cov_all.vcf) >/dev/null; then
+    echoerror "Coverage blocks written while calling differ from those of all compiled columns. Check $outdir"
+    exit 1
+fi
+echook "Coverage blocks don't depend on skipped columns"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm -f $outdir/*
+    rmdir $outdir
+fi
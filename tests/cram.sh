@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Calls on CRAM have to be identical to calls on the BAM it was
+# converted from, also with bed regions and an index region
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+cram=$outdir/denv2-pseudoclonal.cram
+log=$outdir/log.txt
+
+if ! samtools view -C -T $reffa -o $cram $bam >> $log 2>&1 || ! samtools index $cram >> $log 2>&1; then
+    echowarn "Couldn't convert $bam to CRAM (samtools too old?). Skipping test"
+    exit 0
+fi
+
+reg=$(head -n 1 $reffa | sed -e 's,^>,,' -e 's, .*,,'):1000-5000
+for opts in "-l $bed" "-r $reg"; do
+    for f in $bam $cram; do
+        out=$outdir/raw_$(basename $f).vcf
+        cmd="$LOFREQ call --no-default-filter $opts -f $reffa -o $out $f"
+        if ! eval $cmd >> $log 2>&1; then
+            echoerror "The following command failed (see $log for more): $cmd"
+            exit 1
+        fi
+    done
+    if ! diff -q <(grep -v '^#' $outdir/raw_$(basename $bam).vcf) <(grep -v '^#' $outdir/raw_$(basename $cram).vcf) >/dev/null; then
+        echoerror "Calls on CRAM differ from calls on BAM with '$opts'. Check $outdir"
+        exit 1
+    fi
+    rm $outdir/raw_*.vcf
+done
+echook "Calls on CRAM and BAM are identical"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# downsampling with a fixed seed has to keep the same reads in every
+# run, independent of the number of threads
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+for run in 1 2; do
+    cmd="$LOFREQ call --no-default-filter --downsample 50 --downsample-seed 7 -f $reffa -l $bed -o $outdir/ds$run.vcf $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+done
+cmd="$LOFREQ call --no-default-filter --downsample 50 --downsample-seed 7 --threads 2 -f $reffa -l $bed -o $outdir/ds_t2.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+if ! grep -v '^#' $outdir/ds1.vcf | grep -q 'DSF='; then
+    echoerror "No downsampled calls found. Check $outdir"
+    exit 1
+fi
+for f in ds2 ds_t2; do
+    if ! diff -q <(grep -v '^#' $outdir/ds1.vcf) <(grep -v '^#' $outdir/$f.vcf) >/dev/null; then
+        echoerror "Downsampling with the same seed gave different results ($f). Check $outdir"
+        exit 1
+    fi
+done
+echook "Downsampling with a fixed seed is reproducible"
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else
+    rm $outdir/*
+    rmdir $outdir
+fi
@@ -119,6 +119,29 @@ if [ $num_exp -ne $num_out ]; then
     let num_fails=num_fails+1
 fi
 
+# single pass (spilling) vs two pass MTC and streaming from stdin
+#
+for opts in "--sb-mtc fdr --snvqual-mtc bonf" "--only-snvs --snvqual-mtc holmbonf --print-all" "--indelqual-mtc fdr --sb-incl-indels --sb-mtc bonf"; do
+    md5_spill=$($FILTER -i $VCF $opts --spill | grep -v '^##' | md5sum)
+    md5_nospill=$($FILTER -i $VCF $opts --no-spill | grep -v '^##' | md5sum)
+    md5_stdin=$($zcat $VCF | $FILTER $opts | grep -v '^##' | md5sum)
+    if [ "$md5_spill" != "$md5_nospill" ] || [ "$md5_spill" != "$md5_stdin" ]; then
+        echoerror "Spilling and two-pass filtering differ for $opts"
+        let num_fails=num_fails+1
+    fi
+done
+
+# multi-threaded vs single-threaded filtering (with and without MTC)
+#
+for opts in "" "--print-all -v 10 -a 0.01 -B 10" "--sb-mtc fdr --snvqual-mtc bonf" "--only-indels --indelqual-mtc fdr --no-spill"; do
+    md5_single=$($FILTER -i $VCF $opts | grep -v '^##' | md5sum)
+    md5_threads=$($FILTER -i $VCF $opts --threads 4 --bgzf-threads 2 | grep -v '^##' | md5sum)
+    if [ "$md5_single" != "$md5_threads" ]; then
+        echoerror "Multi-threaded and single-threaded filtering differ for $opts"
+        let num_fails=num_fails+1
+    fi
+done
+
 if [ $num_fails -gt 0 ];then
     echoerror "$num_fails tests failed"
 else
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Reading BAM input ahead (--io-threads) must not change calls, also
+# not in combination with bed queries and threaded calling
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter -f $reffa -l $bed -o $outdir/raw_plain.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+for opts in "--io-threads 1" "--io-threads 4" "--io-threads 2 --threads 2"; do
+    out=$outdir/raw_io.vcf
+    cmd="$LOFREQ call --no-default-filter $opts -f $reffa -l $bed -o $out $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    if ! diff -q <(grep -v '^#' $outdir/raw_plain.vcf) <(grep -v '^#' $out) >/dev/null; then
+        echoerror "Calls with '$opts' differ from calls without. Check $outdir"
+        exit 1
+    fi
+    rm $out
+done
+echook "Calls with and without read-ahead are identical"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# calls on two regions (shards) merged with lofreq merge must be
+# identical to one call on the whole file, since merge applies the
+# Bonferroni correction for the tests of all shards
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter -f $reffa -o $outdir/full.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+read sq sqlen <<< $($LOFREQ idxstats $bam | awk '$1!="*" {print $1, $2; exit}')
+half=$((sqlen/2))
+i=0
+for reg in "$sq:1-$half" "$sq:$((half+1))-$sqlen"; do
+    i=$((i+1))
+    cmd="$LOFREQ call --no-default-filter -f $reffa -r $reg -o $outdir/shard$i.vcf.gz --manifest $outdir/shard$i.manifest $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+done
+
+# arguments in reverse order to make sure merge sorts
+cmd="$LOFREQ merge -o $outdir/merged.vcf $outdir/shard2.manifest $outdir/shard1.manifest"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/full.vcf) <(grep -v '^#' $outdir/merged.vcf) >/dev/null; then
+    echoerror "Merged shard calls differ from calls on the whole file. Check $outdir"
+    exit 1
+fi
+echook "Merged shard calls are identical to calls on the whole file"
+
+# a modified shard has to be rejected
+zcat $outdir/shard1.vcf.gz | head -n -1 | gzip -c > $outdir/shard1.tmp.vcf.gz
+mv $outdir/shard1.tmp.vcf.gz $outdir/shard1.vcf.gz
+cmd="$LOFREQ merge -o $outdir/merged2.vcf $outdir/shard1.manifest $outdir/shard2.manifest"
+if eval $cmd >> $log 2>&1; then
+    echoerror "lofreq merge didn't reject a modified shard"
+    exit 1
+fi
+echook "lofreq merge rejects modified shards"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm -f $outdir/*
+    rmdir $outdir
+fi
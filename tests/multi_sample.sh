@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Make sure calling several BAM files in one run produces the same
+# results as calling them one by one
+
+source lib.sh || exit 1
+
+
+BAM_N=data/somatic_CHH966_chr22/CHH966-normal-100x-100pur-hg19.chr22-bed-only.bam
+BAM_T=data/somatic_CHH966_chr22/CHH966-tumor-100x-10pur-hg19.chr22-bed-only.bam
+BED=data/somatic_CHH966_chr22/SeqCap_EZ_Exome_v3_primary_lib_extend_no_overlap_minus300.chr22.bed
+REF=data/somatic_CHH966_chr22/hg19_chr22.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call -f $REF -l $BED -o $outdir/multi_ --verbose $BAM_N $BAM_T"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+for bam in $BAM_N $BAM_T; do
+    name=$(basename $bam .bam)
+    single=$outdir/single_${name}.vcf.gz
+    multi=$outdir/multi_${name}.vcf.gz
+
+    cmd="$LOFREQ call -f $REF -l $BED -o $single $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+
+    if [ ! -s $multi ]; then
+        echoerror "Missing output $multi for $bam"
+        exit 1
+    fi
+    nms=$($LOFREQ vcfset -a complement -1 $multi -2 $single --count-only)
+    nsm=$($LOFREQ vcfset -a complement -2 $multi -1 $single --count-only)
+    if [ $nms -ne 0 ] || [ $nsm -ne 0 ] ; then
+        echoerror "Observed some difference between multi-sample and single run for $bam. Check $multi and $single"
+        exit 1
+    else
+        echook "Multi-sample and single run give identical results for $bam."
+    fi
+done
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
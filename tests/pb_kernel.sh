@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Make sure the linear Poisson-binomial kernel (--pb-kernel linear)
+# gives the same calls as the default (log) one and that qualities
+# agree within tolerance
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+# max allowed difference in phred-scaled quality
+MAX_QUAL_DIFF=1
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+outraw_log=$outdir/raw_log.vcf
+outraw_linear=$outdir/raw_linear.vcf
+log=$outdir/log.txt
+
+for kernel in log linear; do
+    out=$outdir/raw_${kernel}.vcf
+    # no filtering, so that insignificant calls get compared as well
+    cmd="$LOFREQ call --pb-kernel $kernel --no-default-filter -f $reffa -l $bed -o $out $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+done
+
+
+n1=$($LOFREQ vcfset -a complement -1 $outraw_log -2 $outraw_linear --count-only)
+n2=$($LOFREQ vcfset -a complement -2 $outraw_log -1 $outraw_linear --count-only)
+if [ $n1 -ne 0 ] || [ $n2 -ne 0 ] ; then
+    echoerror "Observed some difference between log and linear kernel calls. Check $outraw_log and $outraw_linear"
+    exit 1
+else
+    echook "Log and linear kernel give identical calls."
+fi
+
+
+ndiff=$(paste <(grep -v '^#' $outraw_log | cut -f 6) <(grep -v '^#' $outraw_linear | cut -f 6) | \
+    awk -v m=$MAX_QUAL_DIFF '{d=$1-$2; if (d<0) {d=-d}; if (d>m) {n+=1}} END {print n+0}')
+if [ $ndiff -ne 0 ]; then
+    echoerror "$ndiff qualities differ by more than $MAX_QUAL_DIFF between log and linear kernel. Check $outraw_log and $outraw_linear"
+    exit 1
+else
+    echook "Log and linear kernel qualities agree"
+fi
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source lib.sh || exit 1
+
+set -o pipefail
+
+BASEDIR=data/viterbi/
+REF=$BASEDIR/NC_011770.fa
+BAM=$BASEDIR/pseudomonas_pair_screwed_up_cigar.bam
+
+
+# lofreq prep has to give the same as the separate pipeline steps
+
+md5_pipe=$($LOFREQ viterbi -f $REF $BAM | $LOFREQ indelqual --dindel -f $REF - | \
+    $LOFREQ alnqual -b -r - $REF | samtools view - 2>/dev/null | $md5) || exit 1
+md5_prep=$($LOFREQ prep -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+if [ "$md5_pipe" != "$md5_prep" ]; then
+    echoerror "lofreq prep output differs from viterbi | indelqual | alnqual"
+    exit 1
+fi
+
+md5_prep4=$($LOFREQ prep --threads 4 -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+if [ "$md5_prep" != "$md5_prep4" ]; then
+    echoerror "Multi-threaded lofreq prep gave different output"
+    exit 1
+fi
+
+echook "lofreq prep gave same output as separate preprocessing steps"
@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Make sure --profile doesn't change calls and writes a valid JSON
+# summary with counts for the expected stages
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+out_plain=$outdir/plain.vcf
+out_prof=$outdir/prof.vcf
+prof=$outdir/profile.json
+log=$outdir/log.txt
+
+cmd="$LOFREQ call -f $reffa -l $bed -o $out_plain $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --profile $prof -f $reffa -l $bed -o $out_prof $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+
+n1=$($LOFREQ vcfset -a complement -1 $out_plain -2 $out_prof --count-only)
+n2=$($LOFREQ vcfset -a complement -2 $out_plain -1 $out_prof --count-only)
+if [ $n1 -ne 0 ] || [ $n2 -ne 0 ] ; then
+    echoerror "Profiling changed calls. Check $out_plain and $out_prof"
+    exit 1
+else
+    echook "Profiling doesn't change calls."
+fi
+
+
+if ! python -c "
+import json, sys
+p = json.load(open('$prof'))
+for s in ['bam_read', 'baq_idaq', 'compile_plp_col', 'errprobs', 'dp']:
+    assert p['stages'][s]['calls'] > 0, s
+assert p['dp']['runs'] > 0
+" >> $log 2>&1; then
+    echoerror "Invalid or incomplete profile $prof (see $log for more)"
+    exit 1
+else
+    echook "Profile is valid JSON and has counts for all stages"
+fi
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
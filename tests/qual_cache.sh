@@ -0,0 +1,71 @@
+#!/bin/bash
+
+# Calls made with an alignment quality cache (--qual-cache) have to be
+# identical to calls without, both when the cache gets created and
+# when it's reused. Changing a relevant option must invalidate it.
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+cache=$outdir/qual.lqc
+log=$outdir/log.txt
+
+for run in nocache create reuse; do
+    out=$outdir/raw_${run}.vcf
+    opts="--no-default-filter --src-qual -f $reffa -l $bed -o $out"
+    if [ $run != "nocache" ]; then
+        opts="$opts --qual-cache $cache"
+    fi
+    cmd="$LOFREQ call $opts --verbose $bam"
+    if ! eval $cmd >> $outdir/log_${run}.txt 2>&1; then
+        echoerror "The following command failed (see $outdir/log_${run}.txt for more): $cmd"
+        exit 1
+    fi
+done
+
+if ! grep -q 'Creating alignment quality cache' $outdir/log_create.txt; then
+    echoerror "Cache wasn't created on first use"
+    exit 1
+fi
+if ! grep -q 'Reusing alignment quality cache' $outdir/log_reuse.txt; then
+    echoerror "Cache wasn't reused"
+    exit 1
+fi
+
+for run in create reuse; do
+    if ! diff -q <(grep -v '^#' $outdir/raw_nocache.vcf) <(grep -v '^#' $outdir/raw_${run}.vcf) >/dev/null; then
+        echoerror "Calls with cache ($run) differ from calls without. Check $outdir"
+        exit 1
+    fi
+done
+echook "Calls with and without alignment quality cache are identical"
+
+
+# different BAQ setting must not reuse the cache
+cmd="$LOFREQ call --no-default-filter --no-ext-baq -f $reffa -l $bed -o $outdir/raw_noext.vcf --qual-cache $cache --verbose $bam"
+if ! eval $cmd > $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! grep -q 'Creating alignment quality cache' $log; then
+    echoerror "Cache wasn't invalidated after changing BAQ option"
+    exit 1
+else
+    echook "Cache invalidated after changing BAQ option"
+fi
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
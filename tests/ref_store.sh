@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Calls with a memory-mapped reference store (lofreq faidx --ref-store)
+# must be identical to calls with the plain fasta file
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa_orig=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter -f $reffa_orig -o $outdir/raw_fa.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+# store is built next to the fasta file, so work on a copy
+reffa=$outdir/ref.fa
+cp $reffa_orig $reffa
+cmd="$LOFREQ faidx --ref-store $reffa"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if [ ! -s $reffa.lrs ]; then
+    echoerror "No reference store created for $reffa"
+    exit 1
+fi
+
+for opts in "" "--threads 2"; do
+    out=$outdir/raw_store.vcf
+    cmd="$LOFREQ call --no-default-filter --verbose $opts -f $reffa -o $out $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    if ! diff -q <(grep -v '^#' $outdir/raw_fa.vcf) <(grep -v '^#' $out) >/dev/null; then
+        echoerror "Calls using the reference store ($opts) differ from calls using the fasta file. Check $outdir"
+        exit 1
+    fi
+    rm $out
+done
+if ! grep -q 'Using reference store' $log; then
+    echoerror "Reference store was not used. Check $log"
+    exit 1
+fi
+echook "Calls with and without reference store are identical"
+
+cmd="$LOFREQ checkref $reffa $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "checkref failed with reference store (see $log for more): $cmd"
+    exit 1
+fi
+echook "checkref works with reference store"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# lofreq serve answers to position queries must be identical to the
+# corresponding records of a normal call with the same options
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+# serve doesn't correct for multiple testing by default
+opts="--no-default-filter -b 1"
+
+cmd="$LOFREQ call $opts -f $reffa -o $outdir/call.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+grep -v '^#' $outdir/call.vcf | head -n 50 > $outdir/expected.txt
+if [ ! -s $outdir/expected.txt ]; then
+    echoerror "No calls made. Check $log"
+    exit 1
+fi
+
+# one query per position, plus a comment and an invalid query
+queries=$outdir/queries.txt
+echo "# comment" > $queries
+cut -f 1,2 $outdir/expected.txt | uniq >> $queries
+echo "invalid:query" >> $queries
+num_queries=$(grep -vc '^#' $queries)
+
+cmd="$LOFREQ serve $opts -f $reffa $bam < $queries > $outdir/serve.txt"
+if ! eval $cmd 2>> $log; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+num_answers=$(grep -c '^//$' $outdir/serve.txt)
+if [ $num_answers -ne $num_queries ]; then
+    echoerror "Got $num_answers instead of $num_queries answers. Check $outdir"
+    exit 1
+fi
+if ! diff -q $outdir/expected.txt <(grep -v '^#' $outdir/serve.txt | grep -v '^//$') >/dev/null; then
+    echoerror "Answers of lofreq serve differ from lofreq call records. Check $outdir"
+    exit 1
+fi
+echook "lofreq serve answers are identical to lofreq call records"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# pvalues of several events from one shared Poisson-binomial
+# (snpcaller_shared()) have to be the same as with one snpcaller()
+# call per event. compiles the check in snpcaller.c (see
+# SNPCALLER_SHARED_MAIN)
+
+source lib.sh || exit 1
+
+
+srcdir=../src/lofreq
+htslib=$(sed -n 's/^HTSLIB = //p' $srcdir/Makefile 2>/dev/null)
+if [ -z "$htslib" ]; then
+    echowarn "Couldn't determine htslib location from $srcdir/Makefile. Skipping test"
+    exit 0
+fi
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="gcc -Wall -std=gnu99 -O2 -DSNPCALLER_SHARED_MAIN -I$srcdir/../uthash -I$srcdir/../cdflib90 -I$htslib -o $outdir/snpcaller_shared $srcdir/snpcaller.c $srcdir/fet.c $srcdir/utils.c $srcdir/log.c $srcdir/profile.c -lm -lz"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+for seed in 1 2 3; do
+    cmd="$outdir/snpcaller_shared $seed"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "snpcaller_shared() and snpcaller() differ (see $log for more): $cmd"
+        exit 1
+    fi
+done
+echook "snpcaller_shared() gives the same pvalues as snpcaller()"
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else
+    rm $outdir/*
+    rmdir $outdir
+fi
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# columns are screened out before the exact pvalue is computed if they
+# can't be significant (see errprobs_screen_nonsig()). with -a 1 nothing
+# can be screened out, so calls above the threshold of a stricter run
+# have to be the same. calls at the threshold quality are ignored, since
+# the quality is rounded
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter -a 1 -b 1 -f $reffa -l $bed -o $outdir/all.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --no-default-filter -a 0.001 -b 1 -f $reffa -l $bed -o $outdir/sig.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+# -10*log10(0.001)
+grep -v '^#' $outdir/all.vcf | awk '$6>30' | cut -f 1,2,4,5 > $outdir/all.txt
+grep -v '^#' $outdir/sig.vcf | awk '$6>30' | cut -f 1,2,4,5 > $outdir/sig.txt
+if [ ! -s $outdir/sig.txt ]; then
+    echoerror "No variants called. Check $outdir"
+    exit 1
+fi
+if ! diff -q $outdir/all.txt $outdir/sig.txt >/dev/null; then
+    echoerror "Screening out non-significant columns dropped or added calls. Check $outdir"
+    exit 1
+fi
+echook "Screening out non-significant columns doesn't change calls"
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else
+    rm $outdir/*
+    rmdir $outdir
+fi
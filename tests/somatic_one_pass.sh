@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# compare single pass (lofreq somatic --one-pass) to the multi-stage
+# somatic pipeline. source quality is off in both, since the one-pass
+# mode doesn't know the normal calls in advance
+
+source lib.sh || exit 1
+
+KEEP_TMP=0
+
+BAM_N=./data/somatic_CHH966_chr22/CHH966-normal-100x-100pur-hg19.chr22-bed-only.bam
+BAM_T=./data/somatic_CHH966_chr22//CHH966-tumor-100x-10pur-hg19.chr22-bed-only.bam
+BED=./data/somatic_CHH966_chr22/SeqCap_EZ_Exome_v3_primary_lib_extend_no_overlap_minus300.chr22.bed
+REF=./data/somatic_CHH966_chr22/hg19_chr22.fa
+TRUESNV=./data/somatic_CHH966_chr22/hg19_chr22_true_snv.vcf.gz
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Keeping tmp files in $outdir"
+fi
+
+multiout=$outdir/multi_somatic_final.snvs.vcf.gz
+oneout=$outdir/one_somatic_final.snvs.vcf.gz
+
+cmd="$LOFREQ somatic --no-src-qual -n $BAM_N -t $BAM_T -f $REF -l $BED -o $outdir/multi_"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+cmd="$LOFREQ somatic --one-pass -n $BAM_N -t $BAM_T -f $REF -l $BED -o $outdir/one_"
+if ! eval $cmd; then
+    echoerror "The following command failed: $cmd"
+    exit 1
+fi
+
+n_intersect=$($LOFREQ vcfset -1 $TRUESNV -2 $oneout -a intersect | grep -vc '^#')
+if [ "$n_intersect" -lt 2 ]; then
+    echoerror "Expected at least two true predictions but got $n_intersect (compare $oneout and $TRUESNV)"
+    exit 1
+fi
+
+# both have to give exactly the same somatic SNVs
+zgrep -v '^#' $multiout | cut -f 1,2,4,5 > $outdir/multi.keys
+zgrep -v '^#' $oneout | cut -f 1,2,4,5 > $outdir/one.keys
+if ! diff -q $outdir/multi.keys $outdir/one.keys >/dev/null; then
+    echoerror "One-pass and multi-stage somatic calls differ (see $outdir)"
+    exit 1
+else
+    echook "One-pass and multi-stage somatic calls are identical ($(wc -l < $outdir/one.keys) SNVs)"
+    if [ $KEEP_TMP -ne 1 ]; then
+	    rm -rf $outdir
+    fi
+fi
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Calls made from merged pileup stats of two disjoint read sets
+# (stats-merge) have to be identical to calls made from the BAM file
+# containing all reads
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+log=$outdir/log.txt
+
+# split reads (and their mates) into two sets, like two lanes
+for i in 0 1; do
+    cmd="samtools view -h $bam | awk -v i=$i '/^@/ || ((substr(\$1, length(\$1)) ~ /[02468acegikmoqsuwyACEGIKMOQSUWY]/) == i)' | samtools view -bS - > $outdir/lane$i.bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echowarn "Couldn't split $bam with samtools. Skipping test"
+        exit 0
+    fi
+    cmd="$LOFREQ index $outdir/lane$i.bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    cmd="$LOFREQ call --no-default-filter -f $reffa -l $bed -o $outdir/lane$i.vcf --stats-out $outdir/lane$i.lps --stats-all-cols $outdir/lane$i.bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+done
+
+cmd="$LOFREQ stats-merge -o $outdir/merged.lps $outdir/lane0.lps $outdir/lane1.lps"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+cmd="$LOFREQ call --no-default-filter -f $reffa -l $bed -o $outdir/raw_bam.vcf $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --no-default-filter -o $outdir/raw_stats.vcf --from-stats $outdir/merged.lps"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+# indels at the same position may come out in different order
+if ! diff -q <(grep -v '^#' $outdir/raw_bam.vcf | sort) <(grep -v '^#' $outdir/raw_stats.vcf | sort) >/dev/null; then
+    echoerror "Calls from merged pileup stats differ from calls from BAM. Check $outdir"
+    exit 1
+fi
+echook "Calls from merged pileup stats and BAM are identical"
+
+
+# stats with alt-evidence columns only can't be merged
+cmd="$LOFREQ call --no-default-filter -f $reffa -l $bed -o $outdir/alt_only.vcf --stats-out $outdir/alt_only.lps $outdir/lane0.bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if $LOFREQ stats-merge -o $outdir/merged_alt_only.lps $outdir/alt_only.lps $outdir/lane1.lps >> $log 2>&1; then
+    echoerror "stats-merge accepted stats stored without --stats-all-cols"
+    exit 1
+fi
+echook "stats-merge rejects stats stored without --stats-all-cols"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else
+    rm  $outdir/*
+    rmdir $outdir
+fi
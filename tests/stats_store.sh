@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# Calls made from stored pileup stats (--stats-out, then --from-stats)
+# have to be identical to calls made from the BAM file, also when
+# calling options change in between
+
+source lib.sh || exit 1
+
+
+basedir=data/denv2-pseudoclonal
+bam=$basedir/denv2-pseudoclonal.bam
+reffa=$basedir/denv2-pseudoclonal_cons.fa
+bed=$basedir/denv2-pseudoclonal_incl.bed
+
+KEEP_TMP=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+stats=$outdir/plp.lps
+log=$outdir/log.txt
+
+cmd="$LOFREQ call --no-default-filter --src-qual -f $reffa -l $bed -o $outdir/raw_bam.vcf --stats-out $stats $bam"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+cmd="$LOFREQ call --no-default-filter --src-qual -o $outdir/raw_stats.vcf --from-stats $stats"
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+if ! diff -q <(grep -v '^#' $outdir/raw_bam.vcf) <(grep -v '^#' $outdir/raw_stats.vcf) >/dev/null; then
+    echoerror "Calls from pileup stats differ from calls from BAM. Check $outdir"
+    exit 1
+fi
+echook "Calls from pileup stats and BAM are identical"
+
+
+# calling options still apply
+for opts in "-a 0.05 -q 20" "-Q 25 -b 1000"; do
+    cmd="$LOFREQ call --no-default-filter --src-qual $opts -f $reffa -l $bed -o $outdir/opts_bam.vcf $bam"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    cmd="$LOFREQ call --no-default-filter --src-qual $opts -o $outdir/opts_stats.vcf --from-stats $stats"
+    if ! eval $cmd >> $log 2>&1; then
+        echoerror "The following command failed (see $log for more): $cmd"
+        exit 1
+    fi
+    if ! diff -q <(grep -v '^#' $outdir/opts_bam.vcf) <(grep -v '^#' $outdir/opts_stats.vcf) >/dev/null; then
+        echoerror "Calls with '$opts' from pileup stats differ from calls from BAM. Check $outdir"
+        exit 1
+    fi
+    rm $outdir/opts_bam.vcf $outdir/opts_stats.vcf
+done
+echook "Calls from pileup stats and BAM are identical with changed calling options"
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
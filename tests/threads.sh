@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Make sure multi-threaded calling (--threads) produces the same
+# result as the default single-threaded one
+
+source lib.sh || exit 1
+
+
+
+BAM=data/icgc-tcga-first10kperchrom-syn1/dream-icgc-tcga-first10kperchrom-synthetic.challenge.set1.normal.v2.bam
+# don't bloody gzip your reference even though samtools happily indexes it
+REF=data/icgc-tcga-dream-support/Homo_sapiens_assembly19.fasta
+
+KEEP_TMP=0
+DEBUG=0
+SIMULATE=0
+
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+outraw_threaded=$outdir/raw_threaded.vcf.gz
+outraw_single=$outdir/raw_single.vcf.gz
+log=$outdir/log.txt
+
+cmd="/usr/bin/time -p $LOFREQ call --threads $threads -f $REF -o $outraw_threaded --verbose $BAM"
+test $SIMULATE -eq 1 && cmd="echo $cmd"
+test $DEBUG -eq 1 && echo "DEBUG: cmd=$cmd" 1>&2
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+
+cmd="/usr/bin/time -p $LOFREQ call -f $REF -o $outraw_single --verbose $BAM"
+test $SIMULATE -eq 1 && cmd="echo $cmd"
+test $DEBUG -eq 1 && echo "DEBUG: cmd=$cmd" 1>&2
+if ! eval $cmd >> $log 2>&1; then
+    echoerror "The following command failed (see $log for more): $cmd"
+    exit 1
+fi
+
+
+if [ $SIMULATE -eq 1 ]; then
+    nut=0
+    nus=0
+else
+    nut=$($LOFREQ vcfset -a complement -1 $outraw_threaded -2 $outraw_single --count-only)
+    nus=$($LOFREQ vcfset -a complement -2 $outraw_threaded -1 $outraw_single --count-only)
+fi
+if [ $nut -ne 0 ] || [ $nus -ne 0 ] ; then
+    echoerror "Observed some difference between threaded and single results. Check $outraw_threaded and $outraw_single"
+    exit 1
+else
+    echook "Threaded and single run give identical results."
+fi
+
+# number of tests (i.e. bonferroni factor) has to be identical as well
+nt_threaded=$(grep 'Number of substitution tests' $log | head -n 1 | awk '{print $NF}')
+nt_single=$(grep 'Number of substitution tests' $log | tail -n 1 | awk '{print $NF}')
+if [ "$nt_threaded" != "$nt_single" ]; then
+    echoerror "Number of tests differ between threaded ($nt_threaded) and single ($nt_single) run"
+    exit 1
+else
+    echook "Threaded and single run performed the same number of tests."
+fi
+
+
+
+if [ $KEEP_TMP -eq 1 ]; then
+    echowarn "Not deleting tmp dir $outdir"
+else 
+    rm  $outdir/*
+    rmdir $outdir
+fi
+
@@ -78,3 +78,16 @@ rm $vcf_out
 #echo $vcf_out
 
 
+
+
+# batched (default) and per-variant mode should produce identical output
+vcf_in=data/vcf/CTTGTA_2_remap_razers-i92_peakrem_corr_nodeff.vcf.gz
+bam=data/denv2-dpcr-validated/GGCTAC_2_remap_razers-i92_peakrem_corr.bam
+out_batch=$($LOFREQ uniq -v $vcf_in $bam --output-all -o - | grep -v '^#') || exit 1
+out_pervar=$($LOFREQ uniq -v $vcf_in $bam --output-all --no-batch -o - | grep -v '^#') || exit 1
+if [ "$out_batch" != "$out_pervar" ]; then
+    echoerror "Batched and per-variant uniq output differ"
+    exit 1
+else
+    echook "Batched and per-variant uniq output identical"
+fi
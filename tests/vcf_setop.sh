@@ -109,3 +109,31 @@ else
     echook "intersection with base swapped file return zero variants"    
 fi
 
+
+
+# merge-join (default for sorted input) and index queries should agree
+for action in intersect complement; do
+    for opt in "" "--only-pos" "--only-passed"; do
+        cmd="$LOFREQ vcfset -1 $vcf_t -2 $vcf_n -a $action $opt -o -"
+        md5_merge=$(eval $cmd | grep -v '^#' | $md5)
+        md5_index=$(eval $cmd --no-merge | grep -v '^#' | $md5)
+        if [ "$md5_merge" != "$md5_index" ]; then
+            echoerror "merge-join and index queries differ for $action $opt (cmd = $cmd)"
+        else
+            echook "merge-join and index queries agree for $action $opt"
+        fi
+    done
+done
+
+
+# using the same file twice as vcf2 should give the same as once
+for action in intersect complement; do
+    cmd="$LOFREQ vcfset -1 $vcf_t -2 $vcf_n -a $action -o -"
+    md5_once=$(eval $cmd | grep -v '^#' | $md5)
+    md5_twice=$(eval $cmd -2 $vcf_n | grep -v '^#' | $md5)
+    if [ "$md5_once" != "$md5_twice" ]; then
+        echoerror "n-way $action with duplicated vcf2 differs from 2-way $action"
+    else
+        echook "n-way $action with duplicated vcf2 same as 2-way $action"
+    fi
+done
@@ -17,3 +17,46 @@ if [ $ncorr != "2" ]; then
 else
     echook "All reads correctly realigned"
 fi
+
+
+# multi-threaded output has to be identical (and in the same order)
+md5_1=$($LOFREQ viterbi -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+md5_4=$($LOFREQ viterbi --threads 4 -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+if [ "$md5_1" != "$md5_4" ]; then
+    echoerror "Multi-threaded realignment gave different output"
+    exit 1
+else
+    echook "Multi-threaded realignment gave same output"
+fi
+
+
+# reads without indels are never realigned and have to come out
+# unchanged (tags kept with -k). compared by name and flag, since
+# realigned reads might lose their indels
+BAM=data/denv2-pseudoclonal/denv2-pseudoclonal.bam
+REF=data/denv2-pseudoclonal/denv2-pseudoclonal_cons.fa
+outdir=$(mktemp -d -t $(basename $0).XXXXXX)
+samtools view $BAM | awk '$6 !~ /[ID]/' | sort > $outdir/in.sam || exit 1
+$LOFREQ viterbi -k -f $REF $BAM | samtools view - 2>/dev/null | \
+    awk 'NR==FNR {keep[$1 " " $2]=1; next} ($1 " " $2) in keep' $outdir/in.sam - | sort > $outdir/out.sam || exit 1
+if ! cmp -s $outdir/in.sam $outdir/out.sam; then
+    echoerror "Reads without indels were changed by realignment (see $outdir)"
+    exit 1
+else
+    echook "Reads without indels passed through unchanged"
+fi
+rm -rf $outdir
+
+
+# only a band around the original alignment is computed by default,
+# which has to give the same result as the full matrix
+BAM=data/denv2-pseudoclonal/denv2-pseudoclonal.bam
+REF=data/denv2-pseudoclonal/denv2-pseudoclonal_cons.fa
+md5_band=$($LOFREQ viterbi -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+md5_full=$($LOFREQ viterbi --no-band -f $REF $BAM | samtools view - 2>/dev/null | $md5) || exit 1
+if [ "$md5_band" != "$md5_full" ]; then
+    echoerror "Banded realignment differs from full realignment"
+    exit 1
+else
+    echook "Banded realignment gave same output as full realignment"
+fi